@@ -37,7 +37,11 @@ for i in range(1, len(sys.argv)):
     priority = [line for line in conflines if line.startswith("PRIORITY = ")][0].replace("PRIORITY = ", "")
     environment = [line for line in conflines if line.startswith("ENVIRONMENT = ")][0].replace("ENVIRONMENT = ", "")
 
-    driver_data = {"filename": filename, "priority": DRIVER_CRITICAL, "environment": DRIVER_ENVIRONMENT_ANY}
+    # DEPENDS is optional, it's a space-separated list of driver filenames that must be loaded first
+    depends = [line for line in conflines if line.startswith("DEPENDS = ")]
+    depends = depends[0].replace("\"", "").replace("DEPENDS = ", "").split() if depends else []
+
+    driver_data = {"filename": filename, "priority": DRIVER_CRITICAL, "environment": DRIVER_ENVIRONMENT_ANY, "depends": depends}
 
     # Translate priority to number
     if priority == "CRITICAL":
@@ -62,6 +66,8 @@ for i in range(1, len(sys.argv)):
         driver_data["environment"] = DRIVER_ENVIRONMENT_NORMAL
 
     print(f"-- {filename} will be loaded with priority {priority} and environment {environment}")
+    if depends:
+        print(f"   {filename} depends on: {', '.join(depends)}")
 
     data["drivers"].append(driver_data)
 
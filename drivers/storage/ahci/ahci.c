@@ -0,0 +1,970 @@
+/**
+ * @file drivers/storage/ahci/ahci.c
+ * @brief AHCI (SATA) driver
+ *
+ * Every port gets a 32-slot command list. Drives that support native command queuing are driven
+ * with READ/WRITE FPDMA QUEUED so up to their queue depth of commands can be outstanding at once,
+ * everything else falls back to READ/WRITE DMA EXT (the HBA still queues those, but the drive runs them one by one).
+ *
+ * Slots are claimed lock-free, completions are reaped by whoever gets there first: the IRQ handler
+ * or a waiter polling the port. Start with --ahci-bench to measure random read IOPS at QD1 and at full depth.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "ahci.h"
+
+#include <kernel/loader/driver.h>
+
+#include <kernel/drivers/clock.h>
+#include <kernel/drivers/pci.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/mem/mem.h>
+#include <kernel/misc/args.h>
+#include <kernel/debug.h>
+#include <string.h>
+#include <errno.h>
+
+// Architecture-specific
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/registers.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/registers.h>
+#endif
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "DRIVER:AHCI", __VA_ARGS__)
+
+/* Controllers (for the IRQ handler) */
+static ahci_t *ahci_controllers[AHCI_MAX_CONTROLLERS] = { 0 };
+static int ahci_controller_count = 0;
+
+/* Drive index (sataN) */
+static int ahci_drive_index = 0;
+
+/* Spins between polls of a port while interrupts are delivering completions */
+#define AHCI_POLL_INTERVAL 1000
+
+/* Benchmark parameters */
+#define AHCI_BENCH_IOS      4096    // Reads per run
+#define AHCI_BENCH_SECTORS  8       // 4KB per read
+
+/* PCI match table */
+static pci_match_t ahci_match[] = {
+    PCI_MATCH_CLASS(0x0106, 0x01),  // Mass storage, SATA, AHCI 1.0
+    PCI_MATCH_END
+};
+
+/**
+ * @brief Get the current time in microseconds (0 if the clock isn't ready)
+ */
+static uint64_t ahci_getTime() {
+    if (!clock_isReady()) return 0;
+    return clock_getDevice().get_timer();
+}
+
+/**
+ * @brief Wait for a register to reach a value
+ * @param base The register base
+ * @param reg The register
+ * @param mask The bits to check
+ * @param value The value the masked bits should have
+ * @param timeout Timeout in milliseconds
+ * @returns 0 on success, 1 on timeout
+ */
+static int ahci_waitRegister(uintptr_t base, uint32_t reg, uint32_t mask, uint32_t value, int timeout) {
+    for (int i = 0; i < timeout; i++) {
+        if ((AHCI_READ32(base, reg) & mask) == value) return 0;
+        clock_sleep(1);
+    }
+
+    return ((AHCI_READ32(base, reg) & mask) == value) ? 0 : 1;
+}
+
+/**
+ * @brief Stop a port's command list engine
+ * @param port The port
+ * @returns 0 on success, 1 if the engine did not stop
+ */
+static int ahci_stopPort(ahci_port_t *port) {
+    AHCI_WRITE32(port->regs, AHCI_PxCMD, AHCI_READ32(port->regs, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+    return ahci_waitRegister(port->regs, AHCI_PxCMD, AHCI_PxCMD_CR, 0, AHCI_PORT_TIMEOUT);
+}
+
+/**
+ * @brief Start a port's command list engine (FIS receive must be enabled first)
+ * @param port The port
+ */
+static void ahci_startPort(ahci_port_t *port) {
+    ahci_waitRegister(port->regs, AHCI_PxCMD, AHCI_PxCMD_CR, 0, AHCI_PORT_TIMEOUT);
+    AHCI_WRITE32(port->regs, AHCI_PxCMD, AHCI_READ32(port->regs, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+    AHCI_WRITE32(port->regs, AHCI_PxCMD, AHCI_READ32(port->regs, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+/**
+ * @brief Get a port out of a stuck BSY/DRQ state (the engine must be stopped)
+ *
+ * Uses a command list override if the HBA has one, otherwise a COMRESET.
+ *
+ * @param port The port
+ */
+static void ahci_resetDevice(ahci_port_t *port) {
+    if (!(AHCI_READ32(port->regs, AHCI_PxTFD) & (AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ))) return;
+
+    if (port->hba->cap & AHCI_CAP_SCLO) {
+        AHCI_WRITE32(port->regs, AHCI_PxCMD, AHCI_READ32(port->regs, AHCI_PxCMD) | AHCI_PxCMD_CLO);
+        if (!ahci_waitRegister(port->regs, AHCI_PxCMD, AHCI_PxCMD_CLO, 0, AHCI_PORT_TIMEOUT)) return;
+    }
+
+    // COMRESET (DET has to stay at 1 for at least 1ms)
+    uint32_t sctl = AHCI_READ32(port->regs, AHCI_PxSCTL) & ~0xF;
+    AHCI_WRITE32(port->regs, AHCI_PxSCTL, sctl | AHCI_PxSCTL_DET_INIT);
+    clock_sleep(2);
+    AHCI_WRITE32(port->regs, AHCI_PxSCTL, sctl);
+
+    if (ahci_waitRegister(port->regs, AHCI_PxSSTS, 0xF, AHCI_PxSSTS_DET_PRESENT, AHCI_PORT_TIMEOUT)) {
+        LOG(ERR, "Port %d: device did not come back after COMRESET\n", port->index);
+    }
+
+    AHCI_WRITE32(port->regs, AHCI_PxSERR, 0xFFFFFFFF);
+}
+
+/**
+ * @brief Claim a free command slot
+ * @param port The port
+ * @returns The slot or -EBUSY if every slot is taken
+ */
+static int ahci_allocateSlot(ahci_port_t *port) {
+    uint32_t allocated = __atomic_load_n(&port->allocated, __ATOMIC_RELAXED);
+    for (;;) {
+        uint32_t free = ~allocated & port->slot_mask;
+        if (!free) return -EBUSY;
+
+        int slot = __builtin_ctz(free);
+        if (__atomic_compare_exchange_n(&port->allocated, &allocated, allocated | (1U << slot), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return slot;
+    }
+}
+
+/**
+ * @brief Release a command slot
+ * @param port The port
+ * @param slot The slot
+ */
+static void ahci_freeSlot(ahci_port_t *port, int slot) {
+    __atomic_and_fetch(&port->allocated, ~(1U << slot), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Fill in the PRDT of a command table
+ *
+ * Walks the buffer a page at a time and merges physically contiguous pages into one entry.
+ *
+ * @param port The port
+ * @param table The command table
+ * @param buffer The buffer (word aligned)
+ * @param size The size of the buffer
+ * @returns The amount of entries used or -EINVAL if the buffer can't be described
+ */
+static int ahci_buildPRDT(ahci_port_t *port, ahci_command_table_t *table, uint8_t *buffer, size_t size) {
+    int entries = 0;
+
+    while (size) {
+        if (entries >= AHCI_PRDT_ENTRIES) return -EINVAL;
+
+        // Take the rest of the page, then grow while the next pages are physically contiguous
+        uint32_t length = PAGE_SIZE - ((uintptr_t)buffer & (PAGE_SIZE - 1));
+        if (length > size) length = size;
+        uint64_t phys = mem_getPhysicalAddress(NULL, (uintptr_t)buffer);
+
+        while (length < size) {
+            uint32_t grow = (size - length > PAGE_SIZE) ? PAGE_SIZE : size - length;
+            if (length + grow > AHCI_PRD_MAX_BYTES) break;
+            if (mem_getPhysicalAddress(NULL, (uintptr_t)buffer + length) != phys + length) break;
+            length += grow;
+        }
+
+        if ((phys & 1) || (length & 1)) return -EINVAL;
+        if (!(port->hba->cap & AHCI_CAP_S64A) && phys + length > 0x100000000ULL) return -EINVAL;
+
+        table->prdt[entries].dba = (uint32_t)phys;
+        table->prdt[entries].dbau = (uint32_t)(phys >> 32);
+        table->prdt[entries].reserved = 0;
+        table->prdt[entries].dbc = length - 1;
+        entries++;
+
+        buffer += length;
+        size -= length;
+    }
+
+    return entries;
+}
+
+/**
+ * @brief Issue an ATA command on a claimed slot
+ *
+ * The command runs in the background, use @c ahci_wait to collect it.
+ *
+ * @param port The port
+ * @param slot The slot (from @c ahci_allocateSlot)
+ * @param command The ATA command
+ * @param lba The starting sector
+ * @param count The amount of sectors
+ * @param buffer The data buffer
+ * @param size The size of the data buffer
+ * @returns 0 on success
+ */
+static int ahci_issue(ahci_port_t *port, int slot, uint8_t command, uint64_t lba, uint16_t count, uint8_t *buffer, size_t size) {
+    ahci_command_table_t *table = &port->tables[slot];
+    int prdtl = ahci_buildPRDT(port, table, buffer, size);
+    if (prdtl < 0) return prdtl;
+
+    int queued = (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED);
+    int write = (command == ATA_CMD_WRITE_DMA_EXT || command == ATA_CMD_WRITE_FPDMA_QUEUED);
+
+    fis_reg_h2d_t *fis = (fis_reg_h2d_t*)table->cfis;
+    memset(fis, 0, sizeof(fis_reg_h2d_t));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_COMMAND;
+    fis->command = command;
+    fis->device = (command == ATA_CMD_IDENTIFY) ? 0 : ATA_DEVICE_LBA;
+
+    fis->lba0 = (uint8_t)lba;
+    fis->lba1 = (uint8_t)(lba >> 8);
+    fis->lba2 = (uint8_t)(lba >> 16);
+    fis->lba3 = (uint8_t)(lba >> 24);
+    fis->lba4 = (uint8_t)(lba >> 32);
+    fis->lba5 = (uint8_t)(lba >> 40);
+
+    if (queued) {
+        // The sector count moves to the features register, the count register carries the tag
+        fis->feature_low = count & 0xFF;
+        fis->feature_high = count >> 8;
+        fis->count_low = slot << 3;
+    } else {
+        fis->count_low = count & 0xFF;
+        fis->count_high = count >> 8;
+    }
+
+    uintptr_t table_phys = port->tables_phys[slot];
+    ahci_command_header_t *header = &port->list[slot];
+    header->flags = AHCI_HEADER_CFL(sizeof(fis_reg_h2d_t) / 4) | (write ? AHCI_HEADER_WRITE : 0);
+    header->prdtl = prdtl;
+    header->prdbc = 0;
+    header->ctba = (uint32_t)table_phys;
+    header->ctbau = (uint32_t)((uint64_t)table_phys >> 32);
+
+    __atomic_store_n(&port->status[slot], AHCI_STATUS_PENDING, __ATOMIC_RELAXED);
+
+    // SActive has to be set before the command is issued. The slot only becomes visible to the
+    // completion path once the HBA knows about it, otherwise it would look finished already.
+    spinlock_acquire(&port->lock);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (queued) AHCI_WRITE32(port->regs, AHCI_PxSACT, 1U << slot);
+    AHCI_WRITE32(port->regs, AHCI_PxCI, 1U << slot);
+    __atomic_or_fetch(&port->issued, 1U << slot, __ATOMIC_RELEASE);
+    spinlock_release(&port->lock);
+
+    return 0;
+}
+
+/**
+ * @brief Reap finished commands on a port
+ *
+ * Safe to call from the IRQ handler and from waiters at the same time, only one of them does the work.
+ *
+ * @param port The port
+ */
+static void ahci_processPort(ahci_port_t *port) {
+    uint32_t is = AHCI_READ32(port->regs, AHCI_PxIS);
+    if (is) AHCI_WRITE32(port->regs, AHCI_PxIS, is);
+
+    if (is & AHCI_PxIS_ERROR) {
+        // The engine stopped, a waiter will recover the port
+        __atomic_store_n(&port->error, 1, __ATOMIC_RELEASE);
+    }
+
+    if (__atomic_exchange_n(&port->busy, 1, __ATOMIC_ACQUIRE)) return;
+
+    // A slot is done once the HBA cleared it from both SActive (queued) and CI
+    uint32_t issued = __atomic_load_n(&port->issued, __ATOMIC_ACQUIRE);
+    uint32_t done = issued & ~(AHCI_READ32(port->regs, AHCI_PxSACT) | AHCI_READ32(port->regs, AHCI_PxCI));
+
+    if (done) {
+        __atomic_and_fetch(&port->issued, ~done, __ATOMIC_RELEASE);
+
+        while (done) {
+            int slot = __builtin_ctz(done);
+            done &= done - 1;
+            __atomic_store_n(&port->status[slot], 0, __ATOMIC_RELEASE);
+        }
+    }
+
+    __atomic_store_n(&port->busy, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Recover a port after an error or a timeout
+ *
+ * Commands that finished before the error still succeed, the rest fail with -EIO.
+ *
+ * @param port The port
+ * @param slot The slot of the caller (nothing is done if it was already failed by someone else)
+ */
+static void ahci_recoverPort(ahci_port_t *port, int slot) {
+    spinlock_acquire(&port->lock);
+
+    if (__atomic_load_n(&port->status[slot], __ATOMIC_ACQUIRE) != AHCI_STATUS_PENDING) {
+        spinlock_release(&port->lock);
+        return;
+    }
+
+    while (__atomic_exchange_n(&port->busy, 1, __ATOMIC_ACQUIRE)) asm volatile ("pause" ::: "memory");
+
+    uint32_t sact = AHCI_READ32(port->regs, AHCI_PxSACT);
+    uint32_t ci = AHCI_READ32(port->regs, AHCI_PxCI);
+    LOG(ERR, "Port %d: recovering (TFD 0x%x, SERR 0x%x, SACT 0x%x, CI 0x%x)\n", port->index, AHCI_READ32(port->regs, AHCI_PxTFD), AHCI_READ32(port->regs, AHCI_PxSERR), sact, ci);
+
+    uint32_t issued = __atomic_load_n(&port->issued, __ATOMIC_ACQUIRE);
+    uint32_t done = issued & ~(sact | ci);
+
+    if (ahci_stopPort(port)) LOG(ERR, "Port %d: command list engine did not stop\n", port->index);
+
+    for (int i = 0; i < AHCI_MAX_SLOTS; i++) {
+        if (!(issued & (1U << i))) continue;
+        __atomic_store_n(&port->status[i], (done & (1U << i)) ? 0 : -EIO, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&port->issued, 0, __ATOMIC_RELEASE);
+
+    // Clear the errors and get the drive out of BSY before restarting
+    AHCI_WRITE32(port->regs, AHCI_PxSERR, 0xFFFFFFFF);
+    AHCI_WRITE32(port->regs, AHCI_PxIS, 0xFFFFFFFF);
+    AHCI_WRITE32(port->hba->mmio, AHCI_IS, 1U << port->index);
+    ahci_resetDevice(port);
+    ahci_startPort(port);
+
+    __atomic_store_n(&port->error, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&port->busy, 0, __ATOMIC_RELEASE);
+    spinlock_release(&port->lock);
+}
+
+/**
+ * @brief Wait for a command to finish and release its slot
+ * @param port The port
+ * @param slot The slot
+ * @returns 0 on success, -EIO on failure
+ */
+static int ahci_wait(ahci_port_t *port, int slot) {
+    uint64_t deadline = ahci_getTime() + AHCI_COMMAND_TIMEOUT * 1000;
+    unsigned int spins = 0;
+
+    while (__atomic_load_n(&port->status[slot], __ATOMIC_ACQUIRE) == AHCI_STATUS_PENDING) {
+        if (port->hba->irq < 0 || ++spins >= AHCI_POLL_INTERVAL) {
+            ahci_processPort(port);
+            spins = 0;
+        }
+
+        if (__atomic_load_n(&port->error, __ATOMIC_ACQUIRE)) {
+            ahci_recoverPort(port, slot);
+            continue;
+        }
+
+        if (clock_isReady() && ahci_getTime() > deadline) {
+            LOG(ERR, "Port %d: command in slot %d timed out\n", port->index, slot);
+            ahci_recoverPort(port, slot);
+            continue;
+        }
+
+        asm volatile ("pause" ::: "memory");
+    }
+
+    int status = __atomic_load_n(&port->status[slot], __ATOMIC_ACQUIRE);
+    ahci_freeSlot(port, slot);
+    return status;
+}
+
+/**
+ * @brief Read or write sectors
+ *
+ * The transfer is split into commands of at most AHCI_MAX_SECTORS, which are all put in flight
+ * together (as far as there are free slots).
+ *
+ * @param port The port
+ * @param write 1 to write
+ * @param lba The starting sector
+ * @param count The amount of sectors
+ * @param buffer The buffer
+ * @returns 0 on success
+ */
+static int ahci_access(ahci_port_t *port, int write, uint64_t lba, size_t count, uint8_t *buffer) {
+    if (lba + count > port->sectors) return -EINVAL;
+
+    uint8_t command;
+    if (port->ncq) {
+        command = (write) ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    } else {
+        command = (write) ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    }
+
+    // Slots we have in flight, oldest first
+    int slots[AHCI_MAX_SLOTS];
+    unsigned int head = 0, tail = 0;
+    int ret = 0;
+
+    while (count || head != tail) {
+        if (count && !ret) {
+            int slot = ahci_allocateSlot(port);
+            if (slot >= 0) {
+                uint16_t sectors = (count > AHCI_MAX_SECTORS) ? AHCI_MAX_SECTORS : count;
+                int r = ahci_issue(port, slot, command, lba, sectors, buffer, sectors * AHCI_SECTOR_SIZE);
+                if (r) {
+                    ahci_freeSlot(port, slot);
+                    ret = r;
+                    continue;
+                }
+
+                slots[tail++ % AHCI_MAX_SLOTS] = slot;
+                lba += sectors;
+                count -= sectors;
+                buffer += sectors * AHCI_SECTOR_SIZE;
+                continue;
+            }
+        }
+
+        if (head == tail) {
+            // Someone else has every slot
+            if (ret) break;
+            ahci_processPort(port);
+            asm volatile ("pause" ::: "memory");
+            continue;
+        }
+
+        int r = ahci_wait(port, slots[head++ % AHCI_MAX_SLOTS]);
+        if (r && !ret) ret = r;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief IRQ handler
+ */
+int ahci_irqHandler(uintptr_t exception_index, uintptr_t interrupt_no, registers_t *regs, extended_registers_t *extended) {
+    int handled = IRQ_UNHANDLED;
+
+    for (int i = 0; i < ahci_controller_count; i++) {
+        ahci_t *hba = ahci_controllers[i];
+        if (hba->irq < 0 || interrupt_no < (uintptr_t)hba->irq || interrupt_no >= (uintptr_t)(hba->irq + hba->irq_count)) continue;
+
+        // The line may be shared, and with a single vector every port reports through it
+        uint32_t is = AHCI_READ32(hba->mmio, AHCI_IS);
+        if (hba->irq_per_port) is &= 1U << (interrupt_no - hba->irq);
+        if (!is) continue;
+
+        for (uint32_t pending = is; pending; pending &= pending - 1) {
+            int index = __builtin_ctz(pending);
+            if (hba->ports[index]) {
+                ahci_processPort(hba->ports[index]);
+            } else {
+                AHCI_WRITE32(hba->mmio, AHCI_PORT(index) + AHCI_PxIS, 0xFFFFFFFF);
+            }
+        }
+
+        // Port status first, the HBA bits are set again while a port has anything pending
+        AHCI_WRITE32(hba->mmio, AHCI_IS, is);
+        handled = IRQ_HANDLED;
+    }
+
+    return handled;
+}
+
+/**
+ * @brief Block cache read method for AHCI devices
+ * @param dev The port
+ * @param block The starting sector
+ * @param count The amount of sectors
+ * @param buffer The output buffer
+ */
+static int ahci_readBlocks(void *dev, uint64_t block, size_t count, uint8_t *buffer) {
+    return ahci_access((ahci_port_t*)dev, 0, block, count, buffer);
+}
+
+/**
+ * @brief Block cache write method for AHCI devices
+ * @param dev The port
+ * @param block The starting sector
+ * @param count The amount of sectors
+ * @param buffer The input buffer
+ */
+static int ahci_writeBlocks(void *dev, uint64_t block, size_t count, uint8_t *buffer) {
+    return ahci_access((ahci_port_t*)dev, 1, block, count, buffer);
+}
+
+/**
+ * @brief VFS read method for AHCI devices
+ */
+ssize_t ahci_readFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    ahci_port_t *port = (ahci_port_t*)node->dev;
+    if (!port || !port->cache) return 0;
+
+    return bcache_read(port->cache, offset, size, buffer);
+}
+
+/**
+ * @brief VFS write method for AHCI devices
+ *
+ * Writes go into the block cache and are written back later (see @c bcache_sync)
+ */
+ssize_t ahci_writeFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    ahci_port_t *port = (ahci_port_t*)node->dev;
+    if (!port || !port->cache) return 0;
+
+    return bcache_write(port->cache, offset, size, buffer);
+}
+
+/**
+ * @brief VFS read-ahead method for AHCI devices
+ */
+int ahci_readaheadFS(fs_node_t *node, off_t offset, size_t size) {
+    ahci_port_t *port = (ahci_port_t*)node->dev;
+    if (!port || !port->cache) return -EINVAL;
+
+    bcache_prefetch(port->cache, offset, size);
+    return 0;
+}
+
+/**
+ * @brief Create an AHCI node
+ * @param port The port to create off of
+ */
+fs_node_t *ahci_createNode(ahci_port_t *port) {
+    fs_node_t *out = kmalloc(sizeof(fs_node_t));
+    memset(out, 0, sizeof(fs_node_t));
+
+    snprintf(out->name, 256, "sata%i", ahci_drive_index);
+
+    out->read = ahci_readFS;
+    out->write = ahci_writeFS;
+    out->readahead = ahci_readaheadFS;
+    out->flags = VFS_BLOCKDEVICE;
+    out->mask = 0770;
+    out->length = port->sectors * AHCI_SECTOR_SIZE;
+    out->dev = (void*)port;
+
+    // Register the device with the block cache
+    port->cache = bcache_createDevice(port->model, (void*)port, AHCI_SECTOR_SIZE, port->sectors, ahci_readBlocks, ahci_writeBlocks);
+
+    return out;
+}
+
+/**
+ * @brief Send IDENTIFY DEVICE and pick the command set
+ * @param port The port
+ * @returns 0 on success
+ */
+static int ahci_identify(ahci_port_t *port) {
+    uint16_t *ident = (uint16_t*)mem_allocateDMA(PAGE_SIZE);
+    memset(ident, 0, PAGE_SIZE);
+
+    int slot = ahci_allocateSlot(port);
+    int ret = ahci_issue(port, slot, ATA_CMD_IDENTIFY, 0, 0, (uint8_t*)ident, AHCI_SECTOR_SIZE);
+    if (ret) {
+        ahci_freeSlot(port, slot);
+    } else {
+        ret = ahci_wait(port, slot);
+    }
+
+    if (ret) {
+        LOG(ERR, "Port %d: IDENTIFY DEVICE failed\n", port->index);
+        mem_freeDMA((uintptr_t)ident, PAGE_SIZE);
+        return ret;
+    }
+
+    // Strings are stored with the bytes of every word swapped
+    for (int i = 0; i < 20; i++) {
+        port->model[i * 2] = ident[ATA_IDENT_MODEL + i] >> 8;
+        port->model[i * 2 + 1] = ident[ATA_IDENT_MODEL + i] & 0xFF;
+    }
+
+    port->model[40] = 0;
+    for (int i = 39; i >= 0 && port->model[i] == ' '; i--) port->model[i] = 0;
+
+    if (!(ident[ATA_IDENT_COMMAND_SETS] & ATA_IDENT_COMMAND_SETS_LBA48)) {
+        LOG(WARN, "Port %d: %s does not support 48-bit addressing\n", port->index, port->model);
+        ret = -ENOTSUP;
+    }
+
+    if ((ident[ATA_IDENT_SECTOR_SIZE] & 0xC000) == ATA_IDENT_SECTOR_SIZE_VALID && (ident[ATA_IDENT_SECTOR_SIZE] & ATA_IDENT_SECTOR_SIZE_LARGE)) {
+        LOG(WARN, "Port %d: %s has logical sectors larger than 512 bytes\n", port->index, port->model);
+        ret = -ENOTSUP;
+    }
+
+    port->sectors = (uint64_t)ident[ATA_IDENT_LBA48] | ((uint64_t)ident[ATA_IDENT_LBA48 + 1] << 16) | ((uint64_t)ident[ATA_IDENT_LBA48 + 2] << 32) | ((uint64_t)ident[ATA_IDENT_LBA48 + 3] << 48);
+
+    // NCQ needs both sides, the depth is the smaller of the two
+    if ((port->hba->cap & AHCI_CAP_SNCQ) && (ident[ATA_IDENT_SATA_CAP] & ATA_IDENT_SATA_CAP_NCQ)) {
+        port->ncq = 1;
+        port->depth = (ident[ATA_IDENT_QUEUE_DEPTH] & 0x1F) + 1;
+        if (port->depth > port->hba->slots) port->depth = port->hba->slots;
+    } else {
+        port->ncq = 0;
+        port->depth = port->hba->slots;
+    }
+
+    port->slot_mask = (port->depth >= 32) ? 0xFFFFFFFF : (1U << port->depth) - 1;
+
+    mem_freeDMA((uintptr_t)ident, PAGE_SIZE);
+    return ret;
+}
+
+/**
+ * @brief Initialize a port
+ * @param hba The controller
+ * @param index The port number
+ * @returns The port or NULL if there's no usable drive on it
+ */
+static ahci_port_t *ahci_initPort(ahci_t *hba, int index) {
+    uintptr_t regs = hba->mmio + AHCI_PORT(index);
+
+    // Nothing can be changed while the engines run
+    AHCI_WRITE32(regs, AHCI_PxCMD, AHCI_READ32(regs, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+    if (ahci_waitRegister(regs, AHCI_PxCMD, AHCI_PxCMD_CR, 0, AHCI_PORT_TIMEOUT)) {
+        LOG(ERR, "Port %d: command list engine did not stop\n", index);
+        return NULL;
+    }
+
+    AHCI_WRITE32(regs, AHCI_PxCMD, AHCI_READ32(regs, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+    if (ahci_waitRegister(regs, AHCI_PxCMD, AHCI_PxCMD_FR, 0, AHCI_PORT_TIMEOUT)) {
+        LOG(ERR, "Port %d: FIS receive engine did not stop\n", index);
+        return NULL;
+    }
+
+    if (hba->cap & AHCI_CAP_SSS) {
+        AHCI_WRITE32(regs, AHCI_PxCMD, AHCI_READ32(regs, AHCI_PxCMD) | AHCI_PxCMD_SUD | AHCI_PxCMD_POD);
+    }
+
+    // Give the link a moment to come up
+    ahci_waitRegister(regs, AHCI_PxSSTS, 0xF, AHCI_PxSSTS_DET_PRESENT, 10);
+    uint32_t ssts = AHCI_READ32(regs, AHCI_PxSSTS);
+    if (AHCI_PxSSTS_DET(ssts) != AHCI_PxSSTS_DET_PRESENT || AHCI_PxSSTS_IPM(ssts) != AHCI_PxSSTS_IPM_ACTIVE) return NULL;
+
+    ahci_port_t *port = kmalloc(sizeof(ahci_port_t));
+    memset(port, 0, sizeof(ahci_port_t));
+    port->hba = hba;
+    port->index = index;
+    port->regs = regs;
+
+    // Command list (1KB) and received FIS area (256 bytes) share a page
+    uintptr_t page = mem_allocateDMA(PAGE_SIZE);
+    memset((void*)page, 0, PAGE_SIZE);
+    uint64_t page_phys = mem_getPhysicalAddress(NULL, page);
+    port->list = (ahci_command_header_t*)page;
+    port->fis = (uint8_t*)(page + 0x400);
+
+    size_t tables_size = AHCI_MAX_SLOTS * sizeof(ahci_command_table_t);
+    port->tables = (ahci_command_table_t*)mem_allocateDMA(tables_size);
+    memset(port->tables, 0, tables_size);
+
+    // Every page of the tables has its own frame (a table never crosses a page)
+    uint64_t highest_phys = page_phys + PAGE_SIZE;
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        port->tables_phys[slot] = mem_getPhysicalAddress(NULL, (uintptr_t)&port->tables[slot]);
+        if ((uint64_t)port->tables_phys[slot] + sizeof(ahci_command_table_t) > highest_phys) highest_phys = (uint64_t)port->tables_phys[slot] + sizeof(ahci_command_table_t);
+    }
+
+    if (!(hba->cap & AHCI_CAP_S64A) && highest_phys > 0x100000000ULL) {
+        LOG(ERR, "Port %d: command memory is above 4GB but the HBA only does 32-bit DMA\n", index);
+        goto _fail;
+    }
+
+    AHCI_WRITE32(regs, AHCI_PxCLB, (uint32_t)page_phys);
+    AHCI_WRITE32(regs, AHCI_PxCLBU, (uint32_t)(page_phys >> 32));
+    AHCI_WRITE32(regs, AHCI_PxFB, (uint32_t)(page_phys + 0x400));
+    AHCI_WRITE32(regs, AHCI_PxFBU, (uint32_t)((page_phys + 0x400) >> 32));
+
+    AHCI_WRITE32(regs, AHCI_PxSERR, 0xFFFFFFFF);
+    AHCI_WRITE32(regs, AHCI_PxIS, 0xFFFFFFFF);
+
+    // The signature is valid once the FIS engine has received the first D2H register FIS
+    AHCI_WRITE32(regs, AHCI_PxCMD, AHCI_READ32(regs, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+    if (ahci_waitRegister(regs, AHCI_PxTFD, AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ, 0, AHCI_RESET_TIMEOUT)) {
+        ahci_resetDevice(port);
+    }
+
+    uint32_t sig = AHCI_READ32(regs, AHCI_PxSIG);
+    if (sig != AHCI_SIG_ATA) {
+        LOG(INFO, "Port %d: unsupported device (signature 0x%x)\n", index, sig);
+        goto _fail;
+    }
+
+    port->slot_mask = (hba->slots >= 32) ? 0xFFFFFFFF : (1U << hba->slots) - 1;
+    if (hba->irq >= 0) AHCI_WRITE32(regs, AHCI_PxIE, AHCI_PxIE_DEFAULT);
+    ahci_startPort(port);
+
+    if (ahci_identify(port)) {
+        ahci_stopPort(port);
+        goto _fail;
+    }
+
+    LOG(INFO, "Port %d: %s, %d MB, %s (depth %d)\n", index, port->model, (uint32_t)(port->sectors >> 11), port->ncq ? "NCQ" : "no NCQ", port->depth);
+    return port;
+
+_fail:
+    AHCI_WRITE32(regs, AHCI_PxIE, 0);
+    AHCI_WRITE32(regs, AHCI_PxCMD, AHCI_READ32(regs, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+    ahci_waitRegister(regs, AHCI_PxCMD, AHCI_PxCMD_FR, 0, AHCI_PORT_TIMEOUT);
+    mem_freeDMA((uintptr_t)port->tables, tables_size);
+    mem_freeDMA(page, PAGE_SIZE);
+    kfree(port);
+    return NULL;
+}
+
+/**
+ * @brief Hook up the controller's interrupts
+ *
+ * Prefers one MSI vector per port, then a single MSI vector, then the INTx# line.
+ * Without any of them completions are polled.
+ *
+ * @param hba The controller
+ * @param ports Highest implemented port + 1
+ */
+static void ahci_initInterrupts(ahci_t *hba, int ports) {
+    hba->irq = -1;
+
+    int vectors = pci_allocateIRQs(hba->pci, ports, PCI_IRQ_MSI | PCI_IRQ_MSIX, PCI_CPU_AUTO);
+    if (vectors > 0) {
+        for (int i = 0; i < vectors; i++) {
+            if (hal_registerInterruptHandler(pci_getIRQ(hba->pci, i), ahci_irqHandler)) {
+                while (i--) hal_removeInterruptHandler(pci_getIRQ(hba->pci, i), ahci_irqHandler);
+                pci_freeIRQs(hba->pci);
+                vectors = 0;
+                break;
+            }
+        }
+    }
+
+    if (vectors > 0) {
+        hba->irq = pci_getIRQ(hba->pci, 0);
+        hba->irq_count = vectors;
+
+        // The port to vector mapping is only defined for MSI, and the HBA gives up on it if it got fewer vectors than ports
+        hba->irq_per_port = (hba->pci->irq_mode == PCI_IRQ_MSI && vectors >= ports && !(AHCI_READ32(hba->mmio, AHCI_GHC) & AHCI_GHC_MRSM));
+        LOG(DEBUG, "Using %d %s vector(s) starting at IRQ%d%s\n", vectors, (hba->pci->irq_mode == PCI_IRQ_MSIX) ? "MSI-X" : "MSI", hba->irq, hba->irq_per_port ? ", one per port" : "");
+        return;
+    }
+
+    int line = pci_getLineIRQ(hba->pci->bus, hba->pci->slot, hba->pci->function);
+    if (line >= 0 && !hal_registerInterruptHandler(line, ahci_irqHandler)) {
+        hba->irq = line;
+        hba->irq_count = 1;
+        LOG(DEBUG, "Using IRQ%i\n", line);
+    } else {
+        LOG(WARN, "Could not route INTx# (%i) - completions will be polled\n", line);
+    }
+}
+
+/**
+ * @brief Initialize a controller
+ * @param dev The PCI device
+ */
+static void ahci_initController(pci_device_t *dev) {
+    if (ahci_controller_count >= AHCI_MAX_CONTROLLERS) {
+        LOG(WARN, "Ignoring controller at %02x:%02x.%x (too many controllers)\n", dev->bus, dev->slot, dev->function);
+        return;
+    }
+
+    // ABAR is BAR5
+    pci_bar_t *bar = pci_readBAR(dev->bus, dev->slot, dev->function, 5);
+    if (!bar) {
+        LOG(ERR, "AHCI controller does not have BAR5 - IDE mode?\n");
+        return;
+    }
+
+    if (bar->type != PCI_BAR_MEMORY32 && bar->type != PCI_BAR_MEMORY64) {
+        LOG(ERR, "AHCI controller BAR5 is not memory space - bug in PCI driver?\n");
+        kfree(bar);
+        return;
+    }
+
+    // Enable memory space and bus mastering
+    uint32_t command = pci_readConfigOffset(dev->bus, dev->slot, dev->function, PCI_COMMAND_OFFSET, 2);
+    pci_writeConfigOffset(dev->bus, dev->slot, dev->function, PCI_COMMAND_OFFSET, (command | PCI_COMMAND_MEMORY_SPACE | PCI_COMMAND_BUS_MASTER) & ~PCI_COMMAND_INTERRUPT_DISABLE);
+
+    ahci_t *hba = kmalloc(sizeof(ahci_t));
+    memset(hba, 0, sizeof(ahci_t));
+    hba->pci = dev;
+
+    uintptr_t offset = (uintptr_t)bar->address & (PAGE_SIZE - 1);
+    uintptr_t size = (offset + bar->size + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    hba->mmio = mem_mapMMIO((uintptr_t)bar->address - offset, size) + offset;
+    kfree(bar);
+
+    // Take the controller from the firmware
+    if (AHCI_READ32(hba->mmio, AHCI_CAP2) & AHCI_CAP2_BOH) {
+        AHCI_WRITE32(hba->mmio, AHCI_BOHC, AHCI_READ32(hba->mmio, AHCI_BOHC) | AHCI_BOHC_OOS);
+        ahci_waitRegister(hba->mmio, AHCI_BOHC, AHCI_BOHC_BOS, 0, 25);
+        if (AHCI_READ32(hba->mmio, AHCI_BOHC) & AHCI_BOHC_BB) ahci_waitRegister(hba->mmio, AHCI_BOHC, AHCI_BOHC_BB, 0, 2000);
+    }
+
+    // Reset it (AE has to be set before anything else in GHC is touched)
+    AHCI_WRITE32(hba->mmio, AHCI_GHC, AHCI_READ32(hba->mmio, AHCI_GHC) | AHCI_GHC_AE);
+    AHCI_WRITE32(hba->mmio, AHCI_GHC, AHCI_READ32(hba->mmio, AHCI_GHC) | AHCI_GHC_HR);
+    if (ahci_waitRegister(hba->mmio, AHCI_GHC, AHCI_GHC_HR, 0, AHCI_RESET_TIMEOUT)) {
+        LOG(ERR, "Controller did not finish resetting\n");
+        kfree(hba);
+        return;
+    }
+
+    AHCI_WRITE32(hba->mmio, AHCI_GHC, AHCI_READ32(hba->mmio, AHCI_GHC) | AHCI_GHC_AE);
+
+    hba->cap = AHCI_READ32(hba->mmio, AHCI_CAP);
+    hba->slots = AHCI_CAP_NCS(hba->cap);
+    uint32_t pi = AHCI_READ32(hba->mmio, AHCI_PI);
+    uint32_t vs = AHCI_READ32(hba->mmio, AHCI_VS);
+
+    LOG(INFO, "AHCI %d.%d controller at %02x:%02x.%x: %d ports (implemented 0x%x), %d slots%s%s\n", vs >> 16, (vs >> 8) & 0xFF, dev->bus, dev->slot, dev->function, AHCI_CAP_NP(hba->cap), pi, hba->slots, (hba->cap & AHCI_CAP_SNCQ) ? ", NCQ" : "", (hba->cap & AHCI_CAP_S64A) ? ", 64-bit" : "");
+    if (!pi) {
+        kfree(hba);
+        return;
+    }
+
+    ahci_controllers[ahci_controller_count++] = hba;
+    ahci_initInterrupts(hba, 32 - __builtin_clz(pi));
+
+    // Clear anything left over from the reset before interrupts go live
+    AHCI_WRITE32(hba->mmio, AHCI_IS, 0xFFFFFFFF);
+    if (hba->irq >= 0) AHCI_WRITE32(hba->mmio, AHCI_GHC, AHCI_READ32(hba->mmio, AHCI_GHC) | AHCI_GHC_IE);
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (!(pi & (1U << i))) continue;
+
+        ahci_port_t *port = ahci_initPort(hba, i);
+        if (!port) continue;
+        hba->ports[i] = port;
+
+        // Create a VFS node for it
+        fs_node_t *node = ahci_createNode(port);
+
+        // Mount the node
+        char devname[64];
+        snprintf(devname, 64, "/device/%s", node->name);
+        vfs_mount(node, devname);
+        ahci_drive_index++;
+    }
+}
+
+/**
+ * @brief Run random 4KB reads against a port and log the IOPS
+ * @param port The port
+ * @param depth The amount of reads kept in flight
+ */
+static void ahci_benchmark(ahci_port_t *port, int depth) {
+    uint64_t blocks = port->sectors / AHCI_BENCH_SECTORS;
+    if (!clock_isReady() || !blocks) return;
+    if (blocks > 0xFFFFFFFF) blocks = 0xFFFFFFFF;
+
+    uint8_t command = (port->ncq) ? ATA_CMD_READ_FPDMA_QUEUED : ATA_CMD_READ_DMA_EXT;
+    uint8_t *buffers = (uint8_t*)mem_allocateDMA(depth * PAGE_SIZE);
+
+    int slots[AHCI_MAX_SLOTS];
+    unsigned int head = 0, tail = 0;
+    int submitted = 0, errors = 0;
+    uint32_t seed = 0x9E3779B9 ^ port->index;
+
+    uint64_t start = ahci_getTime();
+
+    while (submitted < AHCI_BENCH_IOS || head != tail) {
+        if (submitted < AHCI_BENCH_IOS && (int)(tail - head) < depth) {
+            int slot = ahci_allocateSlot(port);
+            if (slot >= 0) {
+                // xorshift32
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+
+                uint64_t lba = (uint64_t)(seed % (uint32_t)blocks) * AHCI_BENCH_SECTORS;
+                if (ahci_issue(port, slot, command, lba, AHCI_BENCH_SECTORS, buffers + (tail % depth) * PAGE_SIZE, AHCI_BENCH_SECTORS * AHCI_SECTOR_SIZE)) {
+                    ahci_freeSlot(port, slot);
+                    errors++;
+                    break;
+                }
+
+                slots[tail++ % AHCI_MAX_SLOTS] = slot;
+                submitted++;
+                continue;
+            }
+        }
+
+        if (head == tail) {
+            asm volatile ("pause" ::: "memory");
+            continue;
+        }
+
+        if (ahci_wait(port, slots[head++ % AHCI_MAX_SLOTS])) errors++;
+    }
+
+    // Drain whatever is still in flight after an issue failure
+    while (head != tail) ahci_wait(port, slots[head++ % AHCI_MAX_SLOTS]);
+
+    uint32_t elapsed = (uint32_t)(ahci_getTime() - start);
+    uint32_t elapsed_ms = (elapsed / 1000) ? (elapsed / 1000) : 1;
+    uint32_t iops = (uint32_t)submitted * 1000 / elapsed_ms;
+
+    LOG(INFO, "Port %d: %d random 4KB reads at QD%d in %d ms: %d IOPS, %d us average latency, %d errors\n", port->index, submitted, depth, elapsed_ms, iops, submitted ? elapsed * depth / submitted : 0, errors);
+    mem_freeDMA((uintptr_t)buffers, depth * PAGE_SIZE);
+}
+
+/**
+ * @brief AHCI controller probe method
+ */
+int ahci_find(pci_device_t *dev, void *data) {
+    ahci_initController(dev);
+    return 0; // Keep going, there may be more controllers
+}
+
+/**
+ * @brief AHCI initialize method
+ */
+int ahci_init(int argc, char **argv) {
+    pci_probe(ahci_match, ahci_find, NULL);
+
+    if (!ahci_controller_count) {
+        LOG(INFO, "No AHCI controller found\n");
+        return 0;
+    }
+
+    if (kargs_has("--ahci-bench")) {
+        for (int i = 0; i < ahci_controller_count; i++) {
+            for (int j = 0; j < AHCI_MAX_PORTS; j++) {
+                ahci_port_t *port = ahci_controllers[i]->ports[j];
+                if (!port) continue;
+
+                ahci_benchmark(port, 1);
+                if (port->depth > 1) ahci_benchmark(port, port->depth);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief AHCI deinitialize method
+ */
+int ahci_deinit() {
+    return 0;
+}
+
+
+/* Metadata */
+struct driver_metadata driver_metadata = {
+    .name = "AHCI driver",
+    .author = "Samuel Stuart",
+    .init = ahci_init,
+    .deinit = ahci_deinit
+};
@@ -0,0 +1,293 @@
+/**
+ * @file drivers/storage/ahci/ahci.h
+ * @brief AHCI (SATA) header file
+ *
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef AHCI_H
+#define AHCI_H
+
+/**** INCLUDES ****/
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/fs/bcache.h>
+#include <kernel/drivers/pci.h>
+#include <kernel/misc/spinlock.h>
+
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/hal.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/hal.h>
+#else
+#error "Please define port I/O functions for AHCI driver"
+#endif
+
+/**** DEFINITIONS ****/
+
+/* Generic host control registers */
+
+#define AHCI_CAP                        0x00    // Host capabilities
+#define AHCI_GHC                        0x04    // Global host control
+#define AHCI_IS                         0x08    // Interrupt status (one bit per port)
+#define AHCI_PI                         0x0C    // Ports implemented
+#define AHCI_VS                         0x10    // Version
+#define AHCI_CAP2                       0x24    // Host capabilities extended
+#define AHCI_BOHC                       0x28    // BIOS/OS handoff control and status
+
+#define AHCI_CAP_NP(c)                  (((c) & 0x1F) + 1)          // Number of ports
+#define AHCI_CAP_NCS(c)                 ((((c) >> 8) & 0x1F) + 1)   // Number of command slots
+#define AHCI_CAP_SCLO                   (1 << 24)   // Supports command list override
+#define AHCI_CAP_SSS                    (1 << 27)   // Supports staggered spin-up
+#define AHCI_CAP_SNCQ                   (1 << 30)   // Supports native command queuing
+#define AHCI_CAP_S64A                   (1U << 31)  // Supports 64-bit addressing
+
+#define AHCI_GHC_HR                     (1 << 0)    // HBA reset
+#define AHCI_GHC_IE                     (1 << 1)    // Interrupt enable
+#define AHCI_GHC_MRSM                   (1 << 2)    // MSI revert to single message
+#define AHCI_GHC_AE                     (1U << 31)  // AHCI enable
+
+#define AHCI_CAP2_BOH                   (1 << 0)    // BIOS/OS handoff supported
+
+#define AHCI_BOHC_BOS                   (1 << 0)    // BIOS owned semaphore
+#define AHCI_BOHC_OOS                   (1 << 1)    // OS owned semaphore
+#define AHCI_BOHC_BB                    (1 << 4)    // BIOS busy
+
+/* Port registers */
+
+#define AHCI_PORT(n)                    (0x100 + (n) * 0x80)
+
+#define AHCI_PxCLB                      0x00    // Command list base address
+#define AHCI_PxCLBU                     0x04    // Command list base address (upper 32 bits)
+#define AHCI_PxFB                       0x08    // FIS base address
+#define AHCI_PxFBU                      0x0C    // FIS base address (upper 32 bits)
+#define AHCI_PxIS                       0x10    // Interrupt status
+#define AHCI_PxIE                       0x14    // Interrupt enable
+#define AHCI_PxCMD                      0x18    // Command and status
+#define AHCI_PxTFD                      0x20    // Task file data
+#define AHCI_PxSIG                      0x24    // Signature
+#define AHCI_PxSSTS                     0x28    // SATA status (SCR0: SStatus)
+#define AHCI_PxSCTL                     0x2C    // SATA control (SCR2: SControl)
+#define AHCI_PxSERR                     0x30    // SATA error (SCR1: SError)
+#define AHCI_PxSACT                     0x34    // SATA active (SCR3: SActive)
+#define AHCI_PxCI                       0x38    // Command issue
+
+#define AHCI_PxCMD_ST                   (1 << 0)    // Start
+#define AHCI_PxCMD_SUD                  (1 << 1)    // Spin-up device
+#define AHCI_PxCMD_POD                  (1 << 2)    // Power on device
+#define AHCI_PxCMD_CLO                  (1 << 3)    // Command list override
+#define AHCI_PxCMD_FRE                  (1 << 4)    // FIS receive enable
+#define AHCI_PxCMD_FR                   (1 << 14)   // FIS receive running
+#define AHCI_PxCMD_CR                   (1 << 15)   // Command list running
+
+#define AHCI_PxIS_DHRS                  (1 << 0)    // Device to host register FIS
+#define AHCI_PxIS_PSS                   (1 << 1)    // PIO setup FIS
+#define AHCI_PxIS_DSS                   (1 << 2)    // DMA setup FIS
+#define AHCI_PxIS_SDBS                  (1 << 3)    // Set device bits FIS (NCQ completions)
+#define AHCI_PxIS_DPS                   (1 << 5)    // Descriptor processed
+#define AHCI_PxIS_IFS                   (1 << 27)   // Interface fatal error
+#define AHCI_PxIS_HBDS                  (1 << 28)   // Host bus data error
+#define AHCI_PxIS_HBFS                  (1 << 29)   // Host bus fatal error
+#define AHCI_PxIS_TFES                  (1 << 30)   // Task file error
+
+#define AHCI_PxIS_ERROR                 (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+#define AHCI_PxIE_DEFAULT               (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS | AHCI_PxIS_DPS | AHCI_PxIS_ERROR)
+
+#define AHCI_PxTFD_ERR                  (1 << 0)    // Error
+#define AHCI_PxTFD_DRQ                  (1 << 3)    // Data transfer requested
+#define AHCI_PxTFD_BSY                  (1 << 7)    // Busy
+
+#define AHCI_PxSSTS_DET(s)              ((s) & 0xF)         // Device detection (3 = present, PHY up)
+#define AHCI_PxSSTS_IPM(s)              (((s) >> 8) & 0xF)  // Interface power management (1 = active)
+#define AHCI_PxSSTS_DET_PRESENT         3
+#define AHCI_PxSSTS_IPM_ACTIVE          1
+
+#define AHCI_PxSCTL_DET_INIT            1       // Perform COMRESET
+
+/* Port signatures */
+
+#define AHCI_SIG_ATA                    0x00000101
+#define AHCI_SIG_ATAPI                  0xEB140101
+#define AHCI_SIG_SEMB                   0xC33C0101
+#define AHCI_SIG_PM                     0x96690101
+
+/* FIS types */
+
+#define FIS_TYPE_REG_H2D                0x27    // Register FIS - host to device
+#define FIS_TYPE_REG_D2H                0x34    // Register FIS - device to host
+#define FIS_TYPE_SDB                    0xA1    // Set device bits FIS
+
+#define FIS_H2D_COMMAND                 0x80    // Command (not device control) update
+
+/* ATA commands */
+
+#define ATA_CMD_READ_DMA_EXT            0x25
+#define ATA_CMD_WRITE_DMA_EXT           0x35
+#define ATA_CMD_READ_FPDMA_QUEUED       0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED      0x61
+#define ATA_CMD_IDENTIFY                0xEC
+
+#define ATA_DEVICE_LBA                  0x40    // LBA addressing (bit 6 of the device register)
+
+/* IDENTIFY DEVICE words */
+
+#define ATA_IDENT_MODEL                 27      // Model number (40 characters)
+#define ATA_IDENT_LBA28                 60      // Total addressable sectors (28-bit)
+#define ATA_IDENT_QUEUE_DEPTH           75      // Maximum queue depth - 1 (bits 0-4)
+#define ATA_IDENT_SATA_CAP              76      // SATA capabilities (bit 8 = NCQ)
+#define ATA_IDENT_COMMAND_SETS          83      // Command sets supported (bit 10 = LBA48)
+#define ATA_IDENT_LBA48                 100     // Total addressable sectors (48-bit)
+#define ATA_IDENT_SECTOR_SIZE           106     // Physical/logical sector size
+
+#define ATA_IDENT_SATA_CAP_NCQ          (1 << 8)
+#define ATA_IDENT_COMMAND_SETS_LBA48    (1 << 10)
+#define ATA_IDENT_SECTOR_SIZE_VALID     0x4000  // Bits 14-15 must be 01
+#define ATA_IDENT_SECTOR_SIZE_LARGE     (1 << 12)   // Logical sectors are bigger than 512 bytes
+
+/* Driver limits */
+
+#define AHCI_MAX_CONTROLLERS            4
+#define AHCI_MAX_PORTS                  32
+#define AHCI_MAX_SLOTS                  32
+#define AHCI_SECTOR_SIZE                512
+#define AHCI_PRDT_ENTRIES               24                      // Enough for an unaligned AHCI_MAX_SECTORS transfer
+#define AHCI_MAX_SECTORS                128                     // Sectors per command (64KB)
+#define AHCI_PRD_MAX_BYTES              0x400000                // 4MB per PRDT entry
+
+/* Timeouts (in milliseconds) */
+
+#define AHCI_RESET_TIMEOUT              1000
+#define AHCI_PORT_TIMEOUT               500
+#define AHCI_COMMAND_TIMEOUT            5000
+
+/* Slot status while the command is outstanding */
+
+#define AHCI_STATUS_PENDING             1
+
+/**** TYPES ****/
+
+/**
+ * @brief Command header (one per slot in the command list)
+ */
+typedef struct ahci_command_header {
+    uint16_t flags;                     // CFL (0-4), A (5), W (6), P (7), R (8), B (9), C (10), PMP (12-15)
+    uint16_t prdtl;                     // PRDT length (entries)
+    volatile uint32_t prdbc;            // PRD byte count (transferred)
+    uint32_t ctba;                      // Command table base address (128-byte aligned)
+    uint32_t ctbau;                     // Command table base address (upper 32 bits)
+    uint32_t reserved[4];
+} __attribute__((packed)) ahci_command_header_t;
+
+#define AHCI_HEADER_CFL(dwords)         ((dwords) & 0x1F)
+#define AHCI_HEADER_WRITE               (1 << 6)
+
+/**
+ * @brief Physical region descriptor
+ */
+typedef struct ahci_prd {
+    uint32_t dba;                       // Data base address (word aligned)
+    uint32_t dbau;                      // Data base address (upper 32 bits)
+    uint32_t reserved;
+    uint32_t dbc;                       // Byte count - 1 (0-21), interrupt on completion (31)
+} __attribute__((packed)) ahci_prd_t;
+
+/**
+ * @brief Command table
+ */
+typedef struct ahci_command_table {
+    uint8_t cfis[64];                   // Command FIS
+    uint8_t acmd[16];                   // ATAPI command
+    uint8_t reserved[48];
+    ahci_prd_t prdt[AHCI_PRDT_ENTRIES]; // Scatter-gather list
+} __attribute__((packed)) ahci_command_table_t;
+
+/**
+ * @brief Register FIS - host to device
+ */
+typedef struct fis_reg_h2d {
+    uint8_t type;                       // FIS_TYPE_REG_H2D
+    uint8_t flags;                      // Port multiplier (0-3), command (7)
+    uint8_t command;                    // Command register
+    uint8_t feature_low;                // Features (0-7)
+
+    uint8_t lba0;                       // LBA (0-7)
+    uint8_t lba1;                       // LBA (8-15)
+    uint8_t lba2;                       // LBA (16-23)
+    uint8_t device;                     // Device register
+
+    uint8_t lba3;                       // LBA (24-31)
+    uint8_t lba4;                       // LBA (32-39)
+    uint8_t lba5;                       // LBA (40-47)
+    uint8_t feature_high;               // Features (8-15)
+
+    uint8_t count_low;                  // Count (0-7), NCQ tag in bits 3-7
+    uint8_t count_high;                 // Count (8-15)
+    uint8_t icc;                        // Isochronous command completion
+    uint8_t control;                    // Device control
+
+    uint8_t reserved[4];
+} __attribute__((packed)) fis_reg_h2d_t;
+
+struct ahci;
+
+/**
+ * @brief AHCI port (one SATA device)
+ */
+typedef struct ahci_port {
+    struct ahci *hba;                   // Controller
+    int index;                          // Port number
+    uintptr_t regs;                     // Port registers
+
+    ahci_command_header_t *list;        // Command list (32 headers)
+    uint8_t *fis;                       // Received FIS area
+    ahci_command_table_t *tables;       // Command tables (one per slot)
+    uintptr_t tables_phys[AHCI_MAX_SLOTS];  // Physical address of each command table
+
+    // Slots
+    uint32_t slot_mask;                 // Usable slots (limited by the controller and the queue depth)
+    uint32_t allocated;                 // Slots owned by a caller
+    uint32_t issued;                    // Slots handed to the HBA that haven't completed
+    int status[AHCI_MAX_SLOTS];         // Per-slot result (AHCI_STATUS_PENDING, 0 or -EIO)
+    int busy;                           // Set while someone is processing completions
+    int error;                          // Set when the port stopped on an error
+    spinlock_t lock;                    // Serializes issuing with error recovery
+
+    // Device
+    int ncq;                            // Use READ/WRITE FPDMA QUEUED
+    int depth;                          // Commands in flight
+    uint64_t sectors;                   // Size in sectors
+    char model[41];                     // Model number
+    bcache_device_t *cache;             // Block cache
+} ahci_port_t;
+
+/**
+ * @brief AHCI controller
+ */
+typedef struct ahci {
+    pci_device_t *pci;                  // PCI device
+    uintptr_t mmio;                     // ABAR
+    uint32_t cap;                       // Capabilities
+    int slots;                          // Command slots per port
+
+    // Interrupts
+    int irq;                            // First IRQ (-1 when polled)
+    int irq_count;                      // Amount of IRQs
+    int irq_per_port;                   // Every port has its own vector
+
+    ahci_port_t *ports[AHCI_MAX_PORTS]; // Ports with a usable device
+} ahci_t;
+
+/**** MACROS ****/
+
+#define AHCI_READ32(base, reg)          (*(volatile uint32_t*)((base) + (reg)))
+#define AHCI_WRITE32(base, reg, val)    (*(volatile uint32_t*)((base) + (reg)) = (uint32_t)(val))
+
+#endif
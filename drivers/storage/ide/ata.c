@@ -22,6 +22,7 @@
 #include <kernel/mem/alloc.h>
 #include <kernel/misc/spinlock.h>
 #include <string.h>
+#include <errno.h>
 
 // Architecture-specific
 #if defined(__ARCH_I386__)
@@ -65,21 +66,27 @@ int drive_index = 0;
 int cd_index = 0;
 
 
+/* PCI match table */
+static pci_match_t ata_match[] = {
+    PCI_MATCH_CLASS(ATA_PCI_TYPE, PCI_ANY),
+    PCI_MATCH_END
+};
+
 /**
- * @brief Find method for the ATA PCI controller
+ * @brief Probe method for the ATA PCI controller
  * 
  * @warning This goes based off of subclass/class ID 
  */
-int ata_find(uint8_t bus, uint8_t slot, uint8_t function, uint16_t vendor_id, uint16_t device_id, void *data) {
+int ata_find(pci_device_t *dev, void *data) {
     if (ide_pci != 0xFFFFFFFF) {
-        LOG(WARN, "Additional IDE controller detected: 0x%x 0x%x at bus %i slot %i function %i\n", vendor_id, device_id, bus, slot, function);
+        LOG(WARN, "Additional IDE controller detected: 0x%x 0x%x at bus %i slot %i function %i\n", dev->vendor_id, dev->device_id, dev->bus, dev->slot, dev->function);
         LOG(WARN, "This IDE driver does not support multiple controllers.\n");
         return 0;
     }
 
-    LOG(DEBUG, "IDE controller - vendor 0x%x device 0x%x\n", vendor_id, device_id);
+    LOG(DEBUG, "IDE controller - vendor 0x%x device 0x%x\n", dev->vendor_id, dev->device_id);
 
-    ide_pci = PCI_ADDR(bus, slot, function, 0); // Bus/slot/function can be extracted using other macros
+    ide_pci = PCI_ADDR(dev->bus, dev->slot, dev->function, 0); // Bus/slot/function can be extracted using other macros
 
     return 0; // Temporary while I work some kinks, see ata_initialize
 }
@@ -455,131 +462,78 @@ int atapi_access(ide_device_t *device, int operation, uint64_t lba, size_t secto
 
 
 /**
- * @brief VFS read method for IDE device
- * @warning !!! THIS MATH IS HORRIBLE DO NOT READ !!!
+ * @brief Block cache read method for IDE devices
+ * @param dev The IDE device
+ * @param block The first block (sector) to read
+ * @param count The amount of blocks to read
+ * @param buffer The output buffer
  */
-ssize_t ide_readFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-    // Make sure offset and buffer are good
-    if ((uint64_t)offset >= node->length || !buffer) {
-        return 0;
-    }
-    
-    // Make sure offset + size is good
-    if (offset + size > node->length) {
-        size = node->length - offset;
-    }
+static int ide_readBlocks(void *dev, uint64_t block, size_t count, uint8_t *buffer) {
+    ide_device_t *device = (ide_device_t*)dev;
 
-    // Get device
-    ide_device_t *device = (ide_device_t*)node->dev;
-    if (!device) return 0;
-
-    // Create an LBA, rounded size, and offset
-    // For an offset of 0x5794, the offset would become 0x5600, and the buffer_offset would become 0x194
-    // For a size of 0x34F (which is added to buffer_offset before rounding), it would become 0x400/0x600 (depending on buffer_offset) 
-    
-    uint64_t lba, buffer_offset;
-    size_t size_rounded;
-    
     if (device->atapi) {
-        // ATAPI devices have different block sizes
-        uint64_t blocksize = device->atapi_block_size;
-
-        lba = (offset - (offset % blocksize)) / blocksize;
-        buffer_offset = offset - (lba % blocksize);
-        size_rounded = (((size + buffer_offset) + blocksize) - (((size+buffer_offset)+blocksize) % blocksize));
+        return atapi_access(device, ATA_READ, block, count, buffer);
     } else {
-        // ATA devices are fixed with a 512-byte sector size
-        lba = (offset - (offset % 512)) / 512;
-        buffer_offset = offset - (lba * 512);
-        size_rounded = (((size+buffer_offset) + 512) - (((size+buffer_offset) + 512) % 512));
+        return ata_access(device, ATA_READ, block, count, buffer);
     }
-
-    // Create a temporary buffer that rounds up size to the nearest 512 multiple
-    // !!!: DMA accesses would make this much better
-    uint8_t *tmpbuffer = kmalloc(size_rounded);
-    memset(tmpbuffer, 0, size_rounded);
-
-    if (device->atapi) {
-        // Read in the buffer
-        atapi_access(device, ATA_READ, lba, size_rounded / device->atapi_block_size, tmpbuffer);
-    } else {
-        // Read in the buffer
-        ata_access(device, ATA_READ, lba, size_rounded / 512, tmpbuffer);
-    }
-
-    // Now copy the buffer with offset
-    memcpy(buffer, tmpbuffer + buffer_offset, size);
-    kfree(tmpbuffer);
-    return size;
 }
 
 /**
- * @brief VFS write method for IDE device
- * @warning !!! THIS MATH IS HORRIBLE DO NOT READ !!!
+ * @brief Block cache write method for IDE devices
+ * @param dev The IDE device
+ * @param block The first block (sector) to write
+ * @param count The amount of blocks to write
+ * @param buffer The input buffer
  */
-ssize_t ide_writeFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-    // Make sure offset and buffer are good
-    if ((uint64_t)offset >= node->length || !buffer) {
-        return 0;
-    }
-    
-    // Make sure offset + size is good
-    if (offset + size > node->length) {
-        size = node->length - offset;
-    }
-
-    // Create an LBA and rounded size
-    uint64_t lba = (offset - (offset % 512)) / 512;
-    size_t size_rounded = ((size + 512) - ((size + 512) % 512));
-
-    // Get device
-    ide_device_t *device = (ide_device_t*)node->dev;
-    if (!device) return 0;
+static int ide_writeBlocks(void *dev, uint64_t block, size_t count, uint8_t *buffer) {
+    ide_device_t *device = (ide_device_t*)dev;
 
     // TODO: ATAPI writes
     if (device->atapi) {
         LOG(ERR, "ATAPI writes not supported\n");
-        return 0;
+        return IDE_ERROR;
     }
 
-    // !!!: We have to read in a sector at the end of offset + size rounded to prevent the driver from overwriting existing bytes
-    // !!!: There seems to be a better way to do this, instead of allocating more memory
-    uint8_t *actual_write_buffer = kmalloc(size_rounded);
+    return ata_access(device, ATA_WRITE, block, count, buffer);
+}
 
-    // Read one chunk at the beginning of the disk and one at the end.
-    // !!!: this sucks, and likely corrupts/will corrupt something
-    if (device->atapi) {
-        LOG(ERR, "atapi unimplemented\n");
-    } else {
-        if (ata_access(device, ATA_READ, lba, 1, actual_write_buffer) != IDE_SUCCESS) {
-            kfree(actual_write_buffer);
-            return 0;
-        }
+/**
+ * @brief VFS read method for IDE device
+ * 
+ * All sector rounding and buffering is handled by the block cache.
+ */
+ssize_t ide_readFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    ide_device_t *device = (ide_device_t*)node->dev;
+    if (!device || !device->cache) return 0;
 
-        if (ata_access(device, ATA_READ, ((lba + size_rounded) / 512)-1, 1, actual_write_buffer + (size_rounded-512)) != IDE_SUCCESS) {
-            kfree(actual_write_buffer);
-            return 0;
-        }
-    }
+    return bcache_read(device->cache, offset, size, buffer);
+}
+
+/**
+ * @brief VFS write method for IDE device
+ * 
+ * Writes go into the block cache and are written back later (see @c bcache_sync)
+ */
+ssize_t ide_writeFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    ide_device_t *device = (ide_device_t*)node->dev;
+    if (!device || !device->cache) return 0;
 
-    // Now we can copy the new bytes in
-    memcpy(actual_write_buffer + (offset-(lba*512)), buffer, size);
+    return bcache_write(device->cache, offset, size, buffer);
+}
 
-    // And we can write
-    if (device->atapi) {
-        LOG(ERR, "atapi unimplemented");
-    } else {
-        if (ata_access(device, ATA_WRITE, lba, size_rounded / 512, actual_write_buffer) != IDE_SUCCESS) {
-            kfree(actual_write_buffer);
-            return 0;
-        }
-    }
+/**
+ * @brief VFS read-ahead method for IDE device
+ * 
+ * Pulls the range into the block cache so the following reads don't have to wait on the drive.
+ */
+int ide_readaheadFS(fs_node_t *node, off_t offset, size_t size) {
+    ide_device_t *device = (ide_device_t*)node->dev;
+    if (!device || !device->cache) return -EINVAL;
 
-    kfree(actual_write_buffer);
+    bcache_prefetch(device->cache, offset, size);
     return 0;
 }
 
-
 /**
  * @brief Create an IDE node
  * @param device The device to create off of
@@ -596,11 +550,16 @@ fs_node_t *ide_createNode(ide_device_t *device) {
 
     out->read = ide_readFS;
     out->write = ide_writeFS;
+    out->readahead = ide_readaheadFS;
     out->flags = VFS_BLOCKDEVICE;
     out->mask = 0770;
     out->length = device->size;
     out->dev = (void*)device;
 
+    // Register the device with the block cache
+    size_t block_size = (device->atapi) ? device->atapi_block_size : 512;
+    device->cache = bcache_createDevice(device->model, (void*)device, block_size, device->size / block_size, ide_readBlocks, (device->atapi) ? NULL : ide_writeBlocks);
+
     return out;
 }
 
@@ -848,7 +807,7 @@ void ide_detectDevice(ide_device_t *device) {
  */
 int ata_initialize() {
     // First, scan for the ATA controller
-    pci_scan(ata_find, NULL, ATA_PCI_TYPE);     // Ignore result for now, just in case there are multiple controllers
+    pci_probe(ata_match, ata_find, NULL);       // Ignore result for now, just in case there are multiple controllers
 
     if (ide_pci == 0xFFFFFFFF) {
         LOG(DEBUG, "No IDE controller detected\n");
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/fs/bcache.h>
 #include <kernel/debug.h>
 
 /**** TYPES ****/
@@ -81,6 +82,8 @@ typedef struct ide_device {
     char model[41];             // Model number of the drive
     char serial[21];            // Serial number of the drive
     char firmware[9];           // Firmware of the drive
+
+    bcache_device_t *cache;     // Block cache device
 } ide_device_t;
 
 /**
@@ -0,0 +1,951 @@
+/**
+ * @file drivers/storage/nvme/nvme.c
+ * @brief NVMe driver
+ *
+ * Every CPU gets its own I/O submission/completion queue pair (as far as the controller hands out queues),
+ * so CPUs never fight over a queue. Transfers are described with PRP lists.
+ *
+ * The submitter polls the phase tag of its completion queue, which is the fast path. Every completion queue
+ * also has an interrupt vector (MSI-X targeted at the owning CPU where possible) that reaps completions
+ * nobody is polling for. Start with --nvme-bench to measure random read IOPS over a range of queue depths.
+ *
+ * Namespaces take block aligned reads from I/O rings directly, those complete from the queue's interrupt.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "nvme.h"
+
+#include <kernel/loader/driver.h>
+
+#include <kernel/drivers/clock.h>
+#include <kernel/drivers/pci.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/mem/mem.h>
+#include <kernel/misc/args.h>
+#include <kernel/processor_data.h>
+#include <kernel/debug.h>
+#include <string.h>
+#include <errno.h>
+
+// Architecture-specific
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/registers.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/registers.h>
+#endif
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "DRIVER:NVME", __VA_ARGS__)
+
+/* Controllers (for the IRQ handler) */
+static nvme_t *nvme_controllers[NVME_MAX_CONTROLLERS] = { 0 };
+static int nvme_controller_count = 0;
+
+/* Benchmark parameters */
+#define NVME_BENCH_IOS      8192    // Reads per run
+#define NVME_BENCH_SIZE     4096    // Bytes per read
+
+/* PCI match table */
+static pci_match_t nvme_match[] = {
+    PCI_MATCH_CLASS(0x0108, 0x02),  // Mass storage, non-volatile memory, NVM Express
+    PCI_MATCH_END
+};
+
+/**
+ * @brief Get the current time in microseconds (0 if the clock isn't ready)
+ */
+static uint64_t nvme_getTime() {
+    if (!clock_isReady()) return 0;
+    return clock_getDevice().get_timer();
+}
+
+/**
+ * @brief Wait for a register to reach a value
+ * @param base The register base
+ * @param reg The register
+ * @param mask The bits to check
+ * @param value The value the masked bits should have
+ * @param timeout Timeout in milliseconds
+ * @returns 0 on success, 1 on timeout
+ */
+static int nvme_waitRegister(uintptr_t base, uint32_t reg, uint32_t mask, uint32_t value, int timeout) {
+    for (int i = 0; i < timeout; i++) {
+        if ((NVME_READ32(base, reg) & mask) == value) return 0;
+        clock_sleep(1);
+    }
+
+    return ((NVME_READ32(base, reg) & mask) == value) ? 0 : 1;
+}
+
+/**
+ * @brief Claim a free command slot
+ * @param queue The queue
+ * @returns The slot or -EBUSY if every slot is taken
+ */
+static int nvme_allocateSlot(nvme_queue_t *queue) {
+    uint32_t allocated = __atomic_load_n(&queue->allocated, __ATOMIC_RELAXED);
+    for (;;) {
+        if (allocated == 0xFFFFFFFF) return -EBUSY;
+
+        int slot = __builtin_ctz(~allocated);
+        if (__atomic_compare_exchange_n(&queue->allocated, &allocated, allocated | (1U << slot), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return slot;
+    }
+}
+
+/**
+ * @brief Release a command slot
+ * @param queue The queue
+ * @param slot The slot
+ */
+static void nvme_freeSlot(nvme_queue_t *queue, int slot) {
+    __atomic_and_fetch(&queue->allocated, ~(1U << slot), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get the I/O queue of the current CPU
+ * @param ctrl The controller
+ */
+static nvme_queue_t *nvme_getQueue(nvme_t *ctrl) {
+    return ctrl->queues[current_cpu->cpu_id % ctrl->queue_count];
+}
+
+/**
+ * @brief Describe a buffer with PRP entries
+ *
+ * PRP1 points at the first byte, PRP2 at the second page or at the slot's PRP list if the buffer spans more than two pages.
+ *
+ * @param queue The queue
+ * @param slot The slot (owns a PRP list)
+ * @param command The command to fill in
+ * @param buffer The buffer (dword aligned)
+ * @param size The size of the buffer
+ * @returns 0 on success or -EINVAL if the buffer can't be described
+ */
+static int nvme_buildPRP(nvme_queue_t *queue, int slot, nvme_command_t *command, uint8_t *buffer, size_t size) {
+    if ((uintptr_t)buffer & 3) return -EINVAL;
+
+    command->prp1 = mem_getPhysicalAddress(NULL, (uintptr_t)buffer);
+    command->prp2 = 0;
+
+    size_t length = PAGE_SIZE - ((uintptr_t)buffer & (PAGE_SIZE - 1));
+    if (length >= size) return 0;
+    buffer += length;
+    size -= length;
+
+    if (size <= PAGE_SIZE) {
+        command->prp2 = mem_getPhysicalAddress(NULL, (uintptr_t)buffer);
+        return 0;
+    }
+
+    // Every further entry is page aligned
+    uint64_t *list = &queue->prp_lists[slot * NVME_PRP_LIST_ENTRIES];
+    int entries = 0;
+    while (size) {
+        if (entries >= NVME_PRP_LIST_ENTRIES) return -EINVAL;
+        list[entries++] = mem_getPhysicalAddress(NULL, (uintptr_t)buffer);
+
+        length = (size > PAGE_SIZE) ? PAGE_SIZE : size;
+        buffer += length;
+        size -= length;
+    }
+
+    // The list pages aren't physically contiguous, but a list never crosses a page
+    command->prp2 = mem_getPhysicalAddress(NULL, (uintptr_t)list);
+    return 0;
+}
+
+/**
+ * @brief Put a command on a submission queue and ring the doorbell
+ *
+ * The command runs in the background, use @c nvme_wait to collect it.
+ *
+ * @param queue The queue
+ * @param slot The slot (from @c nvme_allocateSlot)
+ * @param command The command (the identifier is filled in)
+ */
+static void nvme_submit(nvme_queue_t *queue, int slot, nvme_command_t *command) {
+    command->cid = slot;
+    __atomic_store_n(&queue->status[slot], NVME_STATUS_PENDING, __ATOMIC_RELAXED);
+
+    spinlock_acquire(&queue->lock);
+    memcpy(&queue->sq[queue->sq_tail], command, sizeof(nvme_command_t));
+    queue->sq_tail = (queue->sq_tail + 1) % NVME_QUEUE_ENTRIES;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    NVME_WRITE32(queue->sq_doorbell, 0, queue->sq_tail);
+    spinlock_release(&queue->lock);
+}
+
+/**
+ * @brief Record the completion of a slot
+ * @param queue The queue
+ * @param slot The slot
+ * @param result Completion dword 0
+ * @param code Status field
+ */
+static void nvme_complete(nvme_queue_t *queue, int slot, uint32_t result, uint16_t code) {
+    if (code) LOG(ERR, "Queue %d: command %d failed (status 0x%x)\n", queue->id, slot, code);
+
+    // I/O ring requests have nobody waiting on them
+    vfs_io_request_t *request = queue->requests[slot];
+    if (request) {
+        queue->requests[slot] = NULL;
+        nvme_freeSlot(queue, slot);
+        ioring_complete(request, code ? -EIO : (ssize_t)request->sqe.length);
+        return;
+    }
+
+    queue->result[slot] = result;
+
+    int expected = NVME_STATUS_PENDING;
+    if (!__atomic_compare_exchange_n(&queue->status[slot], &expected, code ? -EIO : 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // The waiter gave up on it, now the slot can be reused
+        if (expected == NVME_STATUS_ABANDONED) nvme_freeSlot(queue, slot);
+    }
+}
+
+/**
+ * @brief Reap completions on a queue
+ *
+ * Safe to call from the IRQ handler and from pollers at the same time, only one of them does the work.
+ *
+ * @param queue The queue
+ * @returns The amount of completions reaped
+ */
+static int nvme_processQueue(nvme_queue_t *queue) {
+    // This is what pollers spin on, so look at the phase tag before touching anything shared
+    if ((queue->cq[queue->cq_head].status & NVME_COMPLETION_PHASE) != queue->phase) return 0;
+    if (__atomic_exchange_n(&queue->busy, 1, __ATOMIC_ACQUIRE)) return 0;
+
+    int processed = 0;
+    for (;;) {
+        nvme_completion_t *completion = &queue->cq[queue->cq_head];
+        uint16_t status = completion->status;
+        if ((status & NVME_COMPLETION_PHASE) != queue->phase) break;
+
+        // The rest of the entry is only valid once the phase tag flipped
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (completion->cid < NVME_QUEUE_SLOTS) nvme_complete(queue, completion->cid, completion->result, NVME_COMPLETION_STATUS(status));
+
+        if (++queue->cq_head == NVME_QUEUE_ENTRIES) {
+            queue->cq_head = 0;
+            queue->phase ^= 1;
+        }
+
+        processed++;
+    }
+
+    if (processed) NVME_WRITE32(queue->cq_doorbell, 0, queue->cq_head);
+    __atomic_store_n(&queue->busy, 0, __ATOMIC_RELEASE);
+    return processed;
+}
+
+/**
+ * @brief Wait for a command to finish and release its slot
+ * @param queue The queue
+ * @param slot The slot
+ * @param result Optional output for completion dword 0
+ * @returns 0 on success, -EIO on failure, -ETIMEDOUT on timeout
+ */
+static int nvme_wait(nvme_queue_t *queue, int slot, uint32_t *result) {
+    uint64_t deadline = nvme_getTime() + NVME_COMMAND_TIMEOUT * 1000;
+
+    while (__atomic_load_n(&queue->status[slot], __ATOMIC_ACQUIRE) == NVME_STATUS_PENDING) {
+        nvme_processQueue(queue);
+
+        if (clock_isReady() && nvme_getTime() > deadline) {
+            // The controller still owns the command, leave the slot to the completion path
+            int expected = NVME_STATUS_PENDING;
+            if (__atomic_compare_exchange_n(&queue->status[slot], &expected, NVME_STATUS_ABANDONED, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                LOG(ERR, "Queue %d: command %d timed out\n", queue->id, slot);
+                return -ETIMEDOUT;
+            }
+
+            break;
+        }
+
+        asm volatile ("pause" ::: "memory");
+    }
+
+    int status = __atomic_load_n(&queue->status[slot], __ATOMIC_ACQUIRE);
+    if (result) *result = queue->result[slot];
+    nvme_freeSlot(queue, slot);
+    return status;
+}
+
+/**
+ * @brief Run an admin command
+ * @param ctrl The controller
+ * @param command The command
+ * @param result Optional output for completion dword 0
+ * @returns 0 on success
+ */
+static int nvme_adminCommand(nvme_t *ctrl, nvme_command_t *command, uint32_t *result) {
+    int slot = nvme_allocateSlot(ctrl->admin);
+    if (slot < 0) return slot;
+
+    nvme_submit(ctrl->admin, slot, command);
+    return nvme_wait(ctrl->admin, slot, result);
+}
+
+/**
+ * @brief Send an IDENTIFY command
+ * @param ctrl The controller
+ * @param cns Controller or namespace structure
+ * @param nsid The namespace ID
+ * @param buffer A page of DMA memory
+ * @returns 0 on success
+ */
+static int nvme_identify(nvme_t *ctrl, uint32_t cns, uint32_t nsid, void *buffer) {
+    nvme_command_t command = { 0 };
+    command.opcode = NVME_ADMIN_IDENTIFY;
+    command.nsid = nsid;
+    command.prp1 = mem_getPhysicalAddress(NULL, (uintptr_t)buffer);
+    command.cdw10 = cns;
+    return nvme_adminCommand(ctrl, &command, NULL);
+}
+
+/**
+ * @brief Build and submit a read or write on a claimed slot
+ * @param ns The namespace
+ * @param queue The queue
+ * @param slot The slot
+ * @param write 1 to write
+ * @param lba The starting block
+ * @param count The amount of blocks (at most @c ns->max_blocks)
+ * @param buffer The buffer
+ * @returns 0 on success
+ */
+static int nvme_queueIO(nvme_namespace_t *ns, nvme_queue_t *queue, int slot, int write, uint64_t lba, uint32_t count, uint8_t *buffer) {
+    nvme_command_t command = { 0 };
+    command.opcode = (write) ? NVME_CMD_WRITE : NVME_CMD_READ;
+    command.nsid = ns->nsid;
+    command.cdw10 = (uint32_t)lba;
+    command.cdw11 = (uint32_t)(lba >> 32);
+    command.cdw12 = count - 1;
+
+    int ret = nvme_buildPRP(queue, slot, &command, buffer, (size_t)count * ns->block_size);
+    if (ret) return ret;
+
+    nvme_submit(queue, slot, &command);
+    return 0;
+}
+
+/**
+ * @brief Read or write blocks
+ *
+ * Goes through the current CPU's queue. The transfer is split into commands of at most
+ * @c ns->max_blocks, which are all put in flight together (as far as there are free slots).
+ *
+ * @param ns The namespace
+ * @param write 1 to write
+ * @param lba The starting block
+ * @param count The amount of blocks
+ * @param buffer The buffer
+ * @returns 0 on success
+ */
+static int nvme_access(nvme_namespace_t *ns, int write, uint64_t lba, size_t count, uint8_t *buffer) {
+    if (lba + count > ns->blocks) return -EINVAL;
+
+    nvme_queue_t *queue = nvme_getQueue(ns->ctrl);
+
+    // Slots we have in flight, oldest first
+    int slots[NVME_QUEUE_SLOTS];
+    unsigned int head = 0, tail = 0;
+    int ret = 0;
+
+    while (count || head != tail) {
+        if (count && !ret) {
+            int slot = nvme_allocateSlot(queue);
+            if (slot >= 0) {
+                uint32_t blocks = (count > ns->max_blocks) ? ns->max_blocks : count;
+                int r = nvme_queueIO(ns, queue, slot, write, lba, blocks, buffer);
+                if (r) {
+                    nvme_freeSlot(queue, slot);
+                    ret = r;
+                    continue;
+                }
+
+                slots[tail++ % NVME_QUEUE_SLOTS] = slot;
+                lba += blocks;
+                count -= blocks;
+                buffer += blocks * ns->block_size;
+                continue;
+            }
+        }
+
+        if (head == tail) {
+            // Someone else has every slot
+            if (ret) break;
+            nvme_processQueue(queue);
+            asm volatile ("pause" ::: "memory");
+            continue;
+        }
+
+        int r = nvme_wait(queue, slots[head++ % NVME_QUEUE_SLOTS], NULL);
+        if (r && !ret) ret = r;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief IRQ handler
+ */
+int nvme_irqHandler(uintptr_t exception_index, uintptr_t interrupt_no, registers_t *regs, extended_registers_t *extended) {
+    int handled = IRQ_UNHANDLED;
+
+    for (int i = 0; i < nvme_controller_count; i++) {
+        nvme_t *ctrl = nvme_controllers[i];
+        if (ctrl->irq < 0 || interrupt_no < (uintptr_t)ctrl->irq || interrupt_no >= (uintptr_t)(ctrl->irq + ctrl->irq_count)) continue;
+
+        // Message signalled vectors are never shared
+        if (ctrl->pci->irq_mode != PCI_IRQ_LEGACY) handled = IRQ_HANDLED;
+
+        if (ctrl->admin->irq == (int)interrupt_no && nvme_processQueue(ctrl->admin)) handled = IRQ_HANDLED;
+        for (int q = 0; q < ctrl->queue_count; q++) {
+            if (ctrl->queues[q]->irq == (int)interrupt_no && nvme_processQueue(ctrl->queues[q])) handled = IRQ_HANDLED;
+        }
+    }
+
+    return handled;
+}
+
+/**
+ * @brief Block cache read method for NVMe namespaces
+ * @param dev The namespace
+ * @param block The starting block
+ * @param count The amount of blocks
+ * @param buffer The output buffer
+ */
+static int nvme_readBlocks(void *dev, uint64_t block, size_t count, uint8_t *buffer) {
+    return nvme_access((nvme_namespace_t*)dev, 0, block, count, buffer);
+}
+
+/**
+ * @brief Block cache write method for NVMe namespaces
+ * @param dev The namespace
+ * @param block The starting block
+ * @param count The amount of blocks
+ * @param buffer The input buffer
+ */
+static int nvme_writeBlocks(void *dev, uint64_t block, size_t count, uint8_t *buffer) {
+    return nvme_access((nvme_namespace_t*)dev, 1, block, count, buffer);
+}
+
+/**
+ * @brief VFS read method for NVMe namespaces
+ */
+ssize_t nvme_readFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    nvme_namespace_t *ns = (nvme_namespace_t*)node->dev;
+    if (!ns || !ns->cache) return 0;
+
+    return bcache_read(ns->cache, offset, size, buffer);
+}
+
+/**
+ * @brief VFS write method for NVMe namespaces
+ *
+ * Writes go into the block cache and are written back later (see @c bcache_sync)
+ */
+ssize_t nvme_writeFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    nvme_namespace_t *ns = (nvme_namespace_t*)node->dev;
+    if (!ns || !ns->cache) return 0;
+
+    return bcache_write(ns->cache, offset, size, buffer);
+}
+
+/**
+ * @brief VFS read-ahead method for NVMe namespaces
+ */
+int nvme_readaheadFS(fs_node_t *node, off_t offset, size_t size) {
+    nvme_namespace_t *ns = (nvme_namespace_t*)node->dev;
+    if (!ns || !ns->cache) return -EINVAL;
+
+    bcache_prefetch(ns->cache, offset, size);
+    return 0;
+}
+
+/**
+ * @brief VFS asynchronous submit method for NVMe namespaces
+ *
+ * Block aligned reads that fit in one command go straight to the controller. Writes, vectored I/O and reads
+ * of ranges with dirty cached pages take the synchronous path through the block cache instead, as do
+ * queues without an interrupt (nothing would reap the completion).
+ *
+ * @param node The namespace node
+ * @param request The request
+ * @returns 0 if the request was queued, -ENOTSUP to use the synchronous path, or another error to fail it
+ */
+int nvme_submitFS(fs_node_t *node, vfs_io_request_t *request) {
+    nvme_namespace_t *ns = (nvme_namespace_t*)node->dev;
+    vfs_ioring_sqe_t *sqe = &request->sqe;
+    if (!ns || sqe->opcode != IORING_OP_READ || !sqe->length || ((uintptr_t)sqe->addr & 3)) return -ENOTSUP;
+    if (sqe->offset < 0 || (sqe->offset % ns->block_size) || (sqe->length % ns->block_size)) return -ENOTSUP;
+
+    uint64_t lba = sqe->offset / ns->block_size;
+    size_t count = sqe->length / ns->block_size;
+    if (count > ns->max_blocks) return -ENOTSUP;
+    if (lba + count > ns->blocks) return -EINVAL;
+    if (ns->cache && bcache_isDirty(ns->cache, sqe->offset, sqe->length)) return -ENOTSUP;
+
+    nvme_queue_t *queue = nvme_getQueue(ns->ctrl);
+    if (queue->irq < 0) return -ENOTSUP;
+
+    int slot = nvme_allocateSlot(queue);
+    if (slot < 0) return -ENOTSUP;
+
+    // The completion can come in before nvme_queueIO even returns
+    queue->requests[slot] = request;
+    if (nvme_queueIO(ns, queue, slot, 0, lba, (uint32_t)count, (uint8_t*)sqe->addr)) {
+        queue->requests[slot] = NULL;
+        nvme_freeSlot(queue, slot);
+        return -ENOTSUP;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create an NVMe node
+ * @param ns The namespace to create off of
+ */
+fs_node_t *nvme_createNode(nvme_namespace_t *ns) {
+    fs_node_t *out = kmalloc(sizeof(fs_node_t));
+    memset(out, 0, sizeof(fs_node_t));
+
+    snprintf(out->name, 256, "nvme%in%i", ns->ctrl->index, ns->nsid);
+
+    out->read = nvme_readFS;
+    out->write = nvme_writeFS;
+    out->readahead = nvme_readaheadFS;
+    out->submit = nvme_submitFS;
+    out->flags = VFS_BLOCKDEVICE;
+    out->mask = 0770;
+    out->length = ns->blocks * ns->block_size;
+    out->dev = (void*)ns;
+
+    // Register the device with the block cache
+    ns->cache = bcache_createDevice(ns->ctrl->model, (void*)ns, ns->block_size, ns->blocks, nvme_readBlocks, nvme_writeBlocks);
+
+    return out;
+}
+
+/**
+ * @brief Allocate the memory of a queue pair
+ * @param ctrl The controller
+ * @param id The queue ID
+ * @param cpu The owning CPU (-1 for the admin queue)
+ */
+static nvme_queue_t *nvme_createQueue(nvme_t *ctrl, int id, int cpu) {
+    nvme_queue_t *queue = kmalloc(sizeof(nvme_queue_t));
+    memset(queue, 0, sizeof(nvme_queue_t));
+    queue->ctrl = ctrl;
+    queue->id = id;
+    queue->cpu = cpu;
+    queue->irq = -1;
+    queue->phase = 1;
+
+    queue->sq = (nvme_command_t*)mem_allocateDMA(PAGE_SIZE);
+    memset(queue->sq, 0, PAGE_SIZE);
+    queue->sq_phys = mem_getPhysicalAddress(NULL, (uintptr_t)queue->sq);
+
+    queue->cq = (nvme_completion_t*)mem_allocateDMA(PAGE_SIZE);
+    memset(queue->cq, 0, PAGE_SIZE);
+    queue->cq_phys = mem_getPhysicalAddress(NULL, (uintptr_t)queue->cq);
+
+    size_t prp_size = NVME_QUEUE_SLOTS * NVME_PRP_LIST_ENTRIES * sizeof(uint64_t);
+    queue->prp_lists = (uint64_t*)mem_allocateDMA(prp_size);
+
+    uint32_t stride = 4 << NVME_CAP_DSTRD(ctrl->cap);
+    queue->sq_doorbell = ctrl->mmio + NVME_REG_DOORBELLS + (2 * id) * stride;
+    queue->cq_doorbell = ctrl->mmio + NVME_REG_DOORBELLS + (2 * id + 1) * stride;
+
+    return queue;
+}
+
+/**
+ * @brief Free the memory of a queue pair
+ * @param queue The queue
+ */
+static void nvme_destroyQueue(nvme_queue_t *queue) {
+    mem_freeDMA((uintptr_t)queue->sq, PAGE_SIZE);
+    mem_freeDMA((uintptr_t)queue->cq, PAGE_SIZE);
+    mem_freeDMA((uintptr_t)queue->prp_lists, NVME_QUEUE_SLOTS * NVME_PRP_LIST_ENTRIES * sizeof(uint64_t));
+    kfree(queue);
+}
+
+/**
+ * @brief Create the I/O queue pair of a CPU on the controller
+ * @param ctrl The controller
+ * @param queue The queue
+ * @returns 0 on success
+ */
+static int nvme_registerQueue(nvme_t *ctrl, nvme_queue_t *queue) {
+    // Interrupts of a CPU's queue go to that CPU when there are enough vectors
+    if (ctrl->irq >= 0) {
+        queue->vector = (queue->id < ctrl->irq_count) ? queue->id : (queue->id % ctrl->irq_count);
+        queue->irq = ctrl->irq + queue->vector;
+        if (ctrl->pci->irq_mode == PCI_IRQ_MSIX && queue->vector == queue->id) pci_setIRQAffinity(ctrl->pci, queue->vector, queue->cpu);
+    }
+
+    nvme_command_t command = { 0 };
+    command.opcode = NVME_ADMIN_CREATE_CQ;
+    command.prp1 = queue->cq_phys;
+    command.cdw10 = ((NVME_QUEUE_ENTRIES - 1) << 16) | queue->id;
+    command.cdw11 = ((uint32_t)queue->vector << 16) | NVME_QUEUE_PHYS_CONTIG | ((queue->irq >= 0) ? NVME_QUEUE_IRQ_ENABLED : 0);
+    if (nvme_adminCommand(ctrl, &command, NULL)) return -EIO;
+
+    memset(&command, 0, sizeof(nvme_command_t));
+    command.opcode = NVME_ADMIN_CREATE_SQ;
+    command.prp1 = queue->sq_phys;
+    command.cdw10 = ((NVME_QUEUE_ENTRIES - 1) << 16) | queue->id;
+    command.cdw11 = ((uint32_t)queue->id << 16) | NVME_QUEUE_PHYS_CONTIG;
+    if (nvme_adminCommand(ctrl, &command, NULL)) return -EIO;
+
+    return 0;
+}
+
+/**
+ * @brief Hook up the controller's interrupts
+ *
+ * Prefers MSI-X (one vector per queue), then MSI, then the INTx# line.
+ * Without any of them completions are only polled.
+ *
+ * @param ctrl The controller
+ * @param count Vectors wanted (admin queue + one per CPU)
+ */
+static void nvme_initInterrupts(nvme_t *ctrl, int count) {
+    ctrl->irq = -1;
+
+    // Vector 0 (admin) goes to the BSP, the I/O queue vectors are moved to their CPUs as the queues are created
+    int vectors = pci_allocateIRQs(ctrl->pci, count, PCI_IRQ_MSIX | PCI_IRQ_MSI, 0);
+    if (vectors > 0) {
+        for (int i = 0; i < vectors; i++) {
+            if (hal_registerInterruptHandler(pci_getIRQ(ctrl->pci, i), nvme_irqHandler)) {
+                while (i--) hal_removeInterruptHandler(pci_getIRQ(ctrl->pci, i), nvme_irqHandler);
+                pci_freeIRQs(ctrl->pci);
+                vectors = 0;
+                break;
+            }
+        }
+    }
+
+    if (vectors > 0) {
+        ctrl->irq = pci_getIRQ(ctrl->pci, 0);
+        ctrl->irq_count = vectors;
+        LOG(DEBUG, "Using %d %s vector(s) starting at IRQ%d\n", vectors, (ctrl->pci->irq_mode == PCI_IRQ_MSIX) ? "MSI-X" : "MSI", ctrl->irq);
+        return;
+    }
+
+    int line = pci_getLineIRQ(ctrl->pci->bus, ctrl->pci->slot, ctrl->pci->function);
+    if (line >= 0 && !hal_registerInterruptHandler(line, nvme_irqHandler)) {
+        ctrl->irq = line;
+        ctrl->irq_count = 1;
+        LOG(DEBUG, "Using IRQ%i\n", line);
+    } else {
+        LOG(WARN, "Could not route INTx# (%i) - completions will only be polled\n", line);
+    }
+}
+
+/**
+ * @brief Ask for one I/O queue pair per CPU and create them
+ * @param ctrl The controller
+ */
+static void nvme_initQueues(nvme_t *ctrl) {
+    int wanted = (processor_count < NVME_MAX_QUEUES) ? processor_count : NVME_MAX_QUEUES;
+    if (wanted < 1) wanted = 1;
+
+    // The controller may hand out fewer (values are 0-based)
+    nvme_command_t command = { 0 };
+    command.opcode = NVME_ADMIN_SET_FEATURES;
+    command.cdw10 = NVME_FEATURE_NUM_QUEUES;
+    command.cdw11 = ((uint32_t)(wanted - 1) << 16) | (wanted - 1);
+
+    uint32_t result = 0;
+    if (nvme_adminCommand(ctrl, &command, &result)) {
+        LOG(WARN, "Set Features (number of queues) failed, using one I/O queue\n");
+        wanted = 1;
+    } else {
+        int sqs = (result & 0xFFFF) + 1;
+        int cqs = (result >> 16) + 1;
+        if (sqs < wanted) wanted = sqs;
+        if (cqs < wanted) wanted = cqs;
+    }
+
+    for (int i = 0; i < wanted; i++) {
+        nvme_queue_t *queue = nvme_createQueue(ctrl, i + 1, i);
+        if (nvme_registerQueue(ctrl, queue)) {
+            LOG(ERR, "Could not create I/O queue %d\n", i + 1);
+            nvme_destroyQueue(queue);
+            break;
+        }
+
+        ctrl->queues[ctrl->queue_count++] = queue;
+    }
+
+    LOG(INFO, "%d I/O queue pair(s) for %d CPU(s), %d entries each\n", ctrl->queue_count, processor_count, NVME_QUEUE_ENTRIES);
+}
+
+/**
+ * @brief Identify the namespaces and mount them
+ * @param ctrl The controller
+ * @param count Number of namespaces reported by the controller
+ * @param buffer A page of DMA memory
+ */
+static void nvme_initNamespaces(nvme_t *ctrl, uint32_t count, uint8_t *buffer) {
+    if (count > NVME_MAX_NAMESPACES) count = NVME_MAX_NAMESPACES;
+
+    for (uint32_t nsid = 1; nsid <= count; nsid++) {
+        memset(buffer, 0, PAGE_SIZE);
+        if (nvme_identify(ctrl, NVME_IDENTIFY_NAMESPACE, nsid, buffer)) continue;
+
+        uint64_t blocks = *(uint64_t*)(buffer + NVME_ID_NS_NSZE);
+        if (!blocks) continue; // Inactive
+
+        uint8_t format = buffer[NVME_ID_NS_FLBAS] & 0xF;
+        uint32_t lbads = (*(uint32_t*)(buffer + NVME_ID_NS_LBAF + format * 4) >> 16) & 0xFF;
+        if (lbads < 9 || (1U << lbads) > PAGE_SIZE) {
+            LOG(WARN, "Namespace %d: unsupported block size (2^%d)\n", nsid, lbads);
+            continue;
+        }
+
+        nvme_namespace_t *ns = kmalloc(sizeof(nvme_namespace_t));
+        memset(ns, 0, sizeof(nvme_namespace_t));
+        ns->ctrl = ctrl;
+        ns->nsid = nsid;
+        ns->blocks = blocks;
+        ns->block_size = 1U << lbads;
+        ns->max_blocks = ctrl->max_transfer / ns->block_size;
+        ctrl->namespaces[nsid - 1] = ns;
+
+        LOG(INFO, "Namespace %d: %d MB, %d-byte blocks\n", nsid, (uint32_t)((blocks << lbads) >> 20), ns->block_size);
+
+        // Create a VFS node for it
+        fs_node_t *node = nvme_createNode(ns);
+
+        // Mount the node
+        char devname[64];
+        snprintf(devname, 64, "/device/%s", node->name);
+        vfs_mount(node, devname);
+    }
+}
+
+/**
+ * @brief Initialize a controller
+ * @param dev The PCI device
+ */
+static void nvme_initController(pci_device_t *dev) {
+    if (nvme_controller_count >= NVME_MAX_CONTROLLERS) {
+        LOG(WARN, "Ignoring controller at %02x:%02x.%x (too many controllers)\n", dev->bus, dev->slot, dev->function);
+        return;
+    }
+
+    pci_bar_t *bar = pci_readBAR(dev->bus, dev->slot, dev->function, 0);
+    if (!bar) {
+        LOG(ERR, "NVMe controller does not have BAR0 - false positive?\n");
+        return;
+    }
+
+    if (bar->type != PCI_BAR_MEMORY32 && bar->type != PCI_BAR_MEMORY64) {
+        LOG(ERR, "NVMe controller BAR0 is not memory space - bug in PCI driver?\n");
+        kfree(bar);
+        return;
+    }
+
+    // Enable memory space and bus mastering
+    uint32_t pci_command = pci_readConfigOffset(dev->bus, dev->slot, dev->function, PCI_COMMAND_OFFSET, 2);
+    pci_writeConfigOffset(dev->bus, dev->slot, dev->function, PCI_COMMAND_OFFSET, (pci_command | PCI_COMMAND_MEMORY_SPACE | PCI_COMMAND_BUS_MASTER) & ~PCI_COMMAND_INTERRUPT_DISABLE);
+
+    nvme_t *ctrl = kmalloc(sizeof(nvme_t));
+    memset(ctrl, 0, sizeof(nvme_t));
+    ctrl->pci = dev;
+    ctrl->irq = -1;
+
+    uintptr_t size = (bar->size + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    ctrl->mmio = mem_mapMMIO((uintptr_t)bar->address, size);
+    kfree(bar);
+
+    ctrl->cap = NVME_READ64(ctrl->mmio, NVME_REG_CAP);
+    uint32_t vs = NVME_READ32(ctrl->mmio, NVME_REG_VS);
+    int timeout = NVME_CAP_TO(ctrl->cap) ? NVME_CAP_TO(ctrl->cap) * 500 : 500;
+
+    if (!(ctrl->cap & NVME_CAP_CSS_NVM) || NVME_CAP_MPSMIN(ctrl->cap) > 0 || NVME_CAP_MQES(ctrl->cap) < NVME_QUEUE_ENTRIES) {
+        LOG(ERR, "Unsupported controller (CAP 0x%x%08x)\n", (uint32_t)(ctrl->cap >> 32), (uint32_t)ctrl->cap);
+        kfree(ctrl);
+        return;
+    }
+
+    // Disable the controller before touching the admin queue
+    NVME_WRITE32(ctrl->mmio, NVME_REG_CC, NVME_READ32(ctrl->mmio, NVME_REG_CC) & ~NVME_CC_EN);
+    if (nvme_waitRegister(ctrl->mmio, NVME_REG_CSTS, NVME_CSTS_RDY, 0, timeout)) {
+        LOG(ERR, "Controller did not disable\n");
+        kfree(ctrl);
+        return;
+    }
+
+    ctrl->admin = nvme_createQueue(ctrl, 0, -1);
+    NVME_WRITE32(ctrl->mmio, NVME_REG_AQA, ((NVME_QUEUE_ENTRIES - 1) << 16) | (NVME_QUEUE_ENTRIES - 1));
+    NVME_WRITE64(ctrl->mmio, NVME_REG_ASQ, ctrl->admin->sq_phys);
+    NVME_WRITE64(ctrl->mmio, NVME_REG_ACQ, ctrl->admin->cq_phys);
+
+    NVME_WRITE32(ctrl->mmio, NVME_REG_CC, NVME_CC_EN | NVME_CC_CSS_NVM | NVME_CC_MPS(12) | NVME_CC_AMS_RR | NVME_CC_IOSQES(6) | NVME_CC_IOCQES(4));
+    if (nvme_waitRegister(ctrl->mmio, NVME_REG_CSTS, NVME_CSTS_RDY | NVME_CSTS_CFS, NVME_CSTS_RDY, timeout)) {
+        LOG(ERR, "Controller did not become ready (CSTS 0x%x)\n", NVME_READ32(ctrl->mmio, NVME_REG_CSTS));
+        nvme_destroyQueue(ctrl->admin);
+        kfree(ctrl);
+        return;
+    }
+
+    ctrl->index = nvme_controller_count;
+    nvme_controllers[nvme_controller_count++] = ctrl;
+
+    // The admin queue always interrupts on vector 0
+    int wanted = (processor_count < NVME_MAX_QUEUES) ? processor_count : NVME_MAX_QUEUES;
+    nvme_initInterrupts(ctrl, 1 + wanted);
+    ctrl->admin->irq = ctrl->irq;
+
+    uint8_t *buffer = (uint8_t*)mem_allocateDMA(PAGE_SIZE);
+    memset(buffer, 0, PAGE_SIZE);
+    if (nvme_identify(ctrl, NVME_IDENTIFY_CONTROLLER, 0, buffer)) {
+        LOG(ERR, "IDENTIFY CONTROLLER failed\n");
+        mem_freeDMA((uintptr_t)buffer, PAGE_SIZE);
+        return;
+    }
+
+    memcpy(ctrl->model, buffer + NVME_ID_CTRL_MODEL, 40);
+    memcpy(ctrl->serial, buffer + NVME_ID_CTRL_SERIAL, 20);
+    for (int i = 39; i >= 0 && ctrl->model[i] == ' '; i--) ctrl->model[i] = 0;
+    for (int i = 19; i >= 0 && ctrl->serial[i] == ' '; i--) ctrl->serial[i] = 0;
+
+    // MDTS is a power of two of the minimum page size (4KB here)
+    uint8_t mdts = buffer[NVME_ID_CTRL_MDTS];
+    ctrl->max_transfer = (mdts && mdts < 5) ? (PAGE_SIZE << mdts) : NVME_MAX_TRANSFER;
+    uint32_t namespaces = *(uint32_t*)(buffer + NVME_ID_CTRL_NN);
+
+    LOG(INFO, "NVMe %d.%d controller at %02x:%02x.%x: %s (serial %s), %d namespace(s), %d KB per command\n", vs >> 16, (vs >> 8) & 0xFF, dev->bus, dev->slot, dev->function, ctrl->model, ctrl->serial, namespaces, ctrl->max_transfer / 1024);
+
+    nvme_initQueues(ctrl);
+    if (ctrl->queue_count) nvme_initNamespaces(ctrl, namespaces, buffer);
+
+    mem_freeDMA((uintptr_t)buffer, PAGE_SIZE);
+}
+
+/**
+ * @brief Run random reads against a namespace through the current CPU's queue and log the IOPS
+ * @param ns The namespace
+ * @param depth The amount of reads kept in flight
+ */
+static void nvme_benchmark(nvme_namespace_t *ns, int depth) {
+    uint32_t per_read = NVME_BENCH_SIZE / ns->block_size;
+    uint64_t chunks = ns->blocks >> __builtin_ctz(per_read);
+    if (!clock_isReady() || !chunks) return;
+    if (chunks > 0xFFFFFFFF) chunks = 0xFFFFFFFF;
+
+    nvme_queue_t *queue = nvme_getQueue(ns->ctrl);
+    uint8_t *buffers = (uint8_t*)mem_allocateDMA(depth * NVME_BENCH_SIZE);
+
+    int slots[NVME_QUEUE_SLOTS];
+    unsigned int head = 0, tail = 0;
+    int submitted = 0, errors = 0;
+    uint32_t seed = 0x9E3779B9 ^ ns->nsid;
+
+    uint64_t start = nvme_getTime();
+
+    while (submitted < NVME_BENCH_IOS || head != tail) {
+        if (submitted < NVME_BENCH_IOS && (int)(tail - head) < depth) {
+            int slot = nvme_allocateSlot(queue);
+            if (slot >= 0) {
+                // xorshift32
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+
+                uint64_t lba = (uint64_t)(seed % (uint32_t)chunks) * per_read;
+                if (nvme_queueIO(ns, queue, slot, 0, lba, per_read, buffers + (tail % depth) * NVME_BENCH_SIZE)) {
+                    nvme_freeSlot(queue, slot);
+                    errors++;
+                    break;
+                }
+
+                slots[tail++ % NVME_QUEUE_SLOTS] = slot;
+                submitted++;
+                continue;
+            }
+        }
+
+        if (head == tail) {
+            asm volatile ("pause" ::: "memory");
+            continue;
+        }
+
+        if (nvme_wait(queue, slots[head++ % NVME_QUEUE_SLOTS], NULL)) errors++;
+    }
+
+    // Drain whatever is still in flight after a submission failure
+    while (head != tail) nvme_wait(queue, slots[head++ % NVME_QUEUE_SLOTS], NULL);
+
+    uint32_t elapsed = (uint32_t)(nvme_getTime() - start);
+    uint32_t elapsed_ms = (elapsed / 1000) ? (elapsed / 1000) : 1;
+    uint32_t iops = (uint32_t)submitted * 1000 / elapsed_ms;
+
+    LOG(INFO, "nvme%dn%d: QD%-2d on queue %d: %d IOPS, %d us average latency (%d reads in %d ms, %d errors)\n", ns->ctrl->index, ns->nsid, depth, queue->id, iops, submitted ? elapsed * depth / submitted : 0, submitted, elapsed_ms, errors);
+    mem_freeDMA((uintptr_t)buffers, depth * NVME_BENCH_SIZE);
+}
+
+/**
+ * @brief NVMe controller probe method
+ */
+int nvme_find(pci_device_t *dev, void *data) {
+    nvme_initController(dev);
+    return 0; // Keep going, there may be more controllers
+}
+
+/**
+ * @brief NVMe initialize method
+ */
+int nvme_init(int argc, char **argv) {
+    pci_probe(nvme_match, nvme_find, NULL);
+
+    if (!nvme_controller_count) {
+        LOG(INFO, "No NVMe controller found\n");
+        return 0;
+    }
+
+    // Random 4KB reads at doubling queue depths
+    if (kargs_has("--nvme-bench")) {
+        for (int i = 0; i < nvme_controller_count; i++) {
+            if (!nvme_controllers[i]->queue_count) continue;
+
+            for (int j = 0; j < NVME_MAX_NAMESPACES; j++) {
+                nvme_namespace_t *ns = nvme_controllers[i]->namespaces[j];
+                if (!ns || ns->block_size > NVME_BENCH_SIZE) continue;
+
+                for (int depth = 1; depth <= NVME_QUEUE_SLOTS; depth *= 2) nvme_benchmark(ns, depth);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief NVMe deinitialize method
+ */
+int nvme_deinit() {
+    return 0;
+}
+
+
+/* Metadata */
+struct driver_metadata driver_metadata = {
+    .name = "NVMe driver",
+    .author = "Samuel Stuart",
+    .init = nvme_init,
+    .deinit = nvme_deinit
+};
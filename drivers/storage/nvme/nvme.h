@@ -0,0 +1,232 @@
+/**
+ * @file drivers/storage/nvme/nvme.h
+ * @brief NVMe header file
+ *
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef NVME_H
+#define NVME_H
+
+/**** INCLUDES ****/
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/fs/bcache.h>
+#include <kernel/fs/ioring.h>
+#include <kernel/drivers/pci.h>
+#include <kernel/misc/spinlock.h>
+
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/hal.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/hal.h>
+#else
+#error "Please define port I/O functions for NVMe driver"
+#endif
+
+/**** DEFINITIONS ****/
+
+/* Controller registers */
+
+#define NVME_REG_CAP                    0x00    // Controller capabilities (64-bit)
+#define NVME_REG_VS                     0x08    // Version
+#define NVME_REG_INTMS                  0x0C    // Interrupt mask set (INTx#/MSI only)
+#define NVME_REG_INTMC                  0x10    // Interrupt mask clear
+#define NVME_REG_CC                     0x14    // Controller configuration
+#define NVME_REG_CSTS                   0x1C    // Controller status
+#define NVME_REG_AQA                    0x24    // Admin queue attributes
+#define NVME_REG_ASQ                    0x28    // Admin submission queue base (64-bit)
+#define NVME_REG_ACQ                    0x30    // Admin completion queue base (64-bit)
+#define NVME_REG_DOORBELLS              0x1000  // First doorbell
+
+#define NVME_CAP_MQES(c)                ((uint32_t)((c) & 0xFFFF) + 1)  // Maximum queue entries
+#define NVME_CAP_TO(c)                  ((uint32_t)(((c) >> 24) & 0xFF))// Ready timeout (500ms units)
+#define NVME_CAP_DSTRD(c)               ((uint32_t)(((c) >> 32) & 0xF)) // Doorbell stride (4 << DSTRD bytes)
+#define NVME_CAP_CSS_NVM                (1ULL << 37)                    // NVM command set supported
+#define NVME_CAP_MPSMIN(c)              ((uint32_t)(((c) >> 48) & 0xF)) // Minimum page size (4KB << MPSMIN)
+
+#define NVME_CC_EN                      (1 << 0)    // Enable
+#define NVME_CC_CSS_NVM                 (0 << 4)    // NVM command set
+#define NVME_CC_MPS(shift)              (((shift) - 12) << 7)   // Memory page size
+#define NVME_CC_AMS_RR                  (0 << 11)   // Round robin arbitration
+#define NVME_CC_SHN_NORMAL              (1 << 14)   // Normal shutdown notification
+#define NVME_CC_IOSQES(shift)           ((shift) << 16) // I/O submission queue entry size
+#define NVME_CC_IOCQES(shift)           ((shift) << 20) // I/O completion queue entry size
+
+#define NVME_CSTS_RDY                   (1 << 0)    // Ready
+#define NVME_CSTS_CFS                   (1 << 1)    // Controller fatal status
+
+/* Admin commands */
+
+#define NVME_ADMIN_CREATE_SQ            0x01
+#define NVME_ADMIN_CREATE_CQ            0x05
+#define NVME_ADMIN_IDENTIFY             0x06
+#define NVME_ADMIN_SET_FEATURES         0x09
+
+#define NVME_IDENTIFY_NAMESPACE         0x00    // CNS: identify namespace
+#define NVME_IDENTIFY_CONTROLLER        0x01    // CNS: identify controller
+
+#define NVME_FEATURE_NUM_QUEUES         0x07    // Number of queues
+
+#define NVME_QUEUE_PHYS_CONTIG          (1 << 0)    // Create queue: physically contiguous
+#define NVME_QUEUE_IRQ_ENABLED          (1 << 1)    // Create CQ: interrupts enabled
+
+/* NVM commands */
+
+#define NVME_CMD_FLUSH                  0x00
+#define NVME_CMD_WRITE                  0x01
+#define NVME_CMD_READ                   0x02
+
+/* Identify controller */
+
+#define NVME_ID_CTRL_SERIAL             4       // Serial number (20 characters)
+#define NVME_ID_CTRL_MODEL              24      // Model number (40 characters)
+#define NVME_ID_CTRL_MDTS               77      // Maximum data transfer size (power of two of the minimum page size, 0 = no limit)
+#define NVME_ID_CTRL_NN                 516     // Number of namespaces
+
+/* Identify namespace */
+
+#define NVME_ID_NS_NSZE                 0       // Namespace size in blocks (64-bit)
+#define NVME_ID_NS_FLBAS                26      // Formatted LBA size (bits 0-3 index the LBA formats)
+#define NVME_ID_NS_LBAF                 128     // LBA formats (4 bytes each, bits 16-23 are log2 of the block size)
+
+/* Driver limits */
+
+#define NVME_MAX_CONTROLLERS            4
+#define NVME_MAX_QUEUES                 64      // I/O queue pairs (one per CPU)
+#define NVME_MAX_NAMESPACES             16
+#define NVME_QUEUE_ENTRIES              64      // Entries per queue (the SQ can never fill up, there are fewer slots)
+#define NVME_QUEUE_SLOTS                32      // Outstanding commands per queue
+#define NVME_MAX_TRANSFER               0x20000 // Bytes per command (128KB)
+#define NVME_PRP_LIST_ENTRIES           (NVME_MAX_TRANSFER / PAGE_SIZE) // Enough for an unaligned NVME_MAX_TRANSFER
+
+/* Timeouts (in milliseconds) */
+
+#define NVME_COMMAND_TIMEOUT            5000
+
+/* Slot status */
+
+#define NVME_STATUS_PENDING             1       // Command is outstanding
+#define NVME_STATUS_ABANDONED           2       // Waiter timed out, the completion path frees the slot
+
+/**** TYPES ****/
+
+/**
+ * @brief Submission queue entry
+ */
+typedef struct nvme_command {
+    uint8_t opcode;                     // Opcode
+    uint8_t flags;                      // Fused operation (0-1), PRP or SGL (6-7)
+    uint16_t cid;                       // Command identifier (the slot)
+    uint32_t nsid;                      // Namespace ID
+    uint64_t reserved;
+    uint64_t mptr;                      // Metadata pointer
+    uint64_t prp1;                      // PRP entry 1
+    uint64_t prp2;                      // PRP entry 2 or PRP list pointer
+    uint32_t cdw10;                     // Command specific
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) nvme_command_t;
+
+/**
+ * @brief Completion queue entry
+ */
+typedef struct nvme_completion {
+    uint32_t result;                    // Command specific
+    uint32_t reserved;
+    uint16_t sq_head;                   // Submission queue head pointer
+    uint16_t sq_id;                     // Submission queue identifier
+    uint16_t cid;                       // Command identifier
+    volatile uint16_t status;           // Phase tag (0), status field (1-15)
+} __attribute__((packed)) nvme_completion_t;
+
+#define NVME_COMPLETION_PHASE           (1 << 0)
+#define NVME_COMPLETION_STATUS(s)       ((s) >> 1)
+
+struct nvme;
+
+/**
+ * @brief Submission/completion queue pair
+ */
+typedef struct nvme_queue {
+    struct nvme *ctrl;                  // Controller
+    int id;                             // Queue ID (0 = admin)
+    int cpu;                            // CPU the queue belongs to (-1 for the admin queue)
+    int irq;                            // IRQ the CQ interrupts on (-1 when polled)
+    uint16_t vector;                    // Interrupt vector index in the controller
+
+    nvme_command_t *sq;                 // Submission queue
+    uintptr_t sq_phys;
+    uint16_t sq_tail;                   // Next free submission entry
+    uintptr_t sq_doorbell;              // SQ tail doorbell
+    spinlock_t lock;                    // Protects the submission queue tail
+
+    nvme_completion_t *cq;              // Completion queue
+    uintptr_t cq_phys;
+    uint16_t cq_head;                   // Next completion entry
+    uint16_t phase;                     // Expected phase tag
+    uintptr_t cq_doorbell;              // CQ head doorbell
+    int busy;                           // Set while someone is reaping completions
+
+    // Slots
+    uint32_t allocated;                 // Slots owned by a caller
+    int status[NVME_QUEUE_SLOTS];       // Per-slot result (NVME_STATUS_PENDING, 0 or -EIO)
+    uint32_t result[NVME_QUEUE_SLOTS];  // Per-slot completion dword 0
+    vfs_io_request_t *requests[NVME_QUEUE_SLOTS]; // I/O ring request completed by the slot (no waiter), or NULL
+    uint64_t *prp_lists;                // One PRP list per slot (each within one page, the pages aren't contiguous)
+} nvme_queue_t;
+
+/**
+ * @brief Namespace (one block device)
+ */
+typedef struct nvme_namespace {
+    struct nvme *ctrl;                  // Controller
+    uint32_t nsid;                      // Namespace ID
+    uint64_t blocks;                    // Size in blocks
+    uint32_t block_size;                // Block size
+    uint32_t max_blocks;                // Blocks per command
+    bcache_device_t *cache;             // Block cache
+} nvme_namespace_t;
+
+/**
+ * @brief NVMe controller
+ */
+typedef struct nvme {
+    int index;                          // Controller number (nvmeN)
+    pci_device_t *pci;                  // PCI device
+    uintptr_t mmio;                     // BAR0
+    uint64_t cap;                       // Capabilities
+    uint32_t max_transfer;              // Bytes per command
+
+    nvme_queue_t *admin;                // Admin queue pair
+    nvme_queue_t *queues[NVME_MAX_QUEUES];  // I/O queue pairs (indexed by CPU)
+    int queue_count;
+
+    // Interrupts
+    int irq;                            // First IRQ (-1 when polled)
+    int irq_count;                      // Amount of IRQs
+
+    char model[41];                     // Model number
+    char serial[21];                    // Serial number
+    nvme_namespace_t *namespaces[NVME_MAX_NAMESPACES];
+} nvme_t;
+
+/**** MACROS ****/
+
+#define NVME_READ32(base, reg)          (*(volatile uint32_t*)((base) + (reg)))
+#define NVME_WRITE32(base, reg, val)    (*(volatile uint32_t*)((base) + (reg)) = (uint32_t)(val))
+#define NVME_READ64(base, reg)          ((uint64_t)NVME_READ32(base, reg) | ((uint64_t)NVME_READ32(base, (reg) + 4) << 32))
+#define NVME_WRITE64(base, reg, val)    { NVME_WRITE32(base, reg, (uint64_t)(val) & 0xFFFFFFFF); NVME_WRITE32(base, (reg) + 4, (uint64_t)(val) >> 32); }
+
+#endif
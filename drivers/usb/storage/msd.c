@@ -0,0 +1,527 @@
+/**
+ * @file drivers/usb/storage/msd.c
+ * @brief USB mass-storage class driver (bulk-only transport, SCSI command set)
+ *
+ * Every LUN of a device gets a block node (/device/usbdiskN) backed by the block cache.
+ * The block cache hands us multi-block requests, which are sent as READ/WRITE commands
+ * of up to @c MSD_MAX_TRANSFER bytes each.
+ *
+ * Test with QEMU: -drive if=none,id=stick,file=disk.img -device usb-storage,drive=stick
+ *
+ * @see https://www.usb.org/sites/default/files/usbmassbulk_10.pdf
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "msd.h"
+
+#include <kernel/loader/driver.h>
+#include <kernel/drivers/usb/usb.h>
+#include <kernel/drivers/clock.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/debug.h>
+#include <string.h>
+#include <errno.h>
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "DRIVER:USBSTORAGE", __VA_ARGS__)
+
+/* Disk index */
+static int msd_index = 0;
+
+/* Big-endian helpers (SCSI fields are big-endian) */
+#define MSD_BE16(x) __builtin_bswap16(x)
+#define MSD_BE32(x) __builtin_bswap32(x)
+#define MSD_BE64(x) __builtin_bswap64(x)
+
+/**
+ * @brief Clear a halted bulk endpoint
+ * @param endp The endpoint
+ */
+static USB_STATUS msd_clearHalt(USBEndpoint_t *endp) {
+    endp->toggle = 0;
+    return usb_controlTransferEndpoint(endp, USB_RT_H2D | USB_RT_STANDARD, USB_REQ_CLEAR_FEATURE, USB_FT_ENDPOINT_HALT, 0, 0, NULL);
+}
+
+/**
+ * @brief Perform reset recovery (Bulk-Only Mass Storage Reset, then clear both halts)
+ * @param msd The device
+ */
+static void msd_resetRecovery(msd_device_t *msd) {
+    LOG(WARN, "Performing reset recovery\n");
+
+    if (usb_controlTransferInterface(msd->intf, USB_RT_H2D | USB_RT_CLASS, MSD_REQ_RESET, 0, 0, 0, NULL) != USB_SUCCESS) {
+        LOG(ERR, "Bulk-Only Mass Storage Reset failed\n");
+    }
+
+    msd_clearHalt(msd->in);
+    msd_clearHalt(msd->out);
+}
+
+/**
+ * @brief Send a SCSI command through bulk-only transport
+ * @param lun The LUN to send the command to
+ * @param cb The command block
+ * @param cb_length The length of the command block
+ * @param direction MSD_CBW_IN or MSD_CBW_OUT
+ * @param data The data buffer (can be NULL if @p length is 0)
+ * @param length The amount of data bytes
+ * @returns 0 on success, MSD_CSW_FAILED if the command failed (check sense data), -EIO on transport errors
+ */
+static int msd_command(msd_lun_t *lun, uint8_t *cb, uint8_t cb_length, uint8_t direction, void *data, uint32_t length) {
+    msd_device_t *msd = lun->msd;
+    int ret = 0;
+
+    spinlock_acquire(&msd->lock);
+
+    // Command
+    memset(msd->cbw, 0, sizeof(msd_cbw_t));
+    msd->cbw->signature = MSD_CBW_SIGNATURE;
+    msd->cbw->tag = ++msd->tag;
+    msd->cbw->length = length;
+    msd->cbw->flags = direction;
+    msd->cbw->lun = lun->lun;
+    msd->cbw->cb_length = cb_length;
+    memcpy(msd->cbw->cb, cb, cb_length);
+
+    uint32_t transferred = 0;
+    if (usb_bulkTransfer(msd->out, sizeof(msd_cbw_t), msd->cbw, &transferred) != USB_SUCCESS || transferred != sizeof(msd_cbw_t)) {
+        LOG(ERR, "Failed to send CBW (command 0x%x)\n", cb[0]);
+        msd_resetRecovery(msd);
+        ret = -EIO;
+        goto _done;
+    }
+
+    // Data
+    if (length) {
+        USBEndpoint_t *endp = (direction == MSD_CBW_IN) ? msd->in : msd->out;
+        if (usb_bulkTransfer(endp, length, data, &transferred) != USB_SUCCESS) {
+            // The device stalls the data endpoint when it can't move all of the data - the CSW still follows
+            msd_clearHalt(endp);
+        }
+    }
+
+    // Status (retry once if the IN endpoint was halted)
+    memset(msd->csw, 0, sizeof(msd_csw_t));
+    if (usb_bulkTransfer(msd->in, sizeof(msd_csw_t), msd->csw, &transferred) != USB_SUCCESS) {
+        msd_clearHalt(msd->in);
+        if (usb_bulkTransfer(msd->in, sizeof(msd_csw_t), msd->csw, &transferred) != USB_SUCCESS) {
+            LOG(ERR, "Failed to read CSW (command 0x%x)\n", cb[0]);
+            msd_resetRecovery(msd);
+            ret = -EIO;
+            goto _done;
+        }
+    }
+
+    if (transferred != sizeof(msd_csw_t) || msd->csw->signature != MSD_CSW_SIGNATURE || msd->csw->tag != msd->cbw->tag) {
+        LOG(ERR, "Invalid CSW (command 0x%x)\n", cb[0]);
+        msd_resetRecovery(msd);
+        ret = -EIO;
+        goto _done;
+    }
+
+    switch (msd->csw->status) {
+        case MSD_CSW_PASSED:
+            // A passed command that didn't move everything is still an error for block I/O
+            if (msd->csw->residue && length) {
+                LOG(ERR, "Command 0x%x left %d of %d bytes untransferred\n", cb[0], msd->csw->residue, length);
+                ret = -EIO;
+            }
+            break;
+
+        case MSD_CSW_FAILED:
+            ret = MSD_CSW_FAILED;
+            break;
+
+        default:
+            LOG(ERR, "Phase error (command 0x%x)\n", cb[0]);
+            msd_resetRecovery(msd);
+            ret = -EIO;
+            break;
+    }
+
+_done:
+    spinlock_release(&msd->lock);
+    return ret;
+}
+
+/**
+ * @brief Read sense data of a LUN
+ * @param lun The LUN
+ * @param sense Output sense data
+ * @returns 0 on success
+ */
+static int msd_requestSense(msd_lun_t *lun, scsi_sense_t *sense) {
+    uint8_t cb[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, sizeof(scsi_sense_t), 0 };
+    memset(sense, 0, sizeof(scsi_sense_t));
+    return msd_command(lun, cb, sizeof(cb), MSD_CBW_IN, sense, sizeof(scsi_sense_t));
+}
+
+/**
+ * @brief Send a command, logging the sense data if it fails
+ * @returns 0 on success
+ */
+static int msd_commandSense(msd_lun_t *lun, uint8_t *cb, uint8_t cb_length, uint8_t direction, void *data, uint32_t length) {
+    int ret = msd_command(lun, cb, cb_length, direction, data, length);
+    if (ret != MSD_CSW_FAILED) return ret;
+
+    scsi_sense_t sense;
+    if (msd_requestSense(lun, &sense) == 0) {
+        LOG(ERR, "LUN %d: command 0x%x failed (sense key 0x%x, ASC 0x%x, ASCQ 0x%x)\n", lun->lun, cb[0], sense.key & 0xF, sense.asc, sense.ascq);
+    }
+
+    return -EIO;
+}
+
+/**
+ * @brief Wait for a LUN to become ready
+ * @param lun The LUN
+ * @returns 0 if the LUN is ready
+ */
+static int msd_waitReady(msd_lun_t *lun) {
+    uint8_t cb[6] = { SCSI_TEST_UNIT_READY, 0, 0, 0, 0, 0 };
+
+    for (int i = 0; i < MSD_READY_RETRIES; i++) {
+        int ret = msd_command(lun, cb, sizeof(cb), MSD_CBW_OUT, NULL, 0);
+        if (ret == 0) return 0;
+        if (ret < 0) return ret;
+
+        // Not ready or unit attention (e.g. power on) - pull the sense data and try again
+        scsi_sense_t sense;
+        if (msd_requestSense(lun, &sense)) return -EIO;
+        uint8_t key = sense.key & 0xF;
+        if (key != SCSI_SENSE_NOT_READY && key != SCSI_SENSE_UNIT_ATTENTION) {
+            LOG(ERR, "LUN %d: TEST UNIT READY failed (sense key 0x%x, ASC 0x%x)\n", lun->lun, key, sense.asc);
+            return -EIO;
+        }
+
+        clock_sleep(MSD_READY_DELAY);
+    }
+
+    return -ETIMEDOUT;
+}
+
+/**
+ * @brief Read the capacity of a LUN
+ * @param lun The LUN
+ * @returns 0 on success
+ */
+static int msd_readCapacity(msd_lun_t *lun) {
+    uint32_t capacity10[2];
+    uint8_t cb10[10] = { SCSI_READ_CAPACITY_10, 0 };
+    if (msd_commandSense(lun, cb10, sizeof(cb10), MSD_CBW_IN, capacity10, sizeof(capacity10))) return -EIO;
+
+    lun->block_size = MSD_BE32(capacity10[1]);
+    lun->block_count = (uint64_t)MSD_BE32(capacity10[0]) + 1;
+
+    // Too big for READ CAPACITY (10), ask again with the 16-byte version
+    if (MSD_BE32(capacity10[0]) == 0xFFFFFFFF) {
+        uint8_t capacity16[32];
+        uint8_t cb16[16] = { SCSI_SERVICE_ACTION_IN, 0x10, 0 };
+        cb16[13] = sizeof(capacity16);
+        if (msd_commandSense(lun, cb16, sizeof(cb16), MSD_CBW_IN, capacity16, sizeof(capacity16))) return -EIO;
+
+        uint64_t last_lba;
+        uint32_t block_size;
+        memcpy(&last_lba, capacity16, sizeof(uint64_t));
+        memcpy(&block_size, capacity16 + 8, sizeof(uint32_t));
+        lun->block_count = MSD_BE64(last_lba) + 1;
+        lun->block_size = MSD_BE32(block_size);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read or write blocks of a LUN
+ * @param lun The LUN
+ * @param write 1 to write
+ * @param block The first block
+ * @param count The amount of blocks
+ * @param buffer The buffer
+ * @returns 0 on success
+ */
+static int msd_access(msd_lun_t *lun, int write, uint64_t block, size_t count, uint8_t *buffer) {
+    uint32_t max_blocks = MSD_MAX_TRANSFER / lun->block_size;
+    if (!max_blocks) max_blocks = 1;
+
+    while (count) {
+        uint32_t blocks = (count > max_blocks) ? max_blocks : count;
+        uint8_t cb[16] = { 0 };
+        uint8_t cb_length;
+
+        if (block + blocks > 0xFFFFFFFF) {
+            // READ/WRITE (16)
+            uint64_t lba = MSD_BE64(block);
+            uint32_t length = MSD_BE32(blocks);
+            cb[0] = (write) ? SCSI_WRITE_16 : SCSI_READ_16;
+            memcpy(&cb[2], &lba, sizeof(uint64_t));
+            memcpy(&cb[10], &length, sizeof(uint32_t));
+            cb_length = 16;
+        } else {
+            // READ/WRITE (10)
+            uint32_t lba = MSD_BE32((uint32_t)block);
+            uint16_t length = MSD_BE16((uint16_t)blocks);
+            cb[0] = (write) ? SCSI_WRITE_10 : SCSI_READ_10;
+            memcpy(&cb[2], &lba, sizeof(uint32_t));
+            memcpy(&cb[7], &length, sizeof(uint16_t));
+            cb_length = 10;
+        }
+
+        if (msd_commandSense(lun, cb, cb_length, (write) ? MSD_CBW_OUT : MSD_CBW_IN, buffer, blocks * lun->block_size)) {
+            LOG(ERR, "LUN %d: %s of %d blocks at LBA %llu failed\n", lun->lun, (write) ? "write" : "read", blocks, block);
+            return -EIO;
+        }
+
+        block += blocks;
+        count -= blocks;
+        buffer += blocks * lun->block_size;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Block cache read method
+ */
+static int msd_readBlocks(void *dev, uint64_t block, size_t count, uint8_t *buffer) {
+    return msd_access((msd_lun_t*)dev, 0, block, count, buffer);
+}
+
+/**
+ * @brief Block cache write method
+ */
+static int msd_writeBlocks(void *dev, uint64_t block, size_t count, uint8_t *buffer) {
+    return msd_access((msd_lun_t*)dev, 1, block, count, buffer);
+}
+
+/**
+ * @brief VFS read method for mass-storage LUNs
+ */
+ssize_t msd_readFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    msd_lun_t *lun = (msd_lun_t*)node->dev;
+    if (!lun || !lun->cache) return 0;
+
+    return bcache_read(lun->cache, offset, size, buffer);
+}
+
+/**
+ * @brief VFS write method for mass-storage LUNs
+ */
+ssize_t msd_writeFS(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    msd_lun_t *lun = (msd_lun_t*)node->dev;
+    if (!lun || !lun->cache) return 0;
+
+    return bcache_write(lun->cache, offset, size, buffer);
+}
+
+/**
+ * @brief VFS read-ahead method for mass-storage LUNs
+ */
+int msd_readaheadFS(fs_node_t *node, off_t offset, size_t size) {
+    msd_lun_t *lun = (msd_lun_t*)node->dev;
+    if (!lun || !lun->cache) return -EINVAL;
+
+    bcache_prefetch(lun->cache, offset, size);
+    return 0;
+}
+
+/**
+ * @brief Create a block node for a LUN
+ * @param lun The LUN
+ */
+static fs_node_t *msd_createNode(msd_lun_t *lun) {
+    fs_node_t *out = kmalloc(sizeof(fs_node_t));
+    memset(out, 0, sizeof(fs_node_t));
+
+    snprintf(out->name, 256, "usbdisk%i", msd_index++);
+    out->read = msd_readFS;
+    out->write = msd_writeFS;
+    out->readahead = msd_readaheadFS;
+    out->flags = VFS_BLOCKDEVICE;
+    out->mask = 0770;
+    out->length = lun->block_count * lun->block_size;
+    out->dev = (void*)lun;
+
+    lun->cache = bcache_createDevice(lun->product, (void*)lun, lun->block_size, lun->block_count, msd_readBlocks, msd_writeBlocks);
+    return out;
+}
+
+/**
+ * @brief Copy a space-padded SCSI string
+ */
+static void msd_copyString(char *dest, char *src, size_t length) {
+    memcpy(dest, src, length);
+    dest[length] = 0;
+    for (int i = length - 1; i >= 0 && dest[i] == ' '; i--) dest[i] = 0;
+}
+
+/**
+ * @brief Initialize a LUN
+ * @param msd The device
+ * @param number The LUN number
+ * @returns The LUN or NULL
+ */
+static msd_lun_t *msd_initializeLUN(msd_device_t *msd, uint8_t number) {
+    msd_lun_t *lun = kmalloc(sizeof(msd_lun_t));
+    memset(lun, 0, sizeof(msd_lun_t));
+    lun->msd = msd;
+    lun->lun = number;
+
+    scsi_inquiry_t inquiry;
+    uint8_t cb[6] = { SCSI_INQUIRY, 0, 0, 0, sizeof(scsi_inquiry_t), 0 };
+    if (msd_commandSense(lun, cb, sizeof(cb), MSD_CBW_IN, &inquiry, sizeof(scsi_inquiry_t))) {
+        LOG(ERR, "LUN %d: INQUIRY failed\n", number);
+        goto _error;
+    }
+
+    // Only direct-access block devices
+    if ((inquiry.type & 0x1F) != 0x00) {
+        LOG(INFO, "LUN %d: peripheral type 0x%x is not supported\n", number, inquiry.type & 0x1F);
+        goto _error;
+    }
+
+    msd_copyString(lun->vendor, inquiry.vendor, 8);
+    msd_copyString(lun->product, inquiry.product, 16);
+    lun->removable = (inquiry.removable & 0x80) ? 1 : 0;
+
+    if (msd_waitReady(lun)) {
+        LOG(WARN, "LUN %d (%s %s): no medium\n", number, lun->vendor, lun->product);
+        goto _error;
+    }
+
+    if (msd_readCapacity(lun)) {
+        LOG(ERR, "LUN %d: READ CAPACITY failed\n", number);
+        goto _error;
+    }
+
+    if (!lun->block_size || BCACHE_PAGE_SIZE % lun->block_size) {
+        LOG(ERR, "LUN %d: unsupported block size %d\n", number, lun->block_size);
+        goto _error;
+    }
+
+    LOG(INFO, "LUN %d: %s %s - %llu blocks of %d bytes (%llu MB)%s\n", number, lun->vendor, lun->product, lun->block_count, lun->block_size, (lun->block_count * lun->block_size) / 1024 / 1024, (lun->removable) ? ", removable" : "");
+    return lun;
+
+_error:
+    kfree(lun);
+    return NULL;
+}
+
+/**
+ * @brief Mass-storage initialize device
+ */
+USB_STATUS msd_initializeDevice(USBInterface_t *intf) {
+    if (intf->desc.bInterfaceSubClass != MSD_SUBCLASS_SCSI || intf->desc.bInterfaceProtocol != MSD_PROTOCOL_BOT) {
+        LOG(DEBUG, "Unsupported mass-storage interface (subclass 0x%x, protocol 0x%x)\n", intf->desc.bInterfaceSubClass, intf->desc.bInterfaceProtocol);
+        return USB_FAILURE;
+    }
+
+    USBEndpoint_t *in = usb_getEndpoint(intf, USB_ENDP_BULK, USB_ENDP_IN);
+    USBEndpoint_t *out = usb_getEndpoint(intf, USB_ENDP_BULK, USB_ENDP_OUT);
+    if (!in || !out) {
+        LOG(ERR, "Mass-storage interface is missing its bulk endpoints\n");
+        return USB_FAILURE;
+    }
+
+    if (!intf->dev->bulk) {
+        LOG(ERR, "Host controller does not support bulk transfers\n");
+        return USB_FAILURE;
+    }
+
+    msd_device_t *msd = kmalloc(sizeof(msd_device_t));
+    memset(msd, 0, sizeof(msd_device_t));
+    msd->intf = intf;
+    msd->in = in;
+    msd->out = out;
+    msd->cbw = kmalloc(sizeof(msd_cbw_t));
+    msd->csw = kmalloc(sizeof(msd_csw_t));
+    msd->luns = list_create("usb storage luns");
+
+    // Devices with a single LUN may stall GET MAX LUN
+    uint8_t max_lun = 0;
+    if (usb_controlTransferInterface(intf, USB_RT_D2H | USB_RT_CLASS, MSD_REQ_GET_MAX_LUN, 0, 0, 1, &max_lun) != USB_SUCCESS) max_lun = 0;
+    msd->max_lun = (max_lun < MSD_MAX_LUNS) ? max_lun : MSD_MAX_LUNS - 1;
+
+    for (uint8_t i = 0; i <= msd->max_lun; i++) {
+        msd_lun_t *lun = msd_initializeLUN(msd, i);
+        if (!lun) continue;
+
+        lun->node = msd_createNode(lun);
+
+        char devname[64];
+        snprintf(devname, 64, "/device/%s", lun->node->name);
+        vfs_mount(lun->node, devname);
+
+        list_append(msd->luns, (void*)lun);
+    }
+
+    if (!msd->luns->length) {
+        LOG(WARN, "No usable LUNs on device\n");
+        list_destroy(msd->luns, false);
+        kfree(msd->cbw);
+        kfree(msd->csw);
+        kfree(msd);
+        return USB_FAILURE;
+    }
+
+    intf->driver->s = (void*)msd;
+    return USB_SUCCESS;
+}
+
+/**
+ * @brief Mass-storage deinitialize device
+ */
+USB_STATUS msd_deinitializeDevice(USBInterface_t *intf) {
+    // !!!: The block nodes stay mounted and the cache can't drop a device yet
+    return USB_FAILURE;
+}
+
+/**
+ * @brief Mass-storage driver initialize
+ */
+int msd_init(int argc, char **argv) {
+    USBDriver_t *driver = usb_createDriver();
+    if (!driver) {
+        LOG(ERR, "Failed to allocate driver\n");
+        return -1;
+    }
+
+    driver->name = strdup("Hexahedron USB Mass Storage Driver");
+    driver->find = kmalloc(sizeof(USBDriverFindParameters_t));
+    memset(driver->find, 0, sizeof(USBDriverFindParameters_t));
+    driver->find->classcode = MSD_CLASS_CODE;
+
+    driver->dev_init = msd_initializeDevice;
+    driver->dev_deinit = msd_deinitializeDevice;
+
+    if (usb_registerDriver(driver)) {
+        kfree(driver->name);
+        kfree(driver->find);
+        kfree(driver);
+        LOG(ERR, "Failed to register driver.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Mass-storage driver deinitialize
+ */
+int msd_deinit() {
+    return 0;
+}
+
+/* Metadata */
+struct driver_metadata driver_metadata = {
+    .name = "USB Mass Storage Driver",
+    .author = "Samuel Stuart",
+    .init = msd_init,
+    .deinit = msd_deinit
+};
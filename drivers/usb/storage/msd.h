@@ -0,0 +1,156 @@
+/**
+ * @file drivers/usb/storage/msd.h
+ * @brief USB mass-storage class driver (bulk-only transport, SCSI command set)
+ *
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef MSD_H
+#define MSD_H
+
+/**** INCLUDES ****/
+#include <kernel/drivers/usb/usb.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/fs/bcache.h>
+#include <kernel/misc/spinlock.h>
+#include <structs/list.h>
+
+/**** DEFINITIONS ****/
+
+#define MSD_CLASS_CODE          0x08
+#define MSD_SUBCLASS_SCSI       0x06    // SCSI transparent command set
+#define MSD_PROTOCOL_BOT        0x50    // Bulk-only transport
+
+// Class requests
+#define MSD_REQ_GET_MAX_LUN     0xFE
+#define MSD_REQ_RESET           0xFF    // Bulk-Only Mass Storage Reset
+
+// Command block wrapper/command status wrapper
+#define MSD_CBW_SIGNATURE       0x43425355  // "USBC"
+#define MSD_CSW_SIGNATURE       0x53425355  // "USBS"
+#define MSD_CBW_OUT             0x00
+#define MSD_CBW_IN              0x80
+
+#define MSD_CSW_PASSED          0x00
+#define MSD_CSW_FAILED          0x01
+#define MSD_CSW_PHASE_ERROR     0x02
+
+// SCSI commands
+#define SCSI_TEST_UNIT_READY    0x00
+#define SCSI_REQUEST_SENSE      0x03
+#define SCSI_INQUIRY            0x12
+#define SCSI_READ_CAPACITY_10   0x25
+#define SCSI_READ_10            0x28
+#define SCSI_WRITE_10           0x2A
+#define SCSI_SYNCHRONIZE_CACHE  0x35
+#define SCSI_READ_16            0x88
+#define SCSI_WRITE_16           0x8A
+#define SCSI_SERVICE_ACTION_IN  0x9E    // READ CAPACITY (16) is service action 0x10
+
+// Sense keys
+#define SCSI_SENSE_NOT_READY        0x02
+#define SCSI_SENSE_UNIT_ATTENTION   0x06
+
+// Limits
+#define MSD_MAX_LUNS            16      // Maximum amount of LUNs (GET MAX LUN returns at most 15)
+#define MSD_MAX_TRANSFER        65536   // Maximum amount of bytes moved by a single READ/WRITE command
+#define MSD_READY_RETRIES       20      // TEST UNIT READY attempts before giving up on a LUN
+#define MSD_READY_DELAY         50      // Delay between TEST UNIT READY attempts (ms)
+
+/**** TYPES ****/
+
+/**
+ * @brief Command block wrapper
+ */
+typedef struct msd_cbw {
+    uint32_t signature;         // MSD_CBW_SIGNATURE
+    uint32_t tag;               // Echoed back in the CSW
+    uint32_t length;            // Amount of data bytes expected
+    uint8_t flags;              // MSD_CBW_IN/MSD_CBW_OUT
+    uint8_t lun;                // Target LUN
+    uint8_t cb_length;          // Length of the command block (1-16)
+    uint8_t cb[16];             // Command block
+} __attribute__((packed)) msd_cbw_t;
+
+/**
+ * @brief Command status wrapper
+ */
+typedef struct msd_csw {
+    uint32_t signature;         // MSD_CSW_SIGNATURE
+    uint32_t tag;               // Tag of the CBW
+    uint32_t residue;           // Amount of data bytes not transferred
+    uint8_t status;             // MSD_CSW_...
+} __attribute__((packed)) msd_csw_t;
+
+/**
+ * @brief SCSI INQUIRY data (standard part)
+ */
+typedef struct scsi_inquiry {
+    uint8_t type;               // Peripheral device type (bits 0-4)
+    uint8_t removable;          // Bit 7 is RMB
+    uint8_t version;
+    uint8_t format;
+    uint8_t additional_length;
+    uint8_t flags[3];
+    char vendor[8];
+    char product[16];
+    char revision[4];
+} __attribute__((packed)) scsi_inquiry_t;
+
+/**
+ * @brief SCSI fixed format sense data
+ */
+typedef struct scsi_sense {
+    uint8_t response;           // 0x70/0x71
+    uint8_t obsolete;
+    uint8_t key;                // Sense key (bits 0-3)
+    uint8_t information[4];
+    uint8_t additional_length;
+    uint8_t command_info[4];
+    uint8_t asc;                // Additional sense code
+    uint8_t ascq;               // Additional sense code qualifier
+    uint8_t fruc;
+    uint8_t specific[3];
+} __attribute__((packed)) scsi_sense_t;
+
+/**
+ * @brief Mass-storage device (one per interface)
+ */
+typedef struct msd_device {
+    USBInterface_t *intf;       // Interface
+    USBEndpoint_t *in;          // Bulk IN endpoint
+    USBEndpoint_t *out;         // Bulk OUT endpoint
+
+    spinlock_t lock;            // Bulk-only transport runs one command at a time
+    uint32_t tag;               // Next CBW tag
+    msd_cbw_t *cbw;             // CBW buffer
+    msd_csw_t *csw;             // CSW buffer
+
+    uint8_t max_lun;            // Highest LUN
+    list_t *luns;               // LUNs (msd_lun_t)
+} msd_device_t;
+
+/**
+ * @brief Mass-storage logical unit (one block node each)
+ */
+typedef struct msd_lun {
+    msd_device_t *msd;          // Parent device
+    uint8_t lun;                // LUN number
+    uint32_t block_size;        // Block size in bytes
+    uint64_t block_count;       // Amount of blocks
+    int removable;              // Medium is removable
+
+    char vendor[9];             // Vendor identification
+    char product[17];           // Product identification
+
+    bcache_device_t *cache;     // Block cache device
+    fs_node_t *node;            // VFS node
+} msd_lun_t;
+
+#endif
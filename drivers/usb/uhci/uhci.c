@@ -2,9 +2,17 @@
  * @file drivers/uhci/uhci.c
  * @brief Universal Host Controller Interface driver
  * 
+ * Transfers are completed from the controller interrupt: the last TD of each queue head has
+ * IOC set, and the IRQ handler retires finished queue heads by checking their TDs through
+ * the virtual TD list (no physical remapping). Transfers with a callback return immediately.
+ * 
  * @warning Does not work on x86_64 for some reason
  * 
- * @todo Bulk transfers, interrupt transfers, isochronous transfers (not sure if we can do the last now)
+ * The frame list points into a tree of skeleton queue heads, one per polling interval (1ms - 128ms).
+ * Interrupt queue heads are linked after the skeleton for their interval, and every skeleton
+ * eventually falls through to the asynchronous schedule (control and bulk queue heads).
+ * 
+ * @todo Isochronous transfers (not sure if we can do these now)
  * 
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
@@ -29,24 +37,35 @@
 #include <kernel/panic.h>
 #include <string.h>
 
+// Architecture-specific
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/registers.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/registers.h>
+#endif
+
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "DRIVER:UHCI", __VA_ARGS__)
 
 /* Lock */
 static spinlock_t uhci_lock = { 0 };
 
+/* Controller (for the IRQ handler) */
+static USBController_t *uhci_controller = NULL;
+
+/* PCI match table (serial bus controller, USB, UHCI interface) */
+static pci_match_t uhci_match[] = {
+    PCI_MATCH_CLASS(0x0C03, 0x00),
+    PCI_MATCH_END
+};
+
 /**
- * @brief UHCI controller find method
+ * @brief UHCI controller probe method
  * @param data Pointer to a uint32_t that will store the PCI_ADDR()
  */
-int uhci_find(uint8_t bus, uint8_t slot, uint8_t function, uint16_t vendor_id, uint16_t device_id, void *data) {
-    // We know this device is of type 0x0C03, but it's only UHCI if the interface is 0x00
-    if (pci_readConfigOffset(bus, slot, function, PCI_PROGIF_OFFSET, 1) == 0x00) {
-        *((uint32_t*)data) = PCI_ADDR(bus, slot, function, 0x0);
-        return 1; // Found it
-    }
-
-    return 0;
+int uhci_find(pci_device_t *dev, void *data) {
+    *((uint32_t*)data) = PCI_ADDR(dev->bus, dev->slot, dev->function, 0x0);
+    return 1; // Found it
 }
 
 /**
@@ -156,9 +175,28 @@ void uhci_destroyQH(USBController_t *controller, uhci_qh_t *qh) {
         // Delete from the list
         list_delete(hc->qh_list, node);
     } else {
-        LOG(WARN, "Tried to destroy queue head that is not apart of HC list\n");
+        // Maybe it's an interrupt queue head
+        for (int level = 0; level < UHCI_PERIODIC_LEVELS && !node; level++) {
+            node = list_find(hc->interrupt_list[level], (void*)qh);
+            if (!node) continue;
+
+            // Whatever was before us now links to wherever we linked to (one 32-bit store, so the controller never sees a torn link)
+            uhci_qh_t *qh_prev = (node->prev) ? (uhci_qh_t*)node->prev->value : hc->periodic[level];
+            __atomic_store_n(&qh_prev->qh_link.raw, qh->qh_link.raw, __ATOMIC_RELEASE);
+            list_delete(hc->interrupt_list[level], node);
+        }
+
+        if (!node) LOG(WARN, "Tried to destroy queue head that is not apart of HC list\n");
     }
 
+    spinlock_release(&uhci_lock);
+
+    // The controller may still be working on this queue head in the current frame
+    uint16_t frame = inportw(hc->io_addr + UHCI_REG_FRNUM);
+    for (int i = 0; i < 100000 && inportw(hc->io_addr + UHCI_REG_FRNUM) == frame; i++) asm volatile ("pause" ::: "memory");
+
+    spinlock_acquire(&uhci_lock);
+
     // Zero the queue element pointer
     qh->qe_link.terminate = 1;
     qh->qe_link.qelp = 0;
@@ -179,6 +217,47 @@ void uhci_destroyQH(USBController_t *controller, uhci_qh_t *qh) {
     spinlock_release(&uhci_lock);
 }
 
+/**
+ * @brief Insert a queue head at the end of the asynchronous (control/bulk) schedule
+ * @param hc The host controller
+ * @param qh The queue head to insert. Its TDs should be fully built
+ */
+static void uhci_insertAsync(uhci_t *hc, uhci_qh_t *qh) {
+    spinlock_acquire(&uhci_lock);
+    uhci_qh_t *current = (uhci_qh_t*)hc->qh_list->tail->value;
+    QH_LINK_QH(current, qh);
+    list_append(hc->qh_list, (void*)qh);
+    spinlock_release(&uhci_lock);
+}
+
+/**
+ * @brief Get the periodic schedule level for an endpoint interval
+ * @param interval bInterval of the endpoint (in frames)
+ * @returns The deepest level that still polls at least as often as requested
+ */
+static int uhci_periodicLevel(uint8_t interval) {
+    int level = 0;
+    while (level < UHCI_PERIODIC_LEVELS - 1 && (2 << level) <= interval) level++;
+    return level;
+}
+
+/**
+ * @brief Insert a queue head into the periodic schedule
+ * @param hc The host controller
+ * @param qh The queue head to insert. Its TDs should be fully built
+ * @param level The level to insert at (see @c uhci_periodicLevel)
+ */
+static void uhci_insertPeriodic(uhci_t *hc, uhci_qh_t *qh, int level) {
+    spinlock_acquire(&uhci_lock);
+
+    // Link the queue head to whatever the end of this level links to, then publish it
+    uhci_qh_t *prev = (hc->interrupt_list[level]->tail) ? (uhci_qh_t*)hc->interrupt_list[level]->tail->value : hc->periodic[level];
+    qh->qh_link.raw = prev->qh_link.raw;
+    __atomic_store_n(&prev->qh_link.raw, (LINK(qh) << 4) | 0x2, __ATOMIC_RELEASE);
+    list_append(hc->interrupt_list[level], (void*)qh);
+
+    spinlock_release(&uhci_lock);
+}
 
 /**
  * @brief Write to a port (PORTSC1 or PORTSC2)
@@ -211,128 +290,322 @@ void uhci_clearPort(uint32_t port, uint16_t data)  {
 }
 
 /**
- * @brief Probe for UHCI devices
- * @param controller The USB controller to probe devices from
+ * @brief Root hub port status method
+ */
+static int uhci_portStatus(USBPortHub_t *hub, uint32_t port, int *speed) {
+    uhci_t *hc = HC(hub->c);
+    uint32_t port_addr = hc->io_addr + UHCI_REG_PORTSC1 + (port*2);
+
+    uint16_t status = inportw(port_addr);
+    if (status & UHCI_PORT_RWC) uhci_clearPort(port_addr, UHCI_PORT_RWC);
+
+    *speed = (status & UHCI_PORT_LSDA) ? USB_LOW_SPEED : USB_FULL_SPEED;
+    return ((status & UHCI_PORT_CONNECTION) ? USB_PORT_CONNECTED : 0) |
+            ((status & UHCI_PORT_ENABLE) ? USB_PORT_ENABLED : 0) |
+            ((status & UHCI_PORT_CONNECTION_CHANGE) ? USB_PORT_CONNECT_CHANGE : 0);
+}
+
+/**
+ * @brief Root hub port reset method
+ */
+static void uhci_portReset(USBPortHub_t *hub, uint32_t port, int reset) {
+    uhci_t *hc = HC(hub->c);
+    uint32_t port_addr = hc->io_addr + UHCI_REG_PORTSC1 + (port*2);
+
+    if (reset) {
+        LOG(DEBUG, "UHCI resetting port %d\n", port);
+        uhci_writePort(port_addr, UHCI_PORT_RESET);
+        return;
+    }
+
+    uhci_clearPort(port_addr, UHCI_PORT_RESET);
+
+    // The port has to be enabled by hand once the reset is over, which can take a few tries
+    for (int i = 0; i < 10; i++) {
+        uint16_t status = inportw(port_addr);
+        if (!(status & UHCI_PORT_CONNECTION) || (status & UHCI_PORT_ENABLE)) break;
+
+        if (status & UHCI_PORT_RWC) uhci_clearPort(port_addr, UHCI_PORT_RWC);
+        uhci_writePort(port_addr, UHCI_PORT_ENABLE);
+        clock_sleep(1);
+    }
+}
+
+/**
+ * @brief Root hub port attach method
+ */
+static USBDevice_t *uhci_portAttach(USBPortHub_t *hub, uint32_t port, int speed) {
+    LOG(DEBUG, "Found a UHCI device connected to port %i\n", port);
+
+    USBDevice_t *dev = usb_createDevice(hub->c, port, speed, uhci_control);
+    dev->mps = 8; // TODO: Bochs says to make this equal the mps corresponding to the speed of the device
+    dev->bulk = uhci_bulk;
+    dev->interrupt = uhci_interrupt;
+
+    if (usb_initializeDevice(dev)) {
+        LOG(ERR, "Failed to initialize UHCI device\n");
+        usb_destroyDevice(hub->c, dev);
+        return NULL;
+    }
+
+    return dev;
+}
+
+/**
+ * @brief UHCI poll method (clock interrupt)
  * 
- * @returns The number of found devices
+ * UHCI has no port change interrupt, so the status change bits are checked every tick
+ * and handed to the port engine (which acknowledges them).
  */
-int uhci_probe(USBController_t *controller) {
+static void uhci_poll(USBController_t *controller) {
     uhci_t *hc = HC(controller);
-    if (!hc) return 0;
+    if (!hc || !hc->ports) return;
 
-    int found_ports = 0;
+    for (uint32_t port = 0; port < UHCI_PORT_COUNT; port++) {
+        if (inportw(hc->io_addr + UHCI_REG_PORTSC1 + (port*2)) & UHCI_PORT_RWC) usb_portEvent(hc->ports, port);
+    }
+}
 
-    // UHCI controllers have a max of 2 ports directly connected
-    for (uint32_t port = 0; port < 2; port++) {
-        // Get the PORTSC address
-        uint32_t port_addr = UHCI_REG_PORTSC1 + (port*2);
+/**
+ * @brief Check the state of a queue head's transfer descriptors
+ * @param qh The queue head to check
+ * @param transfer The transfer of the queue head (actual_length is updated)
+ * 
+ * Runs from the IRQ handler, so it doesn't log. A stalled TD keeps its status for @c uhci_logErrors.
+ * 
+ * @returns USB_TRANSFER_IN_PROGRESS, USB_TRANSFER_SUCCESS or USB_TRANSFER_FAILED
+ */
+static int uhci_checkQH(uhci_qh_t *qh, USBTransfer_t *transfer) {
+    uint32_t actual = 0;
 
-        // We can probe for devices by resetting the port and checking if CONNECTION_CHANGE was set
-        LOG(DEBUG, "UHCI resetting port 0x%x\n", hc->io_addr + port);
-        uhci_writePort(hc->io_addr + port_addr, UHCI_PORT_RESET);
-        clock_sleep(100);   // Wait 100ms for the port to reset
-        uhci_clearPort(hc->io_addr + port_addr, UHCI_PORT_RESET);
+    // The controller writes back the status of each TD, so we can just read the virtual TDs
+    foreach(td_node, qh->td_list) {
+        uhci_td_t *td = (uhci_td_t*)td_node->value;
+        uint32_t cs = *(volatile uint32_t*)&td->cs.raw;
 
-        int port_enabled = 0;
+        if (cs & UHCI_TD_STATUS_STALLED) {
+            transfer->actual_length = actual;
+            return USB_TRANSFER_FAILED;
+        }
 
-        // Now we can wait ~200ms (it's required to wait at least 100ms) while checking the status
-        uint16_t status; // This will be used to determine the speed of the port
-        for (int i = 0; i < 20; i++) {
-            clock_sleep(10); // Sleep 10ms
+        // The controller processes the TDs in order, so an active TD means we aren't done
+        if (cs & UHCI_TD_STATUS_ACTIVE) return USB_TRANSFER_IN_PROGRESS;
 
-            // Read the status and check if a connection change has occurred
-            status = inportw(hc->io_addr + port_addr);
-            if (!(status & UHCI_PORT_CONNECTION)) {
-                break;
-            }
+        if (td->token.pid == UHCI_PACKET_SETUP) continue;
+        uint32_t length = UHCI_TD_ACTLEN(cs);
+        actual += length;
 
-            // Acknowledge an RWC if necessary
-            if (status & UHCI_PORT_RWC) {
-                uhci_clearPort(hc->io_addr + port_addr, UHCI_PORT_RWC);
-                continue;
-            }
+        // A short packet ends the transfer early, so the next packet reuses this TD's toggle
+        if ((cs & UHCI_TD_SPD) && length < UHCI_TD_ACTLEN(td->token.maxlen)) {
+            if (transfer->endp) transfer->endp->toggle = td->token.d ^ 1;
+            break;
+        }
+    }
 
-            // Has the port completed its enabling process?
-            if (status & UHCI_PORT_ENABLE) {
-                // Port enabled
-                port_enabled = 1;
-                break;
-            }
+    transfer->actual_length = actual;
+    return USB_TRANSFER_SUCCESS;
+}
 
-            // Nope, enable the port
-            uhci_writePort(hc->io_addr + port_addr, UHCI_PORT_ENABLE);
+/**
+ * @brief Log errors the IRQ handler ran into
+ * 
+ * Nothing logs from IRQ context (the CPU may have been interrupted while holding the debug lock),
+ * so whoever finishes off a queue head reports what went wrong.
+ * 
+ * @param hc The host controller
+ * @param qh A queue head to look for a stalled TD in, or NULL
+ */
+static void uhci_logErrors(uhci_t *hc, uhci_qh_t *qh) {
+    uint16_t status = __atomic_exchange_n(&hc->errors, 0, __ATOMIC_ACQ_REL);
+    if (status & UHCI_STS_HSE) LOG(ERR, "Host system error (USBSTS 0x%x)\n", status);
+    if (status & UHCI_STS_HCPE) LOG(ERR, "Host controller process error (USBSTS 0x%x)\n", status);
+
+    if (!qh) return;
+
+    foreach(td_node, qh->td_list) {
+        uhci_td_t *td = (uhci_td_t*)td_node->value;
+        uint32_t cs = *(volatile uint32_t*)&td->cs.raw;
+
+        if (cs & UHCI_TD_STATUS_STALLED) {
+            LOG(ERR, "UHCI controller detected a fatal TD stall - transfer terminated\n");
+            LOG(ERR, "Transfer terminated - TD %p (PID 0x%x) status 0x%x\n", td, td->token.pid, (cs >> 17) & 0x7F);
+            break;
         }
+    }
+}
 
-        if (port_enabled) {
-            // The port was successfully enabled
-            found_ports++;
-            LOG(DEBUG, "Found a UHCI device connected to port %i\n", port);
-
-            // Now, we need to initialize the device connected to the port
-            USBDevice_t *dev = usb_createDevice(controller, port, (status & UHCI_PORT_LSDA) ? USB_LOW_SPEED : USB_FULL_SPEED, uhci_control);
-            dev->mps = 8; // TODO: Bochs says to make this equal the mps corresponding to the speed of the device
- 
-            if (usb_initializeDevice(dev)) {
-                LOG(ERR, "Failed to initialize UHCI device\n");
-                
-                usb_destroyDevice(controller, dev);
-                found_ports--;
-                break;
-            }
+/**
+ * @brief Rearm the TDs of a repeating transfer
+ * @param qh The queue head to rearm
+ * @param endp The endpoint the queue head belongs to (for data toggles)
+ */
+static void uhci_rearmQH(uhci_qh_t *qh, USBEndpoint_t *endp) {
+    foreach(td_node, qh->td_list) {
+        uhci_td_t *td = (uhci_td_t*)td_node->value;
+        td->token.d = endp->toggle;
+        endp->toggle ^= 1;
+
+        // Keep the static bits (IOC, SPD, LS, ISO), reset the error count and status
+        uint32_t cs = td->cs.raw & ((1 << 24) | (1 << 25) | (1 << 26) | UHCI_TD_SPD);
+        td->cs.raw = cs | (3 << 27) | UHCI_TD_STATUS_ACTIVE;
+    }
+
+    // Point the queue head back at the first TD only once the TDs are ready
+    uhci_td_t *first = (uhci_td_t*)qh->td_list->head->value;
+    __atomic_store_n(&qh->qe_link.raw, LINK(first) << 4, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Retire all completed queue heads
+ * @param hc The host controller
+ * 
+ * Safe to call from IRQ context - this does not take any locks or free any memory.
+ * Queue heads of asynchronous transfers are left in their slot for @c uhci_reapQHs
+ */
+static void uhci_retireQHs(uhci_t *hc) {
+    for (int i = 0; i < UHCI_MAX_INFLIGHT; i++) {
+        uhci_qh_t *qh = __atomic_load_n(&hc->inflight[i], __ATOMIC_ACQUIRE);
+        if (!qh) continue;
+
+        USBTransfer_t *transfer = __atomic_load_n(&qh->transfer, __ATOMIC_ACQUIRE);
+        if (!transfer || __atomic_load_n(&transfer->status, __ATOMIC_ACQUIRE) != USB_TRANSFER_IN_PROGRESS) continue;
+
+        int status = uhci_checkQH(qh, transfer);
+        if (status == USB_TRANSFER_IN_PROGRESS) continue;
+
+        // Claim the transfer so it is only completed once (the IRQ handler and a poller may race)
+        int expected = USB_TRANSFER_IN_PROGRESS;
+        if (!__atomic_compare_exchange_n(&transfer->status, &expected, status, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) continue;
+
+        // Synchronous waiters destroy the queue head themselves
+        if (!transfer->callback) continue;
+        transfer->callback(transfer);
+
+        if ((transfer->flags & USB_TRANSFER_REPEAT) && transfer->endp && status == USB_TRANSFER_SUCCESS) {
+            // Go again with the same TDs
+            uhci_rearmQH(qh, transfer->endp);
+            transfer->actual_length = 0;
+            __atomic_store_n(&transfer->status, USB_TRANSFER_IN_PROGRESS, __ATOMIC_RELEASE);
+        } else {
+            // Leave it for the reaper
+            __atomic_store_n(&qh->transfer, NULL, __ATOMIC_RELEASE);
         }
     }
+}
 
-    LOG(INFO, "Successfully initialized %i devices\n", found_ports);
-    return found_ports;
+/**
+ * @brief Destroy the queue heads of completed asynchronous transfers
+ * @param controller The controller
+ * @warning Not safe to call from IRQ context
+ */
+static void uhci_reapQHs(USBController_t *controller) {
+    uhci_t *hc = HC(controller);
+
+    for (int i = 0; i < UHCI_MAX_INFLIGHT; i++) {
+        uhci_qh_t *qh = __atomic_load_n(&hc->inflight[i], __ATOMIC_ACQUIRE);
+        if (!qh || __atomic_load_n(&qh->transfer, __ATOMIC_ACQUIRE)) continue;
+
+        // Only one reaper gets the slot
+        if (!__atomic_compare_exchange_n(&hc->inflight[i], &qh, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) continue;
+        uhci_logErrors(hc, qh);
+        uhci_destroyQH(controller, qh);
+    }
 }
 
 /**
- * @brief Wait for a queue head to complete its transfer
+ * @brief Track a queue head so the IRQ handler can complete it
  * @param controller The controller
- * @param qh The queue head to watch
+ * @param qh The queue head to track
  * 
- * @returns Nothing, but sets transfer status to USB_TRANSFER_SUCCESS or USB_TRANSFER_FAILED
+ * @returns The slot the queue head was placed in
  */
-void uhci_waitForQH(USBController_t *controller, uhci_qh_t *qh) {
-    if (!controller || !qh || !controller->hc) return;
-    USBTransfer_t *transfer = qh->transfer;
-
-    
+static int uhci_trackQH(USBController_t *controller, uhci_qh_t *qh) {
+    uhci_t *hc = HC(controller);
 
-    // The UHCI controller will update the queue head's link pointer to be the link pointer of the next TD it is processing
-    // Therefore when it reaches the end it should point to 0x0, as that is the terminating TD's link pointer.
-    if (qh->qe_link.qelp == 0x0) {
-        // Finished!
-        transfer->status = USB_TRANSFER_SUCCESS;
-    } else {
-        // TODO: There has to be a better way to do this (specifically in Hexahedron terms), as mem_remapPhys sucks in i386.
-        uhci_td_t *td_remapped = (uhci_td_t*)mem_remapPhys((uintptr_t)(qh->qe_link.qelp << 4), sizeof(uhci_td_t));
-        
-        if (!(td_remapped->cs.active)) {
-            // The TD was marked as not active?
-            if (td_remapped->cs.stalled) {
-                // Stalled :(
-                LOG(ERR, "UHCI controller detected a fatal TD stall - transfer terminated\n");
-                LOG(ERR, "Transfer terminated - controller could not process physical TD %p (PID 0x%x)\n", qh->qe_link.qelp << 4, td_remapped->token.pid);
-                transfer->status = USB_TRANSFER_FAILED;
+    for (;;) {
+        spinlock_acquire(&uhci_lock);
+        for (int i = 0; i < UHCI_MAX_INFLIGHT; i++) {
+            if (!hc->inflight[i]) {
+                __atomic_store_n(&hc->inflight[i], qh, __ATOMIC_RELEASE);
+                spinlock_release(&uhci_lock);
+                return i;
             }
+        }
+        spinlock_release(&uhci_lock);
 
-            // TODO: Add more errors to print out
+        // Every slot is taken, wait for something to finish
+        uhci_retireQHs(hc);
+        uhci_reapQHs(controller);
+        asm volatile ("pause" ::: "memory");
+    }
+}
+
+/**
+ * @brief UHCI IRQ handler
+ */
+int uhci_irqHandler(uintptr_t exception_index, uintptr_t interrupt_no, registers_t *regs, extended_registers_t *extended) {
+    if (!uhci_controller) return IRQ_UNHANDLED;
+    uhci_t *hc = HC(uhci_controller);
+
+    // The line may be shared with another device
+    uint16_t status = inportw(hc->io_addr + UHCI_REG_USBSTS);
+    if (!(status & (UHCI_STS_USBINT | UHCI_STS_ERROR | UHCI_STS_HSE | UHCI_STS_HCPE))) return IRQ_UNHANDLED;
+
+    // Acknowledge (write 1 to clear)
+    outportw(hc->io_addr + UHCI_REG_USBSTS, status);
+
+    // Logged later by uhci_logErrors
+    if (status & (UHCI_STS_HSE | UHCI_STS_HCPE)) __atomic_or_fetch(&hc->errors, status & (UHCI_STS_HSE | UHCI_STS_HCPE), __ATOMIC_RELEASE);
+
+    uhci_retireQHs(hc);
+    return IRQ_HANDLED;
+}
+
+/**
+ * @brief Wait for a synchronous transfer to finish and destroy its queue head
+ * @param controller The controller
+ * @param qh The queue head of the transfer
+ * @param slot The inflight slot of the queue head
+ * 
+ * @returns The transfer status
+ */
+static int uhci_waitQH(USBController_t *controller, uhci_qh_t *qh, int slot) {
+    uhci_t *hc = HC(controller);
+    USBTransfer_t *transfer = qh->transfer;
+
+    // If we don't have an IRQ we have to poll, otherwise only poll occasionally in case an interrupt was lost.
+    unsigned int spins = 0;
+    while (__atomic_load_n(&transfer->status, __ATOMIC_ACQUIRE) == USB_TRANSFER_IN_PROGRESS) {
+        if (!hc->irq_enabled || ++spins >= UHCI_POLL_INTERVAL) {
+            uhci_retireQHs(hc);
+            spins = 0;
         }
 
-        mem_unmapPhys((uintptr_t)td_remapped, sizeof(uhci_td_t));
+        asm volatile ("pause" ::: "memory");
     }
-} 
 
+    // Report what went wrong and destroy the queue head
+    uhci_logErrors(hc, (transfer->status != USB_TRANSFER_SUCCESS) ? qh : NULL);
+    __atomic_store_n(&hc->inflight[slot], NULL, __ATOMIC_RELEASE);
+    uhci_destroyQH(controller, qh); 
 
+    return transfer->status;
+}
 
 /**
  * @brief UHCI control transfer method
+ * 
+ * If @c transfer->callback is set this returns @c USB_TRANSFER_IN_PROGRESS and the callback
+ * is called (possibly from IRQ context) once the transfer completes.
  */
 int uhci_control(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer) {
     if (!controller || !dev || !transfer || !controller->hc) return USB_TRANSFER_FAILED;
     uhci_t *hc = HC(controller);
 
+    // Clean up any asynchronous transfers that finished
+    uhci_reapQHs(controller);
+    transfer->status = USB_TRANSFER_IN_PROGRESS;
+
     // A CONTROL transfer consists of 3 parts:
     // 1. A SETUP packet that details the transaction
     // 2. Some DATA packets that convey transfer->data in terms of dev->mps
@@ -381,25 +654,147 @@ int uhci_control(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *t
 
     TD_LINK_TD(qh, last, td_status);
     TD_LINK_TERM(td_status);
+    td_status->cs.ioc = 1; // Raise an interrupt when the transfer completes
+
+    // Track it before the controller can see it
+    int slot = uhci_trackQH(controller, qh);
 
     // Insert it into the chain
-    spinlock_acquire(&uhci_lock);
-    uhci_qh_t *current = (uhci_qh_t*)hc->qh_list->tail->value;
-    QH_LINK_QH(current, qh);
-    list_append(hc->qh_list, (void*)qh);
-    spinlock_release(&uhci_lock);
+    uhci_insertAsync(hc, qh);
+
+    // Asynchronous transfers are completed by the IRQ handler
+    if (transfer->callback) return USB_TRANSFER_IN_PROGRESS;
 
     // Wait for the transfer to finish
-    while (transfer->status == USB_TRANSFER_IN_PROGRESS) {
-        uhci_waitForQH(controller, qh);
+    return uhci_waitQH(controller, qh, slot);
+}
+
+/**
+ * @brief Build a queue head with a chain of data TDs for a bulk/interrupt transfer
+ * @param hc The host controller
+ * @param dev The device
+ * @param transfer The transfer
+ * @param data The part of the transfer buffer to put on this queue head
+ * @param length The length of @p data (at most @c UHCI_MAX_CHAIN_TDS packets)
+ * 
+ * @returns A queue head that is not yet scheduled
+ */
+static uhci_qh_t *uhci_createDataQH(uhci_t *hc, USBDevice_t *dev, USBTransfer_t *transfer, uint8_t *data, uint32_t length) {
+    USBEndpoint_t *endp = transfer->endp;
+    uint32_t mps = endp->desc.wMaxPacketSize & 0x7FF;
+    if (!mps) mps = 8;
+    int in = (endp->desc.bEndpointAddress & USB_ENDP_DIRECTION) == USB_ENDP_IN;
+
+    uhci_qh_t *qh = uhci_createQH(hc);
+    qh->transfer = transfer;
+    QH_LINK_TERM(qh);
+
+    // Chain one TD per packet, carrying the endpoint's data toggle along
+    uint8_t *buffer = data;
+    uint8_t *buffer_end = data + length;
+    uhci_td_t *last = NULL;
+    do {
+        uint32_t transaction_size = buffer_end - buffer;
+        if (transaction_size > mps) transaction_size = mps;
+
+        uhci_td_t *td = uhci_createTD(hc, dev->speed, endp->toggle, dev->address, transfer->endpoint,
+                                        in ? UHCI_PACKET_IN : UHCI_PACKET_OUT, transaction_size,
+                                        transaction_size ? (void*)mem_getPhysicalAddress(NULL, (uintptr_t)buffer) : NULL);
+        if (in) td->cs.spd = 1; // Stop on short packets
+        endp->toggle ^= 1;
+
+        if (last) {
+            TD_LINK_TD(qh, last, td);
+        } else {
+            QH_LINK_TD(qh, td);
+        }
+
+        buffer += transaction_size;
+        last = td;
+    } while (buffer < buffer_end);
+
+    TD_LINK_TERM(last);
+    last->cs.ioc = 1;
+    return qh;
+}
+
+/**
+ * @brief UHCI bulk transfer method
+ * 
+ * Synchronous transfers larger than @c UHCI_MAX_CHAIN_TDS packets are split into several queue heads.
+ * Asynchronous transfers are limited to a single queue head.
+ */
+int uhci_bulk(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer) {
+    if (!controller || !dev || !transfer || !transfer->endp || !controller->hc) return USB_TRANSFER_FAILED;
+    uhci_t *hc = HC(controller);
+
+    uint32_t mps = transfer->endp->desc.wMaxPacketSize & 0x7FF;
+    uint32_t chunk = (mps ? mps : 8) * UHCI_MAX_CHAIN_TDS;
+
+    // Clean up any asynchronous transfers that finished
+    uhci_reapQHs(controller);
+
+    if (transfer->callback) {
+        if (transfer->length > chunk) {
+            LOG(ERR, "Asynchronous bulk transfer of %d bytes is too large (maximum %d)\n", transfer->length, chunk);
+            return USB_TRANSFER_FAILED;
+        }
+
+        transfer->status = USB_TRANSFER_IN_PROGRESS;
+        uhci_qh_t *qh = uhci_createDataQH(hc, dev, transfer, (uint8_t*)transfer->data, transfer->length);
+        uhci_trackQH(controller, qh);
+        uhci_insertAsync(hc, qh);
+        return USB_TRANSFER_IN_PROGRESS;
     }
 
-    // Destroy the queue head
-    uhci_destroyQH(controller, qh); 
+    uint32_t total = 0;
+    do {
+        uint32_t size = transfer->length - total;
+        if (size > chunk) size = chunk;
 
+        transfer->status = USB_TRANSFER_IN_PROGRESS;
+        uhci_qh_t *qh = uhci_createDataQH(hc, dev, transfer, (uint8_t*)transfer->data + total, size);
+        int slot = uhci_trackQH(controller, qh);
+        uhci_insertAsync(hc, qh);
+
+        if (uhci_waitQH(controller, qh, slot) != USB_TRANSFER_SUCCESS) break;
+        total += transfer->actual_length;
+
+        // Short packet, the device has nothing more for us
+        if (transfer->actual_length < size) break;
+    } while (total < transfer->length);
+
+    transfer->actual_length = total;
     return transfer->status;
 }
 
+/**
+ * @brief UHCI interrupt transfer method
+ * 
+ * The queue head is placed in the periodic schedule at the level matching the endpoint's bInterval.
+ */
+int uhci_interrupt(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer) {
+    if (!controller || !dev || !transfer || !transfer->endp || !controller->hc) return USB_TRANSFER_FAILED;
+    uhci_t *hc = HC(controller);
+
+    uint32_t mps = transfer->endp->desc.wMaxPacketSize & 0x7FF;
+    if (transfer->length > (mps ? mps : 8) * UHCI_MAX_CHAIN_TDS) {
+        LOG(ERR, "Interrupt transfer of %d bytes is too large\n", transfer->length);
+        return USB_TRANSFER_FAILED;
+    }
+
+    // Clean up any asynchronous transfers that finished
+    uhci_reapQHs(controller);
+
+    transfer->status = USB_TRANSFER_IN_PROGRESS;
+    uhci_qh_t *qh = uhci_createDataQH(hc, dev, transfer, (uint8_t*)transfer->data, transfer->length);
+    int slot = uhci_trackQH(controller, qh);
+    uhci_insertPeriodic(hc, qh, uhci_periodicLevel(transfer->endp->desc.bInterval));
+
+    if (transfer->callback) return USB_TRANSFER_IN_PROGRESS;
+    return uhci_waitQH(controller, qh, slot);
+}
+
 
 
 
@@ -410,7 +805,7 @@ int uhci_control(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *t
 int uhci_init(int argc, char **argv) {
     // Scan and find the UHCI PCI device
     uint32_t uhci_pci = 0xFFFFFFFF;
-    if (pci_scan(uhci_find, (void*)(&uhci_pci), 0x0C03) == 0) {
+    if (pci_probe(uhci_match, uhci_find, (void*)(&uhci_pci)) == 0) {
         LOG(INFO, "No UHCI controller found\n");
         return 0;
     }
@@ -460,23 +855,37 @@ int uhci_init(int argc, char **argv) {
     QH_LINK_TERM(qh);
     qh->qe_link.terminate = 1; // Terminate the QE list
 
-    // This queue head that was just created will serve as the first queue head of all transactions
+    // This queue head that was just created will serve as the first queue head of all asynchronous transactions
     // When a new transaction is created, it will be linked to that transaction's queue head and have its terminate bit disabled.
     // When a transaction is completed (and that transaction was the last one), it will have its terminate bit reset.
 
-    // Make frame list skeleton
-    for (int i = 0; i < 1024; i++) {
+    // Create the periodic skeleton. Each level links to the next more frequent one, and level 0 (every frame)
+    // falls through to the asynchronous schedule.
+    for (int level = 0; level < UHCI_PERIODIC_LEVELS; level++) {
+        hc->periodic[level] = uhci_createQH(hc);
+        hc->periodic[level]->qe_link.terminate = 1;
+        hc->interrupt_list[level] = list_create("uhci interrupt list");
+
+        if (level) {
+            QH_LINK_QH(hc->periodic[level], hc->periodic[level-1]);
+        } else {
+            QH_LINK_QH(hc->periodic[level], qh);
+        }
+    }
+
+    // Make frame list skeleton - frame i enters the tree at the least frequent level that divides it
+    for (int i = 0; i < UHCI_FRAME_COUNT; i++) {
+        int level = (i) ? __builtin_ctz(i) : UHCI_PERIODIC_LEVELS - 1;
+        if (level > UHCI_PERIODIC_LEVELS - 1) level = UHCI_PERIODIC_LEVELS - 1;
+
         hc->frame_list[i].qh = 1;
-        hc->frame_list[i].flp = LINK(qh);
+        hc->frame_list[i].flp = LINK(hc->periodic[level]);
         hc->frame_list[i].terminate = 0;
     }
 
-    // Mark entry 1024 as terminate
-    hc->frame_list[1023].terminate = 1;
-
     // Configure the UHCI controller
     outportw(hc->io_addr + UHCI_REG_LEGSUP, 0x8F00);        // Disable legacy support
-    outportw(hc->io_addr + UHCI_REG_USBINTR, 0x0);          // Disable interrupts
+    outportw(hc->io_addr + UHCI_REG_USBINTR, 0x0);          // Disable interrupts (until the IRQ handler is installed)
     outportw(hc->io_addr + UHCI_REG_FRNUM, 0);              // Assign framelist 
 
     // Frame list is expected as a physical address
@@ -487,11 +896,26 @@ int uhci_init(int argc, char **argv) {
     outportw(hc->io_addr + UHCI_REG_USBCMD, UHCI_CMD_RS);   // Enable controller
 
     // Create controller
-    USBController_t *controller = usb_createController((void*)hc, NULL); // TODO: No polling method as no asyncronous transfers/port insertion detection yet
+    USBController_t *controller = usb_createController((void*)hc, uhci_poll);
+
+    // Hook up the interrupt line
+    hc->irq = pci_getLineIRQ(PCI_BUS(uhci_pci), PCI_SLOT(uhci_pci), PCI_FUNCTION(uhci_pci));
+    uhci_controller = controller;
+
+    if (hc->irq >= 0 && !hal_registerInterruptHandler(hc->irq, uhci_irqHandler)) {
+        hc->irq_enabled = 1;
+        outportw(hc->io_addr + UHCI_REG_USBINTR, UHCI_INTR_IOC | UHCI_INTR_TIMEOUT);
+        LOG(DEBUG, "Using IRQ%i for transfer completion\n", hc->irq);
+    } else {
+        LOG(WARN, "Could not route INTx# (%i) - transfers will be polled\n", hc->irq);
+    }
 
-    // Probe for devices
-    // TODO: For the USB stack, make the main USB logic probe for devices
-    uhci_probe(controller);
+    // Hand the root hub ports to the port engine, which enumerates devices in the background
+    hc->ports = usb_createPortHub("UHCI root hub", controller, (void*)hc, UHCI_PORT_COUNT);
+    hc->ports->status = uhci_portStatus;
+    hc->ports->reset = uhci_portReset;
+    hc->ports->attach = uhci_portAttach;
+    usb_registerPortHub(hc->ports, 0);
 
     // Register the controller
     usb_registerController(controller);
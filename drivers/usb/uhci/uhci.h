@@ -84,6 +84,31 @@
 #define UHCI_PORT_SUSP                  (1 << 12)   // Port suspend
 #define UHCI_PORT_RWC                   (UHCI_PORT_CONNECTION_CHANGE | UHCI_PORT_ENABLE_CHANGE)
 
+#define UHCI_PORT_COUNT                 2           // UHCI root hubs have two ports
+
+/* TD control/status bits (for reading cs.raw, which the controller updates behind our back) */
+
+#define UHCI_TD_STATUS_BITSTUFF         (1 << 17)   // Bitstuff error
+#define UHCI_TD_STATUS_CRC              (1 << 18)   // CRC/timeout error
+#define UHCI_TD_STATUS_NAK              (1 << 19)   // NAK received
+#define UHCI_TD_STATUS_BABBLE           (1 << 20)   // Babble detected
+#define UHCI_TD_STATUS_DATABUFFER       (1 << 21)   // Data buffer error
+#define UHCI_TD_STATUS_STALLED          (1 << 22)   // Stalled
+#define UHCI_TD_STATUS_ACTIVE           (1 << 23)   // Active
+#define UHCI_TD_SPD                     (1 << 29)   // Short packet detect
+#define UHCI_TD_ACTLEN(cs)              (((cs) + 1) & 0x7FF)    // Actual length of a TD (stored as n-1)
+
+/* Transfer tracking */
+
+#define UHCI_MAX_INFLIGHT               32          // Maximum amount of queue heads scheduled at once
+#define UHCI_POLL_INTERVAL              1000        // Spins between fallback polls while waiting on a transfer with IRQs enabled
+#define UHCI_MAX_CHAIN_TDS              128         // Maximum amount of TDs chained onto a single bulk/interrupt queue head
+
+/* Periodic schedule */
+
+#define UHCI_FRAME_COUNT                1024        // Amount of entries in the frame list
+#define UHCI_PERIODIC_LEVELS            8           // Interrupt QH tree levels, level n is visited every 2^n frames (1ms - 128ms)
+
 /* UHCI packet ID */
 #define UHCI_PACKET_IN                  0x69
 #define UHCI_PACKET_OUT                 0xE1
@@ -228,6 +253,19 @@ typedef struct uhci {
 
     // Queue heads
     list_t *qh_list;                    // List of queue heads
+    uhci_qh_t *inflight[UHCI_MAX_INFLIGHT]; // Queue heads that are scheduled (scanned by the IRQ handler, no list walking there)
+
+    // Periodic schedule
+    uhci_qh_t *periodic[UHCI_PERIODIC_LEVELS];      // Skeleton queue heads for each interval
+    list_t *interrupt_list[UHCI_PERIODIC_LEVELS];   // Interrupt queue heads linked after each skeleton queue head
+
+    // Interrupts
+    int irq;                            // IRQ of the INTx# line (negative if it can't be routed)
+    int irq_enabled;                    // Completions are delivered by the IRQ handler
+    uint16_t errors;                    // USBSTS error bits seen by the IRQ handler, not logged yet
+
+    // Root hub
+    USBPortHub_t *ports;                // Root hub ports (connect changes are found by uhci_poll)
 } uhci_t;
 
 /**** MACROS ****/
@@ -270,5 +308,15 @@ typedef struct uhci {
  */
 int uhci_control(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer);
 
+/**
+ * @brief UHCI bulk transfer method
+ */
+int uhci_bulk(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer);
+
+/**
+ * @brief UHCI interrupt transfer method
+ */
+int uhci_interrupt(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer);
+
 
 #endif
\ No newline at end of file
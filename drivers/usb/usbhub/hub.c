@@ -23,87 +23,137 @@
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "DRIVER:USBHUB", __VA_ARGS__)
 
-/* Helper macro */
+/* Helper macros */
 #define HUB_SET_FEATURE(hub, port, feature) usb_controlTransfer(hub->intf->dev, USB_RT_H2D | USB_RT_CLASS | USB_RT_OTHER, HUB_REQ_SET_FEATURE, feature, port+1, 0, NULL)
+#define HUB_CLEAR_FEATURE(hub, port, feature) usb_controlTransfer(hub->intf->dev, USB_RT_H2D | USB_RT_CLASS | USB_RT_OTHER, HUB_REQ_CLEAR_FEATURE, feature, port+1, 0, NULL)
 
 /**
- * @brief Probe hub for ports
- * @param hub The hub to probe
+ * @brief Hub port status method
  */
-USB_STATUS usbhub_probe(USBHub_t *hub) {
-    if (hub->nports == 0) return 0;
+static int usbhub_portStatus(USBPortHub_t *ports, uint32_t port, int *speed) {
+    USBHub_t *hub = (USBHub_t*)ports->hub;
+
+    // wPortStatus in the low half, wPortChange in the high half
+    uint32_t port_status = 0;
+    if (usb_controlTransfer(hub->intf->dev, USB_RT_D2H | USB_RT_CLASS | USB_RT_OTHER, HUB_REQ_GET_STATUS, 0, port+1, sizeof(uint32_t), &port_status) != USB_SUCCESS) {
+        LOG(ERR, "Could not read port %d status\n", port+1);
+        return 0;
+    }
 
-    // The port may not be powered. This will be the case if wHubCharacteristics has bit 1 set
-    if ((hub->desc.wHubCharacteristics & 0x3) == 0x2) {
-        LOG(DEBUG, "Individual port power detected - powering up hub ports...\n");
-        for (uint32_t port = 0; port < hub->nports; port++) {
-            if (HUB_SET_FEATURE(hub, port, HUB_FEATURE_PORT_POWER) != USB_SUCCESS) {
-                LOG(ERR, "Failed to power up port %d\n", port+1);
-                return USB_FAILURE;
-            }
+    uint16_t status = port_status & 0xFFFF;
+    uint16_t change = port_status >> 16;
 
-            // Wait for completion
-            clock_sleep(hub->desc.bPowerOnGood * 2); // bPowerOnGood is in units of 2ms
-        }
+    // Acknowledge the changes
+    if (change & HUB_PORT_CHANGE_CONNECTION) HUB_CLEAR_FEATURE(hub, port, HUB_FEATURE_C_PORT_CONNECTION);
+    if (change & HUB_PORT_CHANGE_ENABLE) HUB_CLEAR_FEATURE(hub, port, HUB_FEATURE_C_PORT_ENABLE);
+    if (change & HUB_PORT_CHANGE_SUSPEND) HUB_CLEAR_FEATURE(hub, port, HUB_FEATURE_C_PORT_SUSPEND);
+    if (change & HUB_PORT_CHANGE_OVER_CURRENT) HUB_CLEAR_FEATURE(hub, port, HUB_FEATURE_C_PORT_OVER_CURRENT);
+    if (change & HUB_PORT_CHANGE_RESET) HUB_CLEAR_FEATURE(hub, port, HUB_FEATURE_C_PORT_RESET);
+
+    *speed = (status & HUB_PORT_STATUS_LOW_SPEED) ? USB_LOW_SPEED : ((status & HUB_PORT_STATUS_HIGH_SPEED) ? USB_HIGH_SPEED : USB_FULL_SPEED);
+    return ((status & HUB_PORT_STATUS_CONNECTION) ? USB_PORT_CONNECTED : 0) |
+            ((status & HUB_PORT_STATUS_ENABLE) ? USB_PORT_ENABLED : 0) |
+            ((change & HUB_PORT_CHANGE_CONNECTION) ? USB_PORT_CONNECT_CHANGE : 0);
+}
+
+/**
+ * @brief Hub port reset method (the hub times the reset itself)
+ */
+static void usbhub_portReset(USBPortHub_t *ports, uint32_t port, int reset) {
+    USBHub_t *hub = (USBHub_t*)ports->hub;
+    if (!reset) return;
+
+    // Set PORT_RESET (we can't directly manipulate PORT_ENABLE)
+    if (HUB_SET_FEATURE(hub, port, HUB_FEATURE_PORT_RESET) != USB_SUCCESS) {
+        LOG(ERR, "Failed to reset port %d\n", port+1);
     }
+}
 
-    for (uint32_t port = 0; port < hub->nports; port++) {
-        // Now we need to reset the port, similar to UHCI
-        // Set PORT_RESET (we can't directly manipulate PORT_ENABLE)
-        if (HUB_SET_FEATURE(hub, port, HUB_FEATURE_PORT_RESET) != USB_SUCCESS) {
-            LOG(ERR, "Failed to enable port %d\n", port+1);
-            return USB_FAILURE;
-        }
+/**
+ * @brief Hub port attach method
+ */
+static USBDevice_t *usbhub_portAttach(USBPortHub_t *ports, uint32_t port, int speed) {
+    USBHub_t *hub = (USBHub_t*)ports->hub;
+    LOG(DEBUG, "Found device connected to hub port %d\n", port+1);
+
+    USBDevice_t *dev = usb_createDevice(hub->intf->dev->c, port, speed, hub->intf->dev->control);
+    if (!dev) {
+        LOG(ERR, "Failed to create device for port %d\n", port+1);
+        return NULL;
+    }
 
+    dev->bulk = hub->intf->dev->bulk;
+    dev->interrupt = hub->intf->dev->interrupt;
+    dev->mps = 8; // TODO: Bochs says to make this equal the mps corresponding to the speed of the device
 
-        uint32_t port_status = 0;
+    if (usb_initializeDevice(dev) == USB_FAILURE) {
+        // Failed to initialize
+        usb_deinitializeDevice(dev);
+        usb_destroyDevice(hub->intf->dev->c, dev); 
+        return NULL;
+    }
 
-        for (int t = 0; t < 10; t++) {
-            // 100ms in 10ms increments
-            clock_sleep(10);
+    return dev;
+}
 
-            // Read in current state
-            if (usb_controlTransfer(hub->intf->dev, USB_RT_D2H | USB_RT_CLASS | USB_RT_OTHER, HUB_REQ_GET_STATUS, 0, port+1, sizeof(uint32_t), &port_status) != USB_SUCCESS) {
-                LOG(ERR, "Could not read port %d status\n", port+1);
-                return USB_FAILURE;
-            }
+/**
+ * @brief Hub status change callback (can be IRQ context)
+ */
+static void usbhub_statusChange(USBTransfer_t *transfer) {
+    USBHub_t *hub = (USBHub_t*)transfer->parameter;
+    if (transfer->status != USB_TRANSFER_SUCCESS) return;
 
-            if (!(port_status & HUB_PORT_STATUS_CONNECTION)) {
-                // Nothing is connected to the port
-                break;
-            }
+    // Bit 0 is the hub itself, bit N is port N
+    for (uint32_t port = 0; port < hub->nports && (port + 1) / 8 < transfer->actual_length; port++) {
+        if (hub->status_bitmap[(port + 1) / 8] & (1 << ((port + 1) % 8))) usb_portEvent(hub->ports, port);
+    }
+}
 
-            if (port_status & HUB_PORT_STATUS_ENABLE) {
-                // Port enable
-                LOG(DEBUG, "Found device connected to hub port %d\n", port+1);
-                break;
-            }
-        }
+/**
+ * @brief Probe hub for ports
+ * @param hub The hub to probe
+ * 
+ * Powers the ports and hands them to the port engine. Devices are enumerated in the background.
+ */
+USB_STATUS usbhub_probe(USBHub_t *hub) {
+    if (hub->nports == 0) return USB_SUCCESS;
 
-        // Did the enable bit set?
-        if (port_status & HUB_PORT_STATUS_ENABLE) {
-            // Yes, create a device and initialize it
-            uint32_t port_speed = (port_status & HUB_PORT_STATUS_LOW_SPEED) ? USB_LOW_SPEED : ((port_status & HUB_PORT_STATUS_HIGH_SPEED) ? USB_HIGH_SPEED : USB_FULL_SPEED);
-            USBDevice_t *dev = usb_createDevice(hub->intf->dev->c, port, port_speed, hub->intf->dev->control);
-            dev->mps = 8; // TODO: Bochs says to make this equal the mps corresponding to the speed of the device
-            if (!dev) {
-                LOG(ERR, "Failed to create device for port %d\n", port+1);
+    // The port may not be powered. This will be the case if wHubCharacteristics has bit 1 set
+    uint32_t power_delay = 0;
+    if ((hub->desc.wHubCharacteristics & 0x3) == 0x2) {
+        LOG(DEBUG, "Individual port power detected - powering up hub ports...\n");
+        for (uint32_t port = 0; port < hub->nports; port++) {
+            if (HUB_SET_FEATURE(hub, port, HUB_FEATURE_PORT_POWER) != USB_SUCCESS) {
+                LOG(ERR, "Failed to power up port %d\n", port+1);
                 return USB_FAILURE;
             }
-
-            if (usb_initializeDevice(dev) == USB_FAILURE) {
-                // Failed to initialize
-                usb_deinitializeDevice(dev);
-                usb_destroyDevice(hub->intf->dev->c, dev); 
-                continue;
-            }
-
-            // Insert into list
-            list_append(hub->hub_ports, (void*)dev);
         }
 
-    }  
+        // The port engine waits for power to become good (bPowerOnGood is in units of 2ms)
+        power_delay = hub->desc.bPowerOnGood * 2;
+    }
+
+    hub->ports = usb_createPortHub("USB hub", hub->intf->dev->c, (void*)hub, hub->nports);
+    hub->ports->status = usbhub_portStatus;
+    hub->ports->reset = usbhub_portReset;
+    hub->ports->attach = usbhub_portAttach;
+    hub->ports->reset_time = USB_PORT_HUB_RESET_TIME;
+    usb_registerPortHub(hub->ports, power_delay);
+
+    // Listen for port status changes
+    USBEndpoint_t *endp = usb_getEndpoint(hub->intf, USB_ENDP_INTERRUPT, USB_ENDP_IN);
+    if (endp) {
+        hub->status_transfer.endp = endp;
+        hub->status_transfer.data = hub->status_bitmap;
+        hub->status_transfer.length = (hub->nports + 1 + 7) / 8;
+        hub->status_transfer.callback = usbhub_statusChange;
+        hub->status_transfer.parameter = (void*)hub;
+        hub->status_transfer.flags = USB_TRANSFER_REPEAT;
+
+        if (usb_submitTransfer(&hub->status_transfer) == USB_SUCCESS) return USB_SUCCESS;
+    }
 
+    LOG(WARN, "Hub status change endpoint unavailable - devices plugged in later will not be seen\n");
     return USB_SUCCESS;
 }
 
@@ -113,10 +163,9 @@ USB_STATUS usbhub_probe(USBHub_t *hub) {
 USB_STATUS usbhub_initializeDevice(USBInterface_t *intf) {
     // Read the hub descriptor in
     USBHub_t *hub = kmalloc(sizeof(USBHub_t));
-    hub->hub_ports = list_create("usb hub ports");
+    memset(hub, 0, sizeof(USBHub_t));
     if (usb_getDescriptor(intf->dev, USB_RT_CLASS, USB_DESC_HUB, 0, sizeof(USBHubDescriptor_t), &hub->desc) != USB_SUCCESS) {
         // Failed
-        list_destroy(hub->hub_ports, false);
         kfree(hub);
         LOG(ERR, "Error while trying to get USB hub descriptor\n");
         return USB_FAILURE;
@@ -127,7 +176,6 @@ USB_STATUS usbhub_initializeDevice(USBInterface_t *intf) {
 
     // Now we've read the hub descriptor, probe it for ports
     if (usbhub_probe(hub) != USB_SUCCESS) {
-        list_destroy(hub->hub_ports, false);
         kfree(hub);
         LOG(ERR, "Error while trying to initialize hub ports\n");
         return USB_FAILURE;
@@ -142,8 +190,15 @@ USB_STATUS usbhub_initializeDevice(USBInterface_t *intf) {
  * @brief Hub deinitialize device
  */
 USB_STATUS usbhub_deinitializeDevice(USBInterface_t *intf) {
-    // !!!: We have to also deinitialize all devices connected to the hub, and likely also free their memory.
-    // !!!: This is to allow for the next USB hub driver (or whatever it is) to reinitialize everything properly.
+    USBHub_t *hub = (USBHub_t*)intf->driver->s;
+    if (!hub) return USB_FAILURE;
+
+    // Detach everything downstream and stop listening for changes
+    hub->status_transfer.flags &= ~USB_TRANSFER_REPEAT;
+    usb_unregisterPortHub(hub->ports);
+    hub->ports = NULL;
+
+    // !!!: There's no way to cancel the status change transfer, so the hub (and its device) can't be freed yet
     return USB_FAILURE;
 }
 
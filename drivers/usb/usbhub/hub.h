@@ -23,8 +23,12 @@
 typedef struct USBHub {
     USBInterface_t *intf;       // Interface
     uint32_t nports;            // Number of connected ports
-    list_t *hub_ports;          // List of hub ports
+    USBPortHub_t *ports;        // Ports (handed to the port engine)
     USBHubDescriptor_t desc;    // Descriptor
+
+    // Status change endpoint
+    USBTransfer_t status_transfer;  // Repeating interrupt transfer on the status change endpoint
+    uint8_t status_bitmap[32];      // Bit 0 is the hub, bit N is port N
 } USBHub_t;
 
 /**** DEFINITIONS ****/
@@ -48,6 +52,11 @@ typedef struct USBHub {
 #define HUB_FEATURE_PORT_RESET          4
 #define HUB_FEATURE_PORT_POWER          8
 #define HUB_FEATURE_PORT_LOW_SPEED      9
+#define HUB_FEATURE_C_PORT_CONNECTION   16
+#define HUB_FEATURE_C_PORT_ENABLE       17
+#define HUB_FEATURE_C_PORT_SUSPEND      18
+#define HUB_FEATURE_C_PORT_OVER_CURRENT 19
+#define HUB_FEATURE_C_PORT_RESET        20
 
 // USB port status fields (in wPortStatus)
 #define HUB_PORT_STATUS_CONNECTION         0x01
@@ -61,5 +70,12 @@ typedef struct USBHub {
 #define HUB_PORT_STATUS_TEST               0x800
 #define HUB_PORT_STATUS_INDICATOR          0x1000
 
+// USB port change fields (in wPortChange)
+#define HUB_PORT_CHANGE_CONNECTION          0x01
+#define HUB_PORT_CHANGE_ENABLE              0x02
+#define HUB_PORT_CHANGE_SUSPEND             0x04
+#define HUB_PORT_CHANGE_OVER_CURRENT        0x08
+#define HUB_PORT_CHANGE_RESET               0x10
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1193 @@
+/**
+ * @file drivers/usb/xhci/xhci.c
+ * @brief eXtensible Host Controller Interface driver
+ *
+ * Commands go through the command ring and transfers through one transfer ring per endpoint.
+ * Completions arrive on a single event ring, which is drained by the interrupter 0 IRQ handler
+ * (or by polling if the controller's interrupt line could not be registered). Data buffers are
+ * queued as scatter-gather chains of TRBs, one per physically contiguous run of pages.
+ *
+ * Test with QEMU: -device qemu-xhci -drive if=none,id=stick,file=disk.img -device usb-storage,bus=xhci.0,drive=stick
+ *
+ * @todo Devices behind external hubs (route strings/TTs), streams, isochronous endpoints
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "xhci.h"
+
+#include <kernel/loader/driver.h>
+
+#include <kernel/drivers/usb/usb.h>
+#include <kernel/drivers/usb/dev.h>
+#include <kernel/drivers/clock.h>
+#include <kernel/drivers/pci.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/mem/mem.h>
+#include <kernel/debug.h>
+#include <kernel/panic.h>
+#include <string.h>
+
+// Architecture-specific
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/registers.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/registers.h>
+#endif
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "DRIVER:XHCI", __VA_ARGS__)
+
+/* Controller (for the IRQ handler) */
+static USBController_t *xhci_controller = NULL;
+
+/* Next ring index (the last TRB of a ring is the link TRB) */
+#define XHCI_NEXT(index) (((index) + 1) % (XHCI_RING_SIZE - 1))
+
+/* PCI match table (serial bus controller, USB, xHCI interface) */
+static pci_match_t xhci_match[] = {
+    PCI_MATCH_CLASS(0x0C03, 0x30),
+    PCI_MATCH_END
+};
+
+/**
+ * @brief xHCI controller probe method
+ * @param data Pointer to a pci_device_t* that will store the device
+ */
+int xhci_find(pci_device_t *dev, void *data) {
+    *((pci_device_t**)data) = dev;
+    return 1; // Found it
+}
+
+/**
+ * @brief Get the current time in microseconds (0 if the clock isn't ready)
+ */
+static uint64_t xhci_getTime() {
+    if (!clock_isReady()) return 0;
+    return clock_getDevice().get_timer();
+}
+
+/**
+ * @brief Wait for a register to reach a value
+ * @param base The register base
+ * @param reg The register
+ * @param mask The bits to check
+ * @param value The value the masked bits should have
+ * @param timeout Timeout in milliseconds
+ * @returns 0 on success, 1 on timeout
+ */
+static int xhci_waitRegister(uintptr_t base, uint32_t reg, uint32_t mask, uint32_t value, int timeout) {
+    for (int i = 0; i < timeout; i++) {
+        if ((XHCI_READ32(base, reg) & mask) == value) return 0;
+        clock_sleep(1);
+    }
+
+    return ((XHCI_READ32(base, reg) & mask) == value) ? 0 : 1;
+}
+
+/**
+ * @brief Allocate a zeroed page for the controller
+ * @param phys Output physical address
+ * @returns Virtual address of the page
+ */
+static void *xhci_allocatePage(uintptr_t *phys) {
+    void *page = (void*)mem_allocateDMA(PAGE_SIZE);
+    memset(page, 0, PAGE_SIZE);
+    *phys = mem_getPhysicalAddress(NULL, (uintptr_t)page);
+    return page;
+}
+
+/**
+ * @brief Create a producer ring
+ * @returns A ring with a link TRB pointing back at its start
+ */
+static xhci_ring_t *xhci_createRing() {
+    xhci_ring_t *ring = kmalloc(sizeof(xhci_ring_t));
+    memset(ring, 0, sizeof(xhci_ring_t));
+
+    ring->trbs = (xhci_trb_t*)xhci_allocatePage(&ring->phys);
+    ring->cycle = 1;
+
+    xhci_trb_t *link = &ring->trbs[XHCI_RING_SIZE - 1];
+    link->parameter = ring->phys;
+    link->control = XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TC;
+
+    return ring;
+}
+
+/**
+ * @brief Get the amount of free TRBs on a ring
+ * @param ring The ring
+ */
+static uint32_t xhci_ringSpace(xhci_ring_t *ring) {
+    uint32_t usable = XHCI_RING_SIZE - 1;
+    return (ring->dequeue + usable - ring->enqueue - 1) % usable;
+}
+
+/**
+ * @brief Enqueue a TRB on a ring
+ * @param ring The ring
+ * @param parameter TRB parameter
+ * @param status TRB status
+ * @param control TRB control (the cycle bit is filled in)
+ * @param hold Write the TRB with the wrong cycle bit so the controller doesn't start on it yet (see @c xhci_release)
+ * @returns The index of the TRB
+ */
+static uint32_t xhci_enqueue(xhci_ring_t *ring, uint64_t parameter, uint32_t status, uint32_t control, int hold) {
+    uint32_t index = ring->enqueue;
+    xhci_trb_t *trb = &ring->trbs[index];
+
+    trb->parameter = parameter;
+    trb->status = status;
+    __atomic_store_n(&trb->control, (control & ~XHCI_TRB_CYCLE) | (hold ? ring->cycle ^ 1 : ring->cycle), __ATOMIC_RELEASE);
+
+    ring->enqueue++;
+    if (ring->enqueue == XHCI_RING_SIZE - 1) {
+        // Hand the link TRB to the controller, carrying the chain bit if we're in the middle of a TD
+        xhci_trb_t *link = &ring->trbs[XHCI_RING_SIZE - 1];
+        __atomic_store_n(&link->control, XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TC | (control & XHCI_TRB_CH) | ring->cycle, __ATOMIC_RELEASE);
+        ring->cycle ^= 1;
+        ring->enqueue = 0;
+    }
+
+    return index;
+}
+
+/**
+ * @brief Give a held TRB (and everything queued after it) to the controller
+ * @param ring The ring
+ * @param index The index returned by @c xhci_enqueue
+ */
+static void xhci_release(xhci_ring_t *ring, uint32_t index) {
+    __atomic_xor_fetch(&ring->trbs[index].control, XHCI_TRB_CYCLE, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Complete a transfer
+ * @param hc The host controller
+ * @param xdev The device
+ * @param dci The device context index of the endpoint
+ * @param transfer The transfer
+ * @param status The transfer status
+ */
+static void xhci_complete(xhci_t *hc, xhci_device_t *xdev, uint32_t dci, USBTransfer_t *transfer, int status);
+
+/**
+ * @brief Process all pending events on the event ring
+ * @param hc The host controller
+ *
+ * Safe to call from IRQ context. If someone else is already processing events this returns immediately.
+ */
+static void xhci_processEvents(xhci_t *hc);
+
+/**
+ * @brief Queue a buffer as a chain of TRBs, one per physically contiguous run (scatter-gather)
+ * @param ring The ring to queue on
+ * @param transfer The transfer that owns the buffer
+ * @param type The type of the first TRB (the rest are normal TRBs)
+ * @param first_flags Flags for the first TRB only (e.g. direction of a data stage)
+ * @param flags Flags for every TRB
+ * @param last_flags Flags for the last TRB only (e.g. IOC)
+ * @param mps Max packet size of the endpoint (for the TD size field)
+ * @param hold Hold the first TRB (see @c xhci_enqueue)
+ * @param first Output index of the first TRB
+ * @returns The index of the last TRB
+ */
+static uint32_t xhci_queueBuffer(xhci_ring_t *ring, USBTransfer_t *transfer, uint32_t type, uint32_t first_flags, uint32_t flags, uint32_t last_flags, uint32_t mps, int hold, uint32_t *first) {
+    uint8_t *buffer = (uint8_t*)transfer->data;
+    uint32_t remaining = transfer->length;
+    uint32_t offset = 0;
+    uint32_t index = 0;
+    int is_first = 1;
+
+    do {
+        // Take the rest of the page, then grow while the next pages are physically contiguous
+        uint32_t size = PAGE_SIZE - ((uintptr_t)buffer & (PAGE_SIZE - 1));
+        if (size > remaining) size = remaining;
+        uint64_t phys = (size) ? mem_getPhysicalAddress(NULL, (uintptr_t)buffer) : 0;
+
+        while (size < remaining) {
+            uint32_t grow = (remaining - size > PAGE_SIZE) ? PAGE_SIZE : remaining - size;
+            if (mem_getPhysicalAddress(NULL, (uintptr_t)buffer + size) != phys + size) break;
+            if (((phys + size + grow - 1) & ~(uint64_t)(XHCI_TRB_MAX_LENGTH - 1)) != (phys & ~(uint64_t)(XHCI_TRB_MAX_LENGTH - 1))) break;
+            size += grow;
+        }
+
+        offset += size;
+        remaining -= size;
+
+        // TD size is the amount of packets left after this TRB
+        uint32_t td_size = (remaining + mps - 1) / mps;
+        if (td_size > 31) td_size = 31;
+
+        uint32_t control = XHCI_TRB_TYPE(type) | flags | (is_first ? first_flags : 0) | (remaining ? XHCI_TRB_CH : last_flags);
+        index = xhci_enqueue(ring, phys, size | (td_size << 17), control, hold && is_first);
+
+        ring->pending[index].transfer = transfer;
+        ring->pending[index].offset = offset;
+        if (is_first) *first = index;
+
+        type = XHCI_TRB_NORMAL;
+        buffer += size;
+        is_first = 0;
+    } while (remaining);
+
+    // Every TRB of the TD knows where it starts and ends, so a short packet on any of them releases the whole TD
+    for (uint32_t i = *first; ; i = XHCI_NEXT(i)) {
+        ring->pending[i].first = *first;
+        ring->pending[i].last = index;
+        if (i == index) break;
+    }
+
+    return index;
+}
+
+/**
+ * @brief Wait for ring space, processing events while we do
+ * @param hc The host controller
+ * @param ring The ring
+ * @param needed The amount of TRBs needed
+ */
+static void xhci_waitSpace(xhci_t *hc, xhci_ring_t *ring, uint32_t needed) {
+    while (xhci_ringSpace(ring) < needed) {
+        xhci_processEvents(hc);
+        asm volatile ("pause" ::: "memory");
+    }
+}
+
+/**
+ * @brief Send a command and wait for its completion
+ * @param hc The host controller
+ * @param parameter TRB parameter
+ * @param status TRB status
+ * @param control TRB control
+ * @returns The completion code, or 0 on timeout
+ */
+static uint32_t xhci_command(xhci_t *hc, uint64_t parameter, uint32_t status, uint32_t control) {
+    spinlock_acquire(&hc->command_lock);
+
+    __atomic_store_n(&hc->command_done, 0, __ATOMIC_RELEASE);
+    uint32_t index = xhci_enqueue(hc->command_ring, parameter, status, control, 0);
+    hc->command_trb = hc->command_ring->phys + index * sizeof(xhci_trb_t);
+    XHCI_DOORBELL(hc, 0, 0);
+
+    uint64_t deadline = xhci_getTime() + XHCI_COMMAND_TIMEOUT * 1000;
+    unsigned int spins = 0;
+    while (!__atomic_load_n(&hc->command_done, __ATOMIC_ACQUIRE)) {
+        if (!hc->irq_enabled || ++spins >= XHCI_POLL_INTERVAL) {
+            xhci_processEvents(hc);
+            spins = 0;
+        }
+
+        if (clock_isReady() && xhci_getTime() > deadline) {
+            LOG(ERR, "Command (type %d) timed out\n", XHCI_TRB_GET_TYPE(control));
+            hc->command_trb = 0;
+            spinlock_release(&hc->command_lock);
+            return 0;
+        }
+
+        asm volatile ("pause" ::: "memory");
+    }
+
+    uint32_t code = hc->command_code;
+    spinlock_release(&hc->command_lock);
+    return code;
+}
+
+/**
+ * @brief Handle a transfer event
+ * @param hc The host controller
+ * @param event The event TRB
+ */
+static void xhci_transferEvent(xhci_t *hc, xhci_trb_t *event) {
+    uint32_t slot = event->control >> 24;
+    uint32_t dci = (event->control >> 16) & 0x1F;
+    uint32_t code = event->status >> 24;
+    uint32_t residual = event->status & 0xFFFFFF;
+
+    if (!slot || slot > hc->max_slots || !hc->slots[slot] || !hc->slots[slot]->rings[dci]) return;
+    xhci_device_t *xdev = hc->slots[slot];
+    xhci_ring_t *ring = xdev->rings[dci];
+
+    if (event->parameter < ring->phys || event->parameter >= ring->phys + (XHCI_RING_SIZE - 1) * sizeof(xhci_trb_t)) return;
+    uint32_t index = (event->parameter - ring->phys) / sizeof(xhci_trb_t);
+
+    xhci_pending_t *pending = &ring->pending[index];
+    USBTransfer_t *transfer = pending->transfer;
+    if (!transfer) return;
+
+    int status = USB_TRANSFER_SUCCESS;
+    if (code != XHCI_CC_SUCCESS && code != XHCI_CC_SHORT_PACKET) {
+        LOG(ERR, "Transfer on slot %d endpoint %d failed with completion code %d\n", slot, dci, code);
+        status = USB_TRANSFER_FAILED;
+        ring->halted = 1;
+    }
+
+    transfer->actual_length = pending->offset - residual;
+
+    // Release the TRBs of this TD
+    uint32_t first = pending->first;
+    uint32_t last = pending->last;
+    for (uint32_t i = first; ; i = XHCI_NEXT(i)) {
+        ring->pending[i].transfer = NULL;
+        if (i == last) break;
+    }
+
+    ring->dequeue = XHCI_NEXT(last);
+    xhci_complete(hc, xdev, dci, transfer, status);
+}
+
+/**
+ * @brief Process all pending events on the event ring
+ * @param hc The host controller
+ *
+ * Safe to call from IRQ context. If someone else is already processing events this returns immediately.
+ */
+static void xhci_processEvents(xhci_t *hc) {
+    if (__atomic_exchange_n(&hc->event_busy, 1, __ATOMIC_ACQUIRE)) return;
+
+    int handled = 0;
+    for (;;) {
+        xhci_trb_t *event = &hc->events[hc->event_dequeue];
+        uint32_t control = __atomic_load_n(&event->control, __ATOMIC_ACQUIRE);
+        if ((control & XHCI_TRB_CYCLE) != hc->event_cycle) break;
+
+        switch (XHCI_TRB_GET_TYPE(control)) {
+            case XHCI_TRB_COMMAND_COMPLETION:
+                if (event->parameter == hc->command_trb) {
+                    hc->command_code = event->status >> 24;
+                    hc->command_slot = control >> 24;
+                    __atomic_store_n(&hc->command_done, 1, __ATOMIC_RELEASE);
+                }
+                break;
+
+            case XHCI_TRB_TRANSFER_EVENT:
+                xhci_transferEvent(hc, event);
+                break;
+
+            case XHCI_TRB_PORT_STATUS_CHANGE: ;
+                // The port engine reads and acknowledges the change bits (until it's up, acknowledge them here)
+                uint32_t port = ((event->parameter >> 24) & 0xFF) - 1;
+                if (port < hc->max_ports) {
+                    if (hc->ports) {
+                        usb_portEvent(hc->ports, port);
+                    } else {
+                        uint32_t portsc = XHCI_READ32(hc->op, XHCI_OP_PORTSC(port));
+                        XHCI_WRITE32(hc->op, XHCI_OP_PORTSC(port), (portsc & XHCI_PORTSC_PRESERVE) | (portsc & XHCI_PORTSC_CHANGE));
+                    }
+                }
+                break;
+
+            case XHCI_TRB_HOST_CONTROLLER:
+                LOG(ERR, "Host controller event with completion code %d\n", event->status >> 24);
+                break;
+
+            default:
+                break;
+        }
+
+        if (++hc->event_dequeue == XHCI_EVENT_RING_SIZE) {
+            hc->event_dequeue = 0;
+            hc->event_cycle ^= 1;
+        }
+
+        handled++;
+    }
+
+    // Tell the controller how far we got (and clear the busy flag)
+    if (handled) XHCI_WRITE64(hc->rt, XHCI_RT_ERDP, (hc->events_phys + hc->event_dequeue * sizeof(xhci_trb_t)) | XHCI_ERDP_EHB);
+
+    __atomic_store_n(&hc->event_busy, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief xHCI IRQ handler
+ */
+int xhci_irqHandler(uintptr_t exception_index, uintptr_t interrupt_no, registers_t *regs, extended_registers_t *extended) {
+    if (!xhci_controller) return IRQ_UNHANDLED;
+    xhci_t *hc = HC(xhci_controller);
+
+    // The line may be shared with another device
+    uint32_t status = XHCI_READ32(hc->op, XHCI_OP_USBSTS);
+    uint32_t iman = XHCI_READ32(hc->rt, XHCI_RT_IMAN);
+    if (!(status & (XHCI_STS_EINT | XHCI_STS_HSE)) && !(iman & XHCI_IMAN_IP)) return IRQ_UNHANDLED;
+
+    // Acknowledge (write 1 to clear)
+    XHCI_WRITE32(hc->op, XHCI_OP_USBSTS, status & (XHCI_STS_EINT | XHCI_STS_HSE | XHCI_STS_PCD));
+    XHCI_WRITE32(hc->rt, XHCI_RT_IMAN, iman | XHCI_IMAN_IP);
+
+    if (status & XHCI_STS_HSE) LOG(ERR, "Host system error (USBSTS 0x%x)\n", status);
+
+    xhci_processEvents(hc);
+    return IRQ_HANDLED;
+}
+
+/**
+ * @brief Get the xHCI slot of a USB device
+ * @param hc The host controller
+ * @param dev The device
+ */
+static xhci_device_t *xhci_getDevice(xhci_t *hc, USBDevice_t *dev) {
+    for (uint32_t i = 1; i <= hc->max_slots; i++) {
+        if (hc->slots[i] && hc->slots[i]->dev == dev) return hc->slots[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get a context from a device's input context
+ * @param hc The host controller
+ * @param xdev The device
+ * @param index 0 for the input control context, 1 for the slot context, DCI + 1 for endpoints
+ */
+static void *xhci_inputContext(xhci_t *hc, xhci_device_t *xdev, uint32_t index) {
+    return (void*)((uintptr_t)xdev->input + index * hc->context_size);
+}
+
+/**
+ * @brief Get the physical address of a device's input context
+ */
+static uintptr_t xhci_inputPhysical(xhci_device_t *xdev) {
+    return mem_getPhysicalAddress(NULL, (uintptr_t)xdev->input);
+}
+
+/**
+ * @brief Fill in the default control endpoint context of a device's input context
+ * @param hc The host controller
+ * @param xdev The device
+ * @param mps The max packet size of the endpoint
+ */
+static void xhci_fillEP0(xhci_t *hc, xhci_device_t *xdev, uint32_t mps) {
+    xhci_ring_t *ring = xdev->rings[1];
+    xhci_endpoint_context_t *ep0 = (xhci_endpoint_context_t*)xhci_inputContext(hc, xdev, 2);
+
+    memset(ep0, 0, hc->context_size);
+    ep0->info2 = (3 << 1) | (XHCI_EP_CONTROL << 3) | (mps << 16);
+    ep0->dequeue = (ring->phys + ring->enqueue * sizeof(xhci_trb_t)) | ring->cycle;
+    ep0->average = 8;
+}
+
+/**
+ * @brief Address a device
+ * @param hc The host controller
+ * @param xdev The device
+ * @param bsr Block the SET_ADDRESS request (only enables the default control endpoint)
+ * @returns The completion code
+ */
+static uint32_t xhci_addressDevice(xhci_t *hc, xhci_device_t *xdev, int bsr) {
+    memset(xdev->input, 0, hc->context_size * (XHCI_MAX_ENDPOINTS + 1));
+
+    xhci_input_control_context_t *icc = (xhci_input_control_context_t*)xhci_inputContext(hc, xdev, 0);
+    icc->add = (1 << 0) | (1 << 1);
+
+    xhci_slot_context_t *slot = (xhci_slot_context_t*)xhci_inputContext(hc, xdev, 1);
+    slot->info = (1 << 27) | ((uint32_t)xdev->speed << 20);
+    slot->info2 = (uint32_t)xdev->port << 16;
+
+    xhci_fillEP0(hc, xdev, xdev->ep0_mps);
+    xdev->rings[1]->dequeue = xdev->rings[1]->enqueue;
+
+    return xhci_command(hc, xhci_inputPhysical(xdev), 0, XHCI_TRB_TYPE(XHCI_TRB_ADDRESS_DEVICE) | XHCI_TRB_SLOT(xdev->slot_id) | (bsr ? XHCI_TRB_BSR : 0));
+}
+
+/**
+ * @brief Update the max packet size of the default control endpoint
+ * @param hc The host controller
+ * @param xdev The device
+ * @param mps The new max packet size
+ * @returns The completion code
+ */
+static uint32_t xhci_evaluateEP0(xhci_t *hc, xhci_device_t *xdev, uint32_t mps) {
+    memset(xdev->input, 0, hc->context_size * (XHCI_MAX_ENDPOINTS + 1));
+
+    xhci_input_control_context_t *icc = (xhci_input_control_context_t*)xhci_inputContext(hc, xdev, 0);
+    icc->add = (1 << 1);
+    xhci_fillEP0(hc, xdev, mps);
+
+    uint32_t code = xhci_command(hc, xhci_inputPhysical(xdev), 0, XHCI_TRB_TYPE(XHCI_TRB_EVALUATE_CONTEXT) | XHCI_TRB_SLOT(xdev->slot_id));
+    if (code == XHCI_CC_SUCCESS) xdev->ep0_mps = mps;
+    return code;
+}
+
+/**
+ * @brief Get the endpoint context interval for an endpoint
+ * @param xdev The device
+ * @param desc The endpoint descriptor
+ * @returns The interval as an exponent of 125us
+ */
+static uint32_t xhci_endpointInterval(xhci_device_t *xdev, USBEndpointDescriptor_t *desc) {
+    uint32_t type = desc->bmAttributes & USB_ENDP_TRANSFER_TYPE;
+    if (type != USB_ENDP_INTERRUPT && type != USB_ENDP_ISOCHRONOUS) return 0;
+
+    // High speed and SuperSpeed already use 2^(bInterval-1) microframes
+    if (xdev->speed == XHCI_SPEED_HIGH || xdev->speed == XHCI_SPEED_SUPER || type == USB_ENDP_ISOCHRONOUS) {
+        uint32_t interval = desc->bInterval ? desc->bInterval - 1 : 0;
+        if (type == USB_ENDP_ISOCHRONOUS && xdev->speed != XHCI_SPEED_HIGH && xdev->speed != XHCI_SPEED_SUPER) interval += 3;
+        return (interval > 15) ? 15 : interval;
+    }
+
+    // Full/low speed interrupt endpoints use frames
+    uint32_t microframes = (desc->bInterval ? desc->bInterval : 1) * 8;
+    uint32_t interval = 0;
+    while ((2u << interval) <= microframes) interval++;
+    if (interval < 3) interval = 3;
+    if (interval > 10) interval = 10;
+    return interval;
+}
+
+/**
+ * @brief Configure the endpoints of a device's selected configuration
+ * @param hc The host controller
+ * @param xdev The device
+ * @returns The completion code
+ */
+static uint32_t xhci_configureEndpoints(xhci_t *hc, xhci_device_t *xdev) {
+    USBDevice_t *dev = xdev->dev;
+    if (!dev->config || !dev->config->interface_list) return XHCI_CC_SUCCESS;
+
+    memset(xdev->input, 0, hc->context_size * (XHCI_MAX_ENDPOINTS + 1));
+    xhci_input_control_context_t *icc = (xhci_input_control_context_t*)xhci_inputContext(hc, xdev, 0);
+    uint32_t max_dci = 1;
+
+    foreach(intf_node, dev->config->interface_list) {
+        USBInterface_t *intf = (USBInterface_t*)intf_node->value;
+        if (!intf || !intf->endpoint_list) continue;
+
+        foreach(endp_node, intf->endpoint_list) {
+            USBEndpoint_t *endp = (USBEndpoint_t*)endp_node->value;
+            if (!endp || endp->desc.bDescriptorType != USB_DESC_ENDP) continue;
+
+            uint32_t transfer_type = endp->desc.bmAttributes & USB_ENDP_TRANSFER_TYPE;
+            if (transfer_type == USB_ENDP_CONTROL) continue;
+
+            uint32_t dci = XHCI_DCI(endp->desc.bEndpointAddress);
+            if (dci < 2 || dci >= XHCI_MAX_ENDPOINTS) continue;
+
+            if (!xdev->rings[dci]) xdev->rings[dci] = xhci_createRing();
+            xhci_ring_t *ring = xdev->rings[dci];
+
+            int in = (endp->desc.bEndpointAddress & USB_ENDP_DIRECTION) == USB_ENDP_IN;
+            uint32_t type = transfer_type + (in ? 4 : 0);
+            uint32_t mps = endp->desc.wMaxPacketSize & 0x7FF;
+
+            xhci_endpoint_context_t *ctx = (xhci_endpoint_context_t*)xhci_inputContext(hc, xdev, dci + 1);
+            ctx->info = xhci_endpointInterval(xdev, &endp->desc) << 16;
+            ctx->info2 = ((transfer_type == USB_ENDP_ISOCHRONOUS) ? 0 : (3 << 1)) | (type << 3) | (mps << 16);
+            ctx->dequeue = (ring->phys + ring->enqueue * sizeof(xhci_trb_t)) | ring->cycle;
+            ctx->average = (transfer_type == USB_ENDP_BULK) ? 3072 : ((mps << 16) | mps);
+            ring->dequeue = ring->enqueue;
+
+            icc->add |= (1 << dci);
+            if (dci > max_dci) max_dci = dci;
+        }
+    }
+
+    // Copy the slot context over and update the amount of context entries
+    icc->add |= (1 << 0);
+    xhci_slot_context_t *slot = (xhci_slot_context_t*)xhci_inputContext(hc, xdev, 1);
+    memcpy(slot, xdev->output, sizeof(xhci_slot_context_t));
+    slot->info = (slot->info & ~(0x1F << 27)) | (max_dci << 27);
+    slot->state = 0;
+
+    return xhci_command(hc, xhci_inputPhysical(xdev), 0, XHCI_TRB_TYPE(XHCI_TRB_CONFIGURE_ENDPOINT) | XHCI_TRB_SLOT(xdev->slot_id));
+}
+
+/**
+ * @brief Recover a halted endpoint
+ * @param hc The host controller
+ * @param xdev The device
+ * @param dci The device context index of the endpoint
+ *
+ * Fails everything still queued on the ring and restarts it at the enqueue pointer.
+ * Call with the ring lock held.
+ */
+static void xhci_recoverEndpoint(xhci_t *hc, xhci_device_t *xdev, uint32_t dci) {
+    xhci_ring_t *ring = xdev->rings[dci];
+
+    xhci_command(hc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_RESET_ENDPOINT) | XHCI_TRB_SLOT(xdev->slot_id) | XHCI_TRB_ENDPOINT(dci));
+
+    for (uint32_t i = 0; i < XHCI_RING_SIZE - 1; i++) {
+        USBTransfer_t *transfer = ring->pending[i].transfer;
+        ring->pending[i].transfer = NULL;
+        if (transfer) xhci_complete(hc, xdev, dci, transfer, USB_TRANSFER_FAILED);
+    }
+
+    xhci_command(hc, (ring->phys + ring->enqueue * sizeof(xhci_trb_t)) | ring->cycle, 0, XHCI_TRB_TYPE(XHCI_TRB_SET_TR_DEQUEUE) | XHCI_TRB_SLOT(xdev->slot_id) | XHCI_TRB_ENDPOINT(dci));
+    ring->dequeue = ring->enqueue;
+    ring->halted = 0;
+}
+
+/**
+ * @brief Wait for a synchronous transfer
+ * @param hc The host controller
+ * @param xdev The device
+ * @param dci The device context index of the endpoint
+ * @param transfer The transfer
+ * @returns The transfer status
+ */
+static int xhci_wait(xhci_t *hc, xhci_device_t *xdev, uint32_t dci, USBTransfer_t *transfer) {
+    // If we don't have an IRQ we have to poll, otherwise only poll occasionally in case an interrupt was lost.
+    unsigned int spins = 0;
+    while (__atomic_load_n(&transfer->status, __ATOMIC_ACQUIRE) == USB_TRANSFER_IN_PROGRESS) {
+        if (!hc->irq_enabled || ++spins >= XHCI_POLL_INTERVAL) {
+            xhci_processEvents(hc);
+            spins = 0;
+        }
+
+        asm volatile ("pause" ::: "memory");
+    }
+
+    xhci_ring_t *ring = xdev->rings[dci];
+    if (ring->halted) {
+        spinlock_acquire(&ring->lock);
+        if (ring->halted) xhci_recoverEndpoint(hc, xdev, dci);
+        spinlock_release(&ring->lock);
+    }
+
+    return transfer->status;
+}
+
+/**
+ * @brief Queue a normal TD for a bulk/interrupt transfer and ring the doorbell
+ * @param hc The host controller
+ * @param xdev The device
+ * @param dci The device context index of the endpoint
+ * @param transfer The transfer
+ */
+static void xhci_queueTD(xhci_t *hc, xhci_device_t *xdev, uint32_t dci, USBTransfer_t *transfer) {
+    xhci_ring_t *ring = xdev->rings[dci];
+    uint32_t mps = transfer->endp->desc.wMaxPacketSize & 0x7FF;
+
+    uint32_t first;
+    xhci_queueBuffer(ring, transfer, XHCI_TRB_NORMAL, 0, XHCI_TRB_ISP, XHCI_TRB_IOC, mps ? mps : 8, 1, &first);
+    xhci_release(ring, first);
+    XHCI_DOORBELL(hc, xdev->slot_id, dci);
+}
+
+/**
+ * @brief Complete a transfer
+ * @param hc The host controller
+ * @param xdev The device
+ * @param dci The device context index of the endpoint
+ * @param transfer The transfer
+ * @param status The transfer status
+ */
+static void xhci_complete(xhci_t *hc, xhci_device_t *xdev, uint32_t dci, USBTransfer_t *transfer, int status) {
+    // Claim the transfer so it is only completed once
+    int expected = USB_TRANSFER_IN_PROGRESS;
+    if (!__atomic_compare_exchange_n(&transfer->status, &expected, status, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+
+    // Synchronous waiters pick the status up themselves
+    if (!transfer->callback) return;
+    transfer->callback(transfer);
+
+    xhci_ring_t *ring = xdev->rings[dci];
+    if (ring->repeating != transfer) return;
+
+    if ((transfer->flags & USB_TRANSFER_REPEAT) && status == USB_TRANSFER_SUCCESS) {
+        // The ring belongs to this transfer, so we can requeue it without the lock
+        transfer->actual_length = 0;
+        __atomic_store_n(&transfer->status, USB_TRANSFER_IN_PROGRESS, __ATOMIC_RELEASE);
+        xhci_queueTD(hc, xdev, dci, transfer);
+    } else {
+        ring->repeating = NULL;
+    }
+}
+
+/**
+ * @brief xHCI control transfer method
+ *
+ * SET_ADDRESS is turned into an Address Device command (the controller picks the address) and
+ * SET_CONFIGURATION configures the endpoints of the selected configuration first.
+ */
+int xhci_control(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer) {
+    if (!controller || !dev || !transfer || !transfer->req || !controller->hc) return USB_TRANSFER_FAILED;
+    xhci_t *hc = HC(controller);
+
+    xhci_device_t *xdev = xhci_getDevice(hc, dev);
+    if (!xdev) {
+        LOG(ERR, "Control transfer for a device without a slot (devices behind hubs are not supported yet)\n");
+        transfer->status = USB_TRANSFER_FAILED;
+        return USB_TRANSFER_FAILED;
+    }
+
+    USBDeviceRequest_t *req = transfer->req;
+    int standard = (req->bmRequestType & (USB_RT_TYPE_MASK | USB_RT_RECIPIENT_MASK)) == (USB_RT_STANDARD | USB_RT_DEV);
+
+    // The controller assigns addresses
+    if (standard && req->bRequest == USB_REQ_SET_ADDR) {
+        transfer->status = (xhci_addressDevice(hc, xdev, 0) == XHCI_CC_SUCCESS) ? USB_TRANSFER_SUCCESS : USB_TRANSFER_FAILED;
+        return transfer->status;
+    }
+
+    // Once we know the real max packet size of the default endpoint, tell the controller
+    if (dev->device_desc.bMaxPacketSize0) {
+        uint32_t mps = (xdev->speed == XHCI_SPEED_SUPER) ? (1u << dev->device_desc.bMaxPacketSize0) : dev->device_desc.bMaxPacketSize0;
+        if (mps != xdev->ep0_mps && xhci_evaluateEP0(hc, xdev, mps) != XHCI_CC_SUCCESS) {
+            LOG(WARN, "Failed to update the max packet size of slot %d to %d\n", xdev->slot_id, mps);
+        }
+    }
+
+    if (standard && req->bRequest == USB_REQ_SET_CONF) {
+        if (xhci_configureEndpoints(hc, xdev) != XHCI_CC_SUCCESS) {
+            LOG(ERR, "Configure Endpoint failed for slot %d\n", xdev->slot_id);
+            transfer->status = USB_TRANSFER_FAILED;
+            return USB_TRANSFER_FAILED;
+        }
+    }
+
+    xhci_ring_t *ring = xdev->rings[1];
+    int in = (req->bmRequestType & USB_RT_D2H) != 0;
+
+    spinlock_acquire(&ring->lock);
+    if (ring->halted) xhci_recoverEndpoint(hc, xdev, 1);
+    xhci_waitSpace(hc, ring, transfer->length / PAGE_SIZE + 4);
+
+    transfer->status = USB_TRANSFER_IN_PROGRESS;
+
+    // SETUP stage (the request is immediate data)
+    uint64_t setup;
+    memcpy(&setup, req, sizeof(uint64_t));
+    uint32_t trt = (transfer->length) ? (in ? XHCI_TRT_IN : XHCI_TRT_OUT) : XHCI_TRT_NO_DATA;
+    uint32_t first = xhci_enqueue(ring, setup, 8, XHCI_TRB_TYPE(XHCI_TRB_SETUP) | XHCI_TRB_IDT | trt, 1);
+    ring->pending[first].transfer = NULL;
+
+    // DATA stage
+    if (transfer->length && transfer->data) {
+        uint32_t data_first;
+        xhci_queueBuffer(ring, transfer, XHCI_TRB_DATA, (in ? XHCI_TRB_DIR_IN : 0), 0, 0, xdev->ep0_mps, 0, &data_first);
+    }
+
+    // STATUS stage (opposite direction of the data, IN if there is none)
+    uint32_t status = xhci_enqueue(ring, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_STATUS) | XHCI_TRB_IOC | ((transfer->length && in) ? 0 : XHCI_TRB_DIR_IN), 0);
+    ring->pending[status].transfer = transfer;
+    ring->pending[status].offset = transfer->length;
+    for (uint32_t i = first; ; i = XHCI_NEXT(i)) {
+        ring->pending[i].first = first;
+        ring->pending[i].last = status;
+        if (i == status) break;
+    }
+
+    xhci_release(ring, first);
+    XHCI_DOORBELL(hc, xdev->slot_id, 1);
+    spinlock_release(&ring->lock);
+
+    if (transfer->callback) return USB_TRANSFER_IN_PROGRESS;
+    return xhci_wait(hc, xdev, 1, transfer);
+}
+
+/**
+ * @brief xHCI bulk/interrupt transfer method
+ *
+ * An asynchronous interrupt transfer with @c USB_TRANSFER_REPEAT takes over its ring until the flag is cleared.
+ */
+int xhci_transfer(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer) {
+    if (!controller || !dev || !transfer || !transfer->endp || !controller->hc) return USB_TRANSFER_FAILED;
+    xhci_t *hc = HC(controller);
+
+    xhci_device_t *xdev = xhci_getDevice(hc, dev);
+    uint32_t dci = XHCI_DCI(transfer->endp->desc.bEndpointAddress);
+    if (!xdev || dci >= XHCI_MAX_ENDPOINTS || !xdev->rings[dci]) {
+        LOG(ERR, "Transfer on unconfigured endpoint 0x%x\n", transfer->endp->desc.bEndpointAddress);
+        return USB_TRANSFER_FAILED;
+    }
+
+    xhci_ring_t *ring = xdev->rings[dci];
+    spinlock_acquire(&ring->lock);
+
+    if (ring->repeating) {
+        spinlock_release(&ring->lock);
+        LOG(ERR, "Endpoint 0x%x is owned by a repeating transfer\n", transfer->endp->desc.bEndpointAddress);
+        return USB_TRANSFER_FAILED;
+    }
+
+    if (ring->halted) xhci_recoverEndpoint(hc, xdev, dci);
+    xhci_waitSpace(hc, ring, transfer->length / PAGE_SIZE + 2);
+
+    transfer->status = USB_TRANSFER_IN_PROGRESS;
+    transfer->actual_length = 0;
+    if (transfer->callback && (transfer->flags & USB_TRANSFER_REPEAT)) ring->repeating = transfer;
+
+    xhci_queueTD(hc, xdev, dci, transfer);
+    spinlock_release(&ring->lock);
+
+    if (transfer->callback) return USB_TRANSFER_IN_PROGRESS;
+    return xhci_wait(hc, xdev, dci, transfer);
+}
+
+/**
+ * @brief Root hub port status method
+ */
+static int xhci_portStatus(USBPortHub_t *hub, uint32_t port, int *speed) {
+    xhci_t *hc = HC(hub->c);
+    uint32_t portsc = XHCI_READ32(hc->op, XHCI_OP_PORTSC(port));
+
+    // Acknowledge every change
+    if (portsc & XHCI_PORTSC_CHANGE) XHCI_WRITE32(hc->op, XHCI_OP_PORTSC(port), (portsc & XHCI_PORTSC_PRESERVE) | (portsc & XHCI_PORTSC_CHANGE));
+
+    switch (XHCI_PORTSC_SPEED(portsc)) {
+        case XHCI_SPEED_LOW: *speed = USB_LOW_SPEED; break;
+        case XHCI_SPEED_HIGH: *speed = USB_HIGH_SPEED; break;
+        case XHCI_SPEED_SUPER: *speed = USB_SUPER_SPEED; break;
+        default: *speed = USB_FULL_SPEED; break;
+    }
+
+    return ((portsc & XHCI_PORTSC_CCS) ? USB_PORT_CONNECTED : 0) |
+            ((portsc & XHCI_PORTSC_PED) ? USB_PORT_ENABLED : 0) |
+            ((portsc & XHCI_PORTSC_CSC) ? USB_PORT_CONNECT_CHANGE : 0);
+}
+
+/**
+ * @brief Root hub port reset method
+ * 
+ * USB3 ports enable themselves once link training finishes, USB2 ports need a reset.
+ * The controller times the reset itself.
+ */
+static void xhci_portReset(USBPortHub_t *hub, uint32_t port, int reset) {
+    xhci_t *hc = HC(hub->c);
+    if (!reset) return;
+
+    uint32_t portsc = XHCI_READ32(hc->op, XHCI_OP_PORTSC(port));
+    if (portsc & XHCI_PORTSC_PED) return;
+
+    XHCI_WRITE32(hc->op, XHCI_OP_PORTSC(port), (portsc & XHCI_PORTSC_PRESERVE) | XHCI_PORTSC_PR);
+}
+
+/**
+ * @brief Free the slot of a device
+ * @param hc The host controller
+ * @param xdev The device
+ */
+static void xhci_freeDevice(xhci_t *hc, xhci_device_t *xdev) {
+    xhci_command(hc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_DISABLE_SLOT) | XHCI_TRB_SLOT(xdev->slot_id));
+    hc->slots[xdev->slot_id] = NULL;
+    hc->dcbaa[xdev->slot_id] = 0;
+
+    for (int i = 0; i < XHCI_MAX_ENDPOINTS; i++) {
+        if (!xdev->rings[i]) continue;
+        mem_freeDMA((uintptr_t)xdev->rings[i]->trbs, PAGE_SIZE);
+        kfree(xdev->rings[i]);
+    }
+
+    mem_freeDMA((uintptr_t)xdev->output, PAGE_SIZE);
+    mem_freeDMA((uintptr_t)xdev->input, PAGE_SIZE);
+    kfree(xdev);
+}
+
+/**
+ * @brief Root hub port attach method
+ */
+static USBDevice_t *xhci_portAttach(USBPortHub_t *hub, uint32_t port, int usb_speed) {
+    USBController_t *controller = hub->c;
+    xhci_t *hc = HC(controller);
+    uint32_t speed = XHCI_PORTSC_SPEED(XHCI_READ32(hc->op, XHCI_OP_PORTSC(port)));
+
+    // Get a slot for it
+    if (xhci_command(hc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_ENABLE_SLOT)) != XHCI_CC_SUCCESS) {
+        LOG(ERR, "Enable Slot failed for port %d\n", port);
+        return NULL;
+    }
+
+    uint32_t slot_id = hc->command_slot;
+    if (!slot_id || slot_id > hc->max_slots) {
+        LOG(ERR, "Controller returned bad slot ID %d\n", slot_id);
+        return NULL;
+    }
+
+    xhci_device_t *xdev = kmalloc(sizeof(xhci_device_t));
+    memset(xdev, 0, sizeof(xhci_device_t));
+    xdev->slot_id = slot_id;
+    xdev->port = port + 1;
+    xdev->speed = speed;
+
+    uintptr_t output_phys, input_phys;
+    xdev->output = xhci_allocatePage(&output_phys);
+    xdev->input = xhci_allocatePage(&input_phys);
+    hc->dcbaa[slot_id] = output_phys;
+
+    // Default control endpoint max packet size by speed (updated after the device descriptor is read)
+    xdev->rings[1] = xhci_createRing();
+    xdev->ep0_mps = (speed == XHCI_SPEED_SUPER) ? 512 : (speed == XHCI_SPEED_HIGH) ? 64 : 8;
+    hc->slots[slot_id] = xdev;
+
+    // Enable the default control endpoint without sending SET_ADDRESS yet - the USB stack does that
+    if (xhci_addressDevice(hc, xdev, 1) != XHCI_CC_SUCCESS) {
+        LOG(ERR, "Address Device failed for port %d\n", port);
+        xhci_freeDevice(hc, xdev);
+        return NULL;
+    }
+
+    USBDevice_t *dev = usb_createDevice(controller, port, usb_speed, xhci_control);
+    dev->mps = 8;
+    dev->bulk = xhci_transfer;
+    dev->interrupt = xhci_transfer;
+    xdev->dev = dev;
+
+    LOG(DEBUG, "Port %d: speed %d, slot %d\n", port, speed, slot_id);
+
+    if (usb_initializeDevice(dev)) {
+        LOG(ERR, "Failed to initialize xHCI device\n");
+        usb_destroyDevice(controller, dev);
+        xhci_freeDevice(hc, xdev);
+        return NULL;
+    }
+
+    return dev;
+}
+
+/**
+ * @brief Root hub port detach method
+ */
+static void xhci_portDetach(USBPortHub_t *hub, uint32_t port, USBDevice_t *dev) {
+    xhci_t *hc = HC(hub->c);
+    xhci_device_t *xdev = xhci_getDevice(hc, dev);
+    if (xdev) xhci_freeDevice(hc, xdev);
+}
+
+/**
+ * @brief xHCI poll method (clock interrupt)
+ * 
+ * Only needed without an IRQ - port status change events are drained here then.
+ */
+static void xhci_poll(USBController_t *controller) {
+    xhci_t *hc = HC(controller);
+    if (hc && !hc->irq_enabled) xhci_processEvents(hc);
+}
+
+/**
+ * @brief Take the controller from the BIOS
+ * @param hc The host controller
+ * @param hccparams1 HCCPARAMS1
+ */
+static void xhci_takeOwnership(xhci_t *hc, uint32_t hccparams1) {
+    uint32_t offset = XHCI_HCCPARAMS1_XECP(hccparams1) << 2;
+
+    while (offset) {
+        uint32_t cap = XHCI_READ32(hc->mmio, offset);
+
+        if ((cap & 0xFF) == XHCI_XCAP_LEGACY) {
+            XHCI_WRITE32(hc->mmio, offset, cap | XHCI_LEGACY_OS_OWNED);
+            if (xhci_waitRegister(hc->mmio, offset, XHCI_LEGACY_BIOS_OWNED, 0, XHCI_RESET_TIMEOUT)) {
+                LOG(WARN, "BIOS did not release the controller\n");
+            }
+
+            // Disable SMIs and clear their status
+            uint32_t control = XHCI_READ32(hc->mmio, offset + 4);
+            XHCI_WRITE32(hc->mmio, offset + 4, (control & ~0x0000E011) | 0xE0000000);
+        }
+
+        uint32_t next = (cap >> 8) & 0xFF;
+        if (!next) break;
+        offset += next << 2;
+    }
+}
+
+/**
+ * @brief Set up event interrupts for interrupter 0
+ *
+ * Prefers an MSI-X or MSI vector, then the INTx# line. Without either, events are polled.
+ *
+ * @param hc The host controller
+ */
+static void xhci_initInterrupts(xhci_t *hc) {
+    hc->irq = -1;
+
+    if (pci_allocateIRQs(hc->pci, 1, PCI_IRQ_MSIX | PCI_IRQ_MSI, PCI_CPU_AUTO) > 0) {
+        if (!hal_registerInterruptHandler(pci_getIRQ(hc->pci, 0), xhci_irqHandler)) {
+            hc->irq = pci_getIRQ(hc->pci, 0);
+            LOG(DEBUG, "Using %s vector IRQ%i for events\n", (hc->pci->irq_mode == PCI_IRQ_MSIX) ? "MSI-X" : "MSI", hc->irq);
+        } else {
+            pci_freeIRQs(hc->pci);
+        }
+    }
+
+    if (hc->irq < 0) {
+        int line = pci_getLineIRQ(hc->pci->bus, hc->pci->slot, hc->pci->function);
+        if (line >= 0 && !hal_registerInterruptHandler(line, xhci_irqHandler)) {
+            hc->irq = line;
+            LOG(DEBUG, "Using IRQ%i for events\n", line);
+        } else {
+            LOG(WARN, "Could not route INTx# (%i) - events will be polled\n", line);
+            return;
+        }
+    }
+
+    hc->irq_enabled = 1;
+    XHCI_WRITE32(hc->rt, XHCI_RT_IMAN, XHCI_IMAN_IE | XHCI_IMAN_IP);
+}
+
+/**
+ * @brief xHCI initialize method
+ */
+int xhci_init(int argc, char **argv) {
+    // Scan and find the xHCI PCI device
+    pci_device_t *dev = NULL;
+    if (pci_probe(xhci_match, xhci_find, (void*)(&dev)) == 0) {
+        LOG(INFO, "No xHCI controller found\n");
+        return 0;
+    }
+
+    uint8_t bus = dev->bus, slot = dev->slot, func = dev->function;
+
+    // Now read in the PCI bar
+    pci_bar_t *bar = pci_readBAR(bus, slot, func, 0);
+    if (!bar) {
+        LOG(ERR, "xHCI controller does not have BAR0 - false positive?\n");
+        return -1;
+    }
+
+    if (bar->type != PCI_BAR_MEMORY32 && bar->type != PCI_BAR_MEMORY64) {
+        LOG(ERR, "xHCI controller BAR0 is not memory space - bug in PCI driver?\n");
+        kfree(bar);
+        return -1;
+    }
+
+    // Enable memory space and bus mastering
+    uint32_t command = pci_readConfigOffset(bus, slot, func, PCI_COMMAND_OFFSET, 2);
+    pci_writeConfigOffset(bus, slot, func, PCI_COMMAND_OFFSET, (command | PCI_COMMAND_MEMORY_SPACE | PCI_COMMAND_BUS_MASTER) & ~PCI_COMMAND_INTERRUPT_DISABLE);
+
+    // Construct a host controller
+    xhci_t *hc = kmalloc(sizeof(xhci_t));
+    memset(hc, 0, sizeof(xhci_t));
+    hc->pci = dev;
+
+    uintptr_t size = (bar->size + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    hc->mmio = mem_mapMMIO((uintptr_t)bar->address, size);
+    kfree(bar);
+
+    hc->op = hc->mmio + (*(volatile uint8_t*)(hc->mmio + XHCI_CAP_CAPLENGTH));
+    hc->rt = hc->mmio + (XHCI_READ32(hc->mmio, XHCI_CAP_RTSOFF) & ~0x1F);
+    hc->db = hc->mmio + (XHCI_READ32(hc->mmio, XHCI_CAP_DBOFF) & ~0x3);
+
+    uint32_t hcsparams1 = XHCI_READ32(hc->mmio, XHCI_CAP_HCSPARAMS1);
+    uint32_t hcsparams2 = XHCI_READ32(hc->mmio, XHCI_CAP_HCSPARAMS2);
+    uint32_t hccparams1 = XHCI_READ32(hc->mmio, XHCI_CAP_HCCPARAMS1);
+
+    hc->max_ports = XHCI_HCSPARAMS1_MAXPORTS(hcsparams1);
+    hc->max_slots = XHCI_HCSPARAMS1_MAXSLOTS(hcsparams1);
+    if (hc->max_slots > XHCI_MAX_SLOTS) hc->max_slots = XHCI_MAX_SLOTS;
+    hc->context_size = (hccparams1 & XHCI_HCCPARAMS1_CSZ) ? 64 : 32;
+
+    LOG(INFO, "xHCI controller version %x.%02x: %d ports, %d slots, %d-byte contexts\n", *(volatile uint16_t*)(hc->mmio + XHCI_CAP_HCIVERSION) >> 8, *(volatile uint16_t*)(hc->mmio + XHCI_CAP_HCIVERSION) & 0xFF, hc->max_ports, hc->max_slots, hc->context_size);
+
+    // Take the controller and reset it
+    xhci_takeOwnership(hc, hccparams1);
+
+    XHCI_WRITE32(hc->op, XHCI_OP_USBCMD, XHCI_READ32(hc->op, XHCI_OP_USBCMD) & ~XHCI_CMD_RS);
+    if (xhci_waitRegister(hc->op, XHCI_OP_USBSTS, XHCI_STS_HCH, XHCI_STS_HCH, XHCI_RESET_TIMEOUT)) {
+        LOG(ERR, "Controller did not halt\n");
+        return -1;
+    }
+
+    XHCI_WRITE32(hc->op, XHCI_OP_USBCMD, XHCI_CMD_HCRST);
+    if (xhci_waitRegister(hc->op, XHCI_OP_USBCMD, XHCI_CMD_HCRST, 0, XHCI_RESET_TIMEOUT) || xhci_waitRegister(hc->op, XHCI_OP_USBSTS, XHCI_STS_CNR, 0, XHCI_RESET_TIMEOUT)) {
+        LOG(ERR, "Controller did not finish resetting\n");
+        return -1;
+    }
+
+    XHCI_WRITE32(hc->op, XHCI_OP_CONFIG, hc->max_slots);
+
+    // Device context base address array
+    uintptr_t dcbaa_phys;
+    hc->dcbaa = (uint64_t*)xhci_allocatePage(&dcbaa_phys);
+
+    // Scratchpad buffers (the controller may need memory of its own)
+    uint32_t scratchpads = XHCI_HCSPARAMS2_SCRATCHPADS(hcsparams2);
+    if (scratchpads) {
+        uintptr_t array_phys;
+        uint64_t *array = (uint64_t*)xhci_allocatePage(&array_phys);
+        for (uint32_t i = 0; i < scratchpads && i < PAGE_SIZE / sizeof(uint64_t); i++) {
+            uintptr_t page_phys;
+            xhci_allocatePage(&page_phys);
+            array[i] = page_phys;
+        }
+
+        hc->dcbaa[0] = array_phys;
+    }
+
+    XHCI_WRITE64(hc->op, XHCI_OP_DCBAAP, dcbaa_phys);
+
+    // Command ring
+    hc->command_ring = xhci_createRing();
+    XHCI_WRITE64(hc->op, XHCI_OP_CRCR, hc->command_ring->phys | XHCI_CRCR_RCS);
+
+    // Event ring (one segment)
+    hc->events = (xhci_trb_t*)xhci_allocatePage(&hc->events_phys);
+    hc->event_cycle = 1;
+
+    uintptr_t erst_phys;
+    xhci_erst_entry_t *erst = (xhci_erst_entry_t*)xhci_allocatePage(&erst_phys);
+    erst[0].base = hc->events_phys;
+    erst[0].size = XHCI_EVENT_RING_SIZE;
+
+    XHCI_WRITE32(hc->rt, XHCI_RT_ERSTSZ, 1);
+    XHCI_WRITE64(hc->rt, XHCI_RT_ERDP, hc->events_phys);
+    XHCI_WRITE64(hc->rt, XHCI_RT_ERSTBA, erst_phys);
+    XHCI_WRITE32(hc->rt, XHCI_RT_IMOD, XHCI_IMOD_INTERVAL);
+
+    // Create controller
+    USBController_t *controller = usb_createController((void*)hc, xhci_poll);
+    xhci_controller = controller;
+
+    // Hook up interrupter 0: an MSI-X/MSI vector if there is one, otherwise the INTx# line
+    xhci_initInterrupts(hc);
+
+    // Start the controller
+    XHCI_WRITE32(hc->op, XHCI_OP_USBCMD, XHCI_CMD_RS | XHCI_CMD_HSEE | (hc->irq_enabled ? XHCI_CMD_INTE : 0));
+    if (xhci_waitRegister(hc->op, XHCI_OP_USBSTS, XHCI_STS_HCH, 0, XHCI_RESET_TIMEOUT)) {
+        LOG(ERR, "Controller did not start\n");
+        return -1;
+    }
+
+    // Make sure the command ring works
+    if (xhci_command(hc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_NOOP_COMMAND)) != XHCI_CC_SUCCESS) {
+        LOG(ERR, "Controller did not respond to a no-op command\n");
+        return -1;
+    }
+
+    // Power the ports and hand them to the port engine, which enumerates devices in the background
+    uint32_t power_delay = 0;
+    for (uint32_t port = 0; port < hc->max_ports; port++) {
+        uint32_t portsc = XHCI_READ32(hc->op, XHCI_OP_PORTSC(port));
+        if (!(portsc & XHCI_PORTSC_PP)) {
+            XHCI_WRITE32(hc->op, XHCI_OP_PORTSC(port), (portsc & XHCI_PORTSC_PRESERVE) | XHCI_PORTSC_PP);
+            power_delay = 20;
+        }
+    }
+
+    USBPortHub_t *ports = usb_createPortHub("xHCI root hub", controller, (void*)hc, hc->max_ports);
+    ports->status = xhci_portStatus;
+    ports->reset = xhci_portReset;
+    ports->attach = xhci_portAttach;
+    ports->detach = xhci_portDetach;
+    ports->shared_address = 0;  // Every slot is addressed by the controller
+    usb_registerPortHub(ports, power_delay);
+    hc->ports = ports;
+
+    // Register the controller
+    usb_registerController(controller);
+
+    return 0;
+}
+
+/**
+ * @brief xHCI deinitialize method
+ */
+int xhci_deinit() {
+    return 0;
+}
+
+
+/* Metadata */
+struct driver_metadata driver_metadata = {
+    .name = "xHCI driver",
+    .author = "Samuel Stuart",
+    .init = xhci_init,
+    .deinit = xhci_deinit
+};
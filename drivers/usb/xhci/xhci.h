@@ -0,0 +1,356 @@
+/**
+ * @file drivers/usb/xhci/xhci.h
+ * @brief xHCI header file
+ *
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef XHCI_H
+#define XHCI_H
+
+/**** INCLUDES ****/
+
+#include <stdint.h>
+#include <kernel/drivers/usb/usb.h>
+#include <kernel/misc/spinlock.h>
+#include <kernel/drivers/pci.h>
+
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/hal.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/hal.h>
+#else
+#error "Please define port I/O functions for xHCI driver"
+#endif
+
+/**** DEFINITIONS ****/
+
+/* Capability registers */
+
+#define XHCI_CAP_CAPLENGTH              0x00    // Capability register length (byte)
+#define XHCI_CAP_HCIVERSION             0x02    // Interface version number (word)
+#define XHCI_CAP_HCSPARAMS1             0x04    // Structural parameters 1
+#define XHCI_CAP_HCSPARAMS2             0x08    // Structural parameters 2
+#define XHCI_CAP_HCSPARAMS3             0x0C    // Structural parameters 3
+#define XHCI_CAP_HCCPARAMS1             0x10    // Capability parameters 1
+#define XHCI_CAP_DBOFF                  0x14    // Doorbell offset
+#define XHCI_CAP_RTSOFF                 0x18    // Runtime register space offset
+
+#define XHCI_HCSPARAMS1_MAXSLOTS(p)     ((p) & 0xFF)
+#define XHCI_HCSPARAMS1_MAXPORTS(p)     (((p) >> 24) & 0xFF)
+#define XHCI_HCSPARAMS2_SCRATCHPADS(p)  ((((p) >> 21) & 0x1F) << 5 | (((p) >> 27) & 0x1F))
+#define XHCI_HCCPARAMS1_CSZ             (1 << 2)    // 64-byte context structures
+#define XHCI_HCCPARAMS1_XECP(p)         (((p) >> 16) & 0xFFFF)
+
+/* Operational registers */
+
+#define XHCI_OP_USBCMD                  0x00    // USB command
+#define XHCI_OP_USBSTS                  0x04    // USB status
+#define XHCI_OP_PAGESIZE                0x08    // Page size
+#define XHCI_OP_DNCTRL                  0x14    // Device notification control
+#define XHCI_OP_CRCR                    0x18    // Command ring control (64-bit)
+#define XHCI_OP_DCBAAP                  0x30    // Device context base address array pointer (64-bit)
+#define XHCI_OP_CONFIG                  0x38    // Configure
+#define XHCI_OP_PORTSC(n)               (0x400 + (n) * 0x10)    // Port status and control
+
+/* USBCMD bitflags */
+
+#define XHCI_CMD_RS                     (1 << 0)    // Run/stop
+#define XHCI_CMD_HCRST                  (1 << 1)    // Host controller reset
+#define XHCI_CMD_INTE                   (1 << 2)    // Interrupter enable
+#define XHCI_CMD_HSEE                   (1 << 3)    // Host system error enable
+
+/* USBSTS bitflags */
+
+#define XHCI_STS_HCH                    (1 << 0)    // HC halted
+#define XHCI_STS_HSE                    (1 << 2)    // Host system error
+#define XHCI_STS_EINT                   (1 << 3)    // Event interrupt
+#define XHCI_STS_PCD                    (1 << 4)    // Port change detect
+#define XHCI_STS_CNR                    (1 << 11)   // Controller not ready
+#define XHCI_STS_HCE                    (1 << 12)   // Host controller error
+
+/* CRCR bitflags */
+
+#define XHCI_CRCR_RCS                   (1 << 0)    // Ring cycle state
+
+/* PORTSC bitflags */
+
+#define XHCI_PORTSC_CCS                 (1 << 0)    // Current connect status
+#define XHCI_PORTSC_PED                 (1 << 1)    // Port enabled/disabled (RW1C - writing 1 disables the port!)
+#define XHCI_PORTSC_PR                  (1 << 4)    // Port reset
+#define XHCI_PORTSC_PP                  (1 << 9)    // Port power
+#define XHCI_PORTSC_SPEED(p)            (((p) >> 10) & 0xF)
+#define XHCI_PORTSC_CSC                 (1 << 17)   // Connect status change
+#define XHCI_PORTSC_PEC                 (1 << 18)   // Port enabled/disabled change
+#define XHCI_PORTSC_WRC                 (1 << 19)   // Warm port reset change
+#define XHCI_PORTSC_OCC                 (1 << 20)   // Over-current change
+#define XHCI_PORTSC_PRC                 (1 << 21)   // Port reset change
+#define XHCI_PORTSC_PLC                 (1 << 22)   // Port link state change
+#define XHCI_PORTSC_CEC                 (1 << 23)   // Port config error change
+#define XHCI_PORTSC_CHANGE              (XHCI_PORTSC_CSC | XHCI_PORTSC_PEC | XHCI_PORTSC_WRC | XHCI_PORTSC_OCC | XHCI_PORTSC_PRC | XHCI_PORTSC_PLC | XHCI_PORTSC_CEC)
+#define XHCI_PORTSC_PRESERVE            0x0E00C3E0  // Bits that are safe to write back as read (no RW1C/RW1S bits)
+
+/* Port speeds (PORTSC) */
+
+#define XHCI_SPEED_FULL                 1
+#define XHCI_SPEED_LOW                  2
+#define XHCI_SPEED_HIGH                 3
+#define XHCI_SPEED_SUPER                4
+
+/* Runtime registers (interrupter 0) */
+
+#define XHCI_RT_IMAN                    0x20    // Interrupter management
+#define XHCI_RT_IMOD                    0x24    // Interrupter moderation
+#define XHCI_RT_ERSTSZ                  0x28    // Event ring segment table size
+#define XHCI_RT_ERSTBA                  0x30    // Event ring segment table base address (64-bit)
+#define XHCI_RT_ERDP                    0x38    // Event ring dequeue pointer (64-bit)
+
+#define XHCI_IMAN_IP                    (1 << 0)    // Interrupt pending (RW1C)
+#define XHCI_IMAN_IE                    (1 << 1)    // Interrupt enable
+#define XHCI_ERDP_EHB                   (1 << 3)    // Event handler busy (RW1C)
+
+/* Extended capabilities */
+
+#define XHCI_XCAP_LEGACY                1       // USB legacy support
+#define XHCI_LEGACY_BIOS_OWNED          (1 << 16)
+#define XHCI_LEGACY_OS_OWNED            (1 << 24)
+
+/* TRB types */
+
+#define XHCI_TRB_NORMAL                 1
+#define XHCI_TRB_SETUP                  2
+#define XHCI_TRB_DATA                   3
+#define XHCI_TRB_STATUS                 4
+#define XHCI_TRB_LINK                   6
+#define XHCI_TRB_ENABLE_SLOT            9
+#define XHCI_TRB_DISABLE_SLOT           10
+#define XHCI_TRB_ADDRESS_DEVICE         11
+#define XHCI_TRB_CONFIGURE_ENDPOINT     12
+#define XHCI_TRB_EVALUATE_CONTEXT       13
+#define XHCI_TRB_RESET_ENDPOINT         14
+#define XHCI_TRB_SET_TR_DEQUEUE         16
+#define XHCI_TRB_NOOP_COMMAND           23
+#define XHCI_TRB_TRANSFER_EVENT         32
+#define XHCI_TRB_COMMAND_COMPLETION     33
+#define XHCI_TRB_PORT_STATUS_CHANGE     34
+#define XHCI_TRB_HOST_CONTROLLER        37
+
+/* TRB control bitflags */
+
+#define XHCI_TRB_CYCLE                  (1 << 0)    // Cycle bit
+#define XHCI_TRB_TC                     (1 << 1)    // Toggle cycle (link TRBs)
+#define XHCI_TRB_ENT                    (1 << 1)    // Evaluate next TRB
+#define XHCI_TRB_ISP                    (1 << 2)    // Interrupt on short packet
+#define XHCI_TRB_CH                     (1 << 4)    // Chain
+#define XHCI_TRB_IOC                    (1 << 5)    // Interrupt on completion
+#define XHCI_TRB_IDT                    (1 << 6)    // Immediate data
+#define XHCI_TRB_BSR                    (1 << 9)    // Block set address request (address device)
+#define XHCI_TRB_DIR_IN                 (1 << 16)   // Data/status stage direction
+#define XHCI_TRB_TYPE(t)                ((uint32_t)(t) << 10)
+#define XHCI_TRB_GET_TYPE(c)            (((c) >> 10) & 0x3F)
+#define XHCI_TRB_SLOT(s)                ((uint32_t)(s) << 24)
+#define XHCI_TRB_ENDPOINT(e)            ((uint32_t)(e) << 16)
+
+/* Setup stage transfer types */
+
+#define XHCI_TRT_NO_DATA                0
+#define XHCI_TRT_OUT                    (2 << 16)
+#define XHCI_TRT_IN                     (3 << 16)
+
+/* Completion codes */
+
+#define XHCI_CC_SUCCESS                 1
+#define XHCI_CC_DATA_BUFFER             2
+#define XHCI_CC_BABBLE                  3
+#define XHCI_CC_TRANSACTION             4
+#define XHCI_CC_TRB                     5
+#define XHCI_CC_STALL                   6
+#define XHCI_CC_SHORT_PACKET            13
+
+/* Endpoint types (endpoint context) */
+
+#define XHCI_EP_ISOCH_OUT               1
+#define XHCI_EP_BULK_OUT                2
+#define XHCI_EP_INTERRUPT_OUT           3
+#define XHCI_EP_CONTROL                 4
+#define XHCI_EP_ISOCH_IN                5
+#define XHCI_EP_BULK_IN                 6
+#define XHCI_EP_INTERRUPT_IN            7
+
+/* Driver limits */
+
+#define XHCI_RING_SIZE                  256     // TRBs per ring (one page), the last one is the link TRB
+#define XHCI_EVENT_RING_SIZE            256     // TRBs in the event ring segment
+#define XHCI_MAX_SLOTS                  32      // Maximum device slots we enable
+#define XHCI_MAX_ENDPOINTS              32      // Device context indexes (0 = slot)
+#define XHCI_TRB_MAX_LENGTH             0x10000 // A TRB buffer may not cross a 64KB boundary
+#define XHCI_POLL_INTERVAL              1000    // Spins between fallback polls while waiting with IRQs enabled
+#define XHCI_COMMAND_TIMEOUT            1000    // Command timeout in milliseconds
+#define XHCI_RESET_TIMEOUT              1000    // Controller/port reset timeout in milliseconds
+#define XHCI_IMOD_INTERVAL              160     // Interrupt moderation interval in 250ns units (40us)
+
+/**** TYPES ****/
+
+/**
+ * @brief Transfer request block
+ */
+typedef struct xhci_trb {
+    uint64_t parameter;                 // Parameter (usually a buffer pointer)
+    uint32_t status;                    // Status (usually a transfer length)
+    uint32_t control;                   // Control (cycle, type, flags)
+} xhci_trb_t;
+
+/**
+ * @brief Event ring segment table entry
+ */
+typedef struct xhci_erst_entry {
+    uint64_t base;                      // Segment base address
+    uint32_t size;                      // Segment size in TRBs
+    uint32_t reserved;
+} xhci_erst_entry_t;
+
+/**
+ * @brief Slot context (first 32 bytes, contexts may be 64 bytes large)
+ */
+typedef struct xhci_slot_context {
+    uint32_t info;                      // Route string, speed, MTT, hub, context entries
+    uint32_t info2;                     // Max exit latency, root hub port number, number of ports
+    uint32_t tt;                        // TT info, interrupter target
+    uint32_t state;                     // USB device address, slot state
+    uint32_t reserved[4];
+} __attribute__((packed)) xhci_slot_context_t;
+
+/**
+ * @brief Endpoint context (first 32 bytes, contexts may be 64 bytes large)
+ */
+typedef struct xhci_endpoint_context {
+    uint32_t info;                      // Endpoint state, mult, max streams, interval
+    uint32_t info2;                     // Error count, endpoint type, max burst, max packet size
+    uint64_t dequeue;                   // TR dequeue pointer + dequeue cycle state
+    uint32_t average;                   // Average TRB length, max ESIT payload
+    uint32_t reserved[3];
+} __attribute__((packed)) xhci_endpoint_context_t;
+
+/**
+ * @brief Input control context
+ */
+typedef struct xhci_input_control_context {
+    uint32_t drop;                      // Drop context flags
+    uint32_t add;                       // Add context flags
+    uint32_t reserved[6];
+} __attribute__((packed)) xhci_input_control_context_t;
+
+/**
+ * @brief Pending transfer slot of a ring entry
+ */
+typedef struct xhci_pending {
+    USBTransfer_t *transfer;            // Transfer that owns this TRB
+    uint32_t offset;                    // Byte offset of the end of this TRB within the transfer
+    uint16_t first;                     // Index of the first TRB of the TD
+    uint16_t last;                      // Index of the last TRB of the TD
+} xhci_pending_t;
+
+/**
+ * @brief Producer ring (command or transfer ring)
+ */
+typedef struct xhci_ring {
+    xhci_trb_t *trbs;                   // TRBs (one page, last TRB links back to the start)
+    uintptr_t phys;                     // Physical address of the TRBs
+    uint32_t enqueue;                   // Enqueue index
+    uint32_t dequeue;                   // Dequeue index (as far as completions have told us)
+    uint32_t cycle;                     // Producer cycle state
+    spinlock_t lock;                    // Enqueue lock
+    USBTransfer_t *repeating;           // Repeating interrupt transfer on this ring (owns it)
+    int halted;                         // The endpoint halted and needs a reset before it is used again
+    xhci_pending_t pending[XHCI_RING_SIZE]; // Transfers owning each TRB
+} xhci_ring_t;
+
+/**
+ * @brief xHCI device slot
+ */
+typedef struct xhci_device {
+    uint8_t slot_id;                    // Slot ID given by Enable Slot
+    uint8_t port;                       // Root hub port (1-based)
+    uint8_t speed;                      // PORTSC speed
+    uint32_t ep0_mps;                   // Max packet size currently programmed for the default endpoint
+    USBDevice_t *dev;                   // USB stack device
+
+    void *output;                       // Output device context (owned by the controller)
+    void *input;                        // Input context
+    xhci_ring_t *rings[XHCI_MAX_ENDPOINTS]; // Transfer rings by device context index
+} xhci_device_t;
+
+/**
+ * @brief xHCI controller
+ */
+typedef struct xhci {
+    uintptr_t mmio;                     // Capability registers
+    uintptr_t op;                       // Operational registers
+    uintptr_t rt;                       // Runtime registers
+    uintptr_t db;                       // Doorbell array
+
+    uint32_t max_slots;                 // Enabled device slots
+    uint32_t max_ports;                 // Root hub ports
+    uint32_t context_size;              // 32 or 64 bytes
+
+    uint64_t *dcbaa;                    // Device context base address array
+    xhci_ring_t *command_ring;          // Command ring
+    xhci_trb_t *events;                 // Event ring segment
+    uintptr_t events_phys;              // Physical address of the event ring segment
+    uint32_t event_dequeue;             // Event ring dequeue index
+    uint32_t event_cycle;               // Consumer cycle state
+    int event_busy;                     // Set while someone is processing events
+
+    // Command completion
+    spinlock_t command_lock;            // One command at a time
+    uintptr_t command_trb;              // Physical address of the outstanding command TRB
+    int command_done;                   // Set by the event handler
+    uint32_t command_code;              // Completion code of the last command
+    uint32_t command_slot;              // Slot ID of the last command
+
+    xhci_device_t *slots[XHCI_MAX_SLOTS + 1];  // Devices by slot ID
+
+    // Interrupts
+    pci_device_t *pci;                  // PCI device
+    int irq;                            // IRQ of interrupter 0 (MSI-X/MSI vector or INTx# line, -1 if polled)
+    int irq_enabled;                    // Events are delivered by the IRQ handler
+
+    // Root hub
+    USBPortHub_t *ports;                // Root hub ports (fed by port status change events)
+} xhci_t;
+
+/**** MACROS ****/
+
+// Get the host controller
+#define HC(con) ((xhci_t*)con->hc)
+
+// Register access
+#define XHCI_READ32(base, reg)          (*(volatile uint32_t*)((base) + (reg)))
+#define XHCI_WRITE32(base, reg, val)    (*(volatile uint32_t*)((base) + (reg)) = (uint32_t)(val))
+#define XHCI_WRITE64(base, reg, val)    { XHCI_WRITE32(base, reg, (uint64_t)(val) & 0xFFFFFFFF); XHCI_WRITE32(base, (reg) + 4, (uint64_t)(val) >> 32); }
+
+// Ring a doorbell
+#define XHCI_DOORBELL(hc, slot, target) XHCI_WRITE32((hc)->db, (slot) * 4, target)
+
+// Device context index of an endpoint address
+#define XHCI_DCI(address)               ((((address) & USB_ENDP_NUMBER) * 2) + (((address) & USB_ENDP_DIRECTION) ? 1 : 0))
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief xHCI control transfer method
+ */
+int xhci_control(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer);
+
+/**
+ * @brief xHCI bulk/interrupt transfer method
+ */
+int xhci_transfer(USBController_t *controller, USBDevice_t *dev, USBTransfer_t *transfer);
+
+#endif
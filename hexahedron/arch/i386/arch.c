@@ -177,6 +177,13 @@ int arch_current_cpu() {
     return smp_getCurrentCPU();
 }
 
+/**
+ * @brief Wait for the next interrupt
+ */
+void arch_pause() {
+    asm volatile ("sti\nhlt");
+}
+
 
 /**
  * @brief Get the generic parameters
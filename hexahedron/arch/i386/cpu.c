@@ -48,6 +48,28 @@ void cpu_setMSR(uint32_t msr, uint32_t lo, uint32_t hi) {
     asm volatile ("wrmsr" :: "a"(lo), "d"(hi), "c"(msr));
 }
 
+/**
+ * @brief Program the page attribute table of the current CPU
+ * 
+ * PAT entry 4 (PAT bit set, PCD/PWT clear) is switched to write-combining.
+ * Nothing maps through that entry before this runs, so no cache flush is needed.
+ * 
+ * @returns 1 if the PAT was programmed, 0 if the CPU has no PAT
+ */
+int cpu_patInitialize() {
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(edx & CPUID_FEAT_EDX_PAT) || !(edx & CPUID_FEAT_EDX_MSR)) return 0;
+
+    // PA4 is the low byte of the high dword
+    uint32_t lo = 0, hi = 0;
+    cpu_getMSR(I386_MSR_PAT, &lo, &hi);
+    hi = (hi & ~0xFF) | I386_PAT_WC;
+    cpu_setMSR(I386_MSR_PAT, lo, hi);
+
+    return 1;
+}
+
 /**
  * @brief Perform a CPUID instruction (only for strings)
  * 
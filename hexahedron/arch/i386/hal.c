@@ -47,6 +47,8 @@
 #include <kernel/drivers/x86/pit.h>
 #include <kernel/drivers/x86/acpica.h> // #ifdef ACPICA_ENABLED in this file
 #include <kernel/drivers/x86/minacpi.h>
+#include <kernel/drivers/x86/ioapic.h>
+#include <kernel/drivers/pci.h>
 
 /* Root system descriptor pointer */
 static uint64_t hal_rsdp = 0x0; 
@@ -97,6 +99,9 @@ smp_info_t *hal_initACPI() {
         return NULL;
     }
 
+    // PCI configuration space
+    ACPICA_ParseMCFG();
+
     // Get SMP information
     smp_info_t *smp = ACPICA_GetSMPInfo();
     if (!smp) {
@@ -123,6 +128,9 @@ _minacpi: ; // Jumped here if "--no-acpica" was present
         return NULL;
     }
 
+    // PCI configuration space (the MADT parser releases the tables, so this goes first)
+    minacpi_parseMCFG();
+
     // Get SMP information
     smp_info_t *info = minacpi_parseMADT();
     if (info == NULL) {
@@ -141,6 +149,7 @@ static void hal_init_stage1() {
     if (serial_initialize() == 0) {
         // Success!
         debug_setOutput(serial_print);
+        debug_setWriteOutput(serial_write);
     }
 
     arch_say_hello(1);
@@ -163,11 +172,20 @@ static void hal_init_stage1() {
  */
 static void hal_init_stage2() {
 
+    /* LOG RINGS */
+
+    // The allocator and the clock are up, so log records can be queued from here on
+    debug_startLogDrain();
+
     /* DEBUGGER INITIALIZATION */
 
     // We need to reconfigure the serial ports and initialize the debugger.
     // Configure debug output port
-    serial_setPort(serial_createPortData(__debug_output_com_port, __debug_output_baud_rate), 1);
+    serial_port_t *debug_port = serial_createPortData(__debug_output_com_port, __debug_output_baud_rate);
+    serial_setPort(debug_port, 1);
+
+    // Logging no longer has to wait on the UART
+    serial_enableInterrupts(debug_port);
 
     // Now start preparing for debugger
     if (!__debugger_enabled) goto _no_debug;
@@ -179,6 +197,7 @@ static void hal_init_stage2() {
     }
 
     serial_setPort(port, 0);
+    serial_enableInterrupts(port);
     if (debugger_initialize(port) != 1) {
         dprintf(WARN, "Debugger failed to initialize or connect.\n");
     }
@@ -193,9 +212,29 @@ _no_debug: ;
     /* SMP INITIALIZATION */
 
     // Now that we have our SMP information one way or another, we can initialize SMP.
-    smp_init(smp);
+    if (smp_init(smp)) {
+        dprintf(ERR, "Failed to initialize SMP\n");
+        goto _no_smp;
+    }
+
+    // The APs get their own log rings
+    debug_startLogDrain();
+
+    /* I/O APIC INITIALIZATION */
+
+    // Deliver legacy IRQs through the I/O APIC so they can be spread over every CPU (needs the local APIC from SMP)
+    if (kargs_has("--no-ioapic")) {
+        dprintf(INFO, "Argument \"--no-ioapic\" found, staying on the 8259 PICs.\n");
+    } else if (ioapic_initialize(smp) == 0) {
+        hal_enableIOAPIC();
+    }
 
 _no_smp: ;
+
+    /* PCI INITIALIZATION */
+
+    // Enumerate once, drivers probe the registry
+    pci_init();
     
     /* VIDEO INITIALIZATION */
 
@@ -24,6 +24,7 @@
 // Memory includes
 #include <kernel/mem/mem.h>
 #include <kernel/arch/i386/mem.h>
+#include <kernel/arch/i386/cpu.h>
 #include <kernel/mem/pmm.h>
 
 // General kernel includes
@@ -52,6 +53,9 @@ uintptr_t       mem_mmioRegion      = MEM_MMIO_REGION;     // Memory-mapped I/O
 uintptr_t       mem_driverRegion    = MEM_DRIVER_REGION;   // Driver region
 uintptr_t       mem_dmaRegion       = MEM_DMA_REGION;      // DMA region
 
+// Whether PAT entry 4 is write-combining
+static int          mem_patAvailable = 0;
+
 // Spinlocks (stack-allocated - no spinlock for ID map is required as pool system handles that)
 static spinlock_t heap_lock = { 0 };
 static spinlock_t mmio_lock = { 0 };
@@ -538,6 +542,13 @@ void mem_allocatePage(page_t *page, uintptr_t flags) {
     page->bits.usermode         = (flags & MEM_KERNEL) ? 0 : 1;
     page->bits.writethrough     = (flags & MEM_WRITETHROUGH) ? 1 : 0;
     page->bits.cache_disable    = (flags & MEM_NOT_CACHEABLE) ? 1 : 0;
+    page->bits.pat              = 0;
+
+    // Write-combining goes through PAT entry 4
+    if (flags & MEM_WRITECOMBINE) {
+        if (mem_patAvailable) page->bits.pat = 1;
+        else page->bits.cache_disable = 1;
+    }
 }
 
 /**
@@ -608,6 +619,7 @@ uintptr_t mem_allocateDMA(uintptr_t size) {
     }
 
     spinlock_acquire(&dma_lock);
+    uintptr_t address = mem_dmaRegion;
 
     // Map into memory
     for (uintptr_t i = mem_dmaRegion; i < mem_dmaRegion + size; i += PAGE_SIZE) {
@@ -620,7 +632,7 @@ uintptr_t mem_allocateDMA(uintptr_t size) {
 
     spinlock_release(&dma_lock);
 
-    return mem_dmaRegion - size;
+    return address;
 }
 
 /**
@@ -672,6 +684,7 @@ uintptr_t mem_mapDriver(size_t size) {
     }
 
     spinlock_acquire(&driver_lock);
+    uintptr_t address = mem_driverRegion;
 
     // Align size
     if (size % PAGE_SIZE != 0) size = MEM_ALIGN_PAGE(size);
@@ -687,7 +700,7 @@ uintptr_t mem_mapDriver(size_t size) {
 
     spinlock_release(&driver_lock);
 
-    return mem_driverRegion - size;
+    return address;
 }
 
 /**
@@ -734,6 +747,10 @@ void mem_init(uintptr_t high_address) {
     if (!high_address) kernel_panic(KERNEL_BAD_ARGUMENT_ERROR, "mem");
     mem_kernelHeap = MEM_ALIGN_PAGE(high_address);
 
+    // Setup the PAT for write-combining mappings
+    mem_patAvailable = cpu_patInitialize();
+    if (!mem_patAvailable) dprintf(WARN, "PAT is not supported by this CPU, write-combining mappings will be uncacheable\n");
+
     // Get ourselves a page directory
     // !!!: Is this okay? Do we need to again put things in data structures?
     page_t *page_directory = (page_t*)pmm_allocateBlock();
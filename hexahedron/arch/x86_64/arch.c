@@ -180,6 +180,13 @@ int arch_current_cpu() {
     return 0;
 }
 
+/**
+ * @brief Wait for the next interrupt
+ */
+void arch_pause() {
+    asm volatile ("sti\nhlt");
+}
+
 /**
  * @brief Get the generic parameters
  */
@@ -49,6 +49,60 @@ void cpu_setMSR(uint32_t msr, uint32_t lo, uint32_t hi) {
     asm volatile ("wrmsr" :: "a"(lo), "d"(hi), "c"(msr));
 }
 
+/**
+ * @brief Program the page attribute table of the current CPU
+ * 
+ * PAT entry 4 (PAT bit set, PCD/PWT clear) is switched to write-combining.
+ * Nothing maps through that entry before this runs, so no cache flush is needed.
+ * 
+ * @returns 1 if the PAT was programmed, 0 if the CPU has no PAT
+ */
+int cpu_patInitialize() {
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(edx & CPUID_FEAT_EDX_PAT) || !(edx & CPUID_FEAT_EDX_MSR)) return 0;
+
+    // PA4 is the low byte of the high dword
+    uint32_t lo = 0, hi = 0;
+    cpu_getMSR(X86_64_MSR_PAT, &lo, &hi);
+    hi = (hi & ~0xFF) | X86_64_PAT_WC;
+    cpu_setMSR(X86_64_MSR_PAT, lo, hi);
+
+    return 1;
+}
+
+/**
+ * @brief Enable global pages and PCIDs on the current CPU
+ * 
+ * CR4.PCIDE can only be set while CR3 holds PCID 0, so this runs before any PCID is handed out.
+ * @returns The CPU_TLB_* features that were enabled
+ */
+int cpu_tlbInitialize() {
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);
+
+    int features = 0;
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+
+    if (edx & CPUID_FEAT_EDX_PGE) {
+        cr4 |= (1 << 7);    // CR4.PGE
+        features |= CPU_TLB_GLOBAL;
+    }
+
+    if (ecx & CPUID_FEAT_ECX_PCID) {
+        cr4 |= (1 << 17);   // CR4.PCIDE
+        features |= CPU_TLB_PCID;
+
+        // INVPCID is no use without PCIDs
+        __cpuid_count(CPUID_GETEXTFEATURES, 0, eax, ebx, ecx, edx);
+        if (ebx & CPUID_FEAT7_EBX_INVPCID) features |= CPU_TLB_INVPCID;
+    }
+
+    asm volatile ("mov %0, %%cr4" :: "r"(cr4));
+    return features;
+}
+
 /**
  * @brief Perform a CPUID instruction (only for strings)
  * 
@@ -27,6 +27,9 @@
 #include <kernel/debugger.h>
 #include <kernel/gfx/term.h>
 #include <kernel/misc/args.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/mem/mem.h>
+#include <bits/string_impl.h>
 
 // Drivers (generic)
 #include <kernel/drivers/serial.h>
@@ -41,6 +44,8 @@
 #include <kernel/drivers/x86/pit.h>
 #include <kernel/drivers/x86/acpica.h> // #ifdef ACPICA_ENABLED in this file
 #include <kernel/drivers/x86/minacpi.h>
+#include <kernel/drivers/x86/ioapic.h>
+#include <kernel/drivers/pci.h>
 
 static uintptr_t hal_rsdp = 0x0;
 
@@ -72,6 +77,7 @@ static void hal_init_stage1() {
     if (serial_initialize() == 0) {
         // Setup debug output
         debug_setOutput(serial_print);
+        debug_setWriteOutput(serial_write);
     }    
 
     // Say hi!
@@ -120,6 +126,9 @@ smp_info_t *hal_initACPI() {
         return NULL;
     }
 
+    // PCI configuration space
+    ACPICA_ParseMCFG();
+
     // Get SMP information
     smp_info_t *smp = ACPICA_GetSMPInfo();
     if (!smp) {
@@ -146,6 +155,9 @@ _minacpi: ; // Jumped here if "--no-acpica" was present
         return NULL;
     }
 
+    // PCI configuration space (the MADT parser releases the tables, so this goes first)
+    minacpi_parseMCFG();
+
     // Get SMP information
     smp_info_t *info = minacpi_parseMADT();
     if (info == NULL) {
@@ -157,14 +169,30 @@ _minacpi: ; // Jumped here if "--no-acpica" was present
 }
 
 
+/**
+ * @brief Print a line of the string routine benchmark
+ */
+static void hal_printStringBenchmark(const char *line) {
+    dprintf(NOHEADER, "%s\n", line);
+}
+
 /**
  * @brief Stage 2 startup - initializes debugger, ACPI, etc.
  */
 static void hal_init_stage2() {
+    /* LOG RINGS */
+
+    // The allocator and the clock are up, so log records can be queued from here on
+    debug_startLogDrain();
+
     /* DEBUGGER INITIALIZATION */
 
     // We need to reconfigure the serial ports and initialize the debugger.
-    serial_setPort(serial_createPortData(__debug_output_com_port, __debug_output_baud_rate), 1);
+    serial_port_t *debug_port = serial_createPortData(__debug_output_com_port, __debug_output_baud_rate);
+    serial_setPort(debug_port, 1);
+
+    // Logging no longer has to wait on the UART
+    serial_enableInterrupts(debug_port);
 
     if (!__debugger_enabled) goto _no_debug;
 
@@ -175,12 +203,32 @@ static void hal_init_stage2() {
     }
 
     serial_setPort(port, 0);
+    serial_enableInterrupts(port);
     if (debugger_initialize(port) != 1) {
         dprintf(WARN, "Debugger failed to initialize or connect.\n");
     }
 
 _no_debug: ;
 
+    /* STRING ROUTINES */
+
+    // memcpy/memset/memcmp/strlen already picked their variants on first use
+    dprintf(INFO, "String routines: memcpy %s, memset %s, memcmp %s, strlen %s\n",
+                string_getSelected(STRING_OP_MEMCPY)->name, string_getSelected(STRING_OP_MEMSET)->name,
+                string_getSelected(STRING_OP_MEMCMP)->name, string_getSelected(STRING_OP_STRLEN)->name);
+
+    if (kargs_has("--string-bench")) {
+        // 2MB of scratch space measures sizes up to 1MB
+        void *scratch = kmalloc(2 * 1024 * 1024);
+        string_benchmark(scratch, 2 * 1024 * 1024, hal_printStringBenchmark);
+        kfree(scratch);
+    }
+
+    /* PAGING */
+
+    // Directory switch cost with and without PCIDs
+    if (kargs_has("--switch-bench")) mem_benchmarkSwitch();
+
     /* ACPI INITIALIZATION */
 
     smp_info_t *smp = hal_initACPI();
@@ -189,10 +237,28 @@ _no_debug: ;
     /* SMP INITIALIZATION */
     if (smp_init(smp)) {
         dprintf(ERR, "Failed to initialize SMP\n");
+        goto _no_smp;
+    }
+
+    // The APs get their own log rings
+    debug_startLogDrain();
+
+    /* I/O APIC INITIALIZATION */
+
+    // Deliver legacy IRQs through the I/O APIC so they can be spread over every CPU (needs the local APIC from SMP)
+    if (kargs_has("--no-ioapic")) {
+        dprintf(INFO, "Argument \"--no-ioapic\" found, staying on the 8259 PICs.\n");
+    } else if (ioapic_initialize(smp) == 0) {
+        hal_enableIOAPIC();
     }
 
 _no_smp: ;
 
+    /* PCI INITIALIZATION */
+
+    // Enumerate once, drivers probe the registry
+    pci_init();
+
     /* VIDEO INITIALIZATION */
 
     if (!kargs_has("--no_video")) {
@@ -15,8 +15,14 @@
 #include <kernel/arch/x86_64/hal.h>
 #include <kernel/arch/x86_64/smp.h>
 #include <kernel/arch/x86_64/arch.h>
+#include <kernel/hal.h>
+#include <kernel/drivers/x86/local_apic.h>
+#include <kernel/drivers/x86/ioapic.h>
+#include <kernel/drivers/x86/clock.h>
+#include <kernel/misc/spinlock.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
+#include <kernel/processor_data.h>
 
 #include <errno.h>
 #include <string.h>
@@ -43,8 +49,22 @@ x86_64_gdt_t gdt[MAX_CPUS] __attribute__((used)) = {{
 /* IDT */
 x86_64_interrupt_descriptor_t hal_idt_table[X86_64_MAX_INTERRUPTS];
 
-/* Interrupt handler table - TODO: More than one handler per interrupt? */
-interrupt_handler_t hal_handler_table[X86_64_MAX_INTERRUPTS];
+/* Interrupt handler table (every handler on an interrupt is called, in registration order) */
+interrupt_handler_t hal_handler_table[X86_64_MAX_INTERRUPTS][X86_64_MAX_SHARED_HANDLERS];
+static spinlock_t hal_handler_lock = { 0 };
+
+/* Interrupt statistics (each CPU only writes its own) */
+static hal_interrupt_stats_t hal_interrupt_stats[MAX_CPUS][X86_64_MAX_INTERRUPTS];
+
+/* Legacy IRQs are delivered through the I/O APIC instead of the 8259 PICs */
+static int hal_ioapic_enabled = 0;
+
+/* Dynamically allocated IRQs (bit set = allocated) */
+static uint32_t hal_irq_bitmap[X86_64_IRQ_DYNAMIC_COUNT / 32] = { 0 };
+static spinlock_t hal_irq_bitmap_lock = { 0 };
+
+/* GSI carried by each dynamic IRQ (0 = none, GSIs below 16 are legacy IRQs) */
+static uint32_t hal_irq_gsi[X86_64_IRQ_DYNAMIC_COUNT] = { 0 };
 
 /* Exception handler table - TODO: More than one handler per exception? */
 exception_handler_t hal_exception_handler_table[X86_64_MAX_EXCEPTIONS];
@@ -189,6 +209,12 @@ int hal_registerInterruptVector(uint8_t index, uint8_t flags, uint16_t segment,
  * @brief Handle ending an interrupt
  */
 void hal_endInterrupt(uintptr_t interrupt_number) {
+    // Dynamically allocated IRQs are always message signalled, straight to the local APIC
+    if (hal_ioapic_enabled || interrupt_number >= IOAPIC_LEGACY_IRQS) {
+        lapic_acknowledge();
+        return;
+    }
+
     if (interrupt_number > 8) outportb(X86_64_PIC2_COMMAND, X86_64_PIC_EOI);
     outportb(X86_64_PIC1_COMMAND, X86_64_PIC_EOI);
 }
@@ -273,31 +299,273 @@ void hal_exceptionHandler(uintptr_t exception_index, registers_t *regs, extended
  * @brief Common interrupt handler
  */
 void hal_interruptHandler(uintptr_t exception_index, uintptr_t int_number, registers_t *regs, extended_registers_t *regs_extended) {
+    uint64_t start = clock_readTSC();
+    int claimed = 0;
+
+    // Call every handler on the interrupt, a shared line can have more than one device asserting it
+    for (int i = 0; i < X86_64_MAX_SHARED_HANDLERS; i++) {
+        interrupt_handler_t handler = __atomic_load_n(&hal_handler_table[int_number][i], __ATOMIC_ACQUIRE);
+        if (!handler) continue;
+
+        int return_value = handler(exception_index, int_number, regs, regs_extended);
+        if (return_value == IRQ_HANDLED) {
+            claimed++;
+        } else if (return_value != IRQ_UNHANDLED) {
+            kernel_panic(IRQ_HANDLER_FAILED, "hal");
+            __builtin_unreachable();
+        }
+    }
+
     hal_endInterrupt(int_number);
+
+    // Account the interrupt to this CPU
+    int cpu = current_cpu->cpu_id;
+    if (cpu >= 0 && cpu < MAX_CPUS) {
+        hal_interrupt_stats_t *stats = &hal_interrupt_stats[cpu][int_number];
+        uint64_t cycles = clock_readTSC() - start;
+        stats->count++;
+        if (!claimed) stats->unclaimed++;
+        stats->cycles += cycles;
+        if (cycles > stats->max_cycles) stats->max_cycles = cycles;
+    }
+}
+
+/**
+ * @brief Unmask an IRQ in the I/O APIC once it has a handler
+ * @param int_no The IRQ
+ */
+static void hal_routeIRQ(uintptr_t int_no) {
+    if (!hal_ioapic_enabled) return;
+
+    if (int_no < IOAPIC_LEGACY_IRQS) {
+        ioapic_routeIRQ(int_no, IOAPIC_CPU_AUTO);
+    } else if (int_no < X86_64_IRQ_DYNAMIC_START + X86_64_IRQ_DYNAMIC_COUNT) {
+        uint32_t gsi = __atomic_load_n(&hal_irq_gsi[int_no - X86_64_IRQ_DYNAMIC_START], __ATOMIC_ACQUIRE);
+        if (gsi) ioapic_routeGSI(gsi, int_no, IOAPIC_CPU_AUTO);
+    }
+}
+
+/**
+ * @brief Mask an IRQ in the I/O APIC once its last handler is gone
+ * @param int_no The IRQ
+ */
+static void hal_unrouteIRQ(uintptr_t int_no) {
+    if (!hal_ioapic_enabled) return;
+
+    if (int_no < IOAPIC_LEGACY_IRQS) {
+        ioapic_unrouteIRQ(int_no);
+    } else if (int_no < X86_64_IRQ_DYNAMIC_START + X86_64_IRQ_DYNAMIC_COUNT) {
+        uint32_t gsi = __atomic_load_n(&hal_irq_gsi[int_no - X86_64_IRQ_DYNAMIC_START], __ATOMIC_ACQUIRE);
+        if (gsi) ioapic_unrouteGSI(gsi);
+    }
 }
 
 /**
  * @brief Register an interrupt handler
+ * 
+ * Up to X86_64_MAX_SHARED_HANDLERS handlers can share an interrupt. Handlers on a shared interrupt
+ * should return IRQ_UNHANDLED when their device did not assert it.
+ * 
  * @param int_no Interrupt number
- * @param handler A handler. This should return 0 on success, anything else panics.
+ * @param handler A handler. This should return IRQ_HANDLED or IRQ_UNHANDLED, anything else panics.
  *                It will take an exception number, irq number, registers, and extended registers as arguments.
- * @returns 0 on success, -EINVAL if handler is taken
+ * @returns 0 on success, -EINVAL if the handler is already registered or the interrupt is full
  */
 int hal_registerInterruptHandler(uintptr_t int_no, interrupt_handler_t handler) {
-    if (hal_handler_table[int_no] != NULL) {
+    if (int_no >= X86_64_MAX_INTERRUPTS || !handler) return -EINVAL;
+
+    spinlock_acquire(&hal_handler_lock);
+
+    int slot = -1;
+    int registered = 0;
+    for (int i = 0; i < X86_64_MAX_SHARED_HANDLERS; i++) {
+        if (hal_handler_table[int_no][i] == handler) {
+            spinlock_release(&hal_handler_lock);
+            return -EINVAL;
+        }
+
+        if (hal_handler_table[int_no][i]) registered++;
+        else if (slot == -1) slot = i;
+    }
+
+    if (slot == -1) {
+        spinlock_release(&hal_handler_lock);
         return -EINVAL;
     }
 
-    hal_handler_table[int_no] = handler;
+    __atomic_store_n(&hal_handler_table[int_no][slot], handler, __ATOMIC_RELEASE);
+    spinlock_release(&hal_handler_lock);
+
+    // I/O APIC IRQs stay masked until they have a handler
+    if (!registered) hal_routeIRQ(int_no);
 
     return 0;
 }
 
 /**
- * @brief Unregisters an interrupt handler
+ * @brief Remove a single handler from an interrupt
+ * @param int_no Interrupt number
+ * @param handler The handler to remove
+ */
+void hal_removeInterruptHandler(uintptr_t int_no, interrupt_handler_t handler) {
+    if (int_no >= X86_64_MAX_INTERRUPTS) return;
+
+    spinlock_acquire(&hal_handler_lock);
+
+    int remaining = 0;
+    for (int i = 0; i < X86_64_MAX_SHARED_HANDLERS; i++) {
+        if (hal_handler_table[int_no][i] == handler) __atomic_store_n(&hal_handler_table[int_no][i], NULL, __ATOMIC_RELEASE);
+        else if (hal_handler_table[int_no][i]) remaining++;
+    }
+
+    spinlock_release(&hal_handler_lock);
+
+    if (!remaining) hal_unrouteIRQ(int_no);
+}
+
+/**
+ * @brief Unregisters every handler on an interrupt
  */
 void hal_unregisterInterruptHandler(uintptr_t int_no) {
-    hal_handler_table[int_no] = NULL;
+    if (int_no >= X86_64_MAX_INTERRUPTS) return;
+    hal_unrouteIRQ(int_no);
+
+    spinlock_acquire(&hal_handler_lock);
+    for (int i = 0; i < X86_64_MAX_SHARED_HANDLERS; i++) {
+        __atomic_store_n(&hal_handler_table[int_no][i], NULL, __ATOMIC_RELEASE);
+    }
+    spinlock_release(&hal_handler_lock);
+}
+
+/**
+ * @brief Get the amount of handlers registered on an interrupt
+ * @param int_no The interrupt number
+ */
+int hal_getInterruptHandlerCount(uintptr_t int_no) {
+    if (int_no >= X86_64_MAX_INTERRUPTS) return 0;
+
+    int count = 0;
+    for (int i = 0; i < X86_64_MAX_SHARED_HANDLERS; i++) {
+        if (__atomic_load_n(&hal_handler_table[int_no][i], __ATOMIC_ACQUIRE)) count++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Get the interrupt statistics of a CPU
+ * @param cpu The CPU
+ * @param int_no The interrupt number
+ * @returns The statistics or NULL if either is out of range
+ */
+hal_interrupt_stats_t *hal_getInterruptStats(int cpu, uintptr_t int_no) {
+    if (cpu < 0 || cpu >= MAX_CPUS || int_no >= X86_64_MAX_INTERRUPTS) return NULL;
+    return &hal_interrupt_stats[cpu][int_no];
+}
+
+/**
+ * @brief Allocate a block of dynamic IRQs
+ * 
+ * The IRQs are numbered like any other (vector - 32) and are used with @c hal_registerInterruptHandler.
+ * They are never routed through the PIC or I/O APIC, and are meant for message signalled interrupts.
+ * 
+ * @param count The amount of consecutive IRQs to allocate
+ * @param align Alignment of the first vector (power of two, MSI needs blocks aligned to their size)
+ * @returns The first IRQ number or -ENOSPC
+ */
+int hal_allocateInterrupts(int count, int align) {
+    if (count <= 0 || align <= 0 || (align & (align - 1))) return -EINVAL;
+
+    spinlock_acquire(&hal_irq_bitmap_lock);
+
+    // Vector 32 is aligned to anything MSI can ask for, so aligning the IRQ number aligns the vector
+    int start = (X86_64_IRQ_DYNAMIC_START + align - 1) & ~(align - 1);
+    for (; start - X86_64_IRQ_DYNAMIC_START + count <= X86_64_IRQ_DYNAMIC_COUNT; start += align) {
+        int i;
+        for (i = 0; i < count; i++) {
+            int bit = start - X86_64_IRQ_DYNAMIC_START + i;
+            if (hal_irq_bitmap[bit / 32] & (1 << (bit % 32))) break;
+        }
+
+        if (i != count) continue;
+
+        for (i = 0; i < count; i++) {
+            int bit = start - X86_64_IRQ_DYNAMIC_START + i;
+            hal_irq_bitmap[bit / 32] |= (1 << (bit % 32));
+        }
+
+        spinlock_release(&hal_irq_bitmap_lock);
+        return start;
+    }
+
+    spinlock_release(&hal_irq_bitmap_lock);
+    return -ENOSPC;
+}
+
+/**
+ * @brief Free a block of dynamic IRQs
+ * 
+ * Any handlers must be unregistered first.
+ * 
+ * @param int_no The first IRQ number (as returned by @c hal_allocateInterrupts)
+ * @param count The amount of IRQs
+ */
+void hal_freeInterrupts(uintptr_t int_no, int count) {
+    spinlock_acquire(&hal_irq_bitmap_lock);
+
+    for (int i = 0; i < count; i++) {
+        if (int_no + i < X86_64_IRQ_DYNAMIC_START || int_no + i >= X86_64_IRQ_DYNAMIC_START + X86_64_IRQ_DYNAMIC_COUNT) continue;
+        int bit = int_no + i - X86_64_IRQ_DYNAMIC_START;
+        hal_irq_bitmap[bit / 32] &= ~(1 << (bit % 32));
+    }
+
+    spinlock_release(&hal_irq_bitmap_lock);
+}
+
+/**
+ * @brief Get the IRQ of a PCI INTx# line
+ * 
+ * Lines below 16 are legacy IRQs. Anything higher is taken as an I/O APIC GSI (firmware
+ * puts the GSI in the interrupt line register in APIC mode) and gets a dynamic IRQ, shared
+ * by every device on that GSI and kept for good. It stays masked until it has a handler.
+ * 
+ * @param line The interrupt line register
+ * @returns The IRQ number, -ENODEV if the line isn't connected or can't be routed, or -ENOSPC
+ */
+int hal_getLineIRQ(uint8_t line) {
+    if (line == 0xFF) return -ENODEV;
+    if (line < IOAPIC_LEGACY_IRQS) return line;
+
+    // The 8259s only have 16 inputs
+    if (!hal_ioapic_enabled || !ioapic_hasGSI(line)) return -ENODEV;
+
+    spinlock_acquire(&hal_irq_bitmap_lock);
+    for (int i = 0; i < X86_64_IRQ_DYNAMIC_COUNT; i++) {
+        if (hal_irq_gsi[i] == line) {
+            spinlock_release(&hal_irq_bitmap_lock);
+            return X86_64_IRQ_DYNAMIC_START + i;
+        }
+    }
+    spinlock_release(&hal_irq_bitmap_lock);
+
+    int irq = hal_allocateInterrupts(1, 1);
+    if (irq < 0) return irq;
+
+    // Someone else might have mapped the same GSI in the meantime
+    spinlock_acquire(&hal_irq_bitmap_lock);
+    for (int i = 0; i < X86_64_IRQ_DYNAMIC_COUNT; i++) {
+        if (hal_irq_gsi[i] == line) {
+            spinlock_release(&hal_irq_bitmap_lock);
+            hal_freeInterrupts(irq, 1);
+            return X86_64_IRQ_DYNAMIC_START + i;
+        }
+    }
+
+    __atomic_store_n(&hal_irq_gsi[irq - X86_64_IRQ_DYNAMIC_START], line, __ATOMIC_RELEASE);
+    spinlock_release(&hal_irq_bitmap_lock);
+
+    dprintf_module(INFO, "HAL", "INTx# on GSI %d is IRQ%d\n", line, irq);
+    return irq;
 }
 
 /**
@@ -374,6 +642,21 @@ void hal_disablePIC() {
     outportb(X86_64_PIC2_DATA, 0xFF);
 }
 
+/**
+ * @brief Switch legacy IRQ delivery from the 8259 PICs to the I/O APIC
+ * 
+ * @c ioapic_initialize must have succeeded. IRQs that already have handlers are routed
+ * according to the balancing policy, the rest stay masked until they get one.
+ */
+void hal_enableIOAPIC() {
+    hal_disablePIC();
+    hal_ioapic_enabled = 1;
+
+    for (uintptr_t irq = 0; irq < IOAPIC_LEGACY_IRQS; irq++) {
+        if (hal_getInterruptHandlerCount(irq)) ioapic_routeIRQ(irq, IOAPIC_CPU_AUTO);
+    }
+}
+
 /**
  * @brief Installs the IDT in the current AP
  */
@@ -440,6 +723,10 @@ void hal_initializeInterrupts() {
     hal_registerInterruptVector(46, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halIRQ14);
     hal_registerInterruptVector(47, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halIRQ15);
 
+    for (int i = 0; i < X86_64_IRQ_DYNAMIC_COUNT; i++) {
+        hal_registerInterruptVector(32 + X86_64_IRQ_DYNAMIC_START + i, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halIRQStubs + i * X86_64_IRQ_STUB_SIZE);
+    }
+
     // Install IDT in BSP
     hal_installIDT();
 
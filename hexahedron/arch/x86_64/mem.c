@@ -16,12 +16,14 @@
 
 #include <kernel/arch/x86_64/mem.h>
 #include <kernel/arch/x86_64/cpu.h>
+#include <kernel/arch/x86_64/smp.h>
 #include <kernel/mem/mem.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/processor_data.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
 #include <kernel/misc/spinlock.h>
+#include <kernel/drivers/x86/clock.h>
 
 #include <stdint.h>
 #include <string.h>
@@ -48,6 +50,23 @@ uintptr_t mem_identityMapCacheSize      = 0xAAAAAAAAAAAAAAAA;
 // Whether to use 5-level paging (TODO)
 static int mem_use5LevelPaging = 0;
 
+// Whether PAT entry 4 is write-combining
+static int mem_patAvailable = 0;
+
+// TLB features of the CPUs (CPU_TLB_*)
+static int mem_tlbFeatures = 0;
+
+// PCID allocators, one per CPU
+static mem_asid_table_t mem_asidTables[MAX_CPUS] = { 0 };
+
+// Bumped by mem_flushASIDs, a CPU drops all of its PCIDs when it sees a new value
+static uint64_t mem_asidFlushGeneration = 0;
+
+// Directory switch benchmark (mem_benchmarkSwitch)
+#define MEM_BENCH_SWITCHES      10000
+#define MEM_BENCH_PAGES         32
+#define MEM_BENCH_ADDRESS       0x0000008000000000  // PML4 entry 1, which the kernel directory doesn't use
+
 // Base page layout - loader uses this
 page_t mem_kernelPML[3][512] __attribute__((aligned(PAGE_SIZE))) = {0};
 
@@ -138,12 +157,78 @@ int mem_decrementPageReference(page_t *page) {
     return mem_pageReferences[idx];
 }
 
+/**
+ * @brief Get the physical address of a directory
+ * 
+ * Directories either come from the identity-mapped PMM region or are part of the kernel image,
+ * which is identity mapped at its physical address.
+ */
+static inline uintptr_t mem_getDirectoryPhysical(page_t *pagedir) {
+    uintptr_t address = (uintptr_t)pagedir;
+    if (address >= MEM_PHYSMEM_MAP_REGION && address < MEM_PHYSMEM_MAP_REGION + MEM_PHYSMEM_MAP_SIZE) address -= MEM_PHYSMEM_MAP_REGION;
+    return address & ~0xFFF;
+}
+
+/**
+ * @brief Invalidate TLB entries with INVPCID
+ * @param type The INVPCID type (0 = one address in one PCID)
+ * @param pcid The PCID
+ * @param address The address (type 0 only)
+ */
+static inline void mem_invpcid(uint64_t type, uint64_t pcid, uintptr_t address) {
+    struct { uint64_t pcid; uint64_t address; } descriptor = { pcid, address };
+    asm volatile ("invpcid %0, %1" :: "m"(descriptor), "r"(type) : "memory");
+}
+
+/**
+ * @brief Get the PCID of a directory on the current CPU, handing out a new one if it has none
+ * 
+ * PCIDs are handed out in order. Running out starts a new generation, which takes back all of them at once.
+ * A PCID that was just handed out may still hold the previous owner's entries, so it has to be loaded with a flush.
+ * PCID 0 is never handed out, it is what CR3 boots with and what untagged loads use.
+ * 
+ * @param table The current CPU's allocator
+ * @param dir Physical address of the directory
+ * @param fresh Set to 1 if the PCID was just handed out
+ * @returns The PCID
+ */
+static uint16_t mem_getASID(mem_asid_table_t *table, uintptr_t dir, int *fresh) {
+    // Catch up with mem_flushASIDs (also sets up the table on first use)
+    uint64_t flush_generation = __atomic_load_n(&mem_asidFlushGeneration, __ATOMIC_ACQUIRE);
+    if (!table->next || table->flush_generation != flush_generation) {
+        table->flush_generation = flush_generation;
+        table->generation++;
+        table->next = 1;
+    }
+
+    for (uint16_t asid = 1; asid < MEM_ASID_COUNT; asid++) {
+        if (table->asids[asid].dir == dir && table->asids[asid].generation == table->generation) {
+            *fresh = 0;
+            return asid;
+        }
+    }
+
+    // Out of PCIDs?
+    if (table->next >= MEM_ASID_COUNT) {
+        table->generation++;
+        table->next = 1;
+    }
+
+    uint16_t asid = table->next++;
+    table->asids[asid].dir = dir;
+    table->asids[asid].generation = table->generation;
+    *fresh = 1;
+    return asid;
+}
+
 /**
  * @brief Switch the memory management directory
  * @param pagedir The page directory to switch to, or NULL for the kernel region
  * 
+ * If the CPU has PCIDs, the directory is loaded with its own PCID and the entries it left in the TLB
+ * the last time it was loaded on this CPU are kept. Global (kernel) entries survive either way.
+ * 
  * @warning Pass something mapped by mem_clone() or something in the identity-mapped PMM region.
- *          Anything greater than IDENTITY_MAP_MAXSIZE will be truncated in the PDBR.
  * 
  * @returns -EINVAL on invalid, 0 on success.
  */
@@ -151,10 +236,63 @@ int mem_switchDirectory(page_t *pagedir) {
     if (!pagedir) pagedir = (page_t*)mem_remapPhys((uintptr_t)mem_getKernelDirectory(), 0); // remapping?
     current_cpu->current_dir = pagedir;
 
+    uintptr_t phys = mem_getDirectoryPhysical(pagedir);
+    uint64_t cr3 = phys;
+
+    int cpu = current_cpu->cpu_id;
+    if ((mem_tlbFeatures & CPU_TLB_PCID) && cpu >= 0 && cpu < MAX_CPUS) {
+        int fresh;
+        cr3 |= mem_getASID(&mem_asidTables[cpu], phys, &fresh);
+        if (!fresh) cr3 |= MEM_CR3_NOFLUSH;
+    }
+
     // Load PDBR
-    asm volatile ("movq %0, %%cr3" :: "r"((uintptr_t)pagedir & ~0xFFF));
+    asm volatile ("movq %0, %%cr3" :: "r"(cr3) : "memory");
     return 0;
+}
 
+/**
+ * @brief Drop every PCID on every CPU
+ * 
+ * Call this when a directory is freed (its physical page could come back as a different directory)
+ * or when its user mappings change while another CPU may have it tagged.
+ * Each CPU starts a new PCID generation on its next directory switch.
+ */
+void mem_flushASIDs() {
+    __atomic_add_fetch(&mem_asidFlushGeneration, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Invalidate the TLB entry of a page in a directory
+ * @param dir The directory the mapping was changed in (NULL for current)
+ * @param address The virtual address that was remapped or unmapped
+ * 
+ * @note This only covers the current CPU.
+ */
+void mem_invalidatePage(page_t *dir, uintptr_t address) {
+    // INVLPG covers the current PCID and global entries
+    if (!dir || dir == current_cpu->current_dir) {
+        asm volatile ("invlpg (%0)" :: "r"(address) : "memory");
+        return;
+    }
+
+    // Without PCIDs the entries went away when the directory was switched out
+    int cpu = current_cpu->cpu_id;
+    if (!(mem_tlbFeatures & CPU_TLB_PCID) || cpu < 0 || cpu >= MAX_CPUS) return;
+
+    // The directory might still be tagged on this CPU
+    mem_asid_table_t *table = &mem_asidTables[cpu];
+    uintptr_t phys = mem_getDirectoryPhysical(dir);
+    for (uint16_t asid = 1; asid < MEM_ASID_COUNT; asid++) {
+        if (table->asids[asid].dir != phys || table->asids[asid].generation != table->generation) continue;
+
+        if (mem_tlbFeatures & CPU_TLB_INVPCID) {
+            mem_invpcid(0, asid, address);
+        } else {
+            // Make it get a fresh (flushed) PCID next time
+            table->asids[asid].generation = 0;
+        }
+    }
 }
 
 /**
@@ -421,6 +559,14 @@ void mem_allocatePage(page_t *page, uintptr_t flags) {
     page->bits.usermode         = (flags & MEM_KERNEL) ? 0 : 1;
     page->bits.writethrough     = (flags & MEM_WRITETHROUGH) ? 1 : 0;
     page->bits.cache_disable    = (flags & MEM_NOT_CACHEABLE) ? 1 : 0;
+    page->bits.size             = 0;
+    page->bits.global           = (flags & MEM_GLOBAL) ? 1 : 0;
+
+    // Write-combining goes through PAT entry 4 (bit 7 is the PAT bit in a PTE)
+    if (flags & MEM_WRITECOMBINE) {
+        if (mem_patAvailable) page->bits.size = 1;
+        else page->bits.cache_disable = 1;
+    }
 }
 
 /**
@@ -464,7 +610,7 @@ uintptr_t mem_mapMMIO(uintptr_t phys, uintptr_t size) {
         page_t *page = mem_getPage(NULL, address + i, MEM_CREATE);
         if (page) {
             MEM_SET_FRAME(page, (phys + i));
-            mem_allocatePage(page, MEM_KERNEL | MEM_WRITETHROUGH | MEM_NOT_CACHEABLE | MEM_NOALLOC);
+            mem_allocatePage(page, MEM_KERNEL | MEM_GLOBAL | MEM_WRITETHROUGH | MEM_NOT_CACHEABLE | MEM_NOALLOC);
         }
     }
     
@@ -491,6 +637,7 @@ uintptr_t mem_allocateDMA(uintptr_t size) {
     }
 
     spinlock_acquire(&dma_lock);
+    uintptr_t address = mem_dmaRegion;
 
     // Map into memory
     for (uintptr_t i = mem_dmaRegion; i < mem_dmaRegion + size; i += PAGE_SIZE) {
@@ -503,7 +650,7 @@ uintptr_t mem_allocateDMA(uintptr_t size) {
 
     spinlock_release(&dma_lock);
 
-    return mem_dmaRegion - size;
+    return address;
 }
 
 /**
@@ -557,11 +704,12 @@ uintptr_t mem_mapDriver(size_t size) {
     }
 
     spinlock_acquire(&driver_lock);
+    uintptr_t address = mem_driverRegion;
 
     // Map into memory
     for (uintptr_t i = mem_driverRegion; i < mem_driverRegion + size; i += PAGE_SIZE) {
         page_t *pg = mem_getPage(NULL, i, MEM_CREATE);
-        if (pg) mem_allocatePage(pg, MEM_KERNEL);
+        if (pg) mem_allocatePage(pg, MEM_KERNEL | MEM_GLOBAL);
     }
 
     // Update size
@@ -569,7 +717,7 @@ uintptr_t mem_mapDriver(size_t size) {
 
     spinlock_release(&driver_lock);
 
-    return mem_driverRegion - size;
+    return address;
 }
 
 /**
@@ -592,6 +740,9 @@ void mem_unmapDriver(uintptr_t base, size_t size) {
         for (uintptr_t i = mem_driverRegion; i < mem_driverRegion + size; i += PAGE_SIZE) {
             page_t *pg = mem_getPage(NULL, i, MEM_DEFAULT);
             if (pg) mem_freePage(pg);
+
+            // Global entries survive directory switches, so they have to go explicitly
+            mem_invalidatePage(NULL, i);
         }
 
         // Release the lock
@@ -677,6 +828,10 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
         dprintf(INFO, "5-level paging is not supported by this CPU\n");
     }
 
+    // Setup the PAT for write-combining mappings
+    mem_patAvailable = cpu_patInitialize();
+    if (!mem_patAvailable) dprintf(WARN, "PAT is not supported by this CPU, write-combining mappings will be uncacheable\n");
+
     // First, create an identity map. This is important
     // !!!: == THIS IS REALLY BAD (but makes things quick)
     // !!!: We are basically going to use 2MiB pages in the identity map region and not use caching, since it isn't
@@ -694,7 +849,7 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
 
         // Using 512-page blocks
         for (size_t j = 0; j < 512; j++) {
-            mem_highBasePDs[i][j].data = ((i << 30) + (j << 21)) | 0x80 | 0x03;
+            mem_highBasePDs[i][j].data = ((i << 30) + (j << 21)) | 0x100 | 0x80 | 0x03;   // Global, 2MiB, R/W, present
         }
     }
 
@@ -743,6 +898,7 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
             mem_lowBasePT[(i * 512) + j].bits.address = ((PAGE_SIZE*512) * i + PAGE_SIZE * j) >> MEM_PAGE_SHIFT;
             mem_lowBasePT[(i * 512) + j].bits.present = 1;
             mem_lowBasePT[(i * 512) + j].bits.rw = 1;
+            mem_lowBasePT[(i * 512) + j].bits.global = 1;
         }
     }
 
@@ -790,6 +946,7 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
         mem_heapBasePT[i].bits.address = ((kernel_addr + (i << 12)) >> MEM_PAGE_SHIFT);
         mem_heapBasePT[i].bits.present = 1;
         mem_heapBasePT[i].bits.rw = 1;
+        mem_heapBasePT[i].bits.global = 1;
     }
 
     // Tada. We've finished setting up our heap, so now we need to use mem_remapPhys to remap our PML.
@@ -827,7 +984,14 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
     // Reference counts will be initialized when a user PTE is copied.
     size_t refcount_bytes = frame_bytes >> MEM_PAGE_SHIFT;  // One byte per page
     mem_pageReferences = (uint8_t*)mem_sbrk((refcount_bytes & 0xFFF) ? MEM_ALIGN_PAGE(refcount_bytes) : refcount_bytes);
-    memset(mem_pageReferences, 0, refcount_bytes);
+    memset_nt(mem_pageReferences, 0, refcount_bytes);   // Mostly untouched for a while
+
+    // Kernel mappings are global from here on. Turning on CR4.PGE also flushes everything the loader left behind.
+    mem_tlbFeatures = cpu_tlbInitialize();
+    dprintf(INFO, "TLB: global pages %s, PCIDs %s, INVPCID %s\n",
+                (mem_tlbFeatures & CPU_TLB_GLOBAL) ? "on" : "unsupported",
+                (mem_tlbFeatures & CPU_TLB_PCID) ? "on" : "unsupported",
+                (mem_tlbFeatures & CPU_TLB_INVPCID) ? "available" : "unsupported");
 
     dprintf(INFO, "Memory management initialized\n");
 }
@@ -861,6 +1025,7 @@ uintptr_t mem_sbrk(int b) {// Sanity checks
     if (b < 0) {
         for (uintptr_t i = mem_kernelHeap; i >= mem_kernelHeap + b; i -= 0x1000) {
             mem_freePage(mem_getPage(NULL, i, 0));
+            mem_invalidatePage(NULL, i);
         }
 
         uintptr_t oldStart = mem_kernelHeap;
@@ -881,11 +1046,122 @@ uintptr_t mem_sbrk(int b) {// Sanity checks
         }
 
         page_t *page = mem_getPage(NULL, i, MEM_CREATE);
-        mem_allocatePage(page, MEM_KERNEL);
+        mem_allocatePage(page, MEM_KERNEL | MEM_GLOBAL);
     }
 
     uintptr_t oldStart = mem_kernelHeap;
     mem_kernelHeap += b;
     spinlock_release(&heap_lock);
     return oldStart;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Switch directories the way it was done before PCIDs (benchmark baseline)
+ * 
+ * Everything is loaded as PCID 0 and flushed. mem_getASID never hands out PCID 0, so this doesn't disturb it.
+ */
+static void mem_switchDirectoryUntagged(page_t *pagedir) {
+    current_cpu->current_dir = pagedir;
+    asm volatile ("movq %0, %%cr3" :: "r"((uint64_t)mem_getDirectoryPhysical(pagedir)) : "memory");
+}
+
+/**
+ * @brief Switch back and forth between two directories and touch their pages
+ * @param dirs The two directories
+ * @param tagged Whether to use mem_switchDirectory (PCIDs) or the untagged baseline
+ * @param pages Pages to touch after each switch
+ * @returns TSC cycles per switch
+ */
+static uint64_t mem_benchSwitches(page_t *dirs[2], int tagged, int pages) {
+    volatile uint64_t *scratch = (volatile uint64_t*)MEM_BENCH_ADDRESS;
+
+    uint64_t start = clock_readTSC();
+    for (int i = 0; i < MEM_BENCH_SWITCHES; i++) {
+        for (int d = 0; d < 2; d++) {
+            if (tagged) mem_switchDirectory(dirs[d]);
+            else mem_switchDirectoryUntagged(dirs[d]);
+
+            for (int p = 0; p < pages; p++) (void)scratch[p * (PAGE_SIZE / sizeof(uint64_t))];
+        }
+    }
+
+    return (clock_readTSC() - start) / (MEM_BENCH_SWITCHES * 2);
+}
+
+/**
+ * @brief Free a directory made by mem_clone along with its lower-half tables
+ * 
+ * mem_clone gives every present lower-half entry a table of its own, but the pages those tables map
+ * are shared with the source directory, so only the tables are freed.
+ * Every CPU's PCIDs are dropped too, since the directory frame can come back as a new directory.
+ * 
+ * @param dir The directory (must not be loaded anywhere)
+ */
+static void mem_freeClonedDirectory(page_t *dir) {
+    for (size_t pml4 = 0; pml4 < 256; pml4++) {
+        if (!dir[pml4].bits.present) continue;
+        page_t *pdpt = (page_t*)mem_remapPhys(MEM_GET_FRAME((&dir[pml4])), PAGE_SIZE);
+
+        for (size_t pd_index = 0; pd_index < 512; pd_index++) {
+            if (!pdpt[pd_index].bits.present) continue;
+            page_t *pd = (page_t*)mem_remapPhys(MEM_GET_FRAME((&pdpt[pd_index])), PAGE_SIZE);
+
+            for (size_t pt = 0; pt < 512; pt++) {
+                if (pd[pt].bits.present) pmm_freeBlock(MEM_GET_FRAME((&pd[pt])));
+            }
+
+            pmm_freeBlock(MEM_GET_FRAME((&pdpt[pd_index])));
+        }
+
+        pmm_freeBlock(MEM_GET_FRAME((&dir[pml4])));
+    }
+
+    pmm_freeBlock(mem_getDirectoryPhysical(dir));
+    mem_flushASIDs();
+}
+
+/**
+ * @brief Measure the cost of switching directories with and without PCIDs and print the results
+ */
+void mem_benchmarkSwitch() {
+    if (!clock_getTSCSpeed()) return;
+
+    // Two directories with their own pages at the same address
+    page_t *original = mem_getCurrentDirectory();
+    page_t *dirs[2];
+    for (int d = 0; d < 2; d++) {
+        dirs[d] = mem_clone(NULL);
+        for (int p = 0; p < MEM_BENCH_PAGES; p++) {
+            mem_allocatePage(mem_getPage(dirs[d], MEM_BENCH_ADDRESS + p * PAGE_SIZE, MEM_CREATE), MEM_KERNEL);
+        }
+    }
+
+    dprintf(NOHEADER, "Directory switch benchmark (%i switches, cycles/ns per switch)\n", MEM_BENCH_SWITCHES * 2);
+    dprintf(NOHEADER, "%-14s %-22s switch + %i pages\n", "", "switch only", MEM_BENCH_PAGES);
+
+    for (int tagged = 0; tagged < 2; tagged++) {
+        if (tagged && !(mem_tlbFeatures & CPU_TLB_PCID)) {
+            dprintf(NOHEADER, "%-14s not supported by this CPU\n", "with PCIDs");
+            break;
+        }
+
+        // Warm up, then time
+        mem_benchSwitches(dirs, tagged, MEM_BENCH_PAGES);
+        uint64_t bare = mem_benchSwitches(dirs, tagged, 0);
+        uint64_t touched = mem_benchSwitches(dirs, tagged, MEM_BENCH_PAGES);
+
+        dprintf(NOHEADER, "%-14s %6u cyc %6u ns     %6u cyc %6u ns\n", tagged ? "with PCIDs" : "without PCIDs",
+                    (unsigned int)bare, (unsigned int)(bare * 1000 / clock_getTSCSpeed()),
+                    (unsigned int)touched, (unsigned int)(touched * 1000 / clock_getTSCSpeed()));
+    }
+
+    // Go back and drop the scratch pages and the directories
+    mem_switchDirectory(original);
+    for (int d = 0; d < 2; d++) {
+        for (int p = 0; p < MEM_BENCH_PAGES; p++) {
+            mem_freePage(mem_getPage(dirs[d], MEM_BENCH_ADDRESS + p * PAGE_SIZE, MEM_DEFAULT));
+        }
+
+        mem_freeClonedDirectory(dirs[d]);
+    }
+}
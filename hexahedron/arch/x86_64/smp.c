@@ -59,6 +59,13 @@ static int ap_shutdown_finished = 0;
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "SMP", __VA_ARGS__)
 
+/* Work handed to each AP by smp_runOnCPU (indexed by CPU, not APIC ID) */
+static volatile smp_work_t smp_work[MAX_CPUS] = { 0 };
+static void *smp_work_data[MAX_CPUS] = { 0 };
+
+/* IRQ used to wake an AP when it has work, -1 if none could be allocated */
+static int smp_wakeup_irq = -1;
+
 /**
  * @brief Collect AP information to store in processor_data
  * @param ap The core to store information on
@@ -71,6 +78,40 @@ static void smp_collectAPInfo(int ap) {
     processor_data[ap].cpu_family = cpu_getFamily();
 }
 
+/**
+ * @brief Wakeup IRQ handler, the AP only needs to leave hlt
+ */
+static int smp_wakeupHandler(uintptr_t exception_index, uintptr_t interrupt_no, registers_t *regs, extended_registers_t *regs_extended) {
+    return IRQ_HANDLED;
+}
+
+/**
+ * @brief AP idle loop, running anything handed over by @c smp_runOnCPU
+ * 
+ * Device interrupts the I/O APIC routes here are taken while halted.
+ */
+__attribute__((noreturn)) static void smp_idle() {
+    int cpu = -1;
+    for (int i = 0; i < smp_data->processor_count; i++) {
+        if (smp_data->lapic_ids[i] == smp_getCurrentCPU()) cpu = i;
+    }
+
+    for (;;) {
+        // Check with interrupts off, sti;hlt can't lose a wakeup that comes after this
+        asm volatile ("cli" ::: "memory");
+        smp_work_t work = (cpu > 0) ? __atomic_load_n(&smp_work[cpu], __ATOMIC_ACQUIRE) : NULL;
+
+        if (!work) {
+            arch_pause();
+            continue;
+        }
+
+        asm volatile ("sti" ::: "memory");
+        work(smp_work_data[cpu]);
+        __atomic_store_n(&smp_work[cpu], NULL, __ATOMIC_RELEASE);
+    }
+}
+
 /**
  * @brief Finish an AP's setup. This is done right after the trampoline code gets to 32-bit mode and sets up a stack
  * @param params The AP parameters set up by @c smp_prepareAP
@@ -91,6 +132,12 @@ __attribute__((noreturn)) void smp_finalizeAP() {
 
     // Initialize FPU
     cpu_fpuInitialize();
+
+    // Every core needs the same PAT
+    cpu_patInitialize();
+
+    // Global pages and PCIDs (CR3 still holds PCID 0 here)
+    cpu_tlbInitialize();
 \
     // Set current core's directory
     current_cpu->current_dir = mem_getKernelDirectory();
@@ -105,7 +152,8 @@ __attribute__((noreturn)) void smp_finalizeAP() {
     LOG(DEBUG, "CPU%i online and ready\n", smp_getCurrentCPU());
     ap_startup_finished = 1;
 
-    for (;;);
+    // Idle until there's work
+    smp_idle();
 }
 
 
@@ -192,6 +240,17 @@ int smp_init(smp_info_t *info) {
     pmm_freeBlock(temp_frame);
 
     processor_count = smp_data->processor_count;
+
+    // Get an IRQ to wake APs with
+    if (processor_count > 1) {
+        int irq = hal_allocateInterrupts(1, 1);
+        if (irq < 0 || hal_registerInterruptHandler(irq, smp_wakeupHandler)) {
+            LOG(WARN, "No wakeup IRQ available, work can't be handed to APs\n");
+        } else {
+            smp_wakeup_irq = irq;
+        }
+    }
+
     LOG(INFO, "SMP initialization completed successfully - %i CPUs available to system\n", processor_count);
 
     return 0;
@@ -204,6 +263,37 @@ int smp_getCPUCount() {
     return processor_count;
 }
 
+/**
+ * @brief Get the local APIC ID of a CPU
+ * @param cpu The CPU
+ * @returns The local APIC ID or -1 if SMP is not initialized
+ */
+int smp_getLAPICID(int cpu) {
+    if (!smp_data || cpu < 0 || cpu >= processor_count) return -1;
+    return smp_data->lapic_ids[cpu];
+}
+
+/**
+ * @brief Run a function on an idle AP
+ * 
+ * The AP runs @c work from its idle loop with interrupts enabled and takes no more work
+ * until it returns. Only one CPU should be handing out work.
+ * 
+ * @param cpu The CPU index (not the APIC ID), 0 is the BSP and can't be used
+ * @param work The function to run
+ * @param data Passed to @c work
+ * @returns 0 on success, -EINVAL if the CPU can't take work or -EBUSY if it's still running something
+ */
+int smp_runOnCPU(int cpu, smp_work_t work, void *data) {
+    if (!smp_data || !work || cpu <= 0 || cpu >= processor_count || smp_wakeup_irq < 0) return -EINVAL;
+    if (__atomic_load_n(&smp_work[cpu], __ATOMIC_ACQUIRE)) return -EBUSY;
+
+    smp_work_data[cpu] = data;
+    __atomic_store_n(&smp_work[cpu], work, __ATOMIC_RELEASE);
+    lapic_sendIPI(smp_data->lapic_ids[cpu], 32 + smp_wakeup_irq);
+    return 0;
+}
+
 /**
  * @brief Get the current CPU's APIC ID
  */
@@ -15,8 +15,16 @@
 #include <kernel/debug.h>
 #include <kernel/drivers/clock.h>
 #include <kernel/arch/arch.h>
+#include <kernel/processor_data.h>
+#include <kernel/mem/alloc.h>
 #include <kernel/misc/spinlock.h>
 
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/smp.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/smp.h>
+#endif
+
 #include <time.h>
 #include <stdarg.h>
 #include <string.h>
@@ -25,9 +33,25 @@
 /* TODO: This should be replaced with a VFS node */
 static log_putchar_method_t debug_putchar_method = NULL; 
 
-/* Spinlock */
+/* Write method (optional, faster than going through putchar) */
+static log_write_method_t debug_write_method = NULL;
+
+/* Spinlock (serializes output, not logging) */
 static spinlock_t debug_lock = { 0 };
 
+/* Per-CPU log rings (NULL until debug_startLogDrain, which fills in one per CPU known at the time) */
+static debug_log_ring_t **debug_rings = NULL;
+static int debug_ring_count = 0;
+
+/* Global record sequence */
+static uint32_t debug_sequence = 0;
+
+/* Drain in progress */
+static int debug_draining = 0;
+
+/* Panic state */
+extern int kernel_in_panic_state;
+
 
 /**
  * @brief Function to print debug string
@@ -42,9 +66,11 @@ int debug_print(void *user, char ch) {
 }
 
 /**
- * @brief Write directly to debug_print
+ * @brief Write directly to the debug output
  */
-static int debug_write(size_t length, char *buffer) {
+static int debug_write(size_t length, const char *buffer) {
+    if (debug_write_method) return debug_write_method(NULL, buffer, length);
+
     for (size_t i = 0; i < length; i++) {
         debug_print(NULL, buffer[i]);
     }
@@ -53,18 +79,20 @@ static int debug_write(size_t length, char *buffer) {
 }
 
 /**
- * @brief dprintf that accepts va_args instead
+ * @brief xvas_write_callback for the debug output
  */
-int dprintf_va(char *module, DEBUG_LOG_TYPE status, char *format, va_list ap) {
-    if (!debug_putchar_method) return 0;
-
-    // TEMP: Release the spinlock for now (and possibly remove it) - certain functions like exception handler might not be called
-    spinlock_release(&debug_lock);
-
-    spinlock_acquire(&debug_lock);
-
-    if (status == NOHEADER) goto _write_format;
+static int debug_writeCallback(void *user, const char *buffer, size_t length) {
+    return debug_write(length, buffer);
+}
 
+/**
+ * @brief Write the header of a log line
+ * @param module The module (or NULL)
+ * @param status The log level
+ * @param cpu The CPU the line was logged on
+ * @param timestamp The time of logging, -1 if the clock was not ready
+ */
+static void debug_writeHeader(char *module, DEBUG_LOG_TYPE status, int cpu, time_t timestamp) {
     // Get the header we want to use
     char header_prefix[5]; // strncpy?
     switch (status) {
@@ -86,37 +114,277 @@ int dprintf_va(char *module, DEBUG_LOG_TYPE status, char *format, va_list ap) {
 
     header_prefix[4] = 0;
 
-    // If the clock driver isn't ready we just print a blank header.
+    // If the clock driver wasn't ready we just print a blank header.
     char header[129];
     size_t header_length = 0;
-    if (!clock_isReady()) {
+    if (timestamp == -1) {
         if (module) {
             header_length = snprintf(header, 128, "[no clock ready] [%s] [%s] ", header_prefix, module);
         } else {
             header_length = snprintf(header, 128, "[no clock ready] [%s] ", header_prefix);
         }
     } else {
-        time_t rawtime;
-        time(&rawtime);
-        struct tm *timeinfo = localtime(&rawtime);
+        struct tm *timeinfo = localtime(&timestamp);
         
         if (module) {
-            header_length = snprintf(header, 128, "[%s] [CPU%i] [%s] [%s] ", asctime(timeinfo), arch_current_cpu(), header_prefix, module);
+            header_length = snprintf(header, 128, "[%s] [CPU%i] [%s] [%s] ", asctime(timeinfo), cpu, header_prefix, module);
         } else {
-            header_length = snprintf(header, 128, "[%s] [CPU%i] [%s] ", asctime(timeinfo), arch_current_cpu(), header_prefix);
+            header_length = snprintf(header, 128, "[%s] [CPU%i] [%s] ", asctime(timeinfo), cpu, header_prefix);
         }
     }
 
+    if (header_length > 128) header_length = 128;
     debug_write(header_length, header);
+}
+
+/**
+ * @brief Get the current log timestamp
+ */
+static time_t debug_timestamp() {
+    if (!clock_isReady()) return -1;
+
+    time_t rawtime;
+    time(&rawtime);
+    return rawtime;
+}
+
+/**
+ * @brief Write out a record
+ * @param record The record to write
+ */
+static void debug_writeRecord(debug_log_record_t *record) {
+    if (record->status != NOHEADER) {
+        debug_writeHeader(record->module[0] ? record->module : NULL, record->status, record->cpu, record->timestamp);
+    }
+
+    debug_write(record->length, record->message);
+    if (record->truncated) debug_write(4, "...\n");
+}
+
+/**
+ * @brief Write out queued records in sequence order
+ * @param force Skip records that were reserved but never committed and don't take the output lock (panic)
+ * @param limit Maximum amount of records to write, 0 for no limit
+ */
+static void debug_drainRecords(int force, int limit) {
+    int ring_count = __atomic_load_n(&debug_ring_count, __ATOMIC_ACQUIRE);
+    int written = 0;
+
+    while (!limit || written < limit) {
+        // Find the oldest committed record over every ring
+        debug_log_ring_t *oldest = NULL;
+        debug_log_record_t *oldest_record = NULL;
+
+        for (int i = 0; i < ring_count; i++) {
+            debug_log_ring_t *ring = debug_rings[i];
+            uint32_t tail = ring->tail;
+            uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+            // In a panic, the owner of a reserved record may never get to finish it
+            while (force && tail != head && __atomic_load_n(&ring->records[tail % DEBUG_LOG_RECORDS].committed, __ATOMIC_ACQUIRE) != tail + 1) {
+                __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+                tail++;
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            }
+
+            if (tail == head) continue;
+
+            debug_log_record_t *record = &ring->records[tail % DEBUG_LOG_RECORDS];
+            if (__atomic_load_n(&record->committed, __ATOMIC_ACQUIRE) != tail + 1) continue; // Still being written
+
+            if (!oldest_record || (int32_t)(record->sequence - oldest_record->sequence) < 0) {
+                oldest = ring;
+                oldest_record = record;
+            }
+        }
 
-_write_format: ;
-    int returnValue = xvasprintf(debug_print, NULL, format, ap);
+        if (!oldest) break;
+
+        if (!force) spinlock_acquire(&debug_lock);
+        debug_writeRecord(oldest_record);
+        if (!force) spinlock_release(&debug_lock);
+
+        // Hand the slot back to the producer
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+
+    // Report drops
+    for (int i = 0; i < ring_count; i++) {
+        debug_log_ring_t *ring = debug_rings[i];
+        uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped == ring->reported) continue;
+
+        char line[64];
+        size_t length = snprintf(line, 64, "*** CPU%i dropped %u log records\n", i, dropped - ring->reported);
+        ring->reported = dropped;
+
+        if (!force) spinlock_acquire(&debug_lock);
+        debug_writeHeader(NULL, WARN, i, debug_timestamp());
+        debug_write(length, line);
+        if (!force) spinlock_release(&debug_lock);
+    }
+}
+
+/**
+ * @brief Queue a log record on the current CPU's ring
+ * @returns The length of the message or -1 if the record was dropped
+ */
+static int debug_queue(int cpu, char *module, DEBUG_LOG_TYPE status, char *format, va_list ap) {
+    debug_log_ring_t *ring = debug_rings[cpu];
+
+    // Reserve a slot. Only interrupts on this CPU can race us for it.
+    uint32_t index = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    do {
+        if (index - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= DEBUG_LOG_RECORDS) {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->head, &index, index + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    debug_log_record_t *record = &ring->records[index % DEBUG_LOG_RECORDS];
+    record->sequence = __atomic_fetch_add(&debug_sequence, 1, __ATOMIC_RELAXED);
+    record->timestamp = (status == NOHEADER) ? -1 : debug_timestamp();
+    record->cpu = cpu;
+    record->status = status;
+
+    if (module) {
+        strncpy(record->module, module, DEBUG_LOG_MODULE_SIZE - 1);
+        record->module[DEBUG_LOG_MODULE_SIZE - 1] = 0;
+    } else {
+        record->module[0] = 0;
+    }
+
+    int length = vsnprintf(record->message, DEBUG_LOG_MESSAGE_SIZE, format, ap);
+    if (length < 0) length = 0;
+    record->truncated = (length >= DEBUG_LOG_MESSAGE_SIZE);
+    record->length = record->truncated ? DEBUG_LOG_MESSAGE_SIZE - 1 : length;
+
+    __atomic_store_n(&record->committed, index + 1, __ATOMIC_RELEASE);
+    return length;
+}
+
+/**
+ * @brief dprintf that accepts va_args instead
+ */
+int dprintf_va(char *module, DEBUG_LOG_TYPE status, char *format, va_list ap) {
+    if (!debug_putchar_method) return 0;
+
+    // Queue the record if the rings are up
+    int cpu = arch_current_cpu();
+    if (debug_rings && !kernel_in_panic_state && cpu < __atomic_load_n(&debug_ring_count, __ATOMIC_ACQUIRE)) {
+        return debug_queue(cpu, module, status, format, ap);
+    }
+
+    // Anything still queued has to come out before us
+    if (debug_rings && kernel_in_panic_state) debug_flushLog();
+
+    // TEMP: Release the spinlock for now (and possibly remove it) - certain functions like exception handler might not be called
+    spinlock_release(&debug_lock);
+
+    spinlock_acquire(&debug_lock);
+
+    if (status != NOHEADER) debug_writeHeader(module, status, cpu, debug_timestamp());
+
+    int returnValue = xvasprintf_write(debug_writeCallback, NULL, format, ap);
 
     spinlock_release(&debug_lock);
 
     return returnValue;
 }
 
+/**
+ * @brief Clock callback, writes out a few queued records every tick
+ */
+static void debug_drainTick(uint64_t ticks) {
+    if (!debug_rings || kernel_in_panic_state) return;
+    if (__atomic_exchange_n(&debug_draining, 1, __ATOMIC_ACQUIRE)) return;
+
+    debug_drainRecords(0, DEBUG_LOG_TICK_RECORDS);
+
+    __atomic_store_n(&debug_draining, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Switch the debug log to per-CPU rings
+ * 
+ * Until this is called every dprintf() is written out synchronously. Afterwards
+ * records are queued and written out by @c debug_drainLog and the clock tick.
+ * Needs the allocator and the clock. CPUs brought up later log synchronously until
+ * this is called again, which adds their rings.
+ * 
+ * @returns 0 on success
+ */
+int debug_startLogDrain() {
+    int count = (processor_count < MAX_CPUS) ? processor_count : MAX_CPUS;
+    if (debug_rings && count <= debug_ring_count) return 0;
+
+    int first = !debug_rings;
+    debug_log_ring_t **rings = debug_rings;
+    if (first) {
+        rings = kmalloc(sizeof(debug_log_ring_t*) * MAX_CPUS);
+        memset(rings, 0, sizeof(debug_log_ring_t*) * MAX_CPUS);
+    }
+
+    for (int i = debug_ring_count; i < count; i++) {
+        rings[i] = kmalloc(sizeof(debug_log_ring_t));
+        memset(rings[i], 0, sizeof(debug_log_ring_t));
+    }
+
+    // Publish the rings before the count that makes them used
+    __atomic_store_n(&debug_rings, rings, __ATOMIC_RELEASE);
+    __atomic_store_n(&debug_ring_count, count, __ATOMIC_RELEASE);
+
+    if (first && clock_registerUpdateCallback(debug_drainTick) < 0) {
+        dprintf(WARN, "Failed to register the log drain clock callback\n");
+    }
+
+    dprintf(INFO, "Logging to %i per-CPU rings of %i records\n", count, DEBUG_LOG_RECORDS);
+    return 0;
+}
+
+/**
+ * @brief Write out queued log records, oldest first
+ * 
+ * Does nothing if another CPU is already draining.
+ */
+void debug_drainLog() {
+    if (!debug_rings || kernel_in_panic_state) return;
+    if (__atomic_exchange_n(&debug_draining, 1, __ATOMIC_ACQUIRE)) return;
+
+    debug_drainRecords(0, 0);
+
+    __atomic_store_n(&debug_draining, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Synchronously write out every queued log record (panic path)
+ * 
+ * Does not wait on a drain in progress. Records that were reserved but never
+ * finished are counted as dropped.
+ */
+void debug_flushLog() {
+    if (!debug_rings) return;
+
+    // The drain (or the output lock) may belong to a CPU that is never coming back
+    __atomic_store_n(&debug_draining, 1, __ATOMIC_RELAXED);
+    debug_drainRecords(1, 0);
+    __atomic_store_n(&debug_draining, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get the amount of dropped log records
+ * @param cpu The CPU to get the counter of, or -1 for the total
+ */
+uint32_t debug_getDroppedRecords(int cpu) {
+    if (!debug_rings || cpu >= debug_ring_count) return 0;
+    if (cpu >= 0) return __atomic_load_n(&debug_rings[cpu]->dropped, __ATOMIC_RELAXED);
+
+    uint32_t total = 0;
+    for (int i = 0; i < debug_ring_count; i++) total += __atomic_load_n(&debug_rings[i]->dropped, __ATOMIC_RELAXED);
+    return total;
+}
+
 /**
  * @brief Internal function to print to debug line.
  * 
@@ -143,4 +411,104 @@ void debug_setOutput(log_putchar_method_t logMethod) {
  */
 log_putchar_method_t debug_getOutput() {
     return debug_putchar_method;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Set the debug write method
+ * @param writeMethod Writes whole runs of text (translating newlines itself), or NULL to go through the putchar method
+ */
+void debug_setWriteOutput(log_write_method_t writeMethod) {
+    debug_write_method = writeMethod;
+}
+/**** FORMATTING BENCHMARK ****/
+
+/* Calls per line and path */
+#define DEBUG_BENCH_ITERATIONS  20000
+
+/* Paths */
+#define DEBUG_BENCH_SNPRINTF    0   // Straight into a string
+#define DEBUG_BENCH_WRITE       1   // Chunks to a write(buffer, length) sink
+#define DEBUG_BENCH_PUTCHAR     2   // One call per character
+#define DEBUG_BENCH_PATHS       3
+
+/**
+ * @brief xvas_write_callback that throws the output away
+ */
+static int debug_benchWrite(void *user, const char *buffer, size_t length) {
+    return 0;
+}
+
+/**
+ * @brief xvas_callback that throws the output away
+ */
+static int debug_benchPutchar(void *user, char ch) {
+    return 0;
+}
+
+/**
+ * @brief Format a line through one of the paths
+ */
+static size_t debug_benchFormat(int path, char *buffer, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+
+    size_t length;
+    if (path == DEBUG_BENCH_SNPRINTF) {
+        length = vsnprintf(buffer, DEBUG_LOG_MESSAGE_SIZE, format, ap);
+    } else if (path == DEBUG_BENCH_WRITE) {
+        length = xvasprintf_write(debug_benchWrite, NULL, format, ap);
+    } else {
+        length = xvasprintf(debug_benchPutchar, NULL, format, ap);
+    }
+
+    va_end(ap);
+    return length;
+}
+
+/**
+ * @brief Format one of the sample lines
+ */
+static size_t debug_benchLine(int line, int path, char *buffer) {
+    switch (line) {
+        case 0:
+            return debug_benchFormat(path, buffer, "Memory management initialized\n");
+        case 1:
+            return debug_benchFormat(path, buffer, "[%s] [CPU%i] [%s] [%s] ", "Thu Jan  1 00:00:00 1970", 3, "INFO", "DRIVER:NVME");
+        case 2:
+            return debug_benchFormat(path, buffer, "Mapped %016llX to %p (%i pages)\n", 0xFFFFFF8000123000ULL, (void*)buffer, 512);
+        default:
+            return debug_benchFormat(path, buffer, "%s: %u blocks of %u bytes, %i queues, %lu IOPS\n", "nvme0n1", 1953525168u, 512u, 8, 123456UL);
+    }
+}
+
+/**
+ * @brief Measure formatting throughput of a few typical log lines and print the results
+ */
+void debug_benchmarkFormatting() {
+    static const char *line_names[] = { "literal", "log header", "hex/pointer", "decimal" };
+
+    if (!clock_isReady()) return;
+
+    char buffer[DEBUG_LOG_MESSAGE_SIZE];
+    dprintf(NOHEADER, "Formatting benchmark (%i calls per line, ns per call and MB/s of output)\n", DEBUG_BENCH_ITERATIONS);
+    dprintf(NOHEADER, "%-12s  %-23s %-23s %-23s\n", "line", "snprintf", "write(buf, len)", "per-character");
+
+    for (int line = 0; line < 4; line++) {
+        char row[128];
+        size_t row_length = snprintf(row, sizeof(row), "%-12s", line_names[line]);
+
+        for (int path = 0; path < DEBUG_BENCH_PATHS; path++) {
+            size_t bytes = 0;
+            uint64_t start = clock_getDevice().get_timer();
+            for (int i = 0; i < DEBUG_BENCH_ITERATIONS; i++) bytes += debug_benchLine(line, path, buffer);
+            uint64_t elapsed = clock_getDevice().get_timer() - start;
+            if (!elapsed) elapsed = 1;
+
+            // The timer counts microseconds, so bytes per microsecond are MB/s
+            row_length += snprintf(row + row_length, sizeof(row) - row_length, " %6u ns %6u MB/s  ",
+                                    (unsigned int)(elapsed * 1000 / DEBUG_BENCH_ITERATIONS), (unsigned int)(bytes / elapsed));
+        }
+
+        dprintf(NOHEADER, "%s\n", row);
+    }
+}
@@ -36,6 +36,8 @@
 #include <kernel/config.h>
 #include <kernel/panic.h>
 #include <kernel/misc/pool.h>
+#include <kernel/hal.h>
+#include <kernel/fs/bcache.h>
 #include <structs/list.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -45,6 +47,10 @@
 #include <kernel/arch/i386/hal.h>
 #endif
 
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+#include <kernel/drivers/x86/clock.h>
+#endif
+
 /**** VARIABLES ****/
 
 /* Log method */
@@ -181,6 +187,64 @@ _cleanup:
     return 0;
 }
 
+/**
+ * @brief Send the interrupt statistics of every CPU
+ * 
+ * Only interrupts that fired are sent. Cycles are TSC cycles, "tsc_mhz" converts them.
+ * 
+ * @param reset Zero the statistics once they are sent
+ */
+static void debugger_sendInterruptStats(int reset) {
+    json_value *entries = json_array_new(16);
+
+    for (int cpu = 0; hal_getInterruptStats(cpu, 0); cpu++) {
+        hal_interrupt_stats_t *stats;
+        for (uintptr_t int_no = 0; (stats = hal_getInterruptStats(cpu, int_no)); int_no++) {
+            if (!stats->count) continue;
+
+            json_value *entry = json_object_new(7);
+            json_object_push(entry, "cpu", json_integer_new(cpu));
+            json_object_push(entry, "irq", json_integer_new(int_no));
+            json_object_push(entry, "handlers", json_integer_new(hal_getInterruptHandlerCount(int_no)));
+            json_object_push(entry, "count", json_integer_new(stats->count));
+            json_object_push(entry, "unclaimed", json_integer_new(stats->unclaimed));
+            json_object_push(entry, "cycles", json_integer_new(stats->cycles));
+            json_object_push(entry, "max_cycles", json_integer_new(stats->max_cycles));
+            json_array_push(entries, entry);
+
+            if (reset) memset(stats, 0, sizeof(hal_interrupt_stats_t));
+        }
+    }
+
+    json_value *resp_data = json_object_new(2);
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    json_object_push(resp_data, "tsc_mhz", json_integer_new(clock_getTSCSpeed()));
+#endif
+    json_object_push(resp_data, "interrupts", entries);
+    debugger_sendPacket(PACKET_TYPE_IRQ_STATS, resp_data);
+    json_builder_free(resp_data);
+}
+
+/**
+ * @brief Send the global block cache statistics
+ */
+static void debugger_sendBlockCacheStats() {
+    bcache_stats_t stats;
+    bcache_getStats(NULL, &stats);
+
+    json_value *resp_data = json_object_new(8);
+    json_object_push(resp_data, "hits", json_integer_new(stats.hits));
+    json_object_push(resp_data, "misses", json_integer_new(stats.misses));
+    json_object_push(resp_data, "evictions", json_integer_new(stats.evictions));
+    json_object_push(resp_data, "writebacks", json_integer_new(stats.writebacks));
+    json_object_push(resp_data, "errors", json_integer_new(stats.errors));
+    json_object_push(resp_data, "prefetched", json_integer_new(stats.prefetched));
+    json_object_push(resp_data, "pages", json_integer_new(stats.pages));
+    json_object_push(resp_data, "dirty", json_integer_new(stats.dirty));
+    debugger_sendPacket(PACKET_TYPE_BCACHE_STATS, resp_data);
+    json_builder_free(resp_data);
+}
+
 /**
  * @brief Permanent loop waiting for packets until a continue one is received
  */
@@ -278,6 +342,15 @@ void debugger_packetLoop() {
                 debugger_sendPacket(PACKET_TYPE_BP_UPDATE, resp_data);
                 json_builder_free(resp_data);
                 break;
+
+            case PACKET_TYPE_IRQ_STATS:
+                json_value *reset = debugger_getPacketField(data, "reset");
+                debugger_sendInterruptStats(reset && reset->type == json_integer && reset->u.integer);
+                break;
+
+            case PACKET_TYPE_BCACHE_STATS:
+                debugger_sendBlockCacheStats();
+                break;
         }
 
     _next_packet:
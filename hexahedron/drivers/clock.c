@@ -72,8 +72,9 @@ void clock_sleep(size_t delay) {
         return;
     }
 
+    // The timer counts microseconds
     uint64_t ticks = clock_device.get_timer();
-    while (clock_device.get_timer() < ticks + delay);
+    while (clock_device.get_timer() < ticks + delay * 1000);
 }
 
 /**
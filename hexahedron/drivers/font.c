@@ -16,6 +16,8 @@
 #include <kernel/debug.h>
 #include <kernel/misc/backup-font.h>
 #include <kernel/mem/alloc.h>
+#include <string.h>
+#include <errno.h>
 
 /* Font data */
 font_data_t *current_font = NULL;
@@ -30,63 +32,290 @@ void font_init() {
 
 #ifndef KERNEL_NO_BACKUP_FONT
     current_font = kmalloc(sizeof(font_data_t));
+    memset(current_font, 0, sizeof(font_data_t));
     current_font->data = NULL;
     current_font->width = BACKUP_LARGE_FONT_CELL_WIDTH;
     current_font->height = BACKUP_LARGE_FONT_CELL_HEIGHT;
     current_font->type = FONT_TYPE_BACKUP;
 #else
-    LOG(WARN, "No backup font compiled into kernel");
+    LOG(WARN, "No backup font compiled into kernel, the terminal needs a PSF font\n");
 #endif
 }
 
 
+#ifndef KERNEL_NO_BACKUP_FONT
+
 /**
- * @brief Put character function (backup font)
+ * @brief Render a glyph (backup font)
  * 
  * Implementation of a small backup font stored within the kernel. This backup font
  * doesn't have to be compiled.
  */
-void font_putCharacterBackup(int c, int _x, int _y, color_t fg, color_t bg) {
-    uint8_t* fc = backup_large_font[c];
+static void font_renderGlyphBackup(int c, uint32_t fg, uint32_t bg, uint32_t *out) {
+    uint8_t* fc = backup_large_font[c & 0xFF];
+
+    for (uint8_t h = 0; h < current_font->height; h++) {
+        for (uint8_t w = 0; w < current_font->width; w++) {
+            *out++ = (fc[h] & (1 << (BACKUP_LARGE_FONT_MASK - w))) ? fg : bg;
+        }
+    }
+}
+
+#endif
+
+/**
+ * @brief Get the glyph index of a codepoint
+ * @param font The font
+ * @param codepoint The codepoint
+ * @returns The glyph of the codepoint, the glyph of '?' if it has none
+ */
+static uint32_t font_getGlyphIndex(font_data_t *font, uint32_t codepoint) {
+    if (!font->unicode) return (codepoint < font->glyph_count) ? codepoint : 0;
 
-    int x = _x * current_font->width;
-    int y = _y * current_font->height;
+    size_t low = 0;
+    size_t high = font->unicode_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (font->unicode[mid].codepoint < codepoint) low = mid + 1;
+        else if (font->unicode[mid].codepoint > codepoint) high = mid;
+        else return font->unicode[mid].glyph;
+    }
+
+    return (codepoint != '?') ? font_getGlyphIndex(font, '?') : 0;
+}
 
-    for (uint8_t h = 0; h < font_getHeight(); h++) {
-        for (uint8_t w = 0; w < font_getWidth(); w++) {
-            if (fc[h] & (1 << (BACKUP_LARGE_FONT_MASK - w))) {
-                // Foreground pixel
-                video_plotPixel(x+w, y+h, fg);
+/**
+ * @brief Render a glyph (PSF font)
+ * 
+ * The atlas already has a mask per pixel, so this is one masked copy per row.
+ */
+static void font_renderGlyphPSF(int c, uint32_t fg, uint32_t bg, uint32_t *out) {
+    size_t pixels = current_font->width * current_font->height;
+    uint32_t *mask = &current_font->atlas[font_getGlyphIndex(current_font, (uint32_t)c) * pixels];
+
+    for (size_t i = 0; i < pixels; i++) {
+        out[i] = (mask[i] & fg) | (~mask[i] & bg);
+    }
+}
+
+/**
+ * @brief Decode a UTF-8 codepoint from a PSF2 Unicode table
+ * @param data The table
+ * @param end The end of the file
+ * @param codepoint Output codepoint
+ * @returns Amount of bytes used, 0 if the sequence is cut off
+ */
+static size_t font_decodeUTF8(uint8_t *data, uint8_t *end, uint32_t *codepoint) {
+    size_t length;
+    if (data[0] < 0x80) { *codepoint = data[0]; return 1; }
+    else if ((data[0] & 0xE0) == 0xC0) { *codepoint = data[0] & 0x1F; length = 2; }
+    else if ((data[0] & 0xF0) == 0xE0) { *codepoint = data[0] & 0x0F; length = 3; }
+    else { *codepoint = data[0] & 0x07; length = 4; }
+
+    if (data + length > end) return 0;
+    for (size_t i = 1; i < length; i++) *codepoint = (*codepoint << 6) | (data[i] & 0x3F);
+    return length;
+}
+
+/**
+ * @brief Parse the Unicode table of a PSF font
+ * @param psf2 Whether this is a PSF2 table
+ * @param table The table
+ * @param end The end of the file
+ * @param glyphs Amount of glyphs
+ * @param out Output entries, NULL to only count them
+ * @returns Amount of entries
+ * 
+ * Multi-codepoint sequences are skipped, the terminal only draws single codepoints.
+ */
+static size_t font_parseUnicode(int psf2, uint8_t *table, uint8_t *end, uint32_t glyphs, font_unicode_t *out) {
+    size_t count = 0;
+
+    for (uint32_t glyph = 0; glyph < glyphs && table < end; glyph++) {
+        int sequence = 0;
+        while (table < end) {
+            uint32_t codepoint;
+            if (psf2) {
+                if (*table == PSF2_SEPARATOR) { table++; break; }
+                if (*table == PSF2_STARTSEQ) { sequence = 1; table++; continue; }
+
+                size_t length = font_decodeUTF8(table, end, &codepoint);
+                if (!length) return count;
+                table += length;
             } else {
-                // Background pixel
-                video_plotPixel(x+w, y+h, bg);
+                if (table + 2 > end) return count;
+                codepoint = table[0] | (table[1] << 8);
+                table += 2;
+                
+                if (codepoint == PSF1_SEPARATOR) break;
+                if (codepoint == PSF1_STARTSEQ) { sequence = 1; continue; }
+            }
+
+            if (sequence) continue;
+            if (out) {
+                out[count].codepoint = codepoint;
+                out[count].glyph = glyph;
             }
+            count++;
         }
     }
+
+    return count;
 }
 
+/**
+ * @brief Load a PSF1/PSF2 font and switch to it
+ * @param file The font file
+ * @returns 0 on success, -EINVAL on a bad font, -EIO on a read error
+ */
+int font_loadPSF(fs_node_t *file) {
+    if (!file || file->length < sizeof(psf1_header_t)) return -EINVAL;
+
+    uint8_t *data = kmalloc(file->length);
+    if (fs_read(file, 0, file->length, data) != (ssize_t)file->length) {
+        kfree(data);
+        return -EIO;
+    }
+
+    uint8_t *end = data + file->length;
+    font_data_t *font = kmalloc(sizeof(font_data_t));
+    memset(font, 0, sizeof(font_data_t));
+    font->type = FONT_TYPE_PSF;
+    font->data = data;
+
+    uint8_t *glyphs;
+    size_t charsize;
+    uint8_t *table = NULL;
+    int psf2 = 0;
+
+    psf2_header_t *psf2_header = (psf2_header_t*)data;
+    psf1_header_t *psf1_header = (psf1_header_t*)data;
+    if (file->length >= sizeof(psf2_header_t) && psf2_header->magic == PSF2_MAGIC) {
+        psf2 = 1;
+        font->width = psf2_header->width;
+        font->height = psf2_header->height;
+        font->glyph_count = psf2_header->length;
+        charsize = psf2_header->charsize;
+        glyphs = data + psf2_header->headersize;
+        if (psf2_header->flags & PSF2_HAS_UNICODE_TABLE) table = glyphs + font->glyph_count * charsize;
+    } else if (psf1_header->magic == PSF1_MAGIC) {
+        font->width = 8;
+        font->height = psf1_header->charsize;
+        font->glyph_count = (psf1_header->mode & PSF1_MODE512) ? 512 : 256;
+        charsize = psf1_header->charsize;
+        glyphs = data + sizeof(psf1_header_t);
+        if (psf1_header->mode & (PSF1_MODEHASTAB | PSF1_MODESEQ)) table = glyphs + font->glyph_count * charsize;
+    } else {
+        LOG(ERR, "Bad PSF magic\n");
+        goto _bad_font;
+    }
+
+    size_t row_bytes = (font->width + 7) / 8;
+    if (!font->width || !font->height || !font->glyph_count || font->width > 64 || font->height > 64 || font->glyph_count > 65536 || charsize < row_bytes * font->height || glyphs + font->glyph_count * charsize > end) {
+        LOG(ERR, "Bad PSF%s header (%dx%d, %d glyphs)\n", psf2 ? "2" : "1", font->width, font->height, font->glyph_count);
+        goto _bad_font;
+    }
+
+    // Expand every glyph into the atlas
+    size_t pixels = font->width * font->height;
+    font->atlas = kmalloc(font->glyph_count * pixels * sizeof(uint32_t));
+    for (uint32_t glyph = 0; glyph < font->glyph_count; glyph++) {
+        uint8_t *bitmap = glyphs + glyph * charsize;
+        uint32_t *mask = &font->atlas[glyph * pixels];
+
+        for (size_t y = 0; y < font->height; y++) {
+            for (size_t x = 0; x < font->width; x++) {
+                *mask++ = (bitmap[y * row_bytes + x / 8] & (0x80 >> (x % 8))) ? 0xFFFFFFFF : 0;
+            }
+        }
+    }
+
+    // Build the Unicode mapping
+    if (table) {
+        font->unicode_count = font_parseUnicode(psf2, table, end, font->glyph_count, NULL);
+        if (font->unicode_count) {
+            font->unicode = kmalloc(font->unicode_count * sizeof(font_unicode_t));
+            font_parseUnicode(psf2, table, end, font->glyph_count, font->unicode);
+
+            // Sort by codepoint (insertion sort, tables are a few hundred entries)
+            for (size_t i = 1; i < font->unicode_count; i++) {
+                font_unicode_t entry = font->unicode[i];
+                size_t j = i;
+                while (j > 0 && font->unicode[j - 1].codepoint > entry.codepoint) {
+                    font->unicode[j] = font->unicode[j - 1];
+                    j--;
+                }
+
+                font->unicode[j] = entry;
+            }
+        }
+    }
+
+    LOG(INFO, "Loaded PSF%s font: %dx%d, %d glyphs, %d Unicode mappings\n", psf2 ? "2" : "1", font->width, font->height, font->glyph_count, font->unicode_count);
+
+    // Switch to the new font
+    font_data_t *old = current_font;
+    current_font = font;
+
+    if (old) {
+        if (old->type == FONT_TYPE_PSF) {
+            kfree(old->data);
+            kfree(old->atlas);
+            if (old->unicode) kfree(old->unicode);
+        }
+
+        kfree(old);
+    }
+
+    return 0;
+
+_bad_font:
+    kfree(font);
+    kfree(data);
+    return -EINVAL;
+}
 
 /**
- * @brief Put a character to the screen
+ * @brief Render a glyph into a bitmap
  * @param c The character
- * @param x X coordinate - this is expected as a coordinate relative to the terminal
- * @param y Y coordinate - this is expected as a coordinate relative to the terminal
  * @param fg The foreground color to use
  * @param bg The background color to use
+ * @param out The bitmap (RGB_PIXEL format, font width * height pixels)
  */
-void font_putCharacter(int c, int x, int y, color_t fg, color_t bg) {
+void font_renderGlyph(int c, color_t fg, color_t bg, uint32_t *out) {
     if (!current_font) return;
 
     switch (current_font->type) {
+#ifndef KERNEL_NO_BACKUP_FONT
         case FONT_TYPE_BACKUP:
-            return font_putCharacterBackup(c, x, y, fg, bg);
+            return font_renderGlyphBackup(c, RGB_PIXEL(fg), RGB_PIXEL(bg), out);
+#endif
         case FONT_TYPE_PSF:
-            return;
+            return font_renderGlyphPSF(c, RGB_PIXEL(fg), RGB_PIXEL(bg), out);
         default:
             return;
     }
 }
 
+/**
+ * @brief Put a character to the screen
+ * @param c The character
+ * @param x X coordinate - this is expected as a coordinate relative to the terminal
+ * @param y Y coordinate - this is expected as a coordinate relative to the terminal
+ * @param fg The foreground color to use
+ * @param bg The background color to use
+ * 
+ * @note This renders the glyph every time, the terminal caches rendered glyphs instead.
+ */
+void font_putCharacter(int c, int x, int y, color_t fg, color_t bg) {
+    if (!current_font) return;
+
+    uint32_t *glyph = kmalloc(current_font->width * current_font->height * sizeof(uint32_t));
+    font_renderGlyph(c, fg, bg, glyph);
+    video_blit(x * current_font->width, y * current_font->height, current_font->width, current_font->height, glyph);
+    kfree(glyph);
+}
+
 /**
  * @brief Get font width
  */
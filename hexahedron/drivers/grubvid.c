@@ -16,6 +16,7 @@
 
 #include <kernel/drivers/grubvid.h>
 #include <kernel/drivers/video.h>
+#include <kernel/drivers/clock.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/mem/mem.h>
 #include <kernel/mem/pmm.h>
@@ -25,15 +26,62 @@
 /* Log method */
 #define LOG(status, message, ...) dprintf_module(status, "GRUBVID", message, ## __VA_ARGS__)
 
+/* Back buffer (32bpp, pitch is screenWidth * 4). All drawing goes here and is flushed by grubvid_updateScreen */
+static uint32_t *grubvid_backBuffer = NULL;
+
+/* Dirty span of every row, in pixels. A row is clean if start >= end */
+static uint32_t *grubvid_dirtyStart = NULL;
+static uint32_t *grubvid_dirtyEnd = NULL;
+
+/* Dirty rows (top inclusive, bottom exclusive) */
+static uint32_t grubvid_dirtyTop = 0;
+static uint32_t grubvid_dirtyBottom = 0;
+
+/**
+ * @brief Copy a span of pixels to the framebuffer
+ * @param dest The framebuffer address
+ * @param src The back buffer address
+ * @param count The amount of pixels to copy
+ * 
+ * The framebuffer is write-combining, so this wants the widest stores we can get.
+ * Reads from it are uncached and are never done.
+ */
+static inline void grubvid_copySpan(void *dest, void *src, size_t count) {
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    asm volatile ("rep movsl" : "+D"(dest), "+S"(src), "+c"(count) :: "memory");
+#else
+    uint32_t *d = (uint32_t*)dest;
+    uint32_t *s = (uint32_t*)src;
+    while (count--) *d++ = *s++;
+#endif
+}
+
+/**
+ * @brief Mark a rectangle as dirty
+ * @param driver The driver
+ * @param x X of the rectangle
+ * @param y Y of the rectangle
+ * @param width Width of the rectangle
+ * @param height Height of the rectangle
+ */
+static inline void grubvid_markDirty(video_driver_t *driver, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    for (uint32_t row = y; row < y + height; row++) {
+        if (x < grubvid_dirtyStart[row]) grubvid_dirtyStart[row] = x;
+        if (x + width > grubvid_dirtyEnd[row]) grubvid_dirtyEnd[row] = x + width;
+    }
+
+    if (y < grubvid_dirtyTop) grubvid_dirtyTop = y;
+    if (y + height > grubvid_dirtyBottom) grubvid_dirtyBottom = y + height;
+}
+
 /**
  * @brief Put pixel function
  */
 void grubvid_putPixel(video_driver_t *driver, int x, int y, color_t color) {
-    uintptr_t location = x * 4 + y * driver->screenPitch;
+    if (x < 0 || y < 0 || (uint32_t)x >= driver->screenWidth || (uint32_t)y >= driver->screenHeight) return;
 
-    driver->videoBuffer[location] = RGB_B(color);
-    driver->videoBuffer[location + 1] = RGB_G(color);
-    driver->videoBuffer[location + 2] = RGB_R(color);
+    grubvid_backBuffer[y * driver->screenWidth + x] = RGB_PIXEL(color);
+    grubvid_markDirty(driver, x, y, 1, 1);
 }
 
 /**
@@ -41,23 +89,78 @@ void grubvid_putPixel(video_driver_t *driver, int x, int y, color_t color) {
  */
 void grubvid_clearScreen(video_driver_t *driver, color_t bg) {
     // fg is ignored, fill screen with bg
-    uint8_t *buffer = driver->videoBuffer;
-    for (uint32_t y = 0; y < driver->screenHeight; y++) {
-        for (uint32_t x = 0; x < driver->screenWidth; x++) {
-            buffer[x*4] = RGB_B(bg);
-            buffer[x*4+1] = RGB_G(bg);
-            buffer[x*4+2] = RGB_R(bg);  
-        }
+    uint32_t pixel = RGB_PIXEL(bg);
+    size_t count = driver->screenWidth * driver->screenHeight;
+    for (size_t i = 0; i < count; i++) grubvid_backBuffer[i] = pixel;
+
+    grubvid_markDirty(driver, 0, 0, driver->screenWidth, driver->screenHeight);
+}
+
+/**
+ * @brief Blit function
+ */
+void grubvid_blit(video_driver_t *driver, int x, int y, int width, int height, uint32_t *pixels) {
+    // Clip to the screen
+    int stride = width;
+    if (x < 0) { pixels -= x; width += x; x = 0; }
+    if (y < 0) { pixels -= y * stride; height += y; y = 0; }
+    if (x + width > (int)driver->screenWidth) width = driver->screenWidth - x;
+    if (y + height > (int)driver->screenHeight) height = driver->screenHeight - y;
+    if (width <= 0 || height <= 0) return;
+
+    uint32_t *dest = &grubvid_backBuffer[y * driver->screenWidth + x];
+    for (int row = 0; row < height; row++) {
+        memcpy(dest, pixels, width * 4);
+        dest += driver->screenWidth;
+        pixels += stride;
+    }
+
+    grubvid_markDirty(driver, x, y, width, height);
+}
 
-        buffer += driver->screenPitch;
+/**
+ * @brief Scroll function
+ * 
+ * Moves the back buffer up, which makes the whole screen dirty.
+ */
+void grubvid_scroll(video_driver_t *driver, int lines, color_t bg) {
+    if (lines <= 0) return;
+    if ((uint32_t)lines > driver->screenHeight) lines = driver->screenHeight;
+
+    // Rows are a whole row apart, so every row copy is free of overlap
+    size_t moved = (driver->screenHeight - lines) * driver->screenWidth;
+    for (size_t i = 0; i < moved; i += driver->screenWidth) {
+        memcpy(&grubvid_backBuffer[i], &grubvid_backBuffer[i + lines * driver->screenWidth], driver->screenWidth * 4);
     }
+
+    uint32_t pixel = RGB_PIXEL(bg);
+    size_t count = driver->screenWidth * driver->screenHeight;
+    for (size_t i = moved; i < count; i++) grubvid_backBuffer[i] = pixel;
+
+    grubvid_markDirty(driver, 0, 0, driver->screenWidth, driver->screenHeight);
 }
 
 /**
  * @brief Update screen function
+ * 
+ * Copies the dirty span of every dirty row from the back buffer to the framebuffer.
  */
 void grubvid_updateScreen(struct _video_driver *driver) {
-    // No double buffering
+    if (grubvid_dirtyTop >= grubvid_dirtyBottom) return;
+
+    for (uint32_t y = grubvid_dirtyTop; y < grubvid_dirtyBottom; y++) {
+        uint32_t start = grubvid_dirtyStart[y];
+        uint32_t end = grubvid_dirtyEnd[y];
+        if (start >= end) continue;
+
+        grubvid_copySpan(driver->videoBuffer + y * driver->screenPitch + start * 4, &grubvid_backBuffer[y * driver->screenWidth + start], end - start);
+        
+        grubvid_dirtyStart[y] = driver->screenWidth;
+        grubvid_dirtyEnd[y] = 0;
+    }
+
+    grubvid_dirtyTop = driver->screenHeight;
+    grubvid_dirtyBottom = 0;
 }
 
 /**
@@ -93,16 +196,40 @@ video_driver_t *grubvid_initialize(generic_parameters_t *parameters) {
     driver->clear = grubvid_clearScreen;
     driver->update = grubvid_updateScreen;
     driver->communicate = grubvid_communicate;
+    driver->blit = grubvid_blit;
+    driver->scroll = grubvid_scroll;
 
     // BEFORE WE DO ANYTHING, WE HAVE TO REMAP THE FRAMEBUFFER TO SPECIFIED ADDRESS
+    // The framebuffer is only ever written in whole spans, so map it write-combining
     for (uintptr_t phys = parameters->framebuffer->framebuffer_addr, virt = MEM_FRAMEBUFFER_REGION;
-            phys < parameters->framebuffer->framebuffer_addr + ((driver->screenWidth * driver->screenHeight) * 4);
+            phys < parameters->framebuffer->framebuffer_addr + (driver->screenPitch * driver->screenHeight);
             phys += PAGE_SIZE, virt += PAGE_SIZE) 
     {
-        mem_mapAddress(NULL, phys, virt, MEM_KERNEL); // !!!: usermode access?
+        mem_mapAddress(NULL, phys, virt, MEM_KERNEL | MEM_WRITECOMBINE); // !!!: usermode access?
     }
 
     driver->videoBuffer = (uint8_t*)MEM_FRAMEBUFFER_REGION;
 
+    // Allocate the back buffer and dirty spans
+    grubvid_backBuffer = kmalloc(driver->screenWidth * driver->screenHeight * 4);
+    grubvid_dirtyStart = kmalloc(driver->screenHeight * sizeof(uint32_t));
+    grubvid_dirtyEnd = kmalloc(driver->screenHeight * sizeof(uint32_t));
+    for (uint32_t y = 0; y < driver->screenHeight; y++) {
+        grubvid_dirtyStart[y] = driver->screenWidth;
+        grubvid_dirtyEnd[y] = 0;
+    }
+
+    grubvid_dirtyTop = driver->screenHeight;
+    grubvid_dirtyBottom = 0;
+
+    // Draw the first frame. A full-screen flush is the worst case, so time it
+    grubvid_clearScreen(driver, COLOR_BLACK);
+    uint64_t flush_start = clock_isReady() ? clock_getDevice().get_timer() : 0;
+    grubvid_updateScreen(driver);
+
+    if (clock_isReady()) {
+        LOG(INFO, "%ix%ix%i framebuffer, full-screen flush took %i us\n", driver->screenWidth, driver->screenHeight, driver->screenBPP, (uint32_t)(clock_getDevice().get_timer() - flush_start));
+    }
+
     return driver;
 }
@@ -13,43 +13,111 @@
 
 #include <kernel/drivers/pci.h>
 #include <kernel/mem/alloc.h>
+#include <kernel/mem/mem.h>
+#include <kernel/misc/spinlock.h>
+#include <kernel/processor_data.h>
 #include <kernel/debug.h>
+#include <string.h>
+#include <errno.h>
 
 
 #if defined(__ARCH_I386__)
 #include <kernel/arch/i386/hal.h>
+#include <kernel/arch/i386/smp.h>
 #elif defined(__ARCH_X86_64__)
 #include <kernel/arch/x86_64/hal.h>
+#include <kernel/arch/x86_64/smp.h>
 #endif
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "PCI", __VA_ARGS__)
 
+/* Mechanism #1 uses an address/data register pair */
+static spinlock_t pci_port_lock = { 0 };
+
+/* ECAM ranges */
+static pci_ecam_t pci_ecam[PCI_MAX_ECAM];
+static int pci_ecam_count = 0;
+
+/* Mapped ECAM buses (0 = not yet mapped) */
+static uintptr_t pci_ecam_bus[PCI_MAX_BUS] = { 0 };
+static spinlock_t pci_ecam_lock = { 0 };
+
+/* Device registry */
+static pci_device_t *pci_devices = NULL;
+static pci_device_t *pci_devices_last = NULL;
+static int pci_device_count = 0;
+
+/* Registry indexes */
+static pci_device_t *pci_class_index[256] = { 0 };
+static pci_device_t *pci_id_index[PCI_ID_BUCKETS] = { 0 };
+
+/* Next CPU to target with message signalled interrupts */
+static int pci_next_cpu = 0;
+static spinlock_t pci_irq_lock = { 0 };
+
+/* Vendor/device ID index bucket */
+#define PCI_ID_BUCKET(vendor, device) ((((uint32_t)(vendor) * 31) ^ (uint32_t)(device)) % PCI_ID_BUCKETS)
+
+/**
+ * @brief Get the ECAM mapping of a bus
+ * @param bus The bus
+ * @returns The virtual address of the bus' configuration space or 0 if it has no ECAM range
+ */
+static uintptr_t pci_getECAM(uint8_t bus) {
+    if (pci_ecam_bus[bus]) return pci_ecam_bus[bus];
+
+    for (int i = 0; i < pci_ecam_count; i++) {
+        if (bus < pci_ecam[i].bus_start || bus > pci_ecam[i].bus_end) continue;
+
+        // Map the bus (only once, another CPU could have beaten us)
+        spinlock_acquire(&pci_ecam_lock);
+        if (!pci_ecam_bus[bus]) {
+            pci_ecam_bus[bus] = mem_mapMMIO((uintptr_t)(pci_ecam[i].address + (uint64_t)bus * PCI_ECAM_BUS_SIZE), PCI_ECAM_BUS_SIZE);
+        }
+        spinlock_release(&pci_ecam_lock);
+
+        return pci_ecam_bus[bus];
+    }
+
+    return 0;
+}
+
 /**
  * @brief Read a specific offset from the PCI configuration space
  * 
- * Uses configuration space access mechanism #1.
+ * Uses ECAM if the bus is covered by an MCFG range, configuration space access mechanism #1 otherwise.
  * List of offsets is header-specific except for general header layout, see pci.h
  * 
  * @param bus The bus of the PCI device to read from
  * @param slot The slot of the PCI device to read from
  * @param func The function of the PCI device to read (if the device supports multiple functions)
- * @param offset The offset to read from
+ * @param offset The offset to read from (extended configuration space needs ECAM)
  * @param size The size of the value you want to read from. Do note that you'll have to typecast to this (max uint32_t).
  * 
- * @returns Either PCI_NONE if an invalid size was specified, or a value according to @c size
+ * @returns Either PCI_NONE if an invalid size or offset was specified, or a value according to @c size
  */
-uint32_t pci_readConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, int size) {
+uint32_t pci_readConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, int size) {
     if (size != 1 && size != 2 && size != 4) return PCI_NONE;
+    if (offset >= PCI_ECAM_CONFIG_SIZE) return PCI_NONE;
     
-    // Generate the address
-    uint32_t address = PCI_ADDR(bus, slot, func, offset);
+    uint32_t out;
+    uintptr_t ecam = pci_getECAM(bus);
+    if (ecam) {
+        // One memory read
+        out = *(volatile uint32_t*)(ecam + PCI_ECAM_OFFSET(slot, func) + (offset & ~3));
+    } else {
+        if (offset > 0xFF) return PCI_NONE; // Mechanism #1 only reaches the legacy configuration space
 
-    // Write it to PCI_CONFIG_ADDRESS
-    outportl(PCI_CONFIG_ADDRESS, address);
+        // Generate the address
+        uint32_t address = PCI_ADDR(bus, slot, func, offset);
 
-    // Read what came out
-    uint32_t out = inportl(PCI_CONFIG_DATA);
+        // Write it to PCI_CONFIG_ADDRESS and read what came out
+        spinlock_acquire(&pci_port_lock);
+        outportl(PCI_CONFIG_ADDRESS, address);
+        out = inportl(PCI_CONFIG_DATA);
+        spinlock_release(&pci_port_lock);
+    }
 
     // Depending on size, handle it
     if (size == 1) {
@@ -67,25 +135,69 @@ uint32_t pci_readConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint8_t o
  * @param bus The bus of the PCI device to write to
  * @param slot The slot of the PCI device to write to
  * @param func The function of the PCI device to write (if the device supports multiple functions)
- * @param offset The offset to write to
+ * @param offset The offset to write to (extended configuration space needs ECAM)
  * @param value The value to write
  * 
  * @returns 0 on success
  */
-int pci_writeConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+int pci_writeConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint32_t value) {
+    if (offset >= PCI_ECAM_CONFIG_SIZE) return -EINVAL;
+
+    uintptr_t ecam = pci_getECAM(bus);
+    if (ecam) {
+        *(volatile uint32_t*)(ecam + PCI_ECAM_OFFSET(slot, func) + (offset & ~3)) = value;
+        return 0;
+    }
+
+    if (offset > 0xFF) return -EINVAL;
+
     // Generate the address
     uint32_t address = PCI_ADDR(bus, slot, func, offset);
     
-    // Write it to PCI_CONFIG_ADDRESS
+    // Write it to PCI_CONFIG_ADDRESS, then write the value
+    spinlock_acquire(&pci_port_lock);
     outportl(PCI_CONFIG_ADDRESS, address);
-
-    // Write value
     outportl(PCI_CONFIG_DATA, value);
+    spinlock_release(&pci_port_lock);
 
     // Done
     return 0;
 }
 
+/**
+ * @brief Register an ECAM range (from the ACPI MCFG table)
+ * 
+ * Buses in the range are mapped on first access. Only segment 0 is supported.
+ * 
+ * @param segment The PCI segment group
+ * @param bus_start The first bus decoded by the range
+ * @param bus_end The last bus decoded by the range
+ * @param address The physical address of the range
+ * 
+ * @returns 0 on success
+ */
+int pci_addECAM(uint16_t segment, uint8_t bus_start, uint8_t bus_end, uint64_t address) {
+    if (segment != 0) {
+        LOG(WARN, "Ignoring ECAM range for segment %d (only segment 0 is supported)\n", segment);
+        return -ENOTSUP;
+    }
+
+    if (bus_end < bus_start || pci_ecam_count >= PCI_MAX_ECAM) return -EINVAL;
+
+    // The whole range has to be addressable
+    if (address + (uint64_t)(bus_end + 1) * PCI_ECAM_BUS_SIZE - 1 > (uint64_t)UINTPTR_MAX) {
+        LOG(WARN, "Ignoring ECAM range at 0x%llx (not addressable)\n", address);
+        return -EINVAL;
+    }
+
+    pci_ecam[pci_ecam_count].address = address;
+    pci_ecam[pci_ecam_count].bus_start = bus_start;
+    pci_ecam[pci_ecam_count].bus_end = bus_end;
+    pci_ecam_count++;
+
+    LOG(INFO, "ECAM range for buses %d-%d at 0x%llx\n", bus_start, bus_end, address);
+    return 0;
+}
 
 /**
  * @brief Auto-determine a BAR type and read it using the configuration space
@@ -144,12 +256,12 @@ pci_bar_t *pci_readBAR(uint8_t bus, uint8_t slot, uint8_t func, uint8_t bar) {
         bar_out->type = PCI_BAR_MEMORY64;
 
         // Read the rest of the address
-        uint32_t bar_address_high = pci_readConfigOffset(bus, slot, func, offset + 1, 4);
+        uint32_t bar_address_high = pci_readConfigOffset(bus, slot, func, offset + 4, 4);
         
         // And the rest of the size
-        pci_writeConfigOffset(bus, slot, func, offset + 1, 0xFFFFFFFF);
-        uint32_t bar_size_high = pci_readConfigOffset(bus, slot, func, offset + 1, 4);
-        pci_writeConfigOffset(bus, slot, func, offset + 1, bar_address_high);
+        pci_writeConfigOffset(bus, slot, func, offset + 4, 0xFFFFFFFF);
+        uint32_t bar_size_high = pci_readConfigOffset(bus, slot, func, offset + 4, 4);
+        pci_writeConfigOffset(bus, slot, func, offset + 4, bar_address_high);
 
         // Now put the values in
         bar_out->address = (bar_address & 0xFFFFFFF0) | ((uint64_t)(bar_address_high & 0xFFFFFFFF) << 32);
@@ -183,103 +295,210 @@ pci_bar_t *pci_readBAR(uint8_t bus, uint8_t slot, uint8_t func, uint8_t bar) {
 }
 
 /**
- * @brief PCI callback for when a hit was found on the device
- * 
- * @param callback The callback function
- * @param data User-specified data
- * @param type The type of the device as requested
- * @param bus The bus of the device
- * @param slot The slot of the device
- * @param function The function of the device
+ * @brief Add a function to the device registry
  * 
- * @returns Whatever the callback function returns
+ * @param bus The bus of the function
+ * @param slot The slot of the function
+ * @param func The function
+ * @param vendor_id The vendor ID of the function
  */
-static int pci_scanHit(pci_callback_t callback, void *data, int type, uint8_t bus, uint8_t slot, uint8_t function) {
-    // Read vendor and device ID
-    uint16_t vendor_id = pci_readVendorID(bus, slot, function);
-    uint16_t device_id = pci_readDeviceID(bus, slot, function);
-
-    // Call
-    return callback(bus, slot, function, vendor_id, device_id, data);
+static pci_device_t *pci_addDevice(uint8_t bus, uint8_t slot, uint8_t func, uint16_t vendor_id) {
+    // The first dwords of the header hold everything we need
+    uint32_t id = pci_readConfigOffset(bus, slot, func, PCI_VENID_OFFSET, 4);
+    uint32_t class = pci_readConfigOffset(bus, slot, func, PCI_REVISION_ID_OFFSET, 4);
+
+    pci_device_t *dev = kmalloc(sizeof(pci_device_t));
+    memset(dev, 0, sizeof(pci_device_t));
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->function = func;
+    dev->header_type = pci_readConfigOffset(bus, slot, func, PCI_HEADER_TYPE_OFFSET, 1) & PCI_HEADER_TYPE;
+    dev->vendor_id = vendor_id;
+    dev->device_id = (id >> 16) & 0xFFFF;
+    dev->revision = class & 0xFF;
+    dev->progif = (class >> 8) & 0xFF;
+    dev->type = (class >> 16) & 0xFFFF;
+
+    // Cache where the interrupt capabilities are, drivers look for them on every allocation
+    dev->msi_offset = pci_findCapability(dev, PCI_CAPABILITY_MSI);
+    dev->msix_offset = pci_findCapability(dev, PCI_CAPABILITY_MSIX);
+
+    // Append to the registry, keeping the indexes in enumeration order too
+    if (pci_devices_last) pci_devices_last->next = dev;
+    else pci_devices = dev;
+    pci_devices_last = dev;
+
+    pci_device_t **link = &pci_class_index[dev->type >> 8];
+    while (*link) link = &(*link)->next_class;
+    *link = dev;
+
+    link = &pci_id_index[PCI_ID_BUCKET(dev->vendor_id, dev->device_id)];
+    while (*link) link = &(*link)->next_id;
+    *link = dev;
+
+    pci_device_count++;
+
+    LOG(DEBUG, "%02x:%02x.%d %04x:%04x type %04x progif %02x\n", bus, slot, func, dev->vendor_id, dev->device_id, dev->type, dev->progif);
+    return dev;
 }
 
+static void pci_enumerateBus(uint8_t bus, int depth);
+
 /**
- * @brief Scan and find a PCI device on a specific function
- * 
- * This is required because of @c PCI_TYPE_BRIDGE - also a remnant of the reduceOS scanner
- * 
- * @param callback The callback to use
- * @param data Any user data to pass to callback
- * @param type The type of the device. Set to -1 to ignore type field
- * @param bus The bus to use
- * @param slot The slot of the bus
- * @param func The function of the device
+ * @brief Enumerate a function, following bridges
  * 
- * @returns 0 on failure, 1 on successfully found
+ * @param bus The bus of the function
+ * @param slot The slot of the function
+ * @param func The function
+ * @param vendor_id The vendor ID of the function
+ * @param depth Bridge depth
  */
-int pci_scanFunction(pci_callback_t callback, void *data, int type, uint8_t bus, uint8_t slot, uint8_t func) {
-    if (type == -1 || type == pci_readType(bus, slot, func)) {
-        // Found it
-        return pci_scanHit(callback, data, type, bus, slot, func);
-    }
+static void pci_enumerateFunction(uint8_t bus, uint8_t slot, uint8_t func, uint16_t vendor_id, int depth) {
+    pci_device_t *dev = pci_addDevice(bus, slot, func, vendor_id);
 
-    if (pci_readType(bus, slot, func) == PCI_TYPE_BRIDGE) {
-        // It's a bridge, do more work
-        // TODO: Add header definitions for type 0x1, we're using a hardcoded PCI_SECONDARY_BUS_OFFSET (0x19) 
-        return pci_scanBus(callback, data, type, pci_readConfigOffset(bus, slot, func, 0x19, 1));
-    }
+    if (dev->type == PCI_TYPE_BRIDGE && dev->header_type == PCI_HEADER_TYPE_PCI_TO_PCI_BRIDGE) {
+        uint8_t secondary = pci_readConfigOffset(bus, slot, func, PCI_BRIDGE_SECONDARY_BUS_OFFSET, 1);
 
-    return 0;
+        // A bridge pointing back at or before its own bus is unconfigured (or broken)
+        if (secondary > bus && depth < PCI_MAX_BUS) pci_enumerateBus(secondary, depth + 1);
+    }
 }
 
 /**
- * @brief Scan and find a PCI device on a certain slot
- * 
- * @param callback The callback to use
- * @param data Any user data to pass to callback
- * @param type The type of the device. Set to -1 to ignore type field
- * @param bus The bus to use
- * @param slot The slot of the bus
- * 
- * @returns 0 on failure, 1 on successfully found
+ * @brief Enumerate a slot
+ * @param bus The bus of the slot
+ * @param slot The slot
+ * @param depth Bridge depth
  */
-int pci_scanSlot(pci_callback_t callback, void *data, int type, uint8_t bus, uint8_t slot) {
+static void pci_enumerateSlot(uint8_t bus, uint8_t slot, int depth) {
     // Does the device even exist?
-    if ((uint16_t)pci_readConfigOffset(bus, slot, 0, PCI_VENID_OFFSET, 2) == PCI_NONE) return 0;
+    uint16_t vendor_id = pci_readConfigOffset(bus, slot, 0, PCI_VENID_OFFSET, 2);
+    if (vendor_id == PCI_NONE) return;
+
+    pci_enumerateFunction(bus, slot, 0, vendor_id, depth);
 
-    // First make sure this even supports multi-function
+    // Only check the other functions if it supports multi-function
     uint8_t htype = (uint8_t)pci_readConfigOffset(bus, slot, 0, PCI_HEADER_TYPE_OFFSET, 1);
-    if (!(htype & PCI_HEADER_TYPE_MULTIFUNCTION)) {
-        // Use function 0
-        return pci_scanFunction(callback, data, type, bus, slot, 0);
+    if (!(htype & PCI_HEADER_TYPE_MULTIFUNCTION)) return;
+
+    for (uint8_t func = 1; func < PCI_MAX_FUNC; func++) {
+        vendor_id = pci_readConfigOffset(bus, slot, func, PCI_VENID_OFFSET, 2);
+        if (vendor_id != PCI_NONE) pci_enumerateFunction(bus, slot, func, vendor_id, depth);
     }
+}
 
-    // It does, scan each one.
-    for (uint32_t func = 0; func < PCI_MAX_FUNC; func++) {
-        // Does this one exist?
-        if (pci_readConfigOffset(bus, slot, func, PCI_VENID_OFFSET, 2) != PCI_NONE) {
-            int ret = pci_scanFunction(callback, data, type, bus, slot, func);
-            if (ret) return 1; // Found it!
+/**
+ * @brief Enumerate a bus
+ * @param bus The bus
+ * @param depth Bridge depth
+ */
+static void pci_enumerateBus(uint8_t bus, int depth) {
+    for (uint8_t slot = 0; slot < PCI_MAX_SLOT; slot++) {
+        pci_enumerateSlot(bus, slot, depth);
+    }
+}
+
+/**
+ * @brief Enumerate the PCI topology into the device registry
+ * @returns The amount of devices found
+ */
+int pci_init() {
+    if (pci_devices) return pci_device_count;
+
+    // Enumerate from the host bridge(s) down instead of trying every bus.
+    // A multi-function host bridge means there are multiple host controllers, function N owning bus N.
+    uint8_t htype = (uint8_t)pci_readConfigOffset(0, 0, 0, PCI_HEADER_TYPE_OFFSET, 1);
+    if (!(htype & PCI_HEADER_TYPE_MULTIFUNCTION)) {
+        pci_enumerateBus(0, 0);
+    } else {
+        for (uint8_t func = 0; func < PCI_MAX_FUNC; func++) {
+            if ((uint16_t)pci_readConfigOffset(0, 0, func, PCI_VENID_OFFSET, 2) == PCI_NONE) continue;
+            pci_enumerateBus(func, 0);
         }
     }
 
-    return 0;
+    LOG(INFO, "Found %d PCI functions (%s configuration access)\n", pci_device_count, pci_ecam_count ? "ECAM" : "port I/O");
+    return pci_device_count;
 }
 
 /**
- * @brief Scan and find a PCI device on a certain bus
+ * @brief Get the first device in the registry
+ * @returns The first device (follow @c next) or NULL
+ */
+pci_device_t *pci_getDevices() {
+    return pci_devices;
+}
+
+/**
+ * @brief Find the next device with a type
  * 
- * @param callback The callback to use
- * @param data Any user data to pass to callback
- * @param type The type of the device. Set to -1 to ignore type field
- * @param bus The bus to check
+ * @param type Class code + subclass
+ * @param from The device to continue after, NULL to start at the beginning
  * 
- * @returns 0 on failure, 1 on successfully found
+ * @returns The next device or NULL
+ */
+pci_device_t *pci_findClass(uint16_t type, pci_device_t *from) {
+    pci_device_t *dev = from ? from->next_class : pci_class_index[type >> 8];
+    while (dev && dev->type != type) dev = dev->next_class;
+    return dev;
+}
+
+/**
+ * @brief Find the next device with a vendor and device ID
+ * 
+ * @param vendor_id The vendor ID
+ * @param device_id The device ID
+ * @param from The device to continue after, NULL to start at the beginning
+ * 
+ * @returns The next device or NULL
  */
-int pci_scanBus(pci_callback_t callback, void *data, int type, uint8_t bus) {
-    // We don't need to check the validity of each as pci_scanSlot does that
-    for (uint32_t slot = 0; slot < PCI_MAX_SLOT; slot++) {
-        if (pci_scanSlot(callback, data, type, bus, slot)) return 1;
+pci_device_t *pci_findID(uint16_t vendor_id, uint16_t device_id, pci_device_t *from) {
+    pci_device_t *dev = from ? from->next_id : pci_id_index[PCI_ID_BUCKET(vendor_id, device_id)];
+    while (dev && (dev->vendor_id != vendor_id || dev->device_id != device_id)) dev = dev->next_id;
+    return dev;
+}
+
+/**
+ * @brief Check whether a device matches a match table entry
+ */
+static int pci_matchEntry(pci_match_t *entry, pci_device_t *dev) {
+    if (entry->vendor_id != PCI_ANY && entry->vendor_id != dev->vendor_id) return 0;
+    if (entry->device_id != PCI_ANY && entry->device_id != dev->device_id) return 0;
+    if (entry->type != PCI_ANY && entry->type != dev->type) return 0;
+    if (entry->progif != PCI_ANY && entry->progif != dev->progif) return 0;
+    return 1;
+}
+
+/**
+ * @brief Probe every device matching a driver match table
+ * 
+ * @param table The match table, terminated by @c PCI_MATCH_END
+ * @param probe The probe function
+ * @param data Any user data to pass to the probe function
+ * 
+ * @returns 1 if the probe function stopped probing, 0 otherwise
+ */
+int pci_probe(pci_match_t *table, pci_probe_t probe, void *data) {
+    for (pci_match_t *entry = table; entry->vendor_id || entry->device_id || entry->type || entry->progif; entry++) {
+        // Walk the narrowest index the entry allows
+        pci_device_t *dev;
+        int by_id = (entry->vendor_id != PCI_ANY && entry->device_id != PCI_ANY);
+        int by_class = (entry->type != PCI_ANY);
+
+        if (by_id) dev = pci_findID(entry->vendor_id, entry->device_id, NULL);
+        else if (by_class) dev = pci_findClass(entry->type, NULL);
+        else dev = pci_devices;
+
+        for (; dev; dev = by_id ? dev->next_id : (by_class ? dev->next_class : dev->next)) {
+            if (!pci_matchEntry(entry, dev)) continue;
+
+            // Devices matching an earlier entry were already probed
+            pci_match_t *earlier = table;
+            while (earlier != entry && !pci_matchEntry(earlier, dev)) earlier++;
+            if (earlier != entry) continue;
+
+            if (probe(dev, data)) return 1;
+        }
     }
 
     return 0;
@@ -288,6 +507,7 @@ int pci_scanBus(pci_callback_t callback, void *data, int type, uint8_t bus) {
 /**
  * @brief Scan and find a PCI device. Calls a callback function that can be used to determine the device more closely.
  * 
+ * Walks the device registry, new drivers should use @c pci_probe instead.
  * @see pci_callback_t for params/return value.
  * 
  * @param callback The callback function to call. 
@@ -297,10 +517,9 @@ int pci_scanBus(pci_callback_t callback, void *data, int type, uint8_t bus) {
  * @returns 0 on failure, 1 on successfully found
  */
 int pci_scan(pci_callback_t callback, void *data, int type) {
-    // Start scanning
-    for (uint32_t bus = 0; bus < PCI_MAX_BUS; bus++) {
-        int r = pci_scanBus(callback, data, type, bus);
-        if (r) return r;
+    for (pci_device_t *dev = pci_devices; dev; dev = dev->next) {
+        if (type != -1 && type != dev->type) continue;
+        if (callback(dev->bus, dev->slot, dev->function, dev->vendor_id, dev->device_id, data)) return 1;
     }
     
     return 0;
@@ -343,4 +562,359 @@ uint16_t pci_readVendorID(uint8_t bus, uint8_t slot, uint8_t func) {
  */
 uint16_t pci_readDeviceID(uint8_t bus, uint8_t slot, uint8_t func) {
     return pci_readConfigOffset(bus, slot, func, PCI_DEVID_OFFSET, 2);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Find a capability in a device's capabilities list
+ * 
+ * @param dev The device
+ * @param id The capability ID (e.g. @c PCI_CAPABILITY_MSI)
+ * 
+ * @returns The configuration space offset of the capability or 0 if the device doesn't have it
+ */
+uint8_t pci_findCapability(pci_device_t *dev, uint8_t id) {
+    if (dev->header_type != PCI_HEADER_TYPE_GENERAL && dev->header_type != PCI_HEADER_TYPE_PCI_TO_PCI_BRIDGE) return 0;
+
+    uint16_t status = pci_readConfigOffset(dev->bus, dev->slot, dev->function, PCI_STATUS_OFFSET, 2);
+    if (!(status & PCI_STATUS_CAPABILITIES_LIST)) return 0;
+
+    // The bottom two bits of every pointer are reserved
+    uint8_t offset = pci_readConfigOffset(dev->bus, dev->slot, dev->function, PCI_GENERAL_CAPABILITIES_OFFSET, 1) & ~3;
+    for (int i = 0; offset && i < PCI_CAPABILITY_MAX; i++) {
+        if (pci_readConfigOffset(dev->bus, dev->slot, dev->function, offset + PCI_CAPABILITY_ID_OFFSET, 1) == id) return offset;
+        offset = pci_readConfigOffset(dev->bus, dev->slot, dev->function, offset + PCI_CAPABILITY_NEXT_OFFSET, 1) & ~3;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write the message control register of a capability
+ * 
+ * Configuration space writes are a dword wide, the capability ID and next pointer below it are read-only.
+ * 
+ * @param dev The device
+ * @param offset The capability offset
+ * @param control The new message control value
+ */
+static void pci_writeMessageControl(pci_device_t *dev, uint8_t offset, uint16_t control) {
+    uint32_t header = pci_readConfigOffset(dev->bus, dev->slot, dev->function, offset, 4);
+    pci_writeConfigOffset(dev->bus, dev->slot, dev->function, offset, (header & 0xFFFF) | ((uint32_t)control << 16));
+}
+
+/**
+ * @brief Enable or disable INTx# assertion
+ * @param dev The device
+ * @param enabled Whether INTx# should be enabled
+ */
+static void pci_setINTx(pci_device_t *dev, int enabled) {
+    // Status is write-1-to-clear, keep it zero
+    uint16_t command = pci_readConfigOffset(dev->bus, dev->slot, dev->function, PCI_COMMAND_OFFSET, 2);
+    if (enabled) command &= ~PCI_COMMAND_INTERRUPT_DISABLE;
+    else command |= PCI_COMMAND_INTERRUPT_DISABLE;
+    pci_writeConfigOffset(dev->bus, dev->slot, dev->function, PCI_COMMAND_OFFSET, command);
+}
+
+/**
+ * @brief Compose a message for an IRQ
+ * 
+ * @param irq The IRQ number
+ * @param cpu The destination CPU
+ * @param address Output message address
+ * @param data Output message data
+ * 
+ * @returns 0 on success, -ENODEV if the CPU has no local APIC
+ */
+static int pci_composeMessage(int irq, int cpu, uint32_t *address, uint32_t *data) {
+    int lapic_id = smp_getLAPICID(cpu);
+    if (lapic_id < 0) return -ENODEV;
+
+    *address = PCI_MSI_ADDRESS_BASE | ((uint32_t)lapic_id << PCI_MSI_ADDRESS_DEST_SHIFT);
+    *data = (32 + irq) & PCI_MSI_DATA_VECTOR;
+    return 0;
+}
+
+/**
+ * @brief Pick the CPU of the first vector in a block
+ * @param cpu The requested CPU or @c PCI_CPU_AUTO
+ * @param count The amount of vectors in the block
+ */
+static int pci_pickCPU(int cpu, int count) {
+    if (cpu != PCI_CPU_AUTO) return cpu;
+
+    // Keep going round the CPUs so devices don't all start on the BSP
+    spinlock_acquire(&pci_irq_lock);
+    cpu = pci_next_cpu % processor_count;
+    pci_next_cpu = (pci_next_cpu + count) % processor_count;
+    spinlock_release(&pci_irq_lock);
+    return cpu;
+}
+
+/**
+ * @brief Write an MSI-X table entry
+ * 
+ * @param dev The device
+ * @param index The entry
+ * @param cpu The destination CPU
+ * 
+ * @returns 0 on success
+ */
+static int pci_writeMSIXEntry(pci_device_t *dev, int index, int cpu) {
+    uint32_t address, data;
+    if (pci_composeMessage(dev->irq_base + index, cpu, &address, &data)) return -ENODEV;
+
+    // Mask the entry while it is half-written
+    volatile uint32_t *entry = (volatile uint32_t*)(dev->msix_table + index * PCI_MSIX_ENTRY_SIZE);
+    entry[PCI_MSIX_ENTRY_CONTROL / 4] |= PCI_MSIX_ENTRY_MASKED;
+    entry[PCI_MSIX_ENTRY_ADDRESS_LOW / 4] = address;
+    entry[PCI_MSIX_ENTRY_ADDRESS_HIGH / 4] = 0;
+    entry[PCI_MSIX_ENTRY_DATA / 4] = data;
+    entry[PCI_MSIX_ENTRY_CONTROL / 4] &= ~PCI_MSIX_ENTRY_MASKED;
+    return 0;
+}
+
+/**
+ * @brief Enable MSI-X
+ * 
+ * @param dev The device
+ * @param count The amount of vectors wanted
+ * @param cpu The CPU of the first vector or @c PCI_CPU_AUTO
+ * 
+ * @returns The amount of vectors allocated or a negative error code
+ */
+static int pci_enableMSIX(pci_device_t *dev, int count, int cpu) {
+    uint16_t control = pci_readConfigOffset(dev->bus, dev->slot, dev->function, dev->msix_offset + PCI_MSIX_CONTROL_OFFSET, 2);
+    int table_size = (control & PCI_MSIX_CONTROL_TABLE_SIZE) + 1;
+    if (count > table_size) count = table_size;
+
+    // Map the table (all of it, mappings can't be given back)
+    if (!dev->msix_table) {
+        uint32_t table = pci_readConfigOffset(dev->bus, dev->slot, dev->function, dev->msix_offset + PCI_MSIX_TABLE_OFFSET, 4);
+        pci_bar_t *bar = pci_readBAR(dev->bus, dev->slot, dev->function, table & PCI_MSIX_BIR);
+        if (!bar) return -EINVAL;
+
+        if (bar->type == PCI_BAR_IO_SPACE || !bar->address) {
+            LOG(ERR, "%02x:%02x.%d: MSI-X table BAR%d is not a memory BAR\n", dev->bus, dev->slot, dev->function, table & PCI_MSIX_BIR);
+            kfree(bar);
+            return -EINVAL;
+        }
+
+        uint64_t phys = bar->address + (table & ~PCI_MSIX_BIR);
+        kfree(bar);
+
+        uintptr_t page_offset = phys & (PAGE_SIZE - 1);
+        size_t size = (page_offset + table_size * PCI_MSIX_ENTRY_SIZE + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        dev->msix_table = mem_mapMMIO((uintptr_t)(phys - page_offset), size) + page_offset;
+    }
+
+    int irq = hal_allocateInterrupts(count, 1);
+    if (irq < 0) return irq;
+
+    dev->irq_mode = PCI_IRQ_MSIX;
+    dev->irq_base = irq;
+    dev->irq_count = count;
+
+    // Enable with the function masked, program the entries, then unmask
+    pci_writeMessageControl(dev, dev->msix_offset, control | PCI_MSIX_CONTROL_ENABLE | PCI_MSIX_CONTROL_MASK_ALL);
+
+    cpu = pci_pickCPU(cpu, count);
+    for (int i = 0; i < table_size; i++) {
+        if (i < count) {
+            pci_writeMSIXEntry(dev, i, (cpu + i) % processor_count);
+        } else {
+            *(volatile uint32_t*)(dev->msix_table + i * PCI_MSIX_ENTRY_SIZE + PCI_MSIX_ENTRY_CONTROL) |= PCI_MSIX_ENTRY_MASKED;
+        }
+    }
+
+    pci_setINTx(dev, 0);
+    pci_writeMessageControl(dev, dev->msix_offset, (control | PCI_MSIX_CONTROL_ENABLE) & ~PCI_MSIX_CONTROL_MASK_ALL);
+
+    LOG(DEBUG, "%02x:%02x.%d: MSI-X, %d vectors (IRQ %d-%d) starting on CPU%d\n", dev->bus, dev->slot, dev->function, count, irq, irq + count - 1, cpu);
+    return count;
+}
+
+/**
+ * @brief Write the message of an MSI block
+ * 
+ * @param dev The device
+ * @param cpu The destination CPU
+ * 
+ * @returns 0 on success
+ */
+static int pci_writeMSIMessage(pci_device_t *dev, int cpu) {
+    uint32_t address, data;
+    if (pci_composeMessage(dev->irq_base, cpu, &address, &data)) return -ENODEV;
+
+    uint16_t control = pci_readConfigOffset(dev->bus, dev->slot, dev->function, dev->msi_offset + PCI_MSI_CONTROL_OFFSET, 2);
+    pci_writeConfigOffset(dev->bus, dev->slot, dev->function, dev->msi_offset + PCI_MSI_ADDRESS_LOW_OFFSET, address);
+
+    if (control & PCI_MSI_CONTROL_64BIT) {
+        pci_writeConfigOffset(dev->bus, dev->slot, dev->function, dev->msi_offset + PCI_MSI_ADDRESS_HIGH_OFFSET, 0);
+        pci_writeConfigOffset(dev->bus, dev->slot, dev->function, dev->msi_offset + PCI_MSI_DATA64_OFFSET, data);
+    } else {
+        pci_writeConfigOffset(dev->bus, dev->slot, dev->function, dev->msi_offset + PCI_MSI_DATA32_OFFSET, data);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Enable MSI
+ * 
+ * @param dev The device
+ * @param count The amount of vectors wanted
+ * @param cpu The destination CPU or @c PCI_CPU_AUTO
+ * 
+ * @returns The amount of vectors allocated or a negative error code
+ */
+static int pci_enableMSI(pci_device_t *dev, int count, int cpu) {
+    uint16_t control = pci_readConfigOffset(dev->bus, dev->slot, dev->function, dev->msi_offset + PCI_MSI_CONTROL_OFFSET, 2);
+    int max = 1 << ((control & PCI_MSI_CONTROL_MMC) >> PCI_MSI_CONTROL_MMC_SHIFT);
+    if (max > PCI_MSI_MAX_VECTORS) max = PCI_MSI_MAX_VECTORS;
+
+    // The device ORs the vector number into the low bits of the data, so blocks are aligned powers of two
+    int log2 = 0;
+    while ((1 << log2) < count && (1 << log2) < max) log2++;
+    count = 1 << log2;
+
+    int irq = hal_allocateInterrupts(count, count);
+    if (irq < 0) return irq;
+
+    dev->irq_mode = PCI_IRQ_MSI;
+    dev->irq_base = irq;
+    dev->irq_count = count;
+
+    cpu = pci_pickCPU(cpu, 1);
+    if (pci_writeMSIMessage(dev, cpu)) {
+        hal_freeInterrupts(irq, count);
+        dev->irq_mode = PCI_IRQ_LEGACY;
+        dev->irq_count = 0;
+        return -ENODEV;
+    }
+
+    // Unmask every vector if the device can mask them
+    if (control & PCI_MSI_CONTROL_MASKABLE) {
+        uint16_t mask = (control & PCI_MSI_CONTROL_64BIT) ? PCI_MSI_MASK64_OFFSET : PCI_MSI_MASK32_OFFSET;
+        pci_writeConfigOffset(dev->bus, dev->slot, dev->function, dev->msi_offset + mask, 0);
+    }
+
+    pci_setINTx(dev, 0);
+    control = (control & ~PCI_MSI_CONTROL_MME) | (log2 << PCI_MSI_CONTROL_MME_SHIFT) | PCI_MSI_CONTROL_ENABLE;
+    pci_writeMessageControl(dev, dev->msi_offset, control);
+
+    LOG(DEBUG, "%02x:%02x.%d: MSI, %d vectors (IRQ %d-%d) on CPU%d\n", dev->bus, dev->slot, dev->function, count, irq, irq + count - 1, cpu);
+    return count;
+}
+
+/**
+ * @brief Allocate message signalled interrupts for a device
+ * 
+ * MSI-X is preferred, every vector gets its own destination CPU (spread over the CPUs starting at @c cpu).
+ * MSI blocks are a power of two and share a single destination. INTx# is disabled while vectors are allocated.
+ * Handlers are registered with @c hal_registerInterruptHandler using @c pci_getIRQ.
+ * 
+ * @param dev The device
+ * @param count The amount of vectors wanted (e.g. one per queue per CPU)
+ * @param flags Allowed modes, @c PCI_IRQ_MSI and/or @c PCI_IRQ_MSIX
+ * @param cpu The CPU of the first vector or @c PCI_CPU_AUTO
+ * 
+ * @returns The amount of vectors allocated (can be more or less than @c count) or a negative error code
+ */
+int pci_allocateIRQs(pci_device_t *dev, int count, int flags, int cpu) {
+    if (!dev || count <= 0) return -EINVAL;
+    if (dev->irq_mode != PCI_IRQ_LEGACY) return -EBUSY;
+    if (cpu != PCI_CPU_AUTO && (cpu < 0 || cpu >= processor_count)) return -EINVAL;
+
+    // Messages go straight to a local APIC
+    if (smp_getLAPICID(0) < 0) return -ENODEV;
+
+    int r = -ENOTSUP;
+    if ((flags & PCI_IRQ_MSIX) && dev->msix_offset) {
+        r = pci_enableMSIX(dev, count, cpu);
+        if (r > 0) return r;
+    }
+
+    if ((flags & PCI_IRQ_MSI) && dev->msi_offset) {
+        r = pci_enableMSI(dev, count, cpu);
+    }
+
+    return r;
+}
+
+/**
+ * @brief Get the IRQ number of an allocated vector
+ * 
+ * @param dev The device
+ * @param index The vector index
+ * 
+ * @returns The IRQ number or -EINVAL
+ */
+int pci_getIRQ(pci_device_t *dev, int index) {
+    if (!dev || dev->irq_mode == PCI_IRQ_LEGACY || index < 0 || index >= dev->irq_count) return -EINVAL;
+    return dev->irq_base + index;
+}
+
+/**
+ * @brief Change the destination CPU of an allocated vector
+ * 
+ * MSI vectors share one destination, so this moves all of them.
+ * 
+ * @param dev The device
+ * @param index The vector index
+ * @param cpu The destination CPU
+ * 
+ * @returns 0 on success
+ */
+int pci_setIRQAffinity(pci_device_t *dev, int index, int cpu) {
+    if (!dev || index < 0 || index >= dev->irq_count) return -EINVAL;
+    if (cpu < 0 || cpu >= processor_count) return -EINVAL;
+
+    if (dev->irq_mode == PCI_IRQ_MSIX) return pci_writeMSIXEntry(dev, index, cpu);
+    if (dev->irq_mode == PCI_IRQ_MSI) return pci_writeMSIMessage(dev, cpu);
+    return -EINVAL;
+}
+
+/**
+ * @brief Free the message signalled interrupts of a device and go back to INTx#
+ * 
+ * Any handlers must be unregistered first.
+ * 
+ * @param dev The device
+ */
+void pci_freeIRQs(pci_device_t *dev) {
+    if (!dev || dev->irq_mode == PCI_IRQ_LEGACY) return;
+
+    if (dev->irq_mode == PCI_IRQ_MSIX) {
+        uint16_t control = pci_readConfigOffset(dev->bus, dev->slot, dev->function, dev->msix_offset + PCI_MSIX_CONTROL_OFFSET, 2);
+        for (int i = 0; i < dev->irq_count; i++) {
+            *(volatile uint32_t*)(dev->msix_table + i * PCI_MSIX_ENTRY_SIZE + PCI_MSIX_ENTRY_CONTROL) |= PCI_MSIX_ENTRY_MASKED;
+        }
+        pci_writeMessageControl(dev, dev->msix_offset, control & ~PCI_MSIX_CONTROL_ENABLE);
+    } else {
+        uint16_t control = pci_readConfigOffset(dev->bus, dev->slot, dev->function, dev->msi_offset + PCI_MSI_CONTROL_OFFSET, 2);
+        pci_writeMessageControl(dev, dev->msi_offset, control & ~(PCI_MSI_CONTROL_ENABLE | PCI_MSI_CONTROL_MME));
+    }
+
+    hal_freeInterrupts(dev->irq_base, dev->irq_count);
+    pci_setINTx(dev, 1);
+
+    dev->irq_mode = PCI_IRQ_LEGACY;
+    dev->irq_base = 0;
+    dev->irq_count = 0;
+}
+
+/**
+ * @brief Get the IRQ of a device's INTx# line
+ * 
+ * Lines above 15 are I/O APIC GSIs and get a dynamic IRQ (level triggered, active low),
+ * so they only work once the I/O APIC is enabled.
+ * 
+ * @param bus The bus of the device
+ * @param slot The slot of the device
+ * @param func The function of the device
+ * 
+ * @returns The IRQ number or -ENODEV if the line isn't connected or can't be routed
+ */
+int pci_getLineIRQ(uint8_t bus, uint8_t slot, uint8_t func) {
+    return hal_getLineIRQ((uint8_t)pci_readConfigOffset(bus, slot, func, PCI_GENERAL_INTERRUPT_OFFSET, 1));
+}
@@ -74,6 +74,33 @@ int serial_print(void *user, char ch) {
     }
 }
 
+/**
+ * @brief Write method - writes a run of characters to main_port or early write method.
+ * @param user Can be put as a serial_port object to write to that, or can be NULL.
+ * @param buffer The characters to write
+ * @param length The amount of characters
+ */
+int serial_write(void *user, const char *buffer, size_t length) {
+    serial_port_t *port = user ? (serial_port_t*)user : main_port;
+    if (!port || !port->write_buffer) {
+        // Nothing to batch with
+        for (size_t i = 0; i < length; i++) serial_print(user, buffer[i]);
+        return 0;
+    }
+
+    // Hand over everything between newlines at once, the newlines become CRLF
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (buffer[i] != '\n') continue;
+        if (i > start) port->write_buffer(port, buffer + start, i - start);
+        port->write_buffer(port, "\r\n", 2);
+        start = i + 1;
+    }
+
+    if (start < length) port->write_buffer(port, buffer + start, length - start);
+    return 0;
+}
+
 /**
  * @brief Set the serial early write method
  */
@@ -89,7 +116,7 @@ void serial_setEarlyWriteMethod(int (*write_method)(char ch)) {
 int serial_printf(char *format, ...) {
     va_list ap;
     va_start(ap, format);
-    int out = xvasprintf(serial_print, NULL, format, ap);
+    int out = xvasprintf_write(serial_write, NULL, format, ap);
     va_end(ap);
     return out;
 }
@@ -101,7 +128,7 @@ int serial_printf(char *format, ...) {
 int serial_portPrintf(serial_port_t *port, char *format, ...) {
     va_list ap;
     va_start(ap, format);
-    int out = xvasprintf(serial_print, (void*)port, format, ap);
+    int out = xvasprintf_write(serial_write, (void*)port, format, ap);
     va_end(ap);
     return out;
 }
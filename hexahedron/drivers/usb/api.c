@@ -15,6 +15,7 @@
 #include <kernel/drivers/usb/api.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/debug.h>
+#include <string.h>
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "USB:API", __VA_ARGS__)
@@ -174,3 +175,126 @@ USB_STATUS usb_getStringDevice(USBDevice_t *device, int idx, uint16_t lang, char
 
     return USB_SUCCESS;
 }
+
+/**
+ * @brief Find an endpoint on an interface
+ * @param intf The interface to search
+ * @param type The transfer type of the endpoint (USB_ENDP_BULK, USB_ENDP_INTERRUPT, ...)
+ * @param direction The direction of the endpoint (USB_ENDP_IN or USB_ENDP_OUT)
+ * @returns The first matching endpoint or NULL
+ */
+USBEndpoint_t *usb_getEndpoint(USBInterface_t *intf, uint8_t type, uint8_t direction) {
+    if (!intf || !intf->endpoint_list) return NULL;
+
+    foreach(endp_node, intf->endpoint_list) {
+        USBEndpoint_t *endp = (USBEndpoint_t*)endp_node->value;
+        if (!endp) continue;
+
+        if ((endp->desc.bmAttributes & USB_ENDP_TRANSFER_TYPE) == type && (endp->desc.bEndpointAddress & USB_ENDP_DIRECTION) == direction) {
+            return endp;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get the host controller method for an endpoint
+ * @param endp The endpoint
+ * @returns The bulk/interrupt method of the device or NULL
+ */
+static hc_transfer_t usb_getTransferMethod(USBEndpoint_t *endp) {
+    if (!endp || !endp->intf || !endp->intf->dev) return NULL;
+
+    switch (endp->desc.bmAttributes & USB_ENDP_TRANSFER_TYPE) {
+        case USB_ENDP_BULK:
+            return endp->intf->dev->bulk;
+        case USB_ENDP_INTERRUPT:
+            return endp->intf->dev->interrupt;
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * @brief Perform a synchronous bulk/interrupt transfer
+ * @param endp The endpoint
+ * @param length The length of the data
+ * @param data The data
+ * @param transferred Optional output for the amount of bytes actually transferred
+ */
+static USB_STATUS usb_endpointTransfer(USBEndpoint_t *endp, uintptr_t length, void *data, uint32_t *transferred) {
+    hc_transfer_t method = usb_getTransferMethod(endp);
+    if (!method) {
+        LOG(ERR, "Host controller does not support transfers on endpoint 0x%x (attributes 0x%x)\n", (endp ? endp->desc.bEndpointAddress : 0), (endp ? endp->desc.bmAttributes : 0));
+        return USB_FAILURE;
+    }
+
+    // The transfer lives on our stack - we wait for it
+    USBTransfer_t transfer;
+    memset(&transfer, 0, sizeof(USBTransfer_t));
+    transfer.endpoint = endp->desc.bEndpointAddress & USB_ENDP_NUMBER;
+    transfer.endp = endp;
+    transfer.data = data;
+    transfer.length = length;
+    transfer.status = USB_TRANSFER_IN_PROGRESS;
+
+    int status = method(endp->intf->dev->c, endp->intf->dev, &transfer);
+    if (transferred) *transferred = transfer.actual_length;
+
+    return (status == USB_TRANSFER_SUCCESS) ? USB_SUCCESS : USB_FAILURE;
+}
+
+/**
+ * @brief Perform a bulk transfer on an endpoint
+ * @param endp The bulk endpoint to do the transfer on (direction is taken from the endpoint)
+ * @param length The length of the data
+ * @param data The data to send/receive
+ * @param transferred Optional output for the amount of bytes actually transferred
+ * 
+ * @returns USB_SUCCESS on success
+ */
+USB_STATUS usb_bulkTransfer(USBEndpoint_t *endp, uintptr_t length, void *data, uint32_t *transferred) {
+    if (!endp || (endp->desc.bmAttributes & USB_ENDP_TRANSFER_TYPE) != USB_ENDP_BULK) return USB_FAILURE;
+    return usb_endpointTransfer(endp, length, data, transferred);
+}
+
+/**
+ * @brief Perform an interrupt transfer on an endpoint
+ * @param endp The interrupt endpoint to do the transfer on (direction is taken from the endpoint)
+ * @param length The length of the data
+ * @param data The data to send/receive
+ * @param transferred Optional output for the amount of bytes actually transferred
+ * 
+ * @returns USB_SUCCESS on success
+ */
+USB_STATUS usb_interruptTransfer(USBEndpoint_t *endp, uintptr_t length, void *data, uint32_t *transferred) {
+    if (!endp || (endp->desc.bmAttributes & USB_ENDP_TRANSFER_TYPE) != USB_ENDP_INTERRUPT) return USB_FAILURE;
+    return usb_endpointTransfer(endp, length, data, transferred);
+}
+
+/**
+ * @brief Submit an asynchronous bulk or interrupt transfer
+ * 
+ * The transfer must have @c endp, @c data, @c length and @c callback set. The callback is called
+ * (possibly from IRQ context) once the transfer completes. Interrupt transfers with @c USB_TRANSFER_REPEAT
+ * are rearmed by the host controller after every callback, which is how class drivers should poll
+ * interrupt endpoints (no per-packet allocation or setup).
+ * 
+ * @param transfer The transfer to submit. Must stay valid until it completes
+ * @returns USB_SUCCESS if the transfer was scheduled
+ */
+USB_STATUS usb_submitTransfer(USBTransfer_t *transfer) {
+    if (!transfer || !transfer->callback) return USB_FAILURE;
+
+    hc_transfer_t method = usb_getTransferMethod(transfer->endp);
+    if (!method) return USB_FAILURE;
+
+    transfer->endpoint = transfer->endp->desc.bEndpointAddress & USB_ENDP_NUMBER;
+    transfer->actual_length = 0;
+    transfer->status = USB_TRANSFER_IN_PROGRESS;
+
+    // Completions can come in before the method returns, so only a failure here is meaningful
+    if (method(transfer->endp->intf->dev->c, transfer->endp->intf->dev, transfer) == USB_TRANSFER_FAILED) return USB_FAILURE;
+    return USB_SUCCESS;
+}
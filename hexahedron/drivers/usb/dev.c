@@ -156,6 +156,7 @@ int usb_requestDevice(USBDevice_t *device, uintptr_t type, uintptr_t request, ui
 
     // Create a new transfer
     USBTransfer_t *transfer = kmalloc(sizeof(USBTransfer_t));
+    memset(transfer, 0, sizeof(USBTransfer_t));
     transfer->req = req;
     transfer->endpoint = 0;      // TODO: Allow custom endpoints - CONTROL requests don't necessary have to come from the DCP
     transfer->status = USB_TRANSFER_IN_PROGRESS;
@@ -289,7 +290,9 @@ USBConfiguration_t *usb_getConfigurationFromIndex(USBDevice_t *dev, int index) {
                 // Get the endpoint
                 USBEndpointDescriptor_t *endpoint_desc = (USBEndpointDescriptor_t*)buffer;
                 USBEndpoint_t *endp = kmalloc(sizeof(USBEndpoint_t));
+                memset(endp, 0, sizeof(USBEndpoint_t));
                 memcpy((void*)&endp->desc, (void*)endpoint_desc, sizeof(USBEndpointDescriptor_t));
+                endp->intf = interface;
                 list_append(interface->endpoint_list, (void*)endp);
 
                 LOG(DEBUG, "\tEndpoint available with bEndpointAddress 0x%x bmAttributes 0x%x wMaxPacketSize %d\n", endp->desc.bEndpointAddress, endp->desc.bmAttributes, endp->desc.wMaxPacketSize);
@@ -347,8 +350,8 @@ USB_STATUS usb_initializeDevice(USBDevice_t *dev) {
         return USB_FAILURE;
     }
 
-    // Allow the device a 20ms recovery time
-    clock_sleep(20);
+    // Allow the device its SET_ADDRESS recovery time (TRSETRQ, 2ms)
+    clock_sleep(2);
 
     dev->address = address;
 
@@ -457,6 +460,7 @@ USB_STATUS usb_initializeDevice(USBDevice_t *dev) {
  */
 USB_STATUS usb_deinitializeDevice(USBDevice_t *dev) { 
     if (!dev) return USB_FAILURE;
+    USB_STATUS ret = USB_SUCCESS;
 
     // We need to find all interfaces with a registered device driver
     foreach(conf_node, dev->config_list) {
@@ -469,10 +473,11 @@ USB_STATUS usb_deinitializeDevice(USBDevice_t *dev) {
 
             if (intf->driver->dev_deinit(intf) != USB_SUCCESS) {
                 LOG(WARN, "Driver '%s' failed to deinitialize\n", intf->driver->name);
+                ret = USB_FAILURE;
             }
         }
     }
 
     // TODO: Implement a host controller shutdown method because we need to actually disable the device.
-    return USB_SUCCESS;
+    return ret;
 }
\ No newline at end of file
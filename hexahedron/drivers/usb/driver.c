@@ -15,12 +15,16 @@
 #include <kernel/drivers/usb/usb.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/debug.h>
+#include <kernel/misc/spinlock.h>
 #include <structs/list.h>
 #include <string.h>
 
 /* Device driver list */
 list_t *usb_driver_list = NULL;
 
+/* Class drivers can be registered from several CPUs at once */
+static spinlock_t usb_driver_list_lock = { 0 };
+
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "USB:DRIVER", __VA_ARGS__)
 
@@ -125,7 +129,9 @@ USB_STATUS usb_registerDriver(USBDriver_t *driver) {
     if (!driver) return USB_FAILURE;
 
     // Add it to the list
+    spinlock_acquire(&usb_driver_list_lock);
     list_append(usb_driver_list, (void*)driver);
+    spinlock_release(&usb_driver_list_lock);
 
     // Now get all devices and try them all.
     // !!!: Hacky
@@ -148,7 +154,7 @@ extern list_t *usb_controller_list;
                 USBInterface_t *intf = (USBInterface_t*)(intf_node->value);
                 if (!intf) continue;
                 if (usb_driverInitializeDevice(driver, dev, intf) == USB_SUCCESS) {
-                    return USB_SUCCESS; // All done
+                    break; // Device claimed, keep going with the other devices (e.g. several USB sticks)
                 }       
             }
         }
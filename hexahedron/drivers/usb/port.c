@@ -0,0 +1,372 @@
+/**
+ * @file hexahedron/drivers/usb/port.c
+ * @brief USB port hotplug engine
+ *
+ * Every port of every registered hub runs through a small state machine:
+ *
+ *      DISCONNECTED -> DEBOUNCE -> (WAIT_RESET) -> RESET -> RECOVERY -> ATTACHED
+ *
+ * Each timed state has a deadline instead of a sleep, so the debounce/reset delays
+ * of all ports overlap. Only the reset-to-SET_ADDRESS window is serialized per
+ * controller (every device in it answers on address 0), and only when the hub says so.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/drivers/usb/usb.h>
+#include <kernel/drivers/clock.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/debug.h>
+#include <kernel/misc/spinlock.h>
+#include <structs/list.h>
+#include <string.h>
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "USB:PORT", __VA_ARGS__)
+
+/* List of port hubs */
+static list_t *usb_hub_list = NULL;
+
+/* Protects usb_hub_list against controllers registering from several CPUs */
+static spinlock_t usb_hub_list_lock = { 0 };
+
+/* Bumped whenever a hub is registered or unregistered (so usb_work knows its list walk is stale) */
+static uint32_t usb_hub_generation = 0;
+
+/* Worker reentrancy guard */
+static int usb_work_busy = 0;
+
+/**
+ * @brief Get the current time in microseconds
+ */
+static uint64_t usb_portTime() {
+    if (!clock_isReady()) return 0;
+    return clock_getDevice().get_timer();
+}
+
+/**
+ * @brief Set the state of a port
+ * @param port The port
+ * @param state The new state
+ * @param timeout Time until the state times out (ms), 0 for none
+ */
+static void usb_portSetState(USBPort_t *port, int state, uint32_t timeout) {
+    port->state = state;
+    port->deadline = (timeout) ? usb_portTime() + (uint64_t)timeout * 1000 : 0;
+}
+
+/**
+ * @brief Create a port hub
+ * @param name The name of the hub
+ * @param controller The controller the hub is on
+ * @param hub Hub-specific data
+ * @param nports The amount of ports
+ * @returns A new port hub (fill in the methods and call @c usb_registerPortHub)
+ */
+USBPortHub_t *usb_createPortHub(char *name, USBController_t *controller, void *hub, uint32_t nports) {
+    if (nports > USB_PORT_MAX) nports = USB_PORT_MAX;
+
+    USBPortHub_t *port_hub = kmalloc(sizeof(USBPortHub_t));
+    memset(port_hub, 0, sizeof(USBPortHub_t));
+    port_hub->name = name;
+    port_hub->c = controller;
+    port_hub->hub = hub;
+    port_hub->nports = nports;
+    port_hub->reset_time = USB_PORT_ROOT_RESET_TIME;
+    port_hub->shared_address = 1;
+
+    port_hub->ports = kmalloc(sizeof(USBPort_t) * (nports ? nports : 1));
+    memset(port_hub->ports, 0, sizeof(USBPort_t) * (nports ? nports : 1));
+
+    return port_hub;
+}
+
+/**
+ * @brief Register a port hub and schedule a check of every port
+ * @param hub The port hub
+ * @param power_delay Time until port power is good (ms), 0 if the ports are already powered
+ */
+void usb_registerPortHub(USBPortHub_t *hub, uint32_t power_delay) {
+    if (!hub) return;
+
+    spinlock_acquire(&usb_hub_list_lock);
+    if (!usb_hub_list) usb_hub_list = list_create("usb port hubs");
+    spinlock_release(&usb_hub_list_lock);
+
+    for (uint32_t i = 0; i < hub->nports; i++) {
+        if (power_delay) {
+            usb_portSetState(&hub->ports[i], USB_PORT_STATE_POWERON, power_delay);
+        } else {
+            usb_portEvent(hub, i);
+        }
+    }
+
+    spinlock_acquire(&usb_hub_list_lock);
+    list_append(usb_hub_list, (void*)hub);
+    usb_hub_generation++;
+    spinlock_release(&usb_hub_list_lock);
+    LOG(DEBUG, "Registered %s with %d ports\n", hub->name, hub->nports);
+}
+
+/**
+ * @brief Release the default address if a port holds it
+ */
+static void usb_portReleaseAddress(USBPortHub_t *hub, USBPort_t *port) {
+    if (hub->c && hub->c->enumerating == port) hub->c->enumerating = NULL;
+}
+
+/**
+ * @brief Detach the device on a port
+ * @param hub The port hub
+ * @param index The port index
+ */
+static void usb_portDetach(USBPortHub_t *hub, uint32_t index) {
+    USBPort_t *port = &hub->ports[index];
+    usb_portReleaseAddress(hub, port);
+    if (!port->dev) return;
+
+    LOG(INFO, "%s port %d: device disconnected\n", hub->name, index);
+
+    // Class drivers that can't let go of the device keep it (it is leaked rather than freed under them)
+    USBDevice_t *dev = port->dev;
+    port->dev = NULL;
+    if (usb_deinitializeDevice(dev) != USB_SUCCESS) {
+        LOG(WARN, "%s port %d: a driver did not release the device, leaking it\n", hub->name, index);
+        return;
+    }
+
+    if (hub->detach) hub->detach(hub, index, dev);
+    usb_destroyDevice(hub->c, dev);
+}
+
+/**
+ * @brief Unregister a port hub, detaching every device on it
+ * @param hub The port hub (freed)
+ */
+void usb_unregisterPortHub(USBPortHub_t *hub) {
+    if (!hub) return;
+
+    if (usb_hub_list) {
+        spinlock_acquire(&usb_hub_list_lock);
+        node_t *node = list_find(usb_hub_list, (void*)hub);
+        if (node) {
+            list_delete(usb_hub_list, node);
+            kfree(node);
+        }
+        spinlock_release(&usb_hub_list_lock);
+    }
+
+    usb_hub_generation++;
+
+    for (uint32_t i = 0; i < hub->nports; i++) usb_portDetach(hub, i);
+
+    kfree(hub->ports);
+    kfree(hub);
+}
+
+/**
+ * @brief Queue a status change on a port
+ * @param hub The port hub
+ * @param port The port (0-based)
+ *
+ * Safe to call from IRQ context. Events are coalesced until @c usb_work handles them.
+ */
+void usb_portEvent(USBPortHub_t *hub, uint32_t port) {
+    if (!hub || port >= hub->nports) return;
+    __atomic_or_fetch(&hub->events[port / 32], 1u << (port % 32), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Start resetting a port (or wait for the default address)
+ */
+static void usb_portStartReset(USBPortHub_t *hub, uint32_t index) {
+    USBPort_t *port = &hub->ports[index];
+
+    if (hub->shared_address && hub->c) {
+        if (hub->c->enumerating && hub->c->enumerating != port) {
+            usb_portSetState(port, USB_PORT_STATE_WAIT_RESET, 0);
+            return;
+        }
+
+        hub->c->enumerating = port;
+    }
+
+    hub->reset(hub, index, 1);
+    usb_portSetState(port, USB_PORT_STATE_RESET, hub->reset_time);
+}
+
+/**
+ * @brief Give up on a port until it is disconnected
+ */
+static void usb_portFail(USBPortHub_t *hub, uint32_t index) {
+    LOG(ERR, "%s port %d: giving up on device\n", hub->name, index);
+    usb_portReleaseAddress(hub, &hub->ports[index]);
+    usb_portSetState(&hub->ports[index], USB_PORT_STATE_FAILED, 0);
+}
+
+/**
+ * @brief Handle a status change on a port
+ * @param hub The port hub
+ * @param index The port index
+ */
+static void usb_portChanged(USBPortHub_t *hub, uint32_t index) {
+    USBPort_t *port = &hub->ports[index];
+    int speed = USB_FULL_SPEED;
+    int status = hub->status(hub, index, &speed);
+
+    switch (port->state) {
+        case USB_PORT_STATE_POWERON:
+            // The port power timer takes care of it
+            break;
+
+        case USB_PORT_STATE_DISCONNECTED:
+        case USB_PORT_STATE_FAILED:
+            if (status & USB_PORT_CONNECTED) {
+                if (port->state == USB_PORT_STATE_FAILED && !(status & USB_PORT_CONNECT_CHANGE)) break;
+                port->retries = 0;
+                usb_portSetState(port, USB_PORT_STATE_DEBOUNCE, USB_PORT_DEBOUNCE_TIME);
+            } else {
+                usb_portSetState(port, USB_PORT_STATE_DISCONNECTED, 0);
+            }
+            break;
+
+        case USB_PORT_STATE_DEBOUNCE:
+            // Bouncing restarts the debounce interval
+            if (status & USB_PORT_CONNECT_CHANGE) usb_portSetState(port, USB_PORT_STATE_DEBOUNCE, USB_PORT_DEBOUNCE_TIME);
+            break;
+
+        case USB_PORT_STATE_WAIT_RESET:
+        case USB_PORT_STATE_RESET:
+        case USB_PORT_STATE_RECOVERY:
+            if (!(status & USB_PORT_CONNECTED)) {
+                usb_portReleaseAddress(hub, port);
+                usb_portSetState(port, USB_PORT_STATE_DISCONNECTED, 0);
+            }
+            break;
+
+        case USB_PORT_STATE_ATTACHED:
+            // A connect change means the device went away (possibly replaced by another one)
+            if (!(status & USB_PORT_CONNECTED) || (status & USB_PORT_CONNECT_CHANGE)) {
+                usb_portDetach(hub, index);
+
+                if (status & USB_PORT_CONNECTED) {
+                    port->retries = 0;
+                    usb_portSetState(port, USB_PORT_STATE_DEBOUNCE, USB_PORT_DEBOUNCE_TIME);
+                } else {
+                    usb_portSetState(port, USB_PORT_STATE_DISCONNECTED, 0);
+                }
+            }
+            break;
+    }
+}
+
+/**
+ * @brief Handle a port whose deadline passed
+ * @param hub The port hub
+ * @param index The port index
+ */
+static void usb_portTimeout(USBPortHub_t *hub, uint32_t index) {
+    USBPort_t *port = &hub->ports[index];
+    int speed = USB_FULL_SPEED;
+    port->deadline = 0;
+
+    switch (port->state) {
+        case USB_PORT_STATE_POWERON:
+            usb_portSetState(port, USB_PORT_STATE_DISCONNECTED, 0);
+            usb_portChanged(hub, index);
+            break;
+
+        case USB_PORT_STATE_DEBOUNCE:
+            if (hub->status(hub, index, &speed) & USB_PORT_CONNECTED) {
+                usb_portStartReset(hub, index);
+            } else {
+                usb_portSetState(port, USB_PORT_STATE_DISCONNECTED, 0);
+            }
+            break;
+
+        case USB_PORT_STATE_RESET:
+            hub->reset(hub, index, 0);
+            usb_portSetState(port, USB_PORT_STATE_RECOVERY, USB_PORT_RECOVERY_TIME);
+            break;
+
+        case USB_PORT_STATE_RECOVERY: ;
+            int status = hub->status(hub, index, &speed);
+            if (!(status & USB_PORT_CONNECTED)) {
+                usb_portReleaseAddress(hub, port);
+                usb_portSetState(port, USB_PORT_STATE_DISCONNECTED, 0);
+                break;
+            }
+
+            if (status & USB_PORT_ENABLED) {
+                port->dev = hub->attach(hub, index, speed);
+                usb_portReleaseAddress(hub, port);
+
+                if (port->dev) {
+                    LOG(INFO, "%s port %d: device attached\n", hub->name, index);
+                    usb_portSetState(port, USB_PORT_STATE_ATTACHED, 0);
+                    break;
+                }
+            }
+
+            // Didn't enable or didn't enumerate - try the reset again
+            if (++port->retries >= USB_PORT_RETRIES) {
+                usb_portFail(hub, index);
+            } else {
+                usb_portReleaseAddress(hub, port);
+                usb_portStartReset(hub, index);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Handle queued port events and step port state machines whose deadlines passed
+ *
+ * Must be called from a context that can sleep and allocate (enumeration does both).
+ * Does nothing if called recursively.
+ */
+void usb_work() {
+    if (!usb_hub_list) return;
+    if (__atomic_exchange_n(&usb_work_busy, 1, __ATOMIC_ACQUIRE)) return;
+
+    // Hubs can be registered (enumerating a hub) or unregistered while we walk the list, so restart after either
+    node_t *node = usb_hub_list->head;
+    while (node) {
+        USBPortHub_t *hub = (USBPortHub_t*)node->value;
+        uint32_t generation = usb_hub_generation;
+
+        // Queued status changes
+        for (uint32_t word = 0; word < (hub->nports + 31) / 32; word++) {
+            uint32_t pending = __atomic_exchange_n(&hub->events[word], 0, __ATOMIC_ACQUIRE);
+            while (pending) {
+                uint32_t index = word * 32 + __builtin_ctz(pending);
+                pending &= pending - 1;
+                usb_portChanged(hub, index);
+            }
+        }
+
+        // Timers (and ports waiting on the default address)
+        uint64_t now = usb_portTime();
+        for (uint32_t i = 0; usb_hub_generation == generation && i < hub->nports; i++) {
+            USBPort_t *port = &hub->ports[i];
+
+            if (port->state == USB_PORT_STATE_WAIT_RESET) {
+                if (!hub->c || !hub->c->enumerating) usb_portStartReset(hub, i);
+            } else if (port->deadline && now >= port->deadline) {
+                usb_portTimeout(hub, i);
+            }
+        }
+
+        node = (usb_hub_generation == generation) ? node->next : usb_hub_list->head;
+    }
+
+    __atomic_store_n(&usb_work_busy, 0, __ATOMIC_RELEASE);
+}
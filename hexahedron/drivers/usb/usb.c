@@ -16,7 +16,9 @@
 #include <kernel/drivers/clock.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/debug.h>
+#include <kernel/misc/spinlock.h>
 #include <structs/list.h>
+#include <string.h>
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "USB", __VA_ARGS__)
@@ -24,14 +26,27 @@
 /* List of USB controllers */
 list_t *usb_controller_list = NULL;
 
+/* Controller drivers can be loaded on several CPUs at once. usb_poll only tries it, since it runs from the clock interrupt */
+static spinlock_t usb_controller_list_lock = { 0 };
+
 /**
- * @brief Poll method (done once per tick)
+ * @brief USB poll method, called on every clock tick
  * 
- * @note    This method needs to be replaced with probably some kernel threading system once that is implemented.
- *          Through some testing I have determined that this can and will hang the system if polls take too long
+ * Only the controllers' poll methods run here, which just look at port registers and queue
+ * port events. Anything that talks to devices happens in @c usb_work
  */
 void usb_poll(uint64_t ticks) {
-    // !!!: polling disabled
+    if (!usb_controller_list) return;
+
+    // If the list is being changed (possibly by the code this interrupted), skip this tick. Port change bits stay set until the next one.
+    if (!spinlock_tryAcquire(&usb_controller_list_lock)) return;
+
+    foreach(node, usb_controller_list) {
+        USBController_t *controller = (USBController_t*)node->value;
+        if (controller && controller->poll) controller->poll(controller);
+    }
+
+    spinlock_release(&usb_controller_list_lock);
 }
 
 
@@ -64,6 +79,7 @@ void usb_init() {
  */
 USBController_t *usb_createController(void *hc, usb_poll_t poll) {
     USBController_t *controller = kmalloc(sizeof(USBController_t));
+    memset(controller, 0, sizeof(USBController_t));
     controller->hc = hc;
     controller->poll = poll;
     controller->devices = list_create("usb devices");
@@ -80,7 +96,9 @@ USBController_t *usb_createController(void *hc, usb_poll_t poll) {
 void usb_registerController(USBController_t *controller) {
     if (!controller) return;
 
+    spinlock_acquire(&usb_controller_list_lock);
     list_append(usb_controller_list, controller);
+    spinlock_release(&usb_controller_list_lock);
 }
 
 
@@ -119,6 +119,47 @@ void video_updateScreen() {
     }
 }
 
+/**
+ * @brief Copy a bitmap of pixels to the screen
+ * @param x The x coordinate of the bitmap
+ * @param y The y coordinate of the bitmap
+ * @param width The width of the bitmap
+ * @param height The height of the bitmap
+ * @param pixels The pixels (RGB_PIXEL format, width * height of them)
+ */
+void video_blit(int x, int y, int width, int height, uint32_t *pixels) {
+    if (current_driver == NULL) return;
+
+    if (current_driver->blit) {
+        current_driver->blit(current_driver, x, y, width, height, pixels);
+        return;
+    }
+
+    // Fall back to plotting every pixel
+    if (!current_driver->putpixel) return;
+    for (int h = 0; h < height; h++) {
+        for (int w = 0; w < width; w++) {
+            uint32_t pixel = pixels[h * width + w];
+            current_driver->putpixel(current_driver, x + w, y + h, RGB((pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF, pixel & 0xFF));
+        }
+    }
+}
+
+/**
+ * @brief Scroll the screen up
+ * @param lines The amount of pixel rows to scroll by
+ * @param bg The color to fill the bottom of the screen with
+ * @returns 0 on success, -EINVAL if the driver can't scroll (the caller must redraw)
+ */
+int video_scroll(int lines, color_t bg) {
+    if (current_driver != NULL && current_driver->scroll) {
+        current_driver->scroll(current_driver, lines, bg);
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
 /**
  * @brief Communicate with the internal driver.
  * @param type The type of communication
@@ -17,6 +17,7 @@
 
 #include <acpica/acpi.h>
 #include <acpica/actypes.h>
+#include <kernel/drivers/pci.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
 #include <kernel/mem/mem.h>
@@ -89,6 +90,35 @@ int ACPICA_Initialize() {
     return 0;
 }
 
+/* PCI */
+
+/**
+ * @brief Find and parse the MCFG, registering its ECAM ranges with the PCI driver
+ * @returns The amount of ECAM ranges found
+ */
+int ACPICA_ParseMCFG() {
+    ACPI_TABLE_MCFG *McfgTable;
+    ACPI_STATUS Status;
+
+    Status = AcpiGetTable("MCFG", 1, (ACPI_TABLE_HEADER**)&McfgTable);
+    if (!ACPI_SUCCESS(Status)) {
+        LOG(INFO, "No MCFG table was found (AcpiGetTable returned %i), PCI will use port I/O\n", Status);
+        return 0;
+    }
+
+    ACPI_MCFG_ALLOCATION *Allocation = (ACPI_MCFG_ALLOCATION*)((UINT8*)McfgTable + sizeof(ACPI_TABLE_MCFG));
+    ACPI_MCFG_ALLOCATION *End = (ACPI_MCFG_ALLOCATION*)((UINT8*)McfgTable + McfgTable->Header.Length);
+
+    int Ranges = 0;
+    for (; Allocation + 1 <= End; Allocation++) {
+        LOG(DEBUG, "MCFG - ADDR %016llX SEGMENT %d BUSES %d-%d\n", Allocation->Address, Allocation->PciSegment, Allocation->StartBusNumber, Allocation->EndBusNumber);
+        if (pci_addECAM(Allocation->PciSegment, Allocation->StartBusNumber, Allocation->EndBusNumber, Allocation->Address) == 0) Ranges++;
+    }
+
+    AcpiPutTable((ACPI_TABLE_HEADER*)McfgTable);
+    return Ranges;
+}
+
 /* SMP */
 
 /**
@@ -159,16 +189,15 @@ smp_info_t *ACPICA_GetSMPInfo() {
                 LOG(DEBUG, "INTERRUPT OVERRIDE - SRCIRQ 0x%x BUS 0x%x GLOBAL IRQ 0x%x INTI FLAGS 0x%x\n", IntOverride->SourceIrq, IntOverride->Bus, IntOverride->GlobalIrq, IntOverride->IntiFlags);
                 
                 // Update IRQ override
-                if (IntOverride->SourceIrq != IntOverride->GlobalIrq) {
-                    if (IntOverride->SourceIrq > MAX_INT_OVERRIDES) {
-                        // Not enough space.
-                        kernel_panic_extended(ACPI_SYSTEM_ERROR, "acpica", "*** Interrupt override (SRC 0x%x -> GLBL 0x%x) larger than maximum override (0x%x)\n", IntOverride->SourceIrq, IntOverride->GlobalIrq, MAX_INT_OVERRIDES);
-                    }
-
-                    // Need to map this one
-                    smp_info->irq_overrides[IntOverride->SourceIrq] = IntOverride->GlobalIrq;
+                if (IntOverride->SourceIrq >= MAX_INT_OVERRIDES) {
+                    // Not enough space.
+                    kernel_panic_extended(ACPI_SYSTEM_ERROR, "acpica", "*** Interrupt override (SRC 0x%x -> GLBL 0x%x) larger than maximum override (0x%x)\n", IntOverride->SourceIrq, IntOverride->GlobalIrq, MAX_INT_OVERRIDES);
                 }
 
+                // Need to map this one (identity overrides still carry polarity/trigger mode)
+                if (IntOverride->SourceIrq != IntOverride->GlobalIrq) smp_info->irq_overrides[IntOverride->SourceIrq] = IntOverride->GlobalIrq;
+                smp_info->irq_override_flags[IntOverride->SourceIrq] = IntOverride->IntiFlags;
+
                 break;
 
             case ACPI_MADT_TYPE_LOCAL_APIC_NMI:
@@ -284,7 +284,7 @@ ACPI_STATUS AcpiOsRemoveInterruptHandler(UINT32 InterruptLevel, ACPI_OSD_HANDLER
 
     ACPI_interruptHandlers[InterruptLevel] = NULL;
     ACPI_interruptContext[InterruptLevel] = NULL;
-    hal_unregisterInterruptHandler(InterruptLevel);
+    hal_removeInterruptHandler(InterruptLevel, ACPICA_InterruptHandler);
     
     return AE_OK;
 }
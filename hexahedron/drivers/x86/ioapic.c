@@ -0,0 +1,330 @@
+/**
+ * @file hexahedron/drivers/x86/ioapic.c
+ * @brief I/O APIC driver
+ *
+ * Routes the legacy IRQs through I/O APIC redirection entries instead of the 8259 PICs,
+ * which lets them go to any CPU. Destinations can be pinned per IRQ with
+ * --irq-affinity=IRQ:CPU[,IRQ:CPU...]. Anything not pinned is spread over the APs
+ * round-robin, except for the timer which stays on the BSP.
+ *
+ * GSIs above the legacy range carry PCI INTx# lines. The HAL gives each of them a
+ * dynamic IRQ and routes it here as level triggered, active low.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/drivers/x86/ioapic.h>
+#include <kernel/mem/mem.h>
+#include <kernel/misc/spinlock.h>
+#include <kernel/misc/args.h>
+#include <kernel/processor_data.h>
+#include <kernel/debug.h>
+#include <errno.h>
+
+/* I/O APICs */
+static uintptr_t ioapic_base[MAX_CPUS] = { 0 };
+static uint32_t ioapic_gsi_base[MAX_CPUS] = { 0 };
+static uint32_t ioapic_entries[MAX_CPUS] = { 0 };
+static int ioapic_count = 0;
+
+/* SMP information */
+static smp_info_t *ioapic_smp = NULL;
+
+/* Current destination of each legacy IRQ (-1 = not routed) */
+static int ioapic_affinity[IOAPIC_LEGACY_IRQS];
+
+/* Pinned destinations, from the command line or ioapic_setAffinity (-1 = none) */
+static int ioapic_pinned[IOAPIC_LEGACY_IRQS];
+
+/* Round-robin counter for the balancing policy */
+static int ioapic_next_cpu = 0;
+
+/* Register select/window pair lock */
+static spinlock_t ioapic_lock = { 0 };
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "X86:IOAPIC", __VA_ARGS__)
+
+/**
+ * @brief Read an I/O APIC register
+ * @param ioapic The I/O APIC
+ * @param reg The register
+ */
+static uint32_t ioapic_read(int ioapic, uint32_t reg) {
+    *(volatile uint32_t*)(ioapic_base[ioapic] + IOAPIC_IOREGSEL) = reg;
+    return *(volatile uint32_t*)(ioapic_base[ioapic] + IOAPIC_IOWIN);
+}
+
+/**
+ * @brief Write an I/O APIC register
+ * @param ioapic The I/O APIC
+ * @param reg The register
+ * @param data The value
+ */
+static void ioapic_write(int ioapic, uint32_t reg, uint32_t data) {
+    *(volatile uint32_t*)(ioapic_base[ioapic] + IOAPIC_IOREGSEL) = reg;
+    *(volatile uint32_t*)(ioapic_base[ioapic] + IOAPIC_IOWIN) = data;
+}
+
+/**
+ * @brief Translate a GSI to an I/O APIC pin
+ * @param gsi The GSI
+ * @param ioapic Output I/O APIC
+ * @param pin Output pin
+ * @returns 0 on success
+ */
+static int ioapic_getGSIPin(uint32_t gsi, int *ioapic, uint32_t *pin) {
+    for (int i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapic_gsi_base[i] && gsi < ioapic_gsi_base[i] + ioapic_entries[i]) {
+            *ioapic = i;
+            *pin = gsi - ioapic_gsi_base[i];
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * @brief Translate a legacy IRQ to an I/O APIC pin
+ * @param irq The IRQ
+ * @param ioapic Output I/O APIC
+ * @param pin Output pin
+ * @returns 0 on success
+ */
+static int ioapic_getPin(uint8_t irq, int *ioapic, uint32_t *pin) {
+    if (irq >= IOAPIC_LEGACY_IRQS || !ioapic_smp) return -EINVAL;
+
+    uint32_t gsi = ioapic_smp->irq_overrides[irq] ? ioapic_smp->irq_overrides[irq] : irq;
+    return ioapic_getGSIPin(gsi, ioapic, pin);
+}
+
+/**
+ * @brief Program a redirection entry
+ * @param ioapic The I/O APIC
+ * @param pin The pin
+ * @param cpu The destination CPU
+ * @param low Low dword of the entry (vector and flags)
+ */
+static void ioapic_writeEntry(int ioapic, uint32_t pin, int cpu, uint32_t low) {
+    // Destination first, the entry is live as soon as the low half unmasks it
+    spinlock_acquire(&ioapic_lock);
+    ioapic_write(ioapic, IOAPIC_REGISTER_REDTBL + pin * 2, IOAPIC_REDIR_MASKED);
+    ioapic_write(ioapic, IOAPIC_REGISTER_REDTBL + pin * 2 + 1, (uint32_t)ioapic_smp->lapic_ids[cpu] << IOAPIC_REDIR_DEST_SHIFT);
+    ioapic_write(ioapic, IOAPIC_REGISTER_REDTBL + pin * 2, low);
+    spinlock_release(&ioapic_lock);
+}
+
+/**
+ * @brief Mask a redirection entry
+ * @param ioapic The I/O APIC
+ * @param pin The pin
+ */
+static void ioapic_maskEntry(int ioapic, uint32_t pin) {
+    spinlock_acquire(&ioapic_lock);
+    ioapic_write(ioapic, IOAPIC_REGISTER_REDTBL + pin * 2, ioapic_read(ioapic, IOAPIC_REGISTER_REDTBL + pin * 2) | IOAPIC_REDIR_MASKED);
+    spinlock_release(&ioapic_lock);
+}
+
+/**
+ * @brief Pick a destination CPU for an IRQ
+ * @param irq The IRQ
+ */
+static int ioapic_pickCPU(uint8_t irq) {
+    if (irq < IOAPIC_LEGACY_IRQS && ioapic_pinned[irq] != -1) return ioapic_pinned[irq];
+
+    // The timer drives the clock on the BSP
+    if (irq == 0 || processor_count < 2) return 0;
+
+    // Spread everything else over the APs
+    int cpu = 1 + (ioapic_next_cpu % (processor_count - 1));
+    ioapic_next_cpu++;
+    return cpu;
+}
+
+/**
+ * @brief Parse --irq-affinity
+ */
+static void ioapic_parseAffinity() {
+    char *arg = kargs_get("--irq-affinity");
+    if (!arg) return;
+
+    // IRQ:CPU[,IRQ:CPU...]
+    while (*arg) {
+        int irq = 0, cpu = 0;
+        while (*arg >= '0' && *arg <= '9') irq = irq * 10 + (*arg++ - '0');
+        if (*arg++ != ':') break;
+        while (*arg >= '0' && *arg <= '9') cpu = cpu * 10 + (*arg++ - '0');
+
+        if (irq < IOAPIC_LEGACY_IRQS && cpu < processor_count) {
+            ioapic_pinned[irq] = cpu;
+        } else {
+            LOG(WARN, "Ignoring bad affinity IRQ%d -> CPU%d\n", irq, cpu);
+        }
+
+        if (*arg != ',') break;
+        arg++;
+    }
+}
+
+/**
+ * @brief Initialize the I/O APIC(s)
+ *
+ * Every redirection entry starts out masked. IRQs are routed with @c ioapic_routeIRQ
+ * as handlers are registered.
+ *
+ * @param info SMP information (I/O APICs, overrides and local APIC IDs)
+ * @returns 0 on success
+ */
+int ioapic_initialize(smp_info_t *info) {
+    if (!info || !info->ioapic_count) {
+        LOG(WARN, "No I/O APIC available\n");
+        return -ENODEV;
+    }
+
+    ioapic_smp = info;
+
+    for (int i = 0; i < info->ioapic_count && i < MAX_CPUS; i++) {
+        ioapic_base[i] = mem_mapMMIO(info->ioapic_addrs[i] & ~(PAGE_SIZE - 1), PAGE_SIZE) + (info->ioapic_addrs[i] & (PAGE_SIZE - 1));
+        ioapic_gsi_base[i] = info->ioapic_irqbases[i];
+        ioapic_entries[i] = ((ioapic_read(i, IOAPIC_REGISTER_VERSION) >> 16) & 0xFF) + 1;
+        ioapic_count++;
+
+        // Mask everything until it has a handler
+        for (uint32_t pin = 0; pin < ioapic_entries[i]; pin++) {
+            ioapic_write(i, IOAPIC_REGISTER_REDTBL + pin * 2, IOAPIC_REDIR_MASKED);
+        }
+
+        LOG(INFO, "I/O APIC %d: GSI %d-%d\n", info->ioapic_ids[i], ioapic_gsi_base[i], ioapic_gsi_base[i] + ioapic_entries[i] - 1);
+    }
+
+    for (int i = 0; i < IOAPIC_LEGACY_IRQS; i++) {
+        ioapic_affinity[i] = -1;
+        ioapic_pinned[i] = -1;
+    }
+
+    ioapic_parseAffinity();
+    return 0;
+}
+
+/**
+ * @brief Route a legacy IRQ to a CPU and unmask it
+ * @param irq The IRQ (before interrupt source overrides)
+ * @param cpu The destination CPU or @c IOAPIC_CPU_AUTO
+ * @returns 0 on success
+ */
+int ioapic_routeIRQ(uint8_t irq, int cpu) {
+    if (irq == IOAPIC_IRQ_CASCADE) return -EINVAL;
+
+    int ioapic;
+    uint32_t pin;
+    if (ioapic_getPin(irq, &ioapic, &pin)) return -EINVAL;
+
+    if (cpu == IOAPIC_CPU_AUTO) cpu = ioapic_pickCPU(irq);
+    if (cpu < 0 || cpu >= processor_count) return -EINVAL;
+
+    // ISA interrupts are active high and edge triggered unless an override says otherwise
+    uint32_t low = (32 + irq) & IOAPIC_REDIR_VECTOR;
+    uint16_t flags = ioapic_smp->irq_override_flags[irq];
+    if ((flags & IOAPIC_INTI_POLARITY) == IOAPIC_INTI_POLARITY_LOW) low |= IOAPIC_REDIR_ACTIVE_LOW;
+    if ((flags & IOAPIC_INTI_TRIGGER) == IOAPIC_INTI_TRIGGER_LEVEL) low |= IOAPIC_REDIR_LEVEL;
+
+    ioapic_writeEntry(ioapic, pin, cpu, low);
+
+    ioapic_affinity[irq] = cpu;
+    LOG(DEBUG, "IRQ%d -> GSI %d -> CPU%d (%s, %s)\n", irq, ioapic_gsi_base[ioapic] + pin, cpu, (low & IOAPIC_REDIR_LEVEL) ? "level" : "edge", (low & IOAPIC_REDIR_ACTIVE_LOW) ? "low" : "high");
+    return 0;
+}
+
+/**
+ * @brief Mask a legacy IRQ and forget its route
+ * @param irq The IRQ
+ */
+void ioapic_unrouteIRQ(uint8_t irq) {
+    int ioapic;
+    uint32_t pin;
+    if (ioapic_getPin(irq, &ioapic, &pin)) return;
+
+    ioapic_maskEntry(ioapic, pin);
+    ioapic_affinity[irq] = -1;
+}
+
+/**
+ * @brief Route a GSI above the legacy range to a CPU and unmask it
+ *
+ * These carry PCI INTx# lines, which are active low and level triggered.
+ *
+ * @param gsi The GSI
+ * @param irq The IRQ to deliver it as (vector 32 + @c irq, a dynamic IRQ)
+ * @param cpu The destination CPU or @c IOAPIC_CPU_AUTO
+ * @returns 0 on success
+ */
+int ioapic_routeGSI(uint32_t gsi, uint8_t irq, int cpu) {
+    if (gsi < IOAPIC_LEGACY_IRQS || irq < IOAPIC_LEGACY_IRQS || !ioapic_smp) return -EINVAL;
+
+    int ioapic;
+    uint32_t pin;
+    if (ioapic_getGSIPin(gsi, &ioapic, &pin)) return -ENOENT;
+
+    if (cpu == IOAPIC_CPU_AUTO) cpu = ioapic_pickCPU(irq);
+    if (cpu < 0 || cpu >= processor_count) return -EINVAL;
+
+    ioapic_writeEntry(ioapic, pin, cpu, ((32 + irq) & IOAPIC_REDIR_VECTOR) | IOAPIC_REDIR_ACTIVE_LOW | IOAPIC_REDIR_LEVEL);
+
+    LOG(DEBUG, "GSI %d -> IRQ%d -> CPU%d (level, low)\n", gsi, irq, cpu);
+    return 0;
+}
+
+/**
+ * @brief Mask a GSI above the legacy range
+ * @param gsi The GSI
+ */
+void ioapic_unrouteGSI(uint32_t gsi) {
+    int ioapic;
+    uint32_t pin;
+    if (gsi < IOAPIC_LEGACY_IRQS || ioapic_getGSIPin(gsi, &ioapic, &pin)) return;
+
+    ioapic_maskEntry(ioapic, pin);
+}
+
+/**
+ * @brief Check whether a GSI is wired to an I/O APIC pin
+ * @param gsi The GSI
+ */
+int ioapic_hasGSI(uint32_t gsi) {
+    int ioapic;
+    uint32_t pin;
+    return ioapic_smp && !ioapic_getGSIPin(gsi, &ioapic, &pin);
+}
+
+/**
+ * @brief Change the destination CPU of a legacy IRQ
+ * @param irq The IRQ
+ * @param cpu The destination CPU or @c IOAPIC_CPU_AUTO
+ * @returns 0 on success
+ */
+int ioapic_setAffinity(uint8_t irq, int cpu) {
+    if (irq >= IOAPIC_LEGACY_IRQS) return -EINVAL;
+    if (cpu != IOAPIC_CPU_AUTO && (cpu < 0 || cpu >= processor_count)) return -EINVAL;
+
+    ioapic_pinned[irq] = cpu;
+
+    // Only reprogram IRQs that are live, the rest pick it up when they are routed
+    if (ioapic_affinity[irq] == -1) return 0;
+    return ioapic_routeIRQ(irq, cpu);
+}
+
+/**
+ * @brief Get the destination CPU of a legacy IRQ
+ * @param irq The IRQ
+ * @returns The CPU or -1 if the IRQ is not routed
+ */
+int ioapic_getAffinity(uint8_t irq) {
+    if (irq >= IOAPIC_LEGACY_IRQS || !ioapic_smp) return -1;
+    return ioapic_affinity[irq];
+}
@@ -135,6 +135,22 @@ void lapic_sendNMI(uint8_t lapic_id, uint8_t irq_no) {
     while (lapic_read(LAPIC_REGISTER_ICR) & LAPIC_ICR_SENDING);
 }
 
+/**
+ * @brief Send a fixed interrupt to an APIC
+ * @param lapic_id The ID of the APIC
+ * @param vector The interrupt vector to send
+ */
+void lapic_sendIPI(uint8_t lapic_id, uint8_t vector) {
+    // Write the local APIC ID to the high ICR
+    lapic_write(LAPIC_REGISTER_ICR + 0x10, lapic_id << LAPIC_ICR_HIGH_ID_SHIFT);
+
+    // Write the ICR to send the interrupt
+    lapic_write(LAPIC_REGISTER_ICR, LAPIC_ICR_FIXED | LAPIC_ICR_DESTINATION_PHYSICAL | LAPIC_ICR_INITDEASSERT | LAPIC_ICR_EDGE | vector);
+
+    // Wait for send to be completed
+    while (lapic_read(LAPIC_REGISTER_ICR) & LAPIC_ICR_SENDING);
+}
+
 /**
  * @brief Send INIT signal
  * @param lapic_id The ID of the APIC
@@ -16,6 +16,7 @@
 #include <kernel/mem/alloc.h>
 #include <kernel/misc/args.h>
 #include <kernel/panic.h>
+#include <kernel/drivers/pci.h>
 #include <kernel/debug.h>
 #include <string.h>
 
@@ -103,50 +104,82 @@ int minacpi_parseRSDP() {
 }
 
 /**
- * @brief Find and parse the MADT for SMP information
- * @returns NULL on failure
+ * @brief Find an ACPI table
+ * @param signature The signature of the table
+ * @returns A PAGE_SIZE mapping of the table (unmap with mem_unmapPhys) or NULL
  */
-smp_info_t *minacpi_parseMADT() {
-    acpi_madt_t *madt = NULL;
-
+static acpi_table_header_t *minacpi_findTable(char *signature) {
     if (rsdt) {
         // Use RSDT, ACPI version 1.0
         // Calculate the amount of entries first
-        int entries = (rsdt->header.length - sizeof(rsdt->header)) / 8;
+        int entries = (rsdt->header.length - sizeof(rsdt->header)) / sizeof(uint32_t);
 
         for (int i = 0; i < entries; i++) {
             acpi_table_header_t *header = (acpi_table_header_t*)mem_remapPhys(rsdt->tables[i], PAGE_SIZE);
-            if (!strncmp(header->signature, "APIC", 4)) {
-                // Found the MADT  
-                LOG(DEBUG, "MADT found successfully at %p\n", rsdt->tables[i]);
-                madt = (acpi_madt_t*)header;
-                break;
+            if (!strncmp(header->signature, signature, 4)) {
+                LOG(DEBUG, "%s found successfully at %p\n", signature, rsdt->tables[i]);
+                return header;
             }
         
-            // Not the MADT, we don't care.
+            // Not the table, we don't care.
             mem_unmapPhys((uintptr_t)header, PAGE_SIZE);
         }
     } else if (xsdt) {
         // Use XSDT, ACPI version 2.0+
         // Calculate the amount of entries first
-        int entries = (xsdt->header.length - sizeof(xsdt->header)) / 8;
+        int entries = (xsdt->header.length - sizeof(xsdt->header)) / sizeof(uint64_t);
 
         for (int i = 0; i < entries; i++) {
             acpi_table_header_t *header = (acpi_table_header_t*)mem_remapPhys(xsdt->tables[i], PAGE_SIZE);
-            if (!strncmp(header->signature, "APIC", 4)) {
-                // Found the MADT
-                LOG(DEBUG, "MADT found successfully at %p\n", xsdt->tables[i]);
-                madt = (acpi_madt_t*)header;
-                break;
+            if (!strncmp(header->signature, signature, 4)) {
+                LOG(DEBUG, "%s found successfully at %p\n", signature, xsdt->tables[i]);
+                return header;
             }
 
             mem_unmapPhys((uintptr_t)header, PAGE_SIZE);
         }
-    } else {
-        // what
-        return NULL;
     }
 
+    return NULL;
+}
+
+/**
+ * @brief Find and parse the MCFG, registering its ECAM ranges with the PCI driver
+ * @returns The amount of ECAM ranges found
+ */
+int minacpi_parseMCFG() {
+    acpi_mcfg_t *mcfg = (acpi_mcfg_t*)minacpi_findTable("MCFG");
+    if (!mcfg) {
+        LOG(INFO, "No MCFG table found, PCI will use port I/O\n");
+        return 0;
+    }
+
+    // Make sure our mapping is ok
+    if (mcfg->header.length > PAGE_SIZE) {
+        LOG(WARN, "MCFG too large (%d bytes), ignoring\n", mcfg->header.length);
+        mem_unmapPhys((uintptr_t)mcfg, PAGE_SIZE);
+        return 0;
+    }
+
+    int entries = (mcfg->header.length - sizeof(acpi_mcfg_t)) / sizeof(acpi_mcfg_entry_t);
+    int ranges = 0;
+    for (int i = 0; i < entries; i++) {
+        acpi_mcfg_entry_t *entry = &mcfg->entries[i];
+        LOG(DEBUG, "MCFG - ADDR %016llX SEGMENT %d BUSES %d-%d\n", entry->address, entry->segment, entry->bus_start, entry->bus_end);
+        if (pci_addECAM(entry->segment, entry->bus_start, entry->bus_end, entry->address) == 0) ranges++;
+    }
+
+    mem_unmapPhys((uintptr_t)mcfg, PAGE_SIZE);
+    return ranges;
+}
+
+/**
+ * @brief Find and parse the MADT for SMP information
+ * @returns NULL on failure
+ */
+smp_info_t *minacpi_parseMADT() {
+    acpi_madt_t *madt = (acpi_madt_t*)minacpi_findTable("APIC");
+
     // MADT will only be present if SMP is supported
     if (!madt) {
         LOG(WARN, "Could not find MADT table - system does not support multiprocessing.\n");
@@ -211,16 +244,15 @@ smp_info_t *minacpi_parseMADT() {
                 acpi_madt_io_apic_override_t *override = (acpi_madt_io_apic_override_t*)entry;
                 LOG(DEBUG, "INTERRUPT OVERRIDE - SRCIRQ 0x%x BUS 0%x GLOBAL IRQ 0x%x INTI FLAGS 0x%x\n", override->irq_source, override->bus_source, override->gsi, override->flags);
 
-                if (override->irq_source != override->gsi) {
-                    if (override->irq_source > MAX_INT_OVERRIDES) {
-                        // Not enough space.
-                        kernel_panic_extended(ACPI_SYSTEM_ERROR, "acpica", "*** Interrupt override (SRC 0x%x -> GLBL 0x%x) larger than maximum override (0x%x)\n", override->irq_source, override->gsi, MAX_INT_OVERRIDES);
-                    }
-
-                    // Need to map this one
-                    info->irq_overrides[override->irq_source] = override->gsi;
+                if (override->irq_source >= MAX_INT_OVERRIDES) {
+                    // Not enough space.
+                    kernel_panic_extended(ACPI_SYSTEM_ERROR, "acpica", "*** Interrupt override (SRC 0x%x -> GLBL 0x%x) larger than maximum override (0x%x)\n", override->irq_source, override->gsi, MAX_INT_OVERRIDES);
                 }
 
+                // Need to map this one (identity overrides still carry polarity/trigger mode)
+                if (override->irq_source != override->gsi) info->irq_overrides[override->irq_source] = override->gsi;
+                info->irq_override_flags[override->irq_source] = override->flags;
+
                 break;
 
             case MADT_LOCAL_APIC_NMI:
@@ -38,6 +38,15 @@
 uint16_t serial_defaultPort = SERIAL_COM1_PORT;
 uint16_t serial_defaultBaud = 9600;
 
+// UART state of every COM port
+static serial_uart_t serial_uarts[4] = { 0 };
+
+// Whether the shared handler is registered on IRQ3/IRQ4
+static int serial_irqRegistered[2] = { 0 };
+
+// Panic state (everything goes out synchronously)
+extern int kernel_in_panic_state;
+
 
 // Internal function to get the COM port address using configuration info.
 static uint16_t serial_getCOMAddress(int com_port) {
@@ -93,7 +102,7 @@ int serial_setBaudRate(serial_port_t *device, uint16_t baudrate) {
  */
 static int write_early(char ch) {
     // Wait until transmit is empty
-    while ((inportb(serial_defaultPort + SERIAL_LINE_STATUS) & 0x20) == 0x0);
+    while ((inportb(serial_defaultPort + SERIAL_LINE_STATUS) & SERIAL_LINESTATUS_THRE) == 0x0);
 
     // Write character
     outportb(serial_defaultPort + SERIAL_TRANSMIT_BUFFER, ch);
@@ -101,15 +110,208 @@ static int write_early(char ch) {
     return 0;
 }
 
+/**
+ * @brief Disable interrupts
+ * @returns Whether interrupts were enabled
+ */
+static inline int serial_disableInterrupts() {
+    uintptr_t flags;
+    asm volatile ("pushf\npop %0\ncli" : "=r"(flags) :: "memory");
+    return (flags & 0x200) ? 1 : 0;
+}
+
+/**
+ * @brief Restore interrupts
+ * @param enabled Whether interrupts were enabled
+ */
+static inline void serial_restoreInterrupts(int enabled) {
+    if (enabled) asm volatile ("sti" ::: "memory");
+}
+
+/**
+ * @brief Lock a UART (interrupts must be disabled)
+ * 
+ * When panicking, the lock is skipped. Its holder may never come back.
+ */
+static inline void serial_lock(serial_uart_t *uart) {
+    if (!kernel_in_panic_state) spinlock_acquire(&uart->lock);
+}
+
+/**
+ * @brief Unlock a UART
+ */
+static inline void serial_unlock(serial_uart_t *uart) {
+    if (!kernel_in_panic_state) spinlock_release(&uart->lock);
+}
+
+/**
+ * @brief Move up to a FIFO worth of bytes from the transmit ring into the UART, if the FIFO is empty
+ * @param uart The UART (locked)
+ */
+static void serial_kick(serial_uart_t *uart) {
+    if (uart->tx_head == uart->tx_tail) return;
+    if (!(inportb(uart->io_address + SERIAL_LINE_STATUS) & SERIAL_LINESTATUS_THRE)) return;
+
+    for (int i = 0; i < SERIAL_FIFO_SIZE && uart->tx_tail != uart->tx_head; i++) {
+        outportb(uart->io_address + SERIAL_TRANSMIT_BUFFER, uart->tx[uart->tx_tail % SERIAL_TX_RING_SIZE]);
+        uart->tx_tail++;
+    }
+}
+
+/**
+ * @brief Synchronously write out the transmit ring
+ * @param uart The UART (locked)
+ * @param keep Amount of bytes that may be left in the ring
+ */
+static void serial_drain(serial_uart_t *uart, uint32_t keep) {
+    while (uart->tx_head - uart->tx_tail > keep) {
+        while (!(inportb(uart->io_address + SERIAL_LINE_STATUS) & SERIAL_LINESTATUS_THRE));
+        serial_kick(uart);
+    }
+}
+
+/**
+ * @brief Move received bytes from the UART into the receive ring
+ * @param uart The UART (locked)
+ */
+static void serial_receive(serial_uart_t *uart) {
+    while (inportb(uart->io_address + SERIAL_LINE_STATUS) & SERIAL_LINESTATUS_DATA_READY) {
+        uint8_t ch = inportb(uart->io_address + SERIAL_RECEIVE_BUFFER);
+
+        if (uart->rx_head - uart->rx_tail >= SERIAL_RX_RING_SIZE) {
+            uart->rx_dropped++;
+            continue;
+        }
+
+        uart->rx[uart->rx_head % SERIAL_RX_RING_SIZE] = ch;
+        uart->rx_head++;
+    }
+}
+
+/**
+ * @brief Serial IRQ handler (shared by both ports on the line)
+ */
+int serial_irqHandler(uintptr_t exception_index, uintptr_t int_number, registers_t *regs, extended_registers_t *regs_extended) {
+    for (int i = 0; i < 4; i++) {
+        serial_uart_t *uart = &serial_uarts[i];
+        if (!uart->irq) continue;
+        if ((i % 2 ? SERIAL_COM2_IRQ : SERIAL_COM1_IRQ) != (int)int_number) continue;
+
+        serial_lock(uart);
+
+        uint8_t ident;
+        while (!((ident = inportb(uart->io_address + SERIAL_IDENTIFICATION)) & SERIAL_IDENT_NONE)) {
+            switch (ident & SERIAL_IDENT_MASK) {
+                case SERIAL_IDENT_THRE:
+                    serial_kick(uart);
+                    break;
+                
+                case SERIAL_IDENT_RX:
+                case SERIAL_IDENT_RX_TIMEOUT:
+                    serial_receive(uart);
+                    break;
+
+                case SERIAL_IDENT_LINE_STATUS:
+                    inportb(uart->io_address + SERIAL_LINE_STATUS);
+                    break;
+
+                default:
+                    inportb(uart->io_address + SERIAL_MODEM_STATUS);
+                    break;
+            }
+        }
+
+        serial_unlock(uart);
+    }
+
+    return 0;
+}
+
 /**
  * @brief Write a character to a serial device
+ * 
+ * Once the port is interrupt-driven this only queues the character. It is written out
+ * synchronously if interrupts are disabled (exception handlers, the debugger) or the kernel is panicking.
  */
 static int write_method(serial_port_t *device, char ch) {
-    // Wait until transmit is empty
-    while ((inportb(device->io_address + SERIAL_LINE_STATUS) & 0x20) == 0x0);
+    serial_uart_t *uart = &serial_uarts[device->com_port - 1];
 
-    // Write character
-    outportb(device->io_address + SERIAL_TRANSMIT_BUFFER, ch);
+    if (!uart->irq) {
+        // Wait until transmit is empty
+        while ((inportb(device->io_address + SERIAL_LINE_STATUS) & SERIAL_LINESTATUS_THRE) == 0x0);
+
+        // Write character
+        outportb(device->io_address + SERIAL_TRANSMIT_BUFFER, ch);
+        return 0;
+    }
+
+    int enabled = serial_disableInterrupts();
+    serial_lock(uart);
+
+    if (!enabled || kernel_in_panic_state) {
+        // Nothing will drain the ring, so write everything out in order
+        serial_drain(uart, 0);
+        while ((inportb(uart->io_address + SERIAL_LINE_STATUS) & SERIAL_LINESTATUS_THRE) == 0x0);
+        outportb(uart->io_address + SERIAL_TRANSMIT_BUFFER, ch);
+    } else {
+        // Make room if the ring is full
+        serial_drain(uart, SERIAL_TX_RING_SIZE - 1);
+
+        uart->tx[uart->tx_head % SERIAL_TX_RING_SIZE] = ch;
+        uart->tx_head++;
+        serial_kick(uart);
+    }
+
+    serial_unlock(uart);
+    serial_restoreInterrupts(enabled);
+    return 0;
+}
+
+/**
+ * @brief Write a run of characters to a serial device
+ * 
+ * Same as @c write_method, but takes the lock and kicks the UART once per batch instead of once per character.
+ */
+static int write_buffer_method(serial_port_t *device, const char *buffer, size_t length) {
+    serial_uart_t *uart = &serial_uarts[device->com_port - 1];
+
+    if (!uart->irq) {
+        // Polled, there's nothing to save
+        for (size_t i = 0; i < length; i++) write_method(device, buffer[i]);
+        return 0;
+    }
+
+    while (length) {
+        size_t batch = (length > SERIAL_WRITE_BATCH) ? SERIAL_WRITE_BATCH : length;
+
+        int enabled = serial_disableInterrupts();
+        serial_lock(uart);
+
+        if (!enabled || kernel_in_panic_state) {
+            // Nothing will drain the ring, so write everything out in order
+            serial_drain(uart, 0);
+            for (size_t i = 0; i < batch; i++) {
+                while ((inportb(uart->io_address + SERIAL_LINE_STATUS) & SERIAL_LINESTATUS_THRE) == 0x0);
+                outportb(uart->io_address + SERIAL_TRANSMIT_BUFFER, buffer[i]);
+            }
+        } else {
+            // Make room for the batch
+            serial_drain(uart, SERIAL_TX_RING_SIZE - batch);
+
+            for (size_t i = 0; i < batch; i++) {
+                uart->tx[uart->tx_head % SERIAL_TX_RING_SIZE] = buffer[i];
+                uart->tx_head++;
+            }
+
+            serial_kick(uart);
+        }
+
+        serial_unlock(uart);
+        serial_restoreInterrupts(enabled);
+
+        buffer += batch;
+        length -= batch;
+    }
 
     return 0;
 }
@@ -119,11 +321,30 @@ static int write_method(serial_port_t *device, char ch) {
  * @param timeout The time to wait in seconds 
  */
 static char receive_method(serial_port_t *device, size_t timeout) {
+    serial_uart_t *uart = &serial_uarts[device->com_port - 1];
+
     // Wait until receive has something or the timeout hits
     unsigned long long finish_time = (now() * 1000) + timeout;
 
     while ((timeout == 0) ? 1 : (finish_time > now() * 1000)) {
-        if ((inportb(device->io_address + SERIAL_LINE_STATUS) & 0x01) != 0x0) {
+        if (uart->irq) {
+            // Poll the FIFO as well, interrupts may be disabled
+            int enabled = serial_disableInterrupts();
+            serial_lock(uart);
+            serial_receive(uart);
+
+            if (uart->rx_head != uart->rx_tail) {
+                char ch = uart->rx[uart->rx_tail % SERIAL_RX_RING_SIZE];
+                uart->rx_tail++;
+
+                serial_unlock(uart);
+                serial_restoreInterrupts(enabled);
+                return ch;
+            }
+
+            serial_unlock(uart);
+            serial_restoreInterrupts(enabled);
+        } else if ((inportb(device->io_address + SERIAL_LINE_STATUS) & SERIAL_LINESTATUS_DATA_READY) != 0x0) {
             // Return the character
             return inportb(device->io_address + SERIAL_RECEIVE_BUFFER);
         }
@@ -132,6 +353,38 @@ static char receive_method(serial_port_t *device, size_t timeout) {
     return 0; 
 }
 
+/**
+ * @brief Switch a port to interrupt-driven, ring-buffered I/O
+ * @param port The port
+ * @returns 0 on success, -EINVAL on a bad port
+ * 
+ * Until this is called (and whenever interrupts are disabled or the kernel panics) the port is polled.
+ */
+int serial_enableInterrupts(serial_port_t *port) {
+    if (!port || port->com_port < 1 || port->com_port > 4) return -EINVAL;
+
+    serial_uart_t *uart = &serial_uarts[port->com_port - 1];
+    if (uart->irq) return 0;
+
+    // COM1/COM3 are on IRQ4 and COM2/COM4 are on IRQ3
+    int line = (port->com_port - 1) % 2;
+    if (!serial_irqRegistered[line]) {
+        if (hal_registerInterruptHandler(line ? SERIAL_COM2_IRQ : SERIAL_COM1_IRQ, serial_irqHandler)) {
+            dprintf(WARN, "IRQ%i is taken, COM%i stays polled\n", line ? SERIAL_COM2_IRQ : SERIAL_COM1_IRQ, port->com_port);
+            return -EINVAL;
+        }
+
+        serial_irqRegistered[line] = 1;
+    }
+
+    uart->io_address = port->io_address;
+    uart->irq = 1;
+
+    // Interrupt on received data, line status and an empty transmit FIFO (OUT2 was already set)
+    outportb(uart->io_address + SERIAL_INTENABLE, SERIAL_INTENABLE_RX | SERIAL_INTENABLE_THRE | SERIAL_INTENABLE_LINE_STATUS);
+    return 0;
+}
+
 
 
 /**
@@ -202,6 +455,7 @@ serial_port_t *serial_createPortData(int com_port, uint16_t baudrate) {
     ser_port->com_port = com_port;
     ser_port->read = receive_method;
     ser_port->write = write_method;
+    ser_port->write_buffer = write_buffer_method;
     ser_port->io_address = serial_getCOMAddress(com_port);
     return ser_port;
 }
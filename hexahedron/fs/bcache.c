@@ -0,0 +1,665 @@
+/**
+ * @file hexahedron/fs/bcache.c
+ * @brief Block buffer/page cache
+ *
+ * Caches block device contents in page-sized chunks keyed by (device, page index).
+ * Lookups go through a small chained hash table, and every page also sits on a
+ * single circular "clock" ring which is used for eviction: the clock hand sweeps the
+ * ring, clearing referenced bits, and evicts the first page that hasn't been touched
+ * since the last sweep. Dirty pages are written back before they are evicted, and
+ * periodically by @c bcache_work.
+ *
+ * The lock is never held across device I/O. A page that is being read in or written
+ * back is marked busy instead, which keeps it linked and keeps everyone else off it
+ * until the I/O finishes.
+ *
+ * The cache grows until either @c BCACHE_MAX_PAGES is reached or the PMM drops under
+ * @c BCACHE_LOW_WATERMARK free blocks, after which it starts recycling pages instead
+ * (and @c bcache_work starts giving pages back).
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/fs/bcache.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/mem/pmm.h>
+#include <kernel/drivers/clock.h>
+#include <kernel/debug.h>
+#include <kernel/panic.h>
+#include <string.h>
+
+/* Hash table */
+static bcache_page_t **bcache_hashtable = NULL;
+
+/* Clock hand (also the head of the clock ring) */
+static bcache_page_t *bcache_hand = NULL;
+
+/* Global statistics */
+static bcache_stats_t bcache_stats = { 0 };
+
+/* Timer value (us) of the next periodic write-back */
+static uint64_t bcache_next_writeback = 0;
+
+/* Lock */
+static spinlock_t *bcache_lock = NULL;
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "FS:BCACHE", __VA_ARGS__)
+
+/* Hash a (device, index) pair */
+#define BCACHE_HASH(device, index) ((((uintptr_t)(device) >> 4) ^ (uintptr_t)(index) ^ ((uintptr_t)(index) >> 9)) % BCACHE_HASH_SIZE)
+
+/**
+ * @brief Initialize the block cache
+ */
+void bcache_init() {
+    bcache_hashtable = kmalloc(sizeof(bcache_page_t*) * BCACHE_HASH_SIZE);
+    memset(bcache_hashtable, 0, sizeof(bcache_page_t*) * BCACHE_HASH_SIZE);
+
+    bcache_lock = spinlock_create("bcache lock");
+
+    LOG(INFO, "Block cache initialized (%i buckets, max %i pages)\n", BCACHE_HASH_SIZE, BCACHE_MAX_PAGES);
+}
+
+/**
+ * @brief Register a block device with the cache
+ * @param name The name of the device (for debugging)
+ * @param dev Driver-specific device pointer, passed to @p read and @p write
+ * @param block_size The block size of the device. Must divide @c BCACHE_PAGE_SIZE
+ * @param block_count Amount of blocks on the device
+ * @param read The read method of the device
+ * @param write The write method of the device, or NULL if read-only
+ * @returns A new cache device or NULL on bad arguments
+ */
+bcache_device_t *bcache_createDevice(char *name, void *dev, size_t block_size, uint64_t block_count, bcache_io_t read, bcache_io_t write) {
+    if (!bcache_hashtable) {
+        kernel_panic_extended(KERNEL_BAD_ARGUMENT_ERROR, "bcache", "*** bcache_createDevice before init\n");
+        __builtin_unreachable();
+    }
+
+    if (!read || !block_size || block_size > BCACHE_PAGE_SIZE || (BCACHE_PAGE_SIZE % block_size)) {
+        LOG(WARN, "Refusing to cache device '%s' (block size %i)\n", name, block_size);
+        return NULL;
+    }
+
+    bcache_device_t *device = kmalloc(sizeof(bcache_device_t));
+    memset(device, 0, sizeof(bcache_device_t));
+    device->name = name;
+    device->dev = dev;
+    device->block_size = block_size;
+    device->block_count = block_count;
+    device->read = read;
+    device->write = write;
+
+    LOG(DEBUG, "Caching device '%s' (%i blocks of %i bytes)\n", name, block_count, block_size);
+    return device;
+}
+
+/**
+ * @brief Get the amount of device blocks backing a page (the last page may be partial)
+ */
+static size_t bcache_pageBlocks(bcache_page_t *page) {
+    size_t per_page = BCACHE_PAGE_SIZE / page->device->block_size;
+    uint64_t first = page->index * per_page;
+    if (first >= page->device->block_count) return 0;
+    if (first + per_page > page->device->block_count) return page->device->block_count - first;
+    return per_page;
+}
+
+/**
+ * @brief Let another CPU finish the I/O on a busy page. Lock must be held, it is dropped while waiting.
+ */
+static void bcache_waitBusy() {
+    spinlock_release(bcache_lock);
+    asm volatile ("pause" ::: "memory");
+    spinlock_acquire(bcache_lock);
+}
+
+/**
+ * @brief Write back a dirty page. Lock must be held, it is dropped during the write.
+ *
+ * The page is marked busy while the lock is dropped, so it stays linked and nobody else touches it.
+ * The caller must make sure the page isn't already busy.
+ *
+ * @returns 0 on success
+ */
+static int bcache_writebackPage(bcache_page_t *page) {
+    if (!(page->flags & BCACHE_PAGE_DIRTY)) return 0;
+
+    bcache_device_t *device = page->device;
+    if (!device->write) {
+        // Read-only device, just drop the changes.
+        page->flags &= ~BCACHE_PAGE_DIRTY;
+        bcache_stats.dirty--;
+        device->stats.dirty--;
+        return 0;
+    }
+
+    size_t per_page = BCACHE_PAGE_SIZE / device->block_size;
+    size_t blocks = bcache_pageBlocks(page);
+
+    page->flags |= BCACHE_PAGE_BUSY;
+    spinlock_release(bcache_lock);
+    int error = device->write(device->dev, page->index * per_page, blocks, page->data);
+    spinlock_acquire(bcache_lock);
+    page->flags &= ~BCACHE_PAGE_BUSY;
+
+    if (error) {
+        LOG(ERR, "Write-back of page %i on device '%s' failed\n", page->index, device->name);
+        bcache_stats.errors++;
+        device->stats.errors++;
+        return 1;
+    }
+
+    page->flags &= ~BCACHE_PAGE_DIRTY;
+    bcache_stats.dirty--;
+    device->stats.dirty--;
+    bcache_stats.writebacks++;
+    device->stats.writebacks++;
+    return 0;
+}
+
+/**
+ * @brief Remove a page from the hash table and clock ring. Lock must be held.
+ */
+static void bcache_unlinkPage(bcache_page_t *page) {
+    // Hash table
+    bcache_page_t **link = &bcache_hashtable[BCACHE_HASH(page->device, page->index)];
+    while (*link && *link != page) link = &(*link)->hash_next;
+    if (*link) *link = page->hash_next;
+
+    // Clock ring
+    if (page->next == page) {
+        bcache_hand = NULL;
+    } else {
+        page->prev->next = page->next;
+        page->next->prev = page->prev;
+        if (bcache_hand == page) bcache_hand = page->next;
+    }
+
+    bcache_stats.pages--;
+    page->device->stats.pages--;
+}
+
+/**
+ * @brief Free an unlinked page
+ */
+static void bcache_freePage(bcache_page_t *page) {
+    kfree(page->data);
+    kfree(page);
+}
+
+/**
+ * @brief Run the clock hand until a page can be evicted. Lock must be held, it is dropped to write back dirty pages.
+ * @returns An unlinked page whose data buffer can be reused, or NULL
+ */
+static bcache_page_t *bcache_evict() {
+    // Two full sweeps are enough to clear every referenced bit
+    for (uint64_t i = 0; bcache_hand && i < bcache_stats.pages * 2; i++) {
+        bcache_page_t *page = bcache_hand;
+        bcache_hand = page->next;
+
+        // Someone else is doing I/O on it
+        if (page->flags & BCACHE_PAGE_BUSY) continue;
+
+        if (page->flags & BCACHE_PAGE_REFERENCED) {
+            page->flags &= ~BCACHE_PAGE_REFERENCED;
+            continue;
+        }
+
+        if (bcache_writebackPage(page)) continue; // Keep pages we couldn't write
+
+        bcache_unlinkPage(page);
+        bcache_stats.evictions++;
+        page->device->stats.evictions++;
+        return page;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Lookup a page in the cache. Lock must be held.
+ */
+static bcache_page_t *bcache_lookup(bcache_device_t *device, uint64_t index) {
+    bcache_page_t *page = bcache_hashtable[BCACHE_HASH(device, index)];
+    while (page) {
+        if (page->device == device && page->index == index) return page;
+        page = page->hash_next;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Allocate (or recycle) an unlinked page. Lock must be held, it is dropped if the recycled page needs a write-back.
+ *
+ * Callers have to look their page up again afterwards, someone else may have brought it in meanwhile.
+ *
+ * @returns A page with no valid contents
+ */
+static bcache_page_t *bcache_newPage() {
+    bcache_page_t *page = NULL;
+
+    // Grow the cache, or recycle a page if we are at capacity/under memory pressure
+    if (bcache_stats.pages >= BCACHE_MAX_PAGES || pmm_getFreeBlocks() < BCACHE_LOW_WATERMARK) {
+        page = bcache_evict();
+    }
+
+    if (!page) {
+        page = kmalloc(sizeof(bcache_page_t));
+        page->data = kmalloc(BCACHE_PAGE_SIZE);
+    }
+
+    return page;
+}
+
+/**
+ * @brief Insert a page into the cache. Lock must be held.
+ * @param page The page, from @c bcache_newPage
+ * @param device The device
+ * @param index The page index
+ * @param flags The initial page flags
+ */
+static void bcache_insertPage(bcache_page_t *page, bcache_device_t *device, uint64_t index, uint8_t flags) {
+    page->device = device;
+    page->index = index;
+    page->flags = flags;
+
+    // Link into the hash table
+    uintptr_t hash = BCACHE_HASH(device, index);
+    page->hash_next = bcache_hashtable[hash];
+    bcache_hashtable[hash] = page;
+
+    // Link into the clock ring, right behind the hand so it's the last to be looked at
+    if (!bcache_hand) {
+        page->next = page->prev = page;
+        bcache_hand = page;
+    } else {
+        page->next = bcache_hand;
+        page->prev = bcache_hand->prev;
+        bcache_hand->prev->next = page;
+        bcache_hand->prev = page;
+    }
+
+    bcache_stats.pages++;
+    device->stats.pages++;
+}
+
+/**
+ * @brief Drop a page whose contents could not be read. Lock must be held.
+ */
+static void bcache_dropPage(bcache_page_t *page) {
+    if (page->flags & BCACHE_PAGE_DIRTY) {
+        bcache_stats.dirty--;
+        page->device->stats.dirty--;
+    }
+
+    bcache_unlinkPage(page);
+    bcache_freePage(page);
+}
+
+/**
+ * @brief Get a page for a device, reading it in if needed. Lock must be held, it is dropped during device I/O.
+ * @param device The device
+ * @param index The page index
+ * @param fill Whether the page contents need to be read in on a miss (not needed for full-page writes)
+ * @returns The page (never busy) or NULL on I/O error
+ */
+static bcache_page_t *bcache_getPage(bcache_device_t *device, uint64_t index, int fill) {
+    bcache_page_t *page;
+    for (;;) {
+        page = bcache_lookup(device, index);
+        if (page) {
+            if (page->flags & BCACHE_PAGE_BUSY) {
+                bcache_waitBusy();
+                continue;
+            }
+
+            bcache_stats.hits++;
+            device->stats.hits++;
+            page->flags |= BCACHE_PAGE_REFERENCED;
+            if (!fill || (page->flags & BCACHE_PAGE_VALID)) return page;
+            break;
+        }
+
+        page = bcache_newPage();
+        if (bcache_lookup(device, index)) {
+            bcache_freePage(page);
+            continue;
+        }
+
+        bcache_stats.misses++;
+        device->stats.misses++;
+
+        bcache_insertPage(page, device, index, BCACHE_PAGE_REFERENCED);
+        if (!fill) return page;
+        break;
+    }
+
+    // Read it in without the lock, the busy flag keeps everyone else off the page
+    size_t per_page = BCACHE_PAGE_SIZE / device->block_size;
+    size_t blocks = bcache_pageBlocks(page);
+
+    page->flags |= BCACHE_PAGE_BUSY;
+    spinlock_release(bcache_lock);
+    if (blocks < per_page) memset(page->data, 0, BCACHE_PAGE_SIZE);
+    int error = device->read(device->dev, index * per_page, blocks, page->data);
+    spinlock_acquire(bcache_lock);
+    page->flags &= ~BCACHE_PAGE_BUSY;
+
+    if (error) {
+        LOG(ERR, "Read of page %i on device '%s' failed\n", index, device->name);
+        bcache_stats.errors++;
+        device->stats.errors++;
+
+        // Don't keep garbage around
+        bcache_dropPage(page);
+        return NULL;
+    }
+
+    page->flags |= BCACHE_PAGE_VALID;
+    return page;
+}
+
+/**
+ * @brief Read in a run of missing pages. Lock must be held, it is dropped during device I/O.
+ * @returns The amount of pages read in
+ */
+static int bcache_prefetchRun(bcache_device_t *device, uint64_t first, size_t count) {
+    size_t per_page = BCACHE_PAGE_SIZE / device->block_size;
+    bcache_page_t *pages[BCACHE_PREFETCH_BATCH];
+
+    // Allocating can drop the lock, so cut the run short at a page someone else brought in
+    for (size_t i = 0; i < count; i++) {
+        bcache_page_t *page = bcache_newPage();
+        if (bcache_lookup(device, first + i)) {
+            bcache_freePage(page);
+            count = i;
+            break;
+        }
+
+        bcache_insertPage(page, device, first + i, BCACHE_PAGE_BUSY);
+        pages[i] = page;
+    }
+
+    if (!count) return 0;
+    spinlock_release(bcache_lock);
+
+    // Read straight into the pages. Pages whose buffers happen to sit back to back share a request.
+    int error = 0;
+    for (size_t i = 0; i < count && !error;) {
+        size_t run = 1;
+        size_t run_blocks = bcache_pageBlocks(pages[i]);
+        while (i + run < count && pages[i + run]->data == pages[i]->data + run * BCACHE_PAGE_SIZE) {
+            run_blocks += bcache_pageBlocks(pages[i + run]);
+            run++;
+        }
+
+        // Only the last page of the device can be partial
+        if (run_blocks < run * per_page) memset(pages[i + run - 1]->data, 0, BCACHE_PAGE_SIZE);
+
+        error = device->read(device->dev, (first + i) * per_page, run_blocks, pages[i]->data);
+        i += run;
+    }
+
+    spinlock_acquire(bcache_lock);
+
+    if (error) {
+        LOG(ERR, "Prefetch of pages %i-%i on device '%s' failed\n", first, first + count - 1, device->name);
+        bcache_stats.errors++;
+        device->stats.errors++;
+
+        for (size_t i = 0; i < count; i++) bcache_dropPage(pages[i]);
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) pages[i]->flags = BCACHE_PAGE_VALID;
+
+    bcache_stats.prefetched += count;
+    device->stats.prefetched += count;
+    return count;
+}
+
+/**
+ * @brief Prefetch a range of a cached device
+ *
+ * Pages that are not already cached are read in straight into their cache pages.
+ * Consecutive missing pages share a device request where their buffers are adjacent.
+ *
+ * @param device The device to prefetch on
+ * @param offset The byte offset to start at
+ * @param size The amount of bytes to prefetch
+ * @returns The amount of pages read in
+ */
+int bcache_prefetch(bcache_device_t *device, off_t offset, size_t size) {
+    if (!device || !size) return 0;
+
+    uint64_t length = device->block_count * device->block_size;
+    if ((uint64_t)offset >= length) return 0;
+    if (offset + size > length) size = length - offset;
+
+    uint64_t first = offset / BCACHE_PAGE_SIZE;
+    uint64_t last = (offset + size - 1) / BCACHE_PAGE_SIZE;
+
+    spinlock_acquire(bcache_lock);
+
+    int read = 0;
+    uint64_t run_start = 0;
+    size_t run = 0;
+    for (uint64_t index = first; index <= last; index++) {
+        if (!bcache_lookup(device, index)) {
+            if (!run) run_start = index;
+            run++;
+            if (run < BCACHE_PREFETCH_BATCH && index != last) continue;
+        } else if (!run) {
+            continue;
+        }
+
+        read += bcache_prefetchRun(device, run_start, run);
+        run = 0;
+    }
+
+    spinlock_release(bcache_lock);
+    return read;
+}
+
+/**
+ * @brief Check whether a range of a cached device has changes that aren't on the device yet
+ *
+ * Pages being written back stay dirty until the write finishes, so they count too.
+ *
+ * @param device The device to check
+ * @param offset The byte offset of the range
+ * @param size The size of the range
+ * @returns 1 if any page in the range is dirty
+ */
+int bcache_isDirty(bcache_device_t *device, off_t offset, size_t size) {
+    if (!device || !size) return 0;
+
+    uint64_t first = offset / BCACHE_PAGE_SIZE;
+    uint64_t last = (offset + size - 1) / BCACHE_PAGE_SIZE;
+
+    spinlock_acquire(bcache_lock);
+
+    int dirty = 0;
+    for (uint64_t index = first; index <= last && !dirty; index++) {
+        bcache_page_t *page = bcache_lookup(device, index);
+        if (page && (page->flags & BCACHE_PAGE_DIRTY)) dirty = 1;
+    }
+
+    spinlock_release(bcache_lock);
+    return dirty;
+}
+
+/**
+ * @brief Read from a cached device
+ * @param device The device to read from
+ * @param offset The byte offset to read at
+ * @param size The amount of bytes to read
+ * @param buffer The output buffer
+ * @returns The amount of bytes read
+ */
+ssize_t bcache_read(bcache_device_t *device, off_t offset, size_t size, uint8_t *buffer) {
+    if (!device || !buffer || !size) return 0;
+
+    uint64_t length = device->block_count * device->block_size;
+    if ((uint64_t)offset >= length) return 0;
+    if (offset + size > length) size = length - offset;
+
+    spinlock_acquire(bcache_lock);
+
+    size_t done = 0;
+    while (done < size) {
+        uint64_t index = (offset + done) / BCACHE_PAGE_SIZE;
+        size_t page_offset = (offset + done) % BCACHE_PAGE_SIZE;
+        size_t chunk = BCACHE_PAGE_SIZE - page_offset;
+        if (chunk > size - done) chunk = size - done;
+
+        bcache_page_t *page = bcache_getPage(device, index, 1);
+        if (!page) break;
+
+        memcpy(buffer + done, page->data + page_offset, chunk);
+        done += chunk;
+    }
+
+    spinlock_release(bcache_lock);
+    return done;
+}
+
+/**
+ * @brief Write to a cached device
+ *
+ * Writes are buffered and written back on eviction, every @c BCACHE_WRITEBACK_INTERVAL ms (see @c bcache_work),
+ * on @c bcache_sync, or when too many pages are dirty.
+ *
+ * @param device The device to write to
+ * @param offset The byte offset to write at
+ * @param size The amount of bytes to write
+ * @param buffer The input buffer
+ * @returns The amount of bytes written
+ */
+ssize_t bcache_write(bcache_device_t *device, off_t offset, size_t size, uint8_t *buffer) {
+    if (!device || !buffer || !size) return 0;
+    if (!device->write) return 0;
+
+    uint64_t length = device->block_count * device->block_size;
+    if ((uint64_t)offset >= length) return 0;
+    if (offset + size > length) size = length - offset;
+
+    spinlock_acquire(bcache_lock);
+
+    size_t done = 0;
+    while (done < size) {
+        uint64_t index = (offset + done) / BCACHE_PAGE_SIZE;
+        size_t page_offset = (offset + done) % BCACHE_PAGE_SIZE;
+        size_t chunk = BCACHE_PAGE_SIZE - page_offset;
+        if (chunk > size - done) chunk = size - done;
+
+        // Full page writes do not need the old contents
+        bcache_page_t *page = bcache_getPage(device, index, (chunk != BCACHE_PAGE_SIZE));
+        if (!page) break;
+
+        memcpy(page->data + page_offset, buffer + done, chunk);
+        page->flags |= BCACHE_PAGE_VALID;
+
+        if (!(page->flags & BCACHE_PAGE_DIRTY)) {
+            page->flags |= BCACHE_PAGE_DIRTY;
+            bcache_stats.dirty++;
+            device->stats.dirty++;
+        }
+
+        done += chunk;
+    }
+
+    spinlock_release(bcache_lock);
+
+    // Don't let too much dirty data pile up
+    if (bcache_stats.dirty >= BCACHE_DIRTY_THRESHOLD) bcache_sync(NULL);
+
+    return done;
+}
+
+/**
+ * @brief Write back all dirty pages
+ * @param device The device to write back, or NULL for every device
+ * @returns The amount of pages written back
+ */
+int bcache_sync(bcache_device_t *device) {
+    if (!bcache_lock) return 0;
+    spinlock_acquire(bcache_lock);
+
+    // A page stays linked while its write-back has the lock dropped, so its next pointer is still good afterwards
+    int written = 0;
+    bcache_page_t *page = bcache_hand;
+    for (uint64_t i = 0; page && i < bcache_stats.pages; i++) {
+        // Busy pages are already being written back (or read in, which means they're clean)
+        if ((!device || page->device == device) && (page->flags & BCACHE_PAGE_DIRTY) && !(page->flags & BCACHE_PAGE_BUSY)) {
+            if (!bcache_writebackPage(page)) written++;
+        }
+
+        page = page->next;
+    }
+
+    spinlock_release(bcache_lock);
+    return written;
+}
+
+/**
+ * @brief Drop pages from the cache under memory pressure
+ * @param pages The amount of pages to try and free
+ * @returns The amount of pages freed
+ */
+int bcache_reclaim(size_t pages) {
+    if (!bcache_lock) return 0;
+    spinlock_acquire(bcache_lock);
+
+    size_t freed = 0;
+    while (freed < pages) {
+        bcache_page_t *page = bcache_evict();
+        if (!page) break;
+
+        bcache_freePage(page);
+        freed++;
+    }
+
+    spinlock_release(bcache_lock);
+    return freed;
+}
+
+/**
+ * @brief Periodic cache maintenance, run from the deferred work loop
+ *
+ * Writes back dirty pages every @c BCACHE_WRITEBACK_INTERVAL ms, and shrinks the cache
+ * while the PMM is under @c BCACHE_LOW_WATERMARK free blocks.
+ */
+void bcache_work() {
+    if (!bcache_lock || !clock_isReady()) return;
+
+    // Recycling only stops the cache from growing, give memory back if something else needs it
+    if (bcache_stats.pages && pmm_getFreeBlocks() < BCACHE_LOW_WATERMARK) {
+        int freed = bcache_reclaim(BCACHE_RECLAIM_BATCH);
+        if (freed) LOG(DEBUG, "Low on memory, dropped %i pages\n", freed);
+    }
+
+    uint64_t now = clock_getDevice().get_timer();
+    if (now < bcache_next_writeback) return;
+    bcache_next_writeback = now + (uint64_t)BCACHE_WRITEBACK_INTERVAL * 1000;
+
+    if (bcache_stats.dirty) bcache_sync(NULL);
+}
+
+/**
+ * @brief Get cache statistics
+ * @param device The device to get statistics for, or NULL for the global statistics
+ * @param stats Output structure
+ */
+void bcache_getStats(bcache_device_t *device, bcache_stats_t *stats) {
+    if (!stats) return;
+    memcpy(stats, device ? &device->stats : &bcache_stats, sizeof(bcache_stats_t));
+}
@@ -0,0 +1,270 @@
+/**
+ * @file hexahedron/fs/ioring.c
+ * @brief Asynchronous VFS I/O ring
+ *
+ * Each ring owns a submission queue, a completion queue twice its size, and a pool of
+ * request structures so that neither submission nor completion ever allocates.
+ * Submission is refused once in-flight requests plus unreaped completions would
+ * overflow the completion queue. The submission queue belongs to a single submitter,
+ * everything else is under the ring lock.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/fs/ioring.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/debug.h>
+#include <string.h>
+#include <errno.h>
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "FS:IORING", __VA_ARGS__)
+
+/**
+ * @brief Lock a ring with interrupts off
+ *
+ * Drivers complete requests from their IRQ handlers, which must not find the lock held by their own CPU.
+ *
+ * @param ring The ring
+ * @returns The flags to pass to @c ioring_unlock
+ */
+static uintptr_t ioring_lock(vfs_ioring_t *ring) {
+    uintptr_t flags = 0;
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    asm volatile ("pushf\npop %0\ncli" : "=r"(flags) :: "memory");
+#endif
+    spinlock_acquire(ring->lock);
+    return flags;
+}
+
+/**
+ * @brief Unlock a ring
+ * @param ring The ring
+ * @param flags The flags returned by @c ioring_lock
+ */
+static void ioring_unlock(vfs_ioring_t *ring, uintptr_t flags) {
+    spinlock_release(ring->lock);
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    if (flags & 0x200) asm volatile ("sti" ::: "memory");
+#endif
+}
+
+/**
+ * @brief Create a new I/O ring
+ * @param entries The submission queue size, rounded up to a power of two
+ * @returns A new ring or NULL on bad arguments
+ */
+vfs_ioring_t *ioring_create(size_t entries) {
+    if (!entries || entries > IORING_MAX_ENTRIES) return NULL;
+
+    size_t size = 1;
+    while (size < entries) size <<= 1;
+
+    vfs_ioring_t *ring = kmalloc(sizeof(vfs_ioring_t));
+    memset(ring, 0, sizeof(vfs_ioring_t));
+    ring->entries = size;
+    ring->cq_entries = size * 2;
+
+    ring->sq = kmalloc(sizeof(vfs_ioring_sqe_t) * ring->entries);
+    ring->cq = kmalloc(sizeof(vfs_ioring_cqe_t) * ring->cq_entries);
+    ring->requests = kmalloc(sizeof(vfs_io_request_t) * ring->entries);
+    memset(ring->sq, 0, sizeof(vfs_ioring_sqe_t) * ring->entries);
+    memset(ring->cq, 0, sizeof(vfs_ioring_cqe_t) * ring->cq_entries);
+    memset(ring->requests, 0, sizeof(vfs_io_request_t) * ring->entries);
+
+    // Build the free list
+    for (size_t i = 0; i < ring->entries; i++) {
+        ring->requests[i].ring = ring;
+        ring->requests[i].next = ring->free;
+        ring->free = &ring->requests[i];
+    }
+
+    ring->lock = spinlock_create("ioring lock");
+    return ring;
+}
+
+/**
+ * @brief Destroy an I/O ring
+ * @param ring The ring to destroy
+ * @returns 0 on success, -EBUSY if requests are still in flight
+ */
+int ioring_destroy(vfs_ioring_t *ring) {
+    if (!ring) return -EINVAL;
+    if (ring->inflight) return -EBUSY;
+
+    spinlock_destroy(ring->lock);
+    kfree(ring->requests);
+    kfree(ring->cq);
+    kfree(ring->sq);
+    kfree(ring);
+    return 0;
+}
+
+/**
+ * @brief Get a free submission queue entry
+ *
+ * The entry is zeroed. Fill it in and call @c ioring_submit once the batch is ready.
+ * Only the ring's submitter may call this.
+ *
+ * @param ring The ring
+ * @returns A submission queue entry or NULL if the queue is full
+ */
+vfs_ioring_sqe_t *ioring_getSqe(vfs_ioring_t *ring) {
+    if (!ring) return NULL;
+    if (ring->sq_tail - ring->sq_head >= ring->entries) return NULL;
+
+    vfs_ioring_sqe_t *sqe = &ring->sq[ring->sq_tail & (ring->entries - 1)];
+    memset(sqe, 0, sizeof(vfs_ioring_sqe_t));
+    ring->sq_tail++;
+    return sqe;
+}
+
+/**
+ * @brief Synchronous fallback for nodes without a submit method
+ * @param sqe The submission to execute
+ * @returns Bytes transferred or negative error code
+ */
+static ssize_t ioring_execute(vfs_ioring_sqe_t *sqe) {
+    if (sqe->opcode == IORING_OP_NOP) return 0;
+    if (!sqe->node || !sqe->addr) return -EINVAL;
+
+    switch (sqe->opcode) {
+        case IORING_OP_READ:
+            return fs_read(sqe->node, sqe->offset, sqe->length, (uint8_t*)sqe->addr);
+        case IORING_OP_WRITE:
+            return fs_write(sqe->node, sqe->offset, sqe->length, (uint8_t*)sqe->addr);
+        case IORING_OP_READV:
+            return fs_readv(sqe->node, sqe->offset, (struct iovec*)sqe->addr, (int)sqe->length);
+        case IORING_OP_WRITEV:
+            return fs_writev(sqe->node, sqe->offset, (struct iovec*)sqe->addr, (int)sqe->length);
+        default:
+            return -EINVAL;
+    }
+}
+
+/**
+ * @brief Submit every queued entry
+ *
+ * Submission stops early if the completion queue could overflow. Remaining entries stay queued.
+ * Only the ring's submitter may call this.
+ *
+ * @param ring The ring
+ * @returns The amount of entries submitted
+ */
+int ioring_submit(vfs_ioring_t *ring) {
+    if (!ring) return 0;
+
+    int submitted = 0;
+    while (ring->sq_head != ring->sq_tail) {
+        uintptr_t flags = ioring_lock(ring);
+
+        // Every in-flight request will post a completion, make sure there's room for it
+        if (!ring->free || (ring->cq_tail - ring->cq_head) + ring->inflight >= ring->cq_entries) {
+            ioring_unlock(ring, flags);
+            break;
+        }
+
+        vfs_io_request_t *request = ring->free;
+        ring->free = request->next;
+        request->next = NULL;
+        request->driver = NULL;
+        memcpy(&request->sqe, &ring->sq[ring->sq_head & (ring->entries - 1)], sizeof(vfs_ioring_sqe_t));
+        ring->sq_head++;
+        ring->inflight++;
+        ring->stats.submitted++;
+
+        ioring_unlock(ring, flags);
+        submitted++;
+
+        // Give the node a chance to handle it natively. The lock is not held here as the node may complete immediately.
+        fs_node_t *node = request->sqe.node;
+        if (node && node->submit && request->sqe.opcode != IORING_OP_NOP) {
+            int ret = node->submit(node, request);
+            if (!ret) {
+                ring->stats.async++;
+                continue;
+            }
+
+            if (ret != -ENOTSUP) {
+                ioring_complete(request, ret);
+                continue;
+            }
+        }
+
+        ring->stats.sync++;
+        ioring_complete(request, ioring_execute(&request->sqe));
+    }
+
+    return submitted;
+}
+
+/**
+ * @brief Complete a request
+ *
+ * Called by nodes that accepted a request in their submit method. Safe to call from IRQ context.
+ *
+ * @param request The request to complete
+ * @param result Bytes transferred or negative error code
+ */
+void ioring_complete(vfs_io_request_t *request, ssize_t result) {
+    if (!request || !request->ring) return;
+    vfs_ioring_t *ring = request->ring;
+
+    uintptr_t flags = ioring_lock(ring);
+
+    // ioring_submit guarantees there's room
+    vfs_ioring_cqe_t *cqe = &ring->cq[ring->cq_tail & (ring->cq_entries - 1)];
+    cqe->user_data = request->sqe.user_data;
+    cqe->result = result;
+    ring->cq_tail++;
+
+    request->next = ring->free;
+    ring->free = request;
+    ring->inflight--;
+    ring->stats.completed++;
+
+    ioring_unlock(ring, flags);
+}
+
+/**
+ * @brief Reap a completion
+ * @param ring The ring
+ * @param cqe Output completion
+ * @returns 1 if a completion was reaped, 0 if none are available
+ */
+int ioring_getCqe(vfs_ioring_t *ring, vfs_ioring_cqe_t *cqe) {
+    if (!ring || !cqe) return 0;
+
+    uintptr_t flags = ioring_lock(ring);
+    if (ring->cq_head == ring->cq_tail) {
+        ioring_unlock(ring, flags);
+        return 0;
+    }
+
+    memcpy(cqe, &ring->cq[ring->cq_head & (ring->cq_entries - 1)], sizeof(vfs_ioring_cqe_t));
+    ring->cq_head++;
+    ioring_unlock(ring, flags);
+    return 1;
+}
+
+/**
+ * @brief Wait for completions
+ * @param ring The ring
+ * @param count The amount of completions to wait for (bounded by what is in flight)
+ * @returns The amount of completions available
+ */
+size_t ioring_wait(vfs_ioring_t *ring, size_t count) {
+    if (!ring) return 0;
+
+    // There's no scheduler to sleep on, so just spin until the driver catches up
+    while ((size_t)(ring->cq_tail - ring->cq_head) < count && ring->inflight) {
+        asm volatile ("pause" ::: "memory");
+    }
+
+    return ring->cq_tail - ring->cq_head;
+}
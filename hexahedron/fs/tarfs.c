@@ -28,6 +28,7 @@
 /* Prototypes */
 ssize_t tarfs_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
 ssize_t tarfs_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
+int tarfs_readahead(fs_node_t *node, off_t offset, size_t size);
 fs_node_t *tarfs_finddir(fs_node_t *node, char *path);
 struct dirent *tarfs_readdir(fs_node_t *node, unsigned long index);
 
@@ -120,6 +121,7 @@ static fs_node_t *tarfs_ustarToNode(ustar_header_t *header, uint64_t inode, fs_n
     node->close = NULL;
     node->read = tarfs_read;
     node->write = tarfs_write;
+    node->readahead = tarfs_readahead;
     node->finddir = tarfs_finddir;
     node->readdir = tarfs_readdir;
 
@@ -167,6 +169,21 @@ ssize_t tarfs_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer)
     return fs_write((fs_node_t*)node->dev, write_offset, size, buffer);
 }
 
+/**
+ * @brief tarfs read-ahead method
+ * 
+ * File contents are stored contiguously after their header, so this just forwards to the backing device.
+ */
+int tarfs_readahead(fs_node_t *node, off_t offset, size_t size) {
+    if (node->flags != VFS_FILE) return -EINVAL;
+    if ((size_t)offset >= node->length) return 0;
+    if (offset + size > node->length) {
+        size = node->length - offset;
+    }
+
+    return fs_readahead((fs_node_t*)node->dev, node->inode + 512 + offset, size);
+}
+
 /**
  * @brief tarfs readdir method
  */
@@ -43,6 +43,9 @@ hashmap_t *vfs_filesystems = NULL;
 /* Locks */
 spinlock_t *vfs_lock;
 
+/* Read-ahead statistics */
+static vfs_readahead_stats_t vfs_readaheadStats = { 0 };
+
 /* Old reduceOS implemented a CWD system, but that was just for the kernel CLI */
 
 /**
@@ -73,6 +76,60 @@ void fs_close(fs_node_t *node) {
     kfree(node);
 }
 
+/**
+ * @brief Update the read-ahead state of a node after a read
+ * 
+ * Sequential access is detected by comparing the read offset against where the last read ended.
+ * Once a node is streaming, the next window is prefetched as soon as the reader gets within half a
+ * window of the end of what was already prefetched, so that the device round trip is paid by a read
+ * whose data was already cached rather than by the read that needs it. There are no kernel threads to
+ * hand the prefetch to, so it runs synchronously and that read still waits for the device.
+ * The window doubles on every pass up to @c VFS_READAHEAD_MAX. Any non-sequential read resets the window.
+ * 
+ * @param node The node that was read
+ * @param offset The offset of the read
+ * @param size The amount of bytes that were read
+ */
+static void vfs_readahead(fs_node_t *node, off_t offset, size_t size) {
+    vfs_readahead_t *ra = &node->ra;
+    ra->reads++;
+    vfs_readaheadStats.reads++;
+
+    // Was this read covered by a previous prefetch?
+    if (ra->window && offset + (off_t)size <= ra->end) {
+        ra->hits++;
+        vfs_readaheadStats.hits++;
+    }
+
+    if (offset != ra->next) {
+        // Random access, stop prefetching until the reader is sequential again
+        ra->next = offset + size;
+        ra->end = 0;
+        ra->window = 0;
+        return;
+    }
+
+    ra->next = offset + size;
+
+    // Don't prefetch again until the reader has consumed half of the current window
+    if (ra->window && ra->end > ra->next && (size_t)(ra->end - ra->next) > ra->window / 2) return;
+
+    // Grow the window
+    size_t window = (ra->window) ? ra->window * 2 : size * 4;
+    if (window < VFS_READAHEAD_MIN) window = VFS_READAHEAD_MIN;
+    if (window > VFS_READAHEAD_MAX) window = VFS_READAHEAD_MAX;
+
+    off_t start = (ra->end > ra->next) ? ra->end : ra->next;
+    if (node->length && (uint64_t)start >= node->length) return;
+
+    if (node->readahead(node, start, window) < 0) return;
+
+    ra->end = start + window;
+    ra->window = window;
+    vfs_readaheadStats.prefetches++;
+    vfs_readaheadStats.bytes += window;
+}
+
 /**
  * @brief Standard POSIX read call
  * @param node The node to read from
@@ -85,7 +142,9 @@ ssize_t fs_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
     if (!node) return 0;
 
     if (node->read) {
-        return node->read(node, offset, size, buffer);
+        ssize_t ret = node->read(node, offset, size, buffer);
+        if (ret > 0 && node->readahead) vfs_readahead(node, offset, ret);
+        return ret;
     }
 
     return 0;
@@ -109,6 +168,83 @@ ssize_t fs_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
     return 0;
 }
 
+/**
+ * @brief Vectored read call
+ * @param node The node to read from
+ * @param offset The offset to start reading at
+ * @param iov The buffers to read into, filled in order
+ * @param iovcnt The amount of buffers
+ * @returns The total amount of bytes read, or -EINVAL on bad arguments
+ */
+ssize_t fs_readv(fs_node_t *node, off_t offset, struct iovec *iov, int iovcnt) {
+    if (!node || !iov || iovcnt < 0 || iovcnt > IOV_MAX) return -EINVAL;
+
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (!iov[i].iov_len) continue;
+
+        ssize_t ret = fs_read(node, offset + total, iov[i].iov_len, (uint8_t*)iov[i].iov_base);
+        if (ret < 0) return (total) ? total : ret;
+        total += ret;
+
+        // Short read, don't leave holes in the following buffers
+        if ((size_t)ret < iov[i].iov_len) break;
+    }
+
+    return total;
+}
+
+/**
+ * @brief Vectored write call
+ * @param node The node to write to
+ * @param offset The offset to start writing at
+ * @param iov The buffers to write from, consumed in order
+ * @param iovcnt The amount of buffers
+ * @returns The total amount of bytes written, or -EINVAL on bad arguments
+ */
+ssize_t fs_writev(fs_node_t *node, off_t offset, struct iovec *iov, int iovcnt) {
+    if (!node || !iov || iovcnt < 0 || iovcnt > IOV_MAX) return -EINVAL;
+
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (!iov[i].iov_len) continue;
+
+        ssize_t ret = fs_write(node, offset + total, iov[i].iov_len, (uint8_t*)iov[i].iov_base);
+        if (ret < 0) return (total) ? total : ret;
+        total += ret;
+
+        if ((size_t)ret < iov[i].iov_len) break;
+    }
+
+    return total;
+}
+
+/**
+ * @brief Read-ahead hint call
+ * @param node The node to prefetch on
+ * @param offset The offset to start prefetching at
+ * @param size The amount of bytes to prefetch
+ * @returns 0 on success, -ENOTSUP if the node has no read-ahead method
+ */
+int fs_readahead(fs_node_t *node, off_t offset, size_t size) {
+    if (!node) return -EINVAL;
+
+    if (node->readahead) {
+        return node->readahead(node, offset, size);
+    }
+
+    return -ENOTSUP;
+}
+
+/**
+ * @brief Get read-ahead statistics
+ * @param stats Output structure
+ */
+void vfs_getReadaheadStats(vfs_readahead_stats_t *stats) {
+    if (!stats) return;
+    memcpy(stats, &vfs_readaheadStats, sizeof(vfs_readahead_stats_t));
+}
+
 /**
  * @brief Read directory
  * @param node The node to read the directory of
@@ -440,6 +576,9 @@ static fs_node_t *vfs_getMountpoint(const char *path, char **remainder) {
 
     int _remainder_depth = 0;
 
+    // Drivers can mount while we walk, so hold the tree still
+    spinlock_acquire(vfs_lock);
+
     pch = strtok_r(path_clone, "/", &save);
     while (pch) {
         // We have to search until we don't find a match in the tree.
@@ -468,9 +607,11 @@ static fs_node_t *vfs_getMountpoint(const char *path, char **remainder) {
 
     *remainder = (char*)path + _remainder_depth;
     vfs_tree_node_t *vnode = (vfs_tree_node_t*)last_node->value;
+    fs_node_t *node = vnode->node;
+    spinlock_release(vfs_lock);
     kfree(path_clone);
 
-    return vnode->node;
+    return node;
 }
 
 
@@ -544,6 +685,7 @@ _finish_node:
     // Always clone the node to prevent mucking around with datastructures.
     fs_node_t *retnode = kmalloc(sizeof(fs_node_t));
     memcpy(retnode, node, sizeof(fs_node_t));
+    memset(&retnode->ra, 0, sizeof(vfs_readahead_t)); // Read-ahead state is per open file
     fs_open(retnode, flags);
     return retnode;
 }
@@ -12,8 +12,11 @@
  */
 
 #include <kernel/gfx/term.h>
+#include <kernel/mem/alloc.h>
 #include <kernel/debug.h>
+#include <kernel/misc/spinlock.h>
 #include <stddef.h>
+#include <string.h>
 
 /* GCC */
 #pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
@@ -30,10 +33,58 @@ int terminal_y = 0;
 color_t terminal_fg = TERMINAL_DEFAULT_FG;
 color_t terminal_bg = TERMINAL_DEFAULT_BG;
 
+/* Character cells (terminal_width * terminal_height). Drawing is deferred to terminal_flush */
+static terminal_cell_t *terminal_cells = NULL;
+
+/* Dirty span of every row, in cells. A row is clean if start >= end */
+static int *terminal_dirtyStart = NULL;
+static int *terminal_dirtyEnd = NULL;
+
+/* Lines the screen has to be scrolled by on the next flush */
+static int terminal_scrollPending = 0;
+
+/* Glyph caches */
+static terminal_glyph_cache_t terminal_glyphCaches[TERMINAL_GLYPH_CACHES] = { 0 };
+static uint64_t terminal_glyphCounter = 0;
+
 /* Hacked in ANSI escape codes */
 static int ansi_escape_code = 0; // 0 = no code, 1 = received a \033, 2 = received a [. Resets to 0 on m, meaning that yes, you can break this by not specifying m.
 static int ansi_color_code = 0; 
 
+/* Terminal lock, printf can be called from several CPUs at once */
+static spinlock_t terminal_lock = { 0 };
+
+/* Panic state (panic.c) */
+extern int kernel_in_panic_state;
+
+/**
+ * @brief Lock the terminal
+ * 
+ * Interrupts are disabled while it is held so a handler printing on the same CPU can't deadlock.
+ * A panic ignores the lock, the CPU holding it might have been stopped.
+ * 
+ * @returns Whether interrupts were enabled
+ */
+static int terminal_acquire() {
+    uintptr_t flags = 0;
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    asm volatile ("pushf\npop %0\ncli" : "=r"(flags) :: "memory");
+#endif
+    if (!kernel_in_panic_state) spinlock_acquire(&terminal_lock);
+    return (flags & 0x200) ? 1 : 0;
+}
+
+/**
+ * @brief Unlock the terminal
+ * @param enabled Whether interrupts were enabled
+ */
+static void terminal_release(int enabled) {
+    if (!kernel_in_panic_state) spinlock_release(&terminal_lock);
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    if (enabled) asm volatile ("sti" ::: "memory");
+#endif
+}
+
 /**
  * @brief Initialize the terminal system - sets terminal_print as default printf method.
  * @returns 0 on success, -EINVAL on no video driver/font driver.
@@ -55,6 +106,24 @@ int terminal_init(color_t fg, color_t bg) {
     terminal_fg = fg;
     terminal_bg = bg;
 
+    // (Re)allocate cells and glyph caches
+    if (terminal_cells) {
+        kfree(terminal_cells);
+        kfree(terminal_dirtyStart);
+        kfree(terminal_dirtyEnd);
+    }
+
+    terminal_cells = kmalloc(terminal_width * terminal_height * sizeof(terminal_cell_t));
+    terminal_dirtyStart = kmalloc(terminal_height * sizeof(int));
+    terminal_dirtyEnd = kmalloc(terminal_height * sizeof(int));
+    terminal_scrollPending = 0;
+
+    for (int i = 0; i < TERMINAL_GLYPH_CACHES; i++) {
+        if (terminal_glyphCaches[i].glyphs) kfree(terminal_glyphCaches[i].glyphs);
+        memset(&terminal_glyphCaches[i], 0, sizeof(terminal_glyph_cache_t));
+        terminal_glyphCaches[i].glyphs = kmalloc(TERMINAL_GLYPH_COUNT * fontWidth * fontHeight * sizeof(uint32_t));
+    }
+
     // Reset terminal X and terminal Y
     terminal_x = terminal_y = 0;
 
@@ -65,6 +134,91 @@ int terminal_init(color_t fg, color_t bg) {
     return 0;
 }
 
+/**
+ * @brief Get the rendered glyph of a character
+ * @param c The character
+ * @param fg The foreground
+ * @param bg The background
+ * @returns A bitmap of font width * height pixels
+ */
+static uint32_t *terminal_getGlyph(uint8_t c, color_t fg, color_t bg) {
+    uint32_t fg_pixel = RGB_PIXEL(fg);
+    uint32_t bg_pixel = RGB_PIXEL(bg);
+    terminal_glyphCounter++;
+
+    // Find the cache of this pair, or evict the least recently used one
+    terminal_glyph_cache_t *cache = &terminal_glyphCaches[0];
+    for (int i = 0; i < TERMINAL_GLYPH_CACHES; i++) {
+        terminal_glyph_cache_t *candidate = &terminal_glyphCaches[i];
+        if (candidate->last_used && candidate->fg == fg_pixel && candidate->bg == bg_pixel) {
+            cache = candidate;
+            goto _found;
+        }
+
+        if (candidate->last_used < cache->last_used) cache = candidate;
+    }
+
+    cache->fg = fg_pixel;
+    cache->bg = bg_pixel;
+    memset(cache->rendered, 0, sizeof(cache->rendered));
+
+_found:
+    cache->last_used = terminal_glyphCounter;
+
+    uint32_t *glyph = &cache->glyphs[c * font_getWidth() * font_getHeight()];
+    if (!(cache->rendered[c / 32] & (1U << (c % 32)))) {
+        font_renderGlyph(c, fg, bg, glyph);
+        cache->rendered[c / 32] |= (1U << (c % 32));
+    }
+
+    return glyph;
+}
+
+/**
+ * @brief Mark cells as dirty
+ * @param x The first cell
+ * @param y The row
+ * @param count The amount of cells
+ */
+static inline void terminal_markDirty(int x, int y, int count) {
+    if (x < terminal_dirtyStart[y]) terminal_dirtyStart[y] = x;
+    if (x + count > terminal_dirtyEnd[y]) terminal_dirtyEnd[y] = x + count;
+}
+
+/**
+ * @brief Fill a row with blank cells
+ * @param y The row
+ */
+static void terminal_blankRow(int y) {
+    terminal_cell_t *cell = &terminal_cells[y * terminal_width];
+    for (int x = 0; x < terminal_width; x++) {
+        cell[x].c = ' ';
+        cell[x].fg = terminal_fg;
+        cell[x].bg = terminal_bg;
+    }
+}
+
+/**
+ * @brief Scroll the terminal up by one row
+ * 
+ * Only the cells are moved here. The screen is scrolled once per flush, no matter how many rows were scrolled.
+ */
+static void terminal_scroll() {
+    // Move every row up, pending redraws move with it
+    for (int y = 0; y < terminal_height - 1; y++) {
+        memcpy(&terminal_cells[y * terminal_width], &terminal_cells[(y + 1) * terminal_width], terminal_width * sizeof(terminal_cell_t));
+        terminal_dirtyStart[y] = terminal_dirtyStart[y + 1];
+        terminal_dirtyEnd[y] = terminal_dirtyEnd[y + 1];
+    }
+
+    terminal_blankRow(terminal_height - 1);
+    terminal_dirtyStart[terminal_height - 1] = 0;
+    terminal_dirtyEnd[terminal_height - 1] = terminal_width;
+
+    terminal_y = terminal_height - 1;
+    terminal_scrollPending++;
+}
+
 /**
  * @brief Clear terminal screen
  * @param fg The foreground of the terminal
@@ -73,18 +227,63 @@ int terminal_init(color_t fg, color_t bg) {
 void terminal_clear(color_t fg, color_t bg) {
     terminal_fg = fg;
     terminal_bg = bg;
+    if (!terminal_cells) return;
 
     for (int y = 0; y < terminal_height; y++) {
-        for (int x = 0; x < terminal_width; x++) {
-            font_putCharacter(' ', x, y, terminal_fg, terminal_bg);
+        terminal_blankRow(y);
+        terminal_dirtyStart[y] = terminal_width;
+        terminal_dirtyEnd[y] = 0;
+    }
+
+    // Blank cells are just the background
+    terminal_scrollPending = 0;
+    video_clearScreen(bg);
+}
+
+/**
+ * @brief Flush terminal output to the screen
+ * 
+ * Scrolls the screen, draws every dirty cell from the glyph caches and updates the video driver.
+ */
+void terminal_flush() {
+    int enabled = terminal_acquire();
+
+    if (terminal_cells) {
+        if (terminal_scrollPending) {
+            int font_height = font_getHeight();
+            if (terminal_scrollPending >= terminal_height || video_scroll(terminal_scrollPending * font_height, terminal_bg)) {
+                // Everything has to be drawn again
+                for (int y = 0; y < terminal_height; y++) {
+                    terminal_dirtyStart[y] = 0;
+                    terminal_dirtyEnd[y] = terminal_width;
+                }
+            }
+
+            terminal_scrollPending = 0;
+        }
+
+        int font_width = font_getWidth();
+        int font_height = font_getHeight();
+        for (int y = 0; y < terminal_height; y++) {
+            for (int x = terminal_dirtyStart[y]; x < terminal_dirtyEnd[y]; x++) {
+                terminal_cell_t *cell = &terminal_cells[y * terminal_width + x];
+                video_blit(x * font_width, y * font_height, font_width, font_height, terminal_getGlyph(cell->c, cell->fg, cell->bg));
+            }
+
+            terminal_dirtyStart[y] = terminal_width;
+            terminal_dirtyEnd[y] = 0;
         }
     }
+
+    video_updateScreen();
+    terminal_release(enabled);
 }
 
 /**
  * @brief Handle a backspace in the terminal
  */
 static void terminal_backspace() {
+    if (!terminal_x) return;
     terminal_x--;
     terminal_putchar(' ');
     terminal_x--;
@@ -225,7 +424,11 @@ int terminal_putchar(int c) {
             }
 
             // Normal character
-            font_putCharacter(c, terminal_x, terminal_y, terminal_fg, terminal_bg);
+            terminal_cell_t *cell = &terminal_cells[terminal_y * terminal_width + terminal_x];
+            cell->c = (uint8_t)c;
+            cell->fg = terminal_fg;
+            cell->bg = terminal_bg;
+            terminal_markDirty(terminal_x, terminal_y, 1);
             terminal_x++;
             break;
     }
@@ -236,9 +439,9 @@ int terminal_putchar(int c) {
         terminal_x = 0;
     }
 
-    // Clear the screen if the height is too big
+    // Scroll if the height is too big
     if (terminal_y >= terminal_height) {
-        terminal_clear(terminal_fg, terminal_bg); // No scrolling yet
+        terminal_scroll();
     }
 
     return 0;
@@ -248,7 +451,20 @@ int terminal_putchar(int c) {
  * @brief Put character method (printf-conforming)
  */
 int terminal_print(void *user, int c) {
-    return terminal_putchar(c);
+    int enabled = terminal_acquire();
+    int ret = terminal_putchar(c);
+    terminal_release(enabled);
+    return ret;
+}
+
+/**
+ * @brief Write method (printf-conforming)
+ */
+int terminal_write(void *user, const char *buffer, size_t length) {
+    int enabled = terminal_acquire();
+    for (size_t i = 0; i < length; i++) terminal_putchar((unsigned char)buffer[i]);
+    terminal_release(enabled);
+    return 0;
 }
 
 /**
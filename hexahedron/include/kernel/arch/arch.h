@@ -60,6 +60,11 @@ extern generic_parameters_t *arch_get_generic_parameters();
  */
 extern int arch_current_cpu();
 
+/**
+ * @brief Wait for the next interrupt
+ */
+extern void arch_pause();
+
 /**
  * @brief Jump to usermode and execute at an entrypoint
  * @param entrypoint The entrypoint
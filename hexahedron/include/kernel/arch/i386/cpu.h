@@ -57,6 +57,15 @@
 #define I386_MSR_APIC_BASE          0x1B
 #define I386_MSR_APIC_BASE_BSP      0x100
 #define I386_MSR_APIC_BASE_ENABLE   0x800
+#define I386_MSR_PAT                0x277
+
+// PAT memory types
+#define I386_PAT_UC         0x00    // Uncacheable
+#define I386_PAT_WC         0x01    // Write-combining
+#define I386_PAT_WT         0x04    // Writethrough
+#define I386_PAT_WP         0x05    // Write-protected
+#define I386_PAT_WB         0x06    // Writeback
+#define I386_PAT_UCMINUS    0x07    // Uncacheable, MTRRs can override it
 
 /**** TYPES ****/
 enum {
@@ -161,6 +170,14 @@ void cpu_getMSR(uint32_t msr, uint32_t *lo, uint32_t *hi);
  */
 void cpu_setMSR(uint32_t msr, uint32_t lo, uint32_t hi);
 
+/**
+ * @brief Program the page attribute table of the current CPU
+ * 
+ * PAT entry 4 (PAT bit set, PCD/PWT clear) is switched to write-combining.
+ * @returns 1 if the PAT was programmed, 0 if the CPU has no PAT
+ */
+int cpu_patInitialize();
+
 /**
  * @brief Get the vendor name of a CPU, cleaned up
  */
@@ -54,6 +54,14 @@ void hal_initializePIC();
  */
 void hal_disablePIC();
 
+/**
+ * @brief Switch legacy IRQ delivery from the 8259 PICs to the I/O APIC
+ * 
+ * @c ioapic_initialize must have succeeded. IRQs that already have handlers are routed
+ * according to the balancing policy, the rest stay masked until they get one.
+ */
+void hal_enableIOAPIC();
+
 /**
  * @brief Installs the IDT in the current AP
  */
@@ -61,18 +69,63 @@ void hal_installIDT();
 
 /**
  * @brief Register an interrupt handler
- * @param int_no Interrupt number (start at 0)
- * @param handler A handler. This should return 0 on success, anything else panics.
- *                It will take registers and extended registers as arguments.
- * @returns 0 on success, -EINVAL if handler is taken
+ * 
+ * Up to I86_MAX_SHARED_HANDLERS handlers can share an interrupt. Handlers on a shared interrupt
+ * should return IRQ_UNHANDLED when their device did not assert it.
+ * 
+ * @param int_no Interrupt number
+ * @param handler A handler. This should return IRQ_HANDLED or IRQ_UNHANDLED, anything else panics.
+ *                It will take an exception number, irq number, registers, and extended registers as arguments.
+ * @returns 0 on success, -EINVAL if the handler is already registered or the interrupt is full
  */
 int hal_registerInterruptHandler(uintptr_t int_no, interrupt_handler_t handler);
 
 /**
- * @brief Unregisters an interrupt handler
+ * @brief Remove a single handler from an interrupt
+ * @param int_no Interrupt number
+ * @param handler The handler to remove
+ */
+void hal_removeInterruptHandler(uintptr_t int_no, interrupt_handler_t handler);
+
+/**
+ * @brief Unregisters every handler on an interrupt
  */
 void hal_unregisterInterruptHandler(uintptr_t int_no);
 
+/**
+ * @brief Allocate a block of dynamic IRQs
+ * 
+ * The IRQs are numbered like any other (vector - 32) and are used with @c hal_registerInterruptHandler.
+ * They are never routed through the PIC or I/O APIC, and are meant for message signalled interrupts.
+ * 
+ * @param count The amount of consecutive IRQs to allocate
+ * @param align Alignment of the first vector (power of two, MSI needs blocks aligned to their size)
+ * @returns The first IRQ number or -ENOSPC
+ */
+int hal_allocateInterrupts(int count, int align);
+
+/**
+ * @brief Free a block of dynamic IRQs
+ * 
+ * Any handlers must be unregistered first.
+ * 
+ * @param int_no The first IRQ number (as returned by @c hal_allocateInterrupts)
+ * @param count The amount of IRQs
+ */
+void hal_freeInterrupts(uintptr_t int_no, int count);
+
+/**
+ * @brief Get the IRQ of a PCI INTx# line
+ * 
+ * Lines below 16 are legacy IRQs. Anything higher is taken as an I/O APIC GSI (firmware
+ * puts the GSI in the interrupt line register in APIC mode) and gets a dynamic IRQ, shared
+ * by every device on that GSI and kept for good. It stays masked until it has a handler.
+ * 
+ * @param line The interrupt line register
+ * @returns The IRQ number, -ENODEV if the line isn't connected or can't be routed, or -ENOSPC
+ */
+int hal_getLineIRQ(uint8_t line);
+
 /**
  * @brief Register an exception handler
  * @param int_no Exception number
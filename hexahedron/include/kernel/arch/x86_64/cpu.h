@@ -61,6 +61,21 @@
 #define X86_64_MSR_GSBASE               0xC0000101
 #define X86_64_MSR_KERNELGSBASE         0xC0000102
 
+#define X86_64_MSR_PAT                  0x277
+
+// PAT memory types
+#define X86_64_PAT_UC           0x00    // Uncacheable
+#define X86_64_PAT_WC           0x01    // Write-combining
+#define X86_64_PAT_WT           0x04    // Writethrough
+#define X86_64_PAT_WP           0x05    // Write-protected
+#define X86_64_PAT_WB           0x06    // Writeback
+#define X86_64_PAT_UCMINUS      0x07    // Uncacheable, MTRRs can override it
+
+// TLB features enabled by cpu_tlbInitialize
+#define CPU_TLB_GLOBAL          0x01    // CR4.PGE is set, global pages survive CR3 loads
+#define CPU_TLB_PCID            0x02    // CR4.PCIDE is set, CR3 carries a PCID
+#define CPU_TLB_INVPCID         0x04    // INVPCID is available
+
 /**** TYPES ****/
 enum {
     CPUID_FEAT_ECX_SSE3         = 1 << 0,
@@ -128,12 +143,27 @@ enum {
     CPUID_FEAT_EDX_PBE          = 1 << 31
 };
 
+// Structured extended features (leaf 7, subleaf 0)
+enum {
+    CPUID_FEAT7_EBX_FSGSBASE    = 1 << 0,
+    CPUID_FEAT7_EBX_BMI1        = 1 << 3,
+    CPUID_FEAT7_EBX_AVX2        = 1 << 5,
+    CPUID_FEAT7_EBX_SMEP        = 1 << 7,
+    CPUID_FEAT7_EBX_BMI2        = 1 << 8,
+    CPUID_FEAT7_EBX_ERMS        = 1 << 9,
+    CPUID_FEAT7_EBX_INVPCID     = 1 << 10,
+    CPUID_FEAT7_EBX_SMAP        = 1 << 20,
+
+    CPUID_FEAT7_EDX_FSRM        = 1 << 4,
+};
+
 
 enum cpuid_requests {
     CPUID_GETVENDORSTRING,
     CPUID_GETFEATURES,
     CPUID_GETTLB,
     CPUID_GETSERIAL,
+    CPUID_GETEXTFEATURES = 7,
 
     CPUID_INTELEXTENDED = 0x80000000,
     CPUID_INTELFEATURES,
@@ -180,6 +210,22 @@ void cpu_getMSR(uint32_t msr, uint32_t *lo, uint32_t *hi);
  */
 void cpu_setMSR(uint32_t msr, uint32_t lo, uint32_t hi);
 
+/**
+ * @brief Program the page attribute table of the current CPU
+ * 
+ * PAT entry 4 (PAT bit set, PCD/PWT clear) is switched to write-combining.
+ * @returns 1 if the PAT was programmed, 0 if the CPU has no PAT
+ */
+int cpu_patInitialize();
+
+/**
+ * @brief Enable global pages and PCIDs on the current CPU
+ * 
+ * CR4.PCIDE can only be set while CR3 holds PCID 0, so this runs before any PCID is handed out.
+ * @returns The CPU_TLB_* features that were enabled
+ */
+int cpu_tlbInitialize();
+
 /**
  * @brief Get the vendor name of a CPU, cleaned up
  */
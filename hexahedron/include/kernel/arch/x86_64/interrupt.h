@@ -91,6 +91,10 @@ typedef struct _x86_64_gdt {
 typedef int (*interrupt_handler_t)(uintptr_t exception_index, uintptr_t interrupt_no, registers_t* regs, extended_registers_t* extended);
 typedef int (*exception_handler_t)(uintptr_t exception_index, registers_t* regs, extended_registers_t* extended);
 
+// Interrupt handler return values (anything else panics)
+#define IRQ_HANDLED     0   // The interrupt came from this handler's device
+#define IRQ_UNHANDLED   1   // Not this handler's device, try the next one on the line
+
 
 /**** DEFINITIONS ****/
 
@@ -103,6 +107,12 @@ typedef int (*exception_handler_t)(uintptr_t exception_index, registers_t* regs,
 #define X86_64_IDT_DESC_PRESENT 0x80   // 10000000
 #define X86_64_MAX_INTERRUPTS  255
 #define X86_64_MAX_EXCEPTIONS  31
+#define X86_64_MAX_SHARED_HANDLERS 4   // Handlers that can share an interrupt
+
+// Dynamically allocated IRQs (vectors 48-239, the 16 above are left for the local APIC)
+#define X86_64_IRQ_DYNAMIC_START   16      // First dynamically allocated IRQ number (vector 48)
+#define X86_64_IRQ_DYNAMIC_COUNT   192     // Amount of dynamically allocated IRQs
+#define X86_64_IRQ_STUB_SIZE       32      // Size of a stub in halIRQStubs
 
 // PIC definitions
 #define X86_64_PIC1_ADDR       0x20                // Master PIC address
@@ -173,5 +183,6 @@ extern void halIRQ12(void); // Interrupt number 44
 extern void halIRQ13(void); // Interrupt number 45
 extern void halIRQ14(void); // Interrupt number 46
 extern void halIRQ15(void); // Interrupt number 47
+extern void halIRQStubs(void); // Interrupt numbers 48-239, see X86_64_IRQ_STUB_SIZE
 
 #endif
\ No newline at end of file
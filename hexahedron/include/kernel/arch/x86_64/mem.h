@@ -44,6 +44,24 @@ typedef union page {
     uint64_t data;
 } page_t;
 
+// A PCID handed out by mem_switchDirectory
+typedef struct mem_asid {
+    uintptr_t dir;              // Physical address of the directory tagged with this PCID
+    uint64_t generation;        // Generation the PCID was handed out in (stale if it isn't the current one)
+} mem_asid_t;
+
+// PCIDs each CPU hands out before recycling them (PCID 0 is left for untagged loads).
+// The TLB only keeps a few contexts warm, so a short table that is cheap to search beats using all 4096.
+#define MEM_ASID_COUNT      16
+
+// Per-CPU PCID allocator
+typedef struct mem_asid_table {
+    mem_asid_t asids[MEM_ASID_COUNT];
+    uint64_t generation;        // Current generation. Bumping it takes every PCID back
+    uint64_t flush_generation;  // Last value of the global flush generation this CPU saw
+    uint16_t next;              // Next PCID to hand out
+} mem_asid_table_t;
+
 /**** DEFINITIONS ****/
 
 #define PAGE_SIZE       0x1000      // 4 KiB
@@ -52,6 +70,10 @@ typedef union page {
 // Page shifting
 #define MEM_PAGE_SHIFT  12
 
+// CR3 bits when CR4.PCIDE is set
+#define MEM_CR3_PCID_MASK   0xFFF           // PCID the directory is loaded with
+#define MEM_CR3_NOFLUSH     (1ULL << 63)    // Keep the TLB entries already tagged with that PCID
+
 
 // IMPORTANT: THIS IS THE HEXAHEDRON MEMORY MAP CONFIGURED FOR I386
 // 0x0000000000000000 - 0x0000000000200000: Kernel code - this can be expanded a decent amount.
@@ -101,4 +123,27 @@ typedef union page {
  */
 void mem_init(uintptr_t mem_size, uintptr_t kernel_addr);
 
+/**
+ * @brief Drop every PCID on every CPU
+ * 
+ * Call this when a directory is freed (its physical page could come back as a different directory)
+ * or when its user mappings change while another CPU may have it tagged.
+ * Each CPU starts a new PCID generation on its next directory switch.
+ */
+void mem_flushASIDs();
+
+/**
+ * @brief Invalidate the TLB entry of a page in a directory
+ * @param dir The directory the mapping was changed in (NULL for current)
+ * @param address The virtual address that was remapped or unmapped
+ * 
+ * @note This only covers the current CPU.
+ */
+void mem_invalidatePage(page_t *dir, uintptr_t address);
+
+/**
+ * @brief Measure the cost of switching directories with and without PCIDs and print the results
+ */
+void mem_benchmarkSwitch();
+
 #endif
\ No newline at end of file
@@ -48,6 +48,7 @@ typedef struct _smp_info {
     
     // Overrides
     uint32_t    irq_overrides[MAX_INT_OVERRIDES];   // IRQ overrides (index of array = source, content = map)
+    uint16_t    irq_override_flags[MAX_INT_OVERRIDES]; // MPS INTI flags of the overrides (polarity/trigger mode)
 } smp_info_t;
 
 // AP parameters, unused now mostly
@@ -58,6 +59,9 @@ typedef struct _smp_ap_parameters {
     uintptr_t lapic_id;
 } smp_ap_parameters_t;
 
+// Work run on an AP by smp_runOnCPU
+typedef void (*smp_work_t)(void *data);
+
 /**** FUNCTIONS ****/
 
 /**
@@ -72,6 +76,26 @@ int smp_init(smp_info_t *info);
  */
 int smp_getCPUCount();
 
+/**
+ * @brief Get the local APIC ID of a CPU
+ * @param cpu The CPU
+ * @returns The local APIC ID or -1 if SMP is not initialized
+ */
+int smp_getLAPICID(int cpu);
+
+/**
+ * @brief Run a function on an idle AP
+ * 
+ * The AP runs @c work from its idle loop with interrupts enabled and takes no more work
+ * until it returns. Only one CPU should be handing out work.
+ * 
+ * @param cpu The CPU index (not the APIC ID), 0 is the BSP and can't be used
+ * @param work The function to run
+ * @param data Passed to @c work
+ * @returns 0 on success, -EINVAL if the CPU can't take work or -EBUSY if it's still running something
+ */
+int smp_runOnCPU(int cpu, smp_work_t work, void *data);
+
 /**
  * @brief Get the current CPU's APIC ID
  */
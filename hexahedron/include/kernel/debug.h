@@ -20,20 +20,16 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
-
-/**** TYPES ****/
-typedef int (*log_putchar_method_t)(void *user, char ch); // Put character method used by logger
-
-typedef enum {
-    NOHEADER = 0,       // Do not use any header, including file/timestamp/etc. This is mainly used for some "cool" formatting.
-    INFO = 1,           // Prefix with [INFO]
-    WARN = 2,           // Prefix with [WARN]
-    ERR = 3,            // Prefix with [ERR ]
-    DEBUG = 4,          // Prefix with [DBG ]
-} DEBUG_LOG_TYPE;
+#include <time.h>
 
 /**** DEFINITIONS ****/
 
+// Log rings
+#define DEBUG_LOG_RECORDS       128     // Records per CPU ring (power of two)
+#define DEBUG_LOG_MESSAGE_SIZE  256     // Maximum formatted message length per record
+#define DEBUG_LOG_MODULE_SIZE   24      // Maximum module name length per record
+#define DEBUG_LOG_TICK_RECORDS  4       // Records written out per clock tick (the tick writes with interrupts off)
+
 // NOTE: These colors won't actually be used by dprintf. You have to manually specify them.
 #define INFO_COLOR_CODE     "\033[36m\033[36m"
 #define WARN_COLOR_CODE     "\033[33m\033[33m"
@@ -47,7 +43,45 @@ typedef enum {
 #define COLOR_CODE_YELLOW       "\033[0;33m"
 #define COLOR_CODE_YELLOW_BOLD  "\033[1;33m"
 
+/**** TYPES ****/
+typedef int (*log_putchar_method_t)(void *user, char ch); // Put character method used by logger
+typedef int (*log_write_method_t)(void *user, const char *buffer, size_t length); // Write method used by logger (optional, takes whole runs of text)
+
+typedef enum {
+    NOHEADER = 0,       // Do not use any header, including file/timestamp/etc. This is mainly used for some "cool" formatting.
+    INFO = 1,           // Prefix with [INFO]
+    WARN = 2,           // Prefix with [WARN]
+    ERR = 3,            // Prefix with [ERR ]
+    DEBUG = 4,          // Prefix with [DBG ]
+} DEBUG_LOG_TYPE;
+
+/**
+ * @brief Log record
+ */
+typedef struct debug_log_record {
+    volatile uint32_t committed;            // Ring index + 1 once the record is fully written
+    uint32_t sequence;                      // Global sequence number, used to merge the CPU rings in order
+    time_t timestamp;                       // Time of logging, -1 if the clock was not ready
+    int cpu;                                // CPU the record was logged on
+    DEBUG_LOG_TYPE status;                  // Log level
+    uint16_t length;                        // Length of the message
+    uint8_t truncated;                      // The message did not fit in the record
+    char module[DEBUG_LOG_MODULE_SIZE];     // Module name (empty for none)
+    char message[DEBUG_LOG_MESSAGE_SIZE];   // Formatted message
+} debug_log_record_t;
 
+/**
+ * @brief Per-CPU log ring
+ * 
+ * Only the owning CPU (and interrupts on it) appends to a ring, only the drain consumes from it.
+ */
+typedef struct debug_log_ring {
+    volatile uint32_t head;                 // Next index to reserve
+    volatile uint32_t tail;                 // Next index to drain
+    volatile uint32_t dropped;              // Records dropped because the ring was full
+    uint32_t reported;                      // Dropped records already reported by the drain
+    debug_log_record_t records[DEBUG_LOG_RECORDS];
+} debug_log_ring_t;
 
 /**** FUNCTIONS ****/
 
@@ -96,10 +130,54 @@ void debug_setOutput(log_putchar_method_t logMethod);
  */
 log_putchar_method_t debug_getOutput();
 
+/**
+ * @brief Set the debug write method
+ * @param writeMethod Writes whole runs of text (translating newlines itself), or NULL to go through the putchar method
+ */
+void debug_setWriteOutput(log_write_method_t writeMethod);
+
 /**
  * @brief Function to print debug string
  */
 int debug_print(void *user, char ch);
 
+/**
+ * @brief Switch the debug log to per-CPU rings
+ * 
+ * Until this is called every dprintf() is written out synchronously. Afterwards
+ * records are queued and written out by @c debug_drainLog and the clock tick.
+ * Needs the allocator and the clock. CPUs brought up later log synchronously until
+ * this is called again, which adds their rings.
+ * 
+ * @returns 0 on success
+ */
+int debug_startLogDrain();
+
+/**
+ * @brief Write out queued log records, oldest first
+ * 
+ * Does nothing if another CPU is already draining.
+ */
+void debug_drainLog();
+
+/**
+ * @brief Synchronously write out every queued log record (panic path)
+ * 
+ * Does not wait on a drain in progress. Records that were reserved but never
+ * finished are counted as dropped.
+ */
+void debug_flushLog();
+
+/**
+ * @brief Get the amount of dropped log records
+ * @param cpu The CPU to get the counter of, or -1 for the total
+ */
+uint32_t debug_getDroppedRecords(int cpu);
+
+/**
+ * @brief Measure formatting throughput of a few typical log lines and print the results
+ */
+void debug_benchmarkFormatting();
+
 
 #endif
\ No newline at end of file
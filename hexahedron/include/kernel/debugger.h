@@ -52,6 +52,8 @@ typedef struct _breakpoint {
 #define PACKET_TYPE_WRITEMEM    0x06    // Write memory request
 #define PACKET_TYPE_PANIC       0x07    // Panic! Sent by kernel
 #define PACKET_TYPE_BP_UPDATE   0x08    // Update breakpoint (add/remove)
+#define PACKET_TYPE_IRQ_STATS   0x09    // Interrupt statistics request (per CPU, per interrupt)
+#define PACKET_TYPE_BCACHE_STATS 0x0A   // Block cache statistics request
 
 /**** MACROS ****/
 
@@ -17,22 +17,76 @@
 /**** INCLUDES ****/
 #include <stdint.h>
 #include <kernel/drivers/video.h>
+#include <kernel/fs/vfs.h>
 
 
 /**** TYPES ****/
 
+/**
+ * @brief Unicode mapping entry
+ */
+typedef struct _font_unicode {
+    uint32_t codepoint;         // Unicode codepoint
+    uint32_t glyph;             // Glyph index
+} font_unicode_t;
+
 typedef struct _font_data {
     int type;           // The type of the font
     size_t width;       // Width of the font
     size_t height;      // Height of the font
     uint8_t *data;      // Data pointer to the font
+
+    // PSF fonts
+    uint32_t glyph_count;       // Amount of glyphs
+    uint32_t *atlas;            // Glyph atlas, one pixel mask per pixel (all ones for foreground)
+    font_unicode_t *unicode;    // Unicode mapping sorted by codepoint (NULL if glyphs are indexed by codepoint)
+    size_t unicode_count;       // Amount of Unicode mapping entries
 } font_data_t;
 
+/**
+ * @brief PSF1 header
+ */
+typedef struct psf1_header {
+    uint16_t magic;             // PSF1_MAGIC
+    uint8_t mode;               // PSF1_MODE...
+    uint8_t charsize;           // Bytes per glyph (the height, glyphs are 8 pixels wide)
+} __attribute__((packed)) psf1_header_t;
+
+/**
+ * @brief PSF2 header
+ */
+typedef struct psf2_header {
+    uint32_t magic;             // PSF2_MAGIC
+    uint32_t version;           // Zero
+    uint32_t headersize;        // Offset of the glyphs
+    uint32_t flags;             // PSF2_HAS_UNICODE_TABLE
+    uint32_t length;            // Amount of glyphs
+    uint32_t charsize;          // Bytes per glyph
+    uint32_t height;            // Height of a glyph
+    uint32_t width;             // Width of a glyph
+} __attribute__((packed)) psf2_header_t;
+
 /**** DEFINITIONS ****/
 
 #define FONT_TYPE_BACKUP        0       // Backup font
 #define FONT_TYPE_PSF           1       // PC screen font
 
+#define FONT_DEFAULT_LOCATION   "/device/initrd/font.psf"
+
+// PSF1
+#define PSF1_MAGIC              0x0436
+#define PSF1_MODE512            0x01    // 512 glyphs instead of 256
+#define PSF1_MODEHASTAB         0x02    // Unicode table present
+#define PSF1_MODESEQ            0x04    // Unicode table present (with sequences)
+#define PSF1_SEPARATOR          0xFFFF  // Ends the Unicode entries of a glyph
+#define PSF1_STARTSEQ           0xFFFE  // Starts a sequence
+
+// PSF2
+#define PSF2_MAGIC              0x864AB572
+#define PSF2_HAS_UNICODE_TABLE  0x01
+#define PSF2_SEPARATOR          0xFF    // Ends the Unicode entries of a glyph
+#define PSF2_STARTSEQ           0xFE    // Starts a sequence
+
 /**** FUNCTIONS ****/
 
 /**
@@ -40,6 +94,22 @@ typedef struct _font_data {
  */
 void font_init();
 
+/**
+ * @brief Render a glyph into a bitmap
+ * @param c The character
+ * @param fg The foreground color to use
+ * @param bg The background color to use
+ * @param out The bitmap (RGB_PIXEL format, font width * height pixels)
+ */
+void font_renderGlyph(int c, color_t fg, color_t bg, uint32_t *out);
+
+/**
+ * @brief Load a PSF1/PSF2 font and switch to it
+ * @param file The font file
+ * @returns 0 on success, -EINVAL on a bad font, -EIO on a read error
+ */
+int font_loadPSF(fs_node_t *file);
+
 /**
  * @brief Put a character to the screen
  * @param c The character
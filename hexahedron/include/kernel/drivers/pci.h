@@ -48,6 +48,66 @@ typedef struct pci_bar {
  */
 typedef int (*pci_callback_t)(uint8_t bus, uint8_t slot, uint8_t function, uint16_t vendor_id, uint16_t device_id, void *data);
 
+/**
+ * @brief PCI device (registry entry)
+ * 
+ * Devices are enumerated once at boot by @c pci_init
+ */
+typedef struct pci_device {
+    uint8_t bus;                        // Bus
+    uint8_t slot;                       // Slot
+    uint8_t function;                   // Function
+    uint8_t header_type;                // Header type (without the multifunction bit)
+
+    uint16_t vendor_id;                 // Vendor ID
+    uint16_t device_id;                 // Device ID
+    uint16_t type;                      // Class code + subclass (see @c pci_readType)
+    uint8_t progif;                     // Programming interface
+    uint8_t revision;                   // Revision ID
+
+    uint8_t msi_offset;                 // MSI capability offset (0 = not capable)
+    uint8_t msix_offset;                // MSI-X capability offset (0 = not capable)
+    int irq_mode;                       // Interrupt mode (PCI_IRQ_LEGACY, PCI_IRQ_MSI or PCI_IRQ_MSIX)
+    int irq_base;                       // First allocated IRQ (message signalled modes only)
+    int irq_count;                      // Amount of allocated IRQs
+    uintptr_t msix_table;               // Mapped MSI-X table
+
+    struct pci_device *next;            // Next device (enumeration order)
+    struct pci_device *next_class;      // Next device with the same class code
+    struct pci_device *next_id;         // Next device in the same vendor/device ID bucket
+} pci_device_t;
+
+/**
+ * @brief PCI driver match table entry
+ * 
+ * Any field can be @c PCI_ANY. Tables are terminated by @c PCI_MATCH_END
+ */
+typedef struct pci_match {
+    uint16_t vendor_id;                 // Vendor ID
+    uint16_t device_id;                 // Device ID
+    uint16_t type;                      // Class code + subclass
+    uint16_t progif;                    // Programming interface
+} pci_match_t;
+
+/**
+ * @brief PCI probe function
+ * 
+ * @param dev The matching device
+ * @param data Any additionally specified data by the caller of @c pci_probe
+ * 
+ * @returns 1 to stop probing, 0 to continue
+ */
+typedef int (*pci_probe_t)(pci_device_t *dev, void *data);
+
+/**
+ * @brief ECAM (memory-mapped configuration space) range
+ */
+typedef struct pci_ecam {
+    uint64_t address;                   // Physical address of the range (as if it started at bus 0)
+    uint8_t bus_start;                  // First bus decoded
+    uint8_t bus_end;                    // Last bus decoded
+} pci_ecam_t;
+
 /**** DEFINITIONS ****/
 
 // General stuff
@@ -55,6 +115,13 @@ typedef int (*pci_callback_t)(uint8_t bus, uint8_t slot, uint8_t function, uint1
 #define PCI_MAX_BUS                 256     // 256 buses
 #define PCI_MAX_SLOT                32      // 32 slots
 #define PCI_MAX_FUNC                8       // 8 functions
+#define PCI_ANY                     0xFFFF  // Match table wildcard
+#define PCI_ID_BUCKETS              64      // Vendor/device ID index buckets
+#define PCI_MAX_ECAM                8       // Maximum amount of ECAM ranges
+
+// ECAM
+#define PCI_ECAM_BUS_SIZE           0x100000    // 1MB of configuration space per bus
+#define PCI_ECAM_CONFIG_SIZE        0x1000      // 4KB of configuration space per function
 
 // BAR-specifics
 #define PCI_BAR_MEMORY32            0x0     // 32-bit memory space BAR (physical RAM) 
@@ -112,7 +179,12 @@ typedef int (*pci_callback_t)(uint8_t bus, uint8_t slot, uint8_t function, uint1
 #define PCI_HEADER_TYPE_PCI_CARDBUS_BRIDGE  0x02
 #define PCI_HEADER_TYPE_MULTIFUNCTION       0x80
 
-// Header type 1 (general device)
+// Header type 1 (PCI-to-PCI bridge)
+#define PCI_BRIDGE_PRIMARY_BUS_OFFSET       0x18
+#define PCI_BRIDGE_SECONDARY_BUS_OFFSET     0x19
+#define PCI_BRIDGE_SUBORDINATE_BUS_OFFSET   0x1A
+
+// Header type 0 (general device)
 #define PCI_GENERAL_BAR0_OFFSET             0x10    // BARx = Base Address Register
 #define PCI_GENERAL_BAR1_OFFSET             0x14
 #define PCI_GENERAL_BAR2_OFFSET             0x18
@@ -130,11 +202,80 @@ typedef int (*pci_callback_t)(uint8_t bus, uint8_t slot, uint8_t function, uint1
 #define PCI_GENERAL_MAX_LATENCY_OFFSET      0x3F    // How often the device needs access to the PCI bus (in 1/4 microsecond units)
 
 
+// Capabilities list
+#define PCI_CAPABILITY_ID_OFFSET            0x00    // Capability ID
+#define PCI_CAPABILITY_NEXT_OFFSET          0x01    // Offset of the next capability (0 = end of list)
+#define PCI_CAPABILITY_MAX                  48      // Maximum amount of capabilities (stops broken lists from looping)
+
+#define PCI_CAPABILITY_MSI                  0x05    // Message signalled interrupts
+#define PCI_CAPABILITY_MSIX                 0x11    // Extended message signalled interrupts
+
+// MSI capability
+#define PCI_MSI_CONTROL_OFFSET              0x02    // Message control
+#define PCI_MSI_ADDRESS_LOW_OFFSET          0x04    // Message address
+#define PCI_MSI_ADDRESS_HIGH_OFFSET         0x08    // Message upper address (64-bit capable only)
+#define PCI_MSI_DATA32_OFFSET               0x08    // Message data (32-bit)
+#define PCI_MSI_DATA64_OFFSET               0x0C    // Message data (64-bit capable)
+#define PCI_MSI_MASK32_OFFSET               0x0C    // Mask bits (32-bit, per-vector masking capable only)
+#define PCI_MSI_MASK64_OFFSET               0x10    // Mask bits (64-bit, per-vector masking capable only)
+
+#define PCI_MSI_CONTROL_ENABLE              0x0001  // MSI enable
+#define PCI_MSI_CONTROL_MMC                 0x000E  // Multiple message capable (log2 of the vectors supported)
+#define PCI_MSI_CONTROL_MMC_SHIFT           1
+#define PCI_MSI_CONTROL_MME                 0x0070  // Multiple message enable (log2 of the vectors allocated)
+#define PCI_MSI_CONTROL_MME_SHIFT           4
+#define PCI_MSI_CONTROL_64BIT               0x0080  // 64-bit address capable
+#define PCI_MSI_CONTROL_MASKABLE            0x0100  // Per-vector masking capable
+
+#define PCI_MSI_MAX_VECTORS                 32      // Multiple message enable tops out at 32 vectors
+
+// MSI-X capability
+#define PCI_MSIX_CONTROL_OFFSET             0x02    // Message control
+#define PCI_MSIX_TABLE_OFFSET               0x04    // Table offset and BIR
+#define PCI_MSIX_PBA_OFFSET                 0x08    // Pending bit array offset and BIR
+
+#define PCI_MSIX_CONTROL_TABLE_SIZE         0x07FF  // Table size - 1
+#define PCI_MSIX_CONTROL_MASK_ALL           0x4000  // Function mask
+#define PCI_MSIX_CONTROL_ENABLE             0x8000  // MSI-X enable
+#define PCI_MSIX_BIR                        0x07    // BAR indicator register (low bits of the table/PBA offset)
+
+// MSI-X table entry
+#define PCI_MSIX_ENTRY_SIZE                 16
+#define PCI_MSIX_ENTRY_ADDRESS_LOW          0x00
+#define PCI_MSIX_ENTRY_ADDRESS_HIGH         0x04
+#define PCI_MSIX_ENTRY_DATA                 0x08
+#define PCI_MSIX_ENTRY_CONTROL              0x0C
+#define PCI_MSIX_ENTRY_MASKED               0x01
+
+// x86 message format (fixed delivery, edge triggered, physical destination)
+#define PCI_MSI_ADDRESS_BASE                0xFEE00000  // Local APIC interrupt address range
+#define PCI_MSI_ADDRESS_DEST_SHIFT          12          // Destination local APIC ID
+#define PCI_MSI_DATA_VECTOR                 0xFF        // Vector
+
+// Interrupt modes (also used as flags for pci_allocateIRQs)
+#define PCI_IRQ_LEGACY                      0x0     // INTx# (PIC/I/O APIC line)
+#define PCI_IRQ_MSI                         0x1     // MSI
+#define PCI_IRQ_MSIX                        0x2     // MSI-X
+
+// Destination CPUs
+#define PCI_CPU_AUTO                        -1      // Spread vectors over every CPU
+
 // PCI types that are required
+#define PCI_TYPE_HOST_BRIDGE                0x0600  // Host bridge
 #define PCI_TYPE_BRIDGE                     0x0604  // PCI-to-PCI bridge
 
 /**** MACROS ****/
 
+// Match table terminator
+#define PCI_MATCH_END { 0, 0, 0, 0 }
+
+// Match table entries
+#define PCI_MATCH_ID(vendor, device) { vendor, device, PCI_ANY, PCI_ANY }
+#define PCI_MATCH_CLASS(type, progif) { PCI_ANY, PCI_ANY, type, progif }
+
+// Offset of a function's configuration space within an ECAM bus
+#define PCI_ECAM_OFFSET(slot, func) (((uintptr_t)(slot) << 15) | ((uintptr_t)(func) << 12))
+
 // Macro for help translating a bus/slot/function/offset to an address that can be written to PCI_CONFIG_ADDRESS
 #define PCI_ADDR(bus, slot, func, offset) (uint32_t)(((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC) | ((uint32_t)0x80000000))
 
@@ -148,18 +289,18 @@ typedef int (*pci_callback_t)(uint8_t bus, uint8_t slot, uint8_t function, uint1
 /**
  * @brief Read a specific offset from the PCI configuration space
  * 
- * Uses configuration space access mechanism #1.
+ * Uses ECAM if the bus is covered by an MCFG range, configuration space access mechanism #1 otherwise.
  * List of offsets is header-specific except for general header layout, see pci.h
  * 
  * @param bus The bus of the PCI device to read from
  * @param slot The slot of the PCI device to read from
  * @param func The function of the PCI device to read (if the device supports multiple functions)
- * @param offset The offset to read from
+ * @param offset The offset to read from (extended configuration space needs ECAM)
  * @param size The size of the value you want to read from. Do note that you'll have to typecast to this (max uint32_t).
  * 
- * @returns Either PCI_NONE if an invalid size was specified, or a value according to @c size
+ * @returns Either PCI_NONE if an invalid size or offset was specified, or a value according to @c size
  */
-uint32_t pci_readConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, int size);
+uint32_t pci_readConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, int size);
 
 /**
  * @brief Write to a specific offset in the PCI configuration space
@@ -167,12 +308,12 @@ uint32_t pci_readConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint8_t o
  * @param bus The bus of the PCI device to write to
  * @param slot The slot of the PCI device to write to
  * @param func The function of the PCI device to write (if the device supports multiple functions)
- * @param offset The offset to write to
+ * @param offset The offset to write to (extended configuration space needs ECAM)
  * @param value The value to write
  * 
  * @returns 0 on success
  */
-int pci_writeConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
+int pci_writeConfigOffset(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint32_t value);
 
 /**
  * @brief Auto-determine a BAR type and read it using the configuration space
@@ -234,58 +375,148 @@ uint16_t pci_readVendorID(uint8_t bus, uint8_t slot, uint8_t func);
 uint16_t pci_readType(uint8_t bus, uint8_t slot, uint8_t func);
 
 /**
- * @brief Scan and find a PCI device on a specific function
+ * @brief Scan and find a PCI device. Calls a callback function that can be used to determine the device more closely.
  * 
- * This is required because of @c PCI_TYPE_BRIDGE - also a remnant of the reduceOS scanner
+ * Walks the device registry, new drivers should use @c pci_probe instead.
+ * @see pci_callback_t for params/return value.
  * 
- * @param callback The callback to use
- * @param data Any user data to pass to callback
- * @param type The type of the device. Set to -1 to ignore type field
- * @param bus The bus to use
- * @param slot The slot of the bus
- * @param func The function of the device
+ * @param callback The callback function to call. 
+ * @param data Any user data to pass to callback.
+ * @param type The type of the device. Set to -1 to ignore type field.
  * 
  * @returns 0 on failure, 1 on successfully found
  */
-int pci_scanFunction(pci_callback_t callback, void *data, int type, uint8_t bus, uint8_t slot, uint8_t func);
+int pci_scan(pci_callback_t callback, void *data, int type);
 
 /**
- * @brief Scan and find a PCI device on a certain slot
+ * @brief Register an ECAM range (from the ACPI MCFG table)
  * 
- * @param callback The callback to use
- * @param data Any user data to pass to callback
- * @param type The type of the device. Set to -1 to ignore type field
- * @param bus The bus to use
- * @param slot The slot of the bus
+ * Buses in the range are mapped on first access. Only segment 0 is supported.
  * 
- * @returns 0 on failure, 1 on successfully found
+ * @param segment The PCI segment group
+ * @param bus_start The first bus decoded by the range
+ * @param bus_end The last bus decoded by the range
+ * @param address The physical address of the range
+ * 
+ * @returns 0 on success
  */
-int pci_scanSlot(pci_callback_t callback, void *data, int type, uint8_t bus, uint8_t slot);
+int pci_addECAM(uint16_t segment, uint8_t bus_start, uint8_t bus_end, uint64_t address);
 
 /**
- * @brief Scan and find a PCI device on a certain bus
+ * @brief Enumerate the PCI topology into the device registry
+ * @returns The amount of devices found
+ */
+int pci_init();
+
+/**
+ * @brief Get the first device in the registry
+ * @returns The first device (follow @c next) or NULL
+ */
+pci_device_t *pci_getDevices();
+
+/**
+ * @brief Find the next device with a type
  * 
- * @param callback The callback to use
- * @param data Any user data to pass to callback
- * @param type The type of the device. Set to -1 to ignore type field
- * @param bus The bus to check
+ * @param type Class code + subclass
+ * @param from The device to continue after, NULL to start at the beginning
  * 
- * @returns 0 on failure, 1 on successfully found
+ * @returns The next device or NULL
  */
-int pci_scanBus(pci_callback_t callback, void *data, int type, uint8_t bus);
+pci_device_t *pci_findClass(uint16_t type, pci_device_t *from);
 
 /**
- * @brief Scan and find a PCI device. Calls a callback function that can be used to determine the device more closely.
+ * @brief Find the next device with a vendor and device ID
  * 
- * @see pci_callback_t for params/return value.
+ * @param vendor_id The vendor ID
+ * @param device_id The device ID
+ * @param from The device to continue after, NULL to start at the beginning
  * 
- * @param callback The callback function to call. 
- * @param data Any user data to pass to callback.
- * @param type The type of the device. Set to -1 to ignore type field.
+ * @returns The next device or NULL
+ */
+pci_device_t *pci_findID(uint16_t vendor_id, uint16_t device_id, pci_device_t *from);
+
+/**
+ * @brief Probe every device matching a driver match table
  * 
- * @returns 0 on failure, 1 on successfully found
+ * @param table The match table, terminated by @c PCI_MATCH_END
+ * @param probe The probe function
+ * @param data Any user data to pass to the probe function
+ * 
+ * @returns 1 if the probe function stopped probing, 0 otherwise
  */
-int pci_scan(pci_callback_t callback, void *data, int type);
+int pci_probe(pci_match_t *table, pci_probe_t probe, void *data);
+
+
+/**
+ * @brief Find a capability in a device's capabilities list
+ * 
+ * @param dev The device
+ * @param id The capability ID (e.g. @c PCI_CAPABILITY_MSI)
+ * 
+ * @returns The configuration space offset of the capability or 0 if the device doesn't have it
+ */
+uint8_t pci_findCapability(pci_device_t *dev, uint8_t id);
+
+/**
+ * @brief Allocate message signalled interrupts for a device
+ * 
+ * MSI-X is preferred, every vector gets its own destination CPU (spread over the CPUs starting at @c cpu).
+ * MSI blocks are a power of two and share a single destination. INTx# is disabled while vectors are allocated.
+ * Handlers are registered with @c hal_registerInterruptHandler using @c pci_getIRQ.
+ * 
+ * @param dev The device
+ * @param count The amount of vectors wanted (e.g. one per queue per CPU)
+ * @param flags Allowed modes, @c PCI_IRQ_MSI and/or @c PCI_IRQ_MSIX
+ * @param cpu The CPU of the first vector or @c PCI_CPU_AUTO
+ * 
+ * @returns The amount of vectors allocated (can be more or less than @c count) or a negative error code
+ */
+int pci_allocateIRQs(pci_device_t *dev, int count, int flags, int cpu);
+
+/**
+ * @brief Get the IRQ number of an allocated vector
+ * 
+ * @param dev The device
+ * @param index The vector index
+ * 
+ * @returns The IRQ number or -EINVAL
+ */
+int pci_getIRQ(pci_device_t *dev, int index);
 
+/**
+ * @brief Change the destination CPU of an allocated vector
+ * 
+ * MSI vectors share one destination, so this moves all of them.
+ * 
+ * @param dev The device
+ * @param index The vector index
+ * @param cpu The destination CPU
+ * 
+ * @returns 0 on success
+ */
+int pci_setIRQAffinity(pci_device_t *dev, int index, int cpu);
+
+/**
+ * @brief Free the message signalled interrupts of a device and go back to INTx#
+ * 
+ * Any handlers must be unregistered first.
+ * 
+ * @param dev The device
+ */
+void pci_freeIRQs(pci_device_t *dev);
+
+/**
+ * @brief Get the IRQ of a device's INTx# line
+ * 
+ * Lines above 15 are I/O APIC GSIs and get a dynamic IRQ (level triggered, active low),
+ * so they only work once the I/O APIC is enabled.
+ * 
+ * @param bus The bus of the device
+ * @param slot The slot of the device
+ * @param func The function of the device
+ * 
+ * @returns The IRQ number or -ENODEV if the line isn't connected or can't be routed
+ */
+int pci_getLineIRQ(uint8_t bus, uint8_t slot, uint8_t func);
 
 #endif
\ No newline at end of file
@@ -26,6 +26,9 @@ struct _serial_port;
 // Write method
 typedef int (*serial_port_write_t)(struct _serial_port *port, char ch);
 
+// Write buffer method (raw bytes, no newline translation)
+typedef int (*serial_port_write_buffer_t)(struct _serial_port *port, const char *buffer, size_t length);
+
 // Read method (if timeout is 0, wait forever)
 typedef char (*serial_port_read_t)(struct _serial_port *port, size_t timeout);
 
@@ -37,6 +40,7 @@ typedef struct _serial_port {
 
     serial_port_read_t read;    // Read method 
     serial_port_write_t write;  // Write method
+    serial_port_write_buffer_t write_buffer;    // Write buffer method (optional)
 } serial_port_t;
 
 
@@ -72,6 +76,14 @@ void serial_setEarlyWriteMethod(int (*write_method)(char ch));
  */
 int serial_print(void *user, char ch);
 
+/**
+ * @brief Write method - writes a run of characters to main_port or early write method.
+ * @param user Can be put as a serial_port object to write to that, or can be NULL.
+ * @param buffer The characters to write
+ * @param length The amount of characters
+ */
+int serial_write(void *user, const char *buffer, size_t length);
+
 /**
  * @brief Serial printing method - writes to main_port
  */
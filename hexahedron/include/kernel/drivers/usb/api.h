@@ -103,6 +103,50 @@ USB_STATUS usb_getDescriptor(USBDevice_t *dev, uintptr_t request_type, uintptr_t
  */
 USB_STATUS usb_getStringDevice(USBDevice_t *device, int idx, uint16_t lang, char *buffer, size_t length);
 
+/**
+ * @brief Find an endpoint on an interface
+ * @param intf The interface to search
+ * @param type The transfer type of the endpoint (USB_ENDP_BULK, USB_ENDP_INTERRUPT, ...)
+ * @param direction The direction of the endpoint (USB_ENDP_IN or USB_ENDP_OUT)
+ * @returns The first matching endpoint or NULL
+ */
+USBEndpoint_t *usb_getEndpoint(USBInterface_t *intf, uint8_t type, uint8_t direction);
+
+/**
+ * @brief Perform a bulk transfer on an endpoint
+ * @param endp The bulk endpoint to do the transfer on (direction is taken from the endpoint)
+ * @param length The length of the data
+ * @param data The data to send/receive
+ * @param transferred Optional output for the amount of bytes actually transferred
+ * 
+ * @returns USB_SUCCESS on success
+ */
+USB_STATUS usb_bulkTransfer(USBEndpoint_t *endp, uintptr_t length, void *data, uint32_t *transferred);
+
+/**
+ * @brief Perform an interrupt transfer on an endpoint
+ * @param endp The interrupt endpoint to do the transfer on (direction is taken from the endpoint)
+ * @param length The length of the data
+ * @param data The data to send/receive
+ * @param transferred Optional output for the amount of bytes actually transferred
+ * 
+ * @returns USB_SUCCESS on success
+ */
+USB_STATUS usb_interruptTransfer(USBEndpoint_t *endp, uintptr_t length, void *data, uint32_t *transferred);
+
+/**
+ * @brief Submit an asynchronous bulk or interrupt transfer
+ * 
+ * The transfer must have @c endp, @c data, @c length and @c callback set. The callback is called
+ * (possibly from IRQ context) once the transfer completes. Interrupt transfers with @c USB_TRANSFER_REPEAT
+ * are rearmed by the host controller after every callback, which is how class drivers should poll
+ * interrupt endpoints (no per-packet allocation or setup).
+ * 
+ * @param transfer The transfer to submit. Must stay valid until it completes
+ * @returns USB_SUCCESS if the transfer was scheduled
+ */
+USB_STATUS usb_submitTransfer(USBTransfer_t *transfer);
+
 
 
 #endif
\ No newline at end of file
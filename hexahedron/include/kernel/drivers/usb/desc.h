@@ -46,7 +46,19 @@
 #define USB_ENDP_FEEDBACK       0x10
 #define USB_ENDP_FEEDBACK_IMPL  0x30
 
-// TODO: Endpoint transfer types and syncronization types
+// Endpoint transfer types (bmAttributes & USB_ENDP_TRANSFER_TYPE)
+#define USB_ENDP_TRANSFER_TYPE  0x03
+#define USB_ENDP_CONTROL        0x00
+#define USB_ENDP_ISOCHRONOUS    0x01
+#define USB_ENDP_BULK           0x02
+#define USB_ENDP_INTERRUPT      0x03
+
+// Endpoint direction (bEndpointAddress & USB_ENDP_DIRECTION)
+#define USB_ENDP_DIRECTION      0x80
+#define USB_ENDP_OUT            0x00
+#define USB_ENDP_IN             0x80
+
+// TODO: Endpoint syncronization types
 
 // USB configuration attributes
 #define USB_CONF_REMOTE_WAKEUP  0x20
@@ -25,13 +25,17 @@
 // Speeds
 #define USB_FULL_SPEED      0x00    // Full speed
 #define USB_LOW_SPEED       0x01    // Low speed
-#define USB_HIGH_SPEED      0x02    // High speed (fastest)
+#define USB_HIGH_SPEED      0x02    // High speed
+#define USB_SUPER_SPEED     0x03    // SuperSpeed (USB 3, xHCI only)
 
 // Transfer statuses
 #define USB_TRANSFER_IN_PROGRESS    0
 #define USB_TRANSFER_FAILED         1
 #define USB_TRANSFER_SUCCESS        2
 
+// Transfer flags
+#define USB_TRANSFER_REPEAT         0x01    // (interrupt transfers with a callback) Rearm the transfer after the callback until this flag is cleared
+
 // Maximum address
 #define USB_MAX_ADDRESS     127     // Each controller can have at most 127 devices
 
@@ -76,10 +80,22 @@ typedef struct USBConfiguration {
     list_t *interface_list;             // List of interfaces
 } USBConfiguration_t;
 
+struct USBTransfer;
+
+/**
+ * @brief USB transfer completion callback
+ * @param transfer The transfer that completed (status is already set)
+ * 
+ * @warning This can be called from IRQ context - don't allocate memory or submit transfers from it.
+ */
+typedef void (*usb_transfer_callback_t)(struct USBTransfer *transfer);
+
 /**
  * @brief USB transfer
  * 
  * This is a basic transfer usually passed to the host controller's request (along with the device).
+ * If @c callback is set, the host controller returns immediately and calls it once the transfer completes.
+ * Otherwise the request blocks until the transfer is done.
  */
 typedef struct USBTransfer {
     uint32_t endpoint;              // Endpoint number
@@ -87,6 +103,13 @@ typedef struct USBTransfer {
     void *data;                     // Data
     uint32_t length;                // Length of the data
     int status;                     // Transfer status (USB_TRANSFER_...)
+
+    usb_transfer_callback_t callback;   // Completion callback (optional)
+    void *parameter;                    // Parameter for the completion callback
+
+    struct USBEndpoint *endp;       // Endpoint (bulk/interrupt transfers only)
+    uint32_t actual_length;         // Amount of bytes actually transferred (bulk/interrupt transfers only)
+    int flags;                      // Transfer flags (USB_TRANSFER_...)
 } USBTransfer_t;
 
 
@@ -99,6 +122,15 @@ typedef struct USBTransfer {
  */
 typedef int (*hc_control_t)(struct USBController *controller, struct USBDevice *dev, USBTransfer_t *transfer);
 
+/**
+ * @brief Host controller transfer method for a BULK or INTERRUPT transfer
+ * @param controller The controller
+ * @param dev The device
+ * @param transfer The transfer (@c transfer->endp must be set)
+ * @returns USB_TRANSFER status code, or USB_TRANSFER_IN_PROGRESS if the transfer has a callback
+ */
+typedef int (*hc_transfer_t)(struct USBController *controller, struct USBDevice *dev, USBTransfer_t *transfer);
+
 
 /**
  * @brief Main USB device structure
@@ -128,6 +160,8 @@ typedef struct USBDevice {
 
     // Host controller methods
     hc_control_t    control;                // Control transfer request
+    hc_transfer_t   bulk;                   // Bulk transfer request (optional)
+    hc_transfer_t   interrupt;              // Interrupt transfer request (optional)
 } USBDevice_t;
 
 /**** FUNCTIONS ****/
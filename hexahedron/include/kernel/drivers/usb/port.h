@@ -0,0 +1,161 @@
+/**
+ * @file hexahedron/include/kernel/drivers/usb/port.h
+ * @brief USB port hotplug engine
+ *
+ * Root hubs (host controller drivers) and external hubs register their ports here.
+ * Port status changes are queued with @c usb_portEvent, which is safe from IRQ context,
+ * and every port then runs through a debounce/reset/enumerate state machine driven by
+ * deadlines instead of blocking sleeps. The state machines are stepped by @c usb_work.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef DRIVERS_USB_PORT_H
+#define DRIVERS_USB_PORT_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <kernel/drivers/usb/dev.h>
+
+/**** DEFINITIONS ****/
+
+// Port status (returned by the hub's status method)
+#define USB_PORT_CONNECTED          0x01    // A device is connected
+#define USB_PORT_ENABLED            0x02    // The port is enabled
+#define USB_PORT_CONNECT_CHANGE     0x04    // The connection changed since the last status read
+
+// Port states
+#define USB_PORT_STATE_DISCONNECTED 0       // Nothing connected
+#define USB_PORT_STATE_POWERON      1       // Waiting for port power to become good
+#define USB_PORT_STATE_DEBOUNCE     2       // Waiting for the connection to settle
+#define USB_PORT_STATE_WAIT_RESET   3       // Waiting for the default address to be free
+#define USB_PORT_STATE_RESET        4       // Port reset asserted
+#define USB_PORT_STATE_RECOVERY     5       // Reset recovery
+#define USB_PORT_STATE_ATTACHED     6       // Device enumerated
+#define USB_PORT_STATE_FAILED       7       // Enumeration failed, waiting for a disconnect
+
+// Timings (ms, USB 2.0 section 7.1.7.3 and 9.2.6.2)
+#define USB_PORT_DEBOUNCE_TIME      100     // TATTDB
+#define USB_PORT_ROOT_RESET_TIME    50      // TDRSTR for root ports
+#define USB_PORT_HUB_RESET_TIME     20      // Hubs time the reset themselves, this is when we check on it
+#define USB_PORT_RECOVERY_TIME      10      // TRSTRCY
+
+#define USB_PORT_RETRIES            3       // Reset/enumeration attempts before a port is given up on
+#define USB_PORT_MAX                256     // Maximum ports per hub
+
+/**** TYPES ****/
+
+struct USBPortHub;
+
+/**
+ * @brief Read (and acknowledge) the status of a port
+ * @param hub The port hub
+ * @param port The port (0-based)
+ * @param speed Output speed of the connected device (USB_..._SPEED)
+ * @returns USB_PORT_... status bits. Change bits must be cleared by this call
+ */
+typedef int (*usb_port_status_t)(struct USBPortHub *hub, uint32_t port, int *speed);
+
+/**
+ * @brief Assert or release reset on a port
+ * @param hub The port hub
+ * @param port The port (0-based)
+ * @param reset 1 to start the reset, 0 to end it (hubs that time their own resets can ignore this)
+ */
+typedef void (*usb_port_reset_t)(struct USBPortHub *hub, uint32_t port, int reset);
+
+/**
+ * @brief Enumerate the device on an enabled port
+ * @param hub The port hub
+ * @param port The port (0-based)
+ * @param speed The speed of the device
+ * @returns The initialized device or NULL
+ */
+typedef USBDevice_t *(*usb_port_attach_t)(struct USBPortHub *hub, uint32_t port, int speed);
+
+/**
+ * @brief Release hub/host controller resources of a detached device (optional)
+ * @param hub The port hub
+ * @param port The port (0-based)
+ * @param dev The device, which has already been deinitialized
+ */
+typedef void (*usb_port_detach_t)(struct USBPortHub *hub, uint32_t port, USBDevice_t *dev);
+
+/**
+ * @brief Port state
+ */
+typedef struct USBPort {
+    int state;                  // USB_PORT_STATE_...
+    uint64_t deadline;          // Timer value (us) at which the current state times out, 0 for none
+    int retries;                // Reset/enumeration attempts
+    USBDevice_t *dev;           // Attached device
+} USBPort_t;
+
+/**
+ * @brief Port hub (a root hub or an external hub)
+ */
+typedef struct USBPortHub {
+    char *name;                         // Name (for debugging)
+    struct USBController *c;            // Controller the hub is on
+    void *hub;                          // Hub-specific data
+    uint32_t nports;                    // Amount of ports
+    uint32_t reset_time;                // Time to hold the reset for (ms)
+    int shared_address;                 // Devices are reset into the bus-wide default address (not true on xHCI)
+
+    usb_port_status_t status;           // Status method
+    usb_port_reset_t reset;             // Reset method
+    usb_port_attach_t attach;           // Attach method
+    usb_port_detach_t detach;           // Detach method (optional)
+
+    uint32_t events[USB_PORT_MAX / 32]; // Ports with pending status changes (set from any context)
+    USBPort_t *ports;                   // Port states
+} USBPortHub_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Create a port hub
+ * @param name The name of the hub
+ * @param controller The controller the hub is on
+ * @param hub Hub-specific data
+ * @param nports The amount of ports
+ * @returns A new port hub (fill in the methods and call @c usb_registerPortHub)
+ */
+USBPortHub_t *usb_createPortHub(char *name, struct USBController *controller, void *hub, uint32_t nports);
+
+/**
+ * @brief Register a port hub and schedule a check of every port
+ * @param hub The port hub
+ * @param power_delay Time until port power is good (ms), 0 if the ports are already powered
+ */
+void usb_registerPortHub(USBPortHub_t *hub, uint32_t power_delay);
+
+/**
+ * @brief Unregister a port hub, detaching every device on it
+ * @param hub The port hub (freed)
+ */
+void usb_unregisterPortHub(USBPortHub_t *hub);
+
+/**
+ * @brief Queue a status change on a port
+ * @param hub The port hub
+ * @param port The port (0-based)
+ *
+ * Safe to call from IRQ context. Events are coalesced until @c usb_work handles them.
+ */
+void usb_portEvent(USBPortHub_t *hub, uint32_t port);
+
+/**
+ * @brief Handle queued port events and step port state machines whose deadlines passed
+ *
+ * Must be called from a context that can sleep and allocate (enumeration does both).
+ * Does nothing if called recursively.
+ */
+void usb_work();
+
+#endif
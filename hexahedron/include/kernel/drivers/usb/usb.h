@@ -25,6 +25,7 @@
 #include <kernel/drivers/usb/driver.h>
 #include <kernel/drivers/usb/status.h>
 #include <kernel/drivers/usb/api.h>
+#include <kernel/drivers/usb/port.h>
 
 /**** TYPES ****/
 
@@ -34,7 +35,8 @@ struct USBController;
 /**
  * @brief Poll method for USB controller
  * 
- * @warning Currently unused as of Jan 16, 2025
+ * Called from the clock interrupt, so it must not block or allocate. Root hubs without a
+ * port change interrupt use this to check their ports and queue @c usb_portEvent calls.
  * 
  * @param controller The controller
  */
@@ -51,6 +53,8 @@ typedef struct USBController {
     usb_poll_t poll;        // Poll method, will be called once every tick
     list_t *devices;        // List of USB devices with a maximum of 127
     uint32_t last_address;  // Last address given to a device. Starts at 0x1
+
+    struct USBPort *enumerating;    // Port currently between reset and SET_ADDRESS (its device answers on address 0)
 } USBController_t;
 
 
@@ -72,6 +76,13 @@ void usb_init();
  */
 USBController_t *usb_createController(void *hc, usb_poll_t poll);
 
+/**
+ * @brief USB poll method, called on every clock tick
+ * 
+ * Runs the controllers' poll methods. Enumeration itself happens in @c usb_work
+ */
+void usb_poll(uint64_t ticks);
+
 /**
  * @brief Register a new USB controller
  * 
@@ -92,6 +103,7 @@ USB_STATUS usb_initializeDevice(USBDevice_t *dev);
  * @param dev The device to deinitialize
  * 
  * @note This WILL NOT free the memory of the device. Call @c usb_destroyDevice after this.
+ * @returns USB_FAILURE if a driver did not release the device (don't free it then)
  */
 USB_STATUS usb_deinitializeDevice(USBDevice_t *dev);
 
@@ -36,6 +36,8 @@ typedef void (*putpixel_t)(struct _video_driver *driver, int x, int y, color_t c
 typedef void (*clearscreen_t)(struct _video_driver *driver, color_t bg); // Clear the screen
 typedef void (*updscreen_t)(struct _video_driver *driver); // Update the screen
 typedef int (*communicate_t)(struct _video_driver *driver, int type, uint32_t *data); // Communication. Allows for a sort of ioctl between drivers.
+typedef void (*blit_t)(struct _video_driver *driver, int x, int y, int width, int height, uint32_t *pixels); // Copy a bitmap of pixels (RGB_PIXEL format) to the screen
+typedef void (*scroll_t)(struct _video_driver *driver, int lines, color_t bg); // Move the screen up by lines pixel rows, filling the bottom with bg
 
 typedef struct _video_driver {
     // Driver information
@@ -55,6 +57,8 @@ typedef struct _video_driver {
     clearscreen_t   clear;
     updscreen_t     update;
     communicate_t   communicate;
+    blit_t          blit;                   // (optional)
+    scroll_t        scroll;                 // (optional)
 
     // Fonts and other information will be handled by the font driver
 } video_driver_t;
@@ -66,6 +70,7 @@ typedef struct _video_driver {
 #define RGB_G(color) (color.c.g & 255)
 #define RGB_B(color) (color.c.b & 255)
 #define RGB(red, green, blue) (color_t){.c.r = red, .c.g = green, .c.b = blue}
+#define RGB_PIXEL(color) ((RGB_R(color) << 16) | (RGB_G(color) << 8) | RGB_B(color)) // 32bpp pixel used by blits
 
 
 /**** DEFINITIONS ****/
@@ -140,4 +145,22 @@ void video_clearScreen(color_t bg);
  */
 void video_updateScreen();
 
+/**
+ * @brief Copy a bitmap of pixels to the screen
+ * @param x The x coordinate of the bitmap
+ * @param y The y coordinate of the bitmap
+ * @param width The width of the bitmap
+ * @param height The height of the bitmap
+ * @param pixels The pixels (RGB_PIXEL format, width * height of them)
+ */
+void video_blit(int x, int y, int width, int height, uint32_t *pixels);
+
+/**
+ * @brief Scroll the screen up
+ * @param lines The amount of pixel rows to scroll by
+ * @param bg The color to fill the bottom of the screen with
+ * @returns 0 on success, -EINVAL if the driver can't scroll (the caller must redraw)
+ */
+int video_scroll(int lines, color_t bg);
+
 #endif
\ No newline at end of file
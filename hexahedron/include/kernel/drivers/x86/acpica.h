@@ -43,6 +43,12 @@ int ACPICA_Initialize();
  */
 smp_info_t *ACPICA_GetSMPInfo();
 
+/**
+ * @brief Find and parse the MCFG, registering its ECAM ranges with the PCI driver
+ * @returns The amount of ECAM ranges found
+ */
+int ACPICA_ParseMCFG();
+
 /**
  * @brief Print the ACPICA namespace to serial (for debug)
  */
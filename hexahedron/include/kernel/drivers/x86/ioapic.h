@@ -0,0 +1,128 @@
+/**
+ * @file hexahedron/include/kernel/drivers/x86/ioapic.h
+ * @brief I/O APIC header file
+ *
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef DRIVERS_X86_IOAPIC_H
+#define DRIVERS_X86_IOAPIC_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/smp.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/smp.h>
+#endif
+
+/**** DEFINITIONS ****/
+
+// Registers (accessed through IOREGSEL/IOWIN)
+#define IOAPIC_IOREGSEL             0x00    // Register select
+#define IOAPIC_IOWIN                0x10    // Register window
+
+#define IOAPIC_REGISTER_ID          0x00    // ID register
+#define IOAPIC_REGISTER_VERSION     0x01    // Version register (bits 16-23 are the last redirection entry)
+#define IOAPIC_REGISTER_REDTBL      0x10    // Redirection table (two registers per entry)
+
+// Redirection entry (low dword)
+#define IOAPIC_REDIR_VECTOR         0x000FF // (0-7) Vector
+#define IOAPIC_REDIR_DELIVERY       0x00700 // (8-10) Delivery mode, 000 is fixed
+#define IOAPIC_REDIR_LOGICAL        0x00800 // (11) Logical destination mode
+#define IOAPIC_REDIR_PENDING        0x01000 // (12) Delivery status
+#define IOAPIC_REDIR_ACTIVE_LOW     0x02000 // (13) Polarity, set is active low
+#define IOAPIC_REDIR_REMOTE_IRR     0x04000 // (14) Remote IRR
+#define IOAPIC_REDIR_LEVEL          0x08000 // (15) Trigger mode, set is level triggered
+#define IOAPIC_REDIR_MASKED         0x10000 // (16) Set to mask
+
+// Redirection entry (high dword)
+#define IOAPIC_REDIR_DEST_SHIFT     24      // Destination local APIC ID
+
+// MPS INTI flags (from MADT interrupt source overrides)
+#define IOAPIC_INTI_POLARITY        0x03    // 00 = conforms to the bus, 01 = active high, 11 = active low
+#define IOAPIC_INTI_POLARITY_LOW    0x03
+#define IOAPIC_INTI_TRIGGER         0x0C    // 00 = conforms to the bus, 01 = edge, 11 = level
+#define IOAPIC_INTI_TRIGGER_LEVEL   0x0C
+
+// Limits
+#define IOAPIC_LEGACY_IRQS          16      // ISA IRQs, delivered on vectors 32-47 like the 8259 delivered them (higher GSIs get dynamic IRQs)
+#define IOAPIC_IRQ_CASCADE          2       // 8259 cascade, never used
+
+// Destination CPUs
+#define IOAPIC_CPU_AUTO             -1      // Let the balancing policy pick
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Initialize the I/O APIC(s)
+ *
+ * Every redirection entry starts out masked. IRQs are routed with @c ioapic_routeIRQ
+ * as handlers are registered.
+ *
+ * @param info SMP information (I/O APICs, overrides and local APIC IDs)
+ * @returns 0 on success
+ */
+int ioapic_initialize(smp_info_t *info);
+
+/**
+ * @brief Route a legacy IRQ to a CPU and unmask it
+ * @param irq The IRQ (before interrupt source overrides)
+ * @param cpu The destination CPU or @c IOAPIC_CPU_AUTO
+ * @returns 0 on success
+ */
+int ioapic_routeIRQ(uint8_t irq, int cpu);
+
+/**
+ * @brief Mask a legacy IRQ and forget its route
+ * @param irq The IRQ
+ */
+void ioapic_unrouteIRQ(uint8_t irq);
+
+/**
+ * @brief Change the destination CPU of a legacy IRQ
+ * @param irq The IRQ
+ * @param cpu The destination CPU or @c IOAPIC_CPU_AUTO
+ * @returns 0 on success
+ */
+int ioapic_setAffinity(uint8_t irq, int cpu);
+
+/**
+ * @brief Get the destination CPU of a legacy IRQ
+ * @param irq The IRQ
+ * @returns The CPU or -1 if the IRQ is not routed
+ */
+int ioapic_getAffinity(uint8_t irq);
+
+/**
+ * @brief Route a GSI above the legacy range to a CPU and unmask it
+ *
+ * These carry PCI INTx# lines, which are active low and level triggered.
+ *
+ * @param gsi The GSI
+ * @param irq The IRQ to deliver it as (vector 32 + @c irq, a dynamic IRQ)
+ * @param cpu The destination CPU or @c IOAPIC_CPU_AUTO
+ * @returns 0 on success
+ */
+int ioapic_routeGSI(uint32_t gsi, uint8_t irq, int cpu);
+
+/**
+ * @brief Mask a GSI above the legacy range
+ * @param gsi The GSI
+ */
+void ioapic_unrouteGSI(uint32_t gsi);
+
+/**
+ * @brief Check whether a GSI is wired to an I/O APIC pin
+ * @param gsi The GSI
+ */
+int ioapic_hasGSI(uint32_t gsi);
+
+#endif
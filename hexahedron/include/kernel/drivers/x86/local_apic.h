@@ -125,6 +125,13 @@ void lapic_acknowledge();
  */
 void lapic_sendNMI(uint8_t lapic_id, uint8_t irq_no);
 
+/**
+ * @brief Send a fixed interrupt to an APIC
+ * @param lapic_id The ID of the APIC
+ * @param vector The interrupt vector to send
+ */
+void lapic_sendIPI(uint8_t lapic_id, uint8_t vector);
+
 /**
  * @brief Send INIT signal
  * @param lapic_id The ID of the APIC
@@ -127,6 +127,20 @@ typedef struct acpi_madt_x2apic {
     uint32_t acpi_id;
 } acpi_madt_x2apic_t;
 
+typedef struct acpi_mcfg_entry {
+    uint64_t address;       // ECAM base address
+    uint16_t segment;       // PCI segment group
+    uint8_t bus_start;      // First bus decoded
+    uint8_t bus_end;        // Last bus decoded
+    uint32_t reserved;
+} __attribute__((packed)) acpi_mcfg_entry_t;
+
+typedef struct acpi_mcfg {
+    acpi_table_header_t header;     // MCFG header
+    uint64_t reserved;
+    acpi_mcfg_entry_t entries[];    // ECAM ranges
+} __attribute__((packed)) acpi_mcfg_t;
+
 /**** DEFINITIONS ****/
 
 #define MADT_LOCAL_APIC             0   // Single local processor
@@ -152,4 +166,10 @@ int minacpi_initialize();
  */
 smp_info_t *minacpi_parseMADT();
 
+/**
+ * @brief Find and parse the MCFG, registering its ECAM ranges with the PCI driver
+ * @returns The amount of ECAM ranges found
+ */
+int minacpi_parseMCFG();
+
 #endif
\ No newline at end of file
@@ -18,6 +18,7 @@
 /**** INCLUDES ****/
 #include <stdint.h>
 #include <kernel/drivers/serial.h>
+#include <kernel/misc/spinlock.h>
 
 /**** DEFINITIONS ****/
 
@@ -59,6 +60,51 @@
 
 #define SERIAL_FIFO_ENABLE              0x01 | 0x02 | 0x04 // Sets the first 3 bits to enable FIFO and clear receive/transmit
 
+#define SERIAL_INTENABLE_RX             0x01    // Received data available
+#define SERIAL_INTENABLE_THRE           0x02    // Transmitter holding register empty
+#define SERIAL_INTENABLE_LINE_STATUS    0x04    // Receiver line status
+
+#define SERIAL_IDENT_NONE               0x01    // No interrupt pending
+#define SERIAL_IDENT_MASK               0x0E    // Interrupt ID bits
+#define SERIAL_IDENT_MODEM_STATUS       0x00    // Modem status changed (cleared by reading MSR)
+#define SERIAL_IDENT_THRE               0x02    // Transmitter holding register empty (cleared by reading IIR)
+#define SERIAL_IDENT_RX                 0x04    // Received data available
+#define SERIAL_IDENT_LINE_STATUS        0x06    // Receiver line status (cleared by reading LSR)
+#define SERIAL_IDENT_RX_TIMEOUT         0x0C    // Character timeout (data in the FIFO below the trigger level)
+
+#define SERIAL_LINESTATUS_DATA_READY    0x01    // Data available in RBR
+#define SERIAL_LINESTATUS_THRE          0x20    // Transmitter holding register (FIFO) empty
+
+// IRQs
+#define SERIAL_COM1_IRQ                 4       // Shared with COM3
+#define SERIAL_COM2_IRQ                 3       // Shared with COM4
+
+// Buffering
+#define SERIAL_FIFO_SIZE                16      // Bytes the 16550 transmit FIFO takes per THRE interrupt
+#define SERIAL_TX_RING_SIZE             8192    // Transmit ring (power of two)
+#define SERIAL_WRITE_BATCH              64      // Bytes queued per lock hold by the write buffer method
+#define SERIAL_RX_RING_SIZE             1024    // Receive ring (power of two)
+
+/**** TYPES ****/
+
+/**
+ * @brief UART state, one per COM port (every serial_port_t of that COM port shares it)
+ */
+typedef struct serial_uart {
+    uint16_t io_address;                // I/O address
+    int irq;                            // Interrupts are enabled
+
+    spinlock_t lock;                    // Lock (taken with interrupts off)
+    uint32_t tx_head;                   // Next byte to write into the transmit ring
+    uint32_t tx_tail;                   // Next byte to move into the FIFO
+    uint32_t rx_head;                   // Next byte to write into the receive ring
+    uint32_t rx_tail;                   // Next byte to read from the receive ring
+    uint64_t rx_dropped;                // Received bytes dropped because the receive ring was full
+
+    uint8_t tx[SERIAL_TX_RING_SIZE];    // Transmit ring
+    uint8_t rx[SERIAL_RX_RING_SIZE];    // Receive ring
+} serial_uart_t;
+
 
 /**** FUNCTIONS ****/
 
@@ -87,6 +133,15 @@ int serial_setBaudRate(serial_port_t *device, uint16_t baudrate);
  */
 serial_port_t *serial_initializePort(int com_port, uint16_t baudrate);
 
+/**
+ * @brief Switch a port to interrupt-driven, ring-buffered I/O
+ * @param port The port
+ * @returns 0 on success, -EINVAL on a bad port
+ * 
+ * Until this is called (and whenever interrupts are disabled or the kernel panics) the port is polled.
+ */
+int serial_enableInterrupts(serial_port_t *port);
+
 /**
  * @brief Create serial port data
  * @param com_port The port to create the data from
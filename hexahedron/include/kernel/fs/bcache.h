@@ -0,0 +1,193 @@
+/**
+ * @file hexahedron/include/kernel/fs/bcache.h
+ * @brief Block buffer/page cache
+ *
+ * The block cache sits between block-backed filesystem nodes and their drivers.
+ * Drivers register a device with @c bcache_createDevice and then forward their VFS
+ * read/write calls to @c bcache_read and @c bcache_write.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_FS_BCACHE_H
+#define KERNEL_FS_BCACHE_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <kernel/mem/pmm.h>
+#include <kernel/misc/spinlock.h>
+
+/**** DEFINITIONS ****/
+
+#define BCACHE_PAGE_SIZE        PMM_BLOCK_SIZE  // Size of a single cache page
+#define BCACHE_HASH_SIZE        512             // Amount of hash buckets for cache lookups
+#define BCACHE_MAX_PAGES        4096            // Hard cap on cached pages (16 MB)
+#define BCACHE_LOW_WATERMARK    1024            // If the PMM has less free blocks than this, the cache will evict before growing
+#define BCACHE_DIRTY_THRESHOLD  256             // Amount of dirty pages before a write-back pass is forced
+#define BCACHE_PREFETCH_BATCH   16              // Maximum amount of pages prefetched in one run
+#define BCACHE_WRITEBACK_INTERVAL 1000          // Milliseconds between periodic write-backs of dirty pages
+#define BCACHE_RECLAIM_BATCH    64              // Pages given back per bcache_work pass while the PMM is low
+
+// Page flags
+#define BCACHE_PAGE_VALID       0x01            // Page contents were read from the device
+#define BCACHE_PAGE_DIRTY       0x02            // Page was modified and needs to be written back
+#define BCACHE_PAGE_REFERENCED  0x04            // Page was accessed since the clock hand last passed it
+#define BCACHE_PAGE_BUSY        0x08            // Page is being read in or written back (the cache lock is dropped meanwhile)
+
+/**** TYPES ****/
+
+/**
+ * @brief Block device I/O method
+ * @param dev The driver-specific device pointer given to @c bcache_createDevice
+ * @param block The first block to access
+ * @param count The amount of blocks to access
+ * @param buffer The buffer to read into/write from
+ * @returns 0 on success, anything else is an error
+ */
+typedef int (*bcache_io_t)(void *dev, uint64_t block, size_t count, uint8_t *buffer);
+
+/**
+ * @brief Cache statistics
+ */
+typedef struct bcache_stats {
+    uint64_t hits;              // Lookups that were served from the cache
+    uint64_t misses;            // Lookups that had to go to the device
+    uint64_t evictions;         // Pages evicted by the clock hand
+    uint64_t writebacks;        // Dirty pages written back to the device
+    uint64_t errors;            // Device I/O errors
+    uint64_t prefetched;        // Pages read in ahead of time by bcache_prefetch
+    uint64_t pages;             // Pages currently in the cache
+    uint64_t dirty;             // Dirty pages currently in the cache
+} bcache_stats_t;
+
+/**
+ * @brief Cached block device
+ */
+typedef struct bcache_device {
+    char *name;                 // Name of the device (for debugging)
+    void *dev;                  // Driver-specific device pointer, passed to read/write
+    size_t block_size;          // Block size of the device. Must divide BCACHE_PAGE_SIZE
+    uint64_t block_count;       // Amount of blocks on the device
+
+    bcache_io_t read;           // Read blocks method
+    bcache_io_t write;          // Write blocks method (can be NULL for read-only devices)
+
+    bcache_stats_t stats;       // Per-device statistics
+} bcache_device_t;
+
+/**
+ * @brief Cache page
+ */
+typedef struct bcache_page {
+    bcache_device_t *device;    // Owning device
+    uint64_t index;             // Page index on the device (offset / BCACHE_PAGE_SIZE)
+    uint8_t flags;              // Page flags
+    uint8_t *data;              // Page data
+
+    struct bcache_page *hash_next;  // Next page in the hash bucket
+    struct bcache_page *next;       // Next page in the clock ring
+    struct bcache_page *prev;       // Previous page in the clock ring
+} bcache_page_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Initialize the block cache
+ */
+void bcache_init();
+
+/**
+ * @brief Register a block device with the cache
+ * @param name The name of the device (for debugging)
+ * @param dev Driver-specific device pointer, passed to @p read and @p write
+ * @param block_size The block size of the device. Must divide @c BCACHE_PAGE_SIZE
+ * @param block_count Amount of blocks on the device
+ * @param read The read method of the device
+ * @param write The write method of the device, or NULL if read-only
+ * @returns A new cache device or NULL on bad arguments
+ */
+bcache_device_t *bcache_createDevice(char *name, void *dev, size_t block_size, uint64_t block_count, bcache_io_t read, bcache_io_t write);
+
+/**
+ * @brief Read from a cached device
+ * @param device The device to read from
+ * @param offset The byte offset to read at
+ * @param size The amount of bytes to read
+ * @param buffer The output buffer
+ * @returns The amount of bytes read
+ */
+ssize_t bcache_read(bcache_device_t *device, off_t offset, size_t size, uint8_t *buffer);
+
+/**
+ * @brief Write to a cached device
+ *
+ * Writes are buffered and written back on eviction, every @c BCACHE_WRITEBACK_INTERVAL ms (see @c bcache_work),
+ * on @c bcache_sync, or when too many pages are dirty.
+ *
+ * @param device The device to write to
+ * @param offset The byte offset to write at
+ * @param size The amount of bytes to write
+ * @param buffer The input buffer
+ * @returns The amount of bytes written
+ */
+ssize_t bcache_write(bcache_device_t *device, off_t offset, size_t size, uint8_t *buffer);
+
+/**
+ * @brief Prefetch a range of a cached device
+ *
+ * Pages that are not already cached are read in straight into their cache pages.
+ * Consecutive missing pages share a device request where their buffers are adjacent.
+ *
+ * @param device The device to prefetch on
+ * @param offset The byte offset to start at
+ * @param size The amount of bytes to prefetch
+ * @returns The amount of pages read in
+ */
+int bcache_prefetch(bcache_device_t *device, off_t offset, size_t size);
+
+/**
+ * @brief Check whether a range of a cached device has changes that aren't on the device yet
+ * @param device The device to check
+ * @param offset The byte offset of the range
+ * @param size The size of the range
+ * @returns 1 if any page in the range is dirty
+ */
+int bcache_isDirty(bcache_device_t *device, off_t offset, size_t size);
+
+/**
+ * @brief Write back all dirty pages
+ * @param device The device to write back, or NULL for every device
+ * @returns The amount of pages written back
+ */
+int bcache_sync(bcache_device_t *device);
+
+/**
+ * @brief Drop pages from the cache under memory pressure
+ * @param pages The amount of pages to try and free
+ * @returns The amount of pages freed
+ */
+int bcache_reclaim(size_t pages);
+
+/**
+ * @brief Periodic cache maintenance, run from the deferred work loop
+ *
+ * Writes back dirty pages every @c BCACHE_WRITEBACK_INTERVAL ms, and shrinks the cache
+ * while the PMM is under @c BCACHE_LOW_WATERMARK free blocks.
+ */
+void bcache_work();
+
+/**
+ * @brief Get cache statistics
+ * @param device The device to get statistics for, or NULL for the global statistics
+ * @param stats Output structure
+ */
+void bcache_getStats(bcache_device_t *device, bcache_stats_t *stats);
+
+#endif
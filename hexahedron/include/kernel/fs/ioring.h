@@ -0,0 +1,175 @@
+/**
+ * @file hexahedron/include/kernel/fs/ioring.h
+ * @brief Asynchronous VFS I/O ring
+ *
+ * Kernel subsystems batch I/O requests by filling submission queue entries (@c ioring_getSqe)
+ * and handing them off with @c ioring_submit. Results show up on the completion queue.
+ *
+ * Nodes with a @c submit method get the request directly and call @c ioring_complete whenever the
+ * I/O finishes (e.g. from their IRQ handler). Everything else goes through a synchronous shim built
+ * on @c fs_read / @c fs_write, so existing filesystems work unchanged.
+ *
+ * A ring has a single submitter. @c ioring_getSqe and @c ioring_submit don't lock the submission queue,
+ * so they must never run concurrently on the same ring - give every CPU or subsystem its own ring instead.
+ * Completions (@c ioring_complete) and reaping (@c ioring_getCqe) can happen anywhere.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_FS_IORING_H
+#define KERNEL_FS_IORING_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/misc/spinlock.h>
+
+/**** DEFINITIONS ****/
+
+#define IORING_MAX_ENTRIES      4096        // Maximum submission queue size
+
+// Opcodes
+#define IORING_OP_NOP           0           // Do nothing, just post a completion
+#define IORING_OP_READ          1           // Read into addr (length bytes)
+#define IORING_OP_WRITE         2           // Write from addr (length bytes)
+#define IORING_OP_READV         3           // Read into an iovec array at addr (length iovecs)
+#define IORING_OP_WRITEV        4           // Write from an iovec array at addr (length iovecs)
+
+/**** TYPES ****/
+
+/**
+ * @brief Submission queue entry
+ */
+typedef struct vfs_ioring_sqe {
+    uint8_t opcode;             // Operation
+    fs_node_t *node;            // Node to perform the operation on
+    off_t offset;               // Offset in the node
+    void *addr;                 // Buffer, or iovec array for vectored operations
+    size_t length;              // Buffer size, or amount of iovecs for vectored operations
+    uint64_t user_data;         // Passed back untouched in the completion
+} vfs_ioring_sqe_t;
+
+/**
+ * @brief Completion queue entry
+ */
+typedef struct vfs_ioring_cqe {
+    uint64_t user_data;         // user_data of the submission
+    ssize_t result;             // Bytes transferred or negative error code
+} vfs_ioring_cqe_t;
+
+/**
+ * @brief In-flight request, given to a node's submit method
+ */
+typedef struct vfs_io_request {
+    struct vfs_ioring *ring;        // Owning ring
+    vfs_ioring_sqe_t sqe;           // Copy of the submission
+    void *driver;                   // Free for use by the driver while the request is in flight
+    struct vfs_io_request *next;    // Next free request
+} vfs_io_request_t;
+
+/**
+ * @brief Ring statistics
+ */
+typedef struct vfs_ioring_stats {
+    uint64_t submitted;         // Requests submitted
+    uint64_t completed;         // Requests completed
+    uint64_t async;             // Requests accepted by a native submit method
+    uint64_t sync;              // Requests handled by the synchronous shim
+} vfs_ioring_stats_t;
+
+/**
+ * @brief I/O ring
+ */
+typedef struct vfs_ioring {
+    size_t entries;                 // Submission queue size (power of two)
+    size_t cq_entries;              // Completion queue size (power of two)
+
+    vfs_ioring_sqe_t *sq;           // Submission queue
+    volatile uint32_t sq_head;      // Next entry to submit
+    volatile uint32_t sq_tail;      // Next free entry
+
+    vfs_ioring_cqe_t *cq;           // Completion queue
+    volatile uint32_t cq_head;      // Next completion to reap
+    volatile uint32_t cq_tail;      // Next free completion
+
+    vfs_io_request_t *requests;     // Request pool
+    vfs_io_request_t *free;         // Free requests
+    volatile size_t inflight;       // Requests that have not completed yet
+
+    spinlock_t *lock;               // Protects the completion queue and request pool, taken with interrupts off
+    vfs_ioring_stats_t stats;       // Statistics
+} vfs_ioring_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Create a new I/O ring
+ * @param entries The submission queue size, rounded up to a power of two
+ * @returns A new ring or NULL on bad arguments
+ */
+vfs_ioring_t *ioring_create(size_t entries);
+
+/**
+ * @brief Destroy an I/O ring
+ * @param ring The ring to destroy
+ * @returns 0 on success, -EBUSY if requests are still in flight
+ */
+int ioring_destroy(vfs_ioring_t *ring);
+
+/**
+ * @brief Get a free submission queue entry
+ *
+ * The entry is zeroed. Fill it in and call @c ioring_submit once the batch is ready.
+ * Only the ring's submitter may call this.
+ *
+ * @param ring The ring
+ * @returns A submission queue entry or NULL if the queue is full
+ */
+vfs_ioring_sqe_t *ioring_getSqe(vfs_ioring_t *ring);
+
+/**
+ * @brief Submit every queued entry
+ *
+ * Submission stops early if the completion queue could overflow. Remaining entries stay queued.
+ * Only the ring's submitter may call this.
+ *
+ * @param ring The ring
+ * @returns The amount of entries submitted
+ */
+int ioring_submit(vfs_ioring_t *ring);
+
+/**
+ * @brief Complete a request
+ *
+ * Called by nodes that accepted a request in their submit method. Safe to call from IRQ context.
+ *
+ * @param request The request to complete
+ * @param result Bytes transferred or negative error code
+ */
+void ioring_complete(vfs_io_request_t *request, ssize_t result);
+
+/**
+ * @brief Reap a completion
+ * @param ring The ring
+ * @param cqe Output completion
+ * @returns 1 if a completion was reaped, 0 if none are available
+ */
+int ioring_getCqe(vfs_ioring_t *ring, vfs_ioring_cqe_t *cqe);
+
+/**
+ * @brief Wait for completions
+ * @param ring The ring
+ * @param count The amount of completions to wait for (bounded by what is in flight)
+ * @returns The amount of completions available
+ */
+size_t ioring_wait(vfs_ioring_t *ring, size_t count);
+
+#endif
@@ -19,6 +19,7 @@
 #include <stddef.h>
 #include <bits/dirent.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <structs/tree.h>
 
 
@@ -34,12 +35,19 @@
 #define VFS_MOUNTPOINT      0x40
 #define VFS_SOCKET          0x80
 
+// Read-ahead tuning
+#define VFS_READAHEAD_MIN       (16 * 1024)     // Initial read-ahead window
+#define VFS_READAHEAD_MAX       (128 * 1024)    // Maximum read-ahead window (the window doubles on every sequential pass)
+
 
 /**** TYPES ****/
 
 // Node prototype
 struct fs_node;
 
+// Asynchronous request prototype (see kernel/fs/ioring.h)
+struct vfs_io_request;
+
 // These are the types of operations that can be performed on an inode.
 // Sourced from the POSIX standard (tweaked to use fs_node rather than fd)
 typedef void (*open_t)(struct fs_node*, unsigned int oflag); // oflag can be sourced from fcntl.h
@@ -55,6 +63,25 @@ typedef int (*unlink_t)(struct fs_node *, char *);
 typedef int (*readlink_t)(struct fs_node *, char *, size_t);
 typedef int (*ioctl_t)(struct fs_node*, unsigned long, void *);
 typedef int (*symlink_t)(struct fs_node*, char *, char *);
+typedef int (*readahead_t)(struct fs_node*, off_t, size_t);
+typedef int (*submit_t)(struct fs_node*, struct vfs_io_request*);
+
+// Per-open-file read-ahead state
+typedef struct vfs_readahead {
+    off_t next;             // Offset the next sequential read is expected at
+    off_t end;              // End of the range that has already been prefetched
+    size_t window;          // Current read-ahead window (0 if not streaming)
+    uint64_t reads;         // Reads made through this node
+    uint64_t hits;          // Reads that were fully covered by a previous prefetch
+} vfs_readahead_t;
+
+// Global read-ahead statistics
+typedef struct vfs_readahead_stats {
+    uint64_t reads;         // Reads made through nodes supporting read-ahead
+    uint64_t hits;          // Reads that were fully covered by a previous prefetch
+    uint64_t prefetches;    // Prefetch requests issued
+    uint64_t bytes;         // Bytes requested by prefetches
+} vfs_readahead_stats_t;
 
 
 // Inode structure
@@ -87,11 +114,15 @@ typedef struct fs_node {
     ioctl_t ioctl;          // I/O control function
     readlink_t readlink;    // Readlink function
     symlink_t symlink;      // Symlink function
+    readahead_t readahead;  // Read-ahead hint function (optional, prefetches into a cache)
+    submit_t submit;        // Asynchronous I/O submission function (optional, see ioring_complete)
 
     // Last file stuff
     struct fs_node *ptr;    // Used by mountpoints and symlinks
     int64_t refcount;       // Reference count on the file
     void *dev;              // Device structure
+
+    vfs_readahead_t ra;     // Read-ahead state (per open file, see kopen)
 } fs_node_t;
 
 // Hexahedron uses a mount callback system that works similar to interrupt handlers.
@@ -153,6 +184,41 @@ ssize_t fs_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
  */
 ssize_t fs_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
 
+/**
+ * @brief Vectored read call
+ * @param node The node to read from
+ * @param offset The offset to start reading at
+ * @param iov The buffers to read into, filled in order
+ * @param iovcnt The amount of buffers
+ * @returns The total amount of bytes read, or -EINVAL on bad arguments
+ */
+ssize_t fs_readv(fs_node_t *node, off_t offset, struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Vectored write call
+ * @param node The node to write to
+ * @param offset The offset to start writing at
+ * @param iov The buffers to write from, consumed in order
+ * @param iovcnt The amount of buffers
+ * @returns The total amount of bytes written, or -EINVAL on bad arguments
+ */
+ssize_t fs_writev(fs_node_t *node, off_t offset, struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Read-ahead hint call
+ * @param node The node to prefetch on
+ * @param offset The offset to start prefetching at
+ * @param size The amount of bytes to prefetch
+ * @returns 0 on success, -ENOTSUP if the node has no read-ahead method
+ */
+int fs_readahead(fs_node_t *node, off_t offset, size_t size);
+
+/**
+ * @brief Get read-ahead statistics
+ * @param stats Output structure
+ */
+void vfs_getReadaheadStats(vfs_readahead_stats_t *stats);
+
 /**
  * @brief Read directory
  * @param node The node to read the directory of
@@ -19,12 +19,38 @@
 #include <kernel/drivers/font.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
 
 /**** DEFINITIONS ****/
 
 #define TERMINAL_DEFAULT_FG     RGB(255, 255, 255)  // White
 #define TERMINAL_DEFAULT_BG     RGB(0, 0, 0)        // Black
 
+#define TERMINAL_GLYPH_COUNT    256                 // Amount of glyphs in a glyph cache
+#define TERMINAL_GLYPH_CACHES   4                   // Amount of fg/bg pairs with rendered glyphs
+
+/**** TYPES ****/
+
+/**
+ * @brief Character cell
+ */
+typedef struct terminal_cell {
+    uint8_t c;                  // Character
+    color_t fg;                 // Foreground
+    color_t bg;                 // Background
+} terminal_cell_t;
+
+/**
+ * @brief Glyph cache (every glyph pre-rendered in one fg/bg pair)
+ */
+typedef struct terminal_glyph_cache {
+    uint32_t fg;                                    // Foreground pixel
+    uint32_t bg;                                    // Background pixel
+    uint64_t last_used;                             // Use counter at the last lookup, 0 if the cache is unused
+    uint32_t rendered[TERMINAL_GLYPH_COUNT / 32];   // Bitmap of rendered glyphs
+    uint32_t *glyphs;                               // Glyphs (font width * height pixels each)
+} terminal_glyph_cache_t;
+
 /**** FUNCTIONS ****/
 
 /**
@@ -44,6 +70,16 @@ int terminal_putchar(int c);
  */
 int terminal_print(void *user, int c);
 
+/**
+ * @brief Write method (printf-conforming)
+ */
+int terminal_write(void *user, const char *buffer, size_t length);
+
+/**
+ * @brief Flush terminal output to the screen
+ */
+void terminal_flush();
+
 /**
  * @brief Clear terminal screen
  * @param fg The foreground of the terminal
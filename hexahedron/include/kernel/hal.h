@@ -15,8 +15,21 @@
 #ifndef KERNEL_HAL_H
 #define KERNEL_HAL_H
 
+/**** INCLUDES ****/
+#include <stdint.h>
+
 /**** TYPES ****/
 
+/**
+ * @brief Interrupt statistics (per CPU, per interrupt)
+ */
+typedef struct hal_interrupt_stats {
+    uint64_t count;                 // Interrupts received
+    uint64_t unclaimed;             // Interrupts no handler claimed
+    uint64_t cycles;                // TSC cycles spent in handlers
+    uint64_t max_cycles;            // Slowest run through the handlers, in TSC cycles
+} hal_interrupt_stats_t;
+
 struct _registers;
 struct _extended_registers;
 
@@ -26,6 +39,20 @@ struct _extended_registers;
  */
 extern struct _registers *hal_getRegisters();
 
+/**
+ * @brief Get the interrupt statistics of a CPU
+ * @param cpu The CPU
+ * @param int_no The interrupt number
+ * @returns The statistics or NULL if either is out of range
+ */
+hal_interrupt_stats_t *hal_getInterruptStats(int cpu, uintptr_t int_no);
+
+/**
+ * @brief Get the amount of handlers registered on an interrupt
+ * @param int_no The interrupt number
+ */
+int hal_getInterruptHandlerCount(uintptr_t int_no);
+
 
 
 #endif
\ No newline at end of file
@@ -17,6 +17,7 @@
 /**** INCLUDES ****/
 #include <stdint.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/loader/elf_loader.h>
 
 /**** TYPES ****/
 
@@ -56,6 +57,9 @@ typedef struct loaded_driver {
     int environment;                // Driver environment
     uintptr_t load_address;         // Driver load address
     ssize_t size;                   // Size of the driver in memory    
+    uint64_t load_time;             // Time spent reading and relocating the driver (microseconds)
+    uint64_t init_time;             // Time spent in the init function of the driver (microseconds)
+    elf_load_stats_t elf_stats;     // Relocation and symbol lookup statistics of the driver
 } loaded_driver_t;
 
 /**** DEFINITIONS ****/
@@ -78,6 +82,9 @@ typedef struct loaded_driver {
 // IMPORTANT: Current version of the Hexahedron driver loader
 #define DRIVER_CURRENT_VERSION          1
 
+// Maximum amount of dependencies a driver can declare (via the optional "depends" array in the driver JSON)
+#define DRIVER_MAX_DEPENDENCIES         8
+
 /**** FUNCTIONS ****/
 
 /**
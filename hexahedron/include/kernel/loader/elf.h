@@ -160,8 +160,10 @@
 #define SHT_SYMTAB      2   
 #define SHT_STRTAB      3
 #define SHT_RELA        4
+#define SHT_HASH        5
 #define SHT_NOBITS      8
 #define SHT_REL         9
+#define SHT_DYNSYM      11
 
 /* Symbol binding */
 #define STB_LOCAL 	0
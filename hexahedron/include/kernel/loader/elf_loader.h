@@ -26,6 +26,29 @@
 
 #define ELF_FAIL    (uintptr_t)1       // Ugliest value ever...
 
+/**** TYPES ****/
+
+// Load statistics of an ELF file
+typedef struct elf_load_stats {
+    uint32_t relocations;       // Relocations processed
+    uint32_t cache_hits;        // Symbol resolutions served from the per-load cache
+    uint32_t cache_misses;      // Symbols actually resolved (once per symbol)
+    uint32_t symbols;           // Symbols in the lookup index
+    uint32_t hash_section;      // 1 if the index is the file's own hash section
+} elf_load_stats_t;
+
+// Symbol lookup index of a loaded ELF file (SysV hash layout)
+typedef struct elf_symbol_index {
+    uintptr_t ehdr;                     // File the index belongs to
+    int table;                          // Section index of the indexed symbol table
+    uint32_t nbucket;                   // Amount of buckets
+    uint32_t *buckets;                  // Bucket heads (symbol indices, 0 terminates)
+    uint32_t *chains;                   // Next symbol index in the same bucket
+    int owned;                          // Whether buckets/chains were allocated by the loader
+    elf_load_stats_t stats;             // Load statistics
+    struct elf_symbol_index *next;      // Next index
+} elf_symbol_index_t;
+
 /**** FUNCTIONS ****/
 
 /**
@@ -61,6 +84,14 @@ uintptr_t elf_loadBuffer(uint8_t *fbuf, int flags);
  */
 uintptr_t elf_load(fs_node_t *node, int flags);
 
+/**
+ * @brief Get the load statistics of an ELF file
+ * @param elf_address The address given by @c elf_load or another loading function
+ * @param stats Output structure
+ * @returns 0 on success, -1 if the file was not loaded by the ELF loader
+ */
+int elf_getLoadStats(uintptr_t elf_address, elf_load_stats_t *stats);
+
 /**
  * @brief Cleanup an ELF file after it has finished executing
  * @param elf_address The address given by @c elf_load or another loading function
@@ -44,6 +44,8 @@
 #define MEM_NOALLOC             0x40    // Do not allocate the page and instead use what was given
 #define MEM_FREE_PAGE           0x80    // Free the page. Sets it to zero if specified in mem_allocatePage
 #define MEM_NO_EXECUTE         0x100    // (x86_64 only) Set the page as non-executable.
+#define MEM_WRITECOMBINE       0x200    // The page is write-combining (uncacheable if the CPU can't do that)
+#define MEM_GLOBAL             0x400    // (x86_64 only) The page is mapped the same in every directory and survives switches
 
 /**** FUNCTIONS ****/
 
@@ -18,6 +18,10 @@
 #include <stdint.h>
 #include <kernel/fs/vfs.h>
 
+/**** DEFINITIONS ****/
+
+#define KSYM_HASHMAP_SIZE       2048    // Buckets in the symbol hashmap (the kernel exports a few thousand symbols)
+
 /**** TYPES ****/
 
 
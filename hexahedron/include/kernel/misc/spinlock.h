@@ -49,6 +49,12 @@ void spinlock_destroy(spinlock_t *spinlock);
  */
 void spinlock_acquire(spinlock_t *spinlock);
 
+/**
+ * @brief Try to lock a spinlock without spinning
+ * @returns 1 if the lock was acquired, 0 if someone else holds it
+ */
+int spinlock_tryAcquire(spinlock_t *spinlock);
+
 /**
  * @brief Release a spinlock
  */
@@ -34,9 +34,16 @@
 #include <kernel/fs/vfs.h>
 #include <kernel/fs/tarfs.h>
 #include <kernel/fs/ramdev.h>
+#include <kernel/fs/bcache.h>
+
+// Graphics
+#include <kernel/drivers/video.h>
+#include <kernel/drivers/font.h>
+#include <kernel/gfx/term.h>
 
 // Misc.
 #include <kernel/misc/ksym.h>
+#include <kernel/drivers/usb/usb.h>
 #include <kernel/misc/args.h>
 
 
@@ -84,6 +91,34 @@ void kernel_mountRamdisk(generic_parameters_t *parameters) {
     printf("Mounted initial ramdisk successfully\n");
 }
 
+/**
+ * @brief Load the console font from the initial ramdisk
+ * 
+ * The backup font is only a fallback. Use --font=<path> to pick another font.
+ */
+void kernel_loadFont() {
+    char *path = kargs_has("--font") ? kargs_get("--font") : FONT_DEFAULT_LOCATION;
+
+    fs_node_t *font_file = kopen(path, O_RDONLY);
+    if (!font_file) {
+        LOG(INFO, "No console font at %s\n", path);
+        return;
+    }
+
+    int ret = font_loadPSF(font_file);
+    fs_close(font_file);
+
+    if (ret) {
+        LOG(WARN, "Failed to load console font %s (error %i)\n", path, ret);
+        return;
+    }
+
+    // The cell size changed, so the terminal starts over
+    if (video_getDriver()) {
+        terminal_init(terminal_getForeground(), terminal_getBackground());
+    }
+}
+
 /**
  * @brief Load kernel drivers
  */
@@ -118,12 +153,18 @@ void kmain() {
     // Now, initialize the VFS.
     vfs_init();
 
+    // Initialize the block cache
+    bcache_init();
+
     // Startup the builtin filesystem drivers    
     tarfs_init();
 
     // Now we need to mount the initial ramdisk
     kernel_mountRamdisk(parameters);
 
+    // Catch up on the log (the clock tick only writes out a few records at a time)
+    debug_drainLog();
+
     // Load symbols
     fs_node_t *symfile = kopen("/device/initrd/hexahedron-kernel-symmap.map", O_RDONLY);
     if (!symfile) {
@@ -136,6 +177,12 @@ void kmain() {
 
     LOG(INFO, "Loaded %i symbols from symbol map\n", symbols);
 
+    // Load the console font
+    kernel_loadFont();
+
+    // Measure the printf engine
+    if (kargs_has("--printf-bench")) debug_benchmarkFormatting();
+
     // Load drivers
     if (!kargs_has("--no-load-drivers")) {
         kernel_loadDrivers();
@@ -143,6 +190,15 @@ void kmain() {
         LOG(WARN, "Not loading any drivers, found argument \"--no-load-drivers\".\n");
     }
 
+    // There are no kernel threads yet, so from here on the boot CPU runs deferred work (USB enumeration, block cache write-back, log output)
+    LOG(INFO, "Boot finished, running deferred work\n");
+    for (;;) {
+        usb_work();
+        bcache_work();
+        debug_drainLog();
+        arch_pause();
+    }
+
 
 
 }
\ No newline at end of file
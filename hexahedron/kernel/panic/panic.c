@@ -55,11 +55,11 @@
 int kernel_in_panic_state = 0;
 
 /**
- * @brief xvas_callback
+ * @brief xvas_write_callback
  */
-static int kernel_panic_putchar(void *user, char ch) {
-    dprintf(NOHEADER, "%c", ch);
-    printf("%c", ch);
+static int kernel_panic_write(void *user, const char *buffer, size_t length) {
+    dprintf(NOHEADER, "%.*s", (int)length, buffer);
+    printf("%.*s", (int)length, buffer);
     return 0;
 }
 
@@ -99,6 +99,9 @@ void kernel_panic_extended(uint32_t bugcode, char *module, char *format, ...) {
 
     kernel_in_panic_state = 1;
 
+    // Get anything still queued in the log rings out first
+    debug_flushLog();
+
     // Prepare for the panic
     arch_panic_prepare();
 
@@ -112,10 +115,12 @@ void kernel_panic_extended(uint32_t bugcode, char *module, char *format, ...) {
     
     // Print out anything additional
     char additional[512];
-    va_list ap;
+    va_list ap, ap_copy;
     va_start(ap, format);
-    xvasprintf(kernel_panic_putchar, NULL, format, ap);
-    vsnprintf(additional, 512, format, ap);
+    va_copy(ap_copy, ap);
+    xvasprintf_write(kernel_panic_write, NULL, format, ap);
+    vsnprintf(additional, 512, format, ap_copy);
+    va_end(ap_copy);
     va_end(ap);
 
    
@@ -152,6 +157,9 @@ void kernel_panic(uint32_t bugcode, char *module) {
     }
 
     kernel_in_panic_state = 1;
+
+    // Get anything still queued in the log rings out first
+    debug_flushLog();
     
     // Prepare for the panic
     arch_panic_prepare();
@@ -189,6 +197,9 @@ void kernel_panic_prepare(uint32_t bugcode) {
 
     kernel_in_panic_state = 1;
 
+    // Get anything still queued in the log rings out first
+    debug_flushLog();
+
     // Do arch-specific panic preparation
     arch_panic_prepare();
 
@@ -13,6 +13,15 @@
  * 
  * This field should be named 'driver_metadata' and be publicly exposed. It will be looked up by the ELF loader.
  * 
+ * Drivers can also declare dependencies (the "depends" array of filenames in the JSON). The loader
+ * loads the configuration in waves: every driver whose dependencies have all finished loading is part of
+ * the next wave, and a driver whose dependency failed is not loaded at all. Load and init times are recorded
+ * per driver, and the boot critical path through the dependency graph is logged once loading finishes.
+ * 
+ * The drivers of a wave are handed out to idle APs, the BSP loads one itself whenever none are free.
+ * Reading and relocating drivers is serialized by the load lock, init functions run concurrently.
+ * The --serial-drivers boot argument keeps everything on the BSP.
+ * 
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
  * It is released under the terms of the BSD 3-clause license.
@@ -26,23 +35,68 @@
 #include <kernel/mem/alloc.h>
 #include <kernel/mem/mem.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/drivers/clock.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
+#include <kernel/misc/spinlock.h>
+#include <kernel/misc/args.h>
 #include <structs/json.h>
 #include <structs/json-builder.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
 
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/smp.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/smp.h>
+#endif
+
 /* List of drivers */
 list_t *driver_list = NULL;
 
 /* Current environment */
 int driver_current_environment = DRIVER_ENVIRONMENT_PRELOAD;
 
+/* Load lock. Drivers are sized by how far they moved mem_driverRegion, so mapping and relocating can't overlap */
+static spinlock_t driver_load_lock = { 0 };
+
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "DRIVER", __VA_ARGS__)
 
+/* Configuration entry states */
+#define DRIVER_ENTRY_PENDING    0
+#define DRIVER_ENTRY_LOADED     1
+#define DRIVER_ENTRY_FAILED     2
+
+/* Configuration entry (only used while loading the configuration) */
+typedef struct driver_entry {
+    char *filename;                             // Filename of the driver
+    int priority;                               // Driver priority
+    int environment;                            // Driver environment
+    int state;                                  // Entry state
+    int dependency_count;                       // Amount of dependencies
+    int dependencies[DRIVER_MAX_DEPENDENCIES];  // Indices of the dependencies in the entry array
+    uint64_t finish_time;                       // Length of the longest dependency chain ending in this driver (microseconds)
+} driver_entry_t;
+
+/* A configuration entry being loaded by some CPU during a wave */
+typedef struct driver_job {
+    driver_entry_t *entries;                    // The entry array
+    int index;                                  // Index of the entry to load
+    int result;                                 // Result of driver_loadEntry
+    int done;                                   // Set once the job has finished
+} driver_job_t;
+
+/**
+ * @brief Get the current time for load statistics
+ * @returns Microseconds or 0 if the clock isn't ready yet
+ */
+static uint64_t driver_getTime() {
+    if (!clock_isReady()) return 0;
+    return clock_getDevice().get_timer();
+}
+
 
 /**
  * @brief Find a driver by name and return data on it
@@ -115,9 +169,13 @@ static void driver_handleLoadError(int priority, char *error, char *file) {
  * @param file The driver filename
  * @param argc Argument count
  * @param argv Argument data
- * @returns 0 on success, anything else is a failure/panic
+ * @returns The loaded driver or NULL on failure
  */
-int driver_load(fs_node_t *driver_file, int priority, int environment, char *file, int argc, char **argv) {
+static loaded_driver_t *driver_loadImage(fs_node_t *driver_file, int priority, int environment, char *file, int argc, char **argv) {
+    uint64_t start_time = driver_getTime();
+
+    spinlock_acquire(&driver_load_lock);
+
     // First we have to map the driver into memory. The mem subsystem provides functions for this.
     uintptr_t driver_load_address = mem_mapDriver(driver_file->length);
     memset((void*)driver_load_address, 0, driver_file->length);
@@ -125,28 +183,31 @@ int driver_load(fs_node_t *driver_file, int priority, int environment, char *fil
     // Now we can read the file into this address
     if (fs_read(driver_file, 0, driver_file->length, (uint8_t*)driver_load_address) != (ssize_t)driver_file->length) {
         // Uh oh, read error.
-        driver_handleLoadError(priority, "Read error", file);
         mem_unmapDriver(driver_load_address, driver_file->length);
-        return -1;
+        spinlock_release(&driver_load_lock);
+        driver_handleLoadError(priority, "Read error", file);
+        return NULL;
     }
 
     // Load from buffer
     uintptr_t elf = elf_loadBuffer((uint8_t*)driver_load_address, ELF_DRIVER);
     if (elf == 0x0) {
         // Load failed
-        driver_handleLoadError(priority, "ELF load error (check to make sure architecture matches)", file);
         mem_unmapDriver(driver_load_address, driver_file->length);
-        return -1;
+        spinlock_release(&driver_load_lock);
+        driver_handleLoadError(priority, "ELF load error (check to make sure architecture matches)", file);
+        return NULL;
     }
 
     // Find the metadata
     struct driver_metadata *metadata = (struct driver_metadata*)elf_findSymbol(elf, "driver_metadata");
     if (!metadata) {
         // No metadata
-        driver_handleLoadError(priority, "No driver metadata (checked for driver_metadata symbol)", file);
         elf_cleanup(elf);
         mem_unmapDriver(driver_load_address, driver_file->length);
-        return -1;
+        spinlock_release(&driver_load_lock);
+        driver_handleLoadError(priority, "No driver metadata (checked for driver_metadata symbol)", file);
+        return NULL;
     }
 
     // Construct a bit of list data first
@@ -168,40 +229,66 @@ extern uintptr_t mem_driverRegion;  // !!!: BAD!!!!
     loaded_driver->environment = environment;
     loaded_driver->load_address = driver_load_address;
     loaded_driver->size = driver_loaded_size;
+    elf_getLoadStats(elf, &loaded_driver->elf_stats);
 
     // Set in list
     list_append(driver_list, (void*)loaded_driver);
+    spinlock_release(&driver_load_lock);
+    loaded_driver->load_time = driver_getTime() - start_time;
     
     // Now we need to execute the driver. Let's go!
+    uint64_t init_start_time = driver_getTime();
     int loadstatus = metadata->init(argc, argv);
+    loaded_driver->init_time = driver_getTime() - init_start_time;
     
     if (loadstatus) {
         // Didn't return 0 - cleanup.
         driver_handleLoadError(priority, "Init function did not return 0", file);
+
+        spinlock_acquire(&driver_load_lock);
         elf_cleanup(elf);
         list_delete(driver_list, list_find(driver_list, (void*)loaded_driver)); // Will this cause issues?
+        mem_unmapDriver(driver_load_address, driver_file->length);
+        spinlock_release(&driver_load_lock);
+
         kfree(loaded_driver->metadata);
         kfree(loaded_driver->filename);
         kfree(loaded_driver);
-        mem_unmapDriver(driver_load_address, driver_file->length);
-        return -1;
+        return NULL;
     }
 
 
     printf("Loaded driver '%s' successfully.\n", metadata->name);
+    LOG(DEBUG, "Driver '%s': load %i us, init %i us, %i relocations (%i symbols resolved, %i cached)\n", metadata->name, (int)loaded_driver->load_time, (int)loaded_driver->init_time,
+                loaded_driver->elf_stats.relocations, loaded_driver->elf_stats.cache_misses, loaded_driver->elf_stats.cache_hits);
 
     // Load success!
-    return 0;
+    return loaded_driver;
+}
+
+/**
+ * @brief Load a driver into memory and start it
+ * @param driver_file The driver file
+ * @param priority The priority of the driver file
+ * @param environment The environment of the driver file
+ * @param file The driver filename
+ * @param argc Argument count
+ * @param argv Argument data
+ * @returns 0 on success, anything else is a failure/panic
+ */
+int driver_load(fs_node_t *driver_file, int priority, int environment, char *file, int argc, char **argv) {
+    return driver_loadImage(driver_file, priority, environment, file, argc, argv) ? 0 : -1;
 }
 
 
 /**
- * @brief Read a field in the JSON driver object
+ * @brief Find a field in the JSON driver object
  * @param object The object to check
  * @param field The field to look for
- * @returns The value of the field or NULL 
+ * @param expected_type The type the field should have
+ * @returns The value of the field or NULL if it isn't present
  */
-static json_value *driver_getField(json_value *object, char * field, json_type expected_type) {
+static json_value *driver_findField(json_value *object, char *field, json_type expected_type) {
     if (object->type != json_object) return NULL;
 
     for (unsigned int i = 0; i < object->u.object.length; i++) {
@@ -221,11 +308,115 @@ static json_value *driver_getField(json_value *object, char * field, json_type e
         }
     }
 
+    return NULL;
+}
+
+/**
+ * @brief Read a field in the JSON driver object
+ * @param object The object to check
+ * @param field The field to look for
+ * @returns The value of the field or NULL 
+ */
+static json_value *driver_getField(json_value *object, char * field, json_type expected_type) {
+    json_value *obj = driver_findField(object, field, expected_type);
+    if (obj) return obj;
 
     kernel_panic_extended(DRIVER_LOADER_ERROR, "driver", "*** Could not find field '%s' in driver JSON\n", field);
     __builtin_unreachable();
 }
 
+/**
+ * @brief Load a single configuration entry
+ * @param entries The entry array
+ * @param index The index of the entry to load
+ * @returns 0 on success
+ */
+static int driver_loadEntry(driver_entry_t *entries, int index) {
+    driver_entry_t *entry = &entries[index];
+
+    // Don't bother if something we need isn't there
+    uint64_t dependency_time = 0;
+    for (int i = 0; i < entry->dependency_count; i++) {
+        driver_entry_t *dependency = &entries[entry->dependencies[i]];
+        if (dependency->state == DRIVER_ENTRY_FAILED) {
+            driver_handleLoadError(entry->priority, "A dependency failed to load", entry->filename);
+            return -1;
+        }
+
+        if (dependency->finish_time > dependency_time) dependency_time = dependency->finish_time;
+    }
+
+    // Construct the full filename
+    char full_filename[256];
+    snprintf(full_filename, 256, "%s%s", DRIVER_DEFAULT_PATH, entry->filename);
+
+    // Try to open the driver
+    LOG(INFO, "Loading driver \"%s\" with priority %i (expected environment %i)...\n", full_filename, entry->priority, entry->environment);
+    
+    fs_node_t *driver_file = kopen(full_filename, O_RDONLY);
+    if (!driver_file) {
+        driver_handleLoadError(entry->priority, "File not found", entry->filename);
+        return -1;
+    }
+
+    char *arguments[] = { entry->filename }; // by default just filename
+
+    // Load the driver
+    loaded_driver_t *loaded_driver = driver_loadImage(driver_file, entry->priority, entry->environment, entry->filename, 1, arguments);
+    fs_close(driver_file);
+    if (!loaded_driver) return -1;
+
+    entry->finish_time = dependency_time + loaded_driver->load_time + loaded_driver->init_time;
+    return 0;
+}
+
+/**
+ * @brief Run a driver job (on whichever CPU it was handed to)
+ * @param data The @c driver_job_t
+ */
+static void driver_runJob(void *data) {
+    driver_job_t *job = (driver_job_t*)data;
+    job->result = driver_loadEntry(job->entries, job->index);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Load a wave of independent drivers, using every idle CPU
+ * @param jobs The jobs of the wave
+ * @param count The amount of jobs
+ */
+static void driver_loadWave(driver_job_t *jobs, int count) {
+    int cpus = 1;
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    if (!kargs_has("--serial-drivers")) cpus = smp_getCPUCount();
+#endif
+
+    int next = 0;
+    while (next < count) {
+        // Hand out as many jobs as there are idle APs
+        int dispatched = 0;
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+        for (int cpu = 1; cpu < cpus && next < count; cpu++) {
+            if (smp_runOnCPU(cpu, driver_runJob, &jobs[next]) == 0) {
+                next++;
+                dispatched = 1;
+            }
+        }
+#endif
+
+        // Nobody was free, so do one ourselves
+        if (!dispatched && next < count) driver_runJob(&jobs[next++]);
+    }
+
+    // Wait for the APs to finish, writing out what they log meanwhile
+    for (int i = 0; i < count; i++) {
+        while (!__atomic_load_n(&jobs[i].done, __ATOMIC_ACQUIRE)) {
+            debug_drainLog();
+            asm volatile ("pause" ::: "memory");
+        }
+    }
+}
+
 /**
  * @brief Load and parse a JSON file containing driver information
  * @param file The file to parse
@@ -251,7 +442,7 @@ int driver_loadConfiguration(fs_node_t *file) {
     char error[128];
     json_value *json_data = json_parse_ex(&settings, (char*)data, file->length, error);
 
-    if (!data) {
+    if (!json_data) {
         kernel_panic_extended(DRIVER_LOADER_ERROR, "driver", "*** Failed to parse JSON data of driver configuration file: %s\n", error);
         __builtin_unreachable();
     }
@@ -266,10 +457,13 @@ int driver_loadConfiguration(fs_node_t *file) {
 
     // Now get the drivers array
     json_value *drivers_array = driver_getField(json_data, "drivers", json_array);
+    int entry_count = (int)drivers_array->u.array.length;
 
-    // We can start parsing the JSON contents now
-    int drivers = 0;
-    for (int i = 0; i < (int)drivers_array->u.array.length; i++) {
+    driver_entry_t *entries = kmalloc(sizeof(driver_entry_t) * (entry_count ? entry_count : 1));
+    memset(entries, 0, sizeof(driver_entry_t) * (entry_count ? entry_count : 1));
+
+    // Parse every entry first, dependencies can refer to drivers further down the array
+    for (int i = 0; i < entry_count; i++) {
         json_value *driver = drivers_array->u.array.values[i];
         
         if (!driver || driver->type != json_object) {
@@ -277,44 +471,110 @@ int driver_loadConfiguration(fs_node_t *file) {
             __builtin_unreachable();
         }
 
-        // Get the filename field
-        json_value *filename_obj = driver_getField(driver, "filename", json_string);
-        char *filename = filename_obj->u.string.ptr;
+        entries[i].filename = driver_getField(driver, "filename", json_string)->u.string.ptr;
+        entries[i].priority = driver_getField(driver, "priority", json_integer)->u.integer;
+        entries[i].environment = driver_getField(driver, "environment", json_integer)->u.integer;
+        entries[i].state = DRIVER_ENTRY_PENDING;
+    }
+
+    // Resolve dependencies
+    for (int i = 0; i < entry_count; i++) {
+        json_value *depends = driver_findField(drivers_array->u.array.values[i], "depends", json_array);
+        if (!depends) continue;
 
-        // Get the priority field
-        json_value *priority_obj = driver_getField(driver, "priority", json_integer);
-        int priority = priority_obj->u.integer;
+        for (unsigned int d = 0; d < depends->u.array.length; d++) {
+            json_value *name = depends->u.array.values[d];
+            if (!name || name->type != json_string) {
+                kernel_panic_extended(DRIVER_LOADER_ERROR, "driver", "*** Corrupted dependency of driver '%s'\n", entries[i].filename);
+                __builtin_unreachable();
+            }
 
-        // Get the environment field
-        json_value *environment_obj = driver_getField(driver, "environment", json_integer);
-        int environment = environment_obj->u.integer;
+            int found = -1;
+            for (int j = 0; j < entry_count; j++) {
+                if (j != i && !strcmp(entries[j].filename, name->u.string.ptr)) {
+                    found = j;
+                    break;
+                }
+            }
 
-        // Construct the full filename
-        char full_filename[256];
-        snprintf(full_filename, 256, "%s%s", DRIVER_DEFAULT_PATH, filename);
+            if (found < 0 || entries[i].dependency_count >= DRIVER_MAX_DEPENDENCIES) {
+                LOG(ERR, "Driver '%s' has an unresolvable dependency '%s'\n", entries[i].filename, name->u.string.ptr);
+                driver_handleLoadError(entries[i].priority, "Unresolvable dependency", entries[i].filename);
+                entries[i].state = DRIVER_ENTRY_FAILED;
+                break;
+            }
 
-        // Try to open the driver
-        LOG(INFO, "Loading driver \"%s\" with priority %i (expected environment %i)...\n", full_filename, priority, environment);
-        
-        fs_node_t *driver_file = kopen(full_filename, O_RDONLY);
-        if (!driver_file) {
-            driver_handleLoadError(priority, "File not found", filename);
-        } else {
-            char *arguments[] = { filename }; // by default just filename
-
-            // Load the driver
-            if (driver_load(driver_file, priority, environment, filename, 1, arguments) == 0) {
+            entries[i].dependencies[entries[i].dependency_count++] = found;
+        }
+    }
+
+    // Load in waves. Each wave contains every driver whose dependencies have finished.
+    int drivers = 0;
+    int remaining = 0;
+    for (int i = 0; i < entry_count; i++) if (entries[i].state == DRIVER_ENTRY_PENDING) remaining++;
+
+    driver_job_t *jobs = kmalloc(sizeof(driver_job_t) * (entry_count ? entry_count : 1));
+    uint64_t start_time = driver_getTime();
+    int wave = 0;
+    while (remaining) {
+        int ready_count = 0;
+
+        for (int i = 0; i < entry_count; i++) {
+            if (entries[i].state != DRIVER_ENTRY_PENDING) continue;
+
+            int blocked = 0;
+            for (int d = 0; d < entries[i].dependency_count; d++) {
+                if (entries[entries[i].dependencies[d]].state == DRIVER_ENTRY_PENDING) blocked = 1;
+            }
+
+            if (!blocked) {
+                jobs[ready_count].entries = entries;
+                jobs[ready_count].index = i;
+                jobs[ready_count].result = 0;
+                jobs[ready_count].done = 0;
+                ready_count++;
+            }
+        }
+
+        if (!ready_count) {
+            // Everything left is waiting on itself
+            for (int i = 0; i < entry_count; i++) {
+                if (entries[i].state != DRIVER_ENTRY_PENDING) continue;
+                driver_handleLoadError(entries[i].priority, "Dependency cycle", entries[i].filename);
+                entries[i].state = DRIVER_ENTRY_FAILED;
+            }
+
+            break;
+        }
+
+        LOG(DEBUG, "Driver wave %i: %i independent drivers\n", wave, ready_count);
+        driver_loadWave(jobs, ready_count);
+        debug_drainLog();
+
+        for (int i = 0; i < ready_count; i++) {
+            if (jobs[i].result == 0) {
+                entries[jobs[i].index].state = DRIVER_ENTRY_LOADED;
                 drivers++;
+            } else {
+                entries[jobs[i].index].state = DRIVER_ENTRY_FAILED;
             }
+
+            remaining--;
         }
 
-        // Free values
-        fs_close(driver_file);
-        json_value_free(filename_obj);
-        json_value_free(priority_obj);
-        json_value_free(environment_obj);
+        wave++;
     }
 
+    // The critical path is the longest dependency chain, which is the least time loading could take if every wave ran in parallel
+    uint64_t critical_path = 0;
+    for (int i = 0; i < entry_count; i++) {
+        if (entries[i].finish_time > critical_path) critical_path = entries[i].finish_time;
+    }
+
+    LOG(INFO, "Driver loading took %i us over %i waves (critical path %i us)\n", (int)(driver_getTime() - start_time), wave, (int)critical_path);
+
+    kfree(jobs);
+    kfree(entries);
     json_value_free(json_data);
     kfree(data);
 
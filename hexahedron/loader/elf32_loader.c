@@ -30,6 +30,34 @@
 #define ELF_SECTION(ehdr, idx) ((Elf32_Shdr*)&ELF_SHDR(ehdr)[idx])
 #define ELF_PHDR(ehdr, idx) ((Elf32_Phdr*)((uintptr_t)ehdr + ehdr->e_phoff + ehdr->e_phentsize * idx))
 
+/* Symbol lookup indexes of loaded files */
+static elf_symbol_index_t *elf_index_list = NULL;
+
+/* Per-load symbol resolution cache, keyed by symbol index */
+typedef struct elf_symbol_cache {
+    int table;                  // Symbol table the cache is for
+    uintptr_t entries;          // Amount of symbols in the table
+    uintptr_t *values;          // Resolved symbol values
+    uint8_t *resolved;          // Whether the value at the same index is valid
+    elf_load_stats_t *stats;    // Statistics to update
+} elf_symbol_cache_t;
+
+/**
+ * @brief Standard SysV ELF hash function
+ * @param name The name to hash
+ */
+static uint32_t elf_hash(const char *name) {
+    uint32_t h = 0;
+    while (*name) {
+        h = (h << 4) + (uint8_t)*name++;
+        uint32_t g = h & 0xF0000000;
+        if (g) h ^= g >> 24;
+        h &= ~g;
+    }
+
+    return h;
+}
+
 /**
  * @brief Check if an ELF file is supported
  * @param ehdr The EHDR to check
@@ -152,17 +180,45 @@ uintptr_t elf_getSymbolAddress(Elf32_Ehdr *ehdr, int table, uintptr_t idx, int f
     }
 }
 
+/**
+ * @brief Resolve a symbol through the per-load cache
+ * @param ehdr The EHDR of the file
+ * @param cache The resolution cache, or NULL
+ * @param table The table of the symbol
+ * @param idx The index of the symbol
+ * @param flags The flags passed to @c elf_load
+ * @returns Same as @c elf_getSymbolAddress
+ */
+static uintptr_t elf_resolveSymbol(Elf32_Ehdr *ehdr, elf_symbol_cache_t *cache, int table, uintptr_t idx, int flags) {
+    if (!cache || table != cache->table || idx >= cache->entries) return elf_getSymbolAddress(ehdr, table, idx, flags);
+
+    if (cache->resolved[idx]) {
+        cache->stats->cache_hits++;
+        return cache->values[idx];
+    }
+
+    cache->stats->cache_misses++;
+    uintptr_t value = elf_getSymbolAddress(ehdr, table, idx, flags);
+    if (value != ELF_FAIL) {
+        cache->values[idx] = value;
+        cache->resolved[idx] = 1;
+    }
+
+    return value;
+}
+
 /**
  * @brief Relocate a specific symbol
  * @param ehdr The EHDR of the file
  * @param rel The relocatable object
  * @param reltab The SHDR of the relocatable object
  * @param flags Flags passed to @c elf_load
+ * @param cache The per-load symbol resolution cache
  * @returns The symbol value or ELF_RELOC_ERROR
  * 
  * @see https://wiki.osdev.org/ELF_Tutorial
  */
-static uintptr_t elf_relocateSymbol(Elf32_Ehdr *ehdr, Elf32_Rel *rel, Elf32_Shdr *reltab, int flags) {
+static uintptr_t elf_relocateSymbol(Elf32_Ehdr *ehdr, Elf32_Rel *rel, Elf32_Shdr *reltab, int flags, elf_symbol_cache_t *cache) {
     // Calculate the reference address
     Elf32_Shdr *target = ELF_SECTION(ehdr, reltab->sh_info);
     uintptr_t addr = (uintptr_t)ehdr + target->sh_offset;
@@ -171,7 +227,7 @@ static uintptr_t elf_relocateSymbol(Elf32_Ehdr *ehdr, Elf32_Rel *rel, Elf32_Shdr
     // Get the symbol value
     uintptr_t symval = 0; // Default to 0
     if (ELF32_R_SYM(rel->r_info) != SHN_UNDEF) {
-        symval = elf_getSymbolAddress(ehdr, reltab->sh_link, ELF32_R_SYM(rel->r_info), flags);
+        symval = elf_resolveSymbol(ehdr, cache, reltab->sh_link, ELF32_R_SYM(rel->r_info), flags);
         if (symval == ELF_FAIL) return ELF_FAIL;
     }
 
@@ -211,9 +267,10 @@ static uintptr_t elf_relocateSymbol(Elf32_Ehdr *ehdr, Elf32_Rel *rel, Elf32_Shdr
  * @param rel The symbol to relocate
  * @param reltab The section header of the symbol
  * @param flags The flags passed to @c elf_load
+ * @param cache The per-load symbol resolution cache
  * @returns Symbol value or @c ELF_FAIL
  */
-static uintptr_t elf_relocateSymbolAddend(Elf32_Ehdr *ehdr, Elf32_Rela *rel, Elf32_Shdr *reltab, int flags) {
+static uintptr_t elf_relocateSymbolAddend(Elf32_Ehdr *ehdr, Elf32_Rela *rel, Elf32_Shdr *reltab, int flags, elf_symbol_cache_t *cache) {
     // Calculate offset
     Elf32_Shdr *target_section = ELF_SECTION(ehdr, reltab->sh_info);
     uintptr_t *reference = (uintptr_t*)rel->r_offset + target_section->sh_addr;
@@ -222,7 +279,7 @@ static uintptr_t elf_relocateSymbolAddend(Elf32_Ehdr *ehdr, Elf32_Rela *rel, Elf
     uintptr_t symval = 0x0;
     if (ELF32_R_SYM(rel->r_info) != SHN_UNDEF) {
         // We need to get the symbol value for this
-        symval = elf_getSymbolAddress(ehdr, reltab->sh_link, ELF32_R_SYM(rel->r_info), flags);
+        symval = elf_resolveSymbol(ehdr, cache, reltab->sh_link, ELF32_R_SYM(rel->r_info), flags);
         if (symval == ELF_FAIL) return -1; // Didn't work..
     }
 
@@ -264,9 +321,10 @@ static uintptr_t elf_relocateSymbolAddend(Elf32_Ehdr *ehdr, Elf32_Rela *rel, Elf
  *
  * @param ehdr The EHDR of the relocatable file
  * @param flags The flags passed to @c elf_load
+ * @param stats Load statistics to fill in
  * @returns 0 on success, anything else is failure
  */
-int elf_loadRelocatable(Elf32_Ehdr *ehdr, int flags) {
+int elf_loadRelocatable(Elf32_Ehdr *ehdr, int flags, elf_load_stats_t *stats) {
     if (!ehdr || flags > ELF_DRIVER) return -1; // stupid users
 
     // Handle loading initial sections into memory
@@ -293,6 +351,22 @@ int elf_loadRelocatable(Elf32_Ehdr *ehdr, int flags) {
         }
     }
     
+    // Drivers reference the same (mostly kernel) symbols over and over, so cache resolutions by symbol index.
+    // Relocatable files only have one symbol table.
+    elf_symbol_cache_t cache = { .table = -1, .stats = stats };
+    for (unsigned int i = 0; i < ehdr->e_shnum; i++) {
+        if (shdr[i].sh_type == SHT_SYMTAB && shdr[i].sh_entsize) {
+            cache.table = i;
+            cache.entries = shdr[i].sh_size / shdr[i].sh_entsize;
+            cache.values = kmalloc(sizeof(uintptr_t) * cache.entries);
+            cache.resolved = kmalloc(cache.entries);
+            memset(cache.resolved, 0, cache.entries);
+            break;
+        }
+    }
+
+    int ret = 0;
+
     // Now start relocating
     for (unsigned int i = 0; i < ehdr->e_shnum; i++) {
         Elf32_Shdr *section = &shdr[i];
@@ -303,8 +377,12 @@ int elf_loadRelocatable(Elf32_Ehdr *ehdr, int flags) {
                 Elf32_Rel *rel = &((Elf32_Rel*)((uintptr_t)ehdr + section->sh_offset))[entry];
 
                 // Relocate the symbol
-                uintptr_t result = elf_relocateSymbol(ehdr, rel, section, flags);
-                if (result == ELF_FAIL) return -1;
+                uintptr_t result = elf_relocateSymbol(ehdr, rel, section, flags, &cache);
+                stats->relocations++;
+                if (result == ELF_FAIL) {
+                    ret = -1;
+                    goto _done;
+                }
             }
         } else if (section->sh_type == SHT_RELA) {
             // This is a relocatable section with addend, handle that.
@@ -313,16 +391,20 @@ int elf_loadRelocatable(Elf32_Ehdr *ehdr, int flags) {
                 Elf32_Rela *rela = &((Elf32_Rela*)((uintptr_t)ehdr + section->sh_offset))[entry];
 
                 // Relocate the symbol
-                uintptr_t result = elf_relocateSymbolAddend(ehdr, rela, section, flags);
-                if (result == ELF_FAIL) return -1;
+                uintptr_t result = elf_relocateSymbolAddend(ehdr, rela, section, flags, &cache);
+                stats->relocations++;
+                if (result == ELF_FAIL) {
+                    ret = -1;
+                    goto _done;
+                }
             }
         }
     }
 
-
-
-
-    return 0;
+_done:
+    if (cache.values) kfree(cache.values);
+    if (cache.resolved) kfree(cache.resolved);
+    return ret;
 }
 
 /**
@@ -366,6 +448,117 @@ int elf_loadExecutable(Elf32_Ehdr *ehdr) {
 }
 
 
+/**
+ * @brief Get the symbol lookup index of a loaded file
+ * @param ehdr_address The address of the EHDR
+ * @returns The index or NULL
+ */
+static elf_symbol_index_t *elf_getIndex(uintptr_t ehdr_address) {
+    for (elf_symbol_index_t *index = elf_index_list; index; index = index->next) {
+        if (index->ehdr == ehdr_address) return index;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Build the symbol lookup index of a loaded file
+ * 
+ * If the file has its own SysV hash section it is used as-is. Otherwise (relocatable files, which is what
+ * drivers are) an equivalent table is built over the symbol table, keeping symbols in table order within
+ * each chain so lookups return the same symbol a linear scan would.
+ * 
+ * @param ehdr The EHDR of the file
+ * @param stats Load statistics to attach to the index
+ */
+static void elf_buildIndex(Elf32_Ehdr *ehdr, elf_load_stats_t *stats) {
+    elf_symbol_index_t *index = kmalloc(sizeof(elf_symbol_index_t));
+    memset(index, 0, sizeof(elf_symbol_index_t));
+    index->ehdr = (uintptr_t)ehdr;
+    index->table = -1;
+    memcpy(&index->stats, stats, sizeof(elf_load_stats_t));
+
+    // Fast path: use the hash section of the file
+    for (unsigned int i = 0; i < ehdr->e_shnum; i++) {
+        Elf32_Shdr *section = ELF_SECTION(ehdr, i);
+        if (section->sh_type != SHT_HASH || section->sh_size < sizeof(uint32_t) * 2) continue;
+
+        uint32_t *hash = (uint32_t*)((uintptr_t)ehdr + section->sh_offset);
+        if (!hash[0]) continue;
+
+        index->table = section->sh_link;
+        index->nbucket = hash[0];
+        index->buckets = &hash[2];
+        index->chains = &hash[2 + hash[0]];
+        index->stats.symbols = hash[1];
+        index->stats.hash_section = 1;
+        break;
+    }
+
+    if (index->table < 0) {
+        // Build one over the symbol table
+        for (unsigned int i = 0; i < ehdr->e_shnum; i++) {
+            if (ELF_SECTION(ehdr, i)->sh_type == SHT_SYMTAB) {
+                index->table = i;
+                break;
+            }
+        }
+
+        if (index->table < 0) {
+            // Nothing to index
+            kfree(index);
+            return;
+        }
+
+        Elf32_Shdr *symtab = ELF_SECTION(ehdr, index->table);
+        Elf32_Shdr *strtab = ELF_SECTION(ehdr, symtab->sh_link);
+        Elf32_Sym *symbols = (Elf32_Sym*)((uintptr_t)ehdr + symtab->sh_offset);
+        uint32_t count = symtab->sh_size / symtab->sh_entsize;
+
+        index->nbucket = 16;
+        while (index->nbucket < count / 2) index->nbucket <<= 1;
+
+        index->buckets = kmalloc(sizeof(uint32_t) * index->nbucket);
+        index->chains = kmalloc(sizeof(uint32_t) * (count ? count : 1));
+        memset(index->buckets, 0, sizeof(uint32_t) * index->nbucket);
+        memset(index->chains, 0, sizeof(uint32_t) * (count ? count : 1));
+        index->owned = 1;
+
+        // Insert backwards so chains end up in table order
+        for (uint32_t sym = count; sym-- > 1; ) {
+            if (!symbols[sym].st_name) continue;
+
+            uint32_t bucket = elf_hash((char*)ehdr + strtab->sh_offset + symbols[sym].st_name) % index->nbucket;
+            index->chains[sym] = index->buckets[bucket];
+            index->buckets[bucket] = sym;
+            index->stats.symbols++;
+        }
+    }
+
+    index->next = elf_index_list;
+    elf_index_list = index;
+}
+
+/**
+ * @brief Destroy the symbol lookup index of a file
+ * @param ehdr_address The address of the EHDR
+ */
+static void elf_destroyIndex(uintptr_t ehdr_address) {
+    elf_symbol_index_t **link = &elf_index_list;
+    while (*link && (*link)->ehdr != ehdr_address) link = &(*link)->next;
+    if (!*link) return;
+
+    elf_symbol_index_t *index = *link;
+    *link = index->next;
+
+    if (index->owned) {
+        kfree(index->buckets);
+        kfree(index->chains);
+    }
+
+    kfree(index);
+}
+
 /**
  * @brief Find a specific symbol by name and get its value
  * @param ehdr_address The address of the EHDR (as elf64/elf32 could be in use)
@@ -378,6 +571,24 @@ uintptr_t elf_findSymbol(uintptr_t ehdr_address, char *name) {
     if (!ehdr_address || !name) return (uintptr_t)NULL;
     Elf32_Ehdr *ehdr = (Elf32_Ehdr*)ehdr_address;
 
+    // Use the lookup index if the file has one
+    elf_symbol_index_t *index = elf_getIndex(ehdr_address);
+    if (index) {
+        Elf32_Shdr *symtab = ELF_SECTION(ehdr, index->table);
+        Elf32_Shdr *strtab = ELF_SECTION(ehdr, symtab->sh_link);
+        Elf32_Sym *symbols = (Elf32_Sym*)((uintptr_t)ehdr + symtab->sh_offset);
+
+        for (uint32_t sym = index->buckets[elf_hash(name) % index->nbucket]; sym; sym = index->chains[sym]) {
+            if (symbols[sym].st_shndx == SHN_UNDEF) continue; // Not defined in this file
+            if (!strcmp(name, (char*)ehdr + strtab->sh_offset + symbols[sym].st_name)) {
+                return elf_getSymbolAddress(ehdr, index->table, sym, ELF_KERNEL);
+            }
+        }
+
+        // A hash section only covers the dynamic symbols, anything else is in the symbol table
+        if (!index->stats.hash_section) return (uintptr_t)NULL;
+    }
+
     // Start checking symbpols
     for (unsigned int i = 0; i < ehdr->e_shnum; i++) {
         Elf32_Shdr *shdr = ELF_SECTION(ehdr, i);
@@ -394,6 +605,7 @@ uintptr_t elf_findSymbol(uintptr_t ehdr_address, char *name) {
         for (unsigned int sym = 0; sym < shdr->sh_size / shdr->sh_entsize; sym++) {
             // Get the name of the symbol
             Elf32_Sym *symbol = &symtable[sym];
+            if (symbol->st_shndx == SHN_UNDEF) continue;
             char *symname = (char*)ehdr + strtab->sh_offset + symbol->st_name;
 
             if (!strcmp(name, symname)) {
@@ -427,6 +639,7 @@ uintptr_t elf_getEntrypoint(uintptr_t ehdr_address) {
 uintptr_t elf_loadBuffer(uint8_t *fbuf, int flags) {
     // Cast ehdr to fbuf - routines can now access sections by adding to ehdr
     Elf32_Ehdr *ehdr = (Elf32_Ehdr*)fbuf;
+    elf_load_stats_t stats = { 0 };
 
     // Check to make sure the ELF file is supported
     if (!elf_checkSupported(ehdr)) {
@@ -437,7 +650,7 @@ uintptr_t elf_loadBuffer(uint8_t *fbuf, int flags) {
     switch (ehdr->e_type) {
         case ET_REL:
             // Relocatable file
-            if (elf_loadRelocatable(ehdr, flags)) {
+            if (elf_loadRelocatable(ehdr, flags, &stats)) {
                 LOG(ERR, "Failed to load relocatable ELF file.\n");
                 goto _error;
             }
@@ -458,6 +671,9 @@ uintptr_t elf_loadBuffer(uint8_t *fbuf, int flags) {
             goto _error;
     }
 
+    // Index the symbols for elf_findSymbol
+    elf_buildIndex(ehdr, &stats);
+
     // Return a pointer to the EHDR
     return (uintptr_t)ehdr;
 
@@ -497,6 +713,20 @@ uintptr_t elf_load(fs_node_t *node, int flags) {
     return elf_loadBuffer(fbuf, flags);
 }
 
+/**
+ * @brief Get the load statistics of an ELF file
+ * @param elf_address The address given by @c elf_load or another loading function
+ * @param stats Output structure
+ * @returns 0 on success, -1 if the file was not loaded by the ELF loader
+ */
+int elf_getLoadStats(uintptr_t elf_address, elf_load_stats_t *stats) {
+    elf_symbol_index_t *index = elf_getIndex(elf_address);
+    if (!index || !stats) return -1;
+
+    memcpy(stats, &index->stats, sizeof(elf_load_stats_t));
+    return 0;
+}
+
 /**
  * @brief Cleanup an ELF file after it has finished executing
  * @param elf_address The address given by @c elf_load or another loading function
@@ -511,6 +741,8 @@ int elf_cleanup(uintptr_t elf_address) {
     Elf32_Ehdr *ehdr = (Elf32_Ehdr*)elf_address; 
     if (!elf_checkSupported(ehdr)) return ELF_FAIL;
 
+    elf_destroyIndex(elf_address);
+
     // Check EHDR type
     if (ehdr->e_type == ET_REL) {
         // Cleanup by finding any sections allocated with SHF_ALLOC and destroy them
@@ -26,6 +26,7 @@
 #include <kernel/mem/mem.h>
 #include <kernel/panic.h>
 #include <kernel/debug.h>
+#include <kernel/misc/spinlock.h>
 
 
 /* Internal copy of the allocator's data */
@@ -34,6 +35,40 @@ static allocator_info_t *alloc_info = NULL; // !!!: What if a bad allocator chan
 /* Current profiling data */
 static profile_info_t *profile_data = NULL;
 
+/* The allocators aren't thread-safe, so every call goes through this lock */
+static spinlock_t alloc_lock = { 0 };
+
+/* Panic state (panic.c) */
+extern int kernel_in_panic_state;
+
+/**
+ * @brief Lock the allocator
+ * 
+ * Interrupts are disabled while it is held, so an IRQ handler that allocates can't spin
+ * on a lock its own CPU holds. The lock is skipped when panicking, its holder may never come back.
+ * 
+ * @returns Whether interrupts were enabled
+ */
+static inline int alloc_acquire() {
+    uintptr_t flags = 0;
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    asm volatile ("pushf\npop %0\ncli" : "=r"(flags) :: "memory");
+#endif
+    if (!kernel_in_panic_state) spinlock_acquire(&alloc_lock);
+    return (flags & 0x200) ? 1 : 0;
+}
+
+/**
+ * @brief Unlock the allocator
+ * @param enabled Whether interrupts were enabled
+ */
+static inline void alloc_release(int enabled) {
+    if (!kernel_in_panic_state) spinlock_release(&alloc_lock);
+#if defined(__ARCH_I386__) || defined(__ARCH_X86_64__)
+    if (enabled) asm volatile ("sti" ::: "memory");
+#endif
+}
+
 
 /** FORWARDER FUNCTIONS **/
 
@@ -52,7 +87,9 @@ __attribute__((malloc)) void *kmalloc(size_t size) {
         if (size < profile_data->least_bytes_allocated) profile_data->least_bytes_allocated = size;
     }
 
+    int enabled = alloc_acquire();
     void *ptr = alloc_malloc(size);
+    alloc_release(enabled);
     return ptr;
 }
 
@@ -73,7 +110,9 @@ __attribute__((malloc)) void *krealloc(void *ptr, size_t size) {
     }
 
 
+    int enabled = alloc_acquire();
     void *ret_ptr = alloc_realloc(ptr, size);
+    alloc_release(enabled);
     return ret_ptr;
 }
 
@@ -92,7 +131,9 @@ __attribute__((malloc)) void *kcalloc(size_t elements, size_t size) {
         if (elements * size > profile_data->most_bytes_allocated) profile_data->most_bytes_allocated = elements * size;
         if (elements * size < profile_data->least_bytes_allocated) profile_data->least_bytes_allocated = elements * size;
     }
+    int enabled = alloc_acquire();
     void *ptr = alloc_calloc(elements, size);
+    alloc_release(enabled);
     return ptr;
 }
 
@@ -113,7 +154,9 @@ __attribute__((malloc)) void *kvalloc(size_t size) {
             if (size < profile_data->least_bytes_allocated) profile_data->least_bytes_allocated = size;
         }
 
+        int enabled = alloc_acquire();
         void *ptr = alloc_valloc(size);
+        alloc_release(enabled);
         return ptr;
     } else {
         kernel_panic_extended(UNSUPPORTED_FUNCTION_ERROR, "alloc", "valloc() is not supported in this context.\n");
@@ -130,7 +173,9 @@ void kfree(void *ptr) {
         profile_data->requests++;
     }
     
+    int enabled = alloc_acquire();
     alloc_free(ptr);
+    alloc_release(enabled);
 }
 
 /** ALLOCATOR-MANAGEMENT FUNCTIONS **/
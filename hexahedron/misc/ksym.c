@@ -46,7 +46,7 @@ void ksym_bind_symbol(char *symname, uintptr_t address) {
 int ksym_load(fs_node_t *file) {
     if (!file) return -EINVAL;
     if (ksym_hashmap) return -EALREADY;
-    ksym_hashmap = hashmap_create("ksym", 20);
+    ksym_hashmap = hashmap_create("ksym", KSYM_HASHMAP_SIZE);
     
     // Read the contents of the file
     uint8_t *symbuf = kmalloc(file->length);
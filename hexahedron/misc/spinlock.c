@@ -54,6 +54,14 @@ void spinlock_acquire(spinlock_t *spinlock) {
     }
 }
 
+/**
+ * @brief Try to lock a spinlock without spinning
+ * @returns 1 if the lock was acquired, 0 if someone else holds it
+ */
+int spinlock_tryAcquire(spinlock_t *spinlock) {
+    return !atomic_flag_test_and_set_explicit(&(spinlock->lock), memory_order_acquire);
+}
+
 /**
  * @brief Release a spinlock
  */
@@ -0,0 +1,559 @@
+/**
+ * @file hostbench/bench.c
+ * @brief Microbenchmarks for libkstructures and libpolyhedron
+ *
+ * Names are "suite.case/parameters" and stay stable so compare.py can match runs up.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "hostbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <structs/hashmap.h>
+#include <structs/list.h>
+#include <structs/tree.h>
+#include <structs/json.h>
+
+/* Largest string operation measured (the scratch buffers are this big) */
+#define BENCH_STRING_MAX        (4 * 1024 * 1024)
+
+/* Size of the generated JSON document */
+#define BENCH_JSON_SIZE         (256 * 1024)
+
+/* Benchmark filter */
+static const char *bench_filter = NULL;
+
+/* Keeps results alive */
+static volatile uint64_t bench_sink = 0;
+
+/**
+ * @brief Should a benchmark run?
+ */
+static int bench_wanted(const char *name) {
+    return !bench_filter || strstr(name, bench_filter);
+}
+
+/**
+ * @brief Measure a benchmark and emit its result
+ * @param name Name of the benchmark
+ * @param fn Body
+ * @param context Context for the body
+ * @param ops Operations per iteration of the body (the result is per operation)
+ * @param bytes Bytes processed per iteration, reports MB/s instead of ns/op when non-zero
+ */
+static void bench(const char *name, bench_fn_t fn, void *context, double ops, size_t bytes) {
+    if (!bench_wanted(name)) return;
+
+    double allocs;
+    double ns = hostbench_measure(fn, context, &allocs);
+
+    if (bytes) {
+        hostbench_result(name, (double)bytes / ns * 1000.0, "MB/s", 1, -1);
+    } else {
+        hostbench_result(name, ns / ops, "ns/op", 0, allocs / ops);
+    }
+}
+
+/**** HASHMAP ****/
+
+typedef struct bench_hashmap {
+    size_t buckets;
+    size_t count;
+    char **keys;            // Present keys, in insertion order
+    char **missing;         // Keys that are never inserted
+    size_t *order;          // Shuffled lookup order
+    hashmap_t *map;
+    size_t cursor;
+} bench_hashmap_t;
+
+static void bench_hashmap_set(void *context, uint64_t iterations) {
+    bench_hashmap_t *b = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        hashmap_t *map = hashmap_create("bench", b->buckets);
+        for (size_t k = 0; k < b->count; k++) hashmap_set(map, b->keys[k], (void*)k);
+        hashmap_free(map);
+    }
+}
+
+static void bench_hashmap_get(void *context, uint64_t iterations) {
+    bench_hashmap_t *b = context;
+    uintptr_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        sum += (uintptr_t)hashmap_get(b->map, b->keys[b->order[b->cursor]]);
+        if (++b->cursor == b->count) b->cursor = 0;
+    }
+    bench_sink += sum;
+}
+
+static void bench_hashmap_miss(void *context, uint64_t iterations) {
+    bench_hashmap_t *b = context;
+    uintptr_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        sum += (uintptr_t)hashmap_get(b->map, b->missing[b->order[b->cursor]]);
+        if (++b->cursor == b->count) b->cursor = 0;
+    }
+    bench_sink += sum;
+}
+
+static void bench_hashmap_churn(void *context, uint64_t iterations) {
+    bench_hashmap_t *b = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        char *key = b->keys[b->order[b->cursor]];
+        void *value = hashmap_remove(b->map, key);
+        hashmap_set(b->map, key, value);
+        if (++b->cursor == b->count) b->cursor = 0;
+    }
+}
+
+/**
+ * @brief Hashmap benchmarks for one shape
+ */
+static void bench_hashmaps(size_t buckets, size_t count) {
+    bench_hashmap_t b = { .buckets = buckets, .count = count };
+    b.keys = malloc(sizeof(char*) * count);
+    b.missing = malloc(sizeof(char*) * count);
+    b.order = malloc(sizeof(size_t) * count);
+
+    // Keys look like the kernel's (paths and symbol names of mixed length)
+    for (size_t i = 0; i < count; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), (i & 1) ? "/device/disk%zu" : "ksym_function_%zu", i * 2654435761u % 1000003);
+        b.keys[i] = strdup(key);
+        snprintf(key, sizeof(key), (i & 1) ? "/device/cdrom%zu" : "ksym_variable_%zu", i);
+        b.missing[i] = strdup(key);
+        b.order[i] = i;
+    }
+
+    for (size_t i = count - 1; i > 0; i--) {
+        size_t j = hostbench_random() % (i + 1);
+        size_t t = b.order[i]; b.order[i] = b.order[j]; b.order[j] = t;
+    }
+
+    b.map = hashmap_create("bench", buckets);
+    for (size_t i = 0; i < count; i++) hashmap_set(b.map, b.keys[i], (void*)i);
+
+    char name[128];
+    snprintf(name, sizeof(name), "hashmap.set/buckets=%zu,n=%zu", buckets, count);
+    bench(name, bench_hashmap_set, &b, (double)count, 0);
+    snprintf(name, sizeof(name), "hashmap.get_hit/buckets=%zu,n=%zu", buckets, count);
+    bench(name, bench_hashmap_get, &b, 1, 0);
+    snprintf(name, sizeof(name), "hashmap.get_miss/buckets=%zu,n=%zu", buckets, count);
+    bench(name, bench_hashmap_miss, &b, 1, 0);
+    snprintf(name, sizeof(name), "hashmap.remove_set/buckets=%zu,n=%zu", buckets, count);
+    bench(name, bench_hashmap_churn, &b, 1, 0);
+
+    hashmap_free(b.map);
+    for (size_t i = 0; i < count; i++) {
+        free(b.keys[i]);
+        free(b.missing[i]);
+    }
+    free(b.keys);
+    free(b.missing);
+    free(b.order);
+}
+
+/**** LIST ****/
+
+typedef struct bench_list {
+    size_t count;
+    list_t *list;
+    size_t cursor;
+} bench_list_t;
+
+static void bench_list_append(void *context, uint64_t iterations) {
+    bench_list_t *b = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        list_t *list = list_create("bench");
+        for (size_t k = 0; k < b->count; k++) list_append(list, (void*)k);
+        list_destroy(list, false);
+    }
+}
+
+static void bench_list_queue(void *context, uint64_t iterations) {
+    bench_list_t *b = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        list_append(b->list, (void*)i);
+        node_t *node = list_popleft(b->list);
+        bench_sink += (uintptr_t)node->value;
+        kfree(node);
+    }
+}
+
+static void bench_list_find(void *context, uint64_t iterations) {
+    bench_list_t *b = context;
+    uintptr_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        // The list holds the values 0..count-1, walk to a different one each time
+        b->cursor = (b->cursor + 7919) % b->count;
+        sum += (uintptr_t)list_find(b->list, (void*)b->cursor);
+    }
+    bench_sink += sum;
+}
+
+static void bench_list_delete_index(void *context, uint64_t iterations) {
+    bench_list_t *b = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        list_delete_index(b->list, b->count / 2);
+        list_append(b->list, (void*)i);
+    }
+}
+
+/**
+ * @brief List benchmarks for one length
+ */
+static void bench_lists(size_t count) {
+    bench_list_t b = { .count = count };
+    b.list = list_create("bench");
+    for (size_t i = 0; i < count; i++) list_append(b.list, (void*)i);
+
+    char name[128];
+    snprintf(name, sizeof(name), "list.append/n=%zu", count);
+    bench(name, bench_list_append, &b, (double)count, 0);
+    snprintf(name, sizeof(name), "list.find/n=%zu", count);
+    bench(name, bench_list_find, &b, 1, 0);
+
+    // These two change the values in the list
+    snprintf(name, sizeof(name), "list.append_popleft/n=%zu", count);
+    bench(name, bench_list_queue, &b, 1, 0);
+    snprintf(name, sizeof(name), "list.delete_index_middle/n=%zu", count);
+    bench(name, bench_list_delete_index, &b, 1, 0);
+
+    list_destroy(b.list, false);
+}
+
+/**** TREE ****/
+
+typedef struct bench_tree {
+    size_t count;
+    tree_t *tree;
+    size_t cursor;
+} bench_tree_t;
+
+/**
+ * @brief Build a tree of count nodes with 4 children per node (like a small VFS)
+ */
+static tree_t *bench_tree_build(size_t count) {
+    tree_t *tree = tree_create("bench");
+    tree_set_parent(tree, (void*)0);
+
+    tree_node_t **nodes = malloc(sizeof(tree_node_t*) * count);
+    nodes[0] = tree->root;
+    for (size_t i = 1; i < count; i++) {
+        nodes[i] = tree_insert_child(tree, nodes[(i - 1) / 4], (void*)i);
+    }
+
+    free(nodes);
+    return tree;
+}
+
+static int bench_tree_comparator(void *value, void *search) {
+    return value == search;
+}
+
+static void bench_tree_insert(void *context, uint64_t iterations) {
+    bench_tree_t *b = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        tree_t *tree = bench_tree_build(b->count);
+        tree_delete(tree, tree->root);
+        kfree(tree);
+    }
+}
+
+static void bench_tree_find(void *context, uint64_t iterations) {
+    bench_tree_t *b = context;
+    uintptr_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        b->cursor = (b->cursor + 7919) % b->count;
+        sum += (uintptr_t)tree_find(b->tree, (void*)b->cursor, bench_tree_comparator);
+    }
+    bench_sink += sum;
+}
+
+/**
+ * @brief Tree benchmarks for one size
+ */
+static void bench_trees(size_t count) {
+    bench_tree_t b = { .count = count };
+    b.tree = bench_tree_build(count);
+
+    char name[128];
+    snprintf(name, sizeof(name), "tree.insert/n=%zu", count);
+    bench(name, bench_tree_insert, &b, (double)count, 0);
+    snprintf(name, sizeof(name), "tree.find/n=%zu", count);
+    bench(name, bench_tree_find, &b, 1, 0);
+
+    tree_delete(b.tree, b.tree->root);
+    kfree(b.tree);
+}
+
+/**** JSON ****/
+
+typedef struct bench_json {
+    char *document;
+    size_t length;
+} bench_json_t;
+
+static void bench_json_parse(void *context, uint64_t iterations) {
+    bench_json_t *b = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        json_value *value = json_parse(b->document, b->length);
+        if (!value) {
+            fprintf(stderr, "hostbench: the generated JSON document did not parse\n");
+            abort();
+        }
+        json_value_free(value);
+    }
+}
+
+/**
+ * @brief JSON parsing over a generated document of objects, arrays, strings and numbers
+ */
+static void bench_json() {
+    bench_json_t b;
+    b.document = malloc(BENCH_JSON_SIZE + 1024);
+    b.length = 0;
+
+    b.length += sprintf(b.document, "{\"version\": 3, \"entries\": [");
+    for (int i = 0; b.length < BENCH_JSON_SIZE; i++) {
+        b.length += sprintf(b.document + b.length,
+                    "%s{\"id\": %d, \"name\": \"entry \\\"%d\\\"\", \"path\": \"/device/disk%d\", \"size\": %d, "
+                    "\"ratio\": %d.%03d, \"enabled\": %s, \"parent\": null, \"tags\": [\"boot\", \"storage\", %d]}",
+                    i ? ", " : "", i, i, i % 16, i * 4096, i % 100, i % 1000, (i & 1) ? "true" : "false", i % 7);
+    }
+    b.length += sprintf(b.document + b.length, "]}");
+
+    bench("json.parse", bench_json_parse, &b, 1, b.length);
+    free(b.document);
+}
+
+/**** STRING ****/
+
+typedef struct bench_string {
+    void *function;
+    int op;                 // STRING_OP_*, or -1 for memmove
+    char *dest;
+    char *src;
+    size_t size;
+} bench_string_t;
+
+static void bench_string_body(void *context, uint64_t iterations) {
+    bench_string_t *b = context;
+    uint64_t sum = 0;
+
+    switch (b->op) {
+        case STRING_OP_MEMCPY:
+            for (uint64_t i = 0; i < iterations; i++) ((memcpy_impl_t)b->function)(b->dest, b->src, b->size);
+            break;
+        case STRING_OP_MEMSET:
+            for (uint64_t i = 0; i < iterations; i++) ((memset_impl_t)b->function)(b->dest, (int)i, b->size);
+            break;
+        case STRING_OP_MEMCMP:
+            for (uint64_t i = 0; i < iterations; i++) sum += ((memcmp_impl_t)b->function)(b->dest, b->src, b->size);
+            break;
+        case STRING_OP_STRLEN:
+            for (uint64_t i = 0; i < iterations; i++) sum += ((strlen_impl_t)b->function)(b->src);
+            break;
+        default:
+            for (uint64_t i = 0; i < iterations; i++) ((memcpy_impl_t)b->function)(b->dest, b->src, b->size);
+            break;
+    }
+
+    bench_sink += sum;
+}
+
+/**
+ * @brief Measure one string routine over every size
+ */
+static void bench_string_sizes(const char *op_name, const char *variant, int op, void *function, char *dest, char *src) {
+    static const size_t sizes[] = { 16, 256, 4096, 65536, BENCH_STRING_MAX };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        bench_string_t b = { .function = function, .op = op, .dest = dest, .src = src, .size = sizes[s] };
+
+        // Equal buffers for memcmp, a terminator at the size for strlen
+        memset(src, 'a', BENCH_STRING_MAX + 64);
+        memset(dest, 'a', BENCH_STRING_MAX + 64);
+        if (op == STRING_OP_STRLEN) src[sizes[s]] = 0;
+
+        char name[128];
+        snprintf(name, sizeof(name), "%s.%s/%zu", op_name, variant, sizes[s]);
+        bench(name, bench_string_body, &b, 1, sizes[s]);
+    }
+}
+
+/**
+ * @brief Benchmark every usable variant of the string routines against the dispatcher and the host libc
+ */
+static void bench_strings() {
+    static const char *op_names[STRING_OP_COUNT] = { "memcpy", "memset", "memcmp", "strlen" };
+    void *host[STRING_OP_COUNT] = { (void*)memcpy, (void*)memset, (void*)memcmp, (void*)strlen };
+    void *dispatch[STRING_OP_COUNT] = { (void*)poly_memcpy, (void*)poly_memset, (void*)poly_memcmp, (void*)poly_strlen };
+
+    char *scratch = aligned_alloc(4096, 2 * (BENCH_STRING_MAX + 4096));
+    char *src = scratch;
+    char *dest = scratch + BENCH_STRING_MAX + 4096;
+    int features = poly_string_getFeatures();
+
+    for (int op = 0; op < STRING_OP_COUNT; op++) {
+        int count = 0;
+        const string_variant_t *variants = poly_string_getVariants(op, &count);
+        for (int v = 0; v < count; v++) {
+            if (variants[v].features & ~features) continue;
+            bench_string_sizes(op_names[op], variants[v].name, op, variants[v].function, dest, src);
+        }
+
+        bench_string_sizes(op_names[op], "dispatch", op, dispatch[op], dest, src);
+        bench_string_sizes(op_names[op], "host", op, host[op], dest, src);
+    }
+
+    // memmove has no variants, overlap by a few bytes so it has to pick a direction
+    bench_string_sizes("memmove", "dispatch", -1, (void*)poly_memmove, src + 8, src);
+    bench_string_sizes("memmove", "host", -1, (void*)memmove, src + 8, src);
+
+    free(scratch);
+}
+
+/**** PRINTF ****/
+
+#define BENCH_PRINTF_LINE       "[%s] %s:%d: value %d (0x%08x), %zu bytes at %p, name '%s' %c%%\n"
+#define BENCH_PRINTF_ARGS(i)    "INFO", "hexahedron/fs/vfs.c", 412, (int)(i) * -7919, (unsigned)(i), (size_t)(i) * 512, (void*)(uintptr_t)(i), "disk0", 'x'
+
+/* Bytes taken by the write sink */
+static size_t bench_printf_written = 0;
+
+static int bench_printf_sink(void *user, const char *buffer, size_t length) {
+    bench_printf_written += length;
+    return (int)length;
+}
+
+static size_t bench_printf_write(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    size_t r = poly_xvasprintf_write(bench_printf_sink, NULL, format, ap);
+    va_end(ap);
+    return r;
+}
+
+static void bench_printf_snprintf(void *context, uint64_t iterations) {
+    char buffer[256];
+    for (uint64_t i = 0; i < iterations; i++) poly_snprintf(buffer, sizeof(buffer), BENCH_PRINTF_LINE, BENCH_PRINTF_ARGS(i));
+}
+
+static void bench_printf_writer(void *context, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) bench_printf_write(BENCH_PRINTF_LINE, BENCH_PRINTF_ARGS(i));
+}
+
+static void bench_printf_integers(void *context, uint64_t iterations) {
+    char buffer[256];
+    for (uint64_t i = 0; i < iterations; i++) poly_snprintf(buffer, sizeof(buffer), "%d %u %x %lld %llu", (int)i, (unsigned)(i * 31), (unsigned)i, (long long)i * -1000003LL, (unsigned long long)i << 20);
+}
+
+static void bench_printf_host(void *context, uint64_t iterations) {
+    char buffer[256];
+    for (uint64_t i = 0; i < iterations; i++) snprintf(buffer, sizeof(buffer), BENCH_PRINTF_LINE, BENCH_PRINTF_ARGS(i));
+}
+
+/**
+ * @brief printf benchmarks
+ */
+static void bench_printf() {
+    bench("printf.snprintf_line", bench_printf_snprintf, NULL, 1, 0);
+    bench("printf.write_sink_line", bench_printf_writer, NULL, 1, 0);
+    bench("printf.snprintf_integers", bench_printf_integers, NULL, 1, 0);
+    bench("printf.host_snprintf_line", bench_printf_host, NULL, 1, 0);
+}
+
+/**** STDLIB/TIME ****/
+
+static const char *bench_numbers[] = {
+    "0", "42", "-17", "4096", "2147483647", "-2147483648", "0x7fffffff", "0755",
+    "123456789012", "   99", "+1", "65535", "0x10000", "18446744073709551615", "3", "1000000007",
+};
+
+static const char *bench_doubles[] = {
+    "0", "1.5", "-2.25", "3.14159265358979", "1e10", "6.02e23", "-0.000125", "42",
+};
+
+#define BENCH_NUMBER_COUNT (sizeof(bench_numbers) / sizeof(*bench_numbers))
+#define BENCH_DOUBLE_COUNT (sizeof(bench_doubles) / sizeof(*bench_doubles))
+
+static void bench_strtol(void *context, uint64_t iterations) {
+    long sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) sum += poly_strtol(bench_numbers[i % BENCH_NUMBER_COUNT], NULL, 0);
+    bench_sink += sum;
+}
+
+static void bench_strtoull(void *context, uint64_t iterations) {
+    unsigned long long sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) sum += poly_strtoull(bench_numbers[i % BENCH_NUMBER_COUNT], NULL, 0);
+    bench_sink += sum;
+}
+
+static void bench_strtod(void *context, uint64_t iterations) {
+    double sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) sum += poly_strtod(bench_doubles[i % BENCH_DOUBLE_COUNT], NULL);
+    bench_sink += (uint64_t)sum;
+}
+
+static void bench_gmtime(void *context, uint64_t iterations) {
+    struct poly_tm tm;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        time_t t = (time_t)(1700000000 + i * 86413);
+        poly_gmtime_r(&t, &tm);
+        sum += tm.tm_mday;
+    }
+    bench_sink += sum;
+}
+
+static void bench_strftime(void *context, uint64_t iterations) {
+    struct poly_tm tm;
+    time_t t = 1700000000;
+    poly_gmtime_r(&t, &tm);
+
+    char buffer[128];
+    for (uint64_t i = 0; i < iterations; i++) poly_strftime(buffer, sizeof(buffer), "%a %b %d %H:%M:%S %Y", &tm);
+}
+
+/**
+ * @brief stdlib and time benchmarks
+ */
+static void bench_stdlib() {
+    bench("stdlib.strtol", bench_strtol, NULL, 1, 0);
+    bench("stdlib.strtoull", bench_strtoull, NULL, 1, 0);
+    bench("stdlib.strtod", bench_strtod, NULL, 1, 0);
+    bench("time.gmtime_r", bench_gmtime, NULL, 1, 0);
+    bench("time.strftime", bench_strftime, NULL, 1, 0);
+}
+
+/**
+ * @brief Run the benchmarks
+ * @param filter Only run benchmarks whose name contains this (or NULL)
+ */
+void bench_run(const char *filter) {
+    bench_filter = filter;
+    hostbench_seed(1);
+
+    bench_hashmaps(10, 64);
+    bench_hashmaps(2048, 4096);
+    bench_hashmaps(2048, 65536);
+
+    bench_lists(16);
+    bench_lists(1024);
+
+    bench_trees(64);
+    bench_trees(4096);
+
+    bench_json();
+    bench_strings();
+    bench_printf();
+    bench_stdlib();
+}
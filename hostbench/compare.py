@@ -0,0 +1,80 @@
+#!/usr/bin/python3
+import sys
+import json
+
+# compare.py - Compares two hostbench result files (one JSON object per line)
+# Prints every benchmark with its change, exits with 1 if something got worse by more than the threshold.
+
+if len(sys.argv) < 3:
+    print("Usage: compare.py <old results> <new results> [threshold percent, default 5]")
+    sys.exit(2)
+
+threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 5.0
+
+
+# Load a results file: returns the header and the results by name
+def load(path):
+    header = {}
+    results = {}
+    with open(path, "r") as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("{"):
+                continue
+
+            entry = json.loads(line)
+            if "hostbench" in entry:
+                header = entry
+            elif "name" in entry:
+                results[entry["name"]] = entry
+
+    return header, results
+
+
+old_header, old = load(sys.argv[1])
+new_header, new = load(sys.argv[2])
+
+print("old: %s (%s)" % (old_header.get("revision", "unknown"), old_header.get("cpu", "unknown")))
+print("new: %s (%s)" % (new_header.get("revision", "unknown"), new_header.get("cpu", "unknown")))
+if old_header.get("cpu") != new_header.get("cpu"):
+    print("warning: the runs are from different CPUs")
+print()
+
+regressions = 0
+width = max([len(name) for name in list(old) + list(new)] + [9])
+print("%-*s %14s %14s %9s" % (width, "benchmark", "old", "new", "change"))
+
+for name in list(old) + [name for name in new if name not in old]:
+    if name not in new:
+        print("%-*s %14.2f %14s %9s" % (width, name, old[name]["value"], "-", "removed"))
+        continue
+    if name not in old:
+        print("%-*s %14s %14.2f %9s" % (width, name, "-", new[name]["value"], "new"))
+        continue
+
+    before = old[name]["value"]
+    after = new[name]["value"]
+    if before == 0:
+        continue
+
+    # Positive is always an improvement
+    change = (after - before) / before * 100.0
+    if new[name].get("better") == "lower":
+        change = -change
+
+    mark = ""
+    if change <= -threshold:
+        mark = "  WORSE"
+        regressions += 1
+    elif change >= threshold:
+        mark = "  better"
+
+    print("%-*s %14.2f %14.2f %+8.1f%%%s %s" % (width, name, before, after, change, mark, new[name]["unit"]))
+
+    # Allocation counts are exact, any increase is worth pointing out
+    if old[name].get("allocs_per_op", 0) < new[name].get("allocs_per_op", 0):
+        print("%-*s allocations per op went from %.3f to %.3f" % (width, "", old[name]["allocs_per_op"], new[name]["allocs_per_op"]))
+
+print()
+print("%d benchmark(s) worse by more than %.1f%%" % (regressions, threshold))
+sys.exit(1 if regressions else 0)
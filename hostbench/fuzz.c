@@ -0,0 +1,757 @@
+/**
+ * @file hostbench/fuzz.c
+ * @brief Differential fuzzers for libkstructures and libpolyhedron
+ *
+ * Every case is checked against the host libc or a trivially correct model.
+ * Failures are printed as JSON lines, followed by one summary line per fuzzer.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "hostbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <structs/hashmap.h>
+#include <structs/list.h>
+#include <structs/json.h>
+
+/* Failures printed per fuzzer */
+#define FUZZ_MAX_REPORTS        10
+
+/* Bytes of guard around every string routine destination */
+#define FUZZ_GUARD              64
+
+/* Largest "normal" string case, one in FUZZ_NT_EVERY cases goes past STRING_NT_THRESHOLD instead */
+#define FUZZ_STRING_MAX         16384
+#define FUZZ_NT_EVERY           2048
+#define FUZZ_BUFFER_SIZE        (STRING_NT_THRESHOLD + FUZZ_STRING_MAX + 4 * FUZZ_GUARD)
+
+/* Current fuzzer */
+static const char *fuzz_name = NULL;
+static uint64_t fuzz_iteration = 0;
+static int fuzz_failures = 0;
+
+/**
+ * @brief Report a failure
+ */
+static void fuzz_fail(const char *format, ...) {
+    fuzz_failures++;
+    if (fuzz_failures > FUZZ_MAX_REPORTS) return;
+
+    char message[512];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+
+    // Keep the line valid JSON
+    for (char *c = message; *c; c++) if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) *c = '?';
+
+    printf("{\"fuzz\": \"%s\", \"iteration\": %lu, \"failure\": \"%s\"}\n", fuzz_name, (unsigned long)fuzz_iteration, message);
+    fflush(stdout);
+}
+
+/**
+ * @brief Start a fuzzer
+ */
+static void fuzz_begin(const char *name) {
+    fuzz_name = name;
+    fuzz_iteration = 0;
+    fuzz_failures = 0;
+}
+
+/**
+ * @brief Finish a fuzzer and print its summary
+ * @returns The amount of failures
+ */
+static int fuzz_end(uint64_t cases) {
+    printf("{\"fuzz\": \"%s\", \"cases\": %lu, \"failures\": %d}\n", fuzz_name, (unsigned long)cases, fuzz_failures);
+    fflush(stdout);
+    return fuzz_failures;
+}
+
+/**
+ * @brief Random number below a bound
+ */
+static uint64_t fuzz_below(uint64_t bound) {
+    return bound ? hostbench_random() % bound : 0;
+}
+
+/**
+ * @brief Fill memory with random bytes
+ */
+static void fuzz_fill(void *buffer, size_t size) {
+    uint8_t *p = buffer;
+    while (size >= 8) {
+        uint64_t r = hostbench_random();
+        memcpy(p, &r, 8);
+        p += 8;
+        size -= 8;
+    }
+
+    uint64_t r = hostbench_random();
+    memcpy(p, &r, size);
+}
+
+/**
+ * @brief Check that the guard bytes around [offset, offset + size) are intact
+ */
+static int fuzz_guards_intact(const uint8_t *buffer, size_t offset, size_t size) {
+    for (size_t i = offset - FUZZ_GUARD; i < offset; i++) if (buffer[i] != 0xA5) return 0;
+    for (size_t i = offset + size; i < offset + size + FUZZ_GUARD; i++) if (buffer[i] != 0xA5) return 0;
+    return 1;
+}
+
+static int fuzz_sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+/**** STRING ****/
+
+/**
+ * @brief Collect the implementations of an operation: every usable variant, then the dispatcher
+ */
+static int fuzz_string_functions(int op, void *dispatch, void **functions, const char **names) {
+    int features = poly_string_getFeatures();
+    int count = 0, total = 0;
+    const string_variant_t *variants = poly_string_getVariants(op, &count);
+
+    for (int v = 0; v < count; v++) {
+        if (variants[v].features & ~features) continue;
+        functions[total] = variants[v].function;
+        names[total++] = variants[v].name;
+    }
+
+    functions[total] = dispatch;
+    names[total++] = "dispatch";
+    return total;
+}
+
+/**
+ * @brief memcpy, memset, memmove, memcmp and strlen (every variant) against the host libc
+ */
+static int fuzz_strings(uint64_t iterations) {
+    fuzz_begin("string");
+
+    void *functions[STRING_OP_COUNT][16];
+    const char *names[STRING_OP_COUNT][16];
+    int counts[STRING_OP_COUNT];
+    counts[STRING_OP_MEMCPY] = fuzz_string_functions(STRING_OP_MEMCPY, (void*)poly_memcpy, functions[STRING_OP_MEMCPY], names[STRING_OP_MEMCPY]);
+    counts[STRING_OP_MEMSET] = fuzz_string_functions(STRING_OP_MEMSET, (void*)poly_memset, functions[STRING_OP_MEMSET], names[STRING_OP_MEMSET]);
+    counts[STRING_OP_MEMCMP] = fuzz_string_functions(STRING_OP_MEMCMP, (void*)poly_memcmp, functions[STRING_OP_MEMCMP], names[STRING_OP_MEMCMP]);
+    counts[STRING_OP_STRLEN] = fuzz_string_functions(STRING_OP_STRLEN, (void*)poly_strlen, functions[STRING_OP_STRLEN], names[STRING_OP_STRLEN]);
+
+    uint8_t *src = malloc(FUZZ_BUFFER_SIZE);
+    uint8_t *dest = malloc(FUZZ_BUFFER_SIZE);
+    uint8_t *expect = malloc(FUZZ_BUFFER_SIZE);
+
+    for (fuzz_iteration = 0; fuzz_iteration < iterations; fuzz_iteration++) {
+        // Mostly small, sometimes big enough for the non-temporal paths
+        size_t size;
+        if (fuzz_iteration % FUZZ_NT_EVERY == FUZZ_NT_EVERY - 1) {
+            size = STRING_NT_THRESHOLD + fuzz_below(FUZZ_STRING_MAX);
+        } else {
+            static const size_t limits[] = { 17, 257, 4097, FUZZ_STRING_MAX };
+            size = fuzz_below(limits[fuzz_below(4)]);
+        }
+
+        size_t src_offset = FUZZ_GUARD + fuzz_below(64);
+        size_t dest_offset = FUZZ_GUARD + fuzz_below(64);
+        fuzz_fill(src + src_offset, size);
+
+        // memcpy
+        for (int f = 0; f < counts[STRING_OP_MEMCPY]; f++) {
+            memset(dest, 0xA5, dest_offset + size + FUZZ_GUARD);
+            void *r = ((memcpy_impl_t)functions[STRING_OP_MEMCPY][f])(dest + dest_offset, src + src_offset, size);
+            if (r != dest + dest_offset || memcmp(dest + dest_offset, src + src_offset, size) || !fuzz_guards_intact(dest, dest_offset, size)) {
+                fuzz_fail("memcpy.%s size %zu dest+%zu src+%zu", names[STRING_OP_MEMCPY][f], size, dest_offset % 64, src_offset % 64);
+            }
+        }
+
+        // memset
+        int value = (int)fuzz_below(256);
+        for (int f = 0; f < counts[STRING_OP_MEMSET]; f++) {
+            memset(dest, 0xA5, dest_offset + size + FUZZ_GUARD);
+            void *r = ((memset_impl_t)functions[STRING_OP_MEMSET][f])(dest + dest_offset, value | 0x1200, size);
+
+            int ok = r == dest + dest_offset && fuzz_guards_intact(dest, dest_offset, size);
+            for (size_t i = 0; ok && i < size; i++) if (dest[dest_offset + i] != value) ok = 0;
+            if (!ok) fuzz_fail("memset.%s size %zu dest+%zu value 0x%x", names[STRING_OP_MEMSET][f], size, dest_offset % 64, value);
+        }
+
+        // memcmp, on a copy with maybe one byte changed
+        memcpy(dest + dest_offset, src + src_offset, size);
+        if (size && fuzz_below(4)) dest[dest_offset + fuzz_below(size)] = (uint8_t)hostbench_random();
+        int expected = fuzz_sign(memcmp(dest + dest_offset, src + src_offset, size));
+        for (int f = 0; f < counts[STRING_OP_MEMCMP]; f++) {
+            int r = ((memcmp_impl_t)functions[STRING_OP_MEMCMP][f])(dest + dest_offset, src + src_offset, size);
+            if (fuzz_sign(r) != expected) fuzz_fail("memcmp.%s size %zu returned %d, expected sign %d", names[STRING_OP_MEMCMP][f], size, r, expected);
+        }
+
+        // strlen, over the random bytes with the zeros taken out
+        if (size <= FUZZ_STRING_MAX) {
+            for (size_t i = 0; i < size; i++) if (!src[src_offset + i]) src[src_offset + i] = 0x80;
+            src[src_offset + size] = 0;
+            for (int f = 0; f < counts[STRING_OP_STRLEN]; f++) {
+                size_t r = ((strlen_impl_t)functions[STRING_OP_STRLEN][f])((char*)src + src_offset);
+                if (r != size) fuzz_fail("strlen.%s length %zu at +%zu returned %zu", names[STRING_OP_STRLEN][f], size, src_offset % 64, r);
+            }
+        }
+
+        // memmove within one buffer, in either direction
+        size_t from = FUZZ_GUARD + fuzz_below(128), to = FUZZ_GUARD + fuzz_below(128);
+        size_t span = (size > FUZZ_STRING_MAX) ? FUZZ_STRING_MAX : size;
+        memset(dest, 0xA5, FUZZ_GUARD + 128 + span + FUZZ_GUARD);
+        fuzz_fill(dest + from, span);
+        memcpy(expect, dest, FUZZ_GUARD + 128 + span + FUZZ_GUARD);
+        memmove(expect + to, expect + from, span);
+        void *r = poly_memmove(dest + to, dest + from, span);
+        if (r != dest + to || memcmp(dest, expect, FUZZ_GUARD + 128 + span + FUZZ_GUARD)) {
+            fuzz_fail("memmove size %zu from +%zu to +%zu", span, from - FUZZ_GUARD, to - FUZZ_GUARD);
+        }
+    }
+
+    free(src);
+    free(dest);
+    free(expect);
+    return fuzz_end(iterations);
+}
+
+/**** PRINTF ****/
+
+static char fuzz_printf_sink_buffer[1024];
+static size_t fuzz_printf_sink_length = 0;
+
+static int fuzz_printf_sink(void *user, const char *buffer, size_t length) {
+    if (fuzz_printf_sink_length + length < sizeof(fuzz_printf_sink_buffer)) {
+        memcpy(fuzz_printf_sink_buffer + fuzz_printf_sink_length, buffer, length);
+    }
+
+    fuzz_printf_sink_length += length;
+    return (int)length;
+}
+
+/**
+ * @brief Format through every libpolyhedron path and cross-check them
+ * @param host Also compare against the host libc
+ */
+static void fuzz_printf_check(int host, const char *format, ...) {
+    char full[1024], truncated[1024], expected[1024];
+    va_list ap, copy;
+    va_start(ap, format);
+
+    // snprintf with plenty of room
+    va_copy(copy, ap);
+    int length = poly_vsnprintf(full, sizeof(full), format, copy);
+    va_end(copy);
+
+    if (length < 0 || (size_t)length >= sizeof(full) || strlen(full) != (size_t)length) {
+        fuzz_fail("vsnprintf(\"%s\") returned %d for \"%s\"", format, length, full);
+        va_end(ap);
+        return;
+    }
+
+    // The write sink has to produce exactly the same bytes
+    va_copy(copy, ap);
+    fuzz_printf_sink_length = 0;
+    size_t written = poly_xvasprintf_write(fuzz_printf_sink, NULL, format, copy);
+    va_end(copy);
+
+    if (written != (size_t)length || fuzz_printf_sink_length != (size_t)length || memcmp(fuzz_printf_sink_buffer, full, length)) {
+        fuzz_fail("xvasprintf_write(\"%s\") wrote %zu bytes, snprintf %d", format, written, length);
+    }
+
+    // A short buffer gets a terminated prefix and the same return value
+    size_t size = fuzz_below(length + 2);
+    memset(truncated, 0x5A, sizeof(truncated));
+    va_copy(copy, ap);
+    int r = poly_vsnprintf(truncated, size, format, copy);
+    va_end(copy);
+
+    if (r != length) {
+        fuzz_fail("vsnprintf(\"%s\") into %zu bytes returned %d, expected %d", format, size, r, length);
+    } else if (size && (memcmp(truncated, full, size - 1) || truncated[size - 1])) {
+        fuzz_fail("vsnprintf(\"%s\") into %zu bytes is not a terminated prefix", format, size);
+    } else if (truncated[size] != 0x5A) {
+        fuzz_fail("vsnprintf(\"%s\") into %zu bytes wrote past the buffer", format, size);
+    }
+
+    if (host) {
+        va_copy(copy, ap);
+        vsnprintf(expected, sizeof(expected), format, copy);
+        va_end(copy);
+        if (strcmp(expected, full)) fuzz_fail("\"%s\" gave \"%s\", host libc \"%s\"", format, full, expected);
+    }
+
+    va_end(ap);
+}
+
+/**
+ * @brief printf against itself (all three output paths), and against the host libc where they agree
+ *
+ * libpolyhedron's printf is not fully conforming, the host comparison is limited to what it does implement:
+ * flags on unsigned conversions and %c/%%. Signed padding, %s width and floats only get the self checks.
+ */
+static int fuzz_printf(uint64_t iterations) {
+    fuzz_begin("printf");
+
+    static const char *flags[] = { "", "-", "0", "#" };
+    static const char *lengths[] = { "", "l", "ll", "z" };
+    static const char *strings[] = { "", "a", "hexahedron", "/device/disk0", "with a %% sign", "long string to push the width" };
+    static const char conversions[] = "diuxXcsf%p";
+
+    for (fuzz_iteration = 0; fuzz_iteration < iterations; fuzz_iteration++) {
+        char conversion = conversions[fuzz_below(sizeof(conversions) - 1)];
+        const char *flag = flags[fuzz_below(4)];
+        const char *length = lengths[fuzz_below(4)];
+        int width = fuzz_below(3) ? (int)fuzz_below(24) : 0;
+
+        // Text around the conversion, sometimes long enough to go past the 128-byte output buffer
+        char prefix[160] = "", suffix[32] = "";
+        size_t prefix_length = fuzz_below(4) ? fuzz_below(8) : fuzz_below(150);
+        for (size_t i = 0; i < prefix_length; i++) prefix[i] = 'a' + fuzz_below(26);
+        prefix[prefix_length] = 0;
+        if (fuzz_below(2)) snprintf(suffix, sizeof(suffix), " end%d", (int)fuzz_below(100));
+
+        // '#' only means something (and only matches the host) for hex
+        int hex = conversion == 'x' || conversion == 'X';
+        if (!hex && !strcmp(flag, "#")) flag = "";
+
+        char format[256];
+        char spec[32];
+        if (width) snprintf(spec, sizeof(spec), "%s%d", flag, width);
+        else snprintf(spec, sizeof(spec), "%s", flag);
+
+        // glibc leaves the 0x off a zero, libpolyhedron does not
+        uint64_t value = hostbench_random() >> fuzz_below(64);
+        if (hex && !strcmp(flag, "#") && !value) value = 1;
+        switch (conversion) {
+            case 'd':
+            case 'i':
+                snprintf(format, sizeof(format), "%s%%%s%s%c%s", prefix, spec, length, conversion, suffix);
+                if (!*length) fuzz_printf_check(0, format, (int)value);
+                else if (!strcmp(length, "l")) fuzz_printf_check(0, format, (long)value);
+                else if (!strcmp(length, "ll")) fuzz_printf_check(0, format, (long long)value);
+                else fuzz_printf_check(0, format, (ssize_t)value);
+
+                // Without padding (or zero padding of a positive number) it has to match
+                snprintf(format, sizeof(format), "%s%%%s%c%s", prefix, length, conversion, suffix);
+                if (!*length) fuzz_printf_check(1, format, (int)value);
+                else if (!strcmp(length, "l")) fuzz_printf_check(1, format, (long)value);
+                else if (!strcmp(length, "ll")) fuzz_printf_check(1, format, (long long)value);
+                else fuzz_printf_check(1, format, (ssize_t)value);
+                break;
+
+            case 'u':
+            case 'x':
+            case 'X':
+                snprintf(format, sizeof(format), "%s%%%s%s%c%s", prefix, spec, length, conversion, suffix);
+                if (!*length) fuzz_printf_check(1, format, (unsigned int)value);
+                else if (!strcmp(length, "l")) fuzz_printf_check(1, format, (unsigned long)value);
+                else if (!strcmp(length, "ll")) fuzz_printf_check(1, format, (unsigned long long)value);
+                else fuzz_printf_check(1, format, (size_t)value);
+                break;
+
+            case 'c':
+                snprintf(format, sizeof(format), "%s%%c%s", prefix, suffix);
+                fuzz_printf_check(1, format, 'A' + (int)fuzz_below(26));
+                break;
+
+            case 's':
+                snprintf(format, sizeof(format), "%s%%%ss%s", prefix, spec, suffix);
+                fuzz_printf_check(0, format, strings[fuzz_below(sizeof(strings) / sizeof(*strings))]);
+                snprintf(format, sizeof(format), "%s%%s%s", prefix, suffix);
+                fuzz_printf_check(1, format, strings[fuzz_below(sizeof(strings) / sizeof(*strings))]);
+                break;
+
+            case 'f':
+                snprintf(format, sizeof(format), "%s%%.%df%s", prefix, (int)fuzz_below(10), suffix);
+                fuzz_printf_check(0, format, (double)(int64_t)value / (double)(1 + fuzz_below(1000)));
+                break;
+
+            case 'p':
+                snprintf(format, sizeof(format), "%s%%p%s", prefix, suffix);
+                fuzz_printf_check(0, format, (void*)(uintptr_t)value);
+                break;
+
+            default:
+                snprintf(format, sizeof(format), "%s%%%%%s", prefix, suffix);
+                fuzz_printf_check(1, format);
+                break;
+        }
+    }
+
+    return fuzz_end(iterations);
+}
+
+/**** STRTOL ****/
+
+/**
+ * @brief strtol and friends against the host libc (value and end pointer)
+ */
+static int fuzz_strtol(uint64_t iterations) {
+    fuzz_begin("strtol");
+
+    static const int bases[] = { 0, 2, 8, 10, 16, 36 };
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    static const char garbage[] = "0123456789abcdefghijzABCDEFZ .-+_";   // No 'x', "0x" without hex digits is one of those cases
+
+    for (fuzz_iteration = 0; fuzz_iteration < iterations; fuzz_iteration++) {
+        int base = bases[fuzz_below(6)];
+
+        // [spaces][sign][prefix]digits[garbage]
+        // There is always a digit and never an overflow, libpolyhedron does not handle those cases like the standard says
+        char input[80];
+        size_t n = 0;
+        int digit_base = base;
+        for (int i = fuzz_below(3); i > 0; i--) input[n++] = ' ';
+        if (fuzz_below(3) == 0) input[n++] = fuzz_below(2) ? '-' : '+';
+        if ((base == 0 || base == 16) && fuzz_below(2)) {
+            input[n++] = '0';
+            input[n++] = fuzz_below(2) ? 'x' : 'X';
+            digit_base = 16;
+        } else if (base == 0 && fuzz_below(3) == 0) {
+            input[n++] = '0';
+            digit_base = 8;
+        } else if (base == 0) {
+            digit_base = 10;
+        }
+
+        int max_digits = (digit_base == 2) ? 60 : (digit_base == 8) ? 19 : (digit_base == 16) ? 14 : (digit_base == 36) ? 11 : 15;
+        for (int i = 1 + fuzz_below(max_digits); i > 0; i--) input[n++] = digits[fuzz_below(digit_base)];
+        if (fuzz_below(2)) input[n++] = garbage[fuzz_below(sizeof(garbage) - 1)];
+        input[n] = 0;
+
+        char *end, *expected_end;
+        long l = poly_strtol(input, &end, base);
+        long el = strtol(input, &expected_end, base);
+        if (l != el || end != expected_end) fuzz_fail("strtol(\"%s\", %d) = %ld (end +%td), expected %ld (end +%td)", input, base, l, end - input, el, expected_end - input);
+
+        long long ll = poly_strtoll(input, &end, base);
+        long long ell = strtoll(input, &expected_end, base);
+        if (ll != ell || end != expected_end) fuzz_fail("strtoll(\"%s\", %d) = %lld (end +%td), expected %lld (end +%td)", input, base, ll, end - input, ell, expected_end - input);
+
+        unsigned long ul = poly_strtoul(input, &end, base);
+        unsigned long eul = strtoul(input, &expected_end, base);
+        if (ul != eul || end != expected_end) fuzz_fail("strtoul(\"%s\", %d) = %lu (end +%td), expected %lu (end +%td)", input, base, ul, end - input, eul, expected_end - input);
+
+        unsigned long long ull = poly_strtoull(input, &end, base);
+        unsigned long long eull = strtoull(input, &expected_end, base);
+        if (ull != eull || end != expected_end) fuzz_fail("strtoull(\"%s\", %d) = %llu (end +%td), expected %llu (end +%td)", input, base, ull, end - input, eull, expected_end - input);
+    }
+
+    return fuzz_end(iterations);
+}
+
+/**** TIME ****/
+
+/* 2100-01-01 */
+#define FUZZ_TIME_MAX           4102444800ULL
+
+/**
+ * @brief gmtime_r against the host libc
+ */
+static int fuzz_gmtime(uint64_t iterations) {
+    fuzz_begin("gmtime");
+
+    for (fuzz_iteration = 0; fuzz_iteration < iterations; fuzz_iteration++) {
+        // libpolyhedron stops at 2100
+        time_t t = (time_t)fuzz_below(FUZZ_TIME_MAX);
+        struct poly_tm tm;
+        struct tm expected;
+        gmtime_r(&t, &expected);
+
+        if (!poly_gmtime_r(&t, &tm)) {
+            fuzz_fail("gmtime_r(%ld) failed", (long)t);
+        } else if (tm.tm_sec != expected.tm_sec || tm.tm_min != expected.tm_min || tm.tm_hour != expected.tm_hour ||
+            tm.tm_mday != expected.tm_mday || tm.tm_mon != expected.tm_mon || tm.tm_year != expected.tm_year ||
+            tm.tm_wday != expected.tm_wday || tm.tm_yday != expected.tm_yday) {
+            fuzz_fail("gmtime_r(%ld) = %d-%02d-%02d %02d:%02d:%02d wday %d yday %d, expected %d-%02d-%02d %02d:%02d:%02d wday %d yday %d",
+                    (long)t, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_wday, tm.tm_yday,
+                    expected.tm_year + 1900, expected.tm_mon + 1, expected.tm_mday, expected.tm_hour, expected.tm_min, expected.tm_sec,
+                    expected.tm_wday, expected.tm_yday);
+        }
+    }
+
+    return fuzz_end(iterations);
+}
+
+/**** HASHMAP ****/
+
+#define FUZZ_HASHMAP_KEYS       256
+
+/**
+ * @brief Random hashmap operations against an array model
+ */
+static int fuzz_hashmap(uint64_t iterations) {
+    fuzz_begin("hashmap");
+
+    char keys[FUZZ_HASHMAP_KEYS][24];
+    for (int i = 0; i < FUZZ_HASHMAP_KEYS; i++) snprintf(keys[i], sizeof(keys[i]), (i & 1) ? "key%d" : "/path/%d", i * 37);
+
+    uintptr_t values[FUZZ_HASHMAP_KEYS];
+    int present[FUZZ_HASHMAP_KEYS] = { 0 };
+    size_t count = 0;
+    hashmap_t *map = hashmap_create("fuzz", 1 + fuzz_below(64));
+
+    for (fuzz_iteration = 0; fuzz_iteration < iterations; fuzz_iteration++) {
+        int k = (int)fuzz_below(FUZZ_HASHMAP_KEYS);
+        char key[24];
+        strcpy(key, keys[k]);   // A different pointer every time, the map has to compare contents
+
+        switch (fuzz_below(5)) {
+            case 0:
+            case 1: {
+                uintptr_t value = (uintptr_t)hostbench_random();
+                hashmap_set(map, key, (void*)value);
+                if (!present[k]) count++;
+                present[k] = 1;
+                values[k] = value;
+                break;
+            }
+
+            case 2: {
+                uintptr_t value = (uintptr_t)hashmap_get(map, key);
+                uintptr_t expected = present[k] ? values[k] : 0;
+                if (value != expected) fuzz_fail("hashmap_get(\"%s\") = %#lx, expected %#lx", key, (unsigned long)value, (unsigned long)expected);
+                if (hashmap_has(map, key) != present[k]) fuzz_fail("hashmap_has(\"%s\") != %d", key, present[k]);
+                break;
+            }
+
+            case 3: {
+                uintptr_t value = (uintptr_t)hashmap_remove(map, key);
+                uintptr_t expected = present[k] ? values[k] : 0;
+                if (value != expected) fuzz_fail("hashmap_remove(\"%s\") = %#lx, expected %#lx", key, (unsigned long)value, (unsigned long)expected);
+                if (present[k]) count--;
+                present[k] = 0;
+                break;
+            }
+
+            default: {
+                // Every key exactly once
+                list_t *list = hashmap_keys(map);
+                if (list->length != count) fuzz_fail("hashmap_keys() has %zu keys, expected %zu", list->length, count);
+                list_destroy(list, false);
+
+                // Start over with a different bucket count now and then
+                if (!fuzz_below(64)) {
+                    hashmap_free(map);
+                    map = hashmap_create("fuzz", 1 + fuzz_below(64));
+                    memset(present, 0, sizeof(present));
+                    count = 0;
+                }
+                break;
+            }
+        }
+    }
+
+    hashmap_free(map);
+    return fuzz_end(iterations);
+}
+
+/**** LIST ****/
+
+#define FUZZ_LIST_MAX           64
+
+/**
+ * @brief Check a list against its model, both ways
+ */
+static void fuzz_list_verify(list_t *list, uintptr_t *model, size_t length) {
+    if (list->length != length) {
+        fuzz_fail("list has length %zu, expected %zu", list->length, length);
+        return;
+    }
+
+    size_t i = 0;
+    node_t *prev = NULL;
+    foreach(node, list) {
+        if (i >= length || (uintptr_t)node->value != model[i] || node->prev != prev) {
+            fuzz_fail("list node %zu is wrong", i);
+            return;
+        }
+        prev = node;
+        i++;
+    }
+
+    if (i != length || list->tail != prev) fuzz_fail("list walk ended after %zu nodes, expected %zu", i, length);
+}
+
+/**
+ * @brief Random list operations against an array model
+ */
+static int fuzz_list(uint64_t iterations) {
+    fuzz_begin("list");
+
+    list_t *list = list_create("fuzz");
+    uintptr_t model[FUZZ_LIST_MAX + 1];
+    size_t length = 0;
+
+    for (fuzz_iteration = 0; fuzz_iteration < iterations; fuzz_iteration++) {
+        switch (fuzz_below(6)) {
+            case 0:
+            case 1:
+                if (length < FUZZ_LIST_MAX) {
+                    uintptr_t value = 1 + fuzz_below(1000);
+                    list_append(list, (void*)value);
+                    model[length++] = value;
+                }
+                break;
+
+            case 2: {
+                node_t *node = list_pop(list);
+                if (!length) {
+                    if (node) fuzz_fail("list_pop() on an empty list returned a node");
+                    break;
+                }
+                if (!node || (uintptr_t)node->value != model[length - 1]) fuzz_fail("list_pop() returned the wrong node");
+                kfree(node);
+                length--;
+                break;
+            }
+
+            case 3: {
+                node_t *node = list_popleft(list);
+                if (!length) {
+                    if (node) fuzz_fail("list_popleft() on an empty list returned a node");
+                    break;
+                }
+                if (!node || (uintptr_t)node->value != model[0]) fuzz_fail("list_popleft() returned the wrong node");
+                kfree(node);
+                memmove(model, model + 1, --length * sizeof(uintptr_t));
+                break;
+            }
+
+            case 4: {
+                // Includes one past the end, which must be ignored
+                size_t index = fuzz_below(length + 2);
+                list_delete_index(list, index);
+                if (index < length) memmove(model + index, model + index + 1, (--length - index) * sizeof(uintptr_t));
+                break;
+            }
+
+            default: {
+                uintptr_t value = 1 + fuzz_below(1000);
+                node_t *node = list_find(list, (void*)value);
+                size_t i = 0;
+                while (i < length && model[i] != value) i++;
+                if ((i < length) != (node != NULL) || (node && (uintptr_t)node->value != value)) fuzz_fail("list_find(%lu) is wrong", (unsigned long)value);
+                break;
+            }
+        }
+
+        fuzz_list_verify(list, model, length);
+    }
+
+    list_destroy(list, false);
+    return fuzz_end(iterations);
+}
+
+/**** JSON ****/
+
+/**
+ * @brief Write a random JSON value
+ * @returns The new length
+ */
+static size_t fuzz_json_value(char *out, size_t length, size_t limit, int depth) {
+    if (length + 64 > limit) return length + sprintf(out + length, "0");
+
+    switch (fuzz_below(depth < 4 ? 7 : 5)) {
+        case 0: return length + sprintf(out + length, "%ld", (long)(hostbench_random() >> fuzz_below(64)) * (fuzz_below(2) ? 1 : -1));
+        case 1: return length + sprintf(out + length, "%d.%de%d", (int)fuzz_below(1000), (int)fuzz_below(1000), (int)fuzz_below(20) - 10);
+        case 2: return length + sprintf(out + length, "\"str\\\"ing\\n%d\\u00e9\"", (int)fuzz_below(1000));
+        case 3: return length + sprintf(out + length, fuzz_below(2) ? "true" : "false");
+        case 4: return length + sprintf(out + length, "null");
+
+        case 5: {
+            out[length++] = '[';
+            for (int i = fuzz_below(6); i > 0; i--) {
+                length = fuzz_json_value(out, length, limit, depth + 1);
+                if (i > 1) out[length++] = ',';
+            }
+            out[length++] = ']';
+            out[length] = 0;
+            return length;
+        }
+
+        default: {
+            out[length++] = '{';
+            for (int i = fuzz_below(6); i > 0; i--) {
+                length += sprintf(out + length, " \"k%d\" : ", (int)fuzz_below(100));
+                length = fuzz_json_value(out, length, limit, depth + 1);
+                if (i > 1) out[length++] = ',';
+            }
+            out[length++] = '}';
+            out[length] = 0;
+            return length;
+        }
+    }
+}
+
+/**
+ * @brief JSON: generated documents have to parse, mutated and truncated ones must not crash or leak
+ */
+static int fuzz_json(uint64_t iterations) {
+    fuzz_begin("json");
+
+    char document[8192];
+    for (fuzz_iteration = 0; fuzz_iteration < iterations; fuzz_iteration++) {
+        // Always an array at the top, so the element count can be checked
+        size_t length = 0;
+        int elements = (int)fuzz_below(8);
+        document[length++] = '[';
+        for (int i = 0; i < elements; i++) {
+            length = fuzz_json_value(document, length, sizeof(document) - 128, 1);
+            if (i < elements - 1) document[length++] = ',';
+        }
+        document[length++] = ']';
+        document[length] = 0;
+
+        size_t live = shim_live;
+        json_value *value = json_parse(document, length);
+        if (!value || value->type != json_array || value->u.array.length != (unsigned)elements) {
+            fuzz_fail("generated document did not parse: %.200s", document);
+        }
+        if (value) json_value_free(value);
+
+        // Break it
+        for (int i = 1 + fuzz_below(4); i > 0; i--) {
+            switch (fuzz_below(3)) {
+                case 0: document[fuzz_below(length)] = (char)hostbench_random(); break;
+                case 1: document[fuzz_below(length)] = "[]{}\",:\\0e-"[fuzz_below(11)]; break;
+                default: length = fuzz_below(length + 1); break;
+            }
+        }
+
+        value = json_parse(document, length);
+        if (value) json_value_free(value);
+
+        if (shim_live != live) fuzz_fail("json_parse leaked %zd allocations", (ssize_t)(shim_live - live));
+    }
+
+    return fuzz_end(iterations);
+}
+
+/**
+ * @brief Run the fuzzers
+ * @param iterations Cases per fuzzer
+ * @returns The amount of failures
+ */
+int fuzz_run(uint64_t iterations) {
+    int failures = 0;
+    failures += fuzz_strings(iterations);
+    failures += fuzz_printf(iterations);
+    failures += fuzz_strtol(iterations);
+    failures += fuzz_gmtime(iterations);
+    failures += fuzz_hashmap(iterations);
+    failures += fuzz_list(iterations);
+    failures += fuzz_json(iterations);
+    return failures;
+}
@@ -0,0 +1,153 @@
+/**
+ * @file hostbench/hostbench.h
+ * @brief Host benchmark and fuzz harness for libkstructures and libpolyhedron
+ *
+ * The harness is built with the host libc. Everything libpolyhedron defines is renamed to poly_*
+ * when the libraries are linked (see the Makefile), so it is declared here under those names.
+ * libkstructures keeps its names and is used through its own headers.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef HOSTBENCH_H
+#define HOSTBENCH_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <time.h>
+
+// The variant interface comes straight from libpolyhedron
+#define string_getFeatures poly_string_getFeatures
+#define string_getVariants poly_string_getVariants
+#define string_getSelected poly_string_getSelected
+#define string_benchmark poly_string_benchmark
+#include <bits/string_impl.h>
+
+/**** TYPES ****/
+
+// libpolyhedron's struct tm (it has two extra fields)
+struct poly_tm {
+    int tm_sec;
+    int tm_min;
+    int tm_hour;
+    int tm_mday;
+    int tm_mon;
+    int tm_year;
+    int tm_wday;
+    int tm_yday;
+    int tm_isdst;
+    const char *_tm_zone_name;
+    int _tm_zone_offset;
+};
+
+typedef int (*poly_write_callback_t)(void *user, const char *buffer, size_t length);
+
+/**
+ * @brief Benchmark body
+ * @param context The benchmark's context
+ * @param iterations How many times to do the measured operation
+ */
+typedef void (*bench_fn_t)(void *context, uint64_t iterations);
+
+/**** libpolyhedron ****/
+
+void *poly_memcpy(void *__restrict dest, const void *__restrict src, size_t n);
+void *poly_memmove(void *dest, const void *src, size_t n);
+void *poly_memset(void *dest, int c, size_t n);
+void *poly_memset_nt(void *dest, int c, size_t n);
+int poly_memcmp(const void *a, const void *b, size_t n);
+size_t poly_strlen(const char *s);
+int poly_strcmp(const char *a, const char *b);
+char *poly_strchr(const char *s, int c);
+char *poly_strstr(const char *haystack, const char *needle);
+
+int poly_snprintf(char *str, size_t size, const char *format, ...);
+int poly_vsnprintf(char *str, size_t size, const char *format, va_list ap);
+size_t poly_xvasprintf_write(poly_write_callback_t write, void *user, const char *format, va_list args);
+
+long poly_strtol(const char *s, char **end, int base);
+unsigned long poly_strtoul(const char *s, char **end, int base);
+long long poly_strtoll(const char *s, char **end, int base);
+unsigned long long poly_strtoull(const char *s, char **end, int base);
+double poly_strtod(const char *s, char **end);
+double poly_pow(double x, double y);
+int poly_atoi(const char *s);
+
+struct poly_tm *poly_gmtime_r(const time_t *t, struct poly_tm *buf);
+size_t poly_strftime(char *s, size_t max, const char *format, const struct poly_tm *tm);
+
+/**** SHIM (shim.c) ****/
+
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+extern uint64_t shim_allocations;       // Calls to kmalloc/kcalloc/krealloc(NULL)
+extern uint64_t shim_frees;             // Calls to kfree
+extern size_t shim_live;                // Allocations not freed yet
+
+/**** HARNESS ****/
+
+/**
+ * @brief Get a monotonic timestamp in nanoseconds
+ */
+uint64_t hostbench_now();
+
+/**
+ * @brief Get the next number from the harness PRNG (xorshift64*)
+ */
+uint64_t hostbench_random();
+
+/**
+ * @brief Seed the harness PRNG
+ */
+void hostbench_seed(uint64_t seed);
+
+/**
+ * @brief Calibrate and time a benchmark body
+ *
+ * The iteration count is doubled until one run takes long enough to time, then the best of a few runs is kept.
+ *
+ * @param fn The body
+ * @param context Context for the body
+ * @param allocs_per_op Optional output for the shim allocations per iteration
+ * @returns Nanoseconds per iteration
+ */
+double hostbench_measure(bench_fn_t fn, void *context, double *allocs_per_op);
+
+/**
+ * @brief Emit a result line
+ * @param name The benchmark name ("suite.case/parameter")
+ * @param value The measured value
+ * @param unit The unit ("ns/op", "MB/s", ...)
+ * @param higher_is_better Whether a higher value is an improvement
+ * @param allocs_per_op Shim allocations per operation (negative to leave it out)
+ */
+void hostbench_result(const char *name, double value, const char *unit, int higher_is_better, double allocs_per_op);
+
+/**
+ * @brief Run the benchmarks
+ * @param filter Only run benchmarks whose name contains this (or NULL)
+ */
+void bench_run(const char *filter);
+
+/**
+ * @brief Run the fuzzers
+ * @param iterations Cases per fuzzer
+ * @returns The amount of failures
+ */
+int fuzz_run(uint64_t iterations);
+
+/**
+ * @brief Run the regression tests
+ * @returns The amount of failures
+ */
+int test_run();
+
+#endif
@@ -0,0 +1,170 @@
+/**
+ * @file hostbench/main.c
+ * @brief Host benchmark and fuzz harness entrypoint
+ *
+ * Results are JSON lines on stdout: one header object describing the run, then one object per benchmark.
+ * compare.py diffs two of these files.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "hostbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A run has to take this long before it is timed */
+#define BENCH_MIN_RUN_NS        20000000ULL
+
+/* Timed runs per benchmark (the best one is kept) */
+#define BENCH_RUNS              5
+
+/* PRNG state */
+static uint64_t hostbench_state = 0x9E3779B97F4A7C15ULL;
+
+/**
+ * @brief Get a monotonic timestamp in nanoseconds
+ */
+uint64_t hostbench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Seed the harness PRNG
+ */
+void hostbench_seed(uint64_t seed) {
+    hostbench_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * @brief Get the next number from the harness PRNG (xorshift64*)
+ */
+uint64_t hostbench_random() {
+    hostbench_state ^= hostbench_state >> 12;
+    hostbench_state ^= hostbench_state << 25;
+    hostbench_state ^= hostbench_state >> 27;
+    return hostbench_state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @brief Calibrate and time a benchmark body
+ * @returns Nanoseconds per iteration
+ */
+double hostbench_measure(bench_fn_t fn, void *context, double *allocs_per_op) {
+    // Find an iteration count that runs long enough (this doubles as the warmup)
+    uint64_t iterations = 1;
+    while (1) {
+        uint64_t start = hostbench_now();
+        fn(context, iterations);
+        uint64_t elapsed = hostbench_now() - start;
+        if (elapsed >= BENCH_MIN_RUN_NS || iterations >= (1ULL << 40)) break;
+
+        // Jump close to the target when there is something to go by
+        if (elapsed > BENCH_MIN_RUN_NS / 64) {
+            iterations = iterations * BENCH_MIN_RUN_NS / elapsed + 1;
+        } else {
+            iterations *= 2;
+        }
+    }
+
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        uint64_t allocations = shim_allocations;
+        uint64_t start = hostbench_now();
+        fn(context, iterations);
+        uint64_t elapsed = hostbench_now() - start;
+
+        double per_op = (double)elapsed / (double)iterations;
+        if (!run || per_op < best) best = per_op;
+        if (allocs_per_op) *allocs_per_op = (double)(shim_allocations - allocations) / (double)iterations;
+    }
+
+    return best;
+}
+
+/**
+ * @brief Emit a result line
+ */
+void hostbench_result(const char *name, double value, const char *unit, int higher_is_better, double allocs_per_op) {
+    printf("{\"name\": \"%s\", \"value\": %.4f, \"unit\": \"%s\", \"better\": \"%s\"", name, value, unit, higher_is_better ? "higher" : "lower");
+    if (allocs_per_op >= 0) printf(", \"allocs_per_op\": %.3f", allocs_per_op);
+    printf("}\n");
+    fflush(stdout);
+}
+
+/**
+ * @brief Print the header object describing this run
+ */
+static void hostbench_header() {
+    // CPU model
+    char model[128] = "unknown";
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (cpuinfo) {
+        char line[256];
+        while (fgets(line, sizeof(line), cpuinfo)) {
+            if (strncmp(line, "model name", 10)) continue;
+            char *value = strchr(line, ':');
+            if (!value) break;
+            value += 2;
+            value[strcspn(value, "\n")] = 0;
+            snprintf(model, sizeof(model), "%s", value);
+            break;
+        }
+        fclose(cpuinfo);
+    }
+
+    // Features the string routines detected
+    static const struct { int bit; const char *name; } feature_names[] = {
+        { STRING_FEAT_SSE2, "sse2" }, { STRING_FEAT_AVX2, "avx2" }, { STRING_FEAT_ERMS, "erms" }, { STRING_FEAT_FSRM, "fsrm" },
+    };
+
+    char features[64] = "";
+    int detected = poly_string_getFeatures();
+    for (size_t i = 0; i < sizeof(feature_names) / sizeof(*feature_names); i++) {
+        if (!(detected & feature_names[i].bit)) continue;
+        if (*features) strcat(features, " ");
+        strcat(features, feature_names[i].name);
+    }
+
+    const char *revision = getenv("HOSTBENCH_REVISION");
+    printf("{\"hostbench\": 1, \"revision\": \"%s\", \"cpu\": \"%s\", \"features\": \"%s\", \"runs\": %d}\n",
+            revision ? revision : "unknown", model, features, BENCH_RUNS);
+    fflush(stdout);
+}
+
+/**
+ * @brief Usage
+ */
+static int usage(const char *name) {
+    fprintf(stderr, "Usage: %s bench [FILTER]\n", name);
+    fprintf(stderr, "       %s fuzz [ITERATIONS] [SEED]\n", name);
+    fprintf(stderr, "       %s test\n", name);
+    fprintf(stderr, "\nbench prints one JSON object per line, compare two runs with compare.py.\n");
+    fprintf(stderr, "Set HOSTBENCH_REVISION to record the revision in the header line.\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) return usage(argv[0]);
+
+    if (!strcmp(argv[1], "bench")) {
+        hostbench_header();
+        bench_run(argc > 2 ? argv[2] : NULL);
+        return 0;
+    } else if (!strcmp(argv[1], "fuzz")) {
+        uint64_t iterations = argc > 2 ? strtoull(argv[2], NULL, 0) : 100000;
+        hostbench_seed(argc > 3 ? strtoull(argv[3], NULL, 0) : 1);
+        return fuzz_run(iterations) ? 1 : 0;
+    } else if (!strcmp(argv[1], "test")) {
+        return test_run() ? 1 : 0;
+    }
+
+    return usage(argv[0]);
+}
@@ -0,0 +1,129 @@
+/**
+ * @file hostbench/shim.c
+ * @brief The kernel functions libkstructures and libpolyhedron call, implemented on the host libc
+ *
+ * The allocator counts calls so benchmarks can report allocations per operation.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "hostbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* Allocation statistics */
+uint64_t shim_allocations = 0;
+uint64_t shim_frees = 0;
+size_t shim_live = 0;
+
+/**
+ * @brief Kernel memory allocator
+ */
+void *kmalloc(size_t size) {
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        fprintf(stderr, "hostbench: out of memory allocating %zu bytes\n", size);
+        abort();
+    }
+
+    shim_allocations++;
+    shim_live++;
+    return ptr;
+}
+
+/**
+ * @brief Kernel zeroed memory allocator
+ */
+void *kcalloc(size_t elements, size_t size) {
+    void *ptr = kmalloc(elements * size);
+    memset(ptr, 0, elements * size);
+    return ptr;
+}
+
+/**
+ * @brief Kernel reallocation
+ */
+void *krealloc(void *ptr, size_t size) {
+    if (!ptr) return kmalloc(size);
+
+    void *new = realloc(ptr, size ? size : 1);
+    if (!new) {
+        fprintf(stderr, "hostbench: out of memory reallocating %zu bytes\n", size);
+        abort();
+    }
+
+    return new;
+}
+
+/**
+ * @brief Free kernel memory
+ */
+void kfree(void *ptr) {
+    if (!ptr) return;
+    shim_frees++;
+    shim_live--;
+    free(ptr);
+}
+
+/**
+ * @brief Panic
+ */
+void kernel_panic(uint32_t bugcode, char *module) {
+    fprintf(stderr, "hostbench: kernel_panic(0x%x) from %s\n", bugcode, module ? module : "(none)");
+    abort();
+}
+
+/**
+ * @brief Panic with a message
+ */
+void kernel_panic_extended(uint32_t bugcode, char *module, char *format, ...) {
+    fprintf(stderr, "hostbench: kernel_panic(0x%x) from %s: ", bugcode, module ? module : "(none)");
+
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+
+    abort();
+}
+
+/**
+ * @brief Debug log (libpolyhedron only logs from abort() and malloc())
+ */
+int dprintf_internal(char *module, int status, char *format, ...) {
+    if (module) fprintf(stderr, "[%s] ", module);
+
+    va_list ap;
+    va_start(ap, format);
+    int r = vfprintf(stderr, format, ap);
+    va_end(ap);
+    return r;
+}
+
+/**
+ * @brief Clock
+ */
+int clock_gettimeofday(struct timeval *t, void *z) {
+    return gettimeofday(t, NULL);
+}
+
+/**
+ * @brief Terminal (printf/putchar end up here), sent to stderr to keep the results clean
+ */
+int terminal_write(void *user, const char *buffer, size_t length) {
+    return (int)fwrite(buffer, 1, length, stderr);
+}
+
+/**
+ * @brief Flush the terminal
+ */
+void terminal_flush() {
+    fflush(stderr);
+}
@@ -0,0 +1,225 @@
+/**
+ * @file hostbench/test.c
+ * @brief Regression tests for library bugs the fuzzers found
+ *
+ * Each test pins one bug down with a fixed input, so it keeps failing the same way if the bug comes back.
+ * Failures are printed as JSON lines, followed by one summary line per test.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include "hostbench.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <structs/hashmap.h>
+#include <structs/list.h>
+#include <structs/tree.h>
+
+/* Current test */
+static const char *test_name = NULL;
+static int test_failures = 0;
+
+/**
+ * @brief Report a failure
+ */
+static void test_fail(const char *format, ...) {
+    test_failures++;
+
+    char message[512];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+
+    // Keep the line valid JSON
+    for (char *c = message; *c; c++) if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) *c = '?';
+
+    printf("{\"test\": \"%s\", \"failure\": \"%s\"}\n", test_name, message);
+    fflush(stdout);
+}
+
+/**
+ * @brief Start a test
+ */
+static void test_begin(const char *name) {
+    test_name = name;
+    test_failures = 0;
+}
+
+/**
+ * @brief Finish a test and print its summary
+ * @returns The amount of failures
+ */
+static int test_end() {
+    printf("{\"test\": \"%s\", \"failures\": %d}\n", test_name, test_failures);
+    fflush(stdout);
+    return test_failures;
+}
+
+/**** STRTOL ****/
+
+/**
+ * @brief The strtol family stops at the first digit that is not valid in the base
+ */
+static int test_strtol_base_digits() {
+    test_begin("strtol_base_digits");
+
+    static const struct { const char *input; int base; long long value; size_t used; } cases[] = {
+        { "19", 8, 1, 1 },
+        { "777", 7, 0, 0 },
+        { "1012", 2, 5, 3 },
+        { "89", 9, 8, 1 },
+        { "-19", 8, -1, 2 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+        const char *input = cases[i].input;
+        int base = cases[i].base;
+        char *end_l, *end_ul, *end_ll, *end_ull;
+
+        long l = poly_strtol(input, &end_l, base);
+        unsigned long ul = poly_strtoul(input, &end_ul, base);
+        long long ll = poly_strtoll(input, &end_ll, base);
+        unsigned long long ull = poly_strtoull(input, &end_ull, base);
+
+        if (l != cases[i].value || (size_t)(end_l - input) != cases[i].used) test_fail("strtol('%s', %d) = %ld using %zu characters", input, base, l, (size_t)(end_l - input));
+        if (ll != cases[i].value || (size_t)(end_ll - input) != cases[i].used) test_fail("strtoll('%s', %d) = %lld using %zu characters", input, base, ll, (size_t)(end_ll - input));
+
+        if (ul != (unsigned long)cases[i].value || (size_t)(end_ul - input) != cases[i].used) test_fail("strtoul('%s', %d) = %lu using %zu characters", input, base, ul, (size_t)(end_ul - input));
+        if (ull != (unsigned long long)cases[i].value || (size_t)(end_ull - input) != cases[i].used) test_fail("strtoull('%s', %d) = %llu using %zu characters", input, base, ull, (size_t)(end_ull - input));
+    }
+
+    return test_end();
+}
+
+/**** POW ****/
+
+/**
+ * @brief pow returns a double for fractional bases and negative exponents, and doesn't spin on huge exponents
+ */
+static int test_pow() {
+    test_begin("pow");
+
+    static const struct { double x; double y; double result; } cases[] = {
+        { 2.0, 10.0, 1024.0 },
+        { 2.5, 2.0, 6.25 },
+        { 2.0, -2.0, 0.25 },
+        { 10.0, -3.0, 0.001 },
+        { 10.0, 300.0, 1e300 },
+        { 3.0, 0.0, 1.0 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+        double result = poly_pow(cases[i].x, cases[i].y);
+        double error = (result - cases[i].result) / cases[i].result;
+        if (error > 1e-12 || error < -1e-12) test_fail("pow(%g, %g) = %g, expected %g", cases[i].x, cases[i].y, result, cases[i].result);
+    }
+
+    // json_parse passes exponents straight from the document. SIGALRM ends the run if this spins.
+    alarm(10);
+    double result = poly_pow(1.0, 1e18);
+    alarm(0);
+    if (result != 1.0) test_fail("pow(1, 1e18) = %g, expected 1", result);
+
+    return test_end();
+}
+
+/**** HASHMAP ****/
+
+/**
+ * @brief hashmap_free frees everything hashmap_create and hashmap_set allocated, the hashmap included
+ */
+static int test_hashmap_free() {
+    test_begin("hashmap_free");
+
+    size_t live = shim_live;
+    hashmap_t *map = hashmap_create("test", 4);
+
+    // More keys than buckets, so some of them chain
+    char key[16];
+    for (uintptr_t i = 0; i < 8; i++) {
+        snprintf(key, sizeof(key), "key%lu", (unsigned long)i);
+        hashmap_set(map, key, (void*)i);
+    }
+
+    hashmap_free(map);
+    if (shim_live != live) test_fail("hashmap_free leaked %zu allocations", shim_live - live);
+
+    return test_end();
+}
+
+/**** LIST ****/
+
+/**
+ * @brief list_delete_index frees the node it removes and ignores an index past the end
+ */
+static int test_list_delete_index() {
+    test_begin("list_delete_index");
+
+    list_t *list = list_create("test");
+    for (uintptr_t i = 1; i <= 3; i++) list_append(list, (void*)i);
+
+    size_t live = shim_live;
+    list_delete_index(list, 1);
+    if (list->length != 2 || (uintptr_t)list->head->value != 1 || (uintptr_t)list->tail->value != 3) test_fail("list_delete_index(1) removed the wrong node");
+    if (shim_live != live - 1) test_fail("list_delete_index(1) leaked the removed node");
+
+    // index == length is one past the end
+    list_delete_index(list, list->length);
+    if (list->length != 2) test_fail("list_delete_index(length) removed a node");
+
+    list_destroy(list, false);
+    return test_end();
+}
+
+/**** TREE ****/
+
+/**
+ * @brief tree_delete frees the deleted subtree, its children lists and the parent's list node
+ */
+static int test_tree_delete() {
+    test_begin("tree_delete");
+
+    size_t live = shim_live;
+    tree_t *tree = tree_create("test");
+    tree_set_parent(tree, (void*)1);
+
+    // Deleting a subtree has to give back everything inserting it took
+    size_t before_subtree = shim_live;
+    tree_node_t *child = tree_insert_child(tree, tree->root, (void*)2);
+    tree_insert_child(tree, child, (void*)3);
+    tree_insert_child(tree, child, (void*)4);
+
+    tree_delete(tree, child);
+    if (tree->nodes != 1 || tree->root->children->length) test_fail("tree_delete left %zu nodes, expected 1", tree->nodes);
+    if (shim_live != before_subtree) test_fail("tree_delete(subtree) leaked %zu allocations", shim_live - before_subtree);
+
+    // Same for the root
+    tree_insert_child(tree, tree->root, (void*)5);
+    tree_delete(tree, tree->root);
+    kfree(tree);
+    if (shim_live != live) test_fail("tree_delete(root) leaked %zu allocations", shim_live - live);
+
+    return test_end();
+}
+
+/**
+ * @brief Run the regression tests
+ * @returns The amount of failures
+ */
+int test_run() {
+    int failures = 0;
+    failures += test_strtol_base_digits();
+    failures += test_pow();
+    failures += test_hashmap_free();
+    failures += test_list_delete_index();
+    failures += test_tree_delete();
+    return failures;
+}
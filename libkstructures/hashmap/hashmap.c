@@ -244,6 +244,7 @@ void hashmap_free(hashmap_t *hashmap) {
         }
     }
 
-    // Free the entry map
+    // Free the entry map and the hashmap
     kfree(hashmap->entries);
+    kfree(hashmap);
 }
\ No newline at end of file
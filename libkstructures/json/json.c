@@ -263,7 +263,9 @@ json_value * json_parse_ex (json_settings * settings,
    json_state state = { 0 };
    long flags = 0;
    int num_digits = 0;
+#ifndef __NO_FLOAT
    double num_e = 0, num_fraction = 0;
+#endif
 
    /* Skip UTF-8 BOM
     */
@@ -693,11 +695,13 @@ json_value * json_parse_ex (json_settings * settings,
 
                            flags &= ~ (flag_num_negative | flag_num_e |
                                         flag_num_e_got_sign | flag_num_e_negative |
-                                           flag_num_zero);
+                                           flag_num_zero | flag_num_got_decimal);
 
                            num_digits = 0;
+#ifndef __NO_FLOAT
                            num_fraction = 0;
                            num_e = 0;
+#endif
 
                            if (b != '-')
                            {
@@ -763,6 +767,38 @@ json_value * json_parse_ex (json_settings * settings,
             case json_integer:
             case json_double:
 
+#ifdef __NO_FLOAT
+               /* Kernel builds have no floating point, so only integers parse
+                */
+               if (isdigit ((unsigned char)b))
+               {
+                  ++ num_digits;
+
+                  if (flags & flag_num_zero)
+                  {  sprintf (error, "%u:%u: Unexpected `0` before `%c`", line_and_col, b);
+                     goto e_failed;
+                  }
+
+                  if (num_digits == 1 && b == '0')
+                     flags |= flag_num_zero;
+
+                  if (would_overflow(top->u.integer, b))
+                  {  sprintf (error, "%u:%u: Integer too large", line_and_col);
+                     goto e_failed;
+                  }
+
+                  top->u.integer = (top->u.integer * 10) + (b - '0');
+                  continue;
+               }
+
+               if (b == '.' || b == 'e' || b == 'E')
+               {  sprintf (error, "%u:%u: Unexpected `%c`, floating point is not supported", line_and_col, b);
+                  goto e_failed;
+               }
+
+               if (flags & flag_num_negative)
+                  top->u.integer = - top->u.integer;
+#else
                if (isdigit ((unsigned char)b))
                {
                   ++ num_digits;
@@ -883,6 +919,7 @@ json_value * json_parse_ex (json_settings * settings,
                   else
                      top->u.dbl = - top->u.dbl;
                }
+#endif
 
                flags |= flag_next | flag_reproc;
                break;
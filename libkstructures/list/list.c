@@ -215,7 +215,7 @@ void list_delete(list_t *list, node_t *node) {
  * @param index The index of the node
  */
 void list_delete_index(list_t *list, size_t index) {
-    if (index > list->length) return;
+    if (index >= list->length) return;
 
     // No faster way to do this
     size_t i = 0;
@@ -225,8 +225,9 @@ void list_delete_index(list_t *list, size_t index) {
         i++;
     }
 
-    if (i == index) {
+    if (node && i == index) {
         list_delete(list, node);
+        kfree(node);
     }
 }
 
@@ -105,6 +105,7 @@ static void tree_node_free(tree_node_t *node) {
     foreach(child, node->children) {
         tree_node_free((tree_node_t*)child->value);
     }
+    list_destroy(node->children, false);
     kfree(node);
 }
 
@@ -134,7 +135,9 @@ void tree_delete(tree_t *tree, tree_node_t *node) {
     tree->nodes -= tree_count_children(node);
 
     // Delete it from the parent's children
-    list_delete(parent->children, list_find(parent->children, node));
+    node_t *entry = list_find(parent->children, node);
+    list_delete(parent->children, entry);
+    kfree(entry);
 
     // Free the node
     tree_node_free(node);
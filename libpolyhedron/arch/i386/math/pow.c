@@ -18,10 +18,17 @@ double pow(double x, double y) {
     // This is ass - kernel needs FPU support
     // WARNING WARNING WARNING WARNING
 
-    long long pow = 1;
-    for (int i = 0; i < y; i++) {
-        pow *= x;
+    // Only integral exponents are supported (the fraction is dropped).
+    // Square and multiply, so huge exponents (say, from a JSON number) don't spin forever.
+    long long exponent = (y > 0x1p62) ? (1LL << 62) : (y < -0x1p62) ? -(1LL << 62) : (long long)y;
+    unsigned long long bits = (exponent < 0) ? -(unsigned long long)exponent : (unsigned long long)exponent;
+
+    double pow = 1;
+    while (bits) {
+        if (bits & 1) pow *= x;
+        x *= x;
+        bits >>= 1;
     }
 
-    return pow;
+    return (exponent < 0) ? 1 / pow : pow;
 }
\ No newline at end of file
@@ -0,0 +1,133 @@
+/**
+ * @file libpolyhedron/arch/x86_64/string/bench.c
+ * @brief Benchmark of the string/memory routine variants
+ * 
+ * Prints one row per variant with the bytes per TSC cycle at every size. The TSC doesn't
+ * tick at the core clock on every CPU, so compare rows against each other, not against datasheets.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include "string_x86.h"
+
+/* Smallest size measured (sizes go up by 4x) */
+#define BENCH_MIN_SIZE      16
+
+/* Bytes moved per measurement (small sizes get repeated) */
+#define BENCH_BYTES         (256 * 1024)
+
+/* Measurements per size, the fastest one counts */
+#define BENCH_RUNS          3
+
+/* Keeps the results alive */
+static volatile uintptr_t bench_sink = 0;
+
+/**
+ * @brief Read the TSC (serialized against earlier instructions)
+ */
+static inline uint64_t bench_rdtsc() {
+    uint32_t lo, hi;
+    asm volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * @brief Run a variant once
+ */
+static inline uintptr_t bench_call(int op, void *function, unsigned char *dst, unsigned char *src, size_t size) {
+    switch (op) {
+        case STRING_OP_MEMCPY:
+            return (uintptr_t)((memcpy_impl_t)function)(dst, src, size);
+        case STRING_OP_MEMSET:
+            return (uintptr_t)((memset_impl_t)function)(dst, 0x5A, size);
+        case STRING_OP_MEMCMP:
+            return (uintptr_t)((memcmp_impl_t)function)(dst, src, size);
+        case STRING_OP_STRLEN:
+            return (uintptr_t)((strlen_impl_t)function)((const char*)src);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Measure a variant at one size
+ * @returns Bytes per cycle times 100
+ */
+static unsigned int bench_measure(int op, void *function, unsigned char *dst, unsigned char *src, size_t size) {
+    size_t iterations = (size < BENCH_BYTES) ? BENCH_BYTES / size : 1;
+    uint64_t best = ~0ULL;
+
+    // memcmp has to walk the whole buffer and strlen needs its terminator at the end
+    if (op == STRING_OP_MEMCMP) memcpy_words(dst, src, size);
+    if (op == STRING_OP_STRLEN) src[size - 1] = 0;
+
+    // Warm up (cache, TLB and the branch predictor)
+    bench_sink += bench_call(op, function, dst, src, size);
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        uint64_t start = bench_rdtsc();
+        for (size_t i = 0; i < iterations; i++) bench_sink += bench_call(op, function, dst, src, size);
+        uint64_t cycles = bench_rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+
+    if (op == STRING_OP_STRLEN) src[size - 1] = 'A';
+
+    if (!best) best = 1;
+    return (unsigned int)(((uint64_t)size * iterations * 100) / best);
+}
+
+/**
+ * @brief Measure every usable variant and print a table of size against bytes per cycle
+ *
+ * @param buffer Scratch memory, split into a source and a destination half
+ * @param size The size of the scratch memory (sizes go up to half of it)
+ * @param out Called with every line of the table (without a newline)
+ */
+void string_benchmark(void *buffer, size_t size, void (*out)(const char *line)) {
+    static const char *op_names[STRING_OP_COUNT] = { "memcpy", "memset", "memcmp", "strlen" };
+
+    size_t half = (size / 2) & ~(size_t)63;
+    if (half < BENCH_MIN_SIZE) return;
+
+    unsigned char *src = (unsigned char*)buffer;
+    unsigned char *dst = src + half;
+    memset_words(src, 'A', half);
+
+    int features = string_getFeatures();
+    char line[256];
+    int len;
+
+    // Header
+    len = snprintf(line, sizeof(line), "bytes/cycle     ");
+    for (size_t sz = BENCH_MIN_SIZE; sz <= half && len < (int)sizeof(line) - 8; sz *= 4) {
+        if (sz >= 1024 * 1024) len += snprintf(line + len, sizeof(line) - len, " %5dM", (int)(sz >> 20));
+        else if (sz >= 1024) len += snprintf(line + len, sizeof(line) - len, " %5dK", (int)(sz >> 10));
+        else len += snprintf(line + len, sizeof(line) - len, " %6d", (int)sz);
+    }
+    out(line);
+
+    for (int op = 0; op < STRING_OP_COUNT; op++) {
+        int count = 0;
+        const string_variant_t *variants = string_getVariants(op, &count);
+        const string_variant_t *selected = string_getSelected(op);
+
+        for (int v = 0; v < count; v++) {
+            if ((variants[v].features & features) != variants[v].features) continue;
+
+            len = snprintf(line, sizeof(line), "%s %-6s %c ", op_names[op], variants[v].name, (&variants[v] == selected) ? '*' : ' ');
+            for (size_t sz = BENCH_MIN_SIZE; sz <= half && len < (int)sizeof(line) - 8; sz *= 4) {
+                unsigned int bpc = bench_measure(op, variants[v].function, dst, src, sz);
+                len += snprintf(line + len, sizeof(line) - len, " %3d.%02d", bpc / 100, bpc % 100);
+            }
+            out(line);
+        }
+    }
+}
@@ -0,0 +1,220 @@
+/**
+ * @file libpolyhedron/arch/x86_64/string/dispatch.c
+ * @brief Picks the string/memory routine variants from CPUID
+ * 
+ * Every dispatch pointer starts out at a resolver, so the first call of each
+ * operation runs the detection. It doesn't allocate or call into anything else,
+ * so it's safe to hit this before the rest of the kernel is up.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <string.h>
+#include <kernel/arch/x86_64/cpu.h>
+#include "string_x86.h"
+
+/* Resolvers */
+static void *memcpy_resolve(void *__restrict dest, const void *__restrict src, size_t n);
+static void *memset_resolve(void *dest, int c, size_t n);
+static int memcmp_resolve(const void *a, const void *b, size_t n);
+static size_t strlen_resolve(const char *s);
+
+/* Dispatch pointers */
+memcpy_impl_t string_memcpy = memcpy_resolve;
+memset_impl_t string_memset = memset_resolve;
+memcmp_impl_t string_memcmp = memcmp_resolve;
+strlen_impl_t string_strlen = strlen_resolve;
+
+/* Detected features (-1 = not yet) */
+static int string_features = -1;
+
+/* Selected variant of every operation */
+static const string_variant_t *string_selected[STRING_OP_COUNT] = { 0 };
+
+/* Variant tables (the order is irrelevant, string_select() has the preferences) */
+static const string_variant_t memcpy_variants[] = {
+    { .name = "words",  .features = 0,                  .function = (void*)memcpy_words },
+    { .name = "erms",   .features = STRING_FEAT_ERMS,   .function = (void*)memcpy_erms },
+    { .name = "movnti", .features = 0,                  .function = (void*)memcpy_movnti },
+#ifdef __LIBC
+    { .name = "sse2",   .features = STRING_FEAT_SSE2,   .function = (void*)memcpy_sse2 },
+    { .name = "avx2",   .features = STRING_FEAT_AVX2,   .function = (void*)memcpy_avx2 },
+#endif
+};
+
+static const string_variant_t memset_variants[] = {
+    { .name = "words",  .features = 0,                  .function = (void*)memset_words },
+    { .name = "erms",   .features = STRING_FEAT_ERMS,   .function = (void*)memset_erms },
+    { .name = "movnti", .features = 0,                  .function = (void*)memset_movnti },
+#ifdef __LIBC
+    { .name = "sse2",   .features = STRING_FEAT_SSE2,   .function = (void*)memset_sse2 },
+    { .name = "avx2",   .features = STRING_FEAT_AVX2,   .function = (void*)memset_avx2 },
+#endif
+};
+
+static const string_variant_t memcmp_variants[] = {
+    { .name = "words",  .features = 0,                  .function = (void*)memcmp_words },
+#ifdef __LIBC
+    { .name = "sse2",   .features = STRING_FEAT_SSE2,   .function = (void*)memcmp_sse2 },
+#endif
+};
+
+static const string_variant_t strlen_variants[] = {
+    { .name = "words",  .features = 0,                  .function = (void*)strlen_words },
+#ifdef __LIBC
+    { .name = "sse2",   .features = STRING_FEAT_SSE2,   .function = (void*)strlen_sse2 },
+#endif
+};
+
+#define VARIANT_COUNT(table) ((int)(sizeof(table) / sizeof(*(table))))
+
+/**
+ * @brief Find a variant by name
+ */
+static const string_variant_t *string_findVariant(const string_variant_t *table, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        // No strcmp, it may not be safe to call yet
+        const char *a = table[i].name, *b = name;
+        while (*a && *a == *b) { a++; b++; }
+        if (*a == *b) return &table[i];
+    }
+
+    return &table[0];
+}
+
+/**
+ * @brief Detect the STRING_FEAT_* bits
+ */
+static int string_detectFeatures() {
+    uint32_t eax, ebx, ecx, edx;
+    int features = STRING_FEAT_SSE2;    // Part of x86_64
+
+    __cpuid(CPUID_GETVENDORSTRING, eax, ebx, ecx, edx);
+    uint32_t max_leaf = eax;
+
+    __cpuid(CPUID_GETFEATURES, eax, ebx, ecx, edx);
+
+    // AVX needs the OS to have enabled XSAVE with the SSE and AVX state components
+    int avx_usable = 0;
+    if ((ecx & CPUID_FEAT_ECX_OSXSAVE) && (ecx & CPUID_FEAT_ECX_AVX)) {
+        uint32_t xcr0_lo, xcr0_hi;
+        asm volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        avx_usable = ((xcr0_lo & 0x6) == 0x6);
+    }
+
+    if (max_leaf >= CPUID_GETEXTFEATURES) {
+        __cpuid_count(CPUID_GETEXTFEATURES, 0, eax, ebx, ecx, edx);
+        if (ebx & CPUID_FEAT7_EBX_ERMS) features |= STRING_FEAT_ERMS;
+        if (edx & CPUID_FEAT7_EDX_FSRM) features |= STRING_FEAT_FSRM;
+        if (avx_usable && (ebx & CPUID_FEAT7_EBX_AVX2)) features |= STRING_FEAT_AVX2;
+    }
+
+    return features;
+}
+
+/**
+ * @brief Detect CPU features and pick the variant of every operation
+ */
+void string_select() {
+    int features = string_detectFeatures();
+    const char *copy;
+
+    // FSRM makes REP MOVSB fast at every size, otherwise prefer wide vectors over plain ERMS
+    if (features & STRING_FEAT_FSRM) copy = "erms";
+#ifdef __LIBC
+    else if (features & STRING_FEAT_AVX2) copy = "avx2";
+#endif
+    else if (features & STRING_FEAT_ERMS) copy = "erms";
+#ifdef __LIBC
+    else copy = "sse2";
+#else
+    else copy = "words";
+#endif
+
+#ifdef __LIBC
+    const char *scan = "sse2";
+#else
+    const char *scan = "words";
+#endif
+
+    string_selected[STRING_OP_MEMCPY] = string_findVariant(memcpy_variants, VARIANT_COUNT(memcpy_variants), copy);
+    string_selected[STRING_OP_MEMSET] = string_findVariant(memset_variants, VARIANT_COUNT(memset_variants), copy);
+    string_selected[STRING_OP_MEMCMP] = string_findVariant(memcmp_variants, VARIANT_COUNT(memcmp_variants), scan);
+    string_selected[STRING_OP_STRLEN] = string_findVariant(strlen_variants, VARIANT_COUNT(strlen_variants), scan);
+
+    // Selection is idempotent, so racing CPUs just store the same values
+    __atomic_store_n(&string_memcpy, (memcpy_impl_t)string_selected[STRING_OP_MEMCPY]->function, __ATOMIC_RELEASE);
+    __atomic_store_n(&string_memset, (memset_impl_t)string_selected[STRING_OP_MEMSET]->function, __ATOMIC_RELEASE);
+    __atomic_store_n(&string_memcmp, (memcmp_impl_t)string_selected[STRING_OP_MEMCMP]->function, __ATOMIC_RELEASE);
+    __atomic_store_n(&string_strlen, (strlen_impl_t)string_selected[STRING_OP_STRLEN]->function, __ATOMIC_RELEASE);
+    __atomic_store_n(&string_features, features, __ATOMIC_RELEASE);
+}
+
+static void *memcpy_resolve(void *__restrict dest, const void *__restrict src, size_t n) {
+    string_select();
+    return string_memcpy(dest, src, n);
+}
+
+static void *memset_resolve(void *dest, int c, size_t n) {
+    string_select();
+    return string_memset(dest, c, n);
+}
+
+static int memcmp_resolve(const void *a, const void *b, size_t n) {
+    string_select();
+    return string_memcmp(a, b, n);
+}
+
+static size_t strlen_resolve(const char *s) {
+    string_select();
+    return string_strlen(s);
+}
+
+/**
+ * @brief Get the detected STRING_FEAT_* bits
+ */
+int string_getFeatures() {
+    if (__atomic_load_n(&string_features, __ATOMIC_ACQUIRE) < 0) string_select();
+    return string_features;
+}
+
+/**
+ * @brief Get every variant of an operation built into this library
+ * @param op The operation (STRING_OP_*)
+ * @param count Output amount of variants
+ * @returns The variant table or NULL
+ */
+const string_variant_t *string_getVariants(int op, int *count) {
+    switch (op) {
+        case STRING_OP_MEMCPY:
+            *count = VARIANT_COUNT(memcpy_variants);
+            return memcpy_variants;
+        case STRING_OP_MEMSET:
+            *count = VARIANT_COUNT(memset_variants);
+            return memset_variants;
+        case STRING_OP_MEMCMP:
+            *count = VARIANT_COUNT(memcmp_variants);
+            return memcmp_variants;
+        case STRING_OP_STRLEN:
+            *count = VARIANT_COUNT(strlen_variants);
+            return strlen_variants;
+        default:
+            *count = 0;
+            return NULL;
+    }
+}
+
+/**
+ * @brief Get the variant an operation dispatches to
+ * @param op The operation (STRING_OP_*)
+ */
+const string_variant_t *string_getSelected(int op) {
+    if (op < 0 || op >= STRING_OP_COUNT) return NULL;
+    if (__atomic_load_n(&string_features, __ATOMIC_ACQUIRE) < 0) string_select();
+    return string_selected[op];
+}
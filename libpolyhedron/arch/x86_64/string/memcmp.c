@@ -0,0 +1,65 @@
+/**
+ * @file libpolyhedron/arch/x86_64/string/memcmp.c
+ * @brief memcmp
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <string.h>
+#include "string_x86.h"
+
+/**
+ * @brief Word at a time
+ */
+int memcmp_words(const void *a, const void *b, size_t n) {
+    const unsigned char *x = (const unsigned char*)a;
+    const unsigned char *y = (const unsigned char*)b;
+
+    for (; n >= 8; n -= 8, x += 8, y += 8) {
+        uint64_t wx = *(const string_u64_t*)x;
+        uint64_t wy = *(const string_u64_t*)y;
+        if (wx != wy) {
+            // Byte swap so the first differing byte is the most significant
+            return (__builtin_bswap64(wx) < __builtin_bswap64(wy)) ? -1 : 1;
+        }
+    }
+
+    for (; n; n--, x++, y++) {
+        if (*x != *y) return (*x < *y) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+#ifdef __LIBC
+
+/**
+ * @brief 16 bytes at a time
+ */
+int memcmp_sse2(const void *a, const void *b, size_t n) {
+    const unsigned char *x = (const unsigned char*)a;
+    const unsigned char *y = (const unsigned char*)b;
+
+    for (; n >= 16; n -= 16, x += 16, y += 16) {
+        string_v16_t eq = (string_v16_t)(*(const string_v16u_t*)x == *(const string_v16u_t*)y);
+        unsigned int mask = __builtin_ia32_pmovmskb128(eq);
+        if (mask != 0xFFFF) {
+            int i = __builtin_ctz(~mask);
+            return (x[i] < y[i]) ? -1 : 1;
+        }
+    }
+
+    return memcmp_words(x, y, n);
+}
+
+#endif
+
+int memcmp(const void *a, const void *b, size_t n) {
+    return string_memcmp(a, b, n);
+}
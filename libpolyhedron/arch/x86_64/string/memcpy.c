@@ -1,7 +1,9 @@
 /**
- * @file libpolyhedron/arch/x86_64/stdlib/memcpy.c
+ * @file libpolyhedron/arch/x86_64/string/memcpy.c
  * @brief memcpy
  * 
+ * Small copies are done inline, copies past STRING_NT_THRESHOLD bypass the cache and
+ * everything in between goes to the variant string_select() picked.
  * 
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
@@ -11,12 +13,163 @@
  * Copyright (C) 2024 Samuel Stuart
  */
 
-#include <stddef.h>
+#include <string.h>
+#include "string_x86.h"
 
-void * memcpy(void * restrict dest, const void * restrict src, size_t n) {
-	asm volatile("cld; rep movsb"
-	            : "=c"((int){0})
-	            : "D"(dest), "S"(src), "c"(n)
-	            : "flags", "memory");
-	return dest;
-}
\ No newline at end of file
+/**
+ * @brief Word at a time
+ */
+void *memcpy_words(void *__restrict dest, const void *__restrict src, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+    const unsigned char *s = (const unsigned char*)src;
+
+    if (n <= 16) {
+        string_copySmall(d, s, n);
+        return dest;
+    }
+
+    // Copy one unaligned word and continue from the next aligned destination word
+    size_t skew = 8 - ((uintptr_t)d & 7);
+    *(string_u64_t*)d = *(const string_u64_t*)s;
+    d += skew; s += skew; n -= skew;
+
+    for (; n >= 32; n -= 32, d += 32, s += 32) {
+        uint64_t a = ((const string_u64_t*)s)[0];
+        uint64_t b = ((const string_u64_t*)s)[1];
+        uint64_t c = ((const string_u64_t*)s)[2];
+        uint64_t e = ((const string_u64_t*)s)[3];
+        ((string_u64_t*)d)[0] = a;
+        ((string_u64_t*)d)[1] = b;
+        ((string_u64_t*)d)[2] = c;
+        ((string_u64_t*)d)[3] = e;
+    }
+
+    for (; n >= 8; n -= 8, d += 8, s += 8) *(string_u64_t*)d = *(const string_u64_t*)s;
+
+    // The tail overlaps the last word
+    if (n) *(string_u64_t*)(d + n - 8) = *(const string_u64_t*)(s + n - 8);
+    return dest;
+}
+
+/**
+ * @brief Enhanced REP MOVSB
+ */
+void *memcpy_erms(void *__restrict dest, const void *__restrict src, size_t n) {
+    void *d = dest;
+    asm volatile ("rep movsb"
+                    : "+D"(d), "+S"(src), "+c"(n)
+                    :: "memory");
+    return dest;
+}
+
+/**
+ * @brief Non-temporal stores (MOVNTI), for copies that would only evict the cache
+ */
+void *memcpy_movnti(void *__restrict dest, const void *__restrict src, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+    const unsigned char *s = (const unsigned char*)src;
+
+    if (n < 64) return memcpy_words(dest, src, n);
+
+    // Align the destination
+    size_t head = -(uintptr_t)d & 7;
+    string_copySmall(d, s, head);
+    d += head; s += head; n -= head;
+
+    for (; n >= 8; n -= 8, d += 8, s += 8) {
+        asm volatile ("movnti %1, %0" : "=m"(*(uint64_t*)d) : "r"(*(const string_u64_t*)s));
+    }
+
+    // Non-temporal stores are weakly ordered
+    asm volatile ("sfence" ::: "memory");
+
+    string_copySmall(d, s, n);
+    return dest;
+}
+
+#ifdef __LIBC
+
+/**
+ * @brief 16 bytes at a time
+ */
+void *memcpy_sse2(void *__restrict dest, const void *__restrict src, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+    const unsigned char *s = (const unsigned char*)src;
+
+    if (n <= 32) {
+        if (n <= 16) {
+            string_copySmall(d, s, n);
+        } else {
+            string_v16u_t a = *(const string_v16u_t*)s;
+            string_v16u_t b = *(const string_v16u_t*)(s + n - 16);
+            *(string_v16u_t*)d = a;
+            *(string_v16u_t*)(d + n - 16) = b;
+        }
+        return dest;
+    }
+
+    // Align the destination
+    size_t skew = 16 - ((uintptr_t)d & 15);
+    *(string_v16u_t*)d = *(const string_v16u_t*)s;
+    d += skew; s += skew; n -= skew;
+
+    for (; n >= 64; n -= 64, d += 64, s += 64) {
+        string_v16u_t a = ((const string_v16u_t*)s)[0];
+        string_v16u_t b = ((const string_v16u_t*)s)[1];
+        string_v16u_t c = ((const string_v16u_t*)s)[2];
+        string_v16u_t e = ((const string_v16u_t*)s)[3];
+        ((string_v16_t*)d)[0] = a;
+        ((string_v16_t*)d)[1] = b;
+        ((string_v16_t*)d)[2] = c;
+        ((string_v16_t*)d)[3] = e;
+    }
+
+    for (; n >= 16; n -= 16, d += 16, s += 16) *(string_v16_t*)d = *(const string_v16u_t*)s;
+
+    if (n) *(string_v16u_t*)(d + n - 16) = *(const string_v16u_t*)(s + n - 16);
+    return dest;
+}
+
+/**
+ * @brief 32 bytes at a time
+ */
+__attribute__((__target__("avx2")))
+void *memcpy_avx2(void *__restrict dest, const void *__restrict src, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+    const unsigned char *s = (const unsigned char*)src;
+
+    if (n <= 64) return memcpy_sse2(dest, src, n);
+
+    // Align the destination
+    size_t skew = 32 - ((uintptr_t)d & 31);
+    *(string_v32u_t*)d = *(const string_v32u_t*)s;
+    d += skew; s += skew; n -= skew;
+
+    for (; n >= 128; n -= 128, d += 128, s += 128) {
+        string_v32u_t a = ((const string_v32u_t*)s)[0];
+        string_v32u_t b = ((const string_v32u_t*)s)[1];
+        string_v32u_t c = ((const string_v32u_t*)s)[2];
+        string_v32u_t e = ((const string_v32u_t*)s)[3];
+        ((string_v32_t*)d)[0] = a;
+        ((string_v32_t*)d)[1] = b;
+        ((string_v32_t*)d)[2] = c;
+        ((string_v32_t*)d)[3] = e;
+    }
+
+    for (; n >= 32; n -= 32, d += 32, s += 32) *(string_v32_t*)d = *(const string_v32u_t*)s;
+
+    if (n) *(string_v32u_t*)(d + n - 32) = *(const string_v32u_t*)(s + n - 32);
+    return dest;
+}
+
+#endif
+
+void *memcpy(void *__restrict dest, const void *__restrict src, size_t n) {
+    if (n <= 16) {
+        string_copySmall((unsigned char*)dest, (const unsigned char*)src, n);
+        return dest;
+    }
+
+    if (n >= STRING_NT_THRESHOLD) return memcpy_movnti(dest, src, n);
+    return string_memcpy(dest, src, n);
+}
@@ -0,0 +1,45 @@
+/**
+ * @file libpolyhedron/arch/x86_64/string/memmove.c
+ * @brief memmove
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <string.h>
+#include "string_x86.h"
+
+void *memmove(void *dest, const void *src, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+    const unsigned char *s = (const unsigned char*)src;
+
+    if (n <= 16) {
+        string_copySmall(d, s, n);
+        return dest;
+    }
+
+    // Buffers that don't overlap can take the fast path
+    if ((uintptr_t)d - (uintptr_t)s >= n && (uintptr_t)s - (uintptr_t)d >= n) return memcpy(dest, src, n);
+
+    // Every word is loaded before the stores that could clobber it, in either direction
+    if (d < s) {
+        for (; n >= 8; n -= 8, d += 8, s += 8) *(string_u64_t*)d = *(const string_u64_t*)s;
+        for (; n; n--) *d++ = *s++;
+    } else if (d > s) {
+        d += n;
+        s += n;
+        for (; n >= 8; n -= 8) {
+            d -= 8;
+            s -= 8;
+            *(string_u64_t*)d = *(const string_u64_t*)s;
+        }
+        for (; n; n--) *--d = *--s;
+    }
+
+    return dest;
+}
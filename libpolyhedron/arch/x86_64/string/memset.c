@@ -1,6 +1,6 @@
 /**
- * @file libpolyhedron/arch/x86_64/stdlib/memset.c
- * @brief memset
+ * @file libpolyhedron/arch/x86_64/string/memset.c
+ * @brief memset and memset_nt
  * 
  * 
  * @copyright
@@ -11,14 +11,167 @@
  * Copyright (C) 2024 Samuel Stuart
  */
 
-#include <stddef.h>
-
-void *memset(void* destination_ptr, int value, size_t size) {
-    // It's faster to embed assembly like this and use "rep stosb".
-	// This code needs to be improved and cleaned up a bit though. Intellisense does not like the ';'
-    asm volatile("cld; rep stosb"
-	             : "=c"((int){0})
-	             : "rdi"(destination_ptr), "a"(value), "c"(size)
-	             : "flags", "memory", "rdi");
-	return destination_ptr;
-}
\ No newline at end of file
+#include <string.h>
+#include "string_x86.h"
+
+/**
+ * @brief Word at a time
+ */
+void *memset_words(void *dest, int c, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+    uint64_t pattern = string_pattern(c);
+
+    if (n <= 16) {
+        string_setSmall(d, pattern, n);
+        return dest;
+    }
+
+    // One unaligned word, then continue from the next aligned one
+    size_t skew = 8 - ((uintptr_t)d & 7);
+    *(string_u64_t*)d = pattern;
+    d += skew; n -= skew;
+
+    for (; n >= 32; n -= 32, d += 32) {
+        ((string_u64_t*)d)[0] = pattern;
+        ((string_u64_t*)d)[1] = pattern;
+        ((string_u64_t*)d)[2] = pattern;
+        ((string_u64_t*)d)[3] = pattern;
+    }
+
+    for (; n >= 8; n -= 8, d += 8) *(string_u64_t*)d = pattern;
+
+    if (n) *(string_u64_t*)(d + n - 8) = pattern;
+    return dest;
+}
+
+/**
+ * @brief Enhanced REP STOSB
+ */
+void *memset_erms(void *dest, int c, size_t n) {
+    void *d = dest;
+    asm volatile ("rep stosb"
+                    : "+D"(d), "+c"(n)
+                    : "a"(c)
+                    : "memory");
+    return dest;
+}
+
+/**
+ * @brief Non-temporal stores (MOVNTI), for clears that would only evict the cache
+ */
+void *memset_movnti(void *dest, int c, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+    uint64_t pattern = string_pattern(c);
+
+    if (n < 64) return memset_words(dest, c, n);
+
+    // Align the destination
+    size_t head = -(uintptr_t)d & 7;
+    string_setSmall(d, pattern, head);
+    d += head; n -= head;
+
+    for (; n >= 32; n -= 32, d += 32) {
+        asm volatile ("movnti %4, %0\n"
+                        "movnti %4, %1\n"
+                        "movnti %4, %2\n"
+                        "movnti %4, %3\n"
+                        : "=m"(((uint64_t*)d)[0]), "=m"(((uint64_t*)d)[1]), "=m"(((uint64_t*)d)[2]), "=m"(((uint64_t*)d)[3])
+                        : "r"(pattern));
+    }
+
+    for (; n >= 8; n -= 8, d += 8) {
+        asm volatile ("movnti %1, %0" : "=m"(*(uint64_t*)d) : "r"(pattern));
+    }
+
+    // Non-temporal stores are weakly ordered
+    asm volatile ("sfence" ::: "memory");
+
+    string_setSmall(d, pattern, n);
+    return dest;
+}
+
+#ifdef __LIBC
+
+/**
+ * @brief 16 bytes at a time
+ */
+void *memset_sse2(void *dest, int c, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+
+    if (n <= 16) {
+        string_setSmall(d, string_pattern(c), n);
+        return dest;
+    }
+
+    string_v16_t v = (string_v16_t){0} + (char)c;
+    if (n <= 32) {
+        *(string_v16u_t*)d = v;
+        *(string_v16u_t*)(d + n - 16) = v;
+        return dest;
+    }
+
+    // Align the destination
+    size_t skew = 16 - ((uintptr_t)d & 15);
+    *(string_v16u_t*)d = v;
+    d += skew; n -= skew;
+
+    for (; n >= 64; n -= 64, d += 64) {
+        ((string_v16_t*)d)[0] = v;
+        ((string_v16_t*)d)[1] = v;
+        ((string_v16_t*)d)[2] = v;
+        ((string_v16_t*)d)[3] = v;
+    }
+
+    for (; n >= 16; n -= 16, d += 16) *(string_v16_t*)d = v;
+
+    if (n) *(string_v16u_t*)(d + n - 16) = v;
+    return dest;
+}
+
+/**
+ * @brief 32 bytes at a time
+ */
+__attribute__((__target__("avx2")))
+void *memset_avx2(void *dest, int c, size_t n) {
+    unsigned char *d = (unsigned char*)dest;
+
+    if (n <= 64) return memset_sse2(dest, c, n);
+
+    string_v32_t v = (string_v32_t){0} + (char)c;
+
+    // Align the destination
+    size_t skew = 32 - ((uintptr_t)d & 31);
+    *(string_v32u_t*)d = v;
+    d += skew; n -= skew;
+
+    for (; n >= 128; n -= 128, d += 128) {
+        ((string_v32_t*)d)[0] = v;
+        ((string_v32_t*)d)[1] = v;
+        ((string_v32_t*)d)[2] = v;
+        ((string_v32_t*)d)[3] = v;
+    }
+
+    for (; n >= 32; n -= 32, d += 32) *(string_v32_t*)d = v;
+
+    if (n) *(string_v32u_t*)(d + n - 32) = v;
+    return dest;
+}
+
+#endif
+
+void *memset(void *dest, int c, size_t n) {
+    if (n <= 16) {
+        string_setSmall((unsigned char*)dest, string_pattern(c), n);
+        return dest;
+    }
+
+    if (n >= STRING_NT_THRESHOLD) return memset_movnti(dest, c, n);
+    return string_memset(dest, c, n);
+}
+
+/**
+ * @brief memset that bypasses the cache (for memory that won't be touched again soon, e.g. fresh pages)
+ */
+void *memset_nt(void *dest, int c, size_t n) {
+    return memset_movnti(dest, c, n);
+}
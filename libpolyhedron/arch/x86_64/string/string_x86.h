@@ -0,0 +1,119 @@
+/**
+ * @file libpolyhedron/arch/x86_64/string/string_x86.h
+ * @brief Private header for the x86_64 string/memory routines
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef _STRING_X86_H
+#define _STRING_X86_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <bits/string_impl.h>
+
+/**** TYPES ****/
+
+// Unaligned integer types that may alias anything
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) string_u64_t;
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) string_u32_t;
+
+#ifdef __LIBC
+
+// SIMD types (the kernel doesn't save SSE state on interrupts, so only libc gets these)
+typedef char string_v16_t __attribute__((__vector_size__(16)));
+typedef char string_v16u_t __attribute__((__vector_size__(16), __may_alias__, __aligned__(1)));
+typedef char string_v32_t __attribute__((__vector_size__(32)));
+typedef char string_v32u_t __attribute__((__vector_size__(32), __may_alias__, __aligned__(1)));
+
+#endif
+
+/**** DISPATCH ****/
+
+// Selected variants (these start out pointing at resolvers that call string_select())
+extern memcpy_impl_t string_memcpy;
+extern memset_impl_t string_memset;
+extern memcmp_impl_t string_memcmp;
+extern strlen_impl_t string_strlen;
+
+/**
+ * @brief Detect CPU features and pick the variant of every operation
+ */
+void string_select();
+
+/**** VARIANTS ****/
+
+void *memcpy_words(void *__restrict dest, const void *__restrict src, size_t n);
+void *memcpy_erms(void *__restrict dest, const void *__restrict src, size_t n);
+void *memcpy_movnti(void *__restrict dest, const void *__restrict src, size_t n);
+
+void *memset_words(void *dest, int c, size_t n);
+void *memset_erms(void *dest, int c, size_t n);
+void *memset_movnti(void *dest, int c, size_t n);
+
+int memcmp_words(const void *a, const void *b, size_t n);
+size_t strlen_words(const char *s);
+
+#ifdef __LIBC
+void *memcpy_sse2(void *__restrict dest, const void *__restrict src, size_t n);
+void *memcpy_avx2(void *__restrict dest, const void *__restrict src, size_t n);
+void *memset_sse2(void *dest, int c, size_t n);
+void *memset_avx2(void *dest, int c, size_t n);
+int memcmp_sse2(const void *a, const void *b, size_t n);
+size_t strlen_sse2(const char *s);
+#endif
+
+/**** INLINE HELPERS ****/
+
+/**
+ * @brief Copy up to 16 bytes with two overlapping loads (both loads happen before the stores, so overlap is fine)
+ */
+static inline void string_copySmall(unsigned char *d, const unsigned char *s, size_t n) {
+    if (n >= 8) {
+        uint64_t a = *(const string_u64_t*)s;
+        uint64_t b = *(const string_u64_t*)(s + n - 8);
+        *(string_u64_t*)d = a;
+        *(string_u64_t*)(d + n - 8) = b;
+    } else if (n >= 4) {
+        uint32_t a = *(const string_u32_t*)s;
+        uint32_t b = *(const string_u32_t*)(s + n - 4);
+        *(string_u32_t*)d = a;
+        *(string_u32_t*)(d + n - 4) = b;
+    } else if (n) {
+        unsigned char a = s[0], b = s[n / 2], c = s[n - 1];
+        d[0] = a;
+        d[n / 2] = b;
+        d[n - 1] = c;
+    }
+}
+
+/**
+ * @brief Set up to 16 bytes with two overlapping stores of a byte pattern
+ */
+static inline void string_setSmall(unsigned char *d, uint64_t pattern, size_t n) {
+    if (n >= 8) {
+        *(string_u64_t*)d = pattern;
+        *(string_u64_t*)(d + n - 8) = pattern;
+    } else if (n >= 4) {
+        *(string_u32_t*)d = (uint32_t)pattern;
+        *(string_u32_t*)(d + n - 4) = (uint32_t)pattern;
+    } else if (n) {
+        d[0] = d[n / 2] = d[n - 1] = (unsigned char)pattern;
+    }
+}
+
+/**
+ * @brief Spread a byte over a 64-bit word
+ */
+static inline uint64_t string_pattern(int c) {
+    return 0x0101010101010101ULL * (unsigned char)c;
+}
+
+#endif
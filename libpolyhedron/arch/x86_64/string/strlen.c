@@ -0,0 +1,64 @@
+/**
+ * @file libpolyhedron/arch/x86_64/string/strlen.c
+ * @brief strlen
+ * 
+ * Both variants only ever read aligned blocks, which can't cross into the next page.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <string.h>
+#include "string_x86.h"
+
+#define ONES        0x0101010101010101ULL
+#define HIGHS       0x8080808080808080ULL
+#define HASZERO(x)  (((x) - ONES) & ~(x) & HIGHS)
+
+/**
+ * @brief Word at a time
+ */
+size_t strlen_words(const char *str) {
+    const char *s = str;
+
+    for (; (uintptr_t)s & 7; s++) {
+        if (!*s) return s - str;
+    }
+
+    const string_u64_t *w = (const string_u64_t*)s;
+    for (; !HASZERO(*w); w++);
+
+    // The lowest set high bit is the first zero byte
+    return (const char*)w + (__builtin_ctzll(HASZERO(*w)) >> 3) - str;
+}
+
+#ifdef __LIBC
+
+/**
+ * @brief 16 bytes at a time
+ */
+size_t strlen_sse2(const char *str) {
+    const char *s = (const char*)((uintptr_t)str & ~15);
+    string_v16_t zero = { 0 };
+
+    // Ignore the bytes before the string in the first block
+    unsigned int mask = __builtin_ia32_pmovmskb128((string_v16_t)(*(const string_v16u_t*)s == zero));
+    mask &= 0xFFFFu << ((uintptr_t)str & 15);
+
+    while (!mask) {
+        s += 16;
+        mask = __builtin_ia32_pmovmskb128((string_v16_t)(*(const string_v16u_t*)s == zero));
+    }
+
+    return s + __builtin_ctz(mask) - str;
+}
+
+#endif
+
+size_t strlen(const char *str) {
+    return string_strlen(str);
+}
@@ -0,0 +1,93 @@
+/**
+ * @file libpolyhedron/include/bits/string_impl.h
+ * @brief String/memory routine variants
+ *
+ * On x86_64 memcpy, memset, memcmp and strlen pick an implementation on their first call
+ * from the CPUID feature bits. This header exposes the variants so they can be reported and benchmarked.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <sys/cheader.h>
+
+_Begin_C_Header
+
+#ifndef _BITS_STRING_IMPL_H
+#define _BITS_STRING_IMPL_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+
+/**** DEFINITIONS ****/
+
+// Features the variants can depend on
+#define STRING_FEAT_SSE2        0x01    // SSE2 (always there on x86_64)
+#define STRING_FEAT_AVX2        0x02    // AVX2, and the OS saves YMM state
+#define STRING_FEAT_ERMS        0x04    // Enhanced REP MOVSB/STOSB
+#define STRING_FEAT_FSRM        0x08    // Fast short REP MOVSB
+
+// Operations
+#define STRING_OP_MEMCPY        0
+#define STRING_OP_MEMSET        1
+#define STRING_OP_MEMCMP        2
+#define STRING_OP_STRLEN        3
+#define STRING_OP_COUNT         4
+
+// Copies/clears at least this big bypass the cache
+#define STRING_NT_THRESHOLD     (1024 * 1024)
+
+/**** TYPES ****/
+
+typedef void *(*memcpy_impl_t)(void *__restrict, const void *__restrict, size_t);
+typedef void *(*memset_impl_t)(void *, int, size_t);
+typedef int (*memcmp_impl_t)(const void *, const void *, size_t);
+typedef size_t (*strlen_impl_t)(const char *);
+
+/**
+ * @brief A variant of an operation
+ */
+typedef struct string_variant {
+    const char *name;           // Short name ("erms", "avx2", ...)
+    int features;               // Required STRING_FEAT_* bits
+    void *function;             // The implementation (cast to the operation's *_impl_t)
+} string_variant_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Get the detected STRING_FEAT_* bits
+ */
+int string_getFeatures();
+
+/**
+ * @brief Get every variant of an operation built into this library
+ * @param op The operation (STRING_OP_*)
+ * @param count Output amount of variants
+ * @returns The variant table or NULL
+ */
+const string_variant_t *string_getVariants(int op, int *count);
+
+/**
+ * @brief Get the variant an operation dispatches to
+ * @param op The operation (STRING_OP_*)
+ */
+const string_variant_t *string_getSelected(int op);
+
+/**
+ * @brief Measure every usable variant and print a table of size against bytes per cycle
+ *
+ * @param buffer Scratch memory, split into a source and a destination half
+ * @param size The size of the scratch memory (sizes go up to half of it)
+ * @param out Called with every line of the table (without a newline)
+ */
+void string_benchmark(void *buffer, size_t size, void (*out)(const char *line));
+
+#endif
+
+_End_C_Header
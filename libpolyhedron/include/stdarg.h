@@ -39,6 +39,7 @@ typedef __builtin_va_list va_list;
 #define va_start(x, y) __builtin_va_start(x, y)
 #define va_arg(x, y) __builtin_va_arg(x, y)
 #define va_end(x) __builtin_va_end(x)
+#define va_copy(dest, src) __builtin_va_copy(dest, src)
 
 #endif
 
@@ -28,6 +28,9 @@ _Begin_C_Header
 // Type definitions for xvas_callback
 typedef int (*xvas_callback)(void *, char);
 
+// Type definitions for xvas_write_callback (gets the output in chunks instead of per character)
+typedef int (*xvas_write_callback)(void *, const char *, size_t);
+
 
 /**** DEFINITIONS ****/
 
@@ -44,6 +47,7 @@ int vsnprintf(char *str, size_t size, const char *format, va_list ap);
 int snprintf(char * str, size_t size, const char * format, ...);
 int sprintf(char * str, const char * format, ...);
 size_t xvasprintf(xvas_callback callback, void * userData, const char * fmt, va_list args);
+size_t xvasprintf_write(xvas_write_callback write, void * userData, const char * fmt, va_list args);
 
 
 
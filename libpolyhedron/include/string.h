@@ -24,6 +24,7 @@ int memcmp(const void*, const void*, size_t);
 void* memmove(void*, const void*, size_t);
 void* memcpy(void* __restrict, const void* __restrict, size_t);
 void* memset(void*, int, size_t);
+void* memset_nt(void*, int, size_t);
 void * memchr(const void *, int, size_t);
 
 size_t strlen(const char*);
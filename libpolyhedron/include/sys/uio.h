@@ -0,0 +1,38 @@
+/**
+ * @file libpolyhedron/include/sys/uio.h
+ * @brief Vector I/O header
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <sys/cheader.h>
+
+_Begin_C_Header
+
+#ifndef _SYS_UIO_H
+#define _SYS_UIO_H
+
+/**** INCLUDES ****/
+#include <stddef.h>
+#include <sys/types.h>
+
+/**** DEFINITIONS ****/
+
+#define IOV_MAX     1024
+
+/**** TYPES ****/
+
+struct iovec {
+    void *iov_base;     // Base address of the buffer
+    size_t iov_len;     // Length of the buffer
+};
+
+#endif
+
+_End_C_Header
@@ -2,7 +2,10 @@
  * @file libpolyhedron/stdio/printf.c
  * @brief printf() implementation
  * 
- * @todo This file needs a cleanup and rewrite. I didn't make it!!
+ * Output is formatted into a small buffer and handed to the sink in chunks (a write(buffer, length)
+ * callback) instead of one callback per character. Literal runs and plain %s are copied in one go,
+ * and decimal conversion goes two digits at a time. snprintf() and friends format straight into the
+ * destination string.
  * 
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -15,137 +18,175 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdarg.h>
-#include <stdarg.h>
 #include <stdio.h>
 
-/* Temporary */
-#pragma GCC diagnostic ignored "-Wunused-parameter"
+/* Size of the buffer used for callback sinks */
+#define PRINTF_BUFFER_SIZE 128
 
+/* Output state */
+typedef struct printf_output {
+	xvas_write_callback write;	// Sink (NULL when formatting straight into a string)
+	void * userData;			// Passed to the sink
+	char * buffer;				// Buffer (or the destination string)
+	size_t capacity;			// Size of the buffer
+	size_t length;				// Characters in the buffer
+	size_t written;				// Characters produced, including any that were dropped
+} printf_output_t;
 
+/* "00" to "99" */
+static const char printf_digitPairs[201] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
 
-#define OUT(c) do { callback(userData, (c)); written++; } while (0)
-static size_t print_dec(unsigned long long value, unsigned int width, int (*callback)(void*,char), void * userData, int fill_zero, int align_right, int precision) {
-	size_t written = 0;
-	unsigned long long n_width = 1;
-	unsigned long long i = 9;
-	if (precision == -1) precision = 1;
+/**
+ * @brief Hand the buffer to the sink
+ */
+static void printf_flush(printf_output_t * out) {
+	if (!out->write) return;
+	if (out->length) out->write(out->userData, out->buffer, out->length);
+	out->length = 0;
+}
 
-	if (value == 0) {
-		n_width = 0;
-	} else {
-		unsigned long long val = value;
-		while (val >= 10UL) {
-			val /= 10UL;
-			n_width++;
-		}
+/**
+ * @brief Output a character
+ */
+static inline void printf_putc(printf_output_t * out, char c) {
+	out->written++;
+	if (out->length == out->capacity) {
+		if (!out->write) return; // String is full
+		printf_flush(out);
 	}
+	out->buffer[out->length++] = c;
+}
 
-	if (n_width < (unsigned long long)precision) n_width = precision;
-
-	int printed = 0;
-	if (align_right) {
-		while (n_width + printed < width) {
-			OUT(fill_zero ? '0' : ' ');
-			printed += 1;
-		}
-
-		i = n_width;
-		char tmp[100];
-		while (i > 0) {
-			unsigned long long n = value / 10;
-			long long r = value % 10;
-			tmp[i - 1] = r + '0';
-			i--;
-			value = n;
-		}
-		while (i < n_width) {
-			OUT(tmp[i]);
-			i++;
-		}
-	} else {
-		i = n_width;
-		char tmp[100];
-		while (i > 0) {
-			unsigned long long n = value / 10;
-			long long r = value % 10;
-			tmp[i - 1] = r + '0';
-			i--;
-			value = n;
-			printed++;
-		}
-		while (i < n_width) {
-			OUT(tmp[i]);
-			i++;
-		}
-		while (printed < (long long)width) {
-			OUT(fill_zero ? '0' : ' ');
-			printed += 1;
+/**
+ * @brief Output a run of characters
+ */
+static void printf_write(printf_output_t * out, const char * s, size_t n) {
+	out->written += n;
+	if (out->length + n > out->capacity) {
+		if (!out->write) {
+			// Truncate to what still fits in the string
+			n = out->capacity - out->length;
+		} else {
+			printf_flush(out);
+			if (n >= out->capacity) {
+				// Too big to bother buffering
+				out->write(out->userData, s, n);
+				return;
+			}
 		}
 	}
 
-	return written;
+	memcpy(out->buffer + out->length, s, n);
+	out->length += n;
 }
 
-/*
- * Hexadecimal to string
+/**
+ * @brief Output a character n times
  */
-static size_t print_hex(unsigned long long value, unsigned int width, int (*callback)(void*,char), void* userData, int fill_zero, int alt, int caps, int align) {
-	size_t written = 0;
-	long long i = width;
-
-	unsigned long long n_width = 1;
-	unsigned long long j = 0x0F;
-	while (value > j && j < UINT64_MAX) {
-		n_width += 1;
-		j *= 0x10;
-		j += 0x0F;
-	}
+static void printf_pad(printf_output_t * out, char c, long long n) {
+	while (n-- > 0) printf_putc(out, c);
+}
 
-	if (!fill_zero && align == 1) {
-		while (i > (long long)n_width + 2*!!alt) {
-			OUT(' ');
-			i--;
-		}
+/**
+ * @brief Convert to decimal, two digits at a time
+ * @param value The value (not 0)
+ * @param end End of the digit buffer
+ * @returns The first digit
+ */
+static char * printf_decimal(unsigned long long value, char * end) {
+	char * p = end;
+
+	// 64-bit division is a libgcc call on 32-bit targets, stop using it as soon as possible
+	while (value > UINT32_MAX) {
+		unsigned int pair = (unsigned int)(value % 100);
+		value /= 100;
+		p -= 2;
+		p[0] = printf_digitPairs[pair * 2];
+		p[1] = printf_digitPairs[pair * 2 + 1];
 	}
 
-	if (alt) {
-		OUT('0');
-		OUT(caps ? 'X' : 'x');
+	uint32_t v = (uint32_t)value;
+	while (v >= 100) {
+		uint32_t pair = v % 100;
+		v /= 100;
+		p -= 2;
+		p[0] = printf_digitPairs[pair * 2];
+		p[1] = printf_digitPairs[pair * 2 + 1];
 	}
 
-	if (fill_zero && align == 1) {
-		while (i > (long long)n_width + 2*!!alt) {
-			OUT('0');
-			i--;
-		}
+	if (v >= 10) {
+		p -= 2;
+		p[0] = printf_digitPairs[v * 2];
+		p[1] = printf_digitPairs[v * 2 + 1];
+	} else if (v) {
+		*--p = '0' + v;
 	}
 
-	i = (long long)n_width;
-	while (i-- > 0) {
-		char c = (caps ? "0123456789ABCDEF" : "0123456789abcdef")[(value>>(i*4))&0xF];
-		OUT(c);
+	return p;
+}
+
+/*
+ * Decimal to string
+ */
+static void print_dec(printf_output_t * out, unsigned long long value, unsigned int width, int fill_zero, int align_right, int precision) {
+	char tmp[24];
+	char * end = tmp + sizeof(tmp);
+	char * digits = value ? printf_decimal(value, end) : end; // Zero has no digits, the precision adds them
+	long long count = end - digits;
+
+	if (precision == -1) precision = 1;
+	long long n_width = (count < precision) ? precision : count;
+
+	if (align_right) {
+		printf_pad(out, fill_zero ? '0' : ' ', (long long)width - n_width);
+		printf_pad(out, '0', n_width - count);
+		printf_write(out, digits, count);
+	} else {
+		printf_pad(out, '0', n_width - count);
+		printf_write(out, digits, count);
+		printf_pad(out, fill_zero ? '0' : ' ', (long long)width - n_width);
 	}
+}
 
-	if (align == 0) {
-		i = width;
-		while (i > (long long)n_width + 2*!!alt) {
-			OUT(' ');
-			i--;
-		}
+/*
+ * Hexadecimal to string
+ */
+static void print_hex(printf_output_t * out, unsigned long long value, unsigned int width, int fill_zero, int alt, int caps, int align) {
+	const char * hex = caps ? "0123456789ABCDEF" : "0123456789abcdef";
+	char tmp[16];
+	int n_width = 0;
+	do {
+		tmp[15 - n_width++] = hex[value & 0xF];
+		value >>= 4;
+	} while (value);
+
+	long long padding = (long long)width - n_width - 2*!!alt;
+
+	if (!fill_zero && align == 1) printf_pad(out, ' ', padding);
+
+	if (alt) {
+		printf_putc(out, '0');
+		printf_putc(out, caps ? 'X' : 'x');
 	}
 
-	return written;
+	if (fill_zero && align == 1) printf_pad(out, '0', padding);
+
+	printf_write(out, tmp + 16 - n_width, n_width);
+
+	if (align == 0) printf_pad(out, ' ', padding);
 }
 
 /*
- * vasprintf()
+ * The formatter
  */
-size_t xvasprintf(int (*callback)(void *, char), void * userData, const char * fmt, va_list args) {
+static void printf_format(printf_output_t * out, const char * fmt, va_list args) {
 	const char * s;
-	size_t written = 0;
 	for (const char *f = fmt; *f; f++) {
 		if (*f != '%') {
-			OUT(*f);
+			// Copy everything up to the next conversion at once
+			const char * start = f;
+			while (f[1] && f[1] != '%') f++;
+			printf_write(out, start, f - start + 1);
 			continue;
 		}
 		++f;
@@ -221,41 +262,35 @@ size_t xvasprintf(int (*callback)(void *, char), void * userData, const char * f
 				   sizeof(ptrdiff_t) == sizeof(unsigned long) ? 1 : 0);
 			++f;
 		}
+		/* A lone '%' at the end */
+		if (!*f) break;
 		/* fmt[i] == '%' */
 		switch (*f) {
 			case 's': /* String pointer -> String */
 				{
+					if (big) return;
+					s = (char *)va_arg(args, char *);
+					if (s == NULL) {
+						s = "(null)";
+					}
+
+					// Stop at the precision or the width, whichever comes first
+					size_t limit = (precision >= 0) ? (size_t)precision : SIZE_MAX;
+					if (arg_width && arg_width < limit) limit = arg_width;
+
 					size_t count = 0;
-					if (big) {
-						return written;
+					if (limit == SIZE_MAX) {
+						count = strlen(s);
 					} else {
-						s = (char *)va_arg(args, char *);
-						if (s == NULL) {
-							s = "(null)";
-						}
-						if (precision >= 0) {
-							while (*s && precision > 0) {
-								OUT(*s++);
-								count++;
-								precision--;
-								if (arg_width && count == arg_width) break;
-							}
-						} else {
-							while (*s) {
-								OUT(*s++);
-								count++;
-								if (arg_width && count == arg_width) break;
-							}
-						}
-					}
-					while (count < arg_width) {
-						OUT(' ');
-						count++;
+						while (count < limit && s[count]) count++;
 					}
+
+					printf_write(out, s, count);
+					printf_pad(out, ' ', (long long)arg_width - (long long)count);
 				}
 				break;
 			case 'c': /* Single character */
-				OUT((char)va_arg(args,int));
+				printf_putc(out, (char)va_arg(args,int));
 				break;
 			case 'p':
 				alt = 1;
@@ -272,7 +307,7 @@ size_t xvasprintf(int (*callback)(void *, char), void * userData, const char * f
 					} else {
 						val = (unsigned int)va_arg(args, unsigned int);
 					}
-					written += print_hex(val, arg_width, callback, userData, fill_zero, alt, !(*f & 32), align);
+					print_hex(out, val, arg_width, fill_zero, alt, !(*f & 32), align);
 				}
 				break;
 			case 'i':
@@ -286,13 +321,14 @@ size_t xvasprintf(int (*callback)(void *, char), void * userData, const char * f
 					} else {
 						val = (int)va_arg(args, int);
 					}
+					unsigned long long magnitude = (unsigned long long)val;
 					if (val < 0) {
-						OUT('-');
-						val = -val;
+						printf_putc(out, '-');
+						magnitude = 0ULL - magnitude;
 					} else if (always_sign) {
-						OUT(always_sign == 2 ? ' ' : '+');
+						printf_putc(out, always_sign == 2 ? ' ' : '+');
 					}
-					written += print_dec(val, arg_width, callback, userData, fill_zero, align, precision);
+					print_dec(out, magnitude, arg_width, fill_zero, align, precision);
 				}
 				break;
 			case 'u': /* Unsigned ecimal number */
@@ -305,9 +341,11 @@ size_t xvasprintf(int (*callback)(void *, char), void * userData, const char * f
 					} else {
 						val = (unsigned int)va_arg(args, unsigned int);
 					}
-					written += print_dec(val, arg_width, callback, userData, fill_zero, align, precision);
+					print_dec(out, val, arg_width, fill_zero, align, precision);
 				}
 				break;
+#ifndef __NO_FLOAT
+			// Kernel builds leave this out, they have no floating point (see arch/x86_64/make.config)
 			case 'G':
 			case 'F':
 			case 'g':
@@ -327,19 +365,15 @@ size_t xvasprintf(int (*callback)(void *, char), void * userData, const char * f
 
 					if (exponent == 0x7ff) {
 						if (!fraction) {
-							if (SIGNBIT(asBits)) OUT('-');
-							OUT('i');
-							OUT('n');
-							OUT('f');
+							if (SIGNBIT(asBits)) printf_putc(out, '-');
+							printf_write(out, "inf", 3);
 						} else {
-							OUT('n');
-							OUT('a');
-							OUT('n');
+							printf_write(out, "nan", 3);
 						}
 						break;
 					} else if ((*f == 'g' || *f == 'G') && exponent == 0 && fraction == 0) {
-						if (SIGNBIT(asBits)) OUT('-');
-						OUT('0');
+						if (SIGNBIT(asBits)) printf_putc(out, '-');
+						printf_putc(out, '0');
 						break;
 					}
 
@@ -347,95 +381,98 @@ size_t xvasprintf(int (*callback)(void *, char), void * userData, const char * f
 
 					int isNegative = !!SIGNBIT(asBits);
 					if (isNegative) {
-						OUT('-');
+						printf_putc(out, '-');
 						val = -val;
 					}
 
-					written += print_dec((unsigned long long)val, arg_width, callback, userData, fill_zero, align, 1);
-					OUT('.');
+					print_dec(out, (unsigned long long)val, arg_width, fill_zero, align, 1);
+					printf_putc(out, '.');
 					for (int j = 0; j < ((precision > -1 && precision < 16) ? precision : 16); ++j) {
 						if ((unsigned long long)(val * 100000.0) % 100000 == 0 && j != 0) break;
 						val = val - (unsigned long long)val;
 						val *= 10.0;
 						double roundy = ((double)(val - (unsigned long long)val) - 0.99999);
 						if (roundy < 0.00001 && roundy > -0.00001 && ((unsigned long long)(val) % 10) != 9) {
-							written += print_dec((unsigned long long)(val) % 10 + 1, 0, callback, userData, 0, 0, 1);
+							printf_putc(out, '0' + (unsigned long long)(val) % 10 + 1);
 							break;
 						}
-						written += print_dec((unsigned long long)(val) % 10, 0, callback, userData, 0, 0, 1);
+						printf_putc(out, '0' + (unsigned long long)(val) % 10);
 					}
 				}
 				break;
+#endif
 			case '%': /* Escape */
-				OUT('%');
+				printf_putc(out, '%');
 				break;
 			default: /* Nothing at all, just dump it */
-				OUT(*f);
+				printf_putc(out, *f);
 				break;
 		}
 	}
-	return written;
 }
 
-struct CBData {
-	char * str;
-	size_t size;
-	size_t written;
+/*
+ * vasprintf() with a write(buffer, length) sink
+ */
+size_t xvasprintf_write(xvas_write_callback write, void * userData, const char * fmt, va_list args) {
+	char buffer[PRINTF_BUFFER_SIZE];
+	printf_output_t out = { .write = write, .userData = userData, .buffer = buffer, .capacity = PRINTF_BUFFER_SIZE, .length = 0, .written = 0 };
+	printf_format(&out, fmt, args);
+	printf_flush(&out);
+	return out.written;
+}
+
+/* Per-character sink adapter */
+struct CBChar {
+	xvas_callback callback;
+	void * userData;
 };
 
-static int cb_sprintf(void * user, char c) {
-	struct CBData * data = user;
-	if (data->size > data->written + 1) {
-		data->str[data->written] = c;
-		data->written++;
-		if (data->written < data->size) {
-			data->str[data->written] = '\0';
-		}
-	}
+static int cb_char(void * user, const char * buffer, size_t length) {
+	struct CBChar * data = user;
+	for (size_t i = 0; i < length; i++) data->callback(data->userData, buffer[i]);
 	return 0;
 }
 
+/*
+ * vasprintf() with a per-character sink
+ */
+size_t xvasprintf(xvas_callback callback, void * userData, const char * fmt, va_list args) {
+	struct CBChar data = { callback, userData };
+	return xvasprintf_write(cb_char, &data, fmt, args);
+}
+
 int vsnprintf(char *str, size_t size, const char *format, va_list ap) {
-	struct CBData data = {str,size,0};
-	int out = xvasprintf(cb_sprintf, &data, format, ap);
-	cb_sprintf(&data, '\0');
-	return out;
+	printf_output_t out = { .write = NULL, .userData = NULL, .buffer = str, .capacity = size ? size - 1 : 0, .length = 0, .written = 0 };
+	printf_format(&out, format, ap);
+	if (size) str[out.length] = '\0';
+	return out.written;
 }
 
 int snprintf(char * str, size_t size, const char * format, ...) {
-	struct CBData data = {str,size,0};
 	va_list args;
 	va_start(args, format);
-	int out = xvasprintf(cb_sprintf, &data, format, args);
+	int out = vsnprintf(str, size, format, args);
 	va_end(args);
-	cb_sprintf(&data, '\0');
 	return out;
 }
 
-static int cb_sxprintf(void * user, char c) {
-	struct CBData * data = user;
-	data->str[data->written] = c;
-	data->written++;
-	return 0;
-}
-
-
 int sprintf(char * str, const char * format, ...) {
-	struct CBData data = {str,0,0};
+	printf_output_t out = { .write = NULL, .userData = NULL, .buffer = str, .capacity = SIZE_MAX / 2, .length = 0, .written = 0 };
 	va_list args;
 	va_start(args, format);
-	int out = xvasprintf(cb_sxprintf, &data, format, args);
+	printf_format(&out, format, args);
 	va_end(args);
-	cb_sxprintf(&data, '\0');
-	return out;
+	str[out.length] = '\0';
+	return out.written;
 }
 
-static int cb_printf(void * user, char c) {
+static int cb_printf(void * user, const char * buffer, size_t length) {
 #ifdef __LIBK
 	// Terminal printing!
 	// TODO: Replace with changeable thing?
-	extern int terminal_print(void *user, char c);
-	return terminal_print(user, c);
+	extern int terminal_write(void *user, const char *buffer, size_t length);
+	return terminal_write(user, buffer, length);
 #endif
 
 	return 0;
@@ -444,7 +481,14 @@ static int cb_printf(void * user, char c) {
 int printf(const char * fmt, ...) {
     va_list args;
 	va_start(args, fmt);
-	int out = xvasprintf(cb_printf, NULL, fmt, args);
+	int out = xvasprintf_write(cb_printf, NULL, fmt, args);
 	va_end(args);
+
+#ifdef __LIBK
+	// The terminal draws into a back buffer, push the output to the screen
+	extern void terminal_flush();
+	terminal_flush();
+#endif
+
 	return out;
 }
\ No newline at end of file
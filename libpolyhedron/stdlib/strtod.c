@@ -17,6 +17,9 @@
 #include <stdlib.h>
 #include <math.h>
 
+// Kernel builds have no floating point (see arch/x86_64/make.config)
+#ifndef __NO_FLOAT
+
 double strtod(const char *str, char **endptr) {
     // First discard any whitespace
     char *ptr = (char*)str;
@@ -82,4 +85,6 @@ double strtod(const char *str, char **endptr) {
     if (endptr) *endptr = ptr;
 
     return ((double)normal_part + decimal_part) * exponent;
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
@@ -19,7 +19,7 @@
 
 static int isvalid(int base, int ch) {
     if (tolower(ch) >= 'a' && tolower(ch) < 'a' + (base - 10)) return 1;
-    if (ch >= '0' && ch <= '9') return 1;
+    if (ch >= '0' && ch <= '9' && ch - '0' < base) return 1;
 
     return 0;
 }
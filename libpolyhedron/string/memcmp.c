@@ -13,15 +13,31 @@
 
 #include <string.h>
 
+/* Word type that may alias anything */
+typedef size_t __attribute__((__may_alias__)) memcmp_word_t;
+
+#define WS (sizeof(size_t))
+
+#ifndef MEMCMP_DEFINED
 
 int memcmp(const void* aptr, const void* bptr, size_t n) {
 	const unsigned char* a = (const unsigned char*) aptr;
 	const unsigned char* b = (const unsigned char*) bptr;
+
+	// Skip over equal words when both pointers can be aligned together, the bytes sort out the rest
+	if ((((uintptr_t)a ^ (uintptr_t)b) & (WS - 1)) == 0) {
+		for (; n && ((uintptr_t)a & (WS - 1)); n--, a++, b++) {
+			if (*a != *b) return (*a < *b) ? -1 : 1;
+		}
+
+		for (; n >= WS && *(const memcmp_word_t*)a == *(const memcmp_word_t*)b; n -= WS, a += WS, b += WS);
+	}
 	
-    for (size_t i = 0; i < n; i++) {
-		if (a[i] < b[i]) return -1;
-		else if (b[i] < a[i]) return 1;
+	for (; n; n--, a++, b++) {
+		if (*a != *b) return (*a < *b) ? -1 : 1;
 	}
 
 	return 0;
 }
+
+#endif
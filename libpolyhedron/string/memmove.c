@@ -13,19 +13,51 @@
 
 #include <string.h>
 
+/* Word type that may alias anything */
+typedef size_t __attribute__((__may_alias__)) memmove_word_t;
+
+#define WS (sizeof(size_t))
+
+#ifndef MEMMOVE_DEFINED
+
 void* memmove(void* destination_ptr, const void* source_ptr, size_t size) {
     unsigned char* destination = (unsigned char*)destination_ptr;
     const unsigned char* source = (const unsigned char*)source_ptr;
 
+    if (destination == source) return destination_ptr;
+
+    // Words can only be used when both pointers can be aligned together.
+    // They're then at least a word apart, so a word never overlaps itself.
+    int words = ((((uintptr_t)destination ^ (uintptr_t)source) & (WS - 1)) == 0);
+
     if (destination < source) {
         // Copy normally
-        for (size_t i = 0; i < size; i++) 
-            destination[i] = source[i];
+        if (words) {
+            for (; size && ((uintptr_t)destination & (WS - 1)); size--) *destination++ = *source++;
+            for (; size >= WS; size -= WS, destination += WS, source += WS) {
+                *(memmove_word_t*)destination = *(const memmove_word_t*)source;
+            }
+        }
+
+        for (; size; size--) *destination++ = *source++;
     } else {
-        // Copy in reverse (TODO: != 0 or > 0?)
-        for (size_t i = size; i != 0; i--) 
-            destination[i-1] = source[i - 1];
+        // Copy in reverse
+        destination += size;
+        source += size;
+
+        if (words) {
+            for (; size && ((uintptr_t)destination & (WS - 1)); size--) *--destination = *--source;
+            for (; size >= WS; size -= WS) {
+                destination -= WS;
+                source -= WS;
+                *(memmove_word_t*)destination = *(const memmove_word_t*)source;
+            }
+        }
+
+        for (; size; size--) *--destination = *--source;
     }
 
     return destination_ptr;
-}
\ No newline at end of file
+}
+
+#endif
@@ -13,16 +13,34 @@
 
 #include <string.h>
 
+/* Word type that may alias anything */
+typedef size_t __attribute__((__may_alias__)) memset_word_t;
 
 #ifndef MEMSET_DEFINED
 
 void* memset(void* destination_ptr, int value, size_t size) {
-    size_t i = 0;
-    for (; i < size; i++) {
-        ((char*)destination_ptr)[i] = value;
+    unsigned char *destination = (unsigned char*)destination_ptr;
+
+    // Bytes up to a word boundary, then a word at a time
+    for (; size && ((uintptr_t)destination & (sizeof(size_t) - 1)); size--) *destination++ = value;
+
+    memset_word_t word = ((size_t)-1 / 0xFF) * (unsigned char)value;
+    for (; size >= sizeof(size_t); size -= sizeof(size_t), destination += sizeof(size_t)) {
+        *(memset_word_t*)destination = word;
     }
+
+    for (; size; size--) *destination++ = value;
     
     return destination_ptr;
 }
 
-#endif
\ No newline at end of file
+#endif
+
+#ifndef MEMSET_NT_DEFINED
+
+/* No cache-bypassing stores here, it's just memset */
+void* memset_nt(void* destination_ptr, int value, size_t size) {
+    return memset(destination_ptr, value, size);
+}
+
+#endif
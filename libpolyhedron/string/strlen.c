@@ -12,10 +12,31 @@
  */
 
 #include <string.h>
+#include <limits.h>
+
+/* Word type that may alias anything */
+typedef size_t __attribute__((__may_alias__)) strlen_word_t;
+
+#define ALIGN (sizeof(size_t))
+#define ONES ((size_t)-1/UCHAR_MAX)
+#define HIGHS (ONES * (UCHAR_MAX/2+1))
+#define HASZERO(X) (((X)-ONES) & ~(X) & HIGHS)
+
+#ifndef STRLEN_DEFINED
 
 size_t strlen(const char *str) {
-    size_t length = 0;
-    while (*str++)
-        length++;
-    return length;
-}
\ No newline at end of file
+    const char *s = str;
+
+    // Aligned words never cross a page, so reading past the terminator is safe
+    for (; (uintptr_t)s % ALIGN; s++) {
+        if (!*s) return s - str;
+    }
+
+    const strlen_word_t *w = (const strlen_word_t*)s;
+    for (; !HASZERO(*w); w++);
+
+    for (s = (const char*)w; *s; s++);
+    return s - str;
+}
+
+#endif
@@ -23,7 +23,10 @@ time_t time(time_t *out) {
     return ptr.tv_sec;
 }
 
+// Kernel builds have no floating point (see arch/x86_64/make.config)
+#ifndef __NO_FLOAT
 double difftime(time_t a, time_t b) {
     return (double)(a - b);
 }
+#endif
 